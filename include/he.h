@@ -53,6 +53,16 @@
 #define HE_MAX_WIRE_MTU 1500
 #define HE_MAX_MTU 1350
 #define HE_MAX_MTU_STR "1350"
+/// Largest MTU path MTU discovery can raise a tunnel to: a HE_MAX_WIRE_MTU sized packet less the
+/// outside IPv4 and UDP headers, the Helium header and the D/TLS record overhead
+#define HE_MAX_PMTU 1416
+/// Largest jumbo inner MTU, the largest IPv4 packet there is. Larger packets are split across
+/// several records and put back together by the peer.
+#define HE_MAX_JUMBO_MTU 65535
+
+/** Stateless cookie sizes **/
+#define HE_COOKIE_SECRET_LENGTH 32
+#define HE_COOKIE_LENGTH 32
 
 /** Set Maximum and Minimum Minor Versions **/
 #define HE_WIRE_MINIMUM_PROTOCOL_MAJOR_VERSION 1
@@ -73,6 +83,31 @@
 #define HE_CONFIG_TEXT_FIELD_LENGTH 50
 /// Maximum size of an IPV4 String
 #define HE_MAX_IPV4_STRING_LENGTH 24
+/// Maximum size of a peer address that a stateless cookie can be bound to (fits a sockaddr_in6)
+#define HE_MAX_PEER_ADDRESS_LENGTH 28
+/// Size of the key used to seal exported connections
+#define HE_EXPORT_KEY_LENGTH 32
+/// Returned by he_timers_next_deadline() when no timers are pending
+#define HE_TIMERS_NO_DEADLINE UINT64_MAX
+/// Shortest prefix an address pool can be created with, i.e. at most 65533 clients
+#define HE_IP_POOL_MIN_PREFIX 16
+/// Longest prefix an address pool can be created with, enough for one client
+#define HE_IP_POOL_MAX_PREFIX 30
+/// Number of address bits each level of a route table consumes
+#define HE_ROUTE_TABLE_STRIDE 8
+#define HE_ROUTE_TABLE_NODE_SIZE (1 << HE_ROUTE_TABLE_STRIDE)
+
+/** virtio-net header values, as used by Linux TUN devices opened with IFF_VNET_HDR **/
+/// The checksum at csum_start + csum_offset still has to be completed
+#define HE_VIRTIO_NET_HDR_F_NEEDS_CSUM 1
+/// The checksum has already been verified
+#define HE_VIRTIO_NET_HDR_F_DATA_VALID 2
+/// Not a super-packet
+#define HE_VIRTIO_NET_HDR_GSO_NONE 0
+/// A TCP over IPv4 super-packet to be split into gso_size segments
+#define HE_VIRTIO_NET_HDR_GSO_TCPV4 1
+/// Set along with the GSO type when the segments carry ECN
+#define HE_VIRTIO_NET_HDR_GSO_ECN 0x80
 
 /**
  * @brief All possible return codes for helium
@@ -187,6 +222,29 @@ typedef enum he_return_code {
   HE_ERR_SSL_ERROR_NONFATAL = -51,
   /// Protocol version for connection changed after creation
   HE_ERR_INCORRECT_PROTOCOL_VERSION = -52,
+  /**
+   * @brief A HelloVerifyRequest carrying a stateless cookie has been written to the response
+   * buffer. It should be sent back to the peer and no connection should be created.
+   */
+  HE_WANT_COOKIE = -53,
+  /// The server is at its handshake limit, the handshake should be dropped and retried later
+  HE_ERR_HANDSHAKE_THROTTLED = -54,
+  /// This build of Helium (or of WolfSSL) does not support the requested operation
+  HE_ERR_NOT_SUPPORTED = -55,
+  /// The export key has not been set
+  HE_ERR_CONF_EXPORT_KEY_NOT_SET = -56,
+  /// Every address in the address pool has been handed out
+  HE_ERR_IP_POOL_EXHAUSTED = -57,
+  /// The route is not a valid IPv4 prefix in CIDR notation
+  HE_ERR_INVALID_ROUTE = -58,
+  /// The packet matched a bypass route and should be sent outside the tunnel by the host
+  HE_ERR_PACKET_BYPASSED = -59,
+  /// Every thread slot of the plugin chain is taken
+  HE_ERR_TOO_MANY_THREADS = -60,
+  /// The plugin is not registered on the chain
+  HE_ERR_PLUGIN_NOT_REGISTERED = -61,
+  /// The address is already in use by another connection from the pool
+  HE_ERR_IP_POOL_ADDRESS_TAKEN = -62,
 } he_return_code_t;
 
 /**
@@ -214,7 +272,8 @@ typedef enum he_client_state {
 typedef enum he_client_event {
   /// First packet / message was passed to Helium (i.e. a server response)
   HE_EVENT_FIRST_MESSAGE_RECEIVED = 1,
-  /// Server replied to a PING request (NAT Keepalive)
+  /// Server replied to a PING request (NAT Keepalive). he_conn_get_rtt() and he_conn_get_jitter()
+  /// include the new measurement when this fires.
   HE_EVENT_PONG = 2,
   /// Client tried to send fragmented packets which were rejected as they are not supported by
   /// Helium
@@ -225,6 +284,9 @@ typedef enum he_client_event {
   HE_EVENT_SECURE_RENEGOTIATION_COMPLETED = 5,
   /// Pending Session Acknowledged
   HE_EVENT_PENDING_SESSION_ACKNOWLEDGED = 6,
+  /// Path MTU discovery on either end changed the MTU of the tunnel, see
+  /// he_conn_get_effective_mtu()
+  HE_EVENT_PMTU_UPDATED = 7,
 } he_client_event_t;
 
 /**
@@ -250,10 +312,124 @@ typedef enum he_connection_type {
   HE_CONNECTION_TYPE_STREAM = 1
 } he_connection_type_t;
 
+/**
+ * @brief Reasons a packet that came through the tunnel was dropped before reaching the inside
+ * @see he_conn_get_inside_drops
+ */
+typedef enum he_inside_drop_reason {
+  /// Not dropped
+  HE_INSIDE_DROP_NONE = 0,
+  /// Not an IPv4 packet
+  HE_INSIDE_DROP_NOT_IPV4 = 1,
+  /// The header length is less than 20 bytes or longer than the packet
+  HE_INSIDE_DROP_BAD_HEADER_LENGTH = 2,
+  /// The total length is shorter than the header or longer than the packet
+  HE_INSIDE_DROP_BAD_TOTAL_LENGTH = 3,
+  /// The header checksum is wrong
+  HE_INSIDE_DROP_BAD_CHECKSUM = 4,
+  /// The source address isn't the one the client was given (server only)
+  HE_INSIDE_DROP_SPOOFED_SOURCE = 5,
+  /// Number of reasons, not a reason itself
+  HE_INSIDE_DROP_REASON_COUNT = 6
+} he_inside_drop_reason_t;
+
+/// Return codes he_conn_stats_t can count drops for, from HE_SUCCESS down to -63
+#define HE_CONN_STATS_MAX_DROP_REASONS 64
+
+/**
+ * @brief Traffic and error counters of a connection
+ * @see he_conn_get_stats
+ *
+ * The inside is the host's end of the tunnel (i.e. a TUN device), the outside is the network.
+ */
+typedef struct he_conn_stats {
+  /// Packets and bytes from the inside sent through the tunnel
+  uint64_t inside_rx_packets;
+  uint64_t inside_rx_bytes;
+  /// Packets and bytes from the tunnel written to the inside
+  uint64_t inside_tx_packets;
+  uint64_t inside_tx_bytes;
+  /// Datagrams (or stream reads) and bytes passed to he_conn_outside_data_received()
+  uint64_t outside_rx_packets;
+  uint64_t outside_rx_bytes;
+  /// Datagrams (or stream writes) and bytes written to the outside, handshakes included
+  uint64_t outside_tx_packets;
+  uint64_t outside_tx_bytes;
+  /// Packets and outside data that were dropped, by the he_return_code_t saying why, i.e. the
+  /// drops for HE_ERR_PACKET_TOO_LARGE are drops[-HE_ERR_PACKET_TOO_LARGE]
+  uint64_t drops[HE_CONN_STATS_MAX_DROP_REASONS];
+  /// Drops whose reason the connection had no room left to keep
+  uint64_t other_drops;
+  /// Packets from the tunnel that failed validation, by he_inside_drop_reason_t
+  uint64_t inside_drops[HE_INSIDE_DROP_REASON_COUNT];
+  /// Records from the peer that failed to decrypt or authenticate
+  uint64_t decrypt_failures;
+  /// Records from the peer that were replayed or out of sequence
+  uint64_t replays;
+  /// D/TLS renegotiations completed
+  uint64_t renegotiations;
+  /// Session ID rotations the client acknowledged (server) or the server made (client)
+  uint64_t session_rotations;
+} he_conn_stats_t;
+
+/// Number of he_client_state_t values he_metrics_t counts connections for
+#define HE_METRICS_STATE_COUNT 9
+/// Return codes he_metrics_t counts handshake failures for, from HE_SUCCESS down to -63
+#define HE_METRICS_MAX_ERROR_CODES 64
+
+/**
+ * @brief Totals across every connection of an SSL context
+ * @see he_ssl_ctx_get_metrics
+ * @see he_metrics_render
+ */
+typedef struct he_metrics {
+  /// Connections that currently exist, by he_client_state_t
+  uint64_t connections[HE_METRICS_STATE_COUNT];
+  /// Handshakes started, and those that got as far as HE_STATE_LINK_UP
+  uint64_t handshakes_started;
+  uint64_t handshakes_completed;
+  /// Handshakes that failed, by the he_return_code_t they failed with as in he_conn_stats_t. Those
+  /// turned away by he_ssl_ctx_admit_handshake() count as HE_ERR_HANDSHAKE_THROTTLED.
+  uint64_t handshake_failures[HE_METRICS_MAX_ERROR_CODES];
+  /// Logins the auth callback accepted and rejected (server only)
+  uint64_t auth_successes;
+  uint64_t auth_failures;
+  /// Totals of the he_conn_stats_t counters of the same names
+  uint64_t inside_rx_packets;
+  uint64_t inside_rx_bytes;
+  uint64_t inside_tx_packets;
+  uint64_t inside_tx_bytes;
+  uint64_t outside_rx_packets;
+  uint64_t outside_rx_bytes;
+  uint64_t outside_tx_packets;
+  uint64_t outside_tx_bytes;
+  /// Bytes of padding added to data messages, see he_ssl_ctx_set_padding_type()
+  uint64_t padding_bytes;
+  /// Packets dropped by plugins in either direction
+  uint64_t plugin_drops;
+} he_metrics_t;
+
+/**
+ * @brief Where a client should send a packet from the inside
+ * @see he_route_table_lookup
+ */
+typedef enum he_route_verdict {
+  /// Send the packet through the tunnel
+  HE_ROUTE_TUNNEL = 1,
+  /// Send the packet directly, bypassing the tunnel (e.g. LAN traffic or excluded ranges)
+  HE_ROUTE_BYPASS = 2
+} he_route_verdict_t;
+
 typedef struct he_ssl_ctx he_ssl_ctx_t;
 typedef struct he_conn he_conn_t;
 typedef struct he_plugin_chain he_plugin_chain_t;
 typedef struct he_network_config_ipv4 he_network_config_ipv4_t;
+typedef struct he_virtio_net_hdr he_virtio_net_hdr_t;
+typedef struct he_flow_info he_flow_info_t;
+typedef struct he_snapshot_store he_snapshot_store_t;
+typedef struct he_timers he_timers_t;
+typedef struct he_ip_pool he_ip_pool_t;
+typedef struct he_route_table he_route_table_t;
 
 typedef void *(*he_malloc_t)(size_t size);
 typedef void *(*he_calloc_t)(size_t nmemb, size_t size);
@@ -286,6 +462,43 @@ typedef he_return_code_t (*he_state_change_cb_t)(he_conn_t *conn, he_client_stat
 typedef he_return_code_t (*he_inside_write_cb_t)(he_conn_t *conn, uint8_t *packet, size_t length,
                                                  void *context);
 
+/**
+ * @brief The prototype for the inside write callback function used with GRO
+ * @param client A pointer to the client context that triggered the callback
+ * @param vnet_hdr The virtio-net header to write in front of the packet
+ * @param flow The packet's 5-tuple and flow hash, as for the inside write flow callback
+ * @param packet A pointer to the packet data
+ * @param length The length of the entire packet in bytes
+ * @param context A pointer to the user defined context
+ * @see he_ssl_ctx_set_inside_write_gro_cb Sets this callback
+ *
+ * Used instead of the inside write callback when set, for TUN devices that take a virtio-net
+ * header with every packet. Consecutive segments of a TCP flow received together are merged into
+ * a single super-packet, which the header describes. The flow is worked out once per packet
+ * written, so a super-packet costs no more to classify than one of its segments.
+ */
+typedef he_return_code_t (*he_inside_write_gro_cb_t)(he_conn_t *conn,
+                                                     const he_virtio_net_hdr_t *vnet_hdr,
+                                                     const he_flow_info_t *flow, uint8_t *packet,
+                                                     size_t length, void *context);
+
+/**
+ * @brief The prototype for the inside write callback function that also gets the packet's flow
+ * @param client A pointer to the client context that triggered the callback
+ * @param flow The packet's 5-tuple and flow hash
+ * @param packet A pointer to the packet data
+ * @param length The length of the entire packet in bytes
+ * @param context A pointer to the user defined context
+ * @see he_ssl_ctx_set_inside_write_flow_cb Sets this callback
+ *
+ * Used instead of the inside write callback when set, so hosts writing to a multiqueue tun device
+ * or handing packets to several workers can pick one by the flow hash without parsing the packet
+ * again. Packets of the same flow always have the same hash.
+ */
+typedef he_return_code_t (*he_inside_write_flow_cb_t)(he_conn_t *conn, const he_flow_info_t *flow,
+                                                      uint8_t *packet, size_t length,
+                                                      void *context);
+
 /**
  * @brief The prototype for the outside write callback function
  * @param client AA pointer to the client context that triggered the callback
@@ -375,6 +588,34 @@ typedef he_return_code_t (*he_populate_network_config_ipv4_cb_t)(he_conn_t *conn
                                                                  he_network_config_ipv4_t *config,
                                                                  void *context);
 
+/**
+ * @brief The prototype for the handoff callback
+ * @param conn A pointer to the connection that has finished its handshake
+ * @param context A pointer to the user defined context
+ * @see he_conn_set_context Sets the value of the context pointer
+ *
+ * Called once per server connection, after it has reached HE_STATE_ONLINE and the call that got
+ * it there has completely finished with it. Helium holds no references to the connection at this
+ * point, so the host may move it (and its D/TLS state, which lives inside it) to another thread.
+ */
+typedef he_return_code_t (*he_handoff_cb_t)(he_conn_t *conn, void *context);
+
+/**
+ * @brief The prototype for the callback that confirms a new handshake comes from a returning client
+ * @param ctx A pointer to the SSL context the handshake is for
+ * @param session The Helium session ID from the wire header, or 0 when asking about a D/TLS session
+ * @param tls_session_id The D/TLS session ID from the ClientHello, or NULL when asking about a
+ *        Helium session
+ * @param tls_session_id_length The length of the D/TLS session ID
+ * @return true if the host knows the Helium session, or still has the D/TLS session cached
+ *
+ * Both IDs are set by the client and are not authenticated at this point, anyone can put any
+ * value in them. Only the host can tell whether they belong to a client it has served.
+ */
+typedef bool (*he_returning_client_cb_t)(he_ssl_ctx_t *ctx, uint64_t session,
+                                         const uint8_t *tls_session_id,
+                                         size_t tls_session_id_length);
+
 /** End Public Section **/
 
 typedef struct he_packet_buffer {
@@ -394,6 +635,145 @@ typedef struct he_version_info {
   uint8_t minor_version;
 } he_version_info_t;
 
+typedef enum he_pmtud_state {
+  /// Path MTU discovery hasn't been started
+  HE_PMTUD_DISABLED = 0,
+  /// Probing for the largest MTU that gets through
+  HE_PMTUD_SEARCHING = 1,
+  /// Done until it's time to look for a larger MTU again
+  HE_PMTUD_SEARCH_COMPLETE = 2,
+} he_pmtud_state_t;
+
+/// Different drop reasons a connection keeps counts for
+#define HE_CONN_DROP_SLOTS 8
+/// Low bits of a drop slot, holding the negated he_return_code_t the packets were dropped with
+#define HE_CONN_DROP_REASON_BITS 8
+#define HE_CONN_DROP_REASON(value) (-(int32_t)((value) & ((1u << HE_CONN_DROP_REASON_BITS) - 1)))
+#define HE_CONN_DROP_COUNT(value) ((value) >> HE_CONN_DROP_REASON_BITS)
+
+/**
+ * A drop reason and its count, packed into one word so either direction can claim a slot and
+ * count into it with atomic operations. Zero while the slot is free.
+ */
+typedef struct he_conn_drop_count {
+  volatile uint64_t value;
+} he_conn_drop_count_t;
+
+/**
+ * @brief Counters kept by every connection, see he_conn_get_stats()
+ *
+ * Hosts may receive on one thread and send on another, so the counters each direction writes are
+ * at either end with more than a cache line between them.
+ */
+typedef struct he_conn_counters {
+  /// Written while receiving from the outside
+  uint64_t outside_rx_packets;
+  uint64_t outside_rx_bytes;
+  uint64_t inside_tx_packets;
+  uint64_t inside_tx_bytes;
+  uint64_t decrypt_failures;
+  uint64_t replays;
+  uint32_t renegotiations;
+  uint32_t session_rotations;
+  /// Written in either direction, but only when something goes wrong
+  he_conn_drop_count_t drops[HE_CONN_DROP_SLOTS];
+  volatile uint64_t other_drops;
+  /// Written while sending to the outside
+  uint64_t inside_rx_packets;
+  uint64_t inside_rx_bytes;
+  uint64_t outside_tx_packets;
+  uint64_t outside_tx_bytes;
+} he_conn_counters_t;
+
+/// Context counters that aren't kept per state or return code, see he_metrics_t
+typedef enum he_metric {
+  HE_METRIC_HANDSHAKES_STARTED = 0,
+  HE_METRIC_HANDSHAKES_COMPLETED,
+  HE_METRIC_AUTH_SUCCESSES,
+  HE_METRIC_AUTH_FAILURES,
+  /// Each packet counter is followed by its byte counter
+  HE_METRIC_INSIDE_RX_PACKETS,
+  HE_METRIC_INSIDE_RX_BYTES,
+  HE_METRIC_INSIDE_TX_PACKETS,
+  HE_METRIC_INSIDE_TX_BYTES,
+  HE_METRIC_OUTSIDE_RX_PACKETS,
+  HE_METRIC_OUTSIDE_RX_BYTES,
+  HE_METRIC_OUTSIDE_TX_PACKETS,
+  HE_METRIC_OUTSIDE_TX_BYTES,
+  HE_METRIC_PADDING_BYTES,
+  HE_METRIC_PLUGIN_DROPS,
+  /// Number of counters, not a counter itself
+  HE_METRIC_COUNT
+} he_metric_t;
+
+/// Sets of context counters that threads are spread over
+#define HE_METRICS_SHARDS 8
+
+/**
+ * @brief The context counters updated by some of the threads
+ *
+ * Connections are counted into a state on one shard and out of it on whichever shard the thread
+ * that moves them on has, so the per-state counts only make sense summed over every shard.
+ */
+typedef struct he_metrics_shard {
+  volatile uint64_t counters[HE_METRIC_COUNT];
+  volatile uint64_t connections[HE_METRICS_STATE_COUNT];
+  volatile uint64_t handshake_failures[HE_METRICS_MAX_ERROR_CODES];
+  /// Keeps the next shard off this one's last cache line
+  uint8_t padding[64];
+} he_metrics_shard_t;
+
+typedef struct he_ctx_metrics {
+  he_metrics_shard_t shards[HE_METRICS_SHARDS];
+} he_ctx_metrics_t;
+
+/**
+ * @brief A jumbo packet being put back together from its fragments
+ */
+typedef struct he_reassembly {
+  /// Buffer the size of the whole packet, NULL if this slot is free
+  uint8_t *buffer;
+  /// When the first fragment arrived
+  uint64_t started_ms;
+  /// Bit mask of the fragments received so far
+  uint64_t received;
+  uint16_t id;
+  uint16_t total_length;
+  /// Length of every fragment but the last, fixed by the first fragment to arrive
+  uint16_t chunk_length;
+  /// Bytes of the packet received so far
+  uint16_t received_length;
+  uint8_t count;
+} he_reassembly_t;
+
+/**
+ * @brief TCP segments being merged into a super-packet for the inside write GRO callback
+ */
+typedef struct he_gro {
+  /// Length of the super-packet so far, 0 when nothing is held
+  size_t length;
+  /// Length of the IPv4 and TCP headers
+  size_t header_length;
+  /// Payload size of the first segment, which all but the last must match
+  uint16_t gso_size;
+  uint16_t segments;
+  /// Sequence number the next segment has to start at to be merged
+  uint32_t next_seq;
+  /// Size of the buffer, enough for HE_GRO_MAX_SEGMENTS of the largest segments seen so far
+  size_t capacity;
+  uint8_t *buffer;
+} he_gro_t;
+
+/**
+ * @brief A timer that can be linked into a timer wheel, embedded in the structure it belongs to
+ */
+typedef struct he_timer_node {
+  struct he_timer_node *next;
+  struct he_timer_node *prev;
+  /// Absolute time in milliseconds at which the timer fires
+  uint64_t deadline;
+} he_timer_node_t;
+
 struct he_ssl_ctx {
   /// Server Distinguished Name
   char server_dn[HE_CONFIG_TEXT_FIELD_LENGTH + 1];
@@ -414,6 +794,10 @@ struct he_ssl_ctx {
   he_state_change_cb_t state_change_cb;
   /// Callback for writing to the inside (i.e. a TUN device)
   he_inside_write_cb_t inside_write_cb;
+  /// Callback for writing to the inside with a virtio-net header, used instead when set
+  he_inside_write_gro_cb_t inside_write_gro_cb;
+  /// Callback for writing to the inside along with the flow, used instead when set
+  he_inside_write_flow_cb_t inside_write_flow_cb;
   /// Callback for writing to the outside (i.e. a socket)
   he_outside_write_cb_t outside_write_cb;
   /// Network config callback
@@ -426,12 +810,53 @@ struct he_ssl_ctx {
   he_auth_cb_t auth_cb;
   // Callback for populating the network config (server-only)
   he_populate_network_config_ipv4_cb_t populate_network_config_ipv4_cb;
+  // Callback for handing established connections to another thread (server-only)
+  he_handoff_cb_t handoff_cb;
+  /// Timer wheel new connections schedule their nudges on, instead of calling nudge_time_cb
+  he_timers_t *timers;
+  /// Pool to give clients addresses from, NULL if the host does it in
+  /// populate_network_config_ipv4_cb
+  he_ip_pool_t *ip_pool;
   /// Don't send session ID in packet header
   bool disable_roaming_connections;
   /// Which padding type to use
   he_padding_type_t padding_type;
   /// Use aggressive mode
   bool use_aggressive_mode;
+  /// Answer new ClientHellos with a stateless cookie before a connection is created
+  bool use_stateless_cookies;
+  /// Rewrite the MSS of tunnelled TCP connections to fit the tunnel
+  bool clamp_mss;
+  /// Drop packets from clients that don't come from the address they were given
+  bool validate_source_address;
+  /// Room the host leaves around the buffers it passes to he_conn_outside_data_received()
+  size_t outside_headroom;
+  size_t outside_tailroom;
+  /// Jumbo inner MTU to offer, 0 if disabled
+  int inner_mtu;
+  /// Secret used to generate stateless cookies
+  uint8_t cookie_secret[HE_COOKIE_SECRET_LENGTH];
+  /// Previous cookie secret, still accepted until the next rotation
+  uint8_t previous_cookie_secret[HE_COOKIE_SECRET_LENGTH];
+  bool has_previous_cookie_secret;
+  /// Handshake admission interval in microseconds, zero when admission control is disabled
+  uint64_t handshake_interval_us;
+  /// How far ahead of schedule resumptions and roaming clients may run
+  uint64_t handshake_priority_tolerance_us;
+  /// How far ahead of schedule fresh full handshakes may run
+  uint64_t handshake_full_tolerance_us;
+  /// Theoretical arrival time of the next handshake -- shared between threads
+  volatile uint64_t handshake_tat_us;
+  /// Vouches for handshakes that claim to be resumptions or roaming clients
+  he_returning_client_cb_t returning_client_cb;
+  /// Key used to seal exported connections
+  uint8_t export_key[HE_EXPORT_KEY_LENGTH];
+  bool has_export_key;
+  /// How long connections must be idle before he_conn_hibernate_if_idle() hibernates them, 0 if
+  /// never
+  uint32_t hibernate_idle_ms;
+  /// Totals across the context's connections, shared between threads
+  he_ctx_metrics_t metrics;
 
   /// WolfSSL global context
   WOLFSSL_CTX *wolf_ctx;
@@ -460,8 +885,10 @@ struct he_conn {
   WOLFSSL *wolf_ssl;
   /// Wolf Timeout
   int wolf_timeout;
-  /// Write buffer
-  uint8_t write_buffer[HE_MAX_WIRE_MTU];
+  /// State plugins keep for this connection, one slot per stateful plugin on the chain
+  void *plugin_state[HE_PLUGIN_MAX_STATE_SLOTS];
+  /// Write buffer, with room on either side of the packet for egress plugins
+  uint8_t write_buffer[HE_PLUGIN_HEADROOM + HE_MAX_WIRE_MTU + HE_PLUGIN_TAILROOM];
   /// Packet seen
   bool packet_seen;
   /// Session ID
@@ -481,6 +908,88 @@ struct he_conn {
 
   /// Do we already have a timer running? If so, we don't want to generate new callbacks
   bool is_nudge_timer_running;
+  /// Timer wheel this connection's nudges are scheduled on, if any
+  he_timers_t *timers;
+  /// Node linking this connection into the timer wheel
+  he_timer_node_t timer_node;
+
+  /// Smoothed round trip time and its variation in milliseconds, 0 until the first sample
+  uint32_t srtt_ms;
+  uint32_t rttvar_ms;
+  /// Retransmission timeout derived from the round trip time (RFC 6298)
+  uint32_t rto_ms;
+  /// When the first packet of our current handshake flight was sent, 0 if none is outstanding
+  uint64_t flight_sent_ms;
+  /// How many times the current handshake flight has been retransmitted
+  uint8_t flight_retransmits;
+  /// Sequence number of the last PING sent
+  uint32_t ping_sequence;
+  /// Latest PING round trip time and its jitter (RFC 3550) in milliseconds
+  uint32_t ping_rtt_ms;
+  uint32_t jitter_ms;
+  /// How long the path must be idle before a keepalive is sent, 0 if disabled
+  uint32_t keepalive_interval_ms;
+  /// Records received from the peer
+  uint32_t rx_records;
+  /// When we last heard from the peer or sent a keepalive, as seen by the keepalive scheduler
+  uint64_t keepalive_last_rx_ms;
+  uint64_t keepalive_last_ping_ms;
+  /// The count of records received the keepalive scheduler last saw
+  uint32_t keepalive_rx_records;
+  /// Records received plus packets sent, and when that count last changed, as seen by
+  /// he_conn_hibernate_if_idle(). Kept to 32 bits to fit; idle times wrap after 49 days.
+  uint32_t hibernate_activity;
+  uint32_t hibernate_active_ms;
+
+  /// Inner MTU found by path MTU discovery, 0 until it has found one
+  uint16_t effective_mtu;
+  /// Inner MTU the peer's path MTU discovery found, 0 until it tells us one
+  uint16_t peer_mtu;
+  /// The effective MTU the peer has confirmed hearing, and how often it has been sent since
+  uint16_t pmtud_acked_mtu;
+  uint8_t pmtud_announce_count;
+  /// Path MTU discovery state, see he_conn_send_pmtu_probe_if_due()
+  he_pmtud_state_t pmtud_state;
+  /// Largest inner MTU confirmed to work (0 if none yet) and smallest found not to
+  uint16_t pmtud_low;
+  uint16_t pmtud_high;
+  /// Size and sequence number of the outstanding probe, the size is 0 if there isn't one
+  uint16_t pmtud_probe_size;
+  uint32_t pmtud_probe_sequence;
+  /// How many times in a row a probe of this size went unanswered
+  uint8_t pmtud_probe_count;
+  /// When the outstanding probe was sent, or when the last search completed
+  uint64_t pmtud_timer_ms;
+
+  /// Jumbo inner MTU, offered until the peer agrees to it and 0 if it doesn't
+  int inner_mtu;
+  /// Identifies the next packet split into fragments
+  uint16_t fragment_id;
+  /// Jumbo packets being reassembled, allocated when the first fragment arrives
+  he_reassembly_t *reassembly;
+
+  /// Address the client was given in its network config, in network byte order (server only)
+  uint32_t client_ip;
+  /// Route table deciding which inside packets bypass the tunnel, a he_route_table_t pointer
+  /// widened to 64 bits so it can be swapped atomically while packets are being sent
+  volatile uint64_t route_table;
+  /// Number of threads looking up a packet in the route table, see he_conn_set_route_table()
+  volatile uint64_t route_readers;
+  /// Address taken from ip_pool, to give back when the connection is destroyed, in host byte
+  /// order and 0 if there isn't one
+  uint32_t pool_address;
+  /// Packets from the tunnel dropped before reaching the inside, by he_inside_drop_reason_t
+  uint64_t inside_drops[HE_INSIDE_DROP_REASON_COUNT];
+  /// Traffic and error counters, see he_conn_get_stats()
+  he_conn_counters_t counters;
+  /// Counters of the SSL context the connection was created with, which it adds to as well
+  he_ctx_metrics_t *metrics;
+
+  /// Segments being merged for the inside write GRO callback, allocated on first use
+  he_gro_t *gro;
+  /// Set while he_conn_outside_data_received_batch() holds GRO flushes and the handoff back until
+  /// the whole batch has been processed
+  bool receiving_batch;
 
   he_plugin_chain_t *plugins;
 
@@ -500,6 +1009,13 @@ struct he_conn {
   he_padding_type_t padding_type;
   /// Use aggressive mode
   bool use_aggressive_mode;
+  /// Rewrite the MSS of tunnelled TCP connections to fit the tunnel
+  bool clamp_mss;
+  /// Drop packets from clients that don't come from the address they were given
+  bool validate_source_address;
+  /// Room the host leaves around the buffers it passes to he_conn_outside_data_received()
+  size_t outside_headroom;
+  size_t outside_tailroom;
   /// TCP or UDP?
   he_connection_type_t connection_type;
 
@@ -509,6 +1025,10 @@ struct he_conn {
   he_nudge_time_cb_t nudge_time_cb;
   /// Callback for writing to the inside (i.e. a TUN device)
   he_inside_write_cb_t inside_write_cb;
+  /// Callback for writing to the inside with a virtio-net header, used instead when set
+  he_inside_write_gro_cb_t inside_write_gro_cb;
+  /// Callback for writing to the inside along with the flow, used instead when set
+  he_inside_write_flow_cb_t inside_write_flow_cb;
   /// Callback for writing to the outside (i.e. a socket)
   he_outside_write_cb_t outside_write_cb;
   /// Network config callback
@@ -519,17 +1039,115 @@ struct he_conn {
   he_auth_cb_t auth_cb;
   // Callback for populating the network config (server-only)
   he_populate_network_config_ipv4_cb_t populate_network_config_ipv4_cb;
+  // Callback for handing established connections to another thread (server-only)
+  he_handoff_cb_t handoff_cb;
+  /// Pool to give the client an address from (server-only)
+  he_ip_pool_t *ip_pool;
+  /// Once destroyed, the next connection the pool is waiting to free and the epoch it was
+  /// destroyed in
+  he_conn_t *next_retired;
+  uint64_t retired_epoch;
+  /// Set when the connection went online and the handoff callback is due
+  bool handoff_pending;
+  /// Whether the stateless cookie was issued under the previous cookie secret (server only)
+  bool use_previous_cookie_secret;
+  /// Key used to seal exports of this connection, owned by the SSL context
+  const uint8_t *export_key;
+  /// Sealed state of a hibernating connection, NULL while the connection is awake
+  uint8_t *hibernated_state;
+  size_t hibernated_length;
+  /// SSL context to rebuild a hibernating connection with
+  he_ssl_ctx_t *hibernated_ctx;
 
   /// Connection version -- set on client side, accepted on server side
   he_version_info_t protocol_version;
 
+  /// Peer address that a stateless cookie was bound to (server only)
+  uint8_t peer_address[HE_MAX_PEER_ADDRESS_LENGTH];
+  size_t peer_address_length;
+
   /// Random number generator
   RNG wolf_rng;
 };
 
+/**
+ * @brief One direction of a registered plugin, copied out of its plugin_struct_t
+ *
+ */
+typedef struct he_plugin_hook {
+  he_plugin_return_code_t (*fn)(uint8_t *packet, size_t *length, size_t capacity, void *data);
+  he_plugin_return_code_t (*batch_fn)(he_plugin_packet_t *packets,
+                                      he_plugin_return_code_t *results, size_t count, void *data);
+  void *data;
+  /// The plugin the hook was registered from
+  const plugin_struct_t *owner;
+  /// The plugin's state slot on this chain, or -1 if it has none
+  int state_slot;
+} he_plugin_hook_t;
+
+/**
+ * @brief The registered plugins, flattened into one array per direction
+ *
+ * Only plugins that have a callback for a direction appear in its array, so walking the chain
+ * is a loop over contiguous hooks. A set of hooks never changes once it is in use; registering
+ * or unregistering a plugin builds a new one and swaps it in.
+ */
+typedef struct he_plugin_hooks {
+  /// Ingress hooks in registration order
+  he_plugin_hook_t *ingress;
+  size_t ingress_count;
+  /// Egress hooks in reverse registration order
+  he_plugin_hook_t *egress;
+  size_t egress_count;
+  /// Epoch the hooks were swapped out in, once they have been
+  uint64_t retired_epoch;
+  struct he_plugin_hooks *next_retired;
+} he_plugin_hooks_t;
+
+/// Most threads that can report quiescent states for one shared structure
+#define HE_GRACE_MAX_THREADS 64
+/// Thread epoch of a thread that isn't using the structure at the moment
+#define HE_GRACE_THREAD_OFFLINE UINT64_MAX
+
+/**
+ * @brief Tracks which threads may still hold memory that was swapped out of a shared structure
+ *
+ * Memory is retired in an epoch, and can be freed once every registered thread has reported a
+ * quiescent state in that epoch or a later one.
+ */
+typedef struct he_grace {
+  /// Bumped every time something is retired
+  volatile uint64_t epoch;
+  /// The epoch each registered thread was in at its last quiescent state
+  volatile uint64_t thread_epochs[HE_GRACE_MAX_THREADS];
+  volatile uint64_t thread_count;
+} he_grace_t;
+
+/// Most threads that can process packets for connections sharing one plugin chain
+#define HE_PLUGIN_MAX_THREADS HE_GRACE_MAX_THREADS
+/// Thread epoch of a thread that isn't using the chain at the moment
+#define HE_PLUGIN_THREAD_OFFLINE HE_GRACE_THREAD_OFFLINE
+
+/**
+ * @brief A plugin chain that can be changed while packets are going through it
+ *
+ * Packet processing loads the current hooks with a single atomic read and takes no locks. Hooks
+ * that are swapped out are kept until every registered thread has passed a quiescent state,
+ * i.e. reported that it holds no hooks it loaded before the swap.
+ */
 struct he_plugin_chain {
-  plugin_struct_t *plugin;
-  he_plugin_chain_t *next;
+  /// The current he_plugin_hooks_t, NULL if no plugins are registered
+  volatile uint64_t hooks;
+  /// Threads processing packets, and when swapped out hooks are safe to free
+  he_grace_t grace;
+  /// Held by whichever thread is changing the chain
+  volatile uint64_t writer;
+  /// Swapped out hooks that threads may still be using, newest first
+  he_plugin_hooks_t *retired;
+  /// Which plugin owns each per-connection state slot, and how its state is freed
+  const plugin_struct_t *state_owners[HE_PLUGIN_MAX_STATE_SLOTS];
+  plugin_free_state state_free[HE_PLUGIN_MAX_STATE_SLOTS];
+  void *state_data[HE_PLUGIN_MAX_STATE_SLOTS];
 };
 
 /**
@@ -542,6 +1160,84 @@ struct he_client {
   he_plugin_chain_t *plugins;
 };
 
+/// Timer wheel geometry: four levels of 64 slots with a 1ms tick cover about 4.6 hours
+#define HE_TIMERS_LEVELS 4
+#define HE_TIMERS_SLOT_BITS 6
+#define HE_TIMERS_SLOTS (1 << HE_TIMERS_SLOT_BITS)
+
+/**
+ * @brief A hierarchical timer wheel for scheduling connection nudges
+ *
+ */
+struct he_timers {
+  /// The next tick (in milliseconds) that has not been processed yet
+  uint64_t now;
+  /// Host's clock less Helium's monotonic clock, as of the last time the wheel was advanced
+  uint64_t clock_offset;
+  /// Number of timers in the wheel
+  size_t pending;
+  /// List heads for each slot of each level
+  he_timer_node_t slots[HE_TIMERS_LEVELS][HE_TIMERS_SLOTS];
+};
+
+/**
+ * @brief Tunnel addresses for servers to hand out to clients
+ *
+ * Free addresses are kept on a lock-free stack of slot indexes. The head packs a generation count
+ * in its top 32 bits with the index of the top slot plus one (0 when empty) in the bottom 32, so a
+ * pop that raced with a pop and push of the same slot fails its compare-and-swap.
+ *
+ * Connections are stored as pointers widened to 64 bits so they can use the same atomics.
+ */
+struct he_ip_pool {
+  /// Network address of the range, in host byte order
+  uint32_t network;
+  /// Number of addresses that can be handed out
+  uint32_t size;
+  volatile uint64_t head;
+  /// For each free slot, the index of the slot below it on the stack plus one
+  volatile uint64_t *next;
+  /// For each slot, the connection it was given to, for looking up egress packets, with the low
+  /// bit set while the slot is still on the free stack
+  volatile uint64_t *conns;
+  volatile uint64_t available;
+  /// Threads looking up connections, and when destroyed connections are safe to free
+  he_grace_t grace;
+  /// Held by whichever thread is changing the list of destroyed connections
+  volatile uint64_t writer;
+  /// Destroyed connections that lookup threads may still hold, newest first
+  he_conn_t *retired;
+};
+
+/**
+ * @brief Routes compiled for longest prefix matching
+ *
+ * A multibit trie that looks at 8 bits of the address per level, so a lookup is at most 4 memory
+ * accesses. Routes whose length isn't a multiple of 8 are expanded to cover every entry they span
+ * in a node, and an entry remembers the length of the route that set it so longer routes always
+ * win. Entries with HE_ROUTE_TABLE_CHILD set hold the index of the node for the next 8 bits,
+ * otherwise they hold the verdict in their low byte and the route length plus one in the next, or
+ * are 0 if no route covers them.
+ */
+struct he_route_table {
+  he_route_verdict_t default_verdict;
+  size_t node_count;
+  size_t node_capacity;
+  uint32_t (*nodes)[HE_ROUTE_TABLE_NODE_SIZE];
+};
+
+/**
+ * @brief Header at the start of a snapshot store, the slots follow it
+ *
+ */
+struct he_snapshot_store {
+  // 'H', 'e', 'S', 'S'
+  char magic[4];
+  uint32_t version;
+  uint32_t capacity;
+  uint32_t slot_size;
+};
+
 // MSG IDs
 typedef enum msg_ids {
   /// NOOP - nothing to do
@@ -568,6 +1264,10 @@ typedef enum msg_ids {
   HE_MSGID_SESSION_RESPONSE = 11,
   /// Tell the other side that we're closing down
   HE_MSGID_GOODBYE = 12,
+  /// Part of a data packet too large for a single message
+  HE_MSGID_DATA_FRAGMENT = 13,
+  /// Inner MTU found by path MTU discovery
+  HE_MSGID_MTU = 14,
 } msg_ids_t;
 
 typedef enum he_auth_type { HE_AUTH_TYPE_USERPASS = 1 } he_auth_type_t;
@@ -603,6 +1303,37 @@ typedef struct he_wire_hdr {
   uint64_t session;
 } he_wire_hdr_t;
 
+/**
+ * @brief The virtio-net header Linux TUN devices opened with IFF_VNET_HDR put in front of packets
+ * Fields are in host byte order.
+ */
+typedef struct he_virtio_net_hdr {
+  uint8_t flags;
+  uint8_t gso_type;
+  /// Length of the headers in front of the payload
+  uint16_t hdr_len;
+  /// Payload size of each segment of a super-packet
+  uint16_t gso_size;
+  /// Where checksumming starts from, and how far past that the checksum goes
+  uint16_t csum_start;
+  uint16_t csum_offset;
+} he_virtio_net_hdr_t;
+
+/**
+ * @brief The 5-tuple of an inside packet and its flow hash
+ * Addresses and ports are in host byte order. Ports are 0 for protocols without them, and for
+ * IPv4 fragments since only the first fragment has them.
+ */
+typedef struct he_flow_info {
+  /// Toeplitz hash of the addresses and ports with the standard RSS key, as NICs compute it
+  uint32_t hash;
+  uint32_t src_addr;
+  uint32_t dst_addr;
+  uint16_t src_port;
+  uint16_t dst_port;
+  uint8_t protocol;
+} he_flow_info_t;
+
 /** End Public Section **/
 
 typedef struct he_msg_hdr {
@@ -611,12 +1342,16 @@ typedef struct he_msg_hdr {
 
 typedef struct he_msg_ping {
   he_msg_hdr_t msg_header;
+  /// Sequence number, echoed back in the PONG
   uint32_t payload;
+  /// Sender's clock in milliseconds, echoed back in the PONG. Older peers don't send this.
+  uint32_t timestamp;
 } he_msg_ping_t;
 
 typedef struct he_msg_pong {
   he_msg_hdr_t msg_header;
   uint32_t payload;
+  uint32_t timestamp;
 } he_msg_pong_t;
 
 typedef struct he_msg_auth {
@@ -626,6 +1361,8 @@ typedef struct he_msg_auth {
   uint8_t password_length;
   char username[HE_CONFIG_TEXT_FIELD_LENGTH];
   char password[HE_CONFIG_TEXT_FIELD_LENGTH];
+  /// Jumbo inner MTU the client can take, 0 if none. Older clients don't send this.
+  uint16_t inner_mtu;
 } he_msg_auth_t;
 
 typedef struct he_msg_config_ipv4 {
@@ -642,6 +1379,29 @@ typedef struct he_msg_data {
   uint16_t length;
 } he_msg_data_t;
 
+typedef struct he_msg_mtu {
+  he_msg_hdr_t msg_header;
+  /// Inner MTU the sender's path MTU discovery found, 0 if it hasn't found one
+  uint16_t mtu;
+  /// The MTU the sender last heard from the receiver, so the receiver knows it arrived
+  uint16_t received_mtu;
+  /// Set on answers to an MTU message, which aren't answered themselves
+  uint8_t is_reply;
+} he_msg_mtu_t;
+
+typedef struct he_msg_data_fragment {
+  he_msg_hdr_t msg_header;
+  /// Length of the fragment that follows
+  uint16_t length;
+  /// Identifies the packet this is part of
+  uint16_t id;
+  /// Length of the whole packet
+  uint16_t total_length;
+  /// Position of this fragment and how many the packet was split into
+  uint8_t index;
+  uint8_t count;
+} he_msg_data_fragment_t;
+
 typedef struct he_msg_auth_response {
   he_msg_hdr_t msg_header;
   uint8_t status;
@@ -45,10 +45,65 @@ typedef he_plugin_return_code_t (*plugin_do_ingress)(uint8_t *packet, size_t *le
 typedef he_plugin_return_code_t (*plugin_do_egress)(uint8_t *packet, size_t *length,
                                                     size_t capacity, void *data);
 
+/// The most packets a batch callback is handed in one call
+#define HE_PLUGIN_MAX_BATCH 32
+
+/// Most plugins on a chain that can keep their own state for each connection
+#define HE_PLUGIN_MAX_STATE_SLOTS 8
+
+/// Bytes Helium leaves free in front of every packet it hands to egress plugins
+#define HE_PLUGIN_HEADROOM 64
+/// Bytes Helium leaves free after every packet it hands to egress plugins
+#define HE_PLUGIN_TAILROOM 64
+
+/**
+ * A packet and the free room around it. Everything from `data - headroom` up to
+ * `data + length + tailroom` can be written to, so a plugin can prepend n bytes in place with
+ * `data -= n; length += n; headroom -= n;` and append them with `length += n; tailroom -= n;`.
+ * Stripping bytes from either end works the same way in reverse.
+ *
+ * `state` points to the per-connection state slots of the connection the packet belongs to, or
+ * is NULL if it doesn't belong to one. `state_slot` is set by the chain before each callback to
+ * the slot the plugin being called has on that chain, or -1 if it has none.
+ */
+typedef struct he_plugin_packet {
+  uint8_t *data;
+  size_t length;
+  size_t headroom;
+  size_t tailroom;
+  void **state;
+  int state_slot;
+} he_plugin_packet_t;
+
+/**
+ * Batch variants of plugin_do_ingress and plugin_do_egress, for plugins that can work on several
+ * packets at once or need to grow packets at the front. The callback must set results[i] for
+ * every packet; returning HE_PLUGIN_FAIL fails the whole batch. A plugin may set either variant
+ * or both, and a plugin with only a batch variant is called with a batch of one for single
+ * packets.
+ */
+typedef he_plugin_return_code_t (*plugin_do_ingress_batch)(he_plugin_packet_t *packets,
+                                                           he_plugin_return_code_t *results,
+                                                           size_t count, void *data);
+typedef he_plugin_return_code_t (*plugin_do_egress_batch)(he_plugin_packet_t *packets,
+                                                          he_plugin_return_code_t *results,
+                                                          size_t count, void *data);
+
+/**
+ * Frees the state a plugin kept for a connection, when the connection is destroyed. Setting it
+ * gives the plugin a slot in every connection, and the plugin may then keep its state for a
+ * connection in `packet->state[packet->state_slot]` from its batch callbacks. A plugin registered
+ * on several chains may have a different slot on each.
+ */
+typedef void (*plugin_free_state)(void *state, void *data);
+
 typedef struct plugin_struct {
   plugin_do_ingress do_ingress;
   plugin_do_egress do_egress;
   void *data;
+  plugin_do_ingress_batch do_ingress_batch;
+  plugin_do_egress_batch do_egress_batch;
+  plugin_free_state free_state;
 } plugin_struct_t;
 
 #endif
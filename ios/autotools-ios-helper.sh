@@ -49,7 +49,6 @@ Build() {
         --enable-tls13 \
         --disable-oldtls \
         --prefix="${PREFIX}" \
-        --enable-singlethreaded \
         --enable-dtls \
         --enable-dtls-mtu \
         --enable-sp \
@@ -88,7 +87,6 @@ BuildIntel() {
         --disable-oldtls \
         --enable-aesni \
         --prefix="${PREFIX}" \
-        --enable-singlethreaded \
         --enable-dtls \
         --enable-dtls-mtu \
         --enable-sp \
@@ -121,7 +119,7 @@ MAKE_JOBS=8
 MIN_IOS_VERSION=12.0
 
 # WolfSSL + Helium
-WOLF_FLAGS="-fPIC -DWOLFSSL_DTLS_ALLOW_FUTURE -DWOLFSSL_MIN_RSA_BITS=2048 -DWOLFSSL_MIN_ECC_BITS=256"
+WOLF_FLAGS="-fPIC -DWOLFSSL_DTLS_ALLOW_FUTURE -DWOLFSSL_MIN_RSA_BITS=2048 -DWOLFSSL_MIN_ECC_BITS=256 -DWOLFSSL_DTLS_DROP_STATS"
 
 # Build for platforms
 SDK="iphoneos"
@@ -44,6 +44,31 @@
 #define HE_CONFIG_TEXT_FIELD_LENGTH 50
 /// Maximum size of an IPV4 String
 #define HE_MAX_IPV4_STRING_LENGTH 24
+/// Maximum size of a peer address that a stateless cookie can be bound to (fits a sockaddr_in6)
+#define HE_MAX_PEER_ADDRESS_LENGTH 28
+/// Size of the key used to seal exported connections
+#define HE_EXPORT_KEY_LENGTH 32
+/// Returned by he_timers_next_deadline() when no timers are pending
+#define HE_TIMERS_NO_DEADLINE UINT64_MAX
+/// Shortest prefix an address pool can be created with, i.e. at most 65533 clients
+#define HE_IP_POOL_MIN_PREFIX 16
+/// Longest prefix an address pool can be created with, enough for one client
+#define HE_IP_POOL_MAX_PREFIX 30
+/// Number of address bits each level of a route table consumes
+#define HE_ROUTE_TABLE_STRIDE 8
+#define HE_ROUTE_TABLE_NODE_SIZE (1 << HE_ROUTE_TABLE_STRIDE)
+
+/** virtio-net header values, as used by Linux TUN devices opened with IFF_VNET_HDR **/
+/// The checksum at csum_start + csum_offset still has to be completed
+#define HE_VIRTIO_NET_HDR_F_NEEDS_CSUM 1
+/// The checksum has already been verified
+#define HE_VIRTIO_NET_HDR_F_DATA_VALID 2
+/// Not a super-packet
+#define HE_VIRTIO_NET_HDR_GSO_NONE 0
+/// A TCP over IPv4 super-packet to be split into gso_size segments
+#define HE_VIRTIO_NET_HDR_GSO_TCPV4 1
+/// Set along with the GSO type when the segments carry ECN
+#define HE_VIRTIO_NET_HDR_GSO_ECN 0x80
 
 /**
  * @brief All possible return codes for helium
@@ -158,6 +183,29 @@ typedef enum he_return_code {
   HE_ERR_SSL_ERROR_NONFATAL = -51,
   /// Protocol version for connection changed after creation
   HE_ERR_INCORRECT_PROTOCOL_VERSION = -52,
+  /**
+   * @brief A HelloVerifyRequest carrying a stateless cookie has been written to the response
+   * buffer. It should be sent back to the peer and no connection should be created.
+   */
+  HE_WANT_COOKIE = -53,
+  /// The server is at its handshake limit, the handshake should be dropped and retried later
+  HE_ERR_HANDSHAKE_THROTTLED = -54,
+  /// This build of Helium (or of WolfSSL) does not support the requested operation
+  HE_ERR_NOT_SUPPORTED = -55,
+  /// The export key has not been set
+  HE_ERR_CONF_EXPORT_KEY_NOT_SET = -56,
+  /// Every address in the address pool has been handed out
+  HE_ERR_IP_POOL_EXHAUSTED = -57,
+  /// The route is not a valid IPv4 prefix in CIDR notation
+  HE_ERR_INVALID_ROUTE = -58,
+  /// The packet matched a bypass route and should be sent outside the tunnel by the host
+  HE_ERR_PACKET_BYPASSED = -59,
+  /// Every thread slot of the plugin chain is taken
+  HE_ERR_TOO_MANY_THREADS = -60,
+  /// The plugin is not registered on the chain
+  HE_ERR_PLUGIN_NOT_REGISTERED = -61,
+  /// The address is already in use by another connection from the pool
+  HE_ERR_IP_POOL_ADDRESS_TAKEN = -62,
 } he_return_code_t;
 
 /**
@@ -185,7 +233,8 @@ typedef enum he_client_state {
 typedef enum he_client_event {
   /// First packet / message was passed to Helium (i.e. a server response)
   HE_EVENT_FIRST_MESSAGE_RECEIVED = 1,
-  /// Server replied to a PING request (NAT Keepalive)
+  /// Server replied to a PING request (NAT Keepalive). he_conn_get_rtt() and he_conn_get_jitter()
+  /// include the new measurement when this fires.
   HE_EVENT_PONG = 2,
   /// Client tried to send fragmented packets which were rejected as they are not supported by
   /// Helium
@@ -196,6 +245,9 @@ typedef enum he_client_event {
   HE_EVENT_SECURE_RENEGOTIATION_COMPLETED = 5,
   /// Pending Session Acknowledged
   HE_EVENT_PENDING_SESSION_ACKNOWLEDGED = 6,
+  /// Path MTU discovery on either end changed the MTU of the tunnel, see
+  /// he_conn_get_effective_mtu()
+  HE_EVENT_PMTU_UPDATED = 7,
 } he_client_event_t;
 
 /**
@@ -221,10 +273,124 @@ typedef enum he_connection_type {
   HE_CONNECTION_TYPE_STREAM = 1
 } he_connection_type_t;
 
+/**
+ * @brief Reasons a packet that came through the tunnel was dropped before reaching the inside
+ * @see he_conn_get_inside_drops
+ */
+typedef enum he_inside_drop_reason {
+  /// Not dropped
+  HE_INSIDE_DROP_NONE = 0,
+  /// Not an IPv4 packet
+  HE_INSIDE_DROP_NOT_IPV4 = 1,
+  /// The header length is less than 20 bytes or longer than the packet
+  HE_INSIDE_DROP_BAD_HEADER_LENGTH = 2,
+  /// The total length is shorter than the header or longer than the packet
+  HE_INSIDE_DROP_BAD_TOTAL_LENGTH = 3,
+  /// The header checksum is wrong
+  HE_INSIDE_DROP_BAD_CHECKSUM = 4,
+  /// The source address isn't the one the client was given (server only)
+  HE_INSIDE_DROP_SPOOFED_SOURCE = 5,
+  /// Number of reasons, not a reason itself
+  HE_INSIDE_DROP_REASON_COUNT = 6
+} he_inside_drop_reason_t;
+
+/// Return codes he_conn_stats_t can count drops for, from HE_SUCCESS down to -63
+#define HE_CONN_STATS_MAX_DROP_REASONS 64
+
+/**
+ * @brief Traffic and error counters of a connection
+ * @see he_conn_get_stats
+ *
+ * The inside is the host's end of the tunnel (i.e. a TUN device), the outside is the network.
+ */
+typedef struct he_conn_stats {
+  /// Packets and bytes from the inside sent through the tunnel
+  uint64_t inside_rx_packets;
+  uint64_t inside_rx_bytes;
+  /// Packets and bytes from the tunnel written to the inside
+  uint64_t inside_tx_packets;
+  uint64_t inside_tx_bytes;
+  /// Datagrams (or stream reads) and bytes passed to he_conn_outside_data_received()
+  uint64_t outside_rx_packets;
+  uint64_t outside_rx_bytes;
+  /// Datagrams (or stream writes) and bytes written to the outside, handshakes included
+  uint64_t outside_tx_packets;
+  uint64_t outside_tx_bytes;
+  /// Packets and outside data that were dropped, by the he_return_code_t saying why, i.e. the
+  /// drops for HE_ERR_PACKET_TOO_LARGE are drops[-HE_ERR_PACKET_TOO_LARGE]
+  uint64_t drops[HE_CONN_STATS_MAX_DROP_REASONS];
+  /// Drops whose reason the connection had no room left to keep
+  uint64_t other_drops;
+  /// Packets from the tunnel that failed validation, by he_inside_drop_reason_t
+  uint64_t inside_drops[HE_INSIDE_DROP_REASON_COUNT];
+  /// Records from the peer that failed to decrypt or authenticate
+  uint64_t decrypt_failures;
+  /// Records from the peer that were replayed or out of sequence
+  uint64_t replays;
+  /// D/TLS renegotiations completed
+  uint64_t renegotiations;
+  /// Session ID rotations the client acknowledged (server) or the server made (client)
+  uint64_t session_rotations;
+} he_conn_stats_t;
+
+/// Number of he_client_state_t values he_metrics_t counts connections for
+#define HE_METRICS_STATE_COUNT 9
+/// Return codes he_metrics_t counts handshake failures for, from HE_SUCCESS down to -63
+#define HE_METRICS_MAX_ERROR_CODES 64
+
+/**
+ * @brief Totals across every connection of an SSL context
+ * @see he_ssl_ctx_get_metrics
+ * @see he_metrics_render
+ */
+typedef struct he_metrics {
+  /// Connections that currently exist, by he_client_state_t
+  uint64_t connections[HE_METRICS_STATE_COUNT];
+  /// Handshakes started, and those that got as far as HE_STATE_LINK_UP
+  uint64_t handshakes_started;
+  uint64_t handshakes_completed;
+  /// Handshakes that failed, by the he_return_code_t they failed with as in he_conn_stats_t. Those
+  /// turned away by he_ssl_ctx_admit_handshake() count as HE_ERR_HANDSHAKE_THROTTLED.
+  uint64_t handshake_failures[HE_METRICS_MAX_ERROR_CODES];
+  /// Logins the auth callback accepted and rejected (server only)
+  uint64_t auth_successes;
+  uint64_t auth_failures;
+  /// Totals of the he_conn_stats_t counters of the same names
+  uint64_t inside_rx_packets;
+  uint64_t inside_rx_bytes;
+  uint64_t inside_tx_packets;
+  uint64_t inside_tx_bytes;
+  uint64_t outside_rx_packets;
+  uint64_t outside_rx_bytes;
+  uint64_t outside_tx_packets;
+  uint64_t outside_tx_bytes;
+  /// Bytes of padding added to data messages, see he_ssl_ctx_set_padding_type()
+  uint64_t padding_bytes;
+  /// Packets dropped by plugins in either direction
+  uint64_t plugin_drops;
+} he_metrics_t;
+
+/**
+ * @brief Where a client should send a packet from the inside
+ * @see he_route_table_lookup
+ */
+typedef enum he_route_verdict {
+  /// Send the packet through the tunnel
+  HE_ROUTE_TUNNEL = 1,
+  /// Send the packet directly, bypassing the tunnel (e.g. LAN traffic or excluded ranges)
+  HE_ROUTE_BYPASS = 2
+} he_route_verdict_t;
+
 typedef struct he_ssl_ctx he_ssl_ctx_t;
 typedef struct he_conn he_conn_t;
 typedef struct he_plugin_chain he_plugin_chain_t;
 typedef struct he_network_config_ipv4 he_network_config_ipv4_t;
+typedef struct he_virtio_net_hdr he_virtio_net_hdr_t;
+typedef struct he_flow_info he_flow_info_t;
+typedef struct he_snapshot_store he_snapshot_store_t;
+typedef struct he_timers he_timers_t;
+typedef struct he_ip_pool he_ip_pool_t;
+typedef struct he_route_table he_route_table_t;
 
 typedef void *(*he_malloc_t)(size_t size);
 typedef void *(*he_calloc_t)(size_t nmemb, size_t size);
@@ -257,6 +423,43 @@ typedef he_return_code_t (*he_state_change_cb_t)(he_conn_t *conn, he_client_stat
 typedef he_return_code_t (*he_inside_write_cb_t)(he_conn_t *conn, uint8_t *packet, size_t length,
                                                  void *context);
 
+/**
+ * @brief The prototype for the inside write callback function used with GRO
+ * @param client A pointer to the client context that triggered the callback
+ * @param vnet_hdr The virtio-net header to write in front of the packet
+ * @param flow The packet's 5-tuple and flow hash, as for the inside write flow callback
+ * @param packet A pointer to the packet data
+ * @param length The length of the entire packet in bytes
+ * @param context A pointer to the user defined context
+ * @see he_ssl_ctx_set_inside_write_gro_cb Sets this callback
+ *
+ * Used instead of the inside write callback when set, for TUN devices that take a virtio-net
+ * header with every packet. Consecutive segments of a TCP flow received together are merged into
+ * a single super-packet, which the header describes. The flow is worked out once per packet
+ * written, so a super-packet costs no more to classify than one of its segments.
+ */
+typedef he_return_code_t (*he_inside_write_gro_cb_t)(he_conn_t *conn,
+                                                     const he_virtio_net_hdr_t *vnet_hdr,
+                                                     const he_flow_info_t *flow, uint8_t *packet,
+                                                     size_t length, void *context);
+
+/**
+ * @brief The prototype for the inside write callback function that also gets the packet's flow
+ * @param client A pointer to the client context that triggered the callback
+ * @param flow The packet's 5-tuple and flow hash
+ * @param packet A pointer to the packet data
+ * @param length The length of the entire packet in bytes
+ * @param context A pointer to the user defined context
+ * @see he_ssl_ctx_set_inside_write_flow_cb Sets this callback
+ *
+ * Used instead of the inside write callback when set, so hosts writing to a multiqueue tun device
+ * or handing packets to several workers can pick one by the flow hash without parsing the packet
+ * again. Packets of the same flow always have the same hash.
+ */
+typedef he_return_code_t (*he_inside_write_flow_cb_t)(he_conn_t *conn, const he_flow_info_t *flow,
+                                                      uint8_t *packet, size_t length,
+                                                      void *context);
+
 /**
  * @brief The prototype for the outside write callback function
  * @param client AA pointer to the client context that triggered the callback
@@ -346,6 +549,34 @@ typedef he_return_code_t (*he_populate_network_config_ipv4_cb_t)(he_conn_t *conn
                                                                  he_network_config_ipv4_t *config,
                                                                  void *context);
 
+/**
+ * @brief The prototype for the handoff callback
+ * @param conn A pointer to the connection that has finished its handshake
+ * @param context A pointer to the user defined context
+ * @see he_conn_set_context Sets the value of the context pointer
+ *
+ * Called once per server connection, after it has reached HE_STATE_ONLINE and the call that got
+ * it there has completely finished with it. Helium holds no references to the connection at this
+ * point, so the host may move it (and its D/TLS state, which lives inside it) to another thread.
+ */
+typedef he_return_code_t (*he_handoff_cb_t)(he_conn_t *conn, void *context);
+
+/**
+ * @brief The prototype for the callback that confirms a new handshake comes from a returning client
+ * @param ctx A pointer to the SSL context the handshake is for
+ * @param session The Helium session ID from the wire header, or 0 when asking about a D/TLS session
+ * @param tls_session_id The D/TLS session ID from the ClientHello, or NULL when asking about a
+ *        Helium session
+ * @param tls_session_id_length The length of the D/TLS session ID
+ * @return true if the host knows the Helium session, or still has the D/TLS session cached
+ *
+ * Both IDs are set by the client and are not authenticated at this point, anyone can put any
+ * value in them. Only the host can tell whether they belong to a client it has served.
+ */
+typedef bool (*he_returning_client_cb_t)(he_ssl_ctx_t *ctx, uint64_t session,
+                                         const uint8_t *tls_session_id,
+                                         size_t tls_session_id_length);
+
 
 typedef struct he_network_config_ipv4 {
   char local_ip[HE_MAX_IPV4_STRING_LENGTH];
@@ -376,6 +607,37 @@ typedef struct he_wire_hdr {
   uint64_t session;
 } he_wire_hdr_t;
 
+/**
+ * @brief The virtio-net header Linux TUN devices opened with IFF_VNET_HDR put in front of packets
+ * Fields are in host byte order.
+ */
+typedef struct he_virtio_net_hdr {
+  uint8_t flags;
+  uint8_t gso_type;
+  /// Length of the headers in front of the payload
+  uint16_t hdr_len;
+  /// Payload size of each segment of a super-packet
+  uint16_t gso_size;
+  /// Where checksumming starts from, and how far past that the checksum goes
+  uint16_t csum_start;
+  uint16_t csum_offset;
+} he_virtio_net_hdr_t;
+
+/**
+ * @brief The 5-tuple of an inside packet and its flow hash
+ * Addresses and ports are in host byte order. Ports are 0 for protocols without them, and for
+ * IPv4 fragments since only the first fragment has them.
+ */
+typedef struct he_flow_info {
+  /// Toeplitz hash of the addresses and ports with the standard RSS key, as NICs compute it
+  uint32_t hash;
+  uint32_t src_addr;
+  uint32_t dst_addr;
+  uint16_t src_port;
+  uint16_t dst_port;
+  uint8_t protocol;
+} he_flow_info_t;
+
 #pragma pack()
 
 /** Session codes **/
@@ -668,6 +930,50 @@ void he_ssl_ctx_set_inside_write_cb(he_ssl_ctx_t *ctx, he_inside_write_cb_t insi
  */
 bool he_ssl_ctx_is_inside_write_cb_set(he_ssl_ctx_t *ctx);
 
+/**
+ * @brief Sets the function that will be called for inside writes to a TUN device that takes a
+ *        virtio-net header with every packet.
+ * @param ctx A pointer to a valid SSL context
+ * @param inside_write_gro_cb The function to be called instead of the inside write callback
+ *
+ * When set, consecutive in-order segments of a TCP flow that are decrypted together are merged
+ * into a single super-packet (GRO), and every packet is passed along with the virtio-net header
+ * that describes it and its flow. On Linux this suits a tun device opened with IFF_VNET_HDR.
+ * Segments are
+ * merged across the records of one call to he_conn_outside_data_received(), or across all the
+ * datagrams given to he_conn_outside_data_received_batch().
+ */
+void he_ssl_ctx_set_inside_write_gro_cb(he_ssl_ctx_t *ctx,
+                                        he_inside_write_gro_cb_t inside_write_gro_cb);
+
+/**
+ * @brief Check if the inside write GRO callback has been set.
+ * @param ctx A pointer to a valid SSL context
+ * @return bool Returns true or false depending on whether it has been set
+ */
+bool he_ssl_ctx_is_inside_write_gro_cb_set(he_ssl_ctx_t *ctx);
+
+/**
+ * @brief Sets the function that will be called for inside writes along with the packet's flow.
+ * @param ctx A pointer to a valid SSL context
+ * @param inside_write_flow_cb The function to be called instead of the inside write callback
+ *
+ * Helium works out the 5-tuple and flow hash of each packet once it has been validated, so hosts
+ * spreading packets over the queues of a multiqueue tun device or over several workers needn't
+ * parse them again. he_flow_classify() gives the same result for outgoing packets. The inside
+ * write GRO callback takes precedence if both are set, and is given the flow of every packet
+ * itself.
+ */
+void he_ssl_ctx_set_inside_write_flow_cb(he_ssl_ctx_t *ctx,
+                                         he_inside_write_flow_cb_t inside_write_flow_cb);
+
+/**
+ * @brief Check if the inside write flow callback has been set.
+ * @param ctx A pointer to a valid SSL context
+ * @return bool Returns true or false depending on whether it has been set
+ */
+bool he_ssl_ctx_is_inside_write_flow_cb_set(he_ssl_ctx_t *ctx);
+
 /**
  * @brief Sets the function that will be called when Helium needs to do an outside write.
  * @param ctx A pointer to a valid SSL context
@@ -759,6 +1065,77 @@ bool he_ssl_ctx_is_auth_cb_set(he_ssl_ctx_t *ctx);
  */
 void he_ssl_ctx_set_populate_network_config_ipv4_cb(he_ssl_ctx_t *ctx, he_populate_network_config_ipv4_cb_t pop_network_cb);
 
+/**
+ * @brief Sets the function that will be called when a server connection is ready to be moved to a
+ * data plane thread
+ * @param ctx A pointer to a valid SSL context
+ * @param handoff_cb The function to be called once a connection has gone online
+ *
+ * This supports servers that run handshakes on a dedicated pool of threads and forwarding data on
+ * another. A connection belongs to whichever thread is currently calling into it; the host moves
+ * it between threads by passing the he_conn_t pointer, so no D/TLS state or key material is copied.
+ *
+ * The callback is made at the end of he_conn_outside_data_received(), after the connection has
+ * reached HE_STATE_ONLINE and Helium has finished with it on the calling thread. The host must
+ * not call into the connection from the handshake thread after the callback returns.
+ *
+ * @caution he_conn_server_connect() and he_conn_rotate_session_id() draw from the context's random
+ * number generator and must not run on several threads at the same time. Hosts with a handshake
+ * pool should create connections from a single thread and dispatch them to the pool.
+ * he_conn_export() and he_conn_hibernate() seed a generator of their own on every call, so data
+ * plane threads may export and hibernate the connections they own. WolfSSL must be built without
+ * --enable-singlethreaded (SINGLE_THREADED), as it is by every platform build in this repository.
+ */
+void he_ssl_ctx_set_handoff_cb(he_ssl_ctx_t *ctx, he_handoff_cb_t handoff_cb);
+
+/**
+ * @brief Check if the handoff callback has been set.
+ * @param ctx A pointer to a valid SSL context
+ * @return bool Returns true or false depending on whether it has been set
+ */
+bool he_ssl_ctx_is_handoff_cb_set(he_ssl_ctx_t *ctx);
+
+/**
+ * @brief Sets a timer wheel for connections to schedule their nudges on
+ * @param ctx A pointer to a valid SSL context
+ * @param timers A pointer to a timer wheel created with he_timers_create(), or NULL to go back to
+ *        the nudge time callback
+ *
+ * Connections created after this call use the wheel instead of the nudge time callback. The host
+ * then drives all of them with he_timers_advance() and he_timers_next_deadline().
+ *
+ * @see he_conn_set_timers()
+ */
+void he_ssl_ctx_set_timers(he_ssl_ctx_t *ctx, he_timers_t *timers);
+
+/**
+ * @brief Check if a timer wheel has been set.
+ * @param ctx A pointer to a valid SSL context
+ * @return bool Returns true or false depending on whether it has been set
+ */
+bool he_ssl_ctx_is_timers_set(he_ssl_ctx_t *ctx);
+
+/**
+ * @brief Sets an address pool to give clients their tunnel addresses from (server only)
+ * @param ctx A pointer to a valid SSL context
+ * @param pool A pointer to an address pool created with he_ip_pool_create(), or NULL to leave it
+ *        to the populate network config callback
+ *
+ * Clients of connections created after this call get an address from the pool when they
+ * authenticate. The populate network config callback becomes optional: if it is set, it is called
+ * with the local, peer and DNS IPs already filled in and can change anything it likes.
+ *
+ * @see he_ip_pool_create()
+ */
+void he_ssl_ctx_set_ip_pool(he_ssl_ctx_t *ctx, he_ip_pool_t *pool);
+
+/**
+ * @brief Check if an address pool has been set.
+ * @param ctx A pointer to a valid SSL context
+ * @return bool Returns true or false depending on whether it has been set
+ */
+bool he_ssl_ctx_is_ip_pool_set(he_ssl_ctx_t *ctx);
+
 /**
  * @brief Disables session roaming and removes the session ID from the packet header
  * @return HE_SUCCESS
@@ -803,6 +1180,180 @@ he_padding_type_t he_ssl_ctx_get_padding_type(he_ssl_ctx_t *ctx);
  */
 he_return_code_t he_ssl_ctx_set_aggressive_mode(he_ssl_ctx_t *ctx);
 
+/**
+ * @brief Enables or disables stateless cookies for new D/TLS connections
+ * @param ctx A pointer to a valid SSL context
+ * @param use Whether new connections must present a valid cookie before a connection is created
+ * @return HE_SUCCESS The setting was applied
+ * @return HE_ERR_NULL_POINTER The ctx pointer supplied is NULL
+ *
+ * When enabled, the host should pass every datagram that does not belong to a known session to
+ * he_ssl_ctx_verify_client_hello() before creating a connection for it. Only peers that can
+ * receive traffic at their claimed address get past the cookie exchange, so spoofed ClientHellos
+ * never cost a connection allocation or any asymmetric crypto.
+ *
+ * @note This must be set before calling he_ssl_ctx_start_server()
+ * @see he_ssl_ctx_verify_client_hello()
+ */
+he_return_code_t he_ssl_ctx_set_use_stateless_cookies(he_ssl_ctx_t *ctx, bool use);
+
+/**
+ * @brief Returns whether stateless cookies are enabled
+ * @param ctx A pointer to a valid SSL context
+ * @return bool Whether stateless cookies are enabled
+ */
+bool he_ssl_ctx_get_use_stateless_cookies(he_ssl_ctx_t *ctx);
+
+/**
+ * @brief Enables or disables MSS clamping for new connections
+ * @param ctx A pointer to a valid SSL context
+ * @param clamp Whether to clamp the MSS of TCP connections carried by the tunnel
+ * @return HE_SUCCESS The setting was applied
+ * @return HE_ERR_NULL_POINTER The ctx pointer supplied is NULL
+ *
+ * TCP stacks pick an MSS to suit the MTU of the interface they see, which is larger than the
+ * tunnel's, so full sized segments end up fragmented or dropped. With clamping enabled the MSS
+ * option of TCP SYNs going through the tunnel, in either direction, is lowered to fit
+ * he_conn_get_effective_mtu(). This saves users having to configure it on their devices.
+ *
+ * @note This must be set before connections are created
+ */
+he_return_code_t he_ssl_ctx_set_mss_clamping(he_ssl_ctx_t *ctx, bool clamp);
+
+/**
+ * @brief Returns whether MSS clamping is enabled
+ * @param ctx A pointer to a valid SSL context
+ * @return bool Whether MSS clamping is enabled
+ */
+bool he_ssl_ctx_is_mss_clamping_enabled(he_ssl_ctx_t *ctx);
+
+/**
+ * @brief Enables or disables source address validation for new connections
+ * @param ctx A pointer to a valid SSL context
+ * @param validate Whether to drop packets from clients that don't come from their own address
+ * @return HE_SUCCESS The setting was applied
+ * @return HE_ERR_NULL_POINTER The ctx pointer supplied is NULL
+ *
+ * Servers remember the local IP the populate network config callback gives each client. With
+ * validation enabled, packets a client sends through the tunnel from any other source address are
+ * dropped and counted as HE_INSIDE_DROP_SPOOFED_SOURCE, so one client can't pass its traffic off
+ * as another's. Clients ignore this setting.
+ *
+ * @note This must be set before connections are created
+ */
+he_return_code_t he_ssl_ctx_set_source_address_validation(he_ssl_ctx_t *ctx, bool validate);
+
+/**
+ * @brief Returns whether source address validation is enabled
+ * @param ctx A pointer to a valid SSL context
+ * @return bool Whether source address validation is enabled
+ */
+bool he_ssl_ctx_is_source_address_validation_enabled(he_ssl_ctx_t *ctx);
+
+/**
+ * @brief Tells Helium how much room there is around the buffers passed to
+ *        he_conn_outside_data_received()
+ * @param ctx A pointer to a valid SSL context
+ * @param headroom Bytes that can be written to in front of every buffer
+ * @param tailroom Bytes that can be written to after the end of every buffer
+ * @return HE_SUCCESS The setting was applied
+ * @return HE_ERR_NULL_POINTER The ctx pointer supplied is NULL
+ *
+ * Ingress plugins are given this room, so ones that wrap or pad packets can do it in place
+ * instead of copying into their own buffers. By default there is none.
+ *
+ * @note This must be set before connections are created
+ */
+he_return_code_t he_ssl_ctx_set_outside_buffer_room(he_ssl_ctx_t *ctx, size_t headroom,
+                                                    size_t tailroom);
+
+/**
+ * @brief Enables a jumbo inner MTU for new connections
+ * @param ctx A pointer to a valid SSL context
+ * @param mtu The largest inner packet to carry, up to HE_MAX_JUMBO_MTU, or 0 to disable
+ * @return HE_SUCCESS The setting was applied
+ * @return HE_ERR_NULL_POINTER The ctx pointer supplied is NULL
+ * @return HE_ERR_INVALID_MTU_SIZE The MTU isn't 0 and is either too large or small enough to
+ *         not need a jumbo MTU
+ *
+ * A large TUN MTU means far fewer packets, and so fewer system calls, record encryptions and
+ * plugin calls, for bulk transfers. Packets larger than what fits on the path are split across
+ * several records and put back together by the peer.
+ *
+ * Clients offer this MTU when they authenticate and servers agree to the smaller of theirs and
+ * the client's. The agreed MTU is what the client is given in its network config, and
+ * he_conn_get_inner_mtu() returns it on both sides. If either side doesn't support or enable it,
+ * the connection carries on with an ordinary MTU.
+ *
+ * @note This must be set before connections are created
+ */
+he_return_code_t he_ssl_ctx_set_inner_mtu(he_ssl_ctx_t *ctx, int mtu);
+
+/**
+ * @brief Returns the jumbo inner MTU new connections will offer
+ * @param ctx A pointer to a valid SSL context
+ * @return int The MTU, or 0 if jumbo MTUs are disabled
+ */
+int he_ssl_ctx_get_inner_mtu(he_ssl_ctx_t *ctx);
+
+/**
+ * @brief Generates a fresh stateless cookie secret
+ * @param ctx A pointer to a valid SSL context
+ * @return HE_SUCCESS The secret was rotated
+ * @return HE_ERR_NULL_POINTER The ctx pointer supplied is NULL
+ * @return HE_ERR_FAILED Stateless cookies are not enabled on this context
+ * @return HE_ERR_RNG_FAILURE A new secret could not be generated
+ *
+ * Cookies generated with the previous secret continue to be accepted until the next rotation, so
+ * clients in the middle of the cookie exchange are not affected. Hosts should call this
+ * periodically (e.g. every few minutes).
+ *
+ * @caution This is not thread safe with respect to he_ssl_ctx_verify_client_hello()
+ */
+he_return_code_t he_ssl_ctx_rotate_cookie_secret(he_ssl_ctx_t *ctx);
+
+/**
+ * @brief Sets the key used to seal and open connection exports
+ * @param ctx A pointer to a valid SSL context
+ * @param key A pointer to the key
+ * @param length The length of the key, must be HE_EXPORT_KEY_LENGTH
+ * @return HE_SUCCESS The key was set
+ * @return HE_ERR_NULL_POINTER The ctx or key pointer supplied is NULL
+ * @return HE_ERR_FAILED The key is not HE_EXPORT_KEY_LENGTH bytes long
+ *
+ * Every process that imports a connection must be configured with the same key as the process that
+ * exported it. Helium keeps a copy, so the caller can wipe its own.
+ *
+ * @note Connections pick the key up when they are created, so this must be set before any
+ *       connections that are to be exported are created
+ * @see he_conn_export()
+ */
+he_return_code_t he_ssl_ctx_set_export_key(he_ssl_ctx_t *ctx, const uint8_t *key, size_t length);
+
+/**
+ * @brief Returns whether an export key has been set
+ * @param ctx A pointer to a valid SSL context
+ * @return bool Whether an export key has been set
+ */
+bool he_ssl_ctx_is_export_key_set(he_ssl_ctx_t *ctx);
+
+/**
+ * @brief Sets how long connections must be idle before he_conn_hibernate_if_idle() hibernates them
+ * @param ctx A pointer to a valid SSL context
+ * @param idle_ms The idle time in milliseconds, or 0 to never hibernate idle connections (the
+ *        default)
+ * @return HE_SUCCESS The idle time was set
+ * @return HE_ERR_NULL_POINTER The ctx pointer supplied is NULL
+ */
+he_return_code_t he_ssl_ctx_set_hibernate_idle_time(he_ssl_ctx_t *ctx, uint32_t idle_ms);
+
+/**
+ * @brief Returns the idle time set with he_ssl_ctx_set_hibernate_idle_time()
+ * @param ctx A pointer to a valid SSL context
+ * @return uint32_t The idle time in milliseconds, 0 if idle connections are never hibernated
+ */
+uint32_t he_ssl_ctx_get_hibernate_idle_time(he_ssl_ctx_t *ctx);
+
 /**
  * @brief Creates a Helium connection struct
  * @return he_conn_t* Returns a pointer to a valid Helium connection
@@ -821,6 +1372,11 @@ he_conn_t *he_conn_create(void);
  * It will first remove all of the callbacks which means no Helium callbacks will be triggered after
  * calling this function. It is thus an error to call any Helium functions on this connection after
  * it has been destroyed.
+ *
+ * The one exception is a connection with an address pool that has lookup threads registered with
+ * he_ip_pool_register_thread(). Its memory is kept until every such thread has passed a
+ * quiescent state, so a pointer returned by he_ip_pool_lookup() before the destroy can still be
+ * passed to he_conn_inside_packet_received(), which drops the packet.
  */
 he_return_code_t he_conn_destroy(he_conn_t *conn);
 
@@ -934,6 +1490,61 @@ int he_conn_get_outside_mtu(he_conn_t *conn);
  */
 bool he_conn_is_outside_mtu_set(he_conn_t *conn);
 
+/**
+ * @brief Returns the MTU of the tunnel, i.e. the largest packet he_conn_inside_packet_received()
+ * will accept
+ * @param conn A pointer to a valid connection
+ * @return int The MTU in bytes. This is HE_MAX_MTU unless path MTU discovery has found otherwise.
+ * @see he_conn_send_pmtu_probe_if_due()
+ *
+ * Each end tells the other what its path MTU discovery found, and both use the smaller of the
+ * two. That way neither sends the other packets larger than its TUN device is set up for, even
+ * if only one end runs path MTU discovery.
+ */
+int he_conn_get_effective_mtu(he_conn_t *conn);
+
+/**
+ * @brief Returns the largest packet that can be sent through the tunnel, which the host should
+ * use as the MTU of its TUN device
+ * @param conn A pointer to a valid connection
+ * @return int The jumbo MTU agreed with the peer if there is one, otherwise the effective MTU
+ * @see he_ssl_ctx_set_inner_mtu()
+ */
+int he_conn_get_inner_mtu(he_conn_t *conn);
+
+/**
+ * @brief Returns how many packets from the tunnel were dropped before reaching the inside
+ * @param conn A pointer to a valid connection
+ * @param reason Why the packets were dropped
+ * @return uint64_t The number of packets dropped for that reason, 0 if the reason isn't valid
+ *
+ * Packets from the tunnel are checked to be well formed IPv4 with a good header checksum, and on
+ * servers with source address validation enabled, to come from the client's own address.
+ *
+ * @see he_ssl_ctx_set_source_address_validation()
+ */
+uint64_t he_conn_get_inside_drops(he_conn_t *conn, he_inside_drop_reason_t reason);
+
+/**
+ * @brief Takes a snapshot of the traffic and error counters of the connection
+ * @param conn A pointer to a valid connection
+ * @param stats Filled in with the counts since the connection was created
+ * @return HE_SUCCESS The snapshot was taken
+ * @return HE_ERR_NULL_POINTER Either parameter was NULL
+ *
+ * Counting is always on and costs a few additions per packet. Counters only go up, so the
+ * difference between two snapshots is what happened in between.
+ *
+ * Like the rest of the connection API this isn't thread safe, but the counters are plain
+ * integers; taken from another thread, a snapshot may be slightly behind.
+ *
+ * WolfSSL discards D/TLS records that fail authentication or are replayed without telling
+ * Helium, so for datagram connections those two counters come from WolfSSL's own drop counts.
+ * The WolfSSL builds set up for every platform define WOLFSSL_DTLS_DROP_STATS for this; without
+ * it they stay 0 for datagram connections.
+ */
+he_return_code_t he_conn_get_stats(he_conn_t *conn, he_conn_stats_t *stats);
+
 /**
  * @brief Store a pointer in the context that will be made available in all Helium callbacks
  * @param conn A valid connection
@@ -1004,6 +1615,36 @@ he_return_code_t he_conn_client_connect(he_conn_t *conn, he_ssl_ctx_t *ssl_ctx,
 he_return_code_t he_conn_server_connect(he_conn_t *conn, he_ssl_ctx_t *ssl_ctx,
                                         he_plugin_chain_t *plugins);
 
+/**
+ * @brief Set the address of the peer this connection was created for
+ * @param conn A pointer to a valid connection
+ * @param peer_address The peer's address in the host's native format (e.g. a struct sockaddr)
+ * @param length The length of the peer address
+ * @return HE_SUCCESS The peer address was stored
+ * @return HE_ERR_NULL_POINTER The conn or peer_address pointer is NULL
+ * @return HE_ERR_ZERO_SIZE The length is zero
+ * @return HE_ERR_PACKET_TOO_LARGE The address is longer than HE_MAX_PEER_ADDRESS_LENGTH
+ *
+ * When stateless cookies are enabled this must be set before calling he_conn_server_connect(),
+ * using the exact bytes passed to he_ssl_ctx_verify_client_hello(), so the server accepts the
+ * cookie the client has already obtained.
+ */
+he_return_code_t he_conn_set_peer_address(he_conn_t *conn, const uint8_t *peer_address,
+                                          size_t length);
+
+/**
+ * @brief Set whether the client's stateless cookie was issued under the previous cookie secret
+ * @param conn A pointer to a valid connection
+ * @param use The previous_secret value from he_ssl_ctx_verify_client_hello()
+ * @return HE_SUCCESS The flag was stored
+ * @return HE_ERR_NULL_POINTER The conn pointer is NULL
+ *
+ * Cookies stay valid for one rotation of the cookie secret. Without this, a client whose cookie
+ * predates the last rotation would be sent a second HelloVerifyRequest once its connection has
+ * been created. Ignored if the context no longer has a previous secret.
+ */
+he_return_code_t he_conn_set_use_previous_cookie_secret(he_conn_t *conn, bool use);
+
 /**
  * @brief Try to cleanly disconnect from the remote Helium instance (client or server).
  * @return HE_ERR_NEVER_CONNECTED The connection has never been connected and so cannot be
@@ -1027,9 +1668,41 @@ he_return_code_t he_conn_disconnect(he_conn_t *conn);
  * ensure that the connection doesn't time out due to NAT traversal. This feature is not mandatory,
  * but as Helium cannot by itself know when to send these, it is up to the host application to call
  * this function at the required intervals.
+ *
+ * The reply is also used to measure the round trip time, see he_conn_get_rtt().
  */
 he_return_code_t he_conn_send_keepalive(he_conn_t *conn);
 
+/**
+ * @brief Sets how long the connection must be idle before he_conn_send_keepalive_if_idle() sends
+ * a keepalive
+ * @param conn A pointer to a valid connection
+ * @param interval_ms The idle time in milliseconds, or 0 to disable idle keepalives (the default)
+ * @return HE_SUCCESS The interval was set
+ * @return HE_ERR_NULL_POINTER The conn pointer supplied is NULL
+ */
+he_return_code_t he_conn_set_keepalive_interval(he_conn_t *conn, uint32_t interval_ms);
+
+/**
+ * @brief Returns the keepalive interval set with he_conn_set_keepalive_interval()
+ * @param conn A pointer to a valid connection
+ * @return uint32_t The interval in milliseconds, 0 if idle keepalives are disabled
+ */
+uint32_t he_conn_get_keepalive_interval(he_conn_t *conn);
+
+/**
+ * @brief Sends a keepalive only if nothing has been heard from the peer for the keepalive interval
+ * @param conn A pointer to a valid connection
+ * @return HE_SUCCESS A keepalive was sent, or wasn't needed
+ * @return HE_ERR_INVALID_CLIENT_STATE The connection isn't online
+ * @return HE_ERR_NULL_POINTER The conn pointer supplied is NULL
+ *
+ * Busy connections prove the path is alive with their own traffic, so keepalives are only sent
+ * while the path is idle, and then at most once per interval. The host should call this
+ * regularly, e.g. every second; idle time is measured in steps of however often it is called.
+ */
+he_return_code_t he_conn_send_keepalive_if_idle(he_conn_t *conn);
+
 /**
  * @brief Tell Helium to schedule a renegotiation
  * @param conn A pointer to a valid connection
@@ -1051,6 +1724,38 @@ he_return_code_t he_conn_schedule_renegotiation(he_conn_t *conn);
  */
 int he_conn_get_nudge_time(he_conn_t *conn);
 
+/**
+ * @brief Returns the smoothed round trip time of the connection
+ * @param conn A pointer to a valid connection
+ * @return uint32_t The smoothed round trip time in milliseconds, or 0 if it hasn't been measured
+ *
+ * Helium measures the round trip time from handshake flights and PING / PONG exchanges (see
+ * he_conn_send_keepalive()) and uses it to pace D/TLS retransmissions.
+ */
+uint32_t he_conn_get_rtt(const he_conn_t *conn);
+
+/**
+ * @brief Returns the jitter of the round trip times of keepalives
+ * @param conn A pointer to a valid connection
+ * @return uint32_t The smoothed variation between consecutive PING round trip times in
+ *         milliseconds (as per RFC 3550), or 0 if there aren't enough measurements yet
+ */
+uint32_t he_conn_get_jitter(const he_conn_t *conn);
+
+/**
+ * @brief Moves a connection's nudge timer to another timer wheel
+ * @param conn A pointer to a valid connection
+ * @param timers A pointer to a timer wheel, or NULL to use the nudge time callback
+ * @return HE_SUCCESS The connection now uses the given timers
+ * @return HE_ERR_NULL_POINTER The conn pointer supplied is NULL
+ *
+ * Timer wheels are not thread safe, so a host that hands connections to other threads (see
+ * he_ssl_ctx_set_handoff_cb()) should move them to the receiving thread's wheel. A pending nudge
+ * is rescheduled on the new wheel. The choice sticks through hibernation, and a wheel set before
+ * he_conn_import() is used instead of the context's.
+ */
+he_return_code_t he_conn_set_timers(he_conn_t *conn, he_timers_t *timers);
+
 /**
  * @brief Nudges Helium
  * @param conn A pointer to a valid connection
@@ -1136,6 +1841,8 @@ he_return_code_t he_conn_set_protocol_version(he_conn_t *conn, uint8_t major_ver
  * HE_STATE_ONLINE state
  * @return HE_ERR_PACKET_TOO_SMALL The packet is too small to be a valid Helium packet
  * @return HE_ERR_UNSUPPORTED_PACKET_TYPE The packet is not an IPv4 packet
+ * @return HE_ERR_PACKET_BYPASSED The packet matched a bypass route in the connection's route table
+ * and the host should send it outside the tunnel, see he_conn_set_route_table()
  * @return HE_SUCCESS Packet was processed normally
  * @note It is expected that Helium will support IPv6 almost immediately, so it is worth keeping
  * this in mind.
@@ -1160,12 +1867,35 @@ he_return_code_t he_conn_inside_packet_received(he_conn_t *conn, uint8_t *packet
  * @return HE_SUCCESS The packet was processed normally.
  * @note These error codes may change before final release as new issues come to light.
  * @note If the conn has registered plugins, they may arbitrarily change the packet data,
- * but are restricted here to not exceeding the provided length. Users
+ * but are restricted here to the provided length plus any room set with
+ * he_ssl_ctx_set_outside_buffer_room(). Users
  * who wish to have more control over this should *not* register plugins upon connection, but
  * instead call the plugin API explicitly prior to invoking this function.
  */
 he_return_code_t he_conn_outside_data_received(he_conn_t *conn, uint8_t *buffer, size_t length);
 
+/**
+ * @brief Called when the host application has several datagrams for the same connection at once,
+ *        e.g. from recvmmsg()
+ * @param conn A valid Helium connection
+ * @param buffers Pointers to each datagram
+ * @param lengths The length of each datagram
+ * @param count How many datagrams there are
+ * @return HE_ERR_NULL_POINTER Any of the pointers provided are NULL
+ * @return HE_SUCCESS All datagrams were processed normally
+ * @return The first error he_conn_outside_data_received() returned for any of the datagrams
+ *
+ * Each datagram is processed as by he_conn_outside_data_received(). Datagrams after one that
+ * failed are still processed, unless the error was fatal. Segments are merged for the inside write
+ * GRO callback across the whole batch, and the handoff callback isn't called until the batch is
+ * done.
+ *
+ * Registered plugins see the datagrams through he_plugin_ingress_batch(), up to
+ * HE_PLUGIN_MAX_BATCH at a time, before any of them are processed.
+ */
+he_return_code_t he_conn_outside_data_received_batch(he_conn_t *conn, uint8_t *const *buffers,
+                                                     const size_t *lengths, size_t count);
+
 /**
  * @brief Creates a Helium plugin chain
  * @return he_plugin_chain_t* Returns a pointer to a valid plugin chain
@@ -1190,9 +1920,78 @@ he_return_code_t he_plugin_destroy_chain(he_plugin_chain_t *chain);
  * @return HE_ERR_NULL_POINTER Either parameter was NULL
  * @return HE_ERR_INIT_FAILED Registering the plugin failed
  * @note This function allocates memory
+ * @note The plugin's callbacks and data are copied into the chain, so changing the struct after
+ *       registering it has no effect
+ *
+ * This can be called while the chain is in use. Packets already going through the chain finish
+ * without the new plugin.
+ *
+ * A plugin with a free_state callback is given a per-connection state slot on this chain, passed
+ * to its callbacks in packet->state_slot. The slot stays the plugin's for the life of the chain,
+ * and its free_state callback and data must stay valid for as long as any connection using the
+ * chain exists.
  */
 he_return_code_t he_plugin_register_plugin(he_plugin_chain_t *chain, plugin_struct_t *plugin);
 
+/**
+ * @brief Removes a plugin from the plugin chain
+ * @param chain A pointer to a valid plugin chain
+ * @param plugin The plugin as it was passed to he_plugin_register_plugin()
+ * @return HE_SUCCESS The plugin was removed
+ * @return HE_ERR_NULL_POINTER Either parameter was NULL
+ * @return HE_ERR_PLUGIN_NOT_REGISTERED The plugin isn't on the chain
+ * @return HE_ERR_NO_MEMORY The chain could not be rebuilt without the plugin
+ *
+ * Every registration of the plugin is removed. This can be called while the chain is in use;
+ * packets already going through the chain may still be passed to the plugin, so its data must
+ * stay valid until he_plugin_chain_reclaim() no longer reports anything pending.
+ */
+he_return_code_t he_plugin_unregister_plugin(he_plugin_chain_t *chain, plugin_struct_t *plugin);
+
+/**
+ * @brief Registers a thread that will process packets for connections using the chain
+ * @param chain A pointer to a valid plugin chain
+ * @param thread_id Set to the ID to report quiescent states with
+ * @return HE_SUCCESS The thread was registered
+ * @return HE_ERR_NULL_POINTER Either parameter was NULL
+ * @return HE_ERR_TOO_MANY_THREADS HE_PLUGIN_MAX_THREADS threads are already registered
+ *
+ * Hosts that change the chain while it's in use should register every thread that processes
+ * packets. If no threads are registered, old hooks are kept until the chain is destroyed.
+ */
+he_return_code_t he_plugin_chain_register_thread(he_plugin_chain_t *chain, size_t *thread_id);
+
+/**
+ * @brief Reports that the calling thread holds nothing it got from the chain
+ * @param chain A pointer to a valid plugin chain
+ * @param thread_id The ID from he_plugin_chain_register_thread()
+ * @return HE_SUCCESS Always, unless chain is NULL
+ *
+ * Call this between packets, e.g. once per batch read from the network; it is a single atomic
+ * store. Old hooks are held until every online thread has called it since they were swapped out.
+ */
+he_return_code_t he_plugin_chain_quiescent(he_plugin_chain_t *chain, size_t thread_id);
+
+/**
+ * @brief Reports that the calling thread won't use the chain until its next quiescent state
+ * @param chain A pointer to a valid plugin chain
+ * @param thread_id The ID from he_plugin_chain_register_thread()
+ * @return HE_SUCCESS Always, unless chain is NULL
+ *
+ * Call this before a thread blocks waiting for work, so it doesn't hold up freeing old hooks,
+ * and he_plugin_chain_quiescent() before it processes packets again.
+ */
+he_return_code_t he_plugin_chain_thread_offline(he_plugin_chain_t *chain, size_t thread_id);
+
+/**
+ * @brief Frees hooks swapped out of the chain that no thread can still be using
+ * @param chain A pointer to a valid plugin chain
+ * @return size_t The number of old sets of hooks that are still waiting for threads
+ *
+ * Registering and unregistering plugins does this already; call it to catch up later.
+ */
+size_t he_plugin_chain_reclaim(he_plugin_chain_t *chain);
+
 /**
  * @brief Execute the ingress function of each registered plugin
  * @param chain A pointer to a valid plugin chain
@@ -1221,4 +2020,654 @@ he_return_code_t he_plugin_ingress(he_plugin_chain_t *chain, uint8_t *packet, si
 he_return_code_t he_plugin_egress(he_plugin_chain_t *chain, uint8_t *packet, size_t *length,
                                   size_t capacity);
 
+/**
+ * @brief Execute the ingress function of each registered plugin on a packet with room around it
+ * @param chain A pointer to a valid plugin chain
+ * @param packet The packet, updated as plugins move its start or change its length
+ * @return HE_SUCCESS All plugins executed successfully
+ * @return HE_ERR_PLUGIN_DROP A plugin marked this packet for a drop
+ * @return HE_ERR_FAILED An error occurred processing this packet
+ * @note This MAY alter the contents of packet, depending on the registered plugins
+ *
+ * Unlike he_plugin_ingress(), plugins can use the headroom to add to the front of the packet
+ * without copying it.
+ */
+he_return_code_t he_plugin_ingress_packet(he_plugin_chain_t *chain, he_plugin_packet_t *packet);
+
+/**
+ * @brief Execute the egress function of each registered plugin on a packet with room around it
+ * @param chain A pointer to a valid plugin chain
+ * @param packet The packet, updated as plugins move its start or change its length
+ * @return HE_SUCCESS All plugins executed successfully
+ * @return HE_ERR_PLUGIN_DROP A plugin marked this packet for a drop
+ * @return HE_ERR_FAILED An error occurred processing this packet
+ * @note This MAY alter the contents of packet, depending on the registered plugins
+ */
+he_return_code_t he_plugin_egress_packet(he_plugin_chain_t *chain, he_plugin_packet_t *packet);
+
+/**
+ * @brief Execute the ingress functions of each registered plugin on a batch of packets
+ * @param chain A pointer to a valid plugin chain
+ * @param packets The packets, updated as plugins move their starts or change their lengths
+ * @param results Set to the outcome for each packet, as he_plugin_ingress() would return it
+ * @param count The number of packets
+ * @return HE_SUCCESS The batch was processed; see results for each packet
+ * @return HE_ERR_NULL_POINTER Either of the arrays supplied is NULL
+ * @note This MAY alter the contents of packets, depending on the registered plugins
+ *
+ * Plugins with a batch callback are called with up to HE_PLUGIN_MAX_BATCH packets at a time, and
+ * the others once per packet. A packet that a plugin drops or fails is not passed to the plugins
+ * after it.
+ */
+he_return_code_t he_plugin_ingress_batch(he_plugin_chain_t *chain, he_plugin_packet_t *packets,
+                                         he_return_code_t *results, size_t count);
+
+/**
+ * @brief Execute the egress functions of each registered plugin on a batch of packets
+ * @param chain A pointer to a valid plugin chain
+ * @param packets The packets, updated as plugins move their starts or change their lengths
+ * @param results Set to the outcome for each packet, as he_plugin_egress() would return it
+ * @param count The number of packets
+ * @return HE_SUCCESS The batch was processed; see results for each packet
+ * @return HE_ERR_NULL_POINTER Either of the arrays supplied is NULL
+ * @note This MAY alter the contents of packets, depending on the registered plugins
+ */
+he_return_code_t he_plugin_egress_batch(he_plugin_chain_t *chain, he_plugin_packet_t *packets,
+                                        he_return_code_t *results, size_t count);
+
+/**
+ * @brief Checks a new D/TLS ClientHello for a valid stateless cookie
+ * @param ctx A pointer to a valid, started SSL context
+ * @param peer_address The sender's address in the host's native format (e.g. a struct sockaddr)
+ * @param peer_address_length The length of the sender's address
+ * @param packet A pointer to the datagram as received from the network, including the wire header
+ * @param length The length of the datagram
+ * @param response A buffer to write a HelloVerifyRequest into
+ * @param response_length In: the size of the response buffer, out: the length of the response
+ * @param previous_secret If not NULL, set after HE_SUCCESS to whether the cookie was issued under
+ *        the previous cookie secret
+ * @return HE_SUCCESS The ClientHello carries a valid cookie, a connection can now be created
+ * @return HE_WANT_COOKIE A HelloVerifyRequest has been written to the response buffer. The host
+ *         should send it to the peer and must not create a connection
+ * @return HE_ERR_NULL_POINTER One of the pointers supplied is NULL
+ * @return HE_ERR_INVALID_CONNECTION_TYPE The context is not a datagram context
+ * @return HE_ERR_INVALID_CLIENT_STATE Stateless cookies have not been enabled on this context
+ * @return HE_ERR_PACKET_TOO_LARGE The peer address or the response is too large
+ * @return HE_ERR_PACKET_TOO_SMALL The datagram is too small to be a Helium packet
+ * @return HE_ERR_NOT_HE_PACKET The datagram is not a Helium packet
+ * @return HE_ERR_INCORRECT_PROTOCOL_VERSION The datagram uses an unsupported protocol version
+ * @return HE_ERR_BAD_PACKET The datagram is not an initial D/TLS ClientHello
+ *
+ * The host should call this for datagrams that do not belong to any existing connection. Any
+ * return code other than HE_SUCCESS and HE_WANT_COOKIE means the datagram should be dropped.
+ * A response buffer of HE_MAX_WIRE_MTU bytes is always large enough.
+ *
+ * After HE_SUCCESS the host must pass the same peer address to he_conn_set_peer_address(), and
+ * previous_secret to he_conn_set_use_previous_cookie_secret(), before calling
+ * he_conn_server_connect(). WolfSSL then checks the cookie against the secret that issued it.
+ *
+ * @note This function does not modify the context, so it is safe to call from several threads at
+ *       once, as long as the cookie secret is not being rotated at the same time.
+ * @see he_ssl_ctx_set_use_stateless_cookies()
+ */
+he_return_code_t he_ssl_ctx_verify_client_hello(he_ssl_ctx_t *ctx, const uint8_t *peer_address,
+                                                size_t peer_address_length, const uint8_t *packet,
+                                                size_t length, uint8_t *response,
+                                                size_t *response_length, bool *previous_secret);
+
+/**
+ * @brief Limits the rate at which the server accepts new handshakes
+ * @param ctx A pointer to a valid SSL context
+ * @param handshakes_per_second The sustained number of handshakes to admit per second. Zero
+ *        disables admission control, which is the default
+ * @param burst The number of handshakes that may be admitted back to back once the server has been
+ *        idle. Must be at least one
+ * @return HE_SUCCESS The limit was set
+ * @return HE_ERR_NULL_POINTER The ctx pointer supplied is NULL
+ * @return HE_ERR_ZERO_SIZE The burst is zero while a rate was given
+ *
+ * A part of the burst (HE_HANDSHAKE_PRIORITY_RESERVE_PERCENT) is held back for resumptions and
+ * roaming clients, so they keep getting through while fresh full handshakes are being throttled.
+ * Handshakes are only counted as either once he_ssl_ctx_set_returning_client_cb() has confirmed
+ * them, without that callback everything is a full handshake and the reserve goes unused.
+ *
+ * @note This resets the governor, so should be called during configuration and not while other
+ *       threads may be calling he_ssl_ctx_admit_handshake()
+ * @see he_ssl_ctx_admit_handshake()
+ */
+he_return_code_t he_ssl_ctx_set_handshake_rate(he_ssl_ctx_t *ctx, uint32_t handshakes_per_second,
+                                               uint32_t burst);
+
+/**
+ * @brief Sets the function that confirms a handshake comes from a returning client
+ * @param ctx A pointer to a valid SSL context
+ * @param returning_client_cb The function to call, or NULL to treat every handshake as a full one
+ *
+ * The Helium session in the wire header and the D/TLS session ID in the ClientHello are chosen by
+ * the client. A flood that simply sets them would otherwise use up the capacity held back for
+ * returning clients, so he_ssl_ctx_admit_handshake() asks the host about them first: is this a
+ * session it has a connection for, or a D/TLS session still in its cache?
+ *
+ * The callback is made from he_ssl_ctx_admit_handshake() and so must be just as cheap and safe to
+ * call from several threads at once.
+ */
+void he_ssl_ctx_set_returning_client_cb(he_ssl_ctx_t *ctx,
+                                        he_returning_client_cb_t returning_client_cb);
+
+/**
+ * @brief Decides whether a new handshake should be started now
+ * @param ctx A pointer to a valid SSL context
+ * @param packet A pointer to the first datagram from the client, including the wire header
+ * @param length The length of the datagram
+ * @param now_ms The current time in milliseconds, from any monotonic clock the host likes
+ * @param retry_after_ms If not NULL, set to the number of milliseconds after which a throttled
+ *        handshake of the same class would be admitted
+ * @return HE_SUCCESS The handshake was admitted, the host should create a connection for it
+ * @return HE_ERR_HANDSHAKE_THROTTLED The server is at its limit. The host should drop the
+ *         datagram without creating a connection
+ * @return HE_ERR_NULL_POINTER The ctx or packet pointer supplied is NULL
+ *
+ * This is cheap enough to run for every unknown datagram and never blocks -- it is safe to call
+ * from several threads at once. When stateless cookies are in use, call this only after
+ * he_ssl_ctx_verify_client_hello() has returned HE_SUCCESS, so that spoofed traffic can't use up
+ * the handshake budget.
+ */
+he_return_code_t he_ssl_ctx_admit_handshake(he_ssl_ctx_t *ctx, const uint8_t *packet,
+                                            size_t length, uint64_t now_ms,
+                                            uint32_t *retry_after_ms);
+
+/**
+ * @brief Export an online D/TLS connection
+ * @param conn A pointer to a valid, online connection
+ * @param buffer The buffer to write the export to, or NULL to find out how large it needs to be
+ * @param length In: the size of the buffer, out: the length of the export. If buffer is NULL, the
+ *        maximum size an export can be
+ * @return HE_SUCCESS The connection was exported
+ * @return HE_ERR_NULL_POINTER The conn or length pointer is NULL
+ * @return HE_ERR_INVALID_CONNECTION_TYPE Only datagram connections can be exported
+ * @return HE_ERR_INVALID_CLIENT_STATE The connection isn't online, or is renegotiating
+ * @return HE_ERR_CONF_EXPORT_KEY_NOT_SET No export key has been set on the SSL context
+ * @return HE_ERR_PACKET_TOO_LARGE The export doesn't fit in the buffer
+ * @return HE_ERR_SSL_ERROR WolfSSL could not export its state
+ * @return HE_ERR_NOT_SUPPORTED WolfSSL was built without session export support
+ *
+ * The export is sealed with AES-256-GCM under the key given to he_ssl_ctx_set_export_key(), so it
+ * can be kept in untrusted storage. Exporting does not change the connection, but the host must
+ * stop using it and destroy it once the export has been handed over -- two live copies of one
+ * connection would reuse D/TLS sequence numbers.
+ *
+ * @note Exports contain values in host byte order and can only be imported on a machine with the
+ *       same endianness
+ */
+he_return_code_t he_conn_export(he_conn_t *conn, uint8_t *buffer, size_t *length);
+
+/**
+ * @brief Restore a connection from an export
+ * @param conn A pointer to a newly created connection
+ * @param ctx A pointer to a started SSL context with the same configuration and export key as the
+ *        one the connection was exported from
+ * @param plugins A pointer to the plugin chain for this connection, can be NULL
+ * @param buffer A pointer to the export
+ * @param length The length of the export
+ * @return HE_SUCCESS The connection was restored and is online
+ * @return HE_ERR_NULL_POINTER One of the pointers is NULL
+ * @return HE_ERR_INVALID_CLIENT_STATE The connection has already been connected
+ * @return HE_ERR_CONF_EXPORT_KEY_NOT_SET No export key has been set on the SSL context
+ * @return HE_ERR_BAD_PACKET The export is malformed, has been tampered with, or was sealed with a
+ *         different key
+ * @return HE_ERR_INCORRECT_PROTOCOL_VERSION The export uses a protocol version the context does
+ *         not support
+ * @return HE_ERR_INIT_FAILED WolfSSL could not create the connection
+ * @return HE_ERR_SSL_ERROR WolfSSL could not import its state
+ * @return HE_ERR_NOT_SUPPORTED WolfSSL was built without session export support
+ * @return HE_ERR_IP_POOL_ADDRESS_TAKEN The connection's address is from the context's pool and
+ *         another connection already has it
+ *
+ * The connection goes straight to HE_STATE_ONLINE without a state change callback. If it was
+ * given an address from a pool and the context's pool covers it, it keeps that address.
+ *
+ * Exports from older versions of Helium, as far back as HE_CONN_EXPORT_MIN_VERSION, can be
+ * imported, so connections survive an upgrade of the server.
+ */
+he_return_code_t he_conn_import(he_conn_t *conn, he_ssl_ctx_t *ctx, he_plugin_chain_t *plugins,
+                                const uint8_t *buffer, size_t length);
+
+/**
+ * @brief Frees the D/TLS state of an idle connection until it is next needed
+ * @param conn A pointer to a valid, online connection
+ * @param ctx A pointer to the SSL context the connection was created with
+ * @return HE_SUCCESS The connection is hibernating (or already was)
+ * @return HE_ERR_NULL_POINTER The conn or ctx pointer is NULL
+ * @return HE_ERR_NO_MEMORY Not enough memory to hold the sealed state
+ * @return Any error returned by he_conn_export()
+ *
+ * The connection is exported into a small buffer and its WOLFSSL object is freed, which is where
+ * nearly all of a connection's memory goes. It stays online: the next call to
+ * he_conn_outside_data_received(), he_conn_inside_packet_received(), he_conn_send_keepalive() or
+ * he_conn_disconnect() rebuilds the D/TLS session before carrying on as normal. The host doesn't
+ * need to do anything else.
+ *
+ * Hosts that know better when a connection has gone quiet can call this directly, otherwise see
+ * he_conn_hibernate_if_idle().
+ *
+ * @note Requires an export key on the SSL context, see he_ssl_ctx_set_export_key()
+ */
+he_return_code_t he_conn_hibernate(he_conn_t *conn, he_ssl_ctx_t *ctx);
+
+/**
+ * @brief Hibernates a connection that has been idle for the SSL context's hibernate idle time
+ * @param conn A pointer to a valid connection
+ * @param ctx A pointer to the SSL context the connection was created with
+ * @return HE_SUCCESS The connection was hibernated, or wasn't idle for long enough yet
+ * @return HE_ERR_INVALID_CLIENT_STATE The connection isn't online
+ * @return HE_ERR_NULL_POINTER The conn or ctx pointer supplied is NULL
+ * @return Any error returned by he_conn_hibernate()
+ *
+ * A connection is idle while it neither receives records from the peer nor sends packets from the
+ * inside. Nothing is done unless an idle time has been set with
+ * he_ssl_ctx_set_hibernate_idle_time(). As with he_conn_send_keepalive_if_idle(), the host should
+ * call this regularly, e.g. every second, and idle time is measured in steps of however often it
+ * is called. Connections sending idle keepalives more often than the idle time never hibernate.
+ *
+ * Idle connections can't be found without a timer per connection, which would cost as much memory
+ * on the data path as hibernating saves, so Helium leaves visiting them to the host.
+ */
+he_return_code_t he_conn_hibernate_if_idle(he_conn_t *conn, he_ssl_ctx_t *ctx);
+
+/**
+ * @brief Returns whether a connection is hibernating
+ * @param conn A pointer to a valid connection
+ * @return bool Whether the connection is hibernating
+ */
+bool he_conn_is_hibernating(he_conn_t *conn);
+
+/**
+ * @brief Returns the amount of memory needed for a snapshot store
+ * @param capacity The number of connections the store should be able to hold
+ * @return size_t The size in bytes of the memory region to give to he_snapshot_store_init()
+ *
+ * The store is an open addressing hash table, so should be sized with some headroom -- a capacity
+ * of 25% more than the number of connections to be saved keeps lookups short.
+ */
+size_t he_snapshot_store_size(uint32_t capacity);
+
+/**
+ * @brief Creates an empty snapshot store in the memory region provided
+ * @param region A pointer to the memory to use, aligned to at least 8 bytes
+ * @param length The size of the region
+ * @param capacity The number of connections the store should be able to hold
+ * @return he_snapshot_store_t* A pointer to the store, or NULL if the region is NULL, misaligned,
+ *         too small for the capacity, or the capacity is zero
+ *
+ * The region is owned by the host, which must keep it mapped for as long as the store is used.
+ * Helium never frees it.
+ */
+he_snapshot_store_t *he_snapshot_store_init(void *region, size_t length, uint32_t capacity);
+
+/**
+ * @brief Opens a snapshot store created by he_snapshot_store_init(), usually by another process
+ * @param region A pointer to the mapped store
+ * @param length The size of the mapping
+ * @return he_snapshot_store_t* A pointer to the store, or NULL if the region doesn't contain a
+ *         store this version of Helium understands
+ */
+he_snapshot_store_t *he_snapshot_store_attach(void *region, size_t length);
+
+/**
+ * @brief Exports a connection into the store
+ * @param store A pointer to a valid snapshot store
+ * @param conn A pointer to an online connection
+ * @return HE_SUCCESS The connection was saved
+ * @return HE_ERR_NULL_POINTER The store or conn pointer supplied is NULL
+ * @return HE_ERR_NO_MEMORY The store is full
+ * @return HE_ERR_PACKET_TOO_LARGE The connection's export doesn't fit in a slot
+ * @return Any error returned by he_conn_export()
+ *
+ * Saving the same session twice replaces the earlier copy. As with he_conn_export(), the host
+ * must not use the connection for anything else once it has been saved.
+ *
+ * @caution Saving is not thread safe, use one thread to save all connections
+ */
+he_return_code_t he_snapshot_store_save(he_snapshot_store_t *store, he_conn_t *conn);
+
+/**
+ * @brief Restores a connection from the store
+ * @param store A pointer to a valid snapshot store
+ * @param session_id The session ID from the wire header of the packet that needs a connection
+ * @param conn A pointer to a newly created connection
+ * @param ctx A pointer to a started SSL context with the same export key as the old process
+ * @param plugins A pointer to the plugin chain for this connection, can be NULL
+ * @return HE_SUCCESS The connection was restored and is online. The host can now pass it the
+ *         packet it was looking up
+ * @return HE_ERR_NULL_POINTER The store, conn or ctx pointer supplied is NULL
+ * @return HE_ERR_UNKNOWN_SESSION The store has no connection for this session, or it has already
+ *         been restored
+ * @return Any error returned by he_conn_import()
+ *
+ * Each saved connection is handed out once. If the import fails the slot is still used up, and
+ * the client falls back to a new handshake as it would have without a snapshot.
+ *
+ * This is safe to call from several threads at once.
+ */
+he_return_code_t he_snapshot_store_restore(he_snapshot_store_t *store, uint64_t session_id,
+                                           he_conn_t *conn, he_ssl_ctx_t *ctx,
+                                           he_plugin_chain_t *plugins);
+
+/**
+ * @brief Creates a timer wheel
+ * @param now_ms The current time in milliseconds, from any monotonic clock the host likes
+ * @return he_timers_t* Returns a pointer to a timer wheel, or NULL if it could not be allocated
+ * @note The same clock must be used for every call to he_timers_advance(), and it must count
+ *       real milliseconds
+ */
+he_timers_t *he_timers_create(uint64_t now_ms);
+
+/**
+ * @brief Releases all memory allocated by a timer wheel
+ * @param timers A pointer to a timer wheel, can be NULL
+ * @return HE_SUCCESS This function cannot fail
+ * @note Connections using the wheel must be destroyed, or moved to another wheel, first
+ */
+he_return_code_t he_timers_destroy(he_timers_t *timers);
+
+/**
+ * @brief Nudges every connection whose timer has expired
+ * @param timers A pointer to a valid timer wheel
+ * @param now_ms The current time in milliseconds
+ * @return HE_SUCCESS The wheel was advanced
+ * @return HE_ERR_NULL_POINTER The timers pointer supplied is NULL
+ *
+ * Each expired connection has he_conn_nudge() called on it. A connection that times out changes to
+ * HE_STATE_DISCONNECTED, which the host sees through the state change callback as usual. The host
+ * may destroy connections from within its callbacks.
+ *
+ * @caution A timer wheel is not thread safe. Hosts that run connections on several threads should
+ *          give each thread its own wheel, see he_conn_set_timers()
+ */
+he_return_code_t he_timers_advance(he_timers_t *timers, uint64_t now_ms);
+
+/**
+ * @brief Returns when he_timers_advance() next needs to be called
+ * @param timers A pointer to a valid timer wheel
+ * @return uint64_t The time in milliseconds at which the wheel next has work to do, or
+ *         HE_TIMERS_NO_DEADLINE if there are no timers pending (or the pointer is NULL)
+ *
+ * This is intended for setting the timeout of the host's event loop. Usually it's when the next
+ * timer expires; timers far in the future are sorted lazily, so it can also be when some of them
+ * need moving closer, which costs the host an early wake-up now and then. It looks at no more
+ * than HE_TIMERS_LEVELS * HE_TIMERS_SLOTS slots however many timers there are, and never at the
+ * timers themselves -- call it once per loop iteration, not once per packet.
+ */
+uint64_t he_timers_next_deadline(he_timers_t *timers);
+
+/**
+ * @brief Runs path MTU discovery, sending a probe if one is due
+ * @param conn A pointer to a valid connection
+ * @return HE_SUCCESS A probe was sent, or none was due
+ * @return HE_ERR_NULL_POINTER The conn pointer supplied is NULL
+ * @return HE_ERR_INVALID_CLIENT_STATE The connection isn't online
+ * @return HE_ERR_NOT_SUPPORTED The connection isn't using D/TLS; TCP takes care of its own MTU
+ *
+ * The first call starts the search. The host should then call this regularly, e.g. every second,
+ * to time out lost probes. Answered probes move the search on straight away. What was found is
+ * sent to the peer, which uses it to limit what it sends us. Whenever the MTU of the tunnel
+ * changes, because of a search at either end, HE_EVENT_PMTU_UPDATED is generated and the host
+ * should update the MTU of its TUN device to he_conn_get_effective_mtu().
+ *
+ * Once the search is done, it is repeated every 10 minutes in case the path has changed.
+ *
+ * @note Both ends must be running a version of Helium that answers PINGs with their sequence
+ *       number. If the peer doesn't, no probe will ever be answered and the MTU is left as it is.
+ */
+he_return_code_t he_conn_send_pmtu_probe_if_due(he_conn_t *conn);
+
+/**
+ * @brief Called when the host application needs to deliver an inside packet read from a TUN
+ *        device with a virtio-net header
+ * @param conn A valid connection
+ * @param vnet_hdr The virtio-net header that came with the packet
+ * @param packet A pointer to the packet data, which is consumed if it's segmented, see below
+ * @param length The length of the packet
+ * @return HE_ERR_NULL_POINTER Any of the pointers supplied are NULL
+ * @return HE_ERR_INVALID_CLIENT_STATE Helium will reject packets if it is not in the
+ * HE_STATE_ONLINE state
+ * @return HE_ERR_UNSUPPORTED_PACKET_TYPE The header asks for a kind of segmentation other than
+ * TCP over IPv4
+ * @return HE_ERR_BAD_PACKET The packet doesn't match its header
+ * @return HE_SUCCESS All segments of the packet were processed normally
+ * @return Anything he_conn_inside_packet_received() can return for a segment
+ *
+ * Ordinary packets are passed to he_conn_inside_packet_received() once their checksum is
+ * completed, if the header says it needs to be. Super-packets are split into segments of the
+ * header's gso_size, each with its own IPv4 and TCP headers and checksums, and each of those is
+ * passed along in turn. Segments are built in place, each one's headers written over the end of
+ * the segment before it, so nothing is copied other than into the records themselves.
+ *
+ * Every segment has the same destination and none is larger than the first, so a segment that
+ * is bypassed or too large is always the first one. When the first segment is refused the packet
+ * is put back as it was, so the host can still act on it, e.g. send it outside the tunnel on
+ * HE_ERR_PACKET_BYPASSED. Once a segment has been accepted the packet has been consumed: its
+ * contents are no longer the original packet, even if a later segment fails, and the host must
+ * not send it anywhere.
+ */
+he_return_code_t he_conn_inside_gso_packet_received(he_conn_t *conn,
+                                                    const he_virtio_net_hdr_t *vnet_hdr,
+                                                    uint8_t *packet, size_t length);
+
+/**
+ * @brief Works out the 5-tuple and flow hash of an IPv4 packet
+ * @param packet A pointer to the packet
+ * @param length The length of the packet
+ * @param flow Set to the packet's flow
+ * @return HE_SUCCESS The flow was filled in
+ * @return HE_ERR_NULL_POINTER The packet or flow pointer supplied is NULL
+ * @return HE_ERR_PACKET_TOO_SMALL The packet is too small to be an IPv4 packet
+ * @return HE_ERR_UNSUPPORTED_PACKET_TYPE The packet is not an IPv4 packet
+ * @return HE_ERR_BAD_PACKET The IPv4 header length is wrong
+ *
+ * Helium does this for incoming packets when the inside write flow or GRO callback is set, the
+ * latter once per super-packet. Hosts can call
+ * it on outgoing packets, before passing them to he_conn_inside_packet_received(), to classify
+ * them the same way.
+ */
+he_return_code_t he_flow_classify(const uint8_t *packet, size_t length, he_flow_info_t *flow);
+
+/**
+ * @brief Creates an address pool
+ * @param cidr The range to hand out, e.g. "10.125.0.0/16". The prefix must be between
+ *        HE_IP_POOL_MIN_PREFIX and HE_IP_POOL_MAX_PREFIX.
+ * @return he_ip_pool_t* Returns a pointer to an address pool, or NULL if the range is not valid or
+ *         the pool could not be allocated
+ */
+he_ip_pool_t *he_ip_pool_create(const char *cidr);
+
+/**
+ * @brief Releases all memory allocated by an address pool
+ * @param pool A pointer to an address pool, can be NULL
+ * @return HE_SUCCESS This function cannot fail
+ * @note Connections with addresses from the pool, and SSL contexts using it, must be destroyed
+ *       first. Destroyed connections still waiting for lookup threads are freed with the pool.
+ */
+he_return_code_t he_ip_pool_destroy(he_ip_pool_t *pool);
+
+/**
+ * @brief Returns how many addresses in the pool are free
+ * @param pool A pointer to a valid address pool
+ * @return size_t The number of free addresses, 0 if the pointer is NULL
+ */
+size_t he_ip_pool_available(he_ip_pool_t *pool);
+
+/**
+ * @brief Finds the connection that was given an address
+ * @param pool A pointer to a valid address pool
+ * @param address The address, in network byte order, e.g. straight from a packet's destination
+ * @return he_conn_t* The connection, or NULL if the address isn't from this pool or not in use
+ *
+ * This is what servers need to do with every packet coming back from the Internet before calling
+ * he_conn_inside_packet_received().
+ *
+ * The connection stays valid until the calling thread's next he_ip_pool_quiescent(), even if it is
+ * destroyed in the meantime, as long as the thread is registered with he_ip_pool_register_thread().
+ *
+ * @caution Without any registered threads he_conn_destroy() frees connections straight away, and
+ *          hosts that look up connections on one thread and destroy them on another must make sure
+ *          no thread can still be using a connection before destroying it.
+ */
+he_conn_t *he_ip_pool_lookup(he_ip_pool_t *pool, uint32_t address);
+
+/**
+ * @brief Finds the connection each of a batch of IPv4 packets is destined to
+ * @param pool A pointer to a valid address pool
+ * @param packets The packets, as read from the TUN device
+ * @param lengths The length of each packet
+ * @param count How many packets there are
+ * @param conns Set to the connection each packet is for, or NULL if it isn't for any connection
+ * @return size_t The number of packets that are for a connection, 0 if any pointer is NULL
+ *
+ * Does the same as calling he_ip_pool_lookup() with the destination address of every packet, for
+ * hosts that read packets in batches with recvmmsg() or similar.
+ *
+ * @see he_ip_pool_lookup()
+ */
+size_t he_ip_pool_lookup_batch(he_ip_pool_t *pool, uint8_t *const *packets, const size_t *lengths,
+                               size_t count, he_conn_t **conns);
+
+/**
+ * @brief Registers a thread that will look up connections in the pool
+ * @param pool A pointer to a valid address pool
+ * @param thread_id Set to the ID to report quiescent states with
+ * @return HE_SUCCESS The thread was registered
+ * @return HE_ERR_NULL_POINTER Either parameter was NULL
+ * @return HE_ERR_TOO_MANY_THREADS HE_GRACE_MAX_THREADS threads are already registered
+ *
+ * Once any thread is registered, he_conn_destroy() leaves connections with an address from the
+ * pool for the pool to free, so every thread that looks up connections should be registered.
+ */
+he_return_code_t he_ip_pool_register_thread(he_ip_pool_t *pool, size_t *thread_id);
+
+/**
+ * @brief Reports that the calling thread holds no connection it looked up in the pool
+ * @param pool A pointer to a valid address pool
+ * @param thread_id The ID from he_ip_pool_register_thread()
+ * @return HE_SUCCESS Always, unless pool is NULL
+ *
+ * Call this between packets, e.g. once per batch read from the TUN device; it is a single atomic
+ * store.
+ */
+he_return_code_t he_ip_pool_quiescent(he_ip_pool_t *pool, size_t thread_id);
+
+/**
+ * @brief Reports that the calling thread won't look up connections until its next quiescent state
+ * @param pool A pointer to a valid address pool
+ * @param thread_id The ID from he_ip_pool_register_thread()
+ * @return HE_SUCCESS Always, unless pool is NULL
+ *
+ * Call this before a thread blocks waiting for packets, so it doesn't hold up freeing destroyed
+ * connections, and he_ip_pool_quiescent() before it looks up connections again.
+ */
+he_return_code_t he_ip_pool_thread_offline(he_ip_pool_t *pool, size_t thread_id);
+
+/**
+ * @brief Frees destroyed connections that no lookup thread can still hold
+ * @param pool A pointer to a valid address pool
+ * @return size_t The number of destroyed connections still waiting for threads, 0 if pool is NULL
+ *
+ * Destroying connections does this already; call it to catch up later, e.g. from a timer.
+ */
+size_t he_ip_pool_reclaim(he_ip_pool_t *pool);
+
+/**
+ * @brief Creates an empty route table
+ * @param default_verdict What to do with packets that don't match any route
+ * @return he_route_table_t* Returns a pointer to a route table, or NULL if it could not be
+ *         allocated
+ */
+he_route_table_t *he_route_table_create(he_route_verdict_t default_verdict);
+
+/**
+ * @brief Releases all memory allocated by a route table
+ * @param table A pointer to a route table, can be NULL
+ * @return HE_SUCCESS This function cannot fail
+ * @note The table must not be in use by a connection
+ */
+he_return_code_t he_route_table_destroy(he_route_table_t *table);
+
+/**
+ * @brief Adds a route
+ * @param table A pointer to a valid route table
+ * @param cidr The prefix the route covers, e.g. "192.168.0.0/16"
+ * @param verdict What to do with packets to the prefix
+ * @return HE_SUCCESS The route was added
+ * @return HE_ERR_NULL_POINTER Any of the pointers supplied is NULL
+ * @return HE_ERR_INVALID_ROUTE The prefix is not valid
+ * @return HE_ERR_NO_MEMORY The table could not grow to fit the route
+ *
+ * Routes can be added in any order; the longest one matching an address decides. Adding a route
+ * for a prefix that already has one replaces its verdict.
+ *
+ * @caution Routes must not be added to a table that is in use by a connection
+ */
+he_return_code_t he_route_table_add(he_route_table_t *table, const char *cidr,
+                                    he_route_verdict_t verdict);
+
+/**
+ * @brief Finds the verdict for a destination address
+ * @param table A pointer to a valid route table
+ * @param address The destination address, in network byte order
+ * @return he_route_verdict_t The verdict of the longest matching route, or the table's default
+ */
+he_route_verdict_t he_route_table_lookup(const he_route_table_t *table, uint32_t address);
+
+/**
+ * @brief Sets the route table inside packets are checked against before going through the tunnel
+ * @param conn A pointer to a valid connection
+ * @param table A pointer to a route table, or NULL to send everything through the tunnel
+ * @return he_route_table_t* The table that was in use before, NULL if there wasn't one
+ *
+ * With a table set, he_conn_inside_packet_received() returns HE_ERR_PACKET_BYPASSED for packets
+ * that match a bypass route, without doing anything else with them. The host then sends them
+ * directly.
+ *
+ * The swap is atomic, so this can be called while another thread is sending packets. A packet
+ * already being checked against the old table holds this call up until it is done, so the table
+ * returned can be destroyed straight away.
+ */
+he_route_table_t *he_conn_set_route_table(he_conn_t *conn, he_route_table_t *table);
+
+/**
+ * @brief Returns the route table set on a connection
+ * @param conn A pointer to a valid connection
+ * @return he_route_table_t* The table, NULL if there isn't one
+ * @caution The table is not held, it may be destroyed as soon as another thread replaces it
+ */
+he_route_table_t *he_conn_get_route_table(he_conn_t *conn);
+
+/**
+ * @brief Adds up the counters of an SSL context
+ * @param ctx A pointer to a valid SSL context
+ * @param metrics Filled in with the totals since the context was created
+ * @return HE_SUCCESS The totals were filled in
+ * @return HE_ERR_NULL_POINTER Either pointer is NULL
+ *
+ * Safe to call from any thread while connections are in use. Each counter is read exactly once,
+ * so the snapshot doesn't change while it is being looked at or rendered.
+ */
+he_return_code_t he_ssl_ctx_get_metrics(he_ssl_ctx_t *ctx, he_metrics_t *metrics);
+
+/**
+ * @brief Renders a snapshot in the OpenMetrics text format, e.g. for a Prometheus scrape
+ * @param metrics A snapshot from he_ssl_ctx_get_metrics()
+ * @param buffer The buffer to render into, or NULL to find out how large it needs to be
+ * @param length In: the size of the buffer, out: the length of the text, not including the NUL
+ *        terminator it is followed by
+ * @return HE_SUCCESS The snapshot was rendered
+ * @return HE_ERR_NULL_POINTER The metrics or length pointer is NULL
+ * @return HE_ERR_PACKET_TOO_LARGE The text and its terminator don't fit in the buffer, length has
+ *         been set to the length of the text
+ *
+ * Nothing is allocated. Rendering the same snapshot always gives the same text, so the length
+ * found with a NULL buffer is exactly what is needed for that snapshot.
+ */
+he_return_code_t he_metrics_render(const he_metrics_t *metrics, char *buffer, size_t *length);
+
 #endif
@@ -19,12 +19,86 @@
 /**
  * @file stats_plugin.h
  * @brief Public API for the example stats_plugin
+ *
+ * Counts packets and bytes and keeps log-linear histograms of packet sizes and of the time between
+ * packets on each connection, sharded by thread. Take a snapshot whenever you want to report.
  */
 #ifndef HE_STATS_PLUGIN
 #define HE_STATS_PLUGIN
 #include <helium.h>
 
+/// Buckets per power of two are 2 ^ STATS_SUB_BUCKET_BITS
+#define STATS_SUB_BUCKET_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BUCKET_BITS)
+/// Larger values are recorded as this
+#define STATS_MAX_VALUE UINT32_MAX
+#define STATS_HISTOGRAM_BUCKETS ((32 - STATS_SUB_BUCKET_BITS + 1) * STATS_SUB_BUCKETS)
+
+typedef struct stats_histogram {
+  /// Number of values recorded
+  uint64_t count;
+  /// Sum of the values recorded
+  uint64_t sum;
+  uint64_t buckets[STATS_HISTOGRAM_BUCKETS];
+} stats_histogram_t;
+
+typedef struct stats_direction {
+  /// Packet sizes in bytes; count and sum are the packet and byte counters
+  stats_histogram_t sizes;
+  /// Microseconds since the previous packet on the same connection
+  stats_histogram_t gaps;
+} stats_direction_t;
+
+typedef struct stats_snapshot {
+  stats_direction_t ingress;
+  stats_direction_t egress;
+} stats_snapshot_t;
+
+/**
+ * @brief Sets up a stats plugin, ready to be registered
+ * @param plugin_struct The plugin to fill in
+ * @return HE_SUCCESS The plugin is ready
+ * @return HE_ERR_NULL_POINTER plugin_struct was NULL
+ * @return HE_ERR_NO_MEMORY The counters could not be allocated
+ *
+ * Time between packets is only measured for packets that belong to a connection, as the plugin
+ * keeps the time of the last one in the connection's state slot.
+ */
 he_return_code_t stats_plugin_create(plugin_struct_t *plugin_struct);
+
+/**
+ * @brief Frees the counters of a stats plugin
+ * @param plugin_struct The plugin, which must not be on any plugin chain
+ */
 void stats_plugin_destroy(plugin_struct_t *plugin_struct);
 
+/**
+ * @brief Adds up everything the plugin has counted so far
+ * @param plugin_struct A plugin set up with stats_plugin_create()
+ * @param snapshot Filled in with the totals since the plugin was created
+ * @return HE_SUCCESS The snapshot was taken
+ * @return HE_ERR_NULL_POINTER Either parameter was NULL, or the plugin wasn't set up
+ *
+ * Safe to call from any thread while packets are flowing. Counters only go up, so the difference
+ * between two snapshots is what happened in between.
+ */
+he_return_code_t stats_plugin_snapshot(const plugin_struct_t *plugin_struct,
+                                       stats_snapshot_t *snapshot);
+
+/**
+ * @brief Adds one snapshot to another, e.g. to combine several plugins
+ * @param into The snapshot to add to
+ * @param from The snapshot to add
+ */
+void stats_snapshot_merge(stats_snapshot_t *into, const stats_snapshot_t *from);
+
+/**
+ * @brief Finds the value below which a percentage of the recorded values fall
+ * @param histogram The histogram to search
+ * @param percentile Between 0 and 100
+ * @return uint64_t The largest value that would be recorded in the same bucket, or 0 if the
+ *         histogram is empty
+ */
+uint64_t stats_histogram_percentile(const stats_histogram_t *histogram, double percentile);
+
 #endif
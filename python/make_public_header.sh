@@ -17,5 +17,5 @@
 # Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 cat prod/he.h.header > he.h
-python make_header.py ../include/he.h ../src/he/memory.h ../src/he/ssl_ctx.h ../src/he/conn.h ../src/he/flow.h ../src/he/plugin_chain.h >> he.h
+python make_header.py ../include/he.h ../src/he/memory.h ../src/he/ssl_ctx.h ../src/he/conn.h ../src/he/flow.h ../src/he/plugin_chain.h ../src/he/cookie.h ../src/he/admission.h ../src/he/conn_export.h ../src/he/snapshot.h ../src/he/timers.h ../src/he/pmtud.h ../src/he/gso.h ../src/he/flow_hash.h ../src/he/ip_pool.h ../src/he/route_table.h ../src/he/metrics.h >> he.h
 cat prod/he.h.footer >> he.h
@@ -0,0 +1,137 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "admission.h"
+#include "atomic.h"
+#include "cookie.h"
+#include "metrics.h"
+
+he_return_code_t he_ssl_ctx_set_handshake_rate(he_ssl_ctx_t *ctx, uint32_t handshakes_per_second,
+                                               uint32_t burst) {
+  if(!ctx) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  if(handshakes_per_second == 0) {
+    ctx->handshake_interval_us = 0;
+    ctx->handshake_priority_tolerance_us = 0;
+    ctx->handshake_full_tolerance_us = 0;
+    ctx->handshake_tat_us = 0;
+    return HE_SUCCESS;
+  }
+
+  if(burst == 0) {
+    return HE_ERR_ZERO_SIZE;
+  }
+
+  // This is the token bucket expressed as a GCRA: instead of counting tokens we keep the time at
+  // which the bucket would next be full, which can be updated with a single compare and swap.
+  uint64_t interval = 1000000 / handshakes_per_second;
+  if(interval == 0) {
+    interval = 1;
+  }
+
+  uint64_t reserve = (uint64_t)burst * HE_HANDSHAKE_PRIORITY_RESERVE_PERCENT / 100;
+
+  ctx->handshake_interval_us = interval;
+  ctx->handshake_priority_tolerance_us = (burst - 1) * interval;
+  ctx->handshake_full_tolerance_us = (burst - 1 - reserve) * interval;
+  ctx->handshake_tat_us = 0;
+
+  return HE_SUCCESS;
+}
+
+void he_ssl_ctx_set_returning_client_cb(he_ssl_ctx_t *ctx,
+                                        he_returning_client_cb_t returning_client_cb) {
+  ctx->returning_client_cb = returning_client_cb;
+}
+
+he_handshake_class_t he_internal_classify_handshake(he_ssl_ctx_t *ctx, const uint8_t *packet,
+                                                    size_t length) {
+  // The client can claim whatever it likes, only the host can tell whether it's true
+  if(!ctx->returning_client_cb || length < sizeof(he_wire_hdr_t)) {
+    return HE_HANDSHAKE_CLASS_FULL;
+  }
+
+  // A non-zero session means the client may have been connected to us (or a peer server) before
+  const he_wire_hdr_t *hdr = (const he_wire_hdr_t *)packet;
+  uint64_t session = 0;
+  memcpy(&session, &hdr->session, sizeof(uint64_t));
+  if(session != 0 && session != HE_PACKET_SESSION_REJECT &&
+     ctx->returning_client_cb(ctx, session, NULL, 0)) {
+    return HE_HANDSHAKE_CLASS_ROAMING;
+  }
+
+  if(ctx->connection_type != HE_CONNECTION_TYPE_DATAGRAM) {
+    return HE_HANDSHAKE_CLASS_FULL;
+  }
+
+  // A non-empty session ID in the ClientHello is an attempt at resumption
+  he_client_hello_t hello = {0};
+  if(he_internal_parse_client_hello(packet + sizeof(he_wire_hdr_t), length - sizeof(he_wire_hdr_t),
+                                    &hello) == HE_SUCCESS &&
+     hello.session_id_length > 1 &&
+     ctx->returning_client_cb(ctx, 0, hello.session_id + 1, hello.session_id_length - 1)) {
+    return HE_HANDSHAKE_CLASS_RESUMPTION;
+  }
+
+  return HE_HANDSHAKE_CLASS_FULL;
+}
+
+he_return_code_t he_ssl_ctx_admit_handshake(he_ssl_ctx_t *ctx, const uint8_t *packet,
+                                            size_t length, uint64_t now_ms,
+                                            uint32_t *retry_after_ms) {
+  if(!ctx || !packet) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  if(retry_after_ms) {
+    *retry_after_ms = 0;
+  }
+
+  // Admission control is off
+  if(ctx->handshake_interval_us == 0) {
+    return HE_SUCCESS;
+  }
+
+  uint64_t tolerance = ctx->handshake_full_tolerance_us;
+  if(he_internal_classify_handshake(ctx, packet, length) != HE_HANDSHAKE_CLASS_FULL) {
+    tolerance = ctx->handshake_priority_tolerance_us;
+  }
+
+  uint64_t now_us = now_ms * 1000;
+  uint64_t tat = he_atomic_load_u64(&ctx->handshake_tat_us);
+
+  for(;;) {
+    uint64_t start = tat > now_us ? tat : now_us;
+    uint64_t ahead = start - now_us;
+
+    if(ahead > tolerance) {
+      if(retry_after_ms) {
+        *retry_after_ms = (uint32_t)((ahead - tolerance + 999) / 1000);
+      }
+      he_internal_metrics_handshake_failed(&ctx->metrics, HE_ERR_HANDSHAKE_THROTTLED);
+      return HE_ERR_HANDSHAKE_THROTTLED;
+    }
+
+    // On failure tat is refreshed with the value another thread stored, so just try again
+    if(he_atomic_cas_u64(&ctx->handshake_tat_us, &tat, start + ctx->handshake_interval_us)) {
+      return HE_SUCCESS;
+    }
+  }
+}
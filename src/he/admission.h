@@ -0,0 +1,122 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file admission.h
+ * @brief Functions for limiting the rate of new handshakes on a server
+ *
+ * Handshakes are by far the most expensive thing a server does. After a server restart or a
+ * network event, every client reconnects at once and the handshake work can starve established
+ * connections. The admission governor bounds the rate at which new connections are created, while
+ * letting clients that are cheap to serve (resumptions) or that already had a session with us
+ * (roaming clients) through ahead of fresh full handshakes.
+ */
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <he.h>
+
+/// Percentage of the handshake burst that only resumptions and roaming clients may use
+#define HE_HANDSHAKE_PRIORITY_RESERVE_PERCENT 25
+
+/**
+ * @brief How expensive a new handshake is expected to be
+ */
+typedef enum he_handshake_class {
+  /// A fresh, full handshake
+  HE_HANDSHAKE_CLASS_FULL = 0,
+  /// The client is resuming a previous D/TLS session
+  HE_HANDSHAKE_CLASS_RESUMPTION = 1,
+  /// The client had a Helium session and is reconnecting
+  HE_HANDSHAKE_CLASS_ROAMING = 2,
+} he_handshake_class_t;
+
+/**
+ * @brief Limits the rate at which the server accepts new handshakes
+ * @param ctx A pointer to a valid SSL context
+ * @param handshakes_per_second The sustained number of handshakes to admit per second. Zero
+ *        disables admission control, which is the default
+ * @param burst The number of handshakes that may be admitted back to back once the server has been
+ *        idle. Must be at least one
+ * @return HE_SUCCESS The limit was set
+ * @return HE_ERR_NULL_POINTER The ctx pointer supplied is NULL
+ * @return HE_ERR_ZERO_SIZE The burst is zero while a rate was given
+ *
+ * A part of the burst (HE_HANDSHAKE_PRIORITY_RESERVE_PERCENT) is held back for resumptions and
+ * roaming clients, so they keep getting through while fresh full handshakes are being throttled.
+ * Handshakes are only counted as either once he_ssl_ctx_set_returning_client_cb() has confirmed
+ * them, without that callback everything is a full handshake and the reserve goes unused.
+ *
+ * @note This resets the governor, so should be called during configuration and not while other
+ *       threads may be calling he_ssl_ctx_admit_handshake()
+ * @see he_ssl_ctx_admit_handshake()
+ */
+he_return_code_t he_ssl_ctx_set_handshake_rate(he_ssl_ctx_t *ctx, uint32_t handshakes_per_second,
+                                               uint32_t burst);
+
+/**
+ * @brief Sets the function that confirms a handshake comes from a returning client
+ * @param ctx A pointer to a valid SSL context
+ * @param returning_client_cb The function to call, or NULL to treat every handshake as a full one
+ *
+ * The Helium session in the wire header and the D/TLS session ID in the ClientHello are chosen by
+ * the client. A flood that simply sets them would otherwise use up the capacity held back for
+ * returning clients, so he_ssl_ctx_admit_handshake() asks the host about them first: is this a
+ * session it has a connection for, or a D/TLS session still in its cache?
+ *
+ * The callback is made from he_ssl_ctx_admit_handshake() and so must be just as cheap and safe to
+ * call from several threads at once.
+ */
+void he_ssl_ctx_set_returning_client_cb(he_ssl_ctx_t *ctx,
+                                        he_returning_client_cb_t returning_client_cb);
+
+/**
+ * @brief Decides whether a new handshake should be started now
+ * @param ctx A pointer to a valid SSL context
+ * @param packet A pointer to the first datagram from the client, including the wire header
+ * @param length The length of the datagram
+ * @param now_ms The current time in milliseconds, from any monotonic clock the host likes
+ * @param retry_after_ms If not NULL, set to the number of milliseconds after which a throttled
+ *        handshake of the same class would be admitted
+ * @return HE_SUCCESS The handshake was admitted, the host should create a connection for it
+ * @return HE_ERR_HANDSHAKE_THROTTLED The server is at its limit. The host should drop the
+ *         datagram without creating a connection
+ * @return HE_ERR_NULL_POINTER The ctx or packet pointer supplied is NULL
+ *
+ * This is cheap enough to run for every unknown datagram and never blocks -- it is safe to call
+ * from several threads at once. When stateless cookies are in use, call this only after
+ * he_ssl_ctx_verify_client_hello() has returned HE_SUCCESS, so that spoofed traffic can't use up
+ * the handshake budget.
+ */
+he_return_code_t he_ssl_ctx_admit_handshake(he_ssl_ctx_t *ctx, const uint8_t *packet,
+                                            size_t length, uint64_t now_ms,
+                                            uint32_t *retry_after_ms);
+
+/**
+ * @brief Works out which class a new handshake belongs to
+ * @param ctx A pointer to a valid SSL context
+ * @param packet A pointer to the first datagram from the client, including the wire header
+ * @param length The length of the datagram
+ * @return he_handshake_class_t The class of the handshake. Anything that can't be parsed, or that
+ *         the returning client callback doesn't confirm, is treated as a full handshake
+ */
+he_handshake_class_t he_internal_classify_handshake(he_ssl_ctx_t *ctx, const uint8_t *packet,
+                                                    size_t length);
+
+#endif  // ADMISSION_H
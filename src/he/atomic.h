@@ -0,0 +1,103 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file atomic.h
+ * @brief Minimal portable atomic operations
+ *
+ * Helium is built with GCC / Clang on most platforms and MSVC on Windows, which doesn't support
+ * C11 atomics. These wrappers give us the handful of operations we need for state that is shared
+ * between threads via the SSL context.
+ */
+
+#ifndef ATOMIC_H
+#define ATOMIC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+
+static inline uint64_t he_atomic_load_u64(volatile uint64_t *ptr) {
+  // A CAS that never succeeds is the portable way to get an atomic 64 bit load on 32 bit Windows
+  return (uint64_t)_InterlockedCompareExchange64((volatile __int64 *)ptr, 0, 0);
+}
+
+static inline void he_atomic_store_u64(volatile uint64_t *ptr, uint64_t value) {
+  _InterlockedExchange64((volatile __int64 *)ptr, (__int64)value);
+}
+
+static inline uint64_t he_atomic_add_u64(volatile uint64_t *ptr, uint64_t value) {
+  return (uint64_t)_InterlockedExchangeAdd64((volatile __int64 *)ptr, (__int64)value);
+}
+
+static inline uint64_t he_atomic_exchange_u64(volatile uint64_t *ptr, uint64_t value) {
+  return (uint64_t)_InterlockedExchange64((volatile __int64 *)ptr, (__int64)value);
+}
+
+static inline bool he_atomic_cas_u64(volatile uint64_t *ptr, uint64_t *expected,
+                                     uint64_t desired) {
+  __int64 previous = _InterlockedCompareExchange64((volatile __int64 *)ptr, (__int64)desired,
+                                                   (__int64)*expected);
+  if((uint64_t)previous == *expected) {
+    return true;
+  }
+  *expected = (uint64_t)previous;
+  return false;
+}
+
+#else
+
+static inline uint64_t he_atomic_load_u64(volatile uint64_t *ptr) {
+  return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+static inline void he_atomic_store_u64(volatile uint64_t *ptr, uint64_t value) {
+  __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t he_atomic_add_u64(volatile uint64_t *ptr, uint64_t value) {
+  return __atomic_fetch_add(ptr, value, __ATOMIC_ACQ_REL);
+}
+
+static inline uint64_t he_atomic_exchange_u64(volatile uint64_t *ptr, uint64_t value) {
+  return __atomic_exchange_n(ptr, value, __ATOMIC_ACQ_REL);
+}
+
+static inline bool he_atomic_cas_u64(volatile uint64_t *ptr, uint64_t *expected,
+                                     uint64_t desired) {
+  return __atomic_compare_exchange_n(ptr, expected, desired, false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE);
+}
+
+#endif
+
+// Spin locks for changes that are rare and quick, so writers simply spin until it's their turn
+static inline void he_atomic_lock(volatile uint64_t *lock) {
+  uint64_t unlocked = 0;
+  while(!he_atomic_cas_u64(lock, &unlocked, 1)) {
+    unlocked = 0;
+  }
+}
+
+static inline void he_atomic_unlock(volatile uint64_t *lock) {
+  he_atomic_store_u64(lock, 0);
+}
+
+#endif  // ATOMIC_H
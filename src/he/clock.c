@@ -0,0 +1,65 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "clock.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+uint64_t he_internal_clock_ms(void) {
+  uint64_t now = 0;
+
+#if defined(_WIN32)
+  LARGE_INTEGER counter;
+  LARGE_INTEGER frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  now = (uint64_t)(counter.QuadPart / (frequency.QuadPart / 1000));
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  now = (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+#endif
+
+  // Zero is used to mean "no timestamp" so never hand it out
+  return now ? now : 1;
+}
+
+uint64_t he_internal_clock_us(void) {
+  uint64_t now = 0;
+
+#if defined(_WIN32)
+  LARGE_INTEGER counter;
+  LARGE_INTEGER frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  // Split so the multiply can't overflow and a coarse counter doesn't divide by zero
+  uint64_t seconds = (uint64_t)(counter.QuadPart / frequency.QuadPart);
+  uint64_t remainder = (uint64_t)(counter.QuadPart % frequency.QuadPart);
+  now = seconds * 1000000 + remainder * 1000000 / (uint64_t)frequency.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  now = (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+#endif
+
+  return now ? now : 1;
+}
@@ -0,0 +1,43 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file clock.h
+ * @brief Monotonic clock used for round trip time measurements
+ *
+ * Kept in its own unit so that tests can mock time.
+ */
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+
+/**
+ * @brief Returns the current time in milliseconds from a monotonic clock
+ * @return uint64_t Milliseconds since an arbitrary point in the past, never 0
+ */
+uint64_t he_internal_clock_ms(void);
+
+/**
+ * @brief Returns the current time in microseconds from the same monotonic clock
+ * @return uint64_t Microseconds since an arbitrary point in the past, never 0
+ */
+uint64_t he_internal_clock_us(void);
+
+#endif  // CLOCK_H
@@ -17,9 +17,19 @@
  */
 
 #include "conn.h"
+#include "atomic.h"
 #include "core.h"
 #include "config.h"
+#include "conn_export.h"
+#include "clock.h"
+#include "frag.h"
+#include "gso.h"
+#include "ip_pool.h"
+#include "metrics.h"
+#include "plugin_chain.h"
+#include "pmtud.h"
 #include "ssl_ctx.h"
+#include "timers.h"
 
 #ifndef WOLFSSL_USER_SETTINGS
 #include <wolfssl/options.h>
@@ -38,6 +48,8 @@ bool he_conn_is_error_fatal(he_conn_t *conn, he_return_code_t error_msg) {
       return false;
     case HE_ERR_SSL_ERROR_NONFATAL:
       return false;
+    case HE_ERR_PACKET_BYPASSED:
+      return false;
     default:
       return true;
   }
@@ -92,8 +104,29 @@ he_conn_t *he_conn_create() {
 
 he_return_code_t he_conn_destroy(he_conn_t *conn) {
   if(conn) {
+    if(conn->timers) {
+      he_internal_timers_cancel(conn->timers, &conn->timer_node);
+    }
     wolfSSL_free(conn->wolf_ssl);
-    he_internal_free(conn);
+    if(conn->hibernated_state) {
+      // The sealed state is worthless without the key, but there's no reason to leave it around
+      memset(conn->hibernated_state, 0, conn->hibernated_length);
+      he_internal_free(conn->hibernated_state);
+    }
+    he_internal_frag_free(conn);
+    he_internal_gro_free(conn);
+    he_internal_ip_pool_release(conn);
+    he_internal_plugin_free_state(conn->plugins, conn->plugin_state);
+    he_internal_metrics_conn_removed(conn->metrics, conn->state);
+
+    // A thread that looked the connection up in the pool may still pass it packets until the pool
+    // frees it, which it will turn away
+    conn->wolf_ssl = NULL;
+    conn->hibernated_state = NULL;
+    conn->state = HE_STATE_DISCONNECTED;
+    if(!he_internal_ip_pool_retire(conn)) {
+      he_internal_free(conn);
+    }
   }
   return HE_SUCCESS;
 }
@@ -103,6 +136,11 @@ he_return_code_t he_internal_conn_configure(he_conn_t *conn, he_ssl_ctx_t *ctx)
   conn->disable_roaming_connections = ctx->disable_roaming_connections;
   conn->padding_type = ctx->padding_type;
   conn->use_aggressive_mode = ctx->use_aggressive_mode;
+  conn->clamp_mss = ctx->clamp_mss;
+  conn->validate_source_address = ctx->validate_source_address;
+  conn->outside_headroom = ctx->outside_headroom;
+  conn->outside_tailroom = ctx->outside_tailroom;
+  conn->inner_mtu = ctx->inner_mtu;
   conn->connection_type = ctx->connection_type;
 
   // Only copy if unset
@@ -114,11 +152,29 @@ he_return_code_t he_internal_conn_configure(he_conn_t *conn, he_ssl_ctx_t *ctx)
   conn->state_change_cb = ctx->state_change_cb;
   conn->nudge_time_cb = ctx->nudge_time_cb;
   conn->inside_write_cb = ctx->inside_write_cb;
+  conn->inside_write_gro_cb = ctx->inside_write_gro_cb;
+  conn->inside_write_flow_cb = ctx->inside_write_flow_cb;
   conn->outside_write_cb = ctx->outside_write_cb;
   conn->network_config_ipv4_cb = ctx->network_config_ipv4_cb;
   conn->event_cb = ctx->event_cb;
   conn->auth_cb = ctx->auth_cb;
   conn->populate_network_config_ipv4_cb = ctx->populate_network_config_ipv4_cb;
+  conn->handoff_cb = ctx->handoff_cb;
+  // Keep a wheel the host picked for this connection, it may belong to another thread
+  if(!conn->timers) {
+    conn->timers = ctx->timers;
+  }
+  // A connection waking from hibernation gives its address back to the pool it came from
+  if(!conn->pool_address) {
+    conn->ip_pool = ctx->ip_pool;
+  }
+  conn->export_key = ctx->has_export_key ? ctx->export_key : NULL;
+
+  // Connections waking from hibernation are already counted
+  if(!conn->metrics) {
+    conn->metrics = &ctx->metrics;
+    he_internal_metrics_conn_added(conn->metrics, conn->state);
+  }
 
   // Copy the RNG to allow for generation of session IDs
   conn->wolf_rng = ctx->wolf_rng;
@@ -179,6 +235,7 @@ static he_return_code_t he_conn_internal_connect(he_conn_t *conn, he_ssl_ctx_t *
 
   // Change state to connecting
   he_internal_change_conn_state(conn, HE_STATE_CONNECTING);
+  he_internal_metrics_add(conn->metrics, HE_METRIC_HANDSHAKES_STARTED, 1);
 
   // Trigger a connection
   res = wolfSSL_negotiate(conn->wolf_ssl);
@@ -201,6 +258,7 @@ static he_return_code_t he_conn_internal_connect(he_conn_t *conn, he_ssl_ctx_t *
         he_internal_update_timeout(conn);
         return HE_SUCCESS;
       default:
+        he_internal_metrics_handshake_failed(conn->metrics, HE_ERR_CONNECT_FAILED);
         return HE_ERR_CONNECT_FAILED;
     }
   } else {
@@ -255,10 +313,38 @@ he_return_code_t he_conn_server_connect(he_conn_t *conn, he_ssl_ctx_t *ctx,
 
   conn->session_id = session_id;
 
+  // If the ClientHello has already passed a stateless cookie check, let wolf verify the same cookie
+  // under the same secret rather than issuing a second HelloVerifyRequest of its own
+  if(ctx->use_stateless_cookies && ctx->connection_type == HE_CONNECTION_TYPE_DATAGRAM &&
+     conn->peer_address_length > 0) {
+    const uint8_t *secret = ctx->cookie_secret;
+    if(conn->use_previous_cookie_secret && ctx->has_previous_cookie_secret) {
+      secret = ctx->previous_cookie_secret;
+    }
+    res = wolfSSL_DTLS_SetCookieSecret(conn->wolf_ssl, secret, sizeof(ctx->cookie_secret));
+    if(res != SSL_SUCCESS) {
+      return HE_ERR_INIT_FAILED;
+    }
+
+    res = wolfSSL_dtls_set_peer(conn->wolf_ssl, conn->peer_address,
+                                (unsigned int)conn->peer_address_length);
+    if(res != SSL_SUCCESS) {
+      return HE_ERR_INIT_FAILED;
+    }
+  }
+
   return HE_SUCCESS;
 }
 
 he_return_code_t he_conn_disconnect(he_conn_t *conn) {
+  // We need the D/TLS session back to say goodbye
+  if(conn->hibernated_state) {
+    he_return_code_t res = he_internal_conn_wake(conn);
+    if(res != HE_SUCCESS) {
+      return res;
+    }
+  }
+
   // Return not initialised if connect hasn't been called
   if(!conn->wolf_ssl) {
     return HE_ERR_NEVER_CONNECTED;
@@ -297,9 +383,17 @@ void he_internal_disconnect_and_shutdown(he_conn_t *conn) {
 
   // Disable read and write callbacks
   conn->inside_write_cb = NULL;
+  conn->inside_write_gro_cb = NULL;
+  conn->inside_write_flow_cb = NULL;
   conn->outside_write_cb = NULL;
   conn->wolf_timeout = 0;
 
+  // Nothing left to nudge
+  if(conn->timers) {
+    he_internal_timers_cancel(conn->timers, &conn->timer_node);
+    conn->is_nudge_timer_running = false;
+  }
+
   // Change to disconnected state
   he_internal_change_conn_state(conn, HE_STATE_DISCONNECTED);
 }
@@ -310,6 +404,7 @@ void he_internal_change_conn_state(he_conn_t *conn, he_client_state_t state) {
     return;
   }
   // Update status
+  he_internal_metrics_state_change(conn->metrics, conn->state, state);
   conn->state = state;
   // Trigger the state callback if set
 
@@ -320,11 +415,25 @@ void he_internal_change_conn_state(he_conn_t *conn, he_client_state_t state) {
   // Handle anything specific to a given state change
   switch(state) {
     case HE_STATE_LINK_UP:
+      he_internal_metrics_add(conn->metrics, HE_METRIC_HANDSHAKES_COMPLETED, 1);
       // If we are a client we need to send auth
       if(!conn->is_server) {
         he_internal_send_auth(conn);
       }
       break;
+    case HE_STATE_ONLINE:
+      // Both sides have seen the other's Finished by the time auth is done, so nothing from the
+      // handshake will ever be retransmitted. WolfSSL only frees these itself for TLS, and would
+      // otherwise hold the flight buffers, peer certificate and transcript hashes for the lifetime
+      // of a D/TLS connection. A renegotiation allocates whatever it needs again.
+      if(conn->wolf_ssl) {
+        wolfSSL_FreeHandshakeResources(conn->wolf_ssl);
+      }
+      // Servers hand the connection off once the current call has finished with it
+      if(conn->is_server && conn->handoff_cb) {
+        conn->handoff_pending = true;
+      }
+      break;
     default:
       // Nothing to do in the default case
       break;
@@ -364,14 +473,37 @@ he_return_code_t he_conn_send_keepalive(he_conn_t *conn) {
     return HE_ERR_INVALID_CLIENT_STATE;
   }
 
+  if(conn->hibernated_state) {
+    he_return_code_t res = he_internal_conn_wake(conn);
+    if(res != HE_SUCCESS) {
+      return res;
+    }
+  }
+
   // Craft a PING message
   he_msg_ping_t ping = {0};
-  ping.msg_header.msgid = HE_MSGID_PING;
+  he_internal_conn_build_ping(conn, &ping);
 
   // Send it
   return he_internal_send_message(conn, (uint8_t *)&ping, sizeof(he_msg_ping_t));
 }
 
+void he_internal_conn_build_ping(he_conn_t *conn, he_msg_ping_t *ping) {
+  ping->msg_header.msgid = HE_MSGID_PING;
+
+  // The peer echoes the sequence number and timestamp back in its PONG so we can time the round
+  // trip. Zero is what older peers send back, so never use it for either.
+  conn->ping_sequence++;
+  if(conn->ping_sequence == 0) {
+    conn->ping_sequence = 1;
+  }
+  ping->payload = conn->ping_sequence;
+  ping->timestamp = (uint32_t)he_internal_clock_ms();
+  if(ping->timestamp == 0) {
+    ping->timestamp = 1;
+  }
+}
+
 he_return_code_t he_internal_send_auth(he_conn_t *conn) {
   // Check we're in the right state
   if(conn->state != HE_STATE_LINK_UP && conn->state != HE_STATE_AUTHENTICATING) {
@@ -397,6 +529,9 @@ he_return_code_t he_internal_send_auth(he_conn_t *conn) {
   memcpy(&auth.username, conn->username, auth.username_length);
   memcpy(&auth.password, conn->password, auth.password_length);
 
+  // Offer a jumbo MTU if we've been set up for one
+  auth.inner_mtu = htons((uint16_t)conn->inner_mtu);
+
   // Send the authentication request with the padded buffer
   return he_internal_send_message(conn, (uint8_t *)&auth, sizeof(he_msg_auth_t));
 }
@@ -458,24 +593,166 @@ void he_internal_update_timeout(he_conn_t *conn) {
     return;
   }
 
-  // Update status
-  conn->wolf_timeout = wolfSSL_dtls_get_current_timeout(conn->wolf_ssl);
-
-  // Scale the timeout value
-  if(conn->renegotiation_in_progress) {
-    conn->wolf_timeout *= HE_WOLF_RENEGOTIATION_TIMEOUT_MULTIPLIER;
+  if(conn->srtt_ms) {
+    // Once we know the round trip time, pace retransmissions on it, backing off exponentially
+    uint8_t backoff = conn->flight_retransmits < HE_RTO_MAX_BACKOFF ? conn->flight_retransmits
+                                                                    : HE_RTO_MAX_BACKOFF;
+    uint32_t timeout = conn->rto_ms << backoff;
+    conn->wolf_timeout = timeout < HE_RTO_MAX_MS ? (int)timeout : HE_RTO_MAX_MS;
   } else {
-    conn->wolf_timeout *= HE_WOLF_TIMEOUT_MULTIPLIER;
+    // Update status
+    conn->wolf_timeout = wolfSSL_dtls_get_current_timeout(conn->wolf_ssl);
+
+    // Scale the timeout value
+    if(conn->renegotiation_in_progress) {
+      conn->wolf_timeout *= HE_WOLF_RENEGOTIATION_TIMEOUT_MULTIPLIER;
+    } else {
+      conn->wolf_timeout *= HE_WOLF_TIMEOUT_MULTIPLIER;
+    }
   }
 
   // Trigger the timeout callback if set and if a timer isn't already running
   // This prevents runaway timers that never have the chance to complete
-  if(conn->nudge_time_cb && !conn->is_nudge_timer_running) {
+  if(conn->is_nudge_timer_running) {
+    return;
+  }
+
+  if(conn->timers) {
+    he_internal_timers_schedule(conn->timers, &conn->timer_node, conn->wolf_timeout);
+    conn->is_nudge_timer_running = true;
+  } else if(conn->nudge_time_cb) {
     conn->nudge_time_cb(conn, conn->wolf_timeout, conn->data);
     conn->is_nudge_timer_running = true;
   }
 }
 
+void he_internal_conn_rtt_sample(he_conn_t *conn, uint32_t rtt_ms) {
+  // A zero sample would look like no estimate at all
+  if(rtt_ms == 0) {
+    rtt_ms = 1;
+  }
+
+  if(conn->srtt_ms == 0) {
+    conn->srtt_ms = rtt_ms;
+    conn->rttvar_ms = rtt_ms / 2;
+  } else {
+    uint32_t delta = conn->srtt_ms > rtt_ms ? conn->srtt_ms - rtt_ms : rtt_ms - conn->srtt_ms;
+    // RTTVAR <- 3/4 RTTVAR + 1/4 |SRTT - R|, SRTT <- 7/8 SRTT + 1/8 R
+    conn->rttvar_ms = (3 * conn->rttvar_ms + delta) / 4;
+    conn->srtt_ms = (7 * conn->srtt_ms + rtt_ms) / 8;
+  }
+
+  // RTO <- SRTT + max(G, 4 * RTTVAR), with a clock granularity of 1ms
+  uint32_t rto = conn->srtt_ms + (conn->rttvar_ms > 0 ? 4 * conn->rttvar_ms : 1);
+
+  if(rto < HE_RTO_MIN_MS) {
+    rto = HE_RTO_MIN_MS;
+  } else if(rto > HE_RTO_MAX_MS) {
+    rto = HE_RTO_MAX_MS;
+  }
+
+  conn->rto_ms = rto;
+}
+
+uint32_t he_conn_get_rtt(const he_conn_t *conn) {
+  return conn->srtt_ms;
+}
+
+uint32_t he_conn_get_jitter(const he_conn_t *conn) {
+  return conn->jitter_ms;
+}
+
+void he_internal_conn_ping_sample(he_conn_t *conn, uint32_t rtt_ms) {
+  if(conn->ping_rtt_ms) {
+    // J <- J + (|D| - J) / 16, where D is the change in round trip time
+    int32_t delta = (int32_t)rtt_ms - (int32_t)conn->ping_rtt_ms;
+    if(delta < 0) {
+      delta = -delta;
+    }
+    conn->jitter_ms = (uint32_t)((int32_t)conn->jitter_ms + (delta - (int32_t)conn->jitter_ms) / 16);
+  }
+
+  // Zero means no measurement yet
+  conn->ping_rtt_ms = rtt_ms ? rtt_ms : 1;
+
+  he_internal_conn_rtt_sample(conn, rtt_ms);
+}
+
+he_return_code_t he_conn_set_keepalive_interval(he_conn_t *conn, uint32_t interval_ms) {
+  if(!conn) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  conn->keepalive_interval_ms = interval_ms;
+  return HE_SUCCESS;
+}
+
+uint32_t he_conn_get_keepalive_interval(he_conn_t *conn) {
+  return conn->keepalive_interval_ms;
+}
+
+he_return_code_t he_conn_send_keepalive_if_idle(he_conn_t *conn) {
+  if(!conn) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  if(conn->state != HE_STATE_ONLINE) {
+    return HE_ERR_INVALID_CLIENT_STATE;
+  }
+
+  if(conn->keepalive_interval_ms == 0) {
+    return HE_SUCCESS;
+  }
+
+  uint64_t now = he_internal_clock_ms();
+
+  // Counting records rather than timestamping them keeps the clock off the data path, at the cost
+  // of only knowing that something arrived since the last call
+  if(conn->rx_records != conn->keepalive_rx_records || conn->keepalive_last_rx_ms == 0) {
+    conn->keepalive_rx_records = conn->rx_records;
+    conn->keepalive_last_rx_ms = now;
+    return HE_SUCCESS;
+  }
+
+  if(now - conn->keepalive_last_rx_ms < conn->keepalive_interval_ms ||
+     now - conn->keepalive_last_ping_ms < conn->keepalive_interval_ms) {
+    return HE_SUCCESS;
+  }
+
+  conn->keepalive_last_ping_ms = now;
+  return he_conn_send_keepalive(conn);
+}
+
+he_return_code_t he_conn_set_timers(he_conn_t *conn, he_timers_t *timers) {
+  if(!conn) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  if(conn->timers == timers) {
+    return HE_SUCCESS;
+  }
+
+  // Carry a pending nudge over to the new wheel, or back to the host's own timers
+  bool was_running = conn->is_nudge_timer_running;
+  if(conn->timers) {
+    he_internal_timers_cancel(conn->timers, &conn->timer_node);
+  }
+  conn->timers = timers;
+
+  if(was_running) {
+    conn->is_nudge_timer_running = false;
+    if(timers) {
+      he_internal_timers_schedule(timers, &conn->timer_node, conn->wolf_timeout);
+      conn->is_nudge_timer_running = true;
+    } else if(conn->nudge_time_cb) {
+      conn->nudge_time_cb(conn, conn->wolf_timeout, conn->data);
+      conn->is_nudge_timer_running = true;
+    }
+  }
+
+  return HE_SUCCESS;
+}
+
 int he_conn_get_nudge_time(he_conn_t *conn) {
   if(conn->state == HE_STATE_ONLINE && !conn->renegotiation_in_progress) {
     return 0;
@@ -487,6 +764,16 @@ he_return_code_t he_conn_nudge(he_conn_t *conn) {
   // We've been nudged so there is no timer running
   conn->is_nudge_timer_running = false;
 
+  // Nothing can time out while hibernating
+  if(conn->hibernated_state) {
+    return HE_SUCCESS;
+  }
+
+  // Whatever we sent last is about to go again, so by Karn's rule its reply can't be timed
+  if(conn->flight_retransmits < UINT8_MAX) {
+    conn->flight_retransmits++;
+  }
+
   // If we are in HE_STATE_AUTHENTICATING then we need to resend our AUTH request
   if(conn->state == HE_STATE_AUTHENTICATING) {
     // Re-send auth request (this is idempotent)
@@ -506,6 +793,9 @@ he_return_code_t he_conn_nudge(he_conn_t *conn) {
         // Note that in this state we are treating APP_DATA_READY as error, because
         // something is very strange if we end up with that message here
         default:
+          if(conn->state == HE_STATE_CONNECTING) {
+            he_internal_metrics_handshake_failed(conn->metrics, HE_CONNECTION_TIMED_OUT);
+          }
           he_internal_change_conn_state(conn, HE_STATE_DISCONNECTED);
           return HE_CONNECTION_TIMED_OUT;
       }
@@ -518,6 +808,36 @@ he_return_code_t he_conn_nudge(he_conn_t *conn) {
   return HE_SUCCESS;
 }
 
+he_return_code_t he_conn_set_peer_address(he_conn_t *conn, const uint8_t *peer_address,
+                                          size_t length) {
+  if(!conn || !peer_address) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  if(length == 0) {
+    return HE_ERR_ZERO_SIZE;
+  }
+
+  if(length > sizeof(conn->peer_address)) {
+    return HE_ERR_PACKET_TOO_LARGE;
+  }
+
+  memcpy(conn->peer_address, peer_address, length);
+  conn->peer_address_length = length;
+
+  return HE_SUCCESS;
+}
+
+he_return_code_t he_conn_set_use_previous_cookie_secret(he_conn_t *conn, bool use) {
+  if(!conn) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  conn->use_previous_cookie_secret = use;
+
+  return HE_SUCCESS;
+}
+
 he_client_state_t he_conn_get_state(he_conn_t *conn) {
   return conn->state;
 }
@@ -615,6 +935,95 @@ int he_conn_get_outside_mtu(he_conn_t *conn) {
   return conn->outside_mtu;
 }
 
+int he_conn_get_effective_mtu(he_conn_t *conn) {
+  int mtu = conn->effective_mtu;
+  if(conn->peer_mtu && (!mtu || conn->peer_mtu < mtu)) {
+    mtu = conn->peer_mtu;
+  }
+
+  if(!mtu) {
+    return HE_MAX_MTU;
+  }
+
+  // The peer's path may take more than our outside MTU does
+  int largest = conn->outside_mtu - (int)HE_PMTUD_OVERHEAD;
+  return (largest > 0 && largest < mtu) ? largest : mtu;
+}
+
+int he_conn_get_inner_mtu(he_conn_t *conn) {
+  return conn->inner_mtu ? conn->inner_mtu : he_conn_get_effective_mtu(conn);
+}
+
+uint64_t he_conn_get_inside_drops(he_conn_t *conn, he_inside_drop_reason_t reason) {
+  if(!conn || reason < 0 || reason >= HE_INSIDE_DROP_REASON_COUNT) {
+    return 0;
+  }
+
+  return conn->inside_drops[reason];
+}
+
+// D/TLS records WolfSSL quietly discards never reach us, but it can count them for us
+static void he_conn_ssl_drops(he_conn_t *conn, uint64_t *decrypt_failures, uint64_t *replays) {
+#ifdef WOLFSSL_DTLS_DROP_STATS
+  word32 mac_drops = 0;
+  word32 replay_drops = 0;
+  if(conn->wolf_ssl && conn->connection_type == HE_CONNECTION_TYPE_DATAGRAM &&
+     wolfSSL_dtls_get_drop_stats(conn->wolf_ssl, &mac_drops, &replay_drops) == SSL_SUCCESS) {
+    *decrypt_failures += mac_drops;
+    *replays += replay_drops;
+  }
+#endif
+}
+
+void he_internal_conn_save_ssl_drops(he_conn_t *conn) {
+  uint64_t decrypt_failures = conn->counters.decrypt_failures;
+  uint64_t replays = conn->counters.replays;
+  he_conn_ssl_drops(conn, &decrypt_failures, &replays);
+  conn->counters.decrypt_failures = decrypt_failures;
+  conn->counters.replays = replays;
+}
+
+he_return_code_t he_conn_get_stats(he_conn_t *conn, he_conn_stats_t *stats) {
+  if(!conn || !stats) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  memset(stats, 0, sizeof(he_conn_stats_t));
+
+  he_conn_counters_t *counters = &conn->counters;
+  stats->inside_rx_packets = counters->inside_rx_packets;
+  stats->inside_rx_bytes = counters->inside_rx_bytes;
+  stats->inside_tx_packets = counters->inside_tx_packets;
+  stats->inside_tx_bytes = counters->inside_tx_bytes;
+  stats->outside_rx_packets = counters->outside_rx_packets;
+  stats->outside_rx_bytes = counters->outside_rx_bytes;
+  stats->outside_tx_packets = counters->outside_tx_packets;
+  stats->outside_tx_bytes = counters->outside_tx_bytes;
+
+  stats->other_drops = he_atomic_load_u64(&counters->other_drops);
+  for(size_t i = 0; i < HE_CONN_DROP_SLOTS; i++) {
+    uint64_t value = he_atomic_load_u64(&counters->drops[i].value);
+    if(!value) {
+      break;
+    }
+    int32_t reason = HE_CONN_DROP_REASON(value);
+    if(-reason < HE_CONN_STATS_MAX_DROP_REASONS) {
+      stats->drops[-reason] = HE_CONN_DROP_COUNT(value);
+    } else {
+      stats->other_drops += HE_CONN_DROP_COUNT(value);
+    }
+  }
+  memcpy(stats->inside_drops, conn->inside_drops, sizeof(stats->inside_drops));
+
+  stats->decrypt_failures = counters->decrypt_failures;
+  stats->replays = counters->replays;
+  stats->renegotiations = counters->renegotiations;
+  stats->session_rotations = counters->session_rotations;
+  he_conn_ssl_drops(conn, &stats->decrypt_failures, &stats->replays);
+
+  return HE_SUCCESS;
+}
+
 bool he_conn_is_outside_mtu_set(he_conn_t *conn) {
   if(conn->outside_mtu) {
     return true;
@@ -631,7 +1040,7 @@ size_t he_internal_calculate_data_packet_length(he_conn_t *conn, size_t length)
 
   // Is full padding enabled IPSEC style?
   if(conn->padding_type == HE_PADDING_FULL) {
-    return HE_MAX_MTU;
+    return he_conn_get_effective_mtu(conn);
   }
 
   // Pad data packets at boundaries to obfuscate true length
@@ -644,7 +1053,7 @@ size_t he_internal_calculate_data_packet_length(he_conn_t *conn, size_t length)
     return 900;
   } else {
     // ~25% of packets were above 1280
-    return HE_MAX_MTU;
+    return he_conn_get_effective_mtu(conn);
   }
 }
 
@@ -31,6 +31,14 @@
 #define HE_WOLF_TIMEOUT_MULTIPLIER 100
 #define HE_WOLF_RENEGOTIATION_TIMEOUT_MULTIPLIER 1000
 
+// Bounds for retransmission timeouts once the round trip time is known
+#define HE_RTO_MIN_MS 100
+#define HE_RTO_MAX_MS 60000
+// Retransmission timeouts double at most this many times
+#define HE_RTO_MAX_BACKOFF 6
+// PONGs are accepted for this many of the most recent PINGs
+#define HE_PING_WINDOW 16
+
 /**
  * @brief Creates a Helium connection struct
  * @return he_conn_t* Returns a pointer to a valid Helium connection
@@ -49,6 +57,11 @@ he_conn_t *he_conn_create(void);
  * It will first remove all of the callbacks which means no Helium callbacks will be triggered after
  * calling this function. It is thus an error to call any Helium functions on this connection after
  * it has been destroyed.
+ *
+ * The one exception is a connection with an address pool that has lookup threads registered with
+ * he_ip_pool_register_thread(). Its memory is kept until every such thread has passed a
+ * quiescent state, so a pointer returned by he_ip_pool_lookup() before the destroy can still be
+ * passed to he_conn_inside_packet_received(), which drops the packet.
  */
 he_return_code_t he_conn_destroy(he_conn_t *conn);
 
@@ -162,6 +175,61 @@ int he_conn_get_outside_mtu(he_conn_t *conn);
  */
 bool he_conn_is_outside_mtu_set(he_conn_t *conn);
 
+/**
+ * @brief Returns the MTU of the tunnel, i.e. the largest packet he_conn_inside_packet_received()
+ * will accept
+ * @param conn A pointer to a valid connection
+ * @return int The MTU in bytes. This is HE_MAX_MTU unless path MTU discovery has found otherwise.
+ * @see he_conn_send_pmtu_probe_if_due()
+ *
+ * Each end tells the other what its path MTU discovery found, and both use the smaller of the
+ * two. That way neither sends the other packets larger than its TUN device is set up for, even
+ * if only one end runs path MTU discovery.
+ */
+int he_conn_get_effective_mtu(he_conn_t *conn);
+
+/**
+ * @brief Returns the largest packet that can be sent through the tunnel, which the host should
+ * use as the MTU of its TUN device
+ * @param conn A pointer to a valid connection
+ * @return int The jumbo MTU agreed with the peer if there is one, otherwise the effective MTU
+ * @see he_ssl_ctx_set_inner_mtu()
+ */
+int he_conn_get_inner_mtu(he_conn_t *conn);
+
+/**
+ * @brief Returns how many packets from the tunnel were dropped before reaching the inside
+ * @param conn A pointer to a valid connection
+ * @param reason Why the packets were dropped
+ * @return uint64_t The number of packets dropped for that reason, 0 if the reason isn't valid
+ *
+ * Packets from the tunnel are checked to be well formed IPv4 with a good header checksum, and on
+ * servers with source address validation enabled, to come from the client's own address.
+ *
+ * @see he_ssl_ctx_set_source_address_validation()
+ */
+uint64_t he_conn_get_inside_drops(he_conn_t *conn, he_inside_drop_reason_t reason);
+
+/**
+ * @brief Takes a snapshot of the traffic and error counters of the connection
+ * @param conn A pointer to a valid connection
+ * @param stats Filled in with the counts since the connection was created
+ * @return HE_SUCCESS The snapshot was taken
+ * @return HE_ERR_NULL_POINTER Either parameter was NULL
+ *
+ * Counting is always on and costs a few additions per packet. Counters only go up, so the
+ * difference between two snapshots is what happened in between.
+ *
+ * Like the rest of the connection API this isn't thread safe, but the counters are plain
+ * integers; taken from another thread, a snapshot may be slightly behind.
+ *
+ * WolfSSL discards D/TLS records that fail authentication or are replayed without telling
+ * Helium, so for datagram connections those two counters come from WolfSSL's own drop counts.
+ * The WolfSSL builds set up for every platform define WOLFSSL_DTLS_DROP_STATS for this; without
+ * it they stay 0 for datagram connections.
+ */
+he_return_code_t he_conn_get_stats(he_conn_t *conn, he_conn_stats_t *stats);
+
 /**
  * @brief Store a pointer in the context that will be made available in all Helium callbacks
  * @param conn A valid connection
@@ -233,6 +301,36 @@ he_return_code_t he_conn_client_connect(he_conn_t *conn, he_ssl_ctx_t *ssl_ctx,
 he_return_code_t he_conn_server_connect(he_conn_t *conn, he_ssl_ctx_t *ssl_ctx,
                                         he_plugin_chain_t *plugins);
 
+/**
+ * @brief Set the address of the peer this connection was created for
+ * @param conn A pointer to a valid connection
+ * @param peer_address The peer's address in the host's native format (e.g. a struct sockaddr)
+ * @param length The length of the peer address
+ * @return HE_SUCCESS The peer address was stored
+ * @return HE_ERR_NULL_POINTER The conn or peer_address pointer is NULL
+ * @return HE_ERR_ZERO_SIZE The length is zero
+ * @return HE_ERR_PACKET_TOO_LARGE The address is longer than HE_MAX_PEER_ADDRESS_LENGTH
+ *
+ * When stateless cookies are enabled this must be set before calling he_conn_server_connect(),
+ * using the exact bytes passed to he_ssl_ctx_verify_client_hello(), so the server accepts the
+ * cookie the client has already obtained.
+ */
+he_return_code_t he_conn_set_peer_address(he_conn_t *conn, const uint8_t *peer_address,
+                                          size_t length);
+
+/**
+ * @brief Set whether the client's stateless cookie was issued under the previous cookie secret
+ * @param conn A pointer to a valid connection
+ * @param use The previous_secret value from he_ssl_ctx_verify_client_hello()
+ * @return HE_SUCCESS The flag was stored
+ * @return HE_ERR_NULL_POINTER The conn pointer is NULL
+ *
+ * Cookies stay valid for one rotation of the cookie secret. Without this, a client whose cookie
+ * predates the last rotation would be sent a second HelloVerifyRequest once its connection has
+ * been created. Ignored if the context no longer has a previous secret.
+ */
+he_return_code_t he_conn_set_use_previous_cookie_secret(he_conn_t *conn, bool use);
+
 /**
  * @brief Try to cleanly disconnect from the remote Helium instance (client or server).
  * @return HE_ERR_NEVER_CONNECTED The connection has never been connected and so cannot be
@@ -262,6 +360,13 @@ he_return_code_t he_internal_send_message(he_conn_t *conn, uint8_t *message, uin
 he_return_code_t he_internal_send_goodbye(he_conn_t *conn);
 he_return_code_t he_internal_send_auth(he_conn_t *conn);
 
+/**
+ * @brief Fills in a PING message with the next sequence number and the current time
+ * @param conn A pointer to a valid connection
+ * @param ping A pointer to the message to fill in
+ */
+void he_internal_conn_build_ping(he_conn_t *conn, he_msg_ping_t *ping);
+
 /**
  * @brief Tell Helium to send a keepalive message. This can be used to avoid NAT timing out.
  * @param conn A pointer to a valid connection
@@ -271,9 +376,41 @@ he_return_code_t he_internal_send_auth(he_conn_t *conn);
  * ensure that the connection doesn't time out due to NAT traversal. This feature is not mandatory,
  * but as Helium cannot by itself know when to send these, it is up to the host application to call
  * this function at the required intervals.
+ *
+ * The reply is also used to measure the round trip time, see he_conn_get_rtt().
  */
 he_return_code_t he_conn_send_keepalive(he_conn_t *conn);
 
+/**
+ * @brief Sets how long the connection must be idle before he_conn_send_keepalive_if_idle() sends
+ * a keepalive
+ * @param conn A pointer to a valid connection
+ * @param interval_ms The idle time in milliseconds, or 0 to disable idle keepalives (the default)
+ * @return HE_SUCCESS The interval was set
+ * @return HE_ERR_NULL_POINTER The conn pointer supplied is NULL
+ */
+he_return_code_t he_conn_set_keepalive_interval(he_conn_t *conn, uint32_t interval_ms);
+
+/**
+ * @brief Returns the keepalive interval set with he_conn_set_keepalive_interval()
+ * @param conn A pointer to a valid connection
+ * @return uint32_t The interval in milliseconds, 0 if idle keepalives are disabled
+ */
+uint32_t he_conn_get_keepalive_interval(he_conn_t *conn);
+
+/**
+ * @brief Sends a keepalive only if nothing has been heard from the peer for the keepalive interval
+ * @param conn A pointer to a valid connection
+ * @return HE_SUCCESS A keepalive was sent, or wasn't needed
+ * @return HE_ERR_INVALID_CLIENT_STATE The connection isn't online
+ * @return HE_ERR_NULL_POINTER The conn pointer supplied is NULL
+ *
+ * Busy connections prove the path is alive with their own traffic, so keepalives are only sent
+ * while the path is idle, and then at most once per interval. The host should call this
+ * regularly, e.g. every second; idle time is measured in steps of however often it is called.
+ */
+he_return_code_t he_conn_send_keepalive_if_idle(he_conn_t *conn);
+
 /**
  * @brief Tell Helium to schedule a renegotiation
  * @param conn A pointer to a valid connection
@@ -302,6 +439,60 @@ void he_internal_update_timeout(he_conn_t *conn);
  */
 int he_conn_get_nudge_time(he_conn_t *conn);
 
+/**
+ * @brief Feeds a round trip time measurement into the connection's RTT estimate
+ * @param conn A pointer to a valid connection
+ * @param rtt_ms The measured round trip time in milliseconds
+ *
+ * Updates the smoothed RTT, its variation and the retransmission timeout as per RFC 6298.
+ */
+void he_internal_conn_rtt_sample(he_conn_t *conn, uint32_t rtt_ms);
+
+/**
+ * @brief Keeps the records WolfSSL has counted as dropped before its session is freed
+ * @param conn A pointer to a valid connection
+ */
+void he_internal_conn_save_ssl_drops(he_conn_t *conn);
+
+/**
+ * @brief Returns the smoothed round trip time of the connection
+ * @param conn A pointer to a valid connection
+ * @return uint32_t The smoothed round trip time in milliseconds, or 0 if it hasn't been measured
+ *
+ * Helium measures the round trip time from handshake flights and PING / PONG exchanges (see
+ * he_conn_send_keepalive()) and uses it to pace D/TLS retransmissions.
+ */
+uint32_t he_conn_get_rtt(const he_conn_t *conn);
+
+/**
+ * @brief Returns the jitter of the round trip times of keepalives
+ * @param conn A pointer to a valid connection
+ * @return uint32_t The smoothed variation between consecutive PING round trip times in
+ *         milliseconds (as per RFC 3550), or 0 if there aren't enough measurements yet
+ */
+uint32_t he_conn_get_jitter(const he_conn_t *conn);
+
+/**
+ * @brief Feeds a PING round trip time into the jitter and RTT estimates
+ * @param conn A pointer to a valid connection
+ * @param rtt_ms The measured round trip time in milliseconds
+ */
+void he_internal_conn_ping_sample(he_conn_t *conn, uint32_t rtt_ms);
+
+/**
+ * @brief Moves a connection's nudge timer to another timer wheel
+ * @param conn A pointer to a valid connection
+ * @param timers A pointer to a timer wheel, or NULL to use the nudge time callback
+ * @return HE_SUCCESS The connection now uses the given timers
+ * @return HE_ERR_NULL_POINTER The conn pointer supplied is NULL
+ *
+ * Timer wheels are not thread safe, so a host that hands connections to other threads (see
+ * he_ssl_ctx_set_handoff_cb()) should move them to the receiving thread's wheel. A pending nudge
+ * is rescheduled on the new wheel. The choice sticks through hibernation, and a wheel set before
+ * he_conn_import() is used instead of the context's.
+ */
+he_return_code_t he_conn_set_timers(he_conn_t *conn, he_timers_t *timers);
+
 /**
  * @brief Nudges Helium
  * @param conn A pointer to a valid connection
@@ -0,0 +1,434 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "conn_export.h"
+#include "clock.h"
+#include "conn.h"
+#include "frag.h"
+#include "gso.h"
+#include "inet.h"
+#include "ip_pool.h"
+#include "metrics.h"
+#include "pmtud.h"
+#include "ssl_ctx.h"
+
+#ifndef WOLFSSL_USER_SETTINGS
+#include <wolfssl/options.h>
+#endif
+#include <wolfssl/error-ssl.h>
+#include <wolfssl/ssl.h>
+#include <wolfssl/wolfcrypt/settings.h>
+#include <wolfssl/wolfcrypt/aes.h>
+
+#include "memory.h"
+
+// Everything in an export apart from the WolfSSL state
+#define HE_CONN_EXPORT_OVERHEAD                                  \
+  (sizeof(he_conn_export_hdr_t) + sizeof(he_conn_export_state_t) + \
+   HE_CONN_EXPORT_TAG_SIZE)
+
+#ifdef WOLFSSL_SESSION_EXPORT
+
+// Length of the fields before wolf_length in each version of the export format
+static const size_t he_conn_export_state_fields[HE_CONN_EXPORT_VERSION + 1] = {
+    [1] = offsetof(he_conn_export_state_t, inner_mtu),
+    [2] = offsetof(he_conn_export_state_t, client_ip),
+    [3] = offsetof(he_conn_export_state_t, effective_mtu),
+    [4] = offsetof(he_conn_export_state_t, pool_address),
+    [5] = offsetof(he_conn_export_state_t, wolf_length),
+};
+
+static he_return_code_t he_conn_export_seal(const uint8_t *key, he_conn_export_hdr_t *hdr,
+                                            uint8_t *data, size_t length, uint8_t *tag) {
+  Aes aes;
+
+  if(wc_AesInit(&aes, NULL, INVALID_DEVID) != 0) {
+    return HE_ERR_FAILED;
+  }
+
+  int res = wc_AesGcmSetKey(&aes, key, HE_EXPORT_KEY_LENGTH);
+  if(res == 0) {
+    res = wc_AesGcmEncrypt(&aes, data, data, (word32)length, hdr->iv, sizeof(hdr->iv), tag,
+                           HE_CONN_EXPORT_TAG_SIZE, (const byte *)hdr, sizeof(*hdr));
+  }
+
+  wc_AesFree(&aes);
+
+  return res == 0 ? HE_SUCCESS : HE_ERR_FAILED;
+}
+
+static he_return_code_t he_conn_export_open(const uint8_t *key, const he_conn_export_hdr_t *hdr,
+                                            const uint8_t *sealed, size_t length,
+                                            const uint8_t *tag, uint8_t *out) {
+  Aes aes;
+
+  if(wc_AesInit(&aes, NULL, INVALID_DEVID) != 0) {
+    return HE_ERR_FAILED;
+  }
+
+  int res = wc_AesGcmSetKey(&aes, key, HE_EXPORT_KEY_LENGTH);
+  if(res == 0) {
+    res = wc_AesGcmDecrypt(&aes, out, sealed, (word32)length, hdr->iv, sizeof(hdr->iv), tag,
+                           HE_CONN_EXPORT_TAG_SIZE, (const byte *)hdr, sizeof(*hdr));
+  }
+
+  wc_AesFree(&aes);
+
+  // Don't distinguish tampering from a wrong key
+  return res == 0 ? HE_SUCCESS : HE_ERR_BAD_PACKET;
+}
+
+he_return_code_t he_conn_export(he_conn_t *conn, uint8_t *buffer, size_t *length) {
+  if(!conn || !length) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  if(conn->connection_type != HE_CONNECTION_TYPE_DATAGRAM) {
+    return HE_ERR_INVALID_CONNECTION_TYPE;
+  }
+
+  if(conn->state != HE_STATE_ONLINE || conn->renegotiation_in_progress) {
+    return HE_ERR_INVALID_CLIENT_STATE;
+  }
+
+  if(!conn->export_key) {
+    return HE_ERR_CONF_EXPORT_KEY_NOT_SET;
+  }
+
+  unsigned int wolf_length = 0;
+
+  if(!buffer) {
+    // Find out how much space WolfSSL might need
+    if(wolfSSL_dtls_export(conn->wolf_ssl, NULL, &wolf_length) < 0) {
+      return HE_ERR_SSL_ERROR;
+    }
+    *length = HE_CONN_EXPORT_OVERHEAD + wolf_length;
+    return HE_SUCCESS;
+  }
+
+  if(*length < HE_CONN_EXPORT_OVERHEAD) {
+    return HE_ERR_PACKET_TOO_LARGE;
+  }
+
+  he_conn_export_hdr_t *hdr = (he_conn_export_hdr_t *)buffer;
+  uint8_t *plaintext = buffer + sizeof(he_conn_export_hdr_t);
+  he_conn_export_state_t *state = (he_conn_export_state_t *)plaintext;
+  uint8_t *wolf_state = plaintext + sizeof(he_conn_export_state_t);
+
+  // Let WolfSSL write straight into the buffer, leaving room for the tag
+  wolf_length = (unsigned int)(*length - HE_CONN_EXPORT_OVERHEAD);
+  int res = wolfSSL_dtls_export(conn->wolf_ssl, wolf_state, &wolf_length);
+  if(res == BUFFER_E) {
+    return HE_ERR_PACKET_TOO_LARGE;
+  }
+  if(res <= 0) {
+    return HE_ERR_SSL_ERROR;
+  }
+  wolf_length = (unsigned int)res;
+
+  memset(state, 0, sizeof(he_conn_export_state_t));
+  state->session_id = conn->session_id;
+  state->pending_session_id = conn->pending_session_id;
+  state->major_version = conn->protocol_version.major_version;
+  state->minor_version = conn->protocol_version.minor_version;
+  state->is_server = conn->is_server;
+  state->padding_type = (uint8_t)conn->padding_type;
+  state->disable_roaming_connections = conn->disable_roaming_connections;
+  state->use_aggressive_mode = conn->use_aggressive_mode;
+  state->outside_mtu = (uint16_t)conn->outside_mtu;
+  state->inner_mtu = (uint16_t)conn->inner_mtu;
+  state->client_ip = conn->client_ip;
+  state->effective_mtu = conn->effective_mtu;
+  state->peer_mtu = conn->peer_mtu;
+  state->pool_address = conn->pool_address;
+  state->wolf_length = wolf_length;
+
+  size_t plaintext_length = sizeof(he_conn_export_state_t) + wolf_length;
+
+  memset(hdr, 0, sizeof(he_conn_export_hdr_t));
+  hdr->magic[0] = 'H';
+  hdr->magic[1] = 'x';
+  hdr->version = HE_CONN_EXPORT_VERSION;
+  hdr->length = htonl((uint32_t)plaintext_length);
+
+  // A fresh IV for every export, a repeat under the same key would be catastrophic for GCM. The
+  // connection's RNG shares its state with the context's and exports may run on any thread, so the
+  // IV comes from a generator of its own
+  RNG rng;
+  if(wc_InitRng(&rng) != 0) {
+    return HE_ERR_RNG_FAILURE;
+  }
+  res = wc_RNG_GenerateBlock(&rng, hdr->iv, sizeof(hdr->iv));
+  wc_FreeRng(&rng);
+  if(res != 0) {
+    return HE_ERR_RNG_FAILURE;
+  }
+
+  he_return_code_t ret = he_conn_export_seal(conn->export_key, hdr, plaintext, plaintext_length,
+                                             plaintext + plaintext_length);
+  if(ret != HE_SUCCESS) {
+    return ret;
+  }
+
+  *length = sizeof(he_conn_export_hdr_t) + plaintext_length + HE_CONN_EXPORT_TAG_SIZE;
+
+  return HE_SUCCESS;
+}
+
+static he_return_code_t he_conn_import_state(he_conn_t *conn, he_ssl_ctx_t *ctx,
+                                             he_plugin_chain_t *plugins, uint8_t version,
+                                             const uint8_t *plaintext, size_t plaintext_length) {
+  // Fields older versions don't have are left zero
+  he_conn_export_state_t state = {0};
+  size_t fields = he_conn_export_state_fields[version];
+  size_t state_length = fields + sizeof(state.wolf_length);
+  memcpy(&state, plaintext, fields);
+  memcpy(&state.wolf_length, plaintext + fields, sizeof(state.wolf_length));
+
+  if(state.wolf_length != plaintext_length - state_length) {
+    return HE_ERR_BAD_PACKET;
+  }
+
+  if(!he_ssl_ctx_is_supported_version(ctx, state.major_version, state.minor_version)) {
+    return HE_ERR_INCORRECT_PROTOCOL_VERSION;
+  }
+
+  // Pick up callbacks and the RNG from the new context, then restore what was negotiated
+  conn->protocol_version.major_version = state.major_version;
+  conn->protocol_version.minor_version = state.minor_version;
+  he_internal_conn_configure(conn, ctx);
+  conn->plugins = plugins;
+
+  conn->session_id = state.session_id;
+  conn->pending_session_id = state.pending_session_id;
+  conn->is_server = state.is_server;
+  conn->padding_type = (he_padding_type_t)state.padding_type;
+  conn->disable_roaming_connections = state.disable_roaming_connections;
+  conn->use_aggressive_mode = state.use_aggressive_mode;
+  conn->outside_mtu = state.outside_mtu;
+  // What was agreed with the peer, not what the context offers
+  conn->inner_mtu = state.inner_mtu;
+  conn->client_ip = state.client_ip;
+
+  // The client keeps using its address, so no one else here may be given it. Waking connections
+  // still hold theirs.
+  if(state.pool_address && conn->pool_address != state.pool_address) {
+    he_return_code_t res = he_internal_ip_pool_claim(conn, state.pool_address);
+    if(res != HE_SUCCESS) {
+      return res;
+    }
+  }
+
+  if((conn->wolf_ssl = wolfSSL_new(ctx->wolf_ctx)) == NULL) {
+    return HE_ERR_INIT_FAILED;
+  }
+
+  wolfSSL_dtls_set_using_nonblock(conn->wolf_ssl, 1);
+
+  // Keep what path MTU discovery found at both ends
+  conn->effective_mtu = state.effective_mtu;
+  conn->peer_mtu = state.peer_mtu;
+  uint16_t wolf_mtu =
+      (conn->effective_mtu || conn->peer_mtu)
+          ? (uint16_t)HE_PMTUD_WOLF_MTU(he_conn_get_effective_mtu(conn))
+          : (uint16_t)(conn->outside_mtu - HE_PACKET_OVERHEAD + HE_WOLF_MAX_HEADER_SIZE);
+  if(wolfSSL_dtls_set_mtu(conn->wolf_ssl, wolf_mtu) != SSL_SUCCESS) {
+    return HE_ERR_INVALID_MTU_SIZE;
+  }
+
+  wolfSSL_SetIOWriteCtx(conn->wolf_ssl, conn);
+  wolfSSL_SetIOReadCtx(conn->wolf_ssl, conn);
+
+  if(wolfSSL_dtls_import(conn->wolf_ssl, plaintext + state_length, state.wolf_length) <= 0) {
+    return HE_ERR_SSL_ERROR;
+  }
+
+  // The connection carries on exactly where it left off
+  conn->first_message_received = true;
+  he_internal_metrics_state_change(conn->metrics, conn->state, HE_STATE_ONLINE);
+  conn->state = HE_STATE_ONLINE;
+
+  return HE_SUCCESS;
+}
+
+he_return_code_t he_conn_import(he_conn_t *conn, he_ssl_ctx_t *ctx, he_plugin_chain_t *plugins,
+                                const uint8_t *buffer, size_t length) {
+  if(!conn || !ctx || !buffer) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  if(conn->wolf_ssl) {
+    return HE_ERR_INVALID_CLIENT_STATE;
+  }
+
+  if(!ctx->has_export_key) {
+    return HE_ERR_CONF_EXPORT_KEY_NOT_SET;
+  }
+
+  // Older versions have less state, the exact length is checked once the version is known
+  if(length < sizeof(he_conn_export_hdr_t) + HE_CONN_EXPORT_TAG_SIZE) {
+    return HE_ERR_BAD_PACKET;
+  }
+
+  he_conn_export_hdr_t hdr;
+  memcpy(&hdr, buffer, sizeof(he_conn_export_hdr_t));
+
+  if(hdr.magic[0] != 'H' || hdr.magic[1] != 'x' || hdr.version < HE_CONN_EXPORT_MIN_VERSION ||
+     hdr.version > HE_CONN_EXPORT_VERSION) {
+    return HE_ERR_BAD_PACKET;
+  }
+
+  size_t plaintext_length = ntohl(hdr.length);
+  if(plaintext_length < he_conn_export_state_fields[hdr.version] + sizeof(uint32_t) ||
+     plaintext_length != length - sizeof(he_conn_export_hdr_t) - HE_CONN_EXPORT_TAG_SIZE) {
+    return HE_ERR_BAD_PACKET;
+  }
+
+  uint8_t *plaintext = he_internal_malloc(plaintext_length);
+  if(!plaintext) {
+    return HE_ERR_NO_MEMORY;
+  }
+
+  const uint8_t *sealed = buffer + sizeof(he_conn_export_hdr_t);
+  he_return_code_t ret = he_conn_export_open(ctx->export_key, &hdr, sealed, plaintext_length,
+                                             sealed + plaintext_length, plaintext);
+  if(ret == HE_SUCCESS) {
+    ret = he_conn_import_state(conn, ctx, plugins, hdr.version, plaintext, plaintext_length);
+  }
+
+  // The plaintext holds session keys
+  memset(plaintext, 0, plaintext_length);
+  he_internal_free(plaintext);
+
+  return ret;
+}
+
+#else
+
+he_return_code_t he_conn_export(he_conn_t *conn, uint8_t *buffer, size_t *length) {
+  return HE_ERR_NOT_SUPPORTED;
+}
+
+he_return_code_t he_conn_import(he_conn_t *conn, he_ssl_ctx_t *ctx, he_plugin_chain_t *plugins,
+                                const uint8_t *buffer, size_t length) {
+  return HE_ERR_NOT_SUPPORTED;
+}
+
+#endif  // WOLFSSL_SESSION_EXPORT
+
+he_return_code_t he_conn_hibernate(he_conn_t *conn, he_ssl_ctx_t *ctx) {
+  if(!conn || !ctx) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  if(conn->hibernated_state) {
+    return HE_SUCCESS;
+  }
+
+  size_t length = 0;
+  he_return_code_t res = he_conn_export(conn, NULL, &length);
+  if(res != HE_SUCCESS) {
+    return res;
+  }
+
+  uint8_t *state = he_internal_malloc(length);
+  if(!state) {
+    return HE_ERR_NO_MEMORY;
+  }
+
+  res = he_conn_export(conn, state, &length);
+  if(res != HE_SUCCESS) {
+    he_internal_free(state);
+    return res;
+  }
+
+  // Everything WolfSSL had is now in the export, apart from what it counted
+  he_internal_conn_save_ssl_drops(conn);
+  wolfSSL_free(conn->wolf_ssl);
+  conn->wolf_ssl = NULL;
+
+  // Partly reassembled packets won't be finished before the peer gives up on them anyway
+  he_internal_frag_free(conn);
+  he_internal_gro_free(conn);
+
+  conn->hibernated_state = state;
+  conn->hibernated_length = length;
+  conn->hibernated_ctx = ctx;
+
+  return HE_SUCCESS;
+}
+
+he_return_code_t he_conn_hibernate_if_idle(he_conn_t *conn, he_ssl_ctx_t *ctx) {
+  if(!conn || !ctx) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  if(conn->state != HE_STATE_ONLINE) {
+    return HE_ERR_INVALID_CLIENT_STATE;
+  }
+
+  if(ctx->hibernate_idle_ms == 0 || conn->hibernated_state) {
+    return HE_SUCCESS;
+  }
+
+  // Counted rather than timestamped, as the keepalive scheduler does, to keep the clock off the
+  // data path
+  uint32_t now = (uint32_t)he_internal_clock_ms();
+  uint32_t activity = conn->rx_records + (uint32_t)conn->counters.inside_rx_packets;
+  if(activity != conn->hibernate_activity || conn->hibernate_active_ms == 0) {
+    conn->hibernate_activity = activity;
+    conn->hibernate_active_ms = now;
+    return HE_SUCCESS;
+  }
+
+  if(now - conn->hibernate_active_ms < ctx->hibernate_idle_ms) {
+    return HE_SUCCESS;
+  }
+
+  return he_conn_hibernate(conn, ctx);
+}
+
+bool he_conn_is_hibernating(he_conn_t *conn) {
+  return conn->hibernated_state != NULL;
+}
+
+he_return_code_t he_internal_conn_wake(he_conn_t *conn) {
+  uint8_t *state = conn->hibernated_state;
+  size_t length = conn->hibernated_length;
+  // Including no wheel at all, if the host went back to the nudge time callback
+  he_timers_t *timers = conn->timers;
+
+  conn->hibernated_state = NULL;
+  conn->hibernated_length = 0;
+
+  he_return_code_t res =
+      he_conn_import(conn, conn->hibernated_ctx, conn->plugins, state, length);
+  conn->timers = timers;
+
+  memset(state, 0, length);
+  he_internal_free(state);
+
+  if(res != HE_SUCCESS) {
+    // There is no way back, the client will have to reconnect
+    wolfSSL_free(conn->wolf_ssl);
+    conn->wolf_ssl = NULL;
+    he_internal_change_conn_state(conn, HE_STATE_DISCONNECTED);
+  }
+
+  return res;
+}
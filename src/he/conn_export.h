@@ -0,0 +1,200 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file conn_export.h
+ * @brief Functions for moving an established connection between threads or processes
+ *
+ * An exported connection is a sealed blob holding everything needed to carry on forwarding data:
+ * the D/TLS record layer state (keys, sequence numbers and replay window) as well as Helium's own
+ * session and configuration. It can be imported by any process holding the same export key and
+ * server configuration, so connections can be rebalanced or survive a process restart without
+ * forcing clients through a new handshake.
+ */
+
+#ifndef CONN_EXPORT_H
+#define CONN_EXPORT_H
+
+#include <he.h>
+
+/// Current version of the export format
+#define HE_CONN_EXPORT_VERSION 5
+/// Oldest version of the export format that can still be imported
+#define HE_CONN_EXPORT_MIN_VERSION 1
+/// Size of the AES-GCM IV used to seal an export
+#define HE_CONN_EXPORT_IV_SIZE 12
+/// Size of the AES-GCM tag on an export
+#define HE_CONN_EXPORT_TAG_SIZE 16
+
+#pragma pack(1)
+
+/**
+ * @brief Unencrypted header of an exported connection, authenticated as additional data
+ */
+typedef struct he_conn_export_hdr {
+  // 'H' and 'x'
+  char magic[2];
+  // Export format version
+  uint8_t version;
+  uint8_t reserved;
+  // Length of the sealed state, in network byte order
+  uint32_t length;
+  uint8_t iv[HE_CONN_EXPORT_IV_SIZE];
+} he_conn_export_hdr_t;
+
+/**
+ * @brief Helium's part of an exported connection, followed by the WolfSSL export
+ *
+ * New fields only ever go just before wolf_length, so an older export holds the fields that
+ * existed in its version followed by wolf_length. Fields it doesn't have are imported as zero,
+ * which must always mean the behaviour from before the field was added.
+ */
+typedef struct he_conn_export_state {
+  uint64_t session_id;
+  uint64_t pending_session_id;
+  uint8_t major_version;
+  uint8_t minor_version;
+  uint8_t is_server;
+  uint8_t padding_type;
+  uint8_t disable_roaming_connections;
+  uint8_t use_aggressive_mode;
+  uint16_t outside_mtu;
+  uint16_t inner_mtu;
+  uint32_t client_ip;
+  uint16_t effective_mtu;
+  uint16_t peer_mtu;
+  // Address from the server's pool, in host byte order
+  uint32_t pool_address;
+  uint32_t wolf_length;
+} he_conn_export_state_t;
+
+#pragma pack()
+
+/**
+ * @brief Export an online D/TLS connection
+ * @param conn A pointer to a valid, online connection
+ * @param buffer The buffer to write the export to, or NULL to find out how large it needs to be
+ * @param length In: the size of the buffer, out: the length of the export. If buffer is NULL, the
+ *        maximum size an export can be
+ * @return HE_SUCCESS The connection was exported
+ * @return HE_ERR_NULL_POINTER The conn or length pointer is NULL
+ * @return HE_ERR_INVALID_CONNECTION_TYPE Only datagram connections can be exported
+ * @return HE_ERR_INVALID_CLIENT_STATE The connection isn't online, or is renegotiating
+ * @return HE_ERR_CONF_EXPORT_KEY_NOT_SET No export key has been set on the SSL context
+ * @return HE_ERR_PACKET_TOO_LARGE The export doesn't fit in the buffer
+ * @return HE_ERR_SSL_ERROR WolfSSL could not export its state
+ * @return HE_ERR_NOT_SUPPORTED WolfSSL was built without session export support
+ *
+ * The export is sealed with AES-256-GCM under the key given to he_ssl_ctx_set_export_key(), so it
+ * can be kept in untrusted storage. Exporting does not change the connection, but the host must
+ * stop using it and destroy it once the export has been handed over -- two live copies of one
+ * connection would reuse D/TLS sequence numbers.
+ *
+ * @note Exports contain values in host byte order and can only be imported on a machine with the
+ *       same endianness
+ */
+he_return_code_t he_conn_export(he_conn_t *conn, uint8_t *buffer, size_t *length);
+
+/**
+ * @brief Restore a connection from an export
+ * @param conn A pointer to a newly created connection
+ * @param ctx A pointer to a started SSL context with the same configuration and export key as the
+ *        one the connection was exported from
+ * @param plugins A pointer to the plugin chain for this connection, can be NULL
+ * @param buffer A pointer to the export
+ * @param length The length of the export
+ * @return HE_SUCCESS The connection was restored and is online
+ * @return HE_ERR_NULL_POINTER One of the pointers is NULL
+ * @return HE_ERR_INVALID_CLIENT_STATE The connection has already been connected
+ * @return HE_ERR_CONF_EXPORT_KEY_NOT_SET No export key has been set on the SSL context
+ * @return HE_ERR_BAD_PACKET The export is malformed, has been tampered with, or was sealed with a
+ *         different key
+ * @return HE_ERR_INCORRECT_PROTOCOL_VERSION The export uses a protocol version the context does
+ *         not support
+ * @return HE_ERR_INIT_FAILED WolfSSL could not create the connection
+ * @return HE_ERR_SSL_ERROR WolfSSL could not import its state
+ * @return HE_ERR_NOT_SUPPORTED WolfSSL was built without session export support
+ * @return HE_ERR_IP_POOL_ADDRESS_TAKEN The connection's address is from the context's pool and
+ *         another connection already has it
+ *
+ * The connection goes straight to HE_STATE_ONLINE without a state change callback. If it was
+ * given an address from a pool and the context's pool covers it, it keeps that address.
+ *
+ * Exports from older versions of Helium, as far back as HE_CONN_EXPORT_MIN_VERSION, can be
+ * imported, so connections survive an upgrade of the server.
+ */
+he_return_code_t he_conn_import(he_conn_t *conn, he_ssl_ctx_t *ctx, he_plugin_chain_t *plugins,
+                                const uint8_t *buffer, size_t length);
+
+/**
+ * @brief Frees the D/TLS state of an idle connection until it is next needed
+ * @param conn A pointer to a valid, online connection
+ * @param ctx A pointer to the SSL context the connection was created with
+ * @return HE_SUCCESS The connection is hibernating (or already was)
+ * @return HE_ERR_NULL_POINTER The conn or ctx pointer is NULL
+ * @return HE_ERR_NO_MEMORY Not enough memory to hold the sealed state
+ * @return Any error returned by he_conn_export()
+ *
+ * The connection is exported into a small buffer and its WOLFSSL object is freed, which is where
+ * nearly all of a connection's memory goes. It stays online: the next call to
+ * he_conn_outside_data_received(), he_conn_inside_packet_received(), he_conn_send_keepalive() or
+ * he_conn_disconnect() rebuilds the D/TLS session before carrying on as normal. The host doesn't
+ * need to do anything else.
+ *
+ * Hosts that know better when a connection has gone quiet can call this directly, otherwise see
+ * he_conn_hibernate_if_idle().
+ *
+ * @note Requires an export key on the SSL context, see he_ssl_ctx_set_export_key()
+ */
+he_return_code_t he_conn_hibernate(he_conn_t *conn, he_ssl_ctx_t *ctx);
+
+/**
+ * @brief Hibernates a connection that has been idle for the SSL context's hibernate idle time
+ * @param conn A pointer to a valid connection
+ * @param ctx A pointer to the SSL context the connection was created with
+ * @return HE_SUCCESS The connection was hibernated, or wasn't idle for long enough yet
+ * @return HE_ERR_INVALID_CLIENT_STATE The connection isn't online
+ * @return HE_ERR_NULL_POINTER The conn or ctx pointer supplied is NULL
+ * @return Any error returned by he_conn_hibernate()
+ *
+ * A connection is idle while it neither receives records from the peer nor sends packets from the
+ * inside. Nothing is done unless an idle time has been set with
+ * he_ssl_ctx_set_hibernate_idle_time(). As with he_conn_send_keepalive_if_idle(), the host should
+ * call this regularly, e.g. every second, and idle time is measured in steps of however often it
+ * is called. Helium keeps no list of a context's connections, so visiting them is up to the host,
+ * e.g. alongside he_conn_send_keepalive_if_idle(). Connections sending idle keepalives more often
+ * than the idle time never hibernate.
+ */
+he_return_code_t he_conn_hibernate_if_idle(he_conn_t *conn, he_ssl_ctx_t *ctx);
+
+/**
+ * @brief Returns whether a connection is hibernating
+ * @param conn A pointer to a valid connection
+ * @return bool Whether the connection is hibernating
+ */
+bool he_conn_is_hibernating(he_conn_t *conn);
+
+/**
+ * @brief Rebuilds the D/TLS session of a hibernating connection
+ * @param conn A pointer to a hibernating connection
+ * @return HE_SUCCESS The connection is awake
+ * @return Any error returned by he_conn_import(), in which case the connection is disconnected
+ */
+he_return_code_t he_internal_conn_wake(he_conn_t *conn);
+
+#endif  // CONN_EXPORT_H
@@ -0,0 +1,315 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "cookie.h"
+#include "ssl_ctx.h"
+
+#ifndef WOLFSSL_USER_SETTINGS
+#include <wolfssl/options.h>
+#endif
+#include <wolfssl/wolfcrypt/settings.h>
+#include <wolfssl/wolfcrypt/hmac.h>
+
+// D/TLS content and handshake types we care about
+#define HE_DTLS_CONTENT_TYPE_HANDSHAKE 22
+#define HE_DTLS_HANDSHAKE_CLIENT_HELLO 1
+#define HE_DTLS_HANDSHAKE_HELLO_VERIFY_REQUEST 3
+
+// HelloVerifyRequests always carry the DTLS 1.0 version (RFC 6347 section 4.2.1)
+#define HE_DTLS_HVR_MAJOR_VERSION 0xfe
+#define HE_DTLS_HVR_MINOR_VERSION 0xff
+
+// Body of a HelloVerifyRequest: server version, cookie length, cookie
+#define HE_DTLS_HVR_BODY_SIZE (2 + 1 + HE_COOKIE_LENGTH)
+
+static inline uint32_t he_read_uint24(const uint8_t *p) {
+  return ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | (uint32_t)p[2];
+}
+
+static inline void he_write_uint24(uint8_t *p, uint32_t value) {
+  p[0] = (uint8_t)(value >> 16);
+  p[1] = (uint8_t)(value >> 8);
+  p[2] = (uint8_t)value;
+}
+
+he_return_code_t he_internal_parse_client_hello(const uint8_t *record, size_t length,
+                                                he_client_hello_t *hello) {
+  if(!record || !hello) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  if(length < HE_DTLS_RECORD_HEADER_SIZE + HE_DTLS_HANDSHAKE_HEADER_SIZE) {
+    return HE_ERR_BAD_PACKET;
+  }
+
+  // Record header: type, version, epoch, sequence number, length
+  if(record[0] != HE_DTLS_CONTENT_TYPE_HANDSHAKE) {
+    return HE_ERR_BAD_PACKET;
+  }
+
+  // Anything past epoch 0 belongs to an established session
+  if(record[3] != 0 || record[4] != 0) {
+    return HE_ERR_BAD_PACKET;
+  }
+
+  size_t record_length = ((size_t)record[11] << 8) | record[12];
+  if(record_length > length - HE_DTLS_RECORD_HEADER_SIZE) {
+    return HE_ERR_BAD_PACKET;
+  }
+
+  // Handshake header: type, length, message sequence, fragment offset, fragment length
+  const uint8_t *hs = record + HE_DTLS_RECORD_HEADER_SIZE;
+  if(hs[0] != HE_DTLS_HANDSHAKE_CLIENT_HELLO) {
+    return HE_ERR_BAD_PACKET;
+  }
+
+  uint32_t body_length = he_read_uint24(hs + 1);
+  uint32_t fragment_offset = he_read_uint24(hs + 6);
+  uint32_t fragment_length = he_read_uint24(hs + 9);
+
+  // We only handle ClientHellos that fit in a single datagram
+  if(fragment_offset != 0 || fragment_length != body_length ||
+     body_length > record_length - HE_DTLS_HANDSHAKE_HEADER_SIZE) {
+    return HE_ERR_BAD_PACKET;
+  }
+
+  const uint8_t *p = hs + HE_DTLS_HANDSHAKE_HEADER_SIZE;
+  const uint8_t *end = p + body_length;
+
+  // Client version and random
+  if(end - p < 2 + HE_DTLS_RANDOM_SIZE) {
+    return HE_ERR_BAD_PACKET;
+  }
+  hello->version_and_random = p;
+  p += 2 + HE_DTLS_RANDOM_SIZE;
+
+  // Session ID
+  if(end - p < 1 || end - p < 1 + p[0]) {
+    return HE_ERR_BAD_PACKET;
+  }
+  hello->session_id = p;
+  hello->session_id_length = 1 + p[0];
+  p += hello->session_id_length;
+
+  // Cookie
+  if(end - p < 1 || end - p < 1 + p[0]) {
+    return HE_ERR_BAD_PACKET;
+  }
+  hello->cookie_length = p[0];
+  hello->cookie = p + 1;
+  p += 1 + hello->cookie_length;
+
+  // Cipher suites
+  if(end - p < 2) {
+    return HE_ERR_BAD_PACKET;
+  }
+  size_t suites_length = ((size_t)p[0] << 8) | p[1];
+  if((size_t)(end - p) < 2 + suites_length) {
+    return HE_ERR_BAD_PACKET;
+  }
+  hello->cipher_suites = p;
+  hello->cipher_suites_length = 2 + suites_length;
+  p += hello->cipher_suites_length;
+
+  // Compression methods
+  if(end - p < 1 || end - p < 1 + p[0]) {
+    return HE_ERR_BAD_PACKET;
+  }
+  hello->compression_methods = p;
+  hello->compression_methods_length = 1 + p[0];
+
+  // Extensions are not covered by the cookie, so we don't need to look at them
+  hello->record_sequence = record + 5;
+
+  return HE_SUCCESS;
+}
+
+he_return_code_t he_internal_generate_cookie(const uint8_t *secret, const uint8_t *peer_address,
+                                             size_t peer_address_length,
+                                             const he_client_hello_t *hello, uint8_t *cookie) {
+  Hmac hmac;
+
+  if(wc_HmacInit(&hmac, NULL, INVALID_DEVID) != 0) {
+    return HE_ERR_FAILED;
+  }
+
+  int res = wc_HmacSetKey(&hmac, WC_SHA256, secret, HE_COOKIE_SECRET_LENGTH);
+
+  if(res == 0) {
+    res = wc_HmacUpdate(&hmac, peer_address, (word32)peer_address_length);
+  }
+  if(res == 0) {
+    res = wc_HmacUpdate(&hmac, hello->version_and_random, 2 + HE_DTLS_RANDOM_SIZE);
+  }
+  if(res == 0) {
+    res = wc_HmacUpdate(&hmac, hello->session_id, (word32)hello->session_id_length);
+  }
+  if(res == 0) {
+    res = wc_HmacUpdate(&hmac, hello->cipher_suites, (word32)hello->cipher_suites_length);
+  }
+  if(res == 0) {
+    res = wc_HmacUpdate(&hmac, hello->compression_methods,
+                        (word32)hello->compression_methods_length);
+  }
+  if(res == 0) {
+    res = wc_HmacFinal(&hmac, cookie);
+  }
+
+  wc_HmacFree(&hmac);
+
+  return res == 0 ? HE_SUCCESS : HE_ERR_FAILED;
+}
+
+/**
+ * Compare two cookies without leaking how many leading bytes matched
+ */
+static bool he_cookie_equal(const uint8_t *a, const uint8_t *b) {
+  uint8_t diff = 0;
+  for(size_t i = 0; i < HE_COOKIE_LENGTH; i++) {
+    diff |= a[i] ^ b[i];
+  }
+  return diff == 0;
+}
+
+static void he_write_hello_verify_request(const he_wire_hdr_t *request_hdr,
+                                          const he_client_hello_t *hello, const uint8_t *cookie,
+                                          uint8_t *response) {
+  // Echo the wire header back, without a session so the client doesn't adopt one
+  he_wire_hdr_t *hdr = (he_wire_hdr_t *)response;
+  memset(hdr, 0, sizeof(he_wire_hdr_t));
+  hdr->he[0] = 'H';
+  hdr->he[1] = 'e';
+  hdr->major_version = request_hdr->major_version;
+  hdr->minor_version = request_hdr->minor_version;
+
+  uint8_t *p = response + sizeof(he_wire_hdr_t);
+
+  // Record header, reusing the ClientHello's sequence number as RFC 6347 requires
+  uint16_t record_length = HE_DTLS_HANDSHAKE_HEADER_SIZE + HE_DTLS_HVR_BODY_SIZE;
+  p[0] = HE_DTLS_CONTENT_TYPE_HANDSHAKE;
+  p[1] = HE_DTLS_HVR_MAJOR_VERSION;
+  p[2] = HE_DTLS_HVR_MINOR_VERSION;
+  p[3] = 0;
+  p[4] = 0;
+  memcpy(p + 5, hello->record_sequence, 6);
+  p[11] = (uint8_t)(record_length >> 8);
+  p[12] = (uint8_t)record_length;
+  p += HE_DTLS_RECORD_HEADER_SIZE;
+
+  // Handshake header, unfragmented
+  p[0] = HE_DTLS_HANDSHAKE_HELLO_VERIFY_REQUEST;
+  he_write_uint24(p + 1, HE_DTLS_HVR_BODY_SIZE);
+  p[4] = 0;
+  p[5] = 0;
+  he_write_uint24(p + 6, 0);
+  he_write_uint24(p + 9, HE_DTLS_HVR_BODY_SIZE);
+  p += HE_DTLS_HANDSHAKE_HEADER_SIZE;
+
+  // Body
+  p[0] = HE_DTLS_HVR_MAJOR_VERSION;
+  p[1] = HE_DTLS_HVR_MINOR_VERSION;
+  p[2] = HE_COOKIE_LENGTH;
+  memcpy(p + 3, cookie, HE_COOKIE_LENGTH);
+}
+
+he_return_code_t he_ssl_ctx_verify_client_hello(he_ssl_ctx_t *ctx, const uint8_t *peer_address,
+                                                size_t peer_address_length, const uint8_t *packet,
+                                                size_t length, uint8_t *response,
+                                                size_t *response_length, bool *previous_secret) {
+  if(!ctx || !peer_address || !packet || !response || !response_length) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  if(ctx->connection_type != HE_CONNECTION_TYPE_DATAGRAM) {
+    return HE_ERR_INVALID_CONNECTION_TYPE;
+  }
+
+  if(!ctx->use_stateless_cookies) {
+    return HE_ERR_INVALID_CLIENT_STATE;
+  }
+
+  if(peer_address_length > HE_MAX_PEER_ADDRESS_LENGTH) {
+    return HE_ERR_PACKET_TOO_LARGE;
+  }
+
+  if(length < sizeof(he_wire_hdr_t)) {
+    return HE_ERR_PACKET_TOO_SMALL;
+  }
+
+  const he_wire_hdr_t *hdr = (const he_wire_hdr_t *)packet;
+
+  if(hdr->he[0] != 'H' || hdr->he[1] != 'e') {
+    return HE_ERR_NOT_HE_PACKET;
+  }
+
+  if(!he_ssl_ctx_is_supported_version(ctx, hdr->major_version, hdr->minor_version)) {
+    return HE_ERR_INCORRECT_PROTOCOL_VERSION;
+  }
+
+  he_client_hello_t hello = {0};
+  he_return_code_t res = he_internal_parse_client_hello(packet + sizeof(he_wire_hdr_t),
+                                                        length - sizeof(he_wire_hdr_t), &hello);
+  if(res != HE_SUCCESS) {
+    return res;
+  }
+
+  uint8_t cookie[HE_COOKIE_LENGTH] = {0};
+
+  res = he_internal_generate_cookie(ctx->cookie_secret, peer_address, peer_address_length, &hello,
+                                    cookie);
+  if(res != HE_SUCCESS) {
+    return res;
+  }
+
+  if(hello.cookie_length == HE_COOKIE_LENGTH) {
+    if(he_cookie_equal(cookie, hello.cookie)) {
+      if(previous_secret) {
+        *previous_secret = false;
+      }
+      return HE_SUCCESS;
+    }
+
+    // Cookies handed out just before a rotation are still good
+    if(ctx->has_previous_cookie_secret) {
+      uint8_t previous[HE_COOKIE_LENGTH] = {0};
+      res = he_internal_generate_cookie(ctx->previous_cookie_secret, peer_address,
+                                        peer_address_length, &hello, previous);
+      if(res != HE_SUCCESS) {
+        return res;
+      }
+      if(he_cookie_equal(previous, hello.cookie)) {
+        if(previous_secret) {
+          *previous_secret = true;
+        }
+        return HE_SUCCESS;
+      }
+    }
+  }
+
+  // No cookie, or one we didn't issue -- ask the client to prove its address
+  size_t needed = sizeof(he_wire_hdr_t) + HE_DTLS_RECORD_HEADER_SIZE +
+                  HE_DTLS_HANDSHAKE_HEADER_SIZE + HE_DTLS_HVR_BODY_SIZE;
+  if(*response_length < needed) {
+    return HE_ERR_PACKET_TOO_LARGE;
+  }
+
+  he_write_hello_verify_request(hdr, &hello, cookie, response);
+  *response_length = needed;
+
+  return HE_WANT_COOKIE;
+}
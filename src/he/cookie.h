@@ -0,0 +1,137 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file cookie.h
+ * @brief Functions for stateless D/TLS cookie exchange
+ *
+ * A server under load should not allocate a connection, or do any asymmetric crypto, for a
+ * ClientHello that may have come from a spoofed address. These functions let the host answer
+ * such ClientHellos with a HelloVerifyRequest without creating any per-client state, and only
+ * create a connection once the client has echoed back a valid cookie.
+ */
+
+#ifndef COOKIE_H
+#define COOKIE_H
+
+#include <he.h>
+
+/// Size of a D/TLS record header
+#define HE_DTLS_RECORD_HEADER_SIZE 13
+/// Size of a D/TLS handshake header
+#define HE_DTLS_HANDSHAKE_HEADER_SIZE 12
+/// Size of the random in a ClientHello
+#define HE_DTLS_RANDOM_SIZE 32
+/// Maximum size of the cookie in a ClientHello
+#define HE_DTLS_MAX_COOKIE_SIZE 255
+
+/**
+ * @brief The parts of a D/TLS ClientHello that the cookie is bound to
+ *
+ * All pointers point into the packet that was parsed and are only valid for as long as it is.
+ */
+typedef struct he_client_hello {
+  /// Record sequence number, echoed back in the HelloVerifyRequest
+  const uint8_t *record_sequence;
+  /// Client version followed by the client random
+  const uint8_t *version_and_random;
+  /// Session ID, prefixed with its one byte length
+  const uint8_t *session_id;
+  size_t session_id_length;
+  /// Cookie (without its length prefix)
+  const uint8_t *cookie;
+  size_t cookie_length;
+  /// Cipher suites, prefixed with their two byte length
+  const uint8_t *cipher_suites;
+  size_t cipher_suites_length;
+  /// Compression methods, prefixed with their one byte length
+  const uint8_t *compression_methods;
+  size_t compression_methods_length;
+} he_client_hello_t;
+
+/**
+ * @brief Checks a new D/TLS ClientHello for a valid stateless cookie
+ * @param ctx A pointer to a valid, started SSL context
+ * @param peer_address The sender's address in the host's native format (e.g. a struct sockaddr)
+ * @param peer_address_length The length of the sender's address
+ * @param packet A pointer to the datagram as received from the network, including the wire header
+ * @param length The length of the datagram
+ * @param response A buffer to write a HelloVerifyRequest into
+ * @param response_length In: the size of the response buffer, out: the length of the response
+ * @param previous_secret If not NULL, set after HE_SUCCESS to whether the cookie was issued under
+ *        the previous cookie secret
+ * @return HE_SUCCESS The ClientHello carries a valid cookie, a connection can now be created
+ * @return HE_WANT_COOKIE A HelloVerifyRequest has been written to the response buffer. The host
+ *         should send it to the peer and must not create a connection
+ * @return HE_ERR_NULL_POINTER One of the pointers supplied is NULL
+ * @return HE_ERR_INVALID_CONNECTION_TYPE The context is not a datagram context
+ * @return HE_ERR_INVALID_CLIENT_STATE Stateless cookies have not been enabled on this context
+ * @return HE_ERR_PACKET_TOO_LARGE The peer address or the response is too large
+ * @return HE_ERR_PACKET_TOO_SMALL The datagram is too small to be a Helium packet
+ * @return HE_ERR_NOT_HE_PACKET The datagram is not a Helium packet
+ * @return HE_ERR_INCORRECT_PROTOCOL_VERSION The datagram uses an unsupported protocol version
+ * @return HE_ERR_BAD_PACKET The datagram is not an initial D/TLS ClientHello
+ *
+ * The host should call this for datagrams that do not belong to any existing connection. Any
+ * return code other than HE_SUCCESS and HE_WANT_COOKIE means the datagram should be dropped.
+ * A response buffer of HE_MAX_WIRE_MTU bytes is always large enough.
+ *
+ * After HE_SUCCESS the host must pass the same peer address to he_conn_set_peer_address(), and
+ * previous_secret to he_conn_set_use_previous_cookie_secret(), before calling
+ * he_conn_server_connect(). WolfSSL then checks the cookie against the secret that issued it.
+ *
+ * @note This function does not modify the context, so it is safe to call from several threads at
+ *       once, as long as the cookie secret is not being rotated at the same time.
+ * @see he_ssl_ctx_set_use_stateless_cookies()
+ */
+he_return_code_t he_ssl_ctx_verify_client_hello(he_ssl_ctx_t *ctx, const uint8_t *peer_address,
+                                                size_t peer_address_length, const uint8_t *packet,
+                                                size_t length, uint8_t *response,
+                                                size_t *response_length, bool *previous_secret);
+
+/**
+ * @brief Parse a D/TLS ClientHello record
+ * @param record A pointer to the start of the D/TLS record, after the wire header
+ * @param length The length of the record
+ * @param hello A pointer to a client hello structure to fill in
+ * @return HE_SUCCESS The record is a well formed, unfragmented, initial ClientHello
+ * @return HE_ERR_NULL_POINTER Either pointer is NULL
+ * @return HE_ERR_BAD_PACKET The record is not a well formed initial ClientHello
+ */
+he_return_code_t he_internal_parse_client_hello(const uint8_t *record, size_t length,
+                                                he_client_hello_t *hello);
+
+/**
+ * @brief Generate the cookie for a ClientHello
+ * @param secret A pointer to a secret of HE_COOKIE_SECRET_LENGTH bytes
+ * @param peer_address The sender's address
+ * @param peer_address_length The length of the sender's address
+ * @param hello A pointer to a parsed ClientHello
+ * @param cookie A buffer of HE_COOKIE_LENGTH bytes to write the cookie into
+ * @return HE_SUCCESS The cookie was generated
+ * @return HE_ERR_FAILED The underlying HMAC failed
+ *
+ * The cookie is an HMAC-SHA256 over the peer address and the fields of the ClientHello that
+ * WolfSSL binds its own DTLS 1.2 cookies to, so once the connection is created WolfSSL accepts the
+ * cookie the client already holds.
+ */
+he_return_code_t he_internal_generate_cookie(const uint8_t *secret, const uint8_t *peer_address,
+                                             size_t peer_address_length,
+                                             const he_client_hello_t *hello, uint8_t *cookie);
+
+#endif  // COOKIE_H
@@ -17,6 +17,8 @@
  */
 
 #include "core.h"
+#include "atomic.h"
+#include "metrics.h"
 
 he_return_code_t he_internal_setup_stream_state(he_conn_t *conn, uint8_t *data, size_t length) {
   if(conn->incoming_data_left_to_read != 0) {
@@ -34,3 +36,30 @@ he_return_code_t he_internal_setup_stream_state(he_conn_t *conn, uint8_t *data,
 
   return HE_SUCCESS;
 }
+
+void he_internal_count_drop(he_conn_t *conn, he_return_code_t reason) {
+  he_conn_drop_count_t *drops = conn->counters.drops;
+
+  if(reason == HE_ERR_PLUGIN_DROP) {
+    he_internal_metrics_add(conn->metrics, HE_METRIC_PLUGIN_DROPS, 1);
+  }
+
+  // Slots are taken in order and never given back, so the first free one ends the search
+  uint64_t code = (uint64_t)(-(int64_t)reason);
+  if(reason < 0 && code < (1u << HE_CONN_DROP_REASON_BITS)) {
+    uint64_t one = 1ull << HE_CONN_DROP_REASON_BITS;
+    for(size_t i = 0; i < HE_CONN_DROP_SLOTS; i++) {
+      uint64_t value = he_atomic_load_u64(&drops[i].value);
+      // The other direction may claim the same free slot first, maybe for another reason
+      if(!value && he_atomic_cas_u64(&drops[i].value, &value, one | code)) {
+        return;
+      }
+      if(HE_CONN_DROP_REASON(value) == reason) {
+        he_atomic_add_u64(&drops[i].value, one);
+        return;
+      }
+    }
+  }
+
+  he_atomic_add_u64(&conn->counters.other_drops, 1);
+}
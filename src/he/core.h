@@ -32,6 +32,15 @@
  */
 he_return_code_t he_internal_setup_stream_state(he_conn_t *conn, uint8_t *data, size_t length);
 
+/**
+ * @brief Counts a packet or piece of outside data dropped for a reason
+ * @param conn A pointer to a valid connection
+ * @param reason The error the data was dropped with
+ *
+ * The first HE_CONN_DROP_SLOTS different reasons get their own counts, any others share one.
+ */
+void he_internal_count_drop(he_conn_t *conn, he_return_code_t reason);
+
 /**
  * Out of the box, Unity doesn't allow us to mock intra-module function calls.
  * This is generally OK but is *very* annoying for the packet lifecycle functions,
@@ -20,7 +20,15 @@
 #include "core.h"
 #include "msg_handlers.h"
 #include "conn.h"
+#include "clock.h"
+#include "conn_export.h"
+#include "frag.h"
+#include "gso.h"
+#include "metrics.h"
+#include "mss.h"
 #include "plugin_chain.h"
+#include "pmtud.h"
+#include "route_table.h"
 
 #ifndef WOLFSSL_USER_SETTINGS
 #include <wolfssl/options.h>
@@ -29,7 +37,7 @@
 #include <wolfssl/ssl.h>
 #include <wolfssl/wolfcrypt/settings.h>
 
-he_return_code_t he_conn_inside_packet_received(he_conn_t *conn, uint8_t *packet, size_t length) {
+static he_return_code_t he_flow_inside_packet(he_conn_t *conn, uint8_t *packet, size_t length) {
   // Return if packet is null
   if(!packet) {
     return HE_ERR_NULL_POINTER;
@@ -45,10 +53,28 @@ he_return_code_t he_conn_inside_packet_received(he_conn_t *conn, uint8_t *packet
     return HE_ERR_PACKET_TOO_SMALL;
   }
 
+  // Split tunnelling: bypassed packets are the host's to send, whatever their size
+  if((packet[0] >> 4) == 4 &&
+     he_internal_route_table_bypass(conn, ((ipv4_header_t *)packet)->dst_addr)) {
+    return HE_ERR_PACKET_BYPASSED;
+  }
+
   // Return if the packet is larger than the MTU of a Helium tunnel
-  // Note that we check both conditions here even though with the current implementation
-  // HE_MAX_MTU is lower than the normal outside_mtu value and the current packet overhead
-  if(length > HE_MAX_MTU || length > (conn->outside_mtu - HE_PACKET_OVERHEAD)) {
+  if(conn->inner_mtu) {
+    // Agreed with the peer, anything too large for a single message gets fragmented
+    if(length > conn->inner_mtu) {
+      return HE_ERR_PACKET_TOO_LARGE;
+    }
+  } else if(conn->effective_mtu || conn->peer_mtu) {
+    // Path MTU discovery at either end has measured what actually fits, which also makes the
+    // safety gap in the overhead unnecessary
+    if(length > he_conn_get_effective_mtu(conn) ||
+       length > (conn->outside_mtu - (int)HE_PMTUD_OVERHEAD)) {
+      return HE_ERR_PACKET_TOO_LARGE;
+    }
+  } else if(length > HE_MAX_MTU || length > (conn->outside_mtu - HE_PACKET_OVERHEAD)) {
+    // Note that we check both conditions here even though with the current implementation
+    // HE_MAX_MTU is lower than the normal outside_mtu value and the current packet overhead
     return HE_ERR_PACKET_TOO_LARGE;
   }
 
@@ -60,8 +86,19 @@ he_return_code_t he_conn_inside_packet_received(he_conn_t *conn, uint8_t *packet
     return HE_ERR_UNSUPPORTED_PACKET_TYPE;
   }
 
+  if(conn->hibernated_state) {
+    he_return_code_t wake_res = he_internal_conn_wake(conn);
+    if(wake_res != HE_SUCCESS) {
+      return wake_res;
+    }
+  }
+
+  if(conn->inner_mtu && length > he_conn_get_effective_mtu(conn)) {
+    return he_internal_frag_send(conn, packet, (uint16_t)length);
+  }
+
   // We need just enough space for the max packet size plus its header
-  uint8_t bytes[HE_MAX_MTU + sizeof(he_msg_data_t)] = {0};
+  uint8_t bytes[HE_MAX_PMTU + sizeof(he_msg_data_t)] = {0};
 
   // Allocate some space for the data message
   he_msg_data_t *hdr = (he_msg_data_t *)bytes;
@@ -80,14 +117,38 @@ he_return_code_t he_conn_inside_packet_received(he_conn_t *conn, uint8_t *packet
   // Copy packet int
   memcpy(bytes + sizeof(he_msg_data_t), packet, length);
 
+  // Done on our copy so the host's buffer is left as it was
+  if(conn->clamp_mss) {
+    he_internal_clamp_mss(bytes + sizeof(he_msg_data_t), length,
+                          (uint16_t)(he_conn_get_inner_mtu(conn) - HE_MSS_HEADER_OVERHEAD));
+  }
+
   // Send the data
-  he_return_code_t ret = he_internal_send_message(
-      conn, (uint8_t *)bytes,
-      he_internal_calculate_data_packet_length(conn, length) + sizeof(he_msg_data_t));
+  size_t padded_length = he_internal_calculate_data_packet_length(conn, length);
+  he_return_code_t ret =
+      he_internal_send_message(conn, (uint8_t *)bytes, padded_length + sizeof(he_msg_data_t));
+  if(ret == HE_SUCCESS) {
+    he_internal_metrics_add(conn->metrics, HE_METRIC_PADDING_BYTES, padded_length - length);
+  }
 
   return ret;
 }
 
+he_return_code_t he_conn_inside_packet_received(he_conn_t *conn, uint8_t *packet, size_t length) {
+  he_return_code_t res = he_flow_inside_packet(conn, packet, length);
+
+  if(res == HE_SUCCESS) {
+    conn->counters.inside_rx_packets++;
+    conn->counters.inside_rx_bytes += length;
+    he_internal_metrics_add_traffic(conn->metrics, HE_METRIC_INSIDE_RX_PACKETS, 1, length);
+  } else if(res != HE_ERR_PACKET_BYPASSED) {
+    // Bypassed packets aren't lost, the host sends them itself
+    he_internal_count_drop(conn, res);
+  }
+
+  return res;
+}
+
 he_return_code_t he_internal_flow_process_message(he_conn_t *conn) {
   // If the packet is too small then either the client is sending corrupted data or something is
   // very wrong with the SSL connection
@@ -118,6 +179,10 @@ he_return_code_t he_internal_flow_process_message(he_conn_t *conn) {
       return HE_SUCCESS;
     case HE_MSGID_DATA:
       return he_handle_msg_data(conn, buf, buf_len);
+    case HE_MSGID_DATA_FRAGMENT:
+      return he_handle_msg_data_fragment(conn, buf, buf_len);
+    case HE_MSGID_MTU:
+      return he_handle_msg_mtu(conn, buf, buf_len);
     case HE_MSGID_CONFIG_IPV4:
       if(!conn->is_server) {
         return he_handle_msg_config_ipv4(conn, buf, buf_len);
@@ -168,6 +233,13 @@ he_return_code_t he_internal_flow_fetch_message(he_conn_t *conn) {
       }
 
       if(error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+        // Only streams see these, WolfSSL drops bad D/TLS records silently and counts them itself
+        if(error == VERIFY_MAC_ERROR || error == DECRYPT_ERROR) {
+          conn->counters.decrypt_failures++;
+        } else if(error == SEQUENCE_ERROR || error == DUPLICATE_MSG_E) {
+          conn->counters.replays++;
+        }
+
         // if this is TCP then any SSL error is fatal (stream corruption).
         // If this is D/TLS we can actually ignore corrupted packets.
         return conn->connection_type == HE_CONNECTION_TYPE_STREAM ? HE_ERR_SSL_ERROR
@@ -195,6 +267,7 @@ he_return_code_t he_internal_update_session_incoming(he_conn_t *conn, he_wire_hd
     } else if(hdr->session == conn->pending_session_id) {
       conn->session_id = hdr->session;
       conn->pending_session_id = HE_PACKET_SESSION_EMPTY;
+      conn->counters.session_rotations++;
       he_internal_generate_event(conn, HE_EVENT_PENDING_SESSION_ACKNOWLEDGED);
       return HE_SUCCESS;
     } else {
@@ -202,28 +275,68 @@ he_return_code_t he_internal_update_session_incoming(he_conn_t *conn, he_wire_hd
     }
   } else {
     // Clients just accept it
+    if(conn->session_id != HE_PACKET_SESSION_EMPTY && hdr->session != conn->session_id) {
+      conn->counters.session_rotations++;
+    }
     conn->session_id = hdr->session;
     return HE_SUCCESS;
   }
 }
 
-he_return_code_t he_conn_outside_data_received(he_conn_t *conn, uint8_t *buffer, size_t length) {
-  // Return if packet is null
-  if(!buffer) {
-    return HE_ERR_NULL_POINTER;
+// Everything he_conn_outside_data_received() does once the plugins have seen the data
+static he_return_code_t he_flow_outside_data_after_plugins(he_conn_t *conn, uint8_t *buffer,
+                                                          size_t post_plugin_length) {
+  he_return_code_t res = HE_SUCCESS;
+
+  // Rebuild the D/TLS session of a hibernating connection before it's needed
+  if(conn->hibernated_state) {
+    res = he_internal_conn_wake(conn);
+    if(res != HE_SUCCESS) {
+      return res;
+    }
   }
 
+  if(conn->connection_type == HE_CONNECTION_TYPE_DATAGRAM) {
+    /// Streaming Stuff
+    res = HE_DISPATCH(he_internal_flow_outside_packet_received, conn, buffer, post_plugin_length);
+  } else if(conn->connection_type == HE_CONNECTION_TYPE_STREAM) {
+    res = HE_DISPATCH(he_internal_flow_outside_stream_received, conn, buffer, post_plugin_length);
+  } else {
+    return HE_ERR_INVALID_CLIENT_STATE;
+  }
+
+  // A batch carries on where this left off, so both wait until it's done
+  if(conn->receiving_batch) {
+    return res;
+  }
+
+  // Everything decrypted from this data has been seen, so segments held for GRO can go
+  he_internal_gro_flush(conn);
+
+  // Only hand the connection over once we're completely done with it on this thread
+  if(conn->handoff_pending && !he_conn_is_error_fatal(conn, res)) {
+    conn->handoff_pending = false;
+    conn->handoff_cb(conn, conn->data);
+  }
+
+  return res;
+}
+
+static he_return_code_t he_flow_outside_data(he_conn_t *conn, uint8_t *buffer, size_t length) {
+
   // Return if we're either disconnected or disconnecting
   if(conn->state == HE_STATE_DISCONNECTING || conn->state == HE_STATE_DISCONNECTED) {
     return HE_ERR_INVALID_CLIENT_STATE;
   }
 
   // Note that he_internal_plugins_egress is in wolf.c:he_wolf_dtls_write
-  size_t post_plugin_length = length;
-  int res = he_plugin_ingress(conn->plugins, buffer, &post_plugin_length, length);
+  he_plugin_packet_t packet = {buffer, length, conn->outside_headroom, conn->outside_tailroom,
+                               conn->plugin_state};
+  int res = he_plugin_ingress_packet(conn->plugins, &packet);
 
   if(res == HE_ERR_PLUGIN_DROP) {
     // No one needs to know
+    he_internal_count_drop(conn, res);
     return HE_SUCCESS;
   }
 
@@ -231,14 +344,106 @@ he_return_code_t he_conn_outside_data_received(he_conn_t *conn, uint8_t *buffer,
     return res;
   }
 
-  if(conn->connection_type == HE_CONNECTION_TYPE_DATAGRAM) {
-    /// Streaming Stuff
-    return HE_DISPATCH(he_internal_flow_outside_packet_received, conn, buffer, post_plugin_length);
-  } else if(conn->connection_type == HE_CONNECTION_TYPE_STREAM) {
-    return HE_DISPATCH(he_internal_flow_outside_stream_received, conn, buffer, post_plugin_length);
-  } else {
-    return HE_ERR_INVALID_CLIENT_STATE;
+  return he_flow_outside_data_after_plugins(conn, packet.data, packet.length);
+}
+
+he_return_code_t he_conn_outside_data_received(he_conn_t *conn, uint8_t *buffer, size_t length) {
+  // Return if packet is null
+  if(!buffer) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  conn->counters.outside_rx_packets++;
+  conn->counters.outside_rx_bytes += length;
+  he_internal_metrics_add_traffic(conn->metrics, HE_METRIC_OUTSIDE_RX_PACKETS, 1, length);
+
+  he_return_code_t res = he_flow_outside_data(conn, buffer, length);
+  if(res != HE_SUCCESS) {
+    he_internal_count_drop(conn, res);
+  }
+
+  return res;
+}
+
+he_return_code_t he_conn_outside_data_received_batch(he_conn_t *conn, uint8_t *const *buffers,
+                                                     const size_t *lengths, size_t count) {
+  if(!conn || !buffers || !lengths) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  he_return_code_t first_error = HE_SUCCESS;
+  bool fatal = false;
+
+  conn->receiving_batch = true;
+  for(size_t start = 0; start < count && !fatal; start += HE_PLUGIN_MAX_BATCH) {
+    size_t n = count - start < HE_PLUGIN_MAX_BATCH ? count - start : HE_PLUGIN_MAX_BATCH;
+
+    // Hand the plugins the whole chunk at once, leaving out anything that isn't a buffer
+    he_plugin_packet_t packets[HE_PLUGIN_MAX_BATCH];
+    he_return_code_t plugin_results[HE_PLUGIN_MAX_BATCH];
+    size_t packet_count = 0;
+    uint64_t bytes = 0;
+    for(size_t i = start; i < start + n; i++) {
+      if(buffers[i]) {
+        conn->counters.outside_rx_packets++;
+        conn->counters.outside_rx_bytes += lengths[i];
+        bytes += lengths[i];
+        he_plugin_packet_t *packet = &packets[packet_count++];
+        packet->data = buffers[i];
+        packet->length = lengths[i];
+        packet->headroom = conn->outside_headroom;
+        packet->tailroom = conn->outside_tailroom;
+        packet->state = conn->plugin_state;
+      }
+    }
+    he_internal_metrics_add_traffic(conn->metrics, HE_METRIC_OUTSIDE_RX_PACKETS, packet_count,
+                                    bytes);
+    he_plugin_ingress_batch(conn->plugins, packets, plugin_results, packet_count);
+
+    size_t packet = 0;
+    for(size_t i = start; i < start + n; i++) {
+      he_return_code_t res = HE_ERR_NULL_POINTER;
+      if(buffers[i]) {
+        res = plugin_results[packet];
+        if(conn->state == HE_STATE_DISCONNECTING || conn->state == HE_STATE_DISCONNECTED) {
+          res = HE_ERR_INVALID_CLIENT_STATE;
+        } else if(res == HE_ERR_PLUGIN_DROP) {
+          he_internal_count_drop(conn, res);
+          res = HE_SUCCESS;
+        } else if(res == HE_SUCCESS) {
+          res = he_flow_outside_data_after_plugins(conn, packets[packet].data,
+                                                   packets[packet].length);
+        }
+        if(res != HE_SUCCESS) {
+          he_internal_count_drop(conn, res);
+        }
+        packet++;
+      }
+
+      if(res == HE_SUCCESS) {
+        continue;
+      }
+
+      // One bad datagram shouldn't hold up the rest
+      if(first_error == HE_SUCCESS) {
+        first_error = res;
+      }
+      if(he_conn_is_error_fatal(conn, res)) {
+        fatal = true;
+        break;
+      }
+    }
   }
+  conn->receiving_batch = false;
+
+  he_internal_gro_flush(conn);
+
+  if(conn->handoff_pending && !fatal) {
+    conn->handoff_pending = false;
+    conn->handoff_cb(conn, conn->data);
+  }
+
+  return first_error;
 }
 
 he_return_code_t he_internal_flow_outside_packet_received(he_conn_t *conn, uint8_t *packet,
@@ -295,6 +500,16 @@ he_return_code_t he_internal_flow_outside_stream_received(he_conn_t *conn, uint8
 }
 
 he_return_code_t he_internal_flow_outside_data_verify_connection(he_conn_t *conn) {
+  // Anything from the peer answers our last handshake flight. Replies to a flight that was
+  // retransmitted are ambiguous though, so per Karn's rule they aren't timed.
+  if(conn->flight_sent_ms) {
+    if(conn->flight_retransmits == 0) {
+      he_internal_conn_rtt_sample(conn, (uint32_t)(he_internal_clock_ms() - conn->flight_sent_ms));
+    }
+    conn->flight_sent_ms = 0;
+  }
+  conn->flight_retransmits = 0;
+
   // Check to see if this is our first message and trigger an event change if it is
   if(!conn->first_message_received) {
     conn->first_message_received = true;
@@ -310,17 +525,18 @@ he_return_code_t he_internal_flow_outside_data_verify_connection(he_conn_t *conn
       int error = wolfSSL_get_error(conn->wolf_ssl, wolf_read);
 
       if(error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
-        // Check the server did not fail certificate verification
+        // None of these can be recovered from
+        he_return_code_t failure = HE_ERR_SSL_ERROR;
         if(error == ASN_SIG_CONFIRM_E) {
-          return HE_ERR_CANNOT_VERIFY_SERVER_CERT;
-        }
-        // Check the server did fail the DN check
-        if(error == DOMAIN_NAME_MISMATCH) {
-          return HE_ERR_SERVER_DN_MISMATCH;
+          // The server failed certificate verification
+          failure = HE_ERR_CANNOT_VERIFY_SERVER_CERT;
+        } else if(error == DOMAIN_NAME_MISMATCH) {
+          // The server failed the DN check
+          failure = HE_ERR_SERVER_DN_MISMATCH;
         }
 
-        // We can't recover from any other errors
-        return HE_ERR_SSL_ERROR;
+        he_internal_metrics_handshake_failed(conn->metrics, failure);
+        return failure;
       }
 
       // Update timer
@@ -354,6 +570,9 @@ he_return_code_t he_internal_flow_outside_data_handle_messages(he_conn_t *conn)
       break;
     }
 
+    // Any record from the peer shows the path is alive, see he_conn_send_keepalive_if_idle()
+    conn->rx_records++;
+
     // Process the message
     ret = he_internal_flow_process_message(conn);
 
@@ -369,7 +588,10 @@ he_return_code_t he_internal_flow_outside_data_handle_messages(he_conn_t *conn)
     // Check for renegotiation_in_progress
     bool temp_renegotiation_in_progress = wolfSSL_SSL_renegotiate_pending(conn->wolf_ssl);
     if(conn->renegotiation_in_progress && !temp_renegotiation_in_progress) {
+      conn->counters.renegotiations++;
       he_internal_generate_event(conn, HE_EVENT_SECURE_RENEGOTIATION_COMPLETED);
+      // As after the initial handshake, the handshake state is no longer needed
+      wolfSSL_FreeHandshakeResources(conn->wolf_ssl);
     }
     conn->renegotiation_in_progress = temp_renegotiation_in_progress;
 
@@ -36,6 +36,8 @@
  * HE_STATE_ONLINE state
  * @return HE_ERR_PACKET_TOO_SMALL The packet is too small to be a valid Helium packet
  * @return HE_ERR_UNSUPPORTED_PACKET_TYPE The packet is not an IPv4 packet
+ * @return HE_ERR_PACKET_BYPASSED The packet matched a bypass route in the connection's route table
+ * and the host should send it outside the tunnel, see he_conn_set_route_table()
  * @return HE_SUCCESS Packet was processed normally
  * @note It is expected that Helium will support IPv6 almost immediately, so it is worth keeping
  * this in mind.
@@ -60,12 +62,35 @@ he_return_code_t he_conn_inside_packet_received(he_conn_t *conn, uint8_t *packet
  * @return HE_SUCCESS The packet was processed normally.
  * @note These error codes may change before final release as new issues come to light.
  * @note If the conn has registered plugins, they may arbitrarily change the packet data,
- * but are restricted here to not exceeding the provided length. Users
+ * but are restricted here to the provided length plus any room set with
+ * he_ssl_ctx_set_outside_buffer_room(). Users
  * who wish to have more control over this should *not* register plugins upon connection, but
  * instead call the plugin API explicitly prior to invoking this function.
  */
 he_return_code_t he_conn_outside_data_received(he_conn_t *conn, uint8_t *buffer, size_t length);
 
+/**
+ * @brief Called when the host application has several datagrams for the same connection at once,
+ *        e.g. from recvmmsg()
+ * @param conn A valid Helium connection
+ * @param buffers Pointers to each datagram
+ * @param lengths The length of each datagram
+ * @param count How many datagrams there are
+ * @return HE_ERR_NULL_POINTER Any of the pointers provided are NULL
+ * @return HE_SUCCESS All datagrams were processed normally
+ * @return The first error he_conn_outside_data_received() returned for any of the datagrams
+ *
+ * Each datagram is processed as by he_conn_outside_data_received(). Datagrams after one that
+ * failed are still processed, unless the error was fatal. Segments are merged for the inside write
+ * GRO callback across the whole batch, and the handoff callback isn't called until the batch is
+ * done.
+ *
+ * Registered plugins see the datagrams through he_plugin_ingress_batch(), up to
+ * HE_PLUGIN_MAX_BATCH at a time, before any of them are processed.
+ */
+he_return_code_t he_conn_outside_data_received_batch(he_conn_t *conn, uint8_t *const *buffers,
+                                                     const size_t *lengths, size_t count);
+
 he_return_code_t he_internal_flow_process_message(he_conn_t *conn);
 he_return_code_t he_internal_flow_fetch_message(he_conn_t *conn);
 he_return_code_t he_internal_update_session_incoming(he_conn_t *conn, he_wire_hdr_t *hdr);
@@ -0,0 +1,101 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "flow_hash.h"
+#include "inet.h"
+#include "network.h"
+
+#include <string.h>
+
+#define HE_TCP_PROTOCOL 6
+#define HE_UDP_PROTOCOL 17
+#define HE_IPV4_MORE_FRAGMENTS 0x2000
+#define HE_IPV4_FRAGMENT_OFFSET_MASK 0x1FFF
+
+// The key from Microsoft's RSS specification, which NICs and their drivers default to
+static const uint8_t he_flow_hash_key[HE_FLOW_HASH_KEY_LENGTH] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2, 0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3,
+    0x8f, 0xb0, 0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4, 0x77, 0xcb, 0x2d, 0xa3,
+    0x80, 0x30, 0xf2, 0x0c, 0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa};
+
+uint32_t he_internal_toeplitz_hash(const uint8_t *input, size_t length) {
+  const uint8_t *key = he_flow_hash_key;
+  uint32_t hash = 0;
+  // The 32 bits of the key that line up with the current bit of input
+  uint32_t window = ((uint32_t)key[0] << 24) | ((uint32_t)key[1] << 16) |
+                    ((uint32_t)key[2] << 8) | (uint32_t)key[3];
+
+  for(size_t i = 0; i < length; i++) {
+    uint8_t next = key[i + 4];
+    for(int bit = 7; bit >= 0; bit--) {
+      if(input[i] & (1u << bit)) {
+        hash ^= window;
+      }
+      window = (window << 1) | ((next >> bit) & 1u);
+    }
+  }
+
+  return hash;
+}
+
+he_return_code_t he_flow_classify(const uint8_t *packet, size_t length, he_flow_info_t *flow) {
+  if(!packet || !flow) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  if(length < sizeof(ipv4_header_t)) {
+    return HE_ERR_PACKET_TOO_SMALL;
+  }
+
+  const ipv4_header_t *ip = (const ipv4_header_t *)packet;
+  if((ip->ver_ihl >> 4) != 4) {
+    return HE_ERR_UNSUPPORTED_PACKET_TYPE;
+  }
+
+  size_t ip_header_length = (size_t)(ip->ver_ihl & 0x0F) * 4;
+  if(ip_header_length < sizeof(ipv4_header_t) || ip_header_length > length) {
+    return HE_ERR_BAD_PACKET;
+  }
+
+  memset(flow, 0, sizeof(*flow));
+  flow->protocol = ip->protocol;
+  flow->src_addr = ntohl(ip->src_addr);
+  flow->dst_addr = ntohl(ip->dst_addr);
+
+  // Hashed as they are on the wire: addresses, then ports
+  uint8_t input[12];
+  size_t input_length = 8;
+  memcpy(input, &ip->src_addr, 8);
+
+  // Only the first fragment has the ports, so every fragment is hashed without them
+  bool is_fragment =
+      (ntohs(ip->flags_fo) & (HE_IPV4_MORE_FRAGMENTS | HE_IPV4_FRAGMENT_OFFSET_MASK)) != 0;
+
+  if(!is_fragment && (ip->protocol == HE_TCP_PROTOCOL || ip->protocol == HE_UDP_PROTOCOL) &&
+     length >= ip_header_length + 4) {
+    const uint8_t *ports = packet + ip_header_length;
+    flow->src_port = (uint16_t)((ports[0] << 8) | ports[1]);
+    flow->dst_port = (uint16_t)((ports[2] << 8) | ports[3]);
+    memcpy(input + 8, ports, 4);
+    input_length = 12;
+  }
+
+  flow->hash = he_internal_toeplitz_hash(input, input_length);
+
+  return HE_SUCCESS;
+}
@@ -0,0 +1,63 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file flow_hash.h
+ * @brief Functions for classifying inside packets by flow
+ *
+ * The flow hash is the Toeplitz hash NICs use for receive side scaling, computed with the
+ * standard key over the source and destination addresses and, for TCP and UDP, ports. Hosts can
+ * use it to keep each flow on one queue of a multiqueue tun device, or on one worker, so packets
+ * of a flow stay in order without any shared state.
+ */
+
+#ifndef FLOW_HASH_H
+#define FLOW_HASH_H
+
+#include <he.h>
+
+// Length of the standard RSS key, enough to hash up to 36 bytes of input
+#define HE_FLOW_HASH_KEY_LENGTH 40
+
+/**
+ * @brief Works out the 5-tuple and flow hash of an IPv4 packet
+ * @param packet A pointer to the packet
+ * @param length The length of the packet
+ * @param flow Set to the packet's flow
+ * @return HE_SUCCESS The flow was filled in
+ * @return HE_ERR_NULL_POINTER The packet or flow pointer supplied is NULL
+ * @return HE_ERR_PACKET_TOO_SMALL The packet is too small to be an IPv4 packet
+ * @return HE_ERR_UNSUPPORTED_PACKET_TYPE The packet is not an IPv4 packet
+ * @return HE_ERR_BAD_PACKET The IPv4 header length is wrong
+ *
+ * Helium does this for incoming packets when the inside write flow or GRO callback is set, the
+ * latter once per super-packet. Hosts can call
+ * it on outgoing packets, before passing them to he_conn_inside_packet_received(), to classify
+ * them the same way.
+ */
+he_return_code_t he_flow_classify(const uint8_t *packet, size_t length, he_flow_info_t *flow);
+
+/**
+ * @brief Computes the Toeplitz hash of the input with the standard RSS key
+ * @param input A pointer to the input
+ * @param length The length of the input, no more than HE_FLOW_HASH_KEY_LENGTH - 4
+ * @return uint32_t The hash
+ */
+uint32_t he_internal_toeplitz_hash(const uint8_t *input, size_t length);
+
+#endif  // FLOW_HASH_H
@@ -0,0 +1,214 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "frag.h"
+#include "clock.h"
+#include "conn.h"
+#include "inet.h"
+#include "memory.h"
+#include "metrics.h"
+
+#include <string.h>
+
+static void he_frag_release(he_reassembly_t *slot) {
+  if(slot->buffer) {
+    he_internal_free(slot->buffer);
+  }
+  memset(slot, 0, sizeof(he_reassembly_t));
+}
+
+he_return_code_t he_internal_frag_send(he_conn_t *conn, const uint8_t *packet, uint16_t length) {
+  // Each fragment goes in a record the same size as a full DATA message
+  uint16_t chunk = (uint16_t)(he_conn_get_effective_mtu(conn) + sizeof(he_msg_data_t) -
+                              sizeof(he_msg_data_fragment_t));
+  size_t count = ((size_t)length + chunk - 1) / chunk;
+
+  if(count > HE_FRAG_MAX_FRAGMENTS) {
+    return HE_ERR_PACKET_TOO_LARGE;
+  }
+
+  uint8_t bytes[HE_MAX_PMTU + sizeof(he_msg_data_t)] = {0};
+  he_msg_data_fragment_t *hdr = (he_msg_data_fragment_t *)bytes;
+  hdr->msg_header.msgid = HE_MSGID_DATA_FRAGMENT;
+  hdr->id = htons(conn->fragment_id++);
+  hdr->total_length = htons(length);
+  hdr->count = (uint8_t)count;
+
+  for(size_t i = 0; i < count; i++) {
+    size_t offset = i * chunk;
+    uint16_t fragment_length = (uint16_t)(length - offset < chunk ? length - offset : chunk);
+
+    hdr->index = (uint8_t)i;
+    hdr->length = htons(fragment_length);
+    memcpy(bytes + sizeof(he_msg_data_fragment_t), packet + offset, fragment_length);
+
+    // Padded like a DATA message carrying the same bytes, so only the last fragment grows. The
+    // padding mustn't give away what the previous fragment held.
+    size_t unpadded = sizeof(he_msg_data_fragment_t) - sizeof(he_msg_data_t) + fragment_length;
+    size_t padded = he_internal_calculate_data_packet_length(conn, unpadded);
+    memset(bytes + sizeof(he_msg_data_fragment_t) + fragment_length, 0, padded - unpadded);
+
+    he_return_code_t res =
+        he_internal_send_message(conn, bytes, (uint16_t)(sizeof(he_msg_data_t) + padded));
+    if(res != HE_SUCCESS) {
+      return res;
+    }
+    he_internal_metrics_add(conn->metrics, HE_METRIC_PADDING_BYTES, padded - unpadded);
+  }
+
+  return HE_SUCCESS;
+}
+
+static he_reassembly_t *he_frag_find_slot(he_conn_t *conn, uint16_t id, uint16_t total_length,
+                                          uint8_t count, uint16_t chunk_length, uint64_t now) {
+  he_reassembly_t *free_slot = NULL;
+  he_reassembly_t *oldest = NULL;
+
+  for(int i = 0; i < HE_FRAG_MAX_REASSEMBLIES; i++) {
+    he_reassembly_t *slot = &conn->reassembly[i];
+
+    // Whatever hasn't arrived by now was lost
+    if(slot->buffer && now - slot->started_ms >= HE_FRAG_TIMEOUT_MS) {
+      he_frag_release(slot);
+    }
+
+    if(!slot->buffer) {
+      if(!free_slot) {
+        free_slot = slot;
+      }
+      continue;
+    }
+
+    if(slot->id == id && slot->total_length == total_length && slot->count == count) {
+      return slot;
+    }
+
+    if(!oldest || slot->started_ms < oldest->started_ms) {
+      oldest = slot;
+    }
+  }
+
+  he_reassembly_t *slot = free_slot;
+  if(!slot) {
+    // Memory is bounded, so a new packet pushes out the one least likely to complete
+    slot = oldest;
+    he_frag_release(slot);
+  }
+
+  // Zeroed so that nothing left in the heap can ever be handed on, whatever the peer sends
+  slot->buffer = he_internal_calloc(1, total_length);
+  if(!slot->buffer) {
+    return NULL;
+  }
+  slot->id = id;
+  slot->total_length = total_length;
+  slot->chunk_length = chunk_length;
+  slot->count = count;
+  slot->started_ms = now;
+
+  return slot;
+}
+
+he_return_code_t he_internal_frag_reassemble(he_conn_t *conn,
+                                             const he_msg_data_fragment_t *fragment,
+                                             const uint8_t *data, uint16_t data_length,
+                                             uint8_t **packet, uint16_t *packet_length) {
+  *packet = NULL;
+  *packet_length = 0;
+
+  uint16_t id = ntohs(fragment->id);
+  uint16_t total_length = ntohs(fragment->total_length);
+  uint8_t count = fragment->count;
+  uint8_t index = fragment->index;
+
+  // Only what was agreed is accepted, which bounds the memory a peer can make us hold
+  if(conn->inner_mtu == 0 || total_length > conn->inner_mtu || data_length == 0 || count < 2 ||
+     count > HE_FRAG_MAX_FRAGMENTS || index >= count || data_length > total_length) {
+    return HE_ERR_BAD_PACKET;
+  }
+
+  // Every fragment but the last is chunk_length long and the last one holds what's left, which
+  // lets any fragment work out the chunk length on its own
+  size_t chunk_length = data_length;
+  if(index == count - 1) {
+    size_t rest = (size_t)total_length - data_length;
+    if(rest % (count - 1) != 0) {
+      return HE_ERR_BAD_PACKET;
+    }
+    chunk_length = rest / (count - 1);
+  }
+  // So that the fragments tile the packet exactly, with a last fragment that isn't empty
+  if(chunk_length == 0 || (size_t)(count - 1) * chunk_length >= total_length ||
+     (size_t)count * chunk_length < total_length) {
+    return HE_ERR_BAD_PACKET;
+  }
+  size_t offset = (size_t)index * chunk_length;
+
+  if(!conn->reassembly) {
+    conn->reassembly = he_internal_calloc(HE_FRAG_MAX_REASSEMBLIES, sizeof(he_reassembly_t));
+    if(!conn->reassembly) {
+      return HE_ERR_NO_MEMORY;
+    }
+  }
+
+  he_reassembly_t *slot = he_frag_find_slot(conn, id, total_length, count,
+                                            (uint16_t)chunk_length, he_internal_clock_ms());
+  if(!slot) {
+    return HE_ERR_NO_MEMORY;
+  }
+
+  // Disagrees with the fragments already received, so the pieces would overlap or leave gaps
+  if(slot->chunk_length != chunk_length) {
+    return HE_ERR_BAD_PACKET;
+  }
+
+  uint64_t bit = (uint64_t)1 << index;
+  if(slot->received & bit) {
+    // Duplicate, e.g. from aggressive mode
+    return HE_SUCCESS;
+  }
+
+  memcpy(slot->buffer + offset, data, data_length);
+  slot->received |= bit;
+  slot->received_length += data_length;
+
+  if(slot->received_length == slot->total_length) {
+    // Hand the buffer over rather than copying it out
+    *packet = slot->buffer;
+    *packet_length = slot->total_length;
+    slot->buffer = NULL;
+    he_frag_release(slot);
+  }
+
+  return HE_SUCCESS;
+}
+
+void he_internal_frag_free(he_conn_t *conn) {
+  if(!conn->reassembly) {
+    return;
+  }
+
+  for(int i = 0; i < HE_FRAG_MAX_REASSEMBLIES; i++) {
+    if(conn->reassembly[i].buffer) {
+      he_frag_release(&conn->reassembly[i]);
+    }
+  }
+
+  he_internal_free(conn->reassembly);
+  conn->reassembly = NULL;
+}
@@ -0,0 +1,79 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file frag.h
+ * @brief Functions for carrying packets larger than a single message across the tunnel
+ *
+ * With a jumbo inner MTU, packets larger than the effective MTU are split into DATA_FRAGMENT
+ * messages that each fit in a record the size of an ordinary full DATA message. The peer puts
+ * them back together in any order, holding at most HE_FRAG_MAX_REASSEMBLIES partial packets per
+ * connection and giving up on any that haven't completed within HE_FRAG_TIMEOUT_MS.
+ */
+
+#ifndef FRAG_H
+#define FRAG_H
+
+#include <he.h>
+
+// Most packets a connection puts back together at once, anything more evicts the oldest
+#define HE_FRAG_MAX_REASSEMBLIES 4
+// How long to wait for the rest of a packet before dropping what has arrived
+#define HE_FRAG_TIMEOUT_MS 2000
+// Most fragments a packet can be split into, one per bit of he_reassembly_t.received
+#define HE_FRAG_MAX_FRAGMENTS 64
+
+/**
+ * @brief Sends a packet larger than the effective MTU as a series of fragments
+ * @param conn A pointer to a valid connection
+ * @param packet A pointer to the packet
+ * @param length The length of the packet, no larger than the connection's inner MTU
+ * @return HE_SUCCESS All fragments were sent
+ * @return HE_ERR_PACKET_TOO_LARGE The packet would need more than HE_FRAG_MAX_FRAGMENTS
+ * @return HE_ERR_SSL_ERROR or HE_ERR_CONNECTION_WAS_CLOSED A fragment couldn't be sent
+ *
+ * Fragments are padded the same way as DATA messages, which only ever grows the last one.
+ */
+he_return_code_t he_internal_frag_send(he_conn_t *conn, const uint8_t *packet, uint16_t length);
+
+/**
+ * @brief Adds a fragment to the packet it belongs to
+ * @param conn A pointer to a valid connection
+ * @param fragment A pointer to the fragment header
+ * @param data A pointer to the fragment's data
+ * @param data_length The length of the data, taken from the fragment header
+ * @param packet Set to the reassembled packet once the last fragment has arrived, else NULL. The
+ *        caller owns the buffer and must free it with he_internal_free().
+ * @param packet_length Set to the length of the reassembled packet
+ * @return HE_SUCCESS The fragment was accepted, or was a duplicate and ignored
+ * @return HE_ERR_BAD_PACKET The fragment header is inconsistent, exceeds the inner MTU or doesn't
+ *         fit with the fragments of the same packet that have already arrived
+ * @return HE_ERR_NO_MEMORY There wasn't memory for the packet
+ */
+he_return_code_t he_internal_frag_reassemble(he_conn_t *conn,
+                                             const he_msg_data_fragment_t *fragment,
+                                             const uint8_t *data, uint16_t data_length,
+                                             uint8_t **packet, uint16_t *packet_length);
+
+/**
+ * @brief Drops any partially reassembled packets and frees the memory held for them
+ * @param conn A pointer to a valid connection
+ */
+void he_internal_frag_free(he_conn_t *conn);
+
+#endif  // FRAG_H
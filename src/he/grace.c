@@ -0,0 +1,72 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "grace.h"
+#include "atomic.h"
+
+he_return_code_t he_internal_grace_register_thread(he_grace_t *grace, size_t *thread_id) {
+  uint64_t id = he_atomic_add_u64(&grace->thread_count, 1);
+  if(id >= HE_GRACE_MAX_THREADS) {
+    return HE_ERR_TOO_MANY_THREADS;
+  }
+
+  he_atomic_store_u64(&grace->thread_epochs[id], he_atomic_load_u64(&grace->epoch));
+  *thread_id = (size_t)id;
+
+  return HE_SUCCESS;
+}
+
+void he_internal_grace_quiescent(he_grace_t *grace, size_t thread_id) {
+  if(thread_id < HE_GRACE_MAX_THREADS) {
+    he_atomic_store_u64(&grace->thread_epochs[thread_id], he_atomic_load_u64(&grace->epoch));
+  }
+}
+
+void he_internal_grace_thread_offline(he_grace_t *grace, size_t thread_id) {
+  if(thread_id < HE_GRACE_MAX_THREADS) {
+    he_atomic_store_u64(&grace->thread_epochs[thread_id], HE_GRACE_THREAD_OFFLINE);
+  }
+}
+
+uint64_t he_internal_grace_retire(he_grace_t *grace) {
+  return he_atomic_add_u64(&grace->epoch, 1) + 1;
+}
+
+uint64_t he_internal_grace_oldest(he_grace_t *grace) {
+  uint64_t thread_count = he_atomic_load_u64(&grace->thread_count);
+  if(thread_count > HE_GRACE_MAX_THREADS) {
+    thread_count = HE_GRACE_MAX_THREADS;
+  }
+  if(!thread_count) {
+    return 0;
+  }
+
+  uint64_t oldest = HE_GRACE_THREAD_OFFLINE;
+  for(uint64_t i = 0; i < thread_count; i++) {
+    uint64_t epoch = he_atomic_load_u64(&grace->thread_epochs[i]);
+    if(epoch < oldest) {
+      oldest = epoch;
+    }
+  }
+
+  return oldest;
+}
+
+bool he_internal_grace_has_threads(he_grace_t *grace) {
+  return he_atomic_load_u64(&grace->thread_count) > 0;
+}
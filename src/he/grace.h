@@ -0,0 +1,80 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file grace.h
+ * @brief Grace periods for memory that threads may still hold without taking a lock
+ *
+ * Shared structures that are read lock-free (the plugin chain's hooks, the connections an address
+ * pool hands out) can't free what they swap out straight away. Threads that read them register
+ * once and report a quiescent state whenever they hold nothing they read, e.g. between batches of
+ * packets. Each retirement bumps the epoch, and memory retired in an epoch every registered thread
+ * has reached since is no longer in use.
+ */
+
+#ifndef GRACE_H
+#define GRACE_H
+
+#include <he.h>
+
+/**
+ * @brief Registers a thread that will read the structure
+ * @param grace A pointer to the structure's grace period tracking
+ * @param thread_id Set to the ID to report quiescent states with
+ * @return HE_SUCCESS The thread was registered
+ * @return HE_ERR_TOO_MANY_THREADS HE_GRACE_MAX_THREADS threads are already registered
+ */
+he_return_code_t he_internal_grace_register_thread(he_grace_t *grace, size_t *thread_id);
+
+/**
+ * @brief Reports that a thread holds nothing it read from the structure
+ * @param grace A pointer to the structure's grace period tracking
+ * @param thread_id The ID from he_internal_grace_register_thread(), others are ignored
+ */
+void he_internal_grace_quiescent(he_grace_t *grace, size_t thread_id);
+
+/**
+ * @brief Reports that a thread won't read the structure until its next quiescent state
+ * @param grace A pointer to the structure's grace period tracking
+ * @param thread_id The ID from he_internal_grace_register_thread(), others are ignored
+ */
+void he_internal_grace_thread_offline(he_grace_t *grace, size_t thread_id);
+
+/**
+ * @brief Starts a new epoch for memory that has just been swapped out
+ * @param grace A pointer to the structure's grace period tracking
+ * @return uint64_t The epoch the memory was retired in
+ */
+uint64_t he_internal_grace_retire(he_grace_t *grace);
+
+/**
+ * @brief Finds the latest epoch whose retired memory no thread can still hold
+ * @param grace A pointer to the structure's grace period tracking
+ * @return uint64_t Memory retired in this epoch or earlier can be freed. 0 if no threads are
+ *         registered, as there's no telling who may still hold it.
+ */
+uint64_t he_internal_grace_oldest(he_grace_t *grace);
+
+/**
+ * @brief Whether any threads have been registered
+ * @param grace A pointer to the structure's grace period tracking
+ * @return bool true once he_internal_grace_register_thread() has been called
+ */
+bool he_internal_grace_has_threads(he_grace_t *grace);
+
+#endif  // GRACE_H
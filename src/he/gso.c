@@ -0,0 +1,383 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "gso.h"
+#include "flow.h"
+#include "flow_hash.h"
+#include "inet.h"
+#include "memory.h"
+#include "network.h"
+
+#include <string.h>
+
+#define HE_TCP_PROTOCOL 6
+#define HE_TCP_FLAG_FIN 0x01
+#define HE_TCP_FLAG_PSH 0x08
+#define HE_TCP_FLAG_ACK 0x10
+#define HE_TCP_FLAG_CWR 0x80
+#define HE_TCP_CHECKSUM_OFFSET 16
+#define HE_IPV4_MORE_FRAGMENTS 0x2000
+#define HE_IPV4_FRAGMENT_OFFSET_MASK 0x1FFF
+// IPv4 and TCP headers with as many options as they can carry
+#define HE_GSO_MAX_HEADER_LENGTH 120
+
+static void he_gso_write16(uint8_t *p, uint16_t value) {
+  p[0] = (uint8_t)(value >> 8);
+  p[1] = (uint8_t)(value & 0xFF);
+}
+
+// Ones' complement sum of big endian 16 bit words, an odd last byte padded with zero (RFC 1071)
+static uint32_t he_gso_sum(uint32_t sum, const uint8_t *data, size_t length) {
+  while(length > 1) {
+    sum += (uint32_t)((data[0] << 8) | data[1]);
+    data += 2;
+    length -= 2;
+  }
+  if(length) {
+    sum += (uint32_t)(data[0] << 8);
+  }
+  return sum;
+}
+
+static uint16_t he_gso_fold(uint32_t sum) {
+  while(sum >> 16) {
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  }
+  return (uint16_t)sum;
+}
+
+static uint32_t he_gso_pseudo_header_sum(const uint8_t *packet, size_t tcp_length) {
+  const ipv4_header_t *ip = (const ipv4_header_t *)packet;
+  // Source and destination addresses are next to each other
+  return he_gso_sum(HE_TCP_PROTOCOL + (uint32_t)tcp_length, (const uint8_t *)&ip->src_addr, 8);
+}
+
+static void he_gso_set_ipv4_checksum(uint8_t *packet, size_t ip_header_length) {
+  ipv4_header_t *ip = (ipv4_header_t *)packet;
+  ip->checksum = 0;
+  he_gso_write16((uint8_t *)&ip->checksum,
+                 (uint16_t)~he_gso_fold(he_gso_sum(0, packet, ip_header_length)));
+}
+
+static void he_gso_set_tcp_checksum(uint8_t *packet, size_t ip_header_length, size_t length) {
+  uint8_t *tcp = packet + ip_header_length;
+  size_t tcp_length = length - ip_header_length;
+  tcp[HE_TCP_CHECKSUM_OFFSET] = 0;
+  tcp[HE_TCP_CHECKSUM_OFFSET + 1] = 0;
+  uint32_t sum = he_gso_sum(he_gso_pseudo_header_sum(packet, tcp_length), tcp, tcp_length);
+  he_gso_write16(tcp + HE_TCP_CHECKSUM_OFFSET, (uint16_t)~he_gso_fold(sum));
+}
+
+// Length of the IPv4 and TCP headers of an unfragmented TCP segment, or 0 if it isn't one
+static size_t he_gso_tcp_headers_length(const uint8_t *packet, size_t length) {
+  if(length < sizeof(ipv4_header_t) + sizeof(tcp_header_t)) {
+    return 0;
+  }
+
+  const ipv4_header_t *ip = (const ipv4_header_t *)packet;
+  if((ip->ver_ihl >> 4) != 4 || ip->protocol != HE_TCP_PROTOCOL ||
+     (ntohs(ip->flags_fo) & (HE_IPV4_MORE_FRAGMENTS | HE_IPV4_FRAGMENT_OFFSET_MASK)) != 0) {
+    return 0;
+  }
+
+  size_t ip_header_length = (size_t)(ip->ver_ihl & 0x0F) * 4;
+  if(ip_header_length < sizeof(ipv4_header_t) ||
+     length < ip_header_length + sizeof(tcp_header_t)) {
+    return 0;
+  }
+
+  const tcp_header_t *tcp = (const tcp_header_t *)(packet + ip_header_length);
+  size_t tcp_header_length = (size_t)(tcp->data_offset >> 4) * 4;
+  if(tcp_header_length < sizeof(tcp_header_t) || length < ip_header_length + tcp_header_length) {
+    return 0;
+  }
+
+  return ip_header_length + tcp_header_length;
+}
+
+he_return_code_t he_conn_inside_gso_packet_received(he_conn_t *conn,
+                                                    const he_virtio_net_hdr_t *vnet_hdr,
+                                                    uint8_t *packet, size_t length) {
+  if(!conn || !vnet_hdr || !packet) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  uint8_t gso_type = vnet_hdr->gso_type & ~HE_VIRTIO_NET_HDR_GSO_ECN;
+
+  if(gso_type == HE_VIRTIO_NET_HDR_GSO_NONE) {
+    if(vnet_hdr->flags & HE_VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+      // The field already holds the sum of the pseudo header, the rest is left to us
+      size_t start = vnet_hdr->csum_start;
+      size_t offset = vnet_hdr->csum_offset;
+      if(start + offset + 2 > length) {
+        return HE_ERR_BAD_PACKET;
+      }
+      uint32_t sum = he_gso_sum(0, packet + start, length - start);
+      he_gso_write16(packet + start + offset, (uint16_t)~he_gso_fold(sum));
+    }
+    return he_conn_inside_packet_received(conn, packet, length);
+  }
+
+  if(gso_type != HE_VIRTIO_NET_HDR_GSO_TCPV4) {
+    return HE_ERR_UNSUPPORTED_PACKET_TYPE;
+  }
+
+  // Checked up front so the host's packet isn't taken apart for nothing
+  if(conn->state != HE_STATE_ONLINE) {
+    return HE_ERR_INVALID_CLIENT_STATE;
+  }
+
+  size_t header_length = he_gso_tcp_headers_length(packet, length);
+  if(!header_length || !vnet_hdr->gso_size) {
+    return HE_ERR_BAD_PACKET;
+  }
+
+  size_t total_length = ntohs(((ipv4_header_t *)packet)->total_length);
+  if(total_length < header_length || total_length > length) {
+    return HE_ERR_BAD_PACKET;
+  }
+
+  // Every segment starts out with a copy of the original headers
+  uint8_t headers[HE_GSO_MAX_HEADER_LENGTH];
+  memcpy(headers, packet, header_length);
+
+  size_t ip_header_length = (size_t)(headers[0] & 0x0F) * 4;
+  const ipv4_header_t *ip = (const ipv4_header_t *)headers;
+  const tcp_header_t *tcp = (const tcp_header_t *)(headers + ip_header_length);
+  uint16_t id = ntohs(ip->id);
+  uint32_t seq = ntohl(tcp->seq);
+
+  size_t payload_length = total_length - header_length;
+  size_t offset = 0;
+  uint16_t index = 0;
+
+  do {
+    size_t segment_payload = payload_length - offset;
+    if(segment_payload > vnet_hdr->gso_size) {
+      segment_payload = vnet_hdr->gso_size;
+    }
+    bool last = offset + segment_payload == payload_length;
+    size_t segment_length = header_length + segment_payload;
+
+    // Headers go right in front of this segment's payload, over the end of the previous segment
+    // which has already been sent
+    uint8_t *segment = packet + offset;
+    memcpy(segment, headers, header_length);
+
+    ipv4_header_t *segment_ip = (ipv4_header_t *)segment;
+    segment_ip->total_length = htons((uint16_t)segment_length);
+    segment_ip->id = htons((uint16_t)(id + index));
+    he_gso_set_ipv4_checksum(segment, ip_header_length);
+
+    tcp_header_t *segment_tcp = (tcp_header_t *)(segment + ip_header_length);
+    segment_tcp->seq = htonl(seq + (uint32_t)offset);
+    // As the kernel does it: FIN and PSH belong to the last segment, CWR to the first
+    if(!last) {
+      segment_tcp->flags &= (uint8_t) ~(HE_TCP_FLAG_FIN | HE_TCP_FLAG_PSH);
+    }
+    if(index > 0) {
+      segment_tcp->flags &= (uint8_t)~HE_TCP_FLAG_CWR;
+    }
+    he_gso_set_tcp_checksum(segment, ip_header_length, segment_length);
+
+    he_return_code_t res = he_conn_inside_packet_received(conn, segment, segment_length);
+    if(res != HE_SUCCESS) {
+      if(index == 0) {
+        // Only the headers have been written to so far, put them back for the host
+        memcpy(packet, headers, header_length);
+      }
+      return res;
+    }
+
+    offset += segment_payload;
+    index++;
+  } while(offset < payload_length);
+
+  return HE_SUCCESS;
+}
+
+// Blanks out everything that differs between segments of the same flow, before comparing
+static void he_gro_mask_headers(uint8_t *headers, size_t ip_header_length) {
+  ipv4_header_t *ip = (ipv4_header_t *)headers;
+  ip->total_length = 0;
+  ip->id = 0;
+  ip->checksum = 0;
+
+  tcp_header_t *tcp = (tcp_header_t *)(headers + ip_header_length);
+  tcp->seq = 0;
+  tcp->checksum = 0;
+  tcp->flags &= (uint8_t)~HE_TCP_FLAG_PSH;
+}
+
+static bool he_gro_can_merge(he_gro_t *gro, const uint8_t *packet, size_t header_length,
+                             size_t payload_length) {
+  const tcp_header_t *tcp = (const tcp_header_t *)(packet + (size_t)(packet[0] & 0x0F) * 4);
+  if(header_length != gro->header_length || payload_length > gro->gso_size ||
+     ntohl(tcp->seq) != gro->next_seq || gro->length + payload_length > gro->capacity) {
+    return false;
+  }
+
+  uint8_t held[HE_GSO_MAX_HEADER_LENGTH];
+  uint8_t next[HE_GSO_MAX_HEADER_LENGTH];
+  memcpy(held, gro->buffer, header_length);
+  memcpy(next, packet, header_length);
+
+  size_t ip_header_length = (size_t)(packet[0] & 0x0F) * 4;
+  he_gro_mask_headers(held, ip_header_length);
+  he_gro_mask_headers(next, ip_header_length);
+
+  return memcmp(held, next, header_length) == 0;
+}
+
+// Makes sure a super-packet of segments like this one fits, without holding on to more than that
+static bool he_gro_reserve(he_gro_t *gro, size_t header_length, size_t payload_length) {
+  size_t capacity = header_length + payload_length * HE_GRO_MAX_SEGMENTS;
+  if(capacity > HE_MAX_JUMBO_MTU) {
+    capacity = HE_MAX_JUMBO_MTU;
+  }
+  if(gro->capacity >= capacity) {
+    return true;
+  }
+
+  // Nothing is held when a new super-packet starts, so there's nothing to copy over
+  if(gro->buffer) {
+    he_internal_free(gro->buffer);
+  }
+  gro->buffer = he_internal_malloc(capacity);
+  gro->capacity = gro->buffer ? capacity : 0;
+  return gro->buffer != NULL;
+}
+
+// Packets reaching here have been validated, and a super-packet keeps the headers of its first
+// segment, so classifying can't fail
+static void he_gro_write(he_conn_t *conn, const he_virtio_net_hdr_t *vnet_hdr, uint8_t *packet,
+                         size_t length) {
+  he_flow_info_t flow = {0};
+  he_flow_classify(packet, length, &flow);
+  conn->inside_write_gro_cb(conn, vnet_hdr, &flow, packet, length, conn->data);
+}
+
+he_return_code_t he_internal_gro_deliver(he_conn_t *conn, uint8_t *packet, size_t length) {
+  size_t header_length = he_gso_tcp_headers_length(packet, length);
+  size_t payload_length = 0;
+  uint8_t flags = 0;
+  uint32_t seq = 0;
+
+  if(header_length) {
+    const tcp_header_t *tcp = (const tcp_header_t *)(packet + (size_t)(packet[0] & 0x0F) * 4);
+    size_t total_length = ntohs(((const ipv4_header_t *)packet)->total_length);
+    payload_length = total_length == length ? length - header_length : 0;
+    flags = tcp->flags;
+    seq = ntohl(tcp->seq);
+  }
+
+  // Only data segments of an established connection are worth merging
+  bool mergeable = payload_length && (flags & ~HE_TCP_FLAG_PSH) == HE_TCP_FLAG_ACK;
+
+  if(mergeable && !conn->gro) {
+    conn->gro = he_internal_calloc(1, sizeof(he_gro_t));
+  }
+
+  if(!mergeable || !conn->gro) {
+    // Anything held goes first so packets stay in order
+    he_internal_gro_flush(conn);
+    he_virtio_net_hdr_t vnet_hdr = {0};
+    he_gro_write(conn, &vnet_hdr, packet, length);
+    return HE_SUCCESS;
+  }
+
+  he_gro_t *gro = conn->gro;
+  if(gro->length && !he_gro_can_merge(gro, packet, header_length, payload_length)) {
+    he_internal_gro_flush(conn);
+  }
+
+  if(!gro->length && !he_gro_reserve(gro, header_length, payload_length)) {
+    he_virtio_net_hdr_t vnet_hdr = {0};
+    he_gro_write(conn, &vnet_hdr, packet, length);
+    return HE_SUCCESS;
+  }
+
+  if(!gro->length) {
+    memcpy(gro->buffer, packet, length);
+    gro->length = length;
+    gro->header_length = header_length;
+    gro->gso_size = (uint16_t)payload_length;
+    gro->segments = 1;
+  } else {
+    memcpy(gro->buffer + gro->length, packet + header_length, payload_length);
+    gro->length += payload_length;
+    gro->segments++;
+    // A PSH on the last segment stands for the whole super-packet
+    tcp_header_t *tcp = (tcp_header_t *)(gro->buffer + (size_t)(gro->buffer[0] & 0x0F) * 4);
+    tcp->flags |= flags & HE_TCP_FLAG_PSH;
+  }
+  gro->next_seq = seq + (uint32_t)payload_length;
+
+  // Nothing can follow a short segment or a PSH, nor a full segment once there's no room for it
+  if(payload_length < gro->gso_size || (flags & HE_TCP_FLAG_PSH) ||
+     gro->length + gro->gso_size > gro->capacity) {
+    he_internal_gro_flush(conn);
+  }
+
+  return HE_SUCCESS;
+}
+
+void he_internal_gro_flush(he_conn_t *conn) {
+  he_gro_t *gro = conn->gro;
+  if(!gro || !gro->length) {
+    return;
+  }
+
+  he_virtio_net_hdr_t vnet_hdr = {0};
+
+  if(gro->segments > 1) {
+    size_t ip_header_length = (size_t)(gro->buffer[0] & 0x0F) * 4;
+    ipv4_header_t *ip = (ipv4_header_t *)gro->buffer;
+    ip->total_length = htons((uint16_t)gro->length);
+    he_gso_set_ipv4_checksum(gro->buffer, ip_header_length);
+
+    // The TCP checksum is left for the kernel to complete when it splits the packet again, as it
+    // is for super-packets it merged itself
+    uint32_t sum = he_gso_pseudo_header_sum(gro->buffer, gro->length - ip_header_length);
+    he_gso_write16(gro->buffer + ip_header_length + HE_TCP_CHECKSUM_OFFSET, he_gso_fold(sum));
+
+    vnet_hdr.flags = HE_VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    vnet_hdr.gso_type = HE_VIRTIO_NET_HDR_GSO_TCPV4;
+    vnet_hdr.hdr_len = (uint16_t)gro->header_length;
+    vnet_hdr.gso_size = gro->gso_size;
+    vnet_hdr.csum_start = (uint16_t)ip_header_length;
+    vnet_hdr.csum_offset = HE_TCP_CHECKSUM_OFFSET;
+  }
+
+  size_t length = gro->length;
+  gro->length = 0;
+
+  if(conn->inside_write_gro_cb) {
+    he_gro_write(conn, &vnet_hdr, gro->buffer, length);
+  }
+}
+
+void he_internal_gro_free(he_conn_t *conn) {
+  if(conn->gro) {
+    if(conn->gro->buffer) {
+      he_internal_free(conn->gro->buffer);
+    }
+    he_internal_free(conn->gro);
+    conn->gro = NULL;
+  }
+}
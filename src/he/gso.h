@@ -0,0 +1,98 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file gso.h
+ * @brief Functions for exchanging TCP super-packets with TUN devices that do GSO and GRO
+ *
+ * Linux TUN devices opened with IFF_VNET_HDR hand over TCP super-packets of up to 64 KiB (GSO),
+ * each with a virtio-net header saying how to split it. Segmenting them here, straight into
+ * records, saves the host a pass through its TCP stack for every segment. In the other direction,
+ * in-order segments of one TCP flow decrypted together are merged back into a super-packet (GRO)
+ * before they are written, so the host's stack handles one large packet instead of many.
+ */
+
+#ifndef GSO_H
+#define GSO_H
+
+#include <he.h>
+
+// Most segments merged into one super-packet, which bounds the memory a connection holds for it
+#define HE_GRO_MAX_SEGMENTS 16
+
+/**
+ * @brief Called when the host application needs to deliver an inside packet read from a TUN
+ *        device with a virtio-net header
+ * @param conn A valid connection
+ * @param vnet_hdr The virtio-net header that came with the packet
+ * @param packet A pointer to the packet data, which is consumed if it's segmented, see below
+ * @param length The length of the packet
+ * @return HE_ERR_NULL_POINTER Any of the pointers supplied are NULL
+ * @return HE_ERR_INVALID_CLIENT_STATE Helium will reject packets if it is not in the
+ * HE_STATE_ONLINE state
+ * @return HE_ERR_UNSUPPORTED_PACKET_TYPE The header asks for a kind of segmentation other than
+ * TCP over IPv4
+ * @return HE_ERR_BAD_PACKET The packet doesn't match its header
+ * @return HE_SUCCESS All segments of the packet were processed normally
+ * @return Anything he_conn_inside_packet_received() can return for a segment
+ *
+ * Ordinary packets are passed to he_conn_inside_packet_received() once their checksum is
+ * completed, if the header says it needs to be. Super-packets are split into segments of the
+ * header's gso_size, each with its own IPv4 and TCP headers and checksums, and each of those is
+ * passed along in turn. Segments are built in place, each one's headers written over the end of
+ * the segment before it, so nothing is copied other than into the records themselves.
+ *
+ * Every segment has the same destination and none is larger than the first, so a segment that
+ * is bypassed or too large is always the first one. When the first segment is refused the packet
+ * is put back as it was, so the host can still act on it, e.g. send it outside the tunnel on
+ * HE_ERR_PACKET_BYPASSED. Once a segment has been accepted the packet has been consumed: its
+ * contents are no longer the original packet, even if a later segment fails, and the host must
+ * not send it anywhere.
+ */
+he_return_code_t he_conn_inside_gso_packet_received(he_conn_t *conn,
+                                                    const he_virtio_net_hdr_t *vnet_hdr,
+                                                    uint8_t *packet, size_t length);
+
+/**
+ * @brief Passes a packet that has come through the tunnel to the inside write GRO callback,
+ *        merging it with others of the same TCP flow where possible
+ * @param conn A pointer to a valid connection with the inside write GRO callback set
+ * @param packet A pointer to the packet, which is copied if it's held back
+ * @param length The length of the packet
+ * @return HE_SUCCESS The packet was written or is held to be merged
+ *
+ * Held segments are written by he_internal_gro_flush(), or as soon as something that can't be
+ * merged with them comes along. The buffer they are held in is sized for HE_GRO_MAX_SEGMENTS
+ * segments like the ones received, rather than the largest possible super-packet, and only grows
+ * when larger segments come along.
+ */
+he_return_code_t he_internal_gro_deliver(he_conn_t *conn, uint8_t *packet, size_t length);
+
+/**
+ * @brief Writes out any segments being held to be merged
+ * @param conn A pointer to a valid connection
+ */
+void he_internal_gro_flush(he_conn_t *conn);
+
+/**
+ * @brief Frees the memory held for merging segments
+ * @param conn A pointer to a valid connection
+ */
+void he_internal_gro_free(he_conn_t *conn);
+
+#endif  // GSO_H
@@ -0,0 +1,341 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "ip_pool.h"
+#include "atomic.h"
+#include "grace.h"
+#include "inet.h"
+#include "ipv4.h"
+#include "memory.h"
+#include "network.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+// Slots are stored plus one in the stack so that 0 can mean the end
+#define HE_IP_POOL_INDEX_MASK 0xFFFFFFFFull
+// Set in a slot's entry in conns while the slot is on the free stack
+#define HE_IP_POOL_ON_STACK 1ull
+
+static void he_ip_pool_format(uint32_t address, char *buffer) {
+  snprintf(buffer, HE_MAX_IPV4_STRING_LENGTH, "%u.%u.%u.%u", (address >> 24) & 0xFF,
+           (address >> 16) & 0xFF, (address >> 8) & 0xFF, address & 0xFF);
+}
+
+// Every change to the head bumps the generation, so a stale head never matches
+static uint64_t he_ip_pool_head(uint64_t old_head, uint64_t top) {
+  return (((old_head >> 32) + 1) << 32) | top;
+}
+
+static bool he_ip_pool_pop(he_ip_pool_t *pool, uint32_t *slot) {
+  uint64_t head = he_atomic_load_u64(&pool->head);
+  for(;;) {
+    uint64_t top = head & HE_IP_POOL_INDEX_MASK;
+    if(top == 0) {
+      return false;
+    }
+    // May be stale if another thread took this slot in the meantime, then the CAS fails
+    uint64_t below = he_atomic_load_u64(&pool->next[top - 1]);
+    if(he_atomic_cas_u64(&pool->head, &head, he_ip_pool_head(head, below))) {
+      *slot = (uint32_t)(top - 1);
+      return true;
+    }
+  }
+}
+
+static he_conn_t *he_ip_pool_owner(uint64_t entry) {
+  return (he_conn_t *)(uintptr_t)(entry & ~HE_IP_POOL_ON_STACK);
+}
+
+// Takes a slot popped off the stack for the connection, unless an import claimed it while it was
+// still on the stack, in which case it's simply left off the stack
+static bool he_ip_pool_take_popped(he_ip_pool_t *pool, uint32_t slot, he_conn_t *conn) {
+  uint64_t entry = he_atomic_load_u64(&pool->conns[slot]);
+  for(;;) {
+    uint64_t owner = entry & ~HE_IP_POOL_ON_STACK;
+    uint64_t next = owner ? owner : (uint64_t)(uintptr_t)conn;
+    if(he_atomic_cas_u64(&pool->conns[slot], &entry, next)) {
+      return !owner;
+    }
+  }
+}
+
+static void he_ip_pool_push(he_ip_pool_t *pool, uint32_t slot) {
+  uint64_t head = he_atomic_load_u64(&pool->head);
+  do {
+    he_atomic_store_u64(&pool->next[slot], head & HE_IP_POOL_INDEX_MASK);
+  } while(!he_atomic_cas_u64(&pool->head, &head, he_ip_pool_head(head, (uint64_t)slot + 1)));
+}
+
+he_ip_pool_t *he_ip_pool_create(const char *cidr) {
+  if(!cidr) {
+    return NULL;
+  }
+
+  uint32_t network = 0;
+  uint32_t prefix = 0;
+  if(!he_internal_ipv4_parse_prefix(cidr, &network, &prefix) || prefix < HE_IP_POOL_MIN_PREFIX ||
+     prefix > HE_IP_POOL_MAX_PREFIX) {
+    return NULL;
+  }
+
+  he_ip_pool_t *pool = he_internal_calloc(1, sizeof(he_ip_pool_t));
+  if(!pool) {
+    return NULL;
+  }
+
+  pool->network = network;
+  // Less the network, gateway and broadcast addresses
+  pool->size = (1u << (32 - prefix)) - 3;
+
+  pool->next = he_internal_calloc(pool->size, sizeof(uint64_t));
+  pool->conns = he_internal_calloc(pool->size, sizeof(uint64_t));
+  if(!pool->next || !pool->conns) {
+    he_ip_pool_destroy(pool);
+    return NULL;
+  }
+
+  // Lowest addresses on top, so clients get them in order on a fresh pool
+  for(uint32_t slot = 0; slot < pool->size; slot++) {
+    pool->next[slot] = slot + 1 < pool->size ? slot + 2 : 0;
+    pool->conns[slot] = HE_IP_POOL_ON_STACK;
+  }
+  pool->head = 1;
+  pool->available = pool->size;
+
+  return pool;
+}
+
+he_return_code_t he_ip_pool_destroy(he_ip_pool_t *pool) {
+  if(pool) {
+    while(pool->retired) {
+      he_conn_t *next = pool->retired->next_retired;
+      he_internal_free(pool->retired);
+      pool->retired = next;
+    }
+    he_internal_free((void *)pool->next);
+    he_internal_free((void *)pool->conns);
+    he_internal_free(pool);
+  }
+  return HE_SUCCESS;
+}
+
+size_t he_ip_pool_available(he_ip_pool_t *pool) {
+  if(!pool) {
+    return 0;
+  }
+
+  return (size_t)he_atomic_load_u64(&pool->available);
+}
+
+he_return_code_t he_internal_ip_pool_assign(he_conn_t *conn, he_network_config_ipv4_t *config) {
+  if(!conn || !config || !conn->ip_pool) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  he_ip_pool_t *pool = conn->ip_pool;
+
+  if(!conn->pool_address) {
+    uint32_t slot = 0;
+    do {
+      if(!he_ip_pool_pop(pool, &slot)) {
+        return HE_ERR_IP_POOL_EXHAUSTED;
+      }
+    } while(!he_ip_pool_take_popped(pool, slot, conn));
+    he_atomic_add_u64(&pool->available, (uint64_t)-1);
+
+    conn->pool_address = pool->network + 2 + slot;
+  }
+
+  he_ip_pool_format(conn->pool_address, config->local_ip);
+  he_ip_pool_format(pool->network + 1, config->peer_ip);
+  he_ip_pool_format(pool->network + 1, config->dns_ip);
+
+  return HE_SUCCESS;
+}
+
+he_return_code_t he_internal_ip_pool_claim(he_conn_t *conn, uint32_t address) {
+  if(!conn) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  he_ip_pool_t *pool = conn->ip_pool;
+  uint32_t slot = pool ? address - pool->network - 2 : 0;
+
+  // Not from this pool, so there's nothing to keep anyone else from being given
+  if(!pool || slot >= pool->size) {
+    return HE_SUCCESS;
+  }
+
+  // Free addresses are taken whether or not they're on the stack, a pop finds out later
+  uint64_t entry = he_atomic_load_u64(&pool->conns[slot]);
+  do {
+    he_conn_t *owner = he_ip_pool_owner(entry);
+    if(owner == conn) {
+      conn->pool_address = address;
+      return HE_SUCCESS;
+    }
+    if(owner) {
+      return HE_ERR_IP_POOL_ADDRESS_TAKEN;
+    }
+  } while(!he_atomic_cas_u64(&pool->conns[slot], &entry,
+                             (uint64_t)(uintptr_t)conn | (entry & HE_IP_POOL_ON_STACK)));
+  he_atomic_add_u64(&pool->available, (uint64_t)-1);
+
+  conn->pool_address = address;
+  return HE_SUCCESS;
+}
+
+void he_internal_ip_pool_release(he_conn_t *conn) {
+  if(!conn || !conn->pool_address || !conn->ip_pool) {
+    return;
+  }
+
+  he_ip_pool_t *pool = conn->ip_pool;
+  uint32_t slot = conn->pool_address - pool->network - 2;
+  conn->pool_address = 0;
+
+  if(slot >= pool->size) {
+    return;
+  }
+
+  // Stop lookups finding this connection before anyone else can be given the address. A slot
+  // claimed while it was on the stack is still there, and mustn't be pushed a second time.
+  uint64_t entry = he_atomic_load_u64(&pool->conns[slot]);
+  while(!he_atomic_cas_u64(&pool->conns[slot], &entry, HE_IP_POOL_ON_STACK)) {
+  }
+  if(!(entry & HE_IP_POOL_ON_STACK)) {
+    he_ip_pool_push(pool, slot);
+  }
+  he_atomic_add_u64(&pool->available, 1);
+}
+
+he_conn_t *he_ip_pool_lookup(he_ip_pool_t *pool, uint32_t address) {
+  if(!pool) {
+    return NULL;
+  }
+
+  // Addresses outside the range wrap around to slots past the end
+  uint32_t slot = ntohl(address) - pool->network - 2;
+  if(slot >= pool->size) {
+    return NULL;
+  }
+
+  return he_ip_pool_owner(he_atomic_load_u64(&pool->conns[slot]));
+}
+
+size_t he_ip_pool_lookup_batch(he_ip_pool_t *pool, uint8_t *const *packets, const size_t *lengths,
+                               size_t count, he_conn_t **conns) {
+  if(!pool || !packets || !lengths || !conns) {
+    return 0;
+  }
+
+  size_t found = 0;
+  for(size_t i = 0; i < count; i++) {
+    conns[i] = NULL;
+    if(!packets[i] || lengths[i] < sizeof(ipv4_header_t) || (packets[i][0] >> 4) != 4) {
+      continue;
+    }
+
+    uint32_t dst_addr;
+    memcpy(&dst_addr, packets[i] + offsetof(ipv4_header_t, dst_addr), sizeof(dst_addr));
+    conns[i] = he_ip_pool_lookup(pool, dst_addr);
+    if(conns[i]) {
+      found++;
+    }
+  }
+
+  return found;
+}
+
+he_return_code_t he_ip_pool_register_thread(he_ip_pool_t *pool, size_t *thread_id) {
+  if(!pool || !thread_id) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  return he_internal_grace_register_thread(&pool->grace, thread_id);
+}
+
+he_return_code_t he_ip_pool_quiescent(he_ip_pool_t *pool, size_t thread_id) {
+  if(!pool) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  he_internal_grace_quiescent(&pool->grace, thread_id);
+
+  return HE_SUCCESS;
+}
+
+he_return_code_t he_ip_pool_thread_offline(he_ip_pool_t *pool, size_t thread_id) {
+  if(!pool) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  he_internal_grace_thread_offline(&pool->grace, thread_id);
+
+  return HE_SUCCESS;
+}
+
+static size_t he_ip_pool_reclaim_locked(he_ip_pool_t *pool) {
+  uint64_t oldest = he_internal_grace_oldest(&pool->grace);
+
+  size_t pending = 0;
+  he_conn_t **link = &pool->retired;
+  while(*link) {
+    he_conn_t *conn = *link;
+    if(conn->retired_epoch <= oldest) {
+      *link = conn->next_retired;
+      he_internal_free(conn);
+    } else {
+      link = &conn->next_retired;
+      pending++;
+    }
+  }
+
+  return pending;
+}
+
+size_t he_ip_pool_reclaim(he_ip_pool_t *pool) {
+  if(!pool) {
+    return 0;
+  }
+
+  he_atomic_lock(&pool->writer);
+  size_t pending = he_ip_pool_reclaim_locked(pool);
+  he_atomic_unlock(&pool->writer);
+
+  return pending;
+}
+
+bool he_internal_ip_pool_retire(he_conn_t *conn) {
+  he_ip_pool_t *pool = conn ? conn->ip_pool : NULL;
+  // Hosts that never registered a lookup thread look after this themselves
+  if(!pool || !he_internal_grace_has_threads(&pool->grace)) {
+    return false;
+  }
+
+  he_atomic_lock(&pool->writer);
+  conn->retired_epoch = he_internal_grace_retire(&pool->grace);
+  conn->next_retired = pool->retired;
+  pool->retired = conn;
+  he_ip_pool_reclaim_locked(pool);
+  he_atomic_unlock(&pool->writer);
+
+  return true;
+}
@@ -0,0 +1,199 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file ip_pool.h
+ * @brief Functions for handing out tunnel addresses to clients
+ *
+ * Servers normally give each client an address from their populate network config callback. An
+ * address pool set on the SSL context does this for them: each client gets a free address from
+ * the range when it authenticates and gives it back when its connection is destroyed. The first
+ * address of the range after the network address is the server's own (the peer IP clients are
+ * told about), and the broadcast address is never handed out.
+ *
+ * A populate network config callback still runs after the pool, and sees the address it filled
+ * in. If the callback gives the client a different address, the pool's one is given back straight
+ * away and the new one is claimed instead when it's in the pool's range; authentication fails if
+ * another connection already has it.
+ *
+ * The address belongs to the connection rather than the session ID it started with, so clients
+ * keep it when they roam or their session ID is rotated. Hibernating connections keep it too.
+ * Connections moved with he_conn_export() take their address with them: he_conn_import() claims
+ * the same address in the pool on the other side, and fails if it's already in use there.
+ * Addresses from outside that pool are kept by the client but not tracked, so servers that move
+ * connections between them should either share a pool or use separate ranges.
+ *
+ * Taking and returning an address is O(1) and lock-free, so one pool can be shared by connections
+ * on any number of threads, and by several SSL contexts.
+ *
+ * The pool also maps its addresses back to connections, for packets heading from the Internet to
+ * clients. Lookups index straight into an array and never block, even while clients come and go
+ * on other threads. Hosts that look connections up on one thread and destroy them on another
+ * register their lookup threads, and destroyed connections are then only freed once every one of
+ * them has called he_ip_pool_quiescent() or he_ip_pool_thread_offline() since, the same way the
+ * plugin chain frees its old hooks.
+ */
+
+#ifndef IP_POOL_H
+#define IP_POOL_H
+
+#include <he.h>
+
+/**
+ * @brief Creates an address pool
+ * @param cidr The range to hand out, e.g. "10.125.0.0/16". The prefix must be between
+ *        HE_IP_POOL_MIN_PREFIX and HE_IP_POOL_MAX_PREFIX.
+ * @return he_ip_pool_t* Returns a pointer to an address pool, or NULL if the range is not valid or
+ *         the pool could not be allocated
+ */
+he_ip_pool_t *he_ip_pool_create(const char *cidr);
+
+/**
+ * @brief Releases all memory allocated by an address pool
+ * @param pool A pointer to an address pool, can be NULL
+ * @return HE_SUCCESS This function cannot fail
+ * @note Connections with addresses from the pool, and SSL contexts using it, must be destroyed
+ *       first. Destroyed connections still waiting for lookup threads are freed with the pool.
+ */
+he_return_code_t he_ip_pool_destroy(he_ip_pool_t *pool);
+
+/**
+ * @brief Returns how many addresses in the pool are free
+ * @param pool A pointer to a valid address pool
+ * @return size_t The number of free addresses, 0 if the pointer is NULL
+ */
+size_t he_ip_pool_available(he_ip_pool_t *pool);
+
+/**
+ * @brief Finds the connection that was given an address
+ * @param pool A pointer to a valid address pool
+ * @param address The address, in network byte order, e.g. straight from a packet's destination
+ * @return he_conn_t* The connection, or NULL if the address isn't from this pool or not in use
+ *
+ * This is what servers need to do with every packet coming back from the Internet before calling
+ * he_conn_inside_packet_received().
+ *
+ * The connection stays valid until the calling thread's next he_ip_pool_quiescent(), even if it is
+ * destroyed in the meantime, as long as the thread is registered with he_ip_pool_register_thread().
+ *
+ * @caution Without any registered threads he_conn_destroy() frees connections straight away, and
+ *          hosts that look up connections on one thread and destroy them on another must make sure
+ *          no thread can still be using a connection before destroying it.
+ */
+he_conn_t *he_ip_pool_lookup(he_ip_pool_t *pool, uint32_t address);
+
+/**
+ * @brief Finds the connection each of a batch of IPv4 packets is destined to
+ * @param pool A pointer to a valid address pool
+ * @param packets The packets, as read from the TUN device
+ * @param lengths The length of each packet
+ * @param count How many packets there are
+ * @param conns Set to the connection each packet is for, or NULL if it isn't for any connection
+ * @return size_t The number of packets that are for a connection, 0 if any pointer is NULL
+ *
+ * Does the same as calling he_ip_pool_lookup() with the destination address of every packet, for
+ * hosts that read packets in batches with recvmmsg() or similar.
+ *
+ * @see he_ip_pool_lookup()
+ */
+size_t he_ip_pool_lookup_batch(he_ip_pool_t *pool, uint8_t *const *packets, const size_t *lengths,
+                               size_t count, he_conn_t **conns);
+
+/**
+ * @brief Registers a thread that will look up connections in the pool
+ * @param pool A pointer to a valid address pool
+ * @param thread_id Set to the ID to report quiescent states with
+ * @return HE_SUCCESS The thread was registered
+ * @return HE_ERR_NULL_POINTER Either parameter was NULL
+ * @return HE_ERR_TOO_MANY_THREADS HE_GRACE_MAX_THREADS threads are already registered
+ *
+ * Once any thread is registered, he_conn_destroy() leaves connections with an address from the
+ * pool for the pool to free, so every thread that looks up connections should be registered.
+ */
+he_return_code_t he_ip_pool_register_thread(he_ip_pool_t *pool, size_t *thread_id);
+
+/**
+ * @brief Reports that the calling thread holds no connection it looked up in the pool
+ * @param pool A pointer to a valid address pool
+ * @param thread_id The ID from he_ip_pool_register_thread()
+ * @return HE_SUCCESS Always, unless pool is NULL
+ *
+ * Call this between packets, e.g. once per batch read from the TUN device; it is a single atomic
+ * store.
+ */
+he_return_code_t he_ip_pool_quiescent(he_ip_pool_t *pool, size_t thread_id);
+
+/**
+ * @brief Reports that the calling thread won't look up connections until its next quiescent state
+ * @param pool A pointer to a valid address pool
+ * @param thread_id The ID from he_ip_pool_register_thread()
+ * @return HE_SUCCESS Always, unless pool is NULL
+ *
+ * Call this before a thread blocks waiting for packets, so it doesn't hold up freeing destroyed
+ * connections, and he_ip_pool_quiescent() before it looks up connections again.
+ */
+he_return_code_t he_ip_pool_thread_offline(he_ip_pool_t *pool, size_t thread_id);
+
+/**
+ * @brief Frees destroyed connections that no lookup thread can still hold
+ * @param pool A pointer to a valid address pool
+ * @return size_t The number of destroyed connections still waiting for threads, 0 if pool is NULL
+ *
+ * Destroying connections does this already; call it to catch up later, e.g. from a timer.
+ */
+size_t he_ip_pool_reclaim(he_ip_pool_t *pool);
+
+/**
+ * @brief Gives the connection an address from its pool and fills it into the network config
+ * @param conn A pointer to a valid connection with a pool
+ * @param config The network config to fill in the local, peer and DNS IPs of
+ * @return HE_SUCCESS The connection has an address
+ * @return HE_ERR_NULL_POINTER Any of the pointers supplied, or the connection's pool, is NULL
+ * @return HE_ERR_IP_POOL_EXHAUSTED There are no free addresses left
+ *
+ * Connections that already have an address keep it. The DNS IP is set to the peer IP.
+ */
+he_return_code_t he_internal_ip_pool_assign(he_conn_t *conn, he_network_config_ipv4_t *config);
+
+/**
+ * @brief Gives the connection a particular address from its pool, e.g. one it had before export
+ * @param conn A pointer to a valid connection without an address of its own
+ * @param address The address, in host byte order
+ * @return HE_SUCCESS The connection has the address, or it isn't from the connection's pool
+ * @return HE_ERR_NULL_POINTER The conn pointer is NULL
+ * @return HE_ERR_IP_POOL_ADDRESS_TAKEN Another connection has the address
+ *
+ * Addresses outside the pool, or for connections without one, are left alone.
+ */
+he_return_code_t he_internal_ip_pool_claim(he_conn_t *conn, uint32_t address);
+
+/**
+ * @brief Gives the connection's address back to its pool, if it has one
+ * @param conn A pointer to a valid connection
+ */
+void he_internal_ip_pool_release(he_conn_t *conn);
+
+/**
+ * @brief Hands a destroyed connection to its pool to free once no lookup thread can hold it
+ * @param conn A pointer to a connection that has been torn down and given back its address
+ * @return bool true if the pool will free the connection, false if the caller should free it now
+ *         because it has no pool or the pool has no registered threads
+ */
+bool he_internal_ip_pool_retire(he_conn_t *conn);
+
+#endif  // IP_POOL_H
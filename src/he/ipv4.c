@@ -0,0 +1,126 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "ipv4.h"
+#include "inet.h"
+#include "network.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static bool he_ipv4_octets_valid(const unsigned int *octets) {
+  return octets[0] <= 255 && octets[1] <= 255 && octets[2] <= 255 && octets[3] <= 255;
+}
+
+static uint32_t he_ipv4_from_octets(const unsigned int *octets) {
+  return (octets[0] << 24) | (octets[1] << 16) | (octets[2] << 8) | octets[3];
+}
+
+uint16_t he_internal_ipv4_checksum(const uint8_t *header, size_t length) {
+  // Sum 32 bits at a time into a 64 bit accumulator and fold at the end. Ones' complement
+  // addition doesn't care about byte order, so words are summed as they are in memory and the
+  // result is already in network byte order.
+  uint64_t sum = 0;
+  size_t i = 0;
+  for(; i + 4 <= length; i += 4) {
+    uint32_t word;
+    memcpy(&word, header + i, sizeof(word));
+    sum += word;
+  }
+  if(i < length) {
+    uint16_t half;
+    memcpy(&half, header + i, sizeof(half));
+    sum += half;
+  }
+
+  while(sum >> 16) {
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  }
+
+  return (uint16_t)~sum;
+}
+
+he_inside_drop_reason_t he_internal_ipv4_validate(const uint8_t *packet, size_t *length,
+                                                  uint32_t allowed_src) {
+  if(!packet || !length || *length == 0 || (packet[0] >> 4) != 4) {
+    return HE_INSIDE_DROP_NOT_IPV4;
+  }
+
+  size_t header_length = (size_t)(packet[0] & 0x0F) * 4;
+  if(header_length < sizeof(ipv4_header_t) || header_length > *length) {
+    return HE_INSIDE_DROP_BAD_HEADER_LENGTH;
+  }
+
+  const ipv4_header_t *ip = (const ipv4_header_t *)packet;
+  size_t total_length = ntohs(ip->total_length);
+  if(total_length < header_length || total_length > *length) {
+    return HE_INSIDE_DROP_BAD_TOTAL_LENGTH;
+  }
+
+  if(allowed_src && ip->src_addr != allowed_src) {
+    return HE_INSIDE_DROP_SPOOFED_SOURCE;
+  }
+
+  if(he_internal_ipv4_checksum(packet, header_length) != 0) {
+    return HE_INSIDE_DROP_BAD_CHECKSUM;
+  }
+
+  // Anything after the IPv4 packet is padding and shouldn't reach the inside
+  *length = total_length;
+
+  return HE_INSIDE_DROP_NONE;
+}
+
+bool he_internal_ipv4_parse_address(const char *text, uint32_t *address) {
+  if(!text || !address) {
+    return false;
+  }
+
+  // Anything left over ends up in trailing and makes the count 5
+  unsigned int octets[4] = {0};
+  char trailing = 0;
+  if(sscanf(text, "%u.%u.%u.%u%c", &octets[0], &octets[1], &octets[2], &octets[3], &trailing) !=
+         4 ||
+     !he_ipv4_octets_valid(octets)) {
+    return false;
+  }
+
+  *address = he_ipv4_from_octets(octets);
+  return true;
+}
+
+bool he_internal_ipv4_parse_prefix(const char *text, uint32_t *network, uint32_t *prefix_length) {
+  if(!text || !network || !prefix_length) {
+    return false;
+  }
+
+  unsigned int octets[4] = {0};
+  unsigned int length = 0;
+  char trailing = 0;
+  if(sscanf(text, "%u.%u.%u.%u/%u%c", &octets[0], &octets[1], &octets[2], &octets[3], &length,
+            &trailing) != 5 ||
+     !he_ipv4_octets_valid(octets) || length > 32) {
+    return false;
+  }
+
+  // Shifting a 32 bit value by 32 is undefined
+  uint32_t mask = length ? 0xFFFFFFFFu << (32 - length) : 0;
+  *network = he_ipv4_from_octets(octets) & mask;
+  *prefix_length = length;
+  return true;
+}
@@ -0,0 +1,72 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file ipv4.h
+ * @brief Validation of IPv4 packets coming out of the tunnel
+ *
+ * Every packet handed to the inside has been decrypted, so it has come from the peer, but that
+ * doesn't make it well formed -- a buggy or hostile peer can send anything. The checks here are
+ * ordered cheapest first so bad packets are dropped before any work is done on them.
+ */
+
+#ifndef IPV4_H
+#define IPV4_H
+
+#include <he.h>
+
+/**
+ * @brief Computes the Internet checksum of an IPv4 header
+ * @param header A pointer to the header
+ * @param length The length of the header, a multiple of 2
+ * @return uint16_t The checksum, in network byte order, ready to be copied into the header
+ *
+ * A header with the right checksum in place sums to 0.
+ */
+uint16_t he_internal_ipv4_checksum(const uint8_t *header, size_t length);
+
+/**
+ * @brief Checks an IPv4 packet is well formed before it is handed to the inside
+ * @param packet A pointer to the packet
+ * @param length In: the number of bytes received, out: the length of the IPv4 packet, which is
+ *        shorter if it was followed by padding
+ * @param allowed_src The only source address to accept, in network byte order, or 0 for any
+ * @return HE_INSIDE_DROP_NONE The packet is valid
+ * @return he_inside_drop_reason_t Why the packet should be dropped
+ */
+he_inside_drop_reason_t he_internal_ipv4_validate(const uint8_t *packet, size_t *length,
+                                                  uint32_t allowed_src);
+
+/**
+ * @brief Parses a dotted quad IPv4 address
+ * @param text The address, e.g. "10.125.0.2"
+ * @param address Set to the address, in host byte order
+ * @return bool Whether the text was a valid address
+ */
+bool he_internal_ipv4_parse_address(const char *text, uint32_t *address);
+
+/**
+ * @brief Parses an IPv4 prefix in CIDR notation
+ * @param text The prefix, e.g. "10.125.0.0/16"
+ * @param network Set to the network address, in host byte order, with any host bits cleared
+ * @param prefix_length Set to the prefix length, 0 to 32
+ * @return bool Whether the text was a valid prefix
+ */
+bool he_internal_ipv4_parse_prefix(const char *text, uint32_t *network, uint32_t *prefix_length);
+
+#endif  // IPV4_H
@@ -0,0 +1,264 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "metrics.h"
+#include "atomic.h"
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#define HE_METRICS_THREAD_LOCAL __declspec(thread)
+#else
+#define HE_METRICS_THREAD_LOCAL __thread
+#endif
+
+// Threads are handed shards in the order they first count something, the same shard in every
+// context
+static volatile uint64_t he_metrics_threads = 0;
+// This thread's shard plus one, or 0 before it has counted anything
+static HE_METRICS_THREAD_LOCAL uint64_t he_metrics_thread_shard = 0;
+
+// Label values for he_client_state_t, NULL for values that aren't a state
+static const char *const he_metrics_state_names[HE_METRICS_STATE_COUNT] = {
+    [HE_STATE_NONE] = "none",
+    [HE_STATE_DISCONNECTED] = "disconnected",
+    [HE_STATE_CONNECTING] = "connecting",
+    [HE_STATE_DISCONNECTING] = "disconnecting",
+    [HE_STATE_AUTHENTICATING] = "authenticating",
+    [HE_STATE_LINK_UP] = "link_up",
+    [HE_STATE_ONLINE] = "online",
+    [HE_STATE_CONFIGURING] = "configuring",
+};
+
+static he_metrics_shard_t *he_metrics_shard(he_ctx_metrics_t *metrics) {
+  if(!he_metrics_thread_shard) {
+    he_metrics_thread_shard = he_atomic_add_u64(&he_metrics_threads, 1) % HE_METRICS_SHARDS + 1;
+  }
+  return &metrics->shards[he_metrics_thread_shard - 1];
+}
+
+void he_internal_metrics_add(he_ctx_metrics_t *metrics, he_metric_t metric, uint64_t value) {
+  if(!metrics || metric >= HE_METRIC_COUNT) {
+    return;
+  }
+  he_atomic_add_u64(&he_metrics_shard(metrics)->counters[metric], value);
+}
+
+void he_internal_metrics_add_traffic(he_ctx_metrics_t *metrics, he_metric_t packets_metric,
+                                     uint64_t packets, uint64_t bytes) {
+  if(!metrics || packets_metric + 1 >= HE_METRIC_COUNT || !packets) {
+    return;
+  }
+  he_metrics_shard_t *shard = he_metrics_shard(metrics);
+  he_atomic_add_u64(&shard->counters[packets_metric], packets);
+  he_atomic_add_u64(&shard->counters[packets_metric + 1], bytes);
+}
+
+void he_internal_metrics_handshake_failed(he_ctx_metrics_t *metrics, he_return_code_t reason) {
+  if(!metrics || reason >= 0 || -reason >= HE_METRICS_MAX_ERROR_CODES) {
+    return;
+  }
+  he_atomic_add_u64(&he_metrics_shard(metrics)->handshake_failures[-reason], 1);
+}
+
+void he_internal_metrics_conn_added(he_ctx_metrics_t *metrics, he_client_state_t state) {
+  if(!metrics || state >= HE_METRICS_STATE_COUNT) {
+    return;
+  }
+  he_atomic_add_u64(&he_metrics_shard(metrics)->connections[state], 1);
+}
+
+void he_internal_metrics_conn_removed(he_ctx_metrics_t *metrics, he_client_state_t state) {
+  if(!metrics || state >= HE_METRICS_STATE_COUNT) {
+    return;
+  }
+  // Wraps around if the connection was counted in on another shard, which the sum undoes
+  he_atomic_add_u64(&he_metrics_shard(metrics)->connections[state], UINT64_MAX);
+}
+
+void he_internal_metrics_state_change(he_ctx_metrics_t *metrics, he_client_state_t from,
+                                      he_client_state_t to) {
+  if(from == to) {
+    return;
+  }
+  he_internal_metrics_conn_removed(metrics, from);
+  he_internal_metrics_conn_added(metrics, to);
+}
+
+he_return_code_t he_ssl_ctx_get_metrics(he_ssl_ctx_t *ctx, he_metrics_t *metrics) {
+  if(!ctx || !metrics) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  uint64_t counters[HE_METRIC_COUNT] = {0};
+  memset(metrics, 0, sizeof(he_metrics_t));
+
+  for(size_t i = 0; i < HE_METRICS_SHARDS; i++) {
+    he_metrics_shard_t *shard = &ctx->metrics.shards[i];
+    for(size_t j = 0; j < HE_METRIC_COUNT; j++) {
+      counters[j] += he_atomic_load_u64(&shard->counters[j]);
+    }
+    for(size_t j = 0; j < HE_METRICS_STATE_COUNT; j++) {
+      metrics->connections[j] += he_atomic_load_u64(&shard->connections[j]);
+    }
+    for(size_t j = 0; j < HE_METRICS_MAX_ERROR_CODES; j++) {
+      metrics->handshake_failures[j] += he_atomic_load_u64(&shard->handshake_failures[j]);
+    }
+  }
+
+  // A connection that changed state while the shards were being read may have been seen leaving
+  // one state but not entering it, or the other way round. Never report fewer than none.
+  for(size_t i = 0; i < HE_METRICS_STATE_COUNT; i++) {
+    if((int64_t)metrics->connections[i] < 0) {
+      metrics->connections[i] = 0;
+    }
+  }
+
+  metrics->handshakes_started = counters[HE_METRIC_HANDSHAKES_STARTED];
+  metrics->handshakes_completed = counters[HE_METRIC_HANDSHAKES_COMPLETED];
+  metrics->auth_successes = counters[HE_METRIC_AUTH_SUCCESSES];
+  metrics->auth_failures = counters[HE_METRIC_AUTH_FAILURES];
+  metrics->inside_rx_packets = counters[HE_METRIC_INSIDE_RX_PACKETS];
+  metrics->inside_rx_bytes = counters[HE_METRIC_INSIDE_RX_BYTES];
+  metrics->inside_tx_packets = counters[HE_METRIC_INSIDE_TX_PACKETS];
+  metrics->inside_tx_bytes = counters[HE_METRIC_INSIDE_TX_BYTES];
+  metrics->outside_rx_packets = counters[HE_METRIC_OUTSIDE_RX_PACKETS];
+  metrics->outside_rx_bytes = counters[HE_METRIC_OUTSIDE_RX_BYTES];
+  metrics->outside_tx_packets = counters[HE_METRIC_OUTSIDE_TX_PACKETS];
+  metrics->outside_tx_bytes = counters[HE_METRIC_OUTSIDE_TX_BYTES];
+  metrics->padding_bytes = counters[HE_METRIC_PADDING_BYTES];
+  metrics->plugin_drops = counters[HE_METRIC_PLUGIN_DROPS];
+
+  return HE_SUCCESS;
+}
+
+// Appends to the text being rendered, only counting what doesn't fit
+typedef struct he_metrics_writer {
+  char *buffer;
+  size_t capacity;
+  size_t length;
+} he_metrics_writer_t;
+
+static void he_metrics_print(he_metrics_writer_t *writer, const char *format, ...) {
+  size_t room = writer->length < writer->capacity ? writer->capacity - writer->length : 0;
+
+  va_list args;
+  va_start(args, format);
+  int written = vsnprintf(room ? writer->buffer + writer->length : NULL, room, format, args);
+  va_end(args);
+
+  if(written > 0) {
+    writer->length += (size_t)written;
+  }
+}
+
+static void he_metrics_family(he_metrics_writer_t *writer, const char *name, const char *type,
+                              const char *unit, const char *help) {
+  he_metrics_print(writer, "# TYPE %s %s\n", name, type);
+  if(unit) {
+    he_metrics_print(writer, "# UNIT %s %s\n", name, unit);
+  }
+  he_metrics_print(writer, "# HELP %s %s\n", name, help);
+}
+
+static void he_metrics_traffic(he_metrics_writer_t *writer, const char *name,
+                               const uint64_t values[4]) {
+  static const char *const sides[4] = {"inside", "inside", "outside", "outside"};
+  static const char *const directions[4] = {"rx", "tx", "rx", "tx"};
+  for(size_t i = 0; i < 4; i++) {
+    he_metrics_print(writer, "%s_total{side=\"%s\",direction=\"%s\"} %" PRIu64 "\n", name,
+                     sides[i], directions[i], values[i]);
+  }
+}
+
+he_return_code_t he_metrics_render(const he_metrics_t *metrics, char *buffer, size_t *length) {
+  if(!metrics || !length) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  he_metrics_writer_t writer = {buffer, buffer ? *length : 0, 0};
+
+  he_metrics_family(&writer, "helium_connections", "gauge", NULL, "Connections by state.");
+  for(size_t i = 0; i < HE_METRICS_STATE_COUNT; i++) {
+    if(he_metrics_state_names[i]) {
+      he_metrics_print(&writer, "helium_connections{state=\"%s\"} %" PRIu64 "\n",
+                       he_metrics_state_names[i], metrics->connections[i]);
+    }
+  }
+
+  he_metrics_family(&writer, "helium_handshakes_started", "counter", NULL,
+                    "Handshakes started.");
+  he_metrics_print(&writer, "helium_handshakes_started_total %" PRIu64 "\n",
+                   metrics->handshakes_started);
+
+  he_metrics_family(&writer, "helium_handshakes_completed", "counter", NULL,
+                    "Handshakes that brought the link up.");
+  he_metrics_print(&writer, "helium_handshakes_completed_total %" PRIu64 "\n",
+                   metrics->handshakes_completed);
+
+  // Only the codes that have happened, there are far too many to list them all
+  he_metrics_family(&writer, "helium_handshake_failures", "counter", NULL,
+                    "Handshakes that failed, by Helium return code.");
+  for(size_t i = 0; i < HE_METRICS_MAX_ERROR_CODES; i++) {
+    if(metrics->handshake_failures[i]) {
+      he_metrics_print(&writer, "helium_handshake_failures_total{code=\"-%zu\"} %" PRIu64 "\n", i,
+                       metrics->handshake_failures[i]);
+    }
+  }
+
+  he_metrics_family(&writer, "helium_auths", "counter", NULL,
+                    "Logins the auth callback accepted and rejected.");
+  he_metrics_print(&writer, "helium_auths_total{result=\"success\"} %" PRIu64 "\n",
+                   metrics->auth_successes);
+  he_metrics_print(&writer, "helium_auths_total{result=\"failure\"} %" PRIu64 "\n",
+                   metrics->auth_failures);
+
+  const uint64_t packets[4] = {metrics->inside_rx_packets, metrics->inside_tx_packets,
+                               metrics->outside_rx_packets, metrics->outside_tx_packets};
+  he_metrics_family(&writer, "helium_packets", "counter", NULL,
+                    "Packets received and sent on the inside and outside.");
+  he_metrics_traffic(&writer, "helium_packets", packets);
+
+  const uint64_t bytes[4] = {metrics->inside_rx_bytes, metrics->inside_tx_bytes,
+                             metrics->outside_rx_bytes, metrics->outside_tx_bytes};
+  he_metrics_family(&writer, "helium_bytes", "counter", "bytes",
+                    "Bytes received and sent on the inside and outside.");
+  he_metrics_traffic(&writer, "helium_bytes", bytes);
+
+  he_metrics_family(&writer, "helium_padding_bytes", "counter", "bytes",
+                    "Padding added to data messages.");
+  he_metrics_print(&writer, "helium_padding_bytes_total %" PRIu64 "\n", metrics->padding_bytes);
+
+  he_metrics_family(&writer, "helium_plugin_drops", "counter", NULL,
+                    "Packets dropped by plugins.");
+  he_metrics_print(&writer, "helium_plugin_drops_total %" PRIu64 "\n", metrics->plugin_drops);
+
+  he_metrics_print(&writer, "# EOF\n");
+
+  *length = writer.length;
+
+  // The terminator needs room too
+  if(buffer && writer.length >= writer.capacity) {
+    return HE_ERR_PACKET_TOO_LARGE;
+  }
+
+  return HE_SUCCESS;
+}
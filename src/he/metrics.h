@@ -0,0 +1,110 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file metrics.h
+ * @brief Functions for the counters an SSL context keeps across its connections
+ *
+ * Every connection adds to the counters of the context it was created with. They are split into
+ * shards, and each thread updates the shard it was given the first time it counted something, so
+ * threads working on different connections rarely touch the same cache lines and never wait for
+ * each other. Reading the counters adds the shards up.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <he.h>
+
+/**
+ * @brief Adds up the counters of an SSL context
+ * @param ctx A pointer to a valid SSL context
+ * @param metrics Filled in with the totals since the context was created
+ * @return HE_SUCCESS The totals were filled in
+ * @return HE_ERR_NULL_POINTER Either pointer is NULL
+ *
+ * Safe to call from any thread while connections are in use. Each counter is read exactly once,
+ * so the snapshot doesn't change while it is being looked at or rendered.
+ */
+he_return_code_t he_ssl_ctx_get_metrics(he_ssl_ctx_t *ctx, he_metrics_t *metrics);
+
+/**
+ * @brief Renders a snapshot in the OpenMetrics text format, e.g. for a Prometheus scrape
+ * @param metrics A snapshot from he_ssl_ctx_get_metrics()
+ * @param buffer The buffer to render into, or NULL to find out how large it needs to be
+ * @param length In: the size of the buffer, out: the length of the text, not including the NUL
+ *        terminator it is followed by
+ * @return HE_SUCCESS The snapshot was rendered
+ * @return HE_ERR_NULL_POINTER The metrics or length pointer is NULL
+ * @return HE_ERR_PACKET_TOO_LARGE The text and its terminator don't fit in the buffer, length has
+ *         been set to the length of the text
+ *
+ * Nothing is allocated. Rendering the same snapshot always gives the same text, so the length
+ * found with a NULL buffer is exactly what is needed for that snapshot.
+ */
+he_return_code_t he_metrics_render(const he_metrics_t *metrics, char *buffer, size_t *length);
+
+/**
+ * @brief Adds to one of the counters of a connection's SSL context
+ * @param metrics The connection's context counters, can be NULL
+ * @param metric The counter to add to
+ * @param value The amount to add
+ */
+void he_internal_metrics_add(he_ctx_metrics_t *metrics, he_metric_t metric, uint64_t value);
+
+/**
+ * @brief Counts packets and their bytes in one go
+ * @param metrics The connection's context counters, can be NULL
+ * @param packets_metric One of the packet counters, the byte counter after it gets the bytes
+ * @param packets The number of packets
+ * @param bytes The total length of the packets
+ */
+void he_internal_metrics_add_traffic(he_ctx_metrics_t *metrics, he_metric_t packets_metric,
+                                     uint64_t packets, uint64_t bytes);
+
+/**
+ * @brief Counts a handshake that failed
+ * @param metrics The context counters, can be NULL
+ * @param reason Why it failed
+ */
+void he_internal_metrics_handshake_failed(he_ctx_metrics_t *metrics, he_return_code_t reason);
+
+/**
+ * @brief Counts a connection into the state it is in when it starts using the context
+ * @param metrics The context counters, can be NULL
+ * @param state The state of the connection
+ */
+void he_internal_metrics_conn_added(he_ctx_metrics_t *metrics, he_client_state_t state);
+
+/**
+ * @brief Counts a connection that is being destroyed out of its last state
+ * @param metrics The context counters, can be NULL
+ * @param state The state of the connection
+ */
+void he_internal_metrics_conn_removed(he_ctx_metrics_t *metrics, he_client_state_t state);
+
+/**
+ * @brief Moves a connection from one state's count to another's
+ * @param metrics The context counters, can be NULL
+ * @param from The state the connection is leaving
+ * @param to The state it is entering
+ */
+void he_internal_metrics_state_change(he_ctx_metrics_t *metrics, he_client_state_t from,
+                                      he_client_state_t to);
+
+#endif  // METRICS_H
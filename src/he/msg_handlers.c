@@ -18,8 +18,70 @@
 
 #include "msg_handlers.h"
 
+#include "clock.h"
 #include "conn.h"
 #include "core.h"
+#include "flow_hash.h"
+#include "frag.h"
+#include "gso.h"
+#include "ip_pool.h"
+#include "ipv4.h"
+#include "memory.h"
+#include "metrics.h"
+#include "mss.h"
+#include "pmtud.h"
+
+static void he_msg_count_delivered(he_conn_t *conn, uint16_t length) {
+  conn->counters.inside_tx_packets++;
+  conn->counters.inside_tx_bytes += length;
+  he_internal_metrics_add_traffic(conn->metrics, HE_METRIC_INSIDE_TX_PACKETS, 1, length);
+}
+
+// Hands a packet that has come through the tunnel to the host
+static he_return_code_t he_msg_deliver_packet(he_conn_t *conn, uint8_t *packet, uint16_t length) {
+  // Validate packet, servers also make sure clients only send from the address they were given
+  size_t ip_length = length;
+  he_inside_drop_reason_t reason = he_internal_ipv4_validate(
+      packet, &ip_length, conn->validate_source_address ? conn->client_ip : 0);
+  if(reason != HE_INSIDE_DROP_NONE) {
+    // Invalid packet
+    conn->inside_drops[reason]++;
+    return HE_ERR_BAD_PACKET;
+  }
+  length = (uint16_t)ip_length;
+
+  // SYNs from the other end set how large a segment our side's TCP stack may send
+  if(conn->clamp_mss) {
+    he_internal_clamp_mss(packet, length,
+                          (uint16_t)(he_conn_get_inner_mtu(conn) - HE_MSS_HEADER_OVERHEAD));
+  }
+
+  // Packet seems to be fine, hand it over
+  if(conn->inside_write_gro_cb) {
+    he_msg_count_delivered(conn, length);
+    return he_internal_gro_deliver(conn, packet, length);
+  }
+
+  if(conn->inside_write_flow_cb) {
+    he_flow_info_t flow = {0};
+    he_return_code_t res = he_flow_classify(packet, length, &flow);
+    if(res != HE_SUCCESS) {
+      // Dropped here rather than failing the whole read, so it's counted here too
+      he_internal_count_drop(conn, res);
+      return HE_SUCCESS;
+    }
+    he_msg_count_delivered(conn, length);
+    conn->inside_write_flow_cb(conn, &flow, packet, length, conn->data);
+    return HE_SUCCESS;
+  }
+
+  if(conn->inside_write_cb) {
+    he_msg_count_delivered(conn, length);
+    conn->inside_write_cb(conn, packet, length, conn->data);
+  }
+
+  return HE_SUCCESS;
+}
 
 he_return_code_t he_handle_msg_noop(he_conn_t *conn, uint8_t *packet, int length) {
   if(conn == NULL || packet == NULL) {
@@ -45,6 +107,15 @@ he_return_code_t he_handle_msg_ping(he_conn_t *conn, uint8_t *packet, int length
   he_msg_pong_t response = {0};
   response.msg_header.msgid = HE_MSGID_PONG;
 
+  // Echo the sequence number and timestamp back so the peer can time the round trip
+  he_msg_ping_t *ping = (he_msg_ping_t *)packet;
+  if(length >= (int)(sizeof(he_msg_hdr_t) + sizeof(ping->payload))) {
+    response.payload = ping->payload;
+  }
+  if(length >= (int)sizeof(he_msg_ping_t)) {
+    response.timestamp = ping->timestamp;
+  }
+
   // Send pong
   he_internal_send_message(conn, (uint8_t *)&response, sizeof(he_msg_pong_t));
 
@@ -56,6 +127,23 @@ he_return_code_t he_handle_msg_pong(he_conn_t *conn, uint8_t *packet, int length
     return HE_ERR_NULL_POINTER;
   }
 
+  he_msg_pong_t *pong = (he_msg_pong_t *)packet;
+
+  // This may be the answer to a path MTU probe
+  if(length >= (int)(sizeof(he_msg_hdr_t) + sizeof(pong->payload))) {
+    he_internal_pmtud_pong_received(conn, pong->payload);
+  }
+
+  // Time the round trip from the echoed timestamp. Only trust replies to one of our recent PINGs,
+  // older peers echo zeros or nothing at all.
+  if(length >= (int)sizeof(he_msg_pong_t) && pong->payload != 0 && pong->timestamp != 0 &&
+     conn->ping_sequence - pong->payload < HE_PING_WINDOW) {
+    uint32_t rtt = (uint32_t)he_internal_clock_ms() - pong->timestamp;
+    if(rtt <= HE_RTO_MAX_MS) {
+      he_internal_conn_ping_sample(conn, rtt);
+    }
+  }
+
   // Tell the host application that we received a PONG
   he_internal_generate_event(conn, HE_EVENT_PONG);
   return HE_SUCCESS;
@@ -98,10 +186,18 @@ he_return_code_t he_handle_msg_config_ipv4(he_conn_t *conn, uint8_t *packet, int
   // Note that res is the "number of variables populated", so we need to check for 1
   int res = sscanf(pkt->mtu, "%u", &parsed_mtu_value);
 
-  if(res != 1 || parsed_mtu_value <= 0 || parsed_mtu_value > HE_MAX_MTU) {
-    config.mtu = HE_MAX_MTU;
-  } else {
+  if(res == 1 && conn->inner_mtu && parsed_mtu_value > HE_MAX_PMTU &&
+     parsed_mtu_value <= conn->inner_mtu) {
+    // The server agreed to a jumbo MTU, possibly smaller than the one we offered
+    conn->inner_mtu = parsed_mtu_value;
     config.mtu = parsed_mtu_value;
+  } else {
+    conn->inner_mtu = 0;
+    if(res != 1 || parsed_mtu_value <= 0 || parsed_mtu_value > HE_MAX_PMTU) {
+      config.mtu = HE_MAX_MTU;
+    } else {
+      config.mtu = parsed_mtu_value;
+    }
   }
 
   // Copy out the session ID
@@ -139,25 +235,36 @@ he_return_code_t he_handle_msg_auth(he_conn_t *conn, uint8_t *packet, int length
     return HE_ERR_INVALID_CLIENT_STATE;
   }
 
-  // Check that we actually have an auth handler setup
-  if(conn->auth_cb == NULL || conn->populate_network_config_ipv4_cb == NULL) {
+  // Check that we actually have an auth handler and a way of giving the client an address
+  if(conn->auth_cb == NULL ||
+     (conn->populate_network_config_ipv4_cb == NULL && conn->ip_pool == NULL)) {
     return HE_ERR_INVALID_CLIENT_STATE;
   }
 
-  // Check the packet is big enough
-  if(length < sizeof(he_msg_auth_t)) {
+  // Check the packet is big enough. Older clients don't send the inner MTU.
+  if(length < offsetof(he_msg_auth_t, inner_mtu)) {
     return HE_ERR_PACKET_TOO_SMALL;
   }
 
   // Cast header
   he_msg_auth_t *msg = (he_msg_auth_t *)packet;
 
+  // Settle on a jumbo MTU both sides can take, if there is one
+  uint16_t client_inner_mtu = length >= sizeof(he_msg_auth_t) ? ntohs(msg->inner_mtu) : 0;
+  if(client_inner_mtu <= HE_MAX_PMTU) {
+    conn->inner_mtu = 0;
+  } else if(client_inner_mtu < conn->inner_mtu) {
+    conn->inner_mtu = client_inner_mtu;
+  }
+
   bool auth_state = conn->auth_cb(conn, msg->username, msg->password, conn->data);
 
   if(!auth_state) {
+    he_internal_metrics_add(conn->metrics, HE_METRIC_AUTH_FAILURES, 1);
     he_internal_change_conn_state(conn, HE_STATE_DISCONNECTING);
     return HE_ERR_ACCESS_DENIED;
   }
+  he_internal_metrics_add(conn->metrics, HE_METRIC_AUTH_SUCCESSES, 1);
 
   // At this point the user is authenticated
   // We no longer need msg->password, let's zero it out
@@ -182,12 +289,40 @@ he_return_code_t he_handle_msg_auth(he_conn_t *conn, uint8_t *packet, int length
   // Set up some space for the config callback
   he_network_config_ipv4_t config = {0};
 
+  // Take an address from the pool, if there is one, before the host gets a say
+  int res = HE_SUCCESS;
+  if(conn->ip_pool) {
+    res = he_internal_ip_pool_assign(conn, &config);
+    if(res != HE_SUCCESS) {
+      return res;
+    }
+  }
+
   // Copy the homogonized network configuration into the auth response
-  int res = conn->populate_network_config_ipv4_cb(conn, &config, conn->data);
-  if(res != HE_SUCCESS) {
-    return res;
+  if(conn->populate_network_config_ipv4_cb) {
+    res = conn->populate_network_config_ipv4_cb(conn, &config, conn->data);
+    if(res != HE_SUCCESS) {
+      return res;
+    }
+  }
+
+  // The host may have given the client an address of its own. The one from the pool mustn't stay
+  // taken, and lookups must find the connection by the address it was actually given.
+  uint32_t client_ip = 0;
+  bool has_client_ip = he_internal_ipv4_parse_address(config.local_ip, &client_ip);
+  if(conn->ip_pool && (!has_client_ip || client_ip != conn->pool_address)) {
+    he_internal_ip_pool_release(conn);
+    if(has_client_ip) {
+      res = he_internal_ip_pool_claim(conn, client_ip);
+      if(res != HE_SUCCESS) {
+        return res;
+      }
+    }
   }
 
+  // Remember the client's address so packets from it can be checked against it
+  conn->client_ip = has_client_ip ? htonl(client_ip) : 0;
+
   // Safely copy the values out and ensure null termination
   strncpy(response->local_ip, config.local_ip, HE_MAX_IPV4_STRING_LENGTH);
   response->local_ip[HE_MAX_IPV4_STRING_LENGTH - 1] = '\0';
@@ -198,7 +333,9 @@ he_return_code_t he_handle_msg_auth(he_conn_t *conn, uint8_t *packet, int length
   strncpy(response->dns_ip, config.dns_ip, HE_MAX_IPV4_STRING_LENGTH);
   response->dns_ip[HE_MAX_IPV4_STRING_LENGTH - 1] = '\0';
 
-  strncpy(response->mtu, HE_MAX_MTU_STR, sizeof(response->mtu));
+  // Servers that have run path MTU discovery on this connection already, or agreed to a jumbo MTU,
+  // can offer more
+  snprintf(response->mtu, sizeof(response->mtu), "%d", he_conn_get_inner_mtu(conn));
 
   // Send config
   he_internal_send_message(conn, (uint8_t *)response, sizeof(he_msg_config_ipv4_t));
@@ -242,17 +379,63 @@ he_return_code_t he_handle_msg_data(he_conn_t *conn, uint8_t *packet, int length
     return HE_ERR_PACKET_TOO_SMALL;
   }
 
-  // Validate packet
-  if(!he_internal_is_ipv4_packet_valid(packet + sizeof(he_msg_data_t), pkt_length)) {
-    // Invalid packet
-    return HE_ERR_BAD_PACKET;
+  return he_msg_deliver_packet(conn, packet + sizeof(he_msg_data_t), pkt_length);
+}
+
+he_return_code_t he_handle_msg_data_fragment(he_conn_t *conn, uint8_t *packet, int length) {
+  if(conn == NULL || packet == NULL) {
+    return HE_ERR_NULL_POINTER;
   }
 
-  // Packet seems to be fine, hand it over
-  if(conn->inside_write_cb) {
-    conn->inside_write_cb(conn, packet + sizeof(he_msg_data_t), pkt_length, conn->data);
+  // Check we're in the ONLINE state
+  if(conn->state != HE_STATE_ONLINE) {
+    return HE_ERR_INVALID_CLIENT_STATE;
+  }
+
+  // Quick header check
+  if(length < (int)sizeof(he_msg_data_fragment_t)) {
+    return HE_ERR_PACKET_TOO_SMALL;
   }
 
+  he_msg_data_fragment_t *fragment = (he_msg_data_fragment_t *)packet;
+  uint16_t fragment_length = ntohs(fragment->length);
+  if(fragment_length > length - sizeof(he_msg_data_fragment_t)) {
+    return HE_ERR_PACKET_TOO_SMALL;
+  }
+
+  uint8_t *reassembled = NULL;
+  uint16_t reassembled_length = 0;
+  he_return_code_t res =
+      he_internal_frag_reassemble(conn, fragment, packet + sizeof(he_msg_data_fragment_t),
+                                  fragment_length, &reassembled, &reassembled_length);
+  if(res != HE_SUCCESS || !reassembled) {
+    return res;
+  }
+
+  res = he_msg_deliver_packet(conn, reassembled, reassembled_length);
+  he_internal_free(reassembled);
+
+  return res;
+}
+
+he_return_code_t he_handle_msg_mtu(he_conn_t *conn, uint8_t *packet, int length) {
+  if(conn == NULL || packet == NULL) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  // Path MTU discovery only runs once the connection is ONLINE
+  if(conn->state != HE_STATE_ONLINE) {
+    return HE_ERR_INVALID_CLIENT_STATE;
+  }
+
+  if(length < (int)sizeof(he_msg_mtu_t)) {
+    return HE_ERR_PACKET_TOO_SMALL;
+  }
+
+  he_msg_mtu_t *msg = (he_msg_mtu_t *)packet;
+  he_internal_pmtud_mtu_received(conn, ntohs(msg->mtu), ntohs(msg->received_mtu),
+                                 msg->is_reply != 0);
+
   return HE_SUCCESS;
 }
 
@@ -274,18 +457,10 @@ he_return_code_t he_handle_msg_auth_response(he_conn_t *conn, uint8_t *packet, i
   return HE_ERR_ACCESS_DENIED;
 }
 
-// Temporary home for this
 bool he_internal_is_ipv4_packet_valid(uint8_t *packet, int length) {
-  if(packet == NULL) {
+  if(length < 0) {
     return false;
   }
-  // for now just check that the packet is IPv4
-  int proto = packet[0] >> 4;
-
-  if(proto != 4) {
-    return false;
-  }
-
-  // Assume it's good enough
-  return true;
+  size_t ip_length = (size_t)length;
+  return he_internal_ipv4_validate(packet, &ip_length, 0) == HE_INSIDE_DROP_NONE;
 }
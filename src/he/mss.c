@@ -0,0 +1,128 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "mss.h"
+#include "inet.h"
+#include "network.h"
+
+#define HE_TCP_PROTOCOL 6
+#define HE_TCP_FLAG_SYN 0x02
+#define HE_TCP_OPTION_END 0
+#define HE_TCP_OPTION_NOP 1
+#define HE_TCP_OPTION_MSS 2
+#define HE_TCP_OPTION_MSS_LENGTH 4
+#define HE_IPV4_FRAGMENT_OFFSET_MASK 0x1FFF
+
+static uint16_t he_mss_read16(const uint8_t *p) {
+  return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+// RFC 1624 eqn 3: HC' = ~(~HC + ~m + m')
+static uint16_t he_mss_checksum_adjust(uint16_t checksum, uint16_t old_word, uint16_t new_word) {
+  uint32_t sum = (uint16_t)~checksum + (uint16_t)~old_word + new_word;
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  return (uint16_t)~sum;
+}
+
+bool he_internal_clamp_mss(uint8_t *packet, size_t length, uint16_t mss) {
+  // Cheapest checks first, almost everything on the data path leaves here
+  if(length < sizeof(ipv4_header_t) + sizeof(tcp_header_t)) {
+    return false;
+  }
+
+  ipv4_header_t *ip = (ipv4_header_t *)packet;
+  if((ip->ver_ihl >> 4) != 4 || ip->protocol != HE_TCP_PROTOCOL ||
+     (ntohs(ip->flags_fo) & HE_IPV4_FRAGMENT_OFFSET_MASK) != 0) {
+    return false;
+  }
+
+  size_t ip_header_length = (size_t)(ip->ver_ihl & 0x0F) * 4;
+  if(ip_header_length < sizeof(ipv4_header_t) ||
+     length < ip_header_length + sizeof(tcp_header_t)) {
+    return false;
+  }
+
+  uint8_t *tcp = packet + ip_header_length;
+  tcp_header_t *tcp_hdr = (tcp_header_t *)tcp;
+  if(!(tcp_hdr->flags & HE_TCP_FLAG_SYN)) {
+    return false;
+  }
+
+  size_t tcp_header_length = (size_t)(tcp_hdr->data_offset >> 4) * 4;
+  if(tcp_header_length < sizeof(tcp_header_t) || length < ip_header_length + tcp_header_length) {
+    return false;
+  }
+
+  // Walk the options looking for the MSS
+  size_t i = sizeof(tcp_header_t);
+  while(i < tcp_header_length) {
+    uint8_t kind = tcp[i];
+    if(kind == HE_TCP_OPTION_END) {
+      return false;
+    }
+    if(kind == HE_TCP_OPTION_NOP) {
+      i++;
+      continue;
+    }
+    if(i + 1 >= tcp_header_length) {
+      return false;
+    }
+
+    uint8_t option_length = tcp[i + 1];
+    if(option_length < 2 || i + option_length > tcp_header_length) {
+      return false;
+    }
+
+    if(kind == HE_TCP_OPTION_MSS && option_length == HE_TCP_OPTION_MSS_LENGTH) {
+      break;
+    }
+    i += option_length;
+  }
+
+  if(i >= tcp_header_length) {
+    return false;
+  }
+
+  uint8_t *value = tcp + i + 2;
+  if(he_mss_read16(value) <= mss) {
+    return false;
+  }
+
+  // The checksum covers 16 bit words from the start of the TCP header. Options can sit at any
+  // offset, so an MSS at an odd one straddles two words and both have to be accounted for.
+  size_t first_word = (i + 2) & ~(size_t)1;
+  size_t words = ((i + 2) & 1) ? 2 : 1;
+
+  uint16_t old_words[2] = {0};
+  for(size_t w = 0; w < words; w++) {
+    old_words[w] = he_mss_read16(tcp + first_word + w * 2);
+  }
+
+  value[0] = (uint8_t)(mss >> 8);
+  value[1] = (uint8_t)(mss & 0xFF);
+
+  uint16_t checksum = ntohs(tcp_hdr->checksum);
+  for(size_t w = 0; w < words; w++) {
+    checksum =
+        he_mss_checksum_adjust(checksum, old_words[w], he_mss_read16(tcp + first_word + w * 2));
+  }
+  tcp_hdr->checksum = htons(checksum);
+
+  return true;
+}
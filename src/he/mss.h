@@ -0,0 +1,50 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file mss.h
+ * @brief Functions for clamping the MSS of TCP connections carried by the tunnel
+ *
+ * The tunnel MTU is smaller than the MTU of the device the host's TCP stack sees the Internet
+ * through, so TCP connections inside the tunnel agree on segments too large to be carried
+ * without fragmentation. Rewriting the MSS option of SYNs in both directions makes both ends send
+ * segments that fit.
+ */
+
+#ifndef MSS_H
+#define MSS_H
+
+#include <he.h>
+
+// IPv4 and TCP headers without options, the difference between an MTU and the MSS that fits it
+#define HE_MSS_HEADER_OVERHEAD 40
+
+/**
+ * @brief Lowers the MSS option of a TCP SYN or SYN-ACK to fit the tunnel, if it's larger
+ * @param packet A pointer to an IPv4 packet, which is modified in place
+ * @param length The length of the packet
+ * @param mss The largest MSS to allow
+ * @return bool Whether the packet was changed
+ *
+ * The TCP checksum is updated incrementally (RFC 1624) so the rest of the packet is never read.
+ * Anything other than an unfragmented (or first fragment) TCP SYN with a well formed MSS option is
+ * left alone.
+ */
+bool he_internal_clamp_mss(uint8_t *packet, size_t length, uint16_t mss);
+
+#endif  // MSS_H
@@ -52,6 +52,18 @@ typedef struct {
   uint16_t checksum;
 } udp_header_t;
 
+typedef struct {
+  uint16_t src_port;
+  uint16_t dst_port;
+  uint32_t seq;
+  uint32_t ack;
+  uint8_t data_offset;  // 4 bits data offset and 4 reserved bits
+  uint8_t flags;
+  uint16_t window;
+  uint16_t checksum;
+  uint16_t urgent_pointer;
+} tcp_header_t;
+
 #pragma pack()
 
 #endif  // NETWORK_H
@@ -17,37 +17,417 @@
  */
 
 #include "plugin_chain.h"
+#include "atomic.h"
+#include "grace.h"
 #include "memory.h"
 
+#include <string.h>
+
 he_plugin_chain_t *he_plugin_create_chain(void) {
   return he_internal_calloc(1, sizeof(he_plugin_chain_t));
 }
 
+static he_plugin_hooks_t *he_plugin_chain_hooks(he_plugin_chain_t *chain) {
+  return (he_plugin_hooks_t *)(uintptr_t)he_atomic_load_u64(&chain->hooks);
+}
+
+static void he_plugin_chain_lock(he_plugin_chain_t *chain) {
+  he_atomic_lock(&chain->writer);
+}
+
+static void he_plugin_chain_unlock(he_plugin_chain_t *chain) {
+  he_atomic_unlock(&chain->writer);
+}
+
 he_return_code_t he_plugin_destroy_chain(he_plugin_chain_t *chain) {
+  if(chain) {
+    he_internal_free(he_plugin_chain_hooks(chain));
+    while(chain->retired) {
+      he_plugin_hooks_t *next = chain->retired->next_retired;
+      he_internal_free(chain->retired);
+      chain->retired = next;
+    }
+  }
   he_internal_free(chain);
   return HE_SUCCESS;
 }
 
+// Allocates a set of hooks and its arrays in one block
+static he_plugin_hooks_t *he_plugin_hooks_create(size_t ingress_count, size_t egress_count) {
+  he_plugin_hooks_t *hooks = he_internal_calloc(
+      1, sizeof(he_plugin_hooks_t) + (ingress_count + egress_count) * sizeof(he_plugin_hook_t));
+  if(!hooks) {
+    return NULL;
+  }
+
+  hooks->ingress = (he_plugin_hook_t *)(hooks + 1);
+  hooks->ingress_count = ingress_count;
+  hooks->egress = hooks->ingress + ingress_count;
+  hooks->egress_count = egress_count;
+  return hooks;
+}
+
+static size_t he_plugin_chain_reclaim_locked(he_plugin_chain_t *chain) {
+  // Without any registered threads there's no telling who may still be using old hooks, so
+  // nothing is freed until one is
+  uint64_t oldest = he_internal_grace_oldest(&chain->grace);
+
+  size_t pending = 0;
+  he_plugin_hooks_t **link = &chain->retired;
+  while(*link) {
+    he_plugin_hooks_t *hooks = *link;
+    if(hooks->retired_epoch <= oldest) {
+      *link = hooks->next_retired;
+      he_internal_free(hooks);
+    } else {
+      link = &hooks->next_retired;
+      pending++;
+    }
+  }
+
+  return pending;
+}
+
+size_t he_plugin_chain_reclaim(he_plugin_chain_t *chain) {
+  if(!chain) {
+    return 0;
+  }
+
+  he_plugin_chain_lock(chain);
+  size_t pending = he_plugin_chain_reclaim_locked(chain);
+  he_plugin_chain_unlock(chain);
+
+  return pending;
+}
+
+// Puts new hooks in place and retires the old ones
+static void he_plugin_chain_swap(he_plugin_chain_t *chain, he_plugin_hooks_t *hooks) {
+  he_plugin_hooks_t *old = (he_plugin_hooks_t *)(uintptr_t)he_atomic_exchange_u64(
+      &chain->hooks, (uint64_t)(uintptr_t)hooks);
+  if(old) {
+    old->retired_epoch = he_internal_grace_retire(&chain->grace);
+    old->next_retired = chain->retired;
+    chain->retired = old;
+  }
+
+  he_plugin_chain_reclaim_locked(chain);
+}
+
+// Finds the state slot a plugin owns, or gives it a free one
+static int he_plugin_state_slot(he_plugin_chain_t *chain, const plugin_struct_t *plugin) {
+  int free_slot = -1;
+  for(int i = 0; i < HE_PLUGIN_MAX_STATE_SLOTS; i++) {
+    if(chain->state_owners[i] == plugin) {
+      return i;
+    }
+    if(free_slot < 0 && !chain->state_owners[i]) {
+      free_slot = i;
+    }
+  }
+  return free_slot;
+}
+
+static he_return_code_t he_plugin_register_locked(he_plugin_chain_t *chain,
+                                                   const plugin_struct_t *plugin) {
+  int slot = -1;
+  if(plugin->free_state) {
+    // Slots are never handed to another plugin, so state left on connections by a plugin that
+    // was unregistered is still its own if it comes back
+    slot = he_plugin_state_slot(chain, plugin);
+    if(slot < 0) {
+      return HE_ERR_INIT_FAILED;
+    }
+    chain->state_owners[slot] = plugin;
+    chain->state_free[slot] = plugin->free_state;
+    chain->state_data[slot] = plugin->data;
+  }
+
+  bool has_ingress = plugin->do_ingress || plugin->do_ingress_batch;
+  bool has_egress = plugin->do_egress || plugin->do_egress_batch;
+  if(!has_ingress && !has_egress) {
+    return HE_SUCCESS;
+  }
+
+  he_plugin_hooks_t *old = he_plugin_chain_hooks(chain);
+  size_t ingress_count = old ? old->ingress_count : 0;
+  size_t egress_count = old ? old->egress_count : 0;
+
+  he_plugin_hooks_t *hooks =
+      he_plugin_hooks_create(ingress_count + has_ingress, egress_count + has_egress);
+  if(!hooks) {
+    return HE_ERR_INIT_FAILED;
+  }
+
+  if(ingress_count) {
+    memcpy(hooks->ingress, old->ingress, ingress_count * sizeof(he_plugin_hook_t));
+  }
+  if(has_ingress) {
+    he_plugin_hook_t *hook = &hooks->ingress[ingress_count];
+    hook->fn = plugin->do_ingress;
+    hook->batch_fn = plugin->do_ingress_batch;
+    hook->data = plugin->data;
+    hook->owner = plugin;
+    hook->state_slot = slot;
+  }
+
+  // Egress runs in reverse, so the newest plugin goes first
+  if(egress_count) {
+    memcpy(&hooks->egress[has_egress], old->egress, egress_count * sizeof(he_plugin_hook_t));
+  }
+  if(has_egress) {
+    he_plugin_hook_t *hook = &hooks->egress[0];
+    hook->fn = plugin->do_egress;
+    hook->batch_fn = plugin->do_egress_batch;
+    hook->data = plugin->data;
+    hook->owner = plugin;
+    hook->state_slot = slot;
+  }
+
+  he_plugin_chain_swap(chain, hooks);
+
+  return HE_SUCCESS;
+}
+
 he_return_code_t he_plugin_register_plugin(he_plugin_chain_t *chain, plugin_struct_t *plugin) {
   if(chain == NULL || plugin == NULL) {
     return HE_ERR_NULL_POINTER;
   }
 
-  // A bit odd, but we initialise the plugin AFTER walking the chain
-  if(!chain->plugin) {
-    chain->plugin = plugin;
-    return HE_SUCCESS;
+  he_plugin_chain_lock(chain);
+  he_return_code_t res = he_plugin_register_locked(chain, plugin);
+  he_plugin_chain_unlock(chain);
+
+  return res;
+}
+
+// Copies the hooks that don't belong to a plugin, returning how many there were
+static size_t he_plugin_hooks_filter(he_plugin_hook_t *to, const he_plugin_hook_t *from,
+                                     size_t count, const plugin_struct_t *plugin) {
+  size_t kept = 0;
+  for(size_t i = 0; i < count; i++) {
+    if(from[i].owner != plugin) {
+      if(to) {
+        to[kept] = from[i];
+      }
+      kept++;
+    }
   }
+  return kept;
+}
 
-  if(!chain->next) {
-    chain->next = he_plugin_create_chain();
-    if(chain->next == NULL) {
-      return HE_ERR_INIT_FAILED;
+static he_return_code_t he_plugin_unregister_locked(he_plugin_chain_t *chain,
+                                                     const plugin_struct_t *plugin) {
+  he_plugin_hooks_t *old = he_plugin_chain_hooks(chain);
+  if(!old) {
+    return HE_ERR_PLUGIN_NOT_REGISTERED;
+  }
+
+  size_t ingress_count = he_plugin_hooks_filter(NULL, old->ingress, old->ingress_count, plugin);
+  size_t egress_count = he_plugin_hooks_filter(NULL, old->egress, old->egress_count, plugin);
+  if(ingress_count == old->ingress_count && egress_count == old->egress_count) {
+    return HE_ERR_PLUGIN_NOT_REGISTERED;
+  }
+
+  // Nothing left means nothing to walk at all
+  he_plugin_hooks_t *hooks = NULL;
+  if(ingress_count || egress_count) {
+    hooks = he_plugin_hooks_create(ingress_count, egress_count);
+    if(!hooks) {
+      return HE_ERR_NO_MEMORY;
+    }
+    he_plugin_hooks_filter(hooks->ingress, old->ingress, old->ingress_count, plugin);
+    he_plugin_hooks_filter(hooks->egress, old->egress, old->egress_count, plugin);
+  }
+
+  he_plugin_chain_swap(chain, hooks);
+
+  return HE_SUCCESS;
+}
+
+he_return_code_t he_plugin_unregister_plugin(he_plugin_chain_t *chain, plugin_struct_t *plugin) {
+  if(chain == NULL || plugin == NULL) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  he_plugin_chain_lock(chain);
+  he_return_code_t res = he_plugin_unregister_locked(chain, plugin);
+  he_plugin_chain_unlock(chain);
+
+  return res;
+}
+
+he_return_code_t he_plugin_chain_register_thread(he_plugin_chain_t *chain, size_t *thread_id) {
+  if(!chain || !thread_id) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  return he_internal_grace_register_thread(&chain->grace, thread_id);
+}
+
+he_return_code_t he_plugin_chain_quiescent(he_plugin_chain_t *chain, size_t thread_id) {
+  if(!chain) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  he_internal_grace_quiescent(&chain->grace, thread_id);
+
+  return HE_SUCCESS;
+}
+
+he_return_code_t he_plugin_chain_thread_offline(he_plugin_chain_t *chain, size_t thread_id) {
+  if(!chain) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  he_internal_grace_thread_offline(&chain->grace, thread_id);
+
+  return HE_SUCCESS;
+}
+
+void he_internal_plugin_free_state(he_plugin_chain_t *chain, void **state) {
+  if(!chain) {
+    return;
+  }
+
+  for(int i = 0; i < HE_PLUGIN_MAX_STATE_SLOTS; i++) {
+    if(state[i] && chain->state_free[i]) {
+      chain->state_free[i](state[i], chain->state_data[i]);
+    }
+    state[i] = NULL;
+  }
+}
+
+static he_return_code_t he_plugin_result(he_plugin_return_code_t res) {
+  if(res == HE_PLUGIN_FAIL) {
+    return HE_ERR_FAILED;
+  }
+  if(res == HE_PLUGIN_DROP) {
+    return HE_ERR_PLUGIN_DROP;
+  }
+  return HE_SUCCESS;
+}
+
+// Calls a plugin's single packet callback, which only knows about room after the packet
+static he_plugin_return_code_t he_plugin_call(const he_plugin_hook_t *hook,
+                                              he_plugin_packet_t *packet) {
+  size_t capacity = packet->length + packet->tailroom;
+  he_plugin_return_code_t res = hook->fn(packet->data, &packet->length, capacity, hook->data);
+  if(packet->length > capacity) {
+    return HE_PLUGIN_FAIL;
+  }
+  packet->tailroom = capacity - packet->length;
+  return res;
+}
+
+static he_return_code_t he_plugin_run(const he_plugin_hook_t *hooks, size_t hook_count,
+                                      he_plugin_packet_t *packet) {
+  for(size_t h = 0; h < hook_count; h++) {
+    const he_plugin_hook_t *hook = &hooks[h];
+    he_plugin_return_code_t res = HE_PLUGIN_SUCCESS;
+
+    packet->state_slot = hook->state_slot;
+    if(hook->fn) {
+      res = he_plugin_call(hook, packet);
+    } else if(hook->batch_fn(packet, &res, 1, hook->data) == HE_PLUGIN_FAIL) {
+      res = HE_PLUGIN_FAIL;
+    }
+
+    he_return_code_t ret = he_plugin_result(res);
+    if(ret != HE_SUCCESS) {
+      return ret;
+    }
+  }
+
+  return HE_SUCCESS;
+}
+
+// Runs the hooks over at most HE_PLUGIN_MAX_BATCH packets, taking packets out of the batch as soon
+// as a plugin drops or fails them
+static void he_plugin_run_batch(const he_plugin_hook_t *hooks, size_t hook_count,
+                                he_plugin_packet_t *packets, he_return_code_t *results,
+                                size_t count) {
+  he_plugin_packet_t live_packets[HE_PLUGIN_MAX_BATCH];
+  size_t live_index[HE_PLUGIN_MAX_BATCH];
+  he_plugin_return_code_t codes[HE_PLUGIN_MAX_BATCH];
+
+  for(size_t i = 0; i < count; i++) {
+    live_packets[i] = packets[i];
+    live_index[i] = i;
+    results[i] = HE_SUCCESS;
+  }
+
+  size_t live = count;
+  for(size_t h = 0; h < hook_count && live; h++) {
+    const he_plugin_hook_t *hook = &hooks[h];
+
+    for(size_t i = 0; i < live; i++) {
+      live_packets[i].state_slot = hook->state_slot;
     }
+
+    if(hook->batch_fn) {
+      for(size_t i = 0; i < live; i++) {
+        codes[i] = HE_PLUGIN_SUCCESS;
+      }
+      if(hook->batch_fn(live_packets, codes, live, hook->data) == HE_PLUGIN_FAIL) {
+        for(size_t i = 0; i < live; i++) {
+          codes[i] = HE_PLUGIN_FAIL;
+        }
+      }
+    } else {
+      for(size_t i = 0; i < live; i++) {
+        codes[i] = he_plugin_call(hook, &live_packets[i]);
+      }
+    }
+
+    size_t kept = 0;
+    for(size_t i = 0; i < live; i++) {
+      packets[live_index[i]] = live_packets[i];
+
+      he_return_code_t ret = he_plugin_result(codes[i]);
+      if(ret != HE_SUCCESS) {
+        results[live_index[i]] = ret;
+        continue;
+      }
+
+      live_packets[kept] = live_packets[i];
+      live_index[kept] = live_index[i];
+      kept++;
+    }
+    live = kept;
+  }
+}
+
+static he_return_code_t he_plugin_batch(const he_plugin_hook_t *hooks, size_t hook_count,
+                                        he_plugin_packet_t *packets, he_return_code_t *results,
+                                        size_t count) {
+  if(!packets || !results) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  for(size_t start = 0; start < count; start += HE_PLUGIN_MAX_BATCH) {
+    size_t n = count - start < HE_PLUGIN_MAX_BATCH ? count - start : HE_PLUGIN_MAX_BATCH;
+    he_plugin_run_batch(hooks, hook_count, &packets[start], &results[start], n);
+  }
+
+  return HE_SUCCESS;
+}
+
+// Runs the hooks over a plain buffer, which has no room in front of the packet
+static he_return_code_t he_plugin_run_buffer(const he_plugin_hook_t *hooks, size_t hook_count,
+                                             uint8_t *packet, size_t *length, size_t capacity) {
+  he_plugin_packet_t desc = {packet, *length, 0, capacity > *length ? capacity - *length : 0,
+                            NULL};
+
+  he_return_code_t res = he_plugin_run(hooks, hook_count, &desc);
+
+  // A plugin may have stripped bytes from the front, but the caller expects the packet to start
+  // where it did
+  if(desc.data != packet) {
+    memmove(packet, desc.data, desc.length);
   }
+  *length = desc.length;
 
-  // This does a null pointer check for us
-  return he_plugin_register_plugin(chain->next, plugin);
+  return res;
 }
 
 he_return_code_t he_plugin_ingress(he_plugin_chain_t *chain, uint8_t *packet, size_t *length,
@@ -57,20 +437,12 @@ he_return_code_t he_plugin_ingress(he_plugin_chain_t *chain, uint8_t *packet, si
     return HE_SUCCESS;
   }
 
-  plugin_struct_t *plugin = chain->plugin;
-
-  if(plugin && plugin->do_ingress != NULL) {
-    int res = plugin->do_ingress(packet, length, capacity, plugin->data);
-    if(res == HE_PLUGIN_FAIL) {
-      return HE_ERR_FAILED;
-    }
-
-    if(res == HE_PLUGIN_DROP) {
-      return HE_ERR_PLUGIN_DROP;
-    }
+  he_plugin_hooks_t *hooks = he_plugin_chain_hooks(chain);
+  if(!hooks || !hooks->ingress_count) {
+    return HE_SUCCESS;
   }
 
-  return he_plugin_ingress(chain->next, packet, length, capacity);
+  return he_plugin_run_buffer(hooks->ingress, hooks->ingress_count, packet, length, capacity);
 }
 
 he_return_code_t he_plugin_egress(he_plugin_chain_t *chain, uint8_t *packet, size_t *length,
@@ -80,21 +452,56 @@ he_return_code_t he_plugin_egress(he_plugin_chain_t *chain, uint8_t *packet, siz
     return HE_SUCCESS;
   }
 
-  int res = he_plugin_egress(chain->next, packet, length, capacity);
-  if(res != HE_SUCCESS) {
-    return res;
+  he_plugin_hooks_t *hooks = he_plugin_chain_hooks(chain);
+  if(!hooks || !hooks->egress_count) {
+    return HE_SUCCESS;
   }
 
-  plugin_struct_t *plugin = chain->plugin;
+  return he_plugin_run_buffer(hooks->egress, hooks->egress_count, packet, length, capacity);
+}
 
-  if(plugin && plugin->do_egress != NULL) {
-    res = plugin->do_egress(packet, length, capacity, plugin->data);
-    if(res == HE_PLUGIN_FAIL) {
-      return HE_ERR_FAILED;
-    }
-    if(res == HE_PLUGIN_DROP) {
-      return HE_ERR_PLUGIN_DROP;
-    }
+he_return_code_t he_plugin_ingress_packet(he_plugin_chain_t *chain, he_plugin_packet_t *packet) {
+  if(chain == NULL) {
+    return HE_SUCCESS;
   }
-  return HE_SUCCESS;
+
+  he_plugin_hooks_t *hooks = he_plugin_chain_hooks(chain);
+  if(!hooks || !hooks->ingress_count) {
+    return HE_SUCCESS;
+  }
+
+  return he_plugin_run(hooks->ingress, hooks->ingress_count, packet);
+}
+
+he_return_code_t he_plugin_egress_packet(he_plugin_chain_t *chain, he_plugin_packet_t *packet) {
+  if(chain == NULL) {
+    return HE_SUCCESS;
+  }
+
+  he_plugin_hooks_t *hooks = he_plugin_chain_hooks(chain);
+  if(!hooks || !hooks->egress_count) {
+    return HE_SUCCESS;
+  }
+
+  return he_plugin_run(hooks->egress, hooks->egress_count, packet);
+}
+
+he_return_code_t he_plugin_ingress_batch(he_plugin_chain_t *chain, he_plugin_packet_t *packets,
+                                         he_return_code_t *results, size_t count) {
+  he_plugin_hooks_t *hooks = chain ? he_plugin_chain_hooks(chain) : NULL;
+  if(!hooks) {
+    return he_plugin_batch(NULL, 0, packets, results, count);
+  }
+
+  return he_plugin_batch(hooks->ingress, hooks->ingress_count, packets, results, count);
+}
+
+he_return_code_t he_plugin_egress_batch(he_plugin_chain_t *chain, he_plugin_packet_t *packets,
+                                        he_return_code_t *results, size_t count) {
+  he_plugin_hooks_t *hooks = chain ? he_plugin_chain_hooks(chain) : NULL;
+  if(!hooks) {
+    return he_plugin_batch(NULL, 0, packets, results, count);
+  }
+
+  return he_plugin_batch(hooks->egress, hooks->egress_count, packets, results, count);
 }
@@ -20,6 +20,14 @@
  * @file plugin_chain.h
  * @brief Creation, destruction, registration, and execution for a plugin chain
  *
+ * A chain can be shared by any number of connections, and plugins can be registered and
+ * unregistered while those connections are passing packets through it on other threads. Each
+ * change swaps in a new set of hooks, and the old set is freed once every thread registered with
+ * he_plugin_chain_register_thread() has called he_plugin_chain_quiescent() or
+ * he_plugin_chain_thread_offline() since. Until a thread is registered old hooks are kept, as
+ * there's no knowing who may still be using them. Packet processing never waits for any of this.
+ *
+ * Changes can be made from any thread; they take a lock that only other changes wait for.
  */
 
 #ifndef PLUGIN_CHAIN_H
@@ -51,9 +59,85 @@ he_return_code_t he_plugin_destroy_chain(he_plugin_chain_t *chain);
  * @return HE_ERR_NULL_POINTER Either parameter was NULL
  * @return HE_ERR_INIT_FAILED Registering the plugin failed
  * @note This function allocates memory
+ * @note The plugin's callbacks and data are copied into the chain, so changing the struct after
+ *       registering it has no effect
+ *
+ * This can be called while the chain is in use. Packets already going through the chain finish
+ * without the new plugin.
+ *
+ * A plugin with a free_state callback is given a per-connection state slot on this chain, passed
+ * to its callbacks in packet->state_slot. The slot stays the plugin's for the life of the chain,
+ * and its free_state callback and data must stay valid for as long as any connection using the
+ * chain exists.
  */
 he_return_code_t he_plugin_register_plugin(he_plugin_chain_t *chain, plugin_struct_t *plugin);
 
+/**
+ * @brief Removes a plugin from the plugin chain
+ * @param chain A pointer to a valid plugin chain
+ * @param plugin The plugin as it was passed to he_plugin_register_plugin()
+ * @return HE_SUCCESS The plugin was removed
+ * @return HE_ERR_NULL_POINTER Either parameter was NULL
+ * @return HE_ERR_PLUGIN_NOT_REGISTERED The plugin isn't on the chain
+ * @return HE_ERR_NO_MEMORY The chain could not be rebuilt without the plugin
+ *
+ * Every registration of the plugin is removed. This can be called while the chain is in use;
+ * packets already going through the chain may still be passed to the plugin, so its data must
+ * stay valid until he_plugin_chain_reclaim() no longer reports anything pending.
+ */
+he_return_code_t he_plugin_unregister_plugin(he_plugin_chain_t *chain, plugin_struct_t *plugin);
+
+/**
+ * @brief Registers a thread that will process packets for connections using the chain
+ * @param chain A pointer to a valid plugin chain
+ * @param thread_id Set to the ID to report quiescent states with
+ * @return HE_SUCCESS The thread was registered
+ * @return HE_ERR_NULL_POINTER Either parameter was NULL
+ * @return HE_ERR_TOO_MANY_THREADS HE_PLUGIN_MAX_THREADS threads are already registered
+ *
+ * Hosts that change the chain while it's in use should register every thread that processes
+ * packets. If no threads are registered, old hooks are kept until the chain is destroyed.
+ */
+he_return_code_t he_plugin_chain_register_thread(he_plugin_chain_t *chain, size_t *thread_id);
+
+/**
+ * @brief Reports that the calling thread holds nothing it got from the chain
+ * @param chain A pointer to a valid plugin chain
+ * @param thread_id The ID from he_plugin_chain_register_thread()
+ * @return HE_SUCCESS Always, unless chain is NULL
+ *
+ * Call this between packets, e.g. once per batch read from the network; it is a single atomic
+ * store. Old hooks are held until every online thread has called it since they were swapped out.
+ */
+he_return_code_t he_plugin_chain_quiescent(he_plugin_chain_t *chain, size_t thread_id);
+
+/**
+ * @brief Reports that the calling thread won't use the chain until its next quiescent state
+ * @param chain A pointer to a valid plugin chain
+ * @param thread_id The ID from he_plugin_chain_register_thread()
+ * @return HE_SUCCESS Always, unless chain is NULL
+ *
+ * Call this before a thread blocks waiting for work, so it doesn't hold up freeing old hooks,
+ * and he_plugin_chain_quiescent() before it processes packets again.
+ */
+he_return_code_t he_plugin_chain_thread_offline(he_plugin_chain_t *chain, size_t thread_id);
+
+/**
+ * @brief Frees hooks swapped out of the chain that no thread can still be using
+ * @param chain A pointer to a valid plugin chain
+ * @return size_t The number of old sets of hooks that are still waiting for threads
+ *
+ * Registering and unregistering plugins does this already; call it to catch up later.
+ */
+size_t he_plugin_chain_reclaim(he_plugin_chain_t *chain);
+
+/**
+ * @brief Frees the state plugins on a chain kept for a connection
+ * @param chain A pointer to the connection's plugin chain, can be NULL
+ * @param state The connection's HE_PLUGIN_MAX_STATE_SLOTS state slots
+ */
+void he_internal_plugin_free_state(he_plugin_chain_t *chain, void **state);
+
 /**
  * @brief Execute the ingress function of each registered plugin
  * @param chain A pointer to a valid plugin chain
@@ -82,4 +166,59 @@ he_return_code_t he_plugin_ingress(he_plugin_chain_t *chain, uint8_t *packet, si
 he_return_code_t he_plugin_egress(he_plugin_chain_t *chain, uint8_t *packet, size_t *length,
                                   size_t capacity);
 
+/**
+ * @brief Execute the ingress function of each registered plugin on a packet with room around it
+ * @param chain A pointer to a valid plugin chain
+ * @param packet The packet, updated as plugins move its start or change its length
+ * @return HE_SUCCESS All plugins executed successfully
+ * @return HE_ERR_PLUGIN_DROP A plugin marked this packet for a drop
+ * @return HE_ERR_FAILED An error occurred processing this packet
+ * @note This MAY alter the contents of packet, depending on the registered plugins
+ *
+ * Unlike he_plugin_ingress(), plugins can use the headroom to add to the front of the packet
+ * without copying it.
+ */
+he_return_code_t he_plugin_ingress_packet(he_plugin_chain_t *chain, he_plugin_packet_t *packet);
+
+/**
+ * @brief Execute the egress function of each registered plugin on a packet with room around it
+ * @param chain A pointer to a valid plugin chain
+ * @param packet The packet, updated as plugins move its start or change its length
+ * @return HE_SUCCESS All plugins executed successfully
+ * @return HE_ERR_PLUGIN_DROP A plugin marked this packet for a drop
+ * @return HE_ERR_FAILED An error occurred processing this packet
+ * @note This MAY alter the contents of packet, depending on the registered plugins
+ */
+he_return_code_t he_plugin_egress_packet(he_plugin_chain_t *chain, he_plugin_packet_t *packet);
+
+/**
+ * @brief Execute the ingress functions of each registered plugin on a batch of packets
+ * @param chain A pointer to a valid plugin chain
+ * @param packets The packets, updated as plugins move their starts or change their lengths
+ * @param results Set to the outcome for each packet, as he_plugin_ingress() would return it
+ * @param count The number of packets
+ * @return HE_SUCCESS The batch was processed; see results for each packet
+ * @return HE_ERR_NULL_POINTER Either of the arrays supplied is NULL
+ * @note This MAY alter the contents of packets, depending on the registered plugins
+ *
+ * Plugins with a batch callback are called with up to HE_PLUGIN_MAX_BATCH packets at a time, and
+ * the others once per packet. A packet that a plugin drops or fails is not passed to the plugins
+ * after it.
+ */
+he_return_code_t he_plugin_ingress_batch(he_plugin_chain_t *chain, he_plugin_packet_t *packets,
+                                         he_return_code_t *results, size_t count);
+
+/**
+ * @brief Execute the egress functions of each registered plugin on a batch of packets
+ * @param chain A pointer to a valid plugin chain
+ * @param packets The packets, updated as plugins move their starts or change their lengths
+ * @param results Set to the outcome for each packet, as he_plugin_egress() would return it
+ * @param count The number of packets
+ * @return HE_SUCCESS The batch was processed; see results for each packet
+ * @return HE_ERR_NULL_POINTER Either of the arrays supplied is NULL
+ * @note This MAY alter the contents of packets, depending on the registered plugins
+ */
+he_return_code_t he_plugin_egress_batch(he_plugin_chain_t *chain, he_plugin_packet_t *packets,
+                                        he_return_code_t *results, size_t count);
+
 #endif  // PLUGIN_CHAIN_H
@@ -16,92 +16,251 @@
  *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
-#include <math.h>
-#include <stdio.h>
-#include <stdlib.h>
 #include "plugin_stats.h"
+#include "atomic.h"
+#include "clock.h"
+#include "memory.h"
 
-// With apologies to https://github.com/zedshaw/liblcthw/blob/master/src/lcthw/stats.c
+#include <string.h>
 
-static double stats_mean(stats_t *st) {
-  return st->sum / st->n;
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define STATS_THREAD_LOCAL __declspec(thread)
+#else
+#define STATS_THREAD_LOCAL __thread
+#endif
+
+// Threads are handed shards in the order they first record a packet, shared by every stats plugin
+static volatile uint64_t stats_threads = 0;
+// This thread's shard plus one, or 0 before its first packet
+static STATS_THREAD_LOCAL uint64_t stats_thread_shard = 0;
+
+static stats_snapshot_t *stats_shard(packet_stats_t *stats) {
+  if(!stats_thread_shard) {
+    stats_thread_shard = he_atomic_add_u64(&stats_threads, 1) % STATS_SHARDS + 1;
+  }
+  return &stats->shards[stats_thread_shard - 1];
 }
 
-static double stats_stddev(stats_t *st) {
-  return sqrt((st->sumsq - (st->sum * st->sum / st->n)) / (st->n - 1));
+static unsigned int stats_magnitude(uint32_t value) {
+#if defined(_MSC_VER)
+  unsigned long index = 0;
+  _BitScanReverse(&index, value);
+  return (unsigned int)index;
+#else
+  return 31 - (unsigned int)__builtin_clz(value);
+#endif
 }
 
-static void stats_sample(stats_t *st, double s) {
-  st->sum += s;
-  st->sumsq += s * s;
+size_t stats_histogram_bucket(uint64_t value) {
+  if(value > STATS_MAX_VALUE) {
+    value = STATS_MAX_VALUE;
+  }
 
-  if(st->n == 0) {
-    st->min = s;
-    st->max = s;
-  } else {
-    if(st->min > s) st->min = s;
-    if(st->max < s) st->max = s;
+  // Small values get a bucket each
+  if(value < STATS_SUB_BUCKETS) {
+    return (size_t)value;
   }
 
-  st->n += 1;
+  // After that each power of two is split into STATS_SUB_BUCKETS equal buckets
+  unsigned int magnitude = stats_magnitude((uint32_t)value);
+  unsigned int shift = magnitude - STATS_SUB_BUCKET_BITS;
+  return (size_t)(shift + 1) * STATS_SUB_BUCKETS + (size_t)(value >> shift) - STATS_SUB_BUCKETS;
 }
 
-static void stats_dump(stats_t *st) {
-  fprintf(stderr,
-          "sum: %f, sumsq: %f, n: %ld, "
-          "min: %f, max: %f, mean: %f, stddev: %f\n",
-          st->sum, st->sumsq, st->n, st->min, st->max, stats_mean(st), stats_stddev(st));
+uint64_t stats_histogram_bucket_max(size_t bucket) {
+  if(bucket < STATS_SUB_BUCKETS) {
+    return bucket;
+  }
+
+  size_t shift = bucket / STATS_SUB_BUCKETS - 1;
+  uint64_t lowest = (uint64_t)(bucket % STATS_SUB_BUCKETS + STATS_SUB_BUCKETS) << shift;
+  return lowest + ((uint64_t)1 << shift) - 1;
 }
 
-he_plugin_return_code_t stats_plugin_do_ingress(uint8_t *packet, size_t *length, size_t capacity,
-                                                packet_stats_t *data) {
-  if(data == NULL) {
-    return HE_PLUGIN_FAIL;
+uint64_t stats_histogram_percentile(const stats_histogram_t *histogram, double percentile) {
+  if(!histogram) {
+    return 0;
   }
 
-  stats_t *incoming = &data->incoming;
+  // The buckets rather than count, as a snapshot taken under load may not have them in step
+  uint64_t total = 0;
+  for(size_t i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+    total += histogram->buckets[i];
+  }
+  if(!total) {
+    return 0;
+  }
+
+  if(percentile < 0) {
+    percentile = 0;
+  } else if(percentile > 100) {
+    percentile = 100;
+  }
 
-  stats_sample(incoming, *length);
+  uint64_t target = (uint64_t)((double)total * percentile / 100.0 + 0.5);
+  if(target < 1) {
+    target = 1;
+  } else if(target > total) {
+    target = total;
+  }
 
-  if(incoming->n % PACKET_SAMPLE_N == 0) {
-    fprintf(stderr, "Ingress: ");
-    stats_dump(incoming);
+  uint64_t seen = 0;
+  for(size_t i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if(seen >= target) {
+      return stats_histogram_bucket_max(i);
+    }
   }
-  return HE_PLUGIN_SUCCESS;
+
+  return 0;
 }
 
-he_plugin_return_code_t stats_plugin_do_egress(uint8_t *packet, size_t *length, size_t capacity,
-                                               packet_stats_t *data) {
-  if(data == NULL) {
-    return HE_PLUGIN_FAIL;
+static void stats_record(void *data, he_plugin_packet_t *packets, size_t count, bool ingress) {
+  packet_stats_t *stats = data;
+  stats_snapshot_t *shard = stats_shard(stats);
+  stats_direction_t *direction = ingress ? &shard->ingress : &shard->egress;
+
+  uint64_t bytes = 0;
+  uint64_t gap_count = 0;
+  uint64_t gap_sum = 0;
+  uint64_t now = 0;
+
+  for(size_t i = 0; i < count; i++) {
+    he_plugin_packet_t *packet = &packets[i];
+    bytes += packet->length;
+    he_atomic_add_u64(&direction->sizes.buckets[stats_histogram_bucket(packet->length)], 1);
+
+    // Time between packets needs somewhere to keep the last one
+    int slot = packet->state_slot;
+    if(slot < 0 || !packet->state) {
+      continue;
+    }
+    stats_conn_t *conn = packet->state[slot];
+    if(!conn) {
+      conn = he_internal_calloc(1, sizeof(stats_conn_t));
+      if(!conn) {
+        continue;
+      }
+      packet->state[slot] = conn;
+    }
+
+    // Packets in one batch arrived together as far as we can tell
+    if(!now) {
+      now = he_internal_clock_us();
+    }
+    uint64_t *last = ingress ? &conn->last_ingress_us : &conn->last_egress_us;
+    if(*last) {
+      uint64_t gap = now - *last;
+      he_atomic_add_u64(&direction->gaps.buckets[stats_histogram_bucket(gap)], 1);
+      gap_count++;
+      gap_sum += gap;
+    }
+    *last = now;
   }
 
-  stats_t *outgoing = &data->outgoing;
+  he_atomic_add_u64(&direction->sizes.count, count);
+  he_atomic_add_u64(&direction->sizes.sum, bytes);
+  if(gap_count) {
+    he_atomic_add_u64(&direction->gaps.count, gap_count);
+    he_atomic_add_u64(&direction->gaps.sum, gap_sum);
+  }
+}
+
+he_plugin_return_code_t stats_plugin_do_ingress(he_plugin_packet_t *packets,
+                                                he_plugin_return_code_t *results, size_t count,
+                                                void *data) {
+  if(data == NULL || packets == NULL) {
+    return HE_PLUGIN_FAIL;
+  }
 
-  stats_sample(outgoing, *length);
+  stats_record(data, packets, count, true);
+  return HE_PLUGIN_SUCCESS;
+}
 
-  if(outgoing->n % PACKET_SAMPLE_N == 0) {
-    fprintf(stderr, "Egress: ");
-    stats_dump(outgoing);
+he_plugin_return_code_t stats_plugin_do_egress(he_plugin_packet_t *packets,
+                                               he_plugin_return_code_t *results, size_t count,
+                                               void *data) {
+  if(data == NULL || packets == NULL) {
+    return HE_PLUGIN_FAIL;
   }
+
+  stats_record(data, packets, count, false);
   return HE_PLUGIN_SUCCESS;
 }
 
-he_plugin_return_code_t stats_plugin_create(plugin_struct_t *plugin_struct) {
-  packet_stats_t *stats = calloc(1, sizeof(packet_stats_t));
+static void stats_plugin_free_state(void *state, void *data) {
+  he_internal_free(state);
+}
+
+he_return_code_t stats_plugin_create(plugin_struct_t *plugin_struct) {
+  if(plugin_struct == NULL) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  packet_stats_t *stats = he_internal_calloc(1, sizeof(packet_stats_t));
   if(stats == NULL) {
-    return HE_PLUGIN_FAIL;
+    return HE_ERR_NO_MEMORY;
   }
 
-  plugin_struct->do_ingress = (plugin_do_ingress)stats_plugin_do_ingress;
-  plugin_struct->do_egress = (plugin_do_egress)stats_plugin_do_egress;
+  memset(plugin_struct, 0, sizeof(plugin_struct_t));
+  plugin_struct->do_ingress_batch = stats_plugin_do_ingress;
+  plugin_struct->do_egress_batch = stats_plugin_do_egress;
+  plugin_struct->free_state = stats_plugin_free_state;
   plugin_struct->data = stats;
 
-  return HE_PLUGIN_SUCCESS;
+  return HE_SUCCESS;
 }
 
 void stats_plugin_destroy(plugin_struct_t *plugin_struct) {
   if(plugin_struct && plugin_struct->data) {
-    free(plugin_struct->data);
+    he_internal_free(plugin_struct->data);
+    plugin_struct->data = NULL;
+  }
+}
+
+// Reads a histogram other threads may be writing to
+static void stats_histogram_load(stats_histogram_t *into, stats_histogram_t *from) {
+  into->count += he_atomic_load_u64(&from->count);
+  into->sum += he_atomic_load_u64(&from->sum);
+  for(size_t i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+    into->buckets[i] += he_atomic_load_u64(&from->buckets[i]);
   }
 }
+
+he_return_code_t stats_plugin_snapshot(const plugin_struct_t *plugin_struct,
+                                       stats_snapshot_t *snapshot) {
+  if(plugin_struct == NULL || plugin_struct->data == NULL || snapshot == NULL) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  packet_stats_t *stats = plugin_struct->data;
+  memset(snapshot, 0, sizeof(stats_snapshot_t));
+  for(size_t i = 0; i < STATS_SHARDS; i++) {
+    stats_histogram_load(&snapshot->ingress.sizes, &stats->shards[i].ingress.sizes);
+    stats_histogram_load(&snapshot->ingress.gaps, &stats->shards[i].ingress.gaps);
+    stats_histogram_load(&snapshot->egress.sizes, &stats->shards[i].egress.sizes);
+    stats_histogram_load(&snapshot->egress.gaps, &stats->shards[i].egress.gaps);
+  }
+
+  return HE_SUCCESS;
+}
+
+static void stats_histogram_merge(stats_histogram_t *into, const stats_histogram_t *from) {
+  into->count += from->count;
+  into->sum += from->sum;
+  for(size_t i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+    into->buckets[i] += from->buckets[i];
+  }
+}
+
+void stats_snapshot_merge(stats_snapshot_t *into, const stats_snapshot_t *from) {
+  if(into == NULL || from == NULL) {
+    return;
+  }
+
+  stats_histogram_merge(&into->ingress.sizes, &from->ingress.sizes);
+  stats_histogram_merge(&into->ingress.gaps, &from->ingress.gaps);
+  stats_histogram_merge(&into->egress.sizes, &from->egress.sizes);
+  stats_histogram_merge(&into->egress.gaps, &from->egress.gaps);
+}
@@ -20,38 +20,121 @@
  * @file plugin_stats.h
  * @brief Example plugin implementation
  *
+ * Counts packets and bytes and keeps log-linear histograms of packet sizes and of the time between
+ * packets on each connection. Nothing is printed or written from the data path; the host takes a
+ * snapshot whenever it wants to report.
+ *
+ * Counters are sharded by thread so packets on different threads don't fight over cache lines.
+ * Histograms have STATS_SUB_BUCKETS buckets per power of two, so a value read back from one is
+ * within 1 / STATS_SUB_BUCKETS (6.25%) of what was recorded.
  */
 
 #ifndef PLUGIN_STATS
 #define PLUGIN_STATS
 
 #include <stddef.h>
+#include <stdint.h>
+#include <he.h>
 #include <he_plugin.h>
 
+/// Buckets per power of two are 2 ^ STATS_SUB_BUCKET_BITS
+#define STATS_SUB_BUCKET_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BUCKET_BITS)
+/// Larger values are recorded as this
+#define STATS_MAX_VALUE UINT32_MAX
+#define STATS_HISTOGRAM_BUCKETS ((32 - STATS_SUB_BUCKET_BITS + 1) * STATS_SUB_BUCKETS)
+
+typedef struct stats_histogram {
+  /// Number of values recorded
+  uint64_t count;
+  /// Sum of the values recorded
+  uint64_t sum;
+  uint64_t buckets[STATS_HISTOGRAM_BUCKETS];
+} stats_histogram_t;
+
+typedef struct stats_direction {
+  /// Packet sizes in bytes; count and sum are the packet and byte counters
+  stats_histogram_t sizes;
+  /// Microseconds since the previous packet on the same connection
+  stats_histogram_t gaps;
+} stats_direction_t;
+
+typedef struct stats_snapshot {
+  stats_direction_t ingress;
+  stats_direction_t egress;
+} stats_snapshot_t;
+
 // This is the only "public" API
-he_plugin_return_code_t stats_plugin_create(plugin_struct_t *plugin_struct);
+
+/**
+ * @brief Sets up a stats plugin, ready to be registered
+ * @param plugin_struct The plugin to fill in
+ * @return HE_SUCCESS The plugin is ready
+ * @return HE_ERR_NULL_POINTER plugin_struct was NULL
+ * @return HE_ERR_NO_MEMORY The counters could not be allocated
+ *
+ * Time between packets is only measured for packets that belong to a connection, as the plugin
+ * keeps the time of the last one in the connection's state slot.
+ */
+he_return_code_t stats_plugin_create(plugin_struct_t *plugin_struct);
+
+/**
+ * @brief Frees the counters of a stats plugin
+ * @param plugin_struct The plugin, which must not be on any plugin chain
+ */
 void stats_plugin_destroy(plugin_struct_t *plugin_struct);
 
-// Everything else here is for testing
+/**
+ * @brief Adds up everything the plugin has counted so far
+ * @param plugin_struct A plugin set up with stats_plugin_create()
+ * @param snapshot Filled in with the totals since the plugin was created
+ * @return HE_SUCCESS The snapshot was taken
+ * @return HE_ERR_NULL_POINTER Either parameter was NULL, or the plugin wasn't set up
+ *
+ * Safe to call from any thread while packets are flowing. Counters only go up, so the difference
+ * between two snapshots is what happened in between.
+ */
+he_return_code_t stats_plugin_snapshot(const plugin_struct_t *plugin_struct,
+                                       stats_snapshot_t *snapshot);
+
+/**
+ * @brief Adds one snapshot to another, e.g. to combine several plugins
+ * @param into The snapshot to add to
+ * @param from The snapshot to add
+ */
+void stats_snapshot_merge(stats_snapshot_t *into, const stats_snapshot_t *from);
 
-#define PACKET_SAMPLE_N 100000
+/**
+ * @brief Finds the value below which a percentage of the recorded values fall
+ * @param histogram The histogram to search
+ * @param percentile Between 0 and 100
+ * @return uint64_t The largest value that would be recorded in the same bucket, or 0 if the
+ *         histogram is empty
+ */
+uint64_t stats_histogram_percentile(const stats_histogram_t *histogram, double percentile);
+
+// Everything else here is for testing
 
-typedef struct stats {
-  double sum;
-  double sumsq;
-  unsigned long n;
-  double min;
-  double max;
-} stats_t;
+#define STATS_SHARDS 8
 
 typedef struct packet_stats {
-  stats_t incoming;
-  stats_t outgoing;
+  stats_snapshot_t shards[STATS_SHARDS];
 } packet_stats_t;
 
-he_plugin_return_code_t stats_plugin_do_ingress(uint8_t *packet, size_t *length, size_t capacity,
-                                                packet_stats_t *data);
-he_plugin_return_code_t stats_plugin_do_egress(uint8_t *packet, size_t *length, size_t capacity,
-                                               packet_stats_t *data);
+/// Per-connection state, kept in the plugin's state slot
+typedef struct stats_conn {
+  uint64_t last_ingress_us;
+  uint64_t last_egress_us;
+} stats_conn_t;
+
+size_t stats_histogram_bucket(uint64_t value);
+uint64_t stats_histogram_bucket_max(size_t bucket);
+
+he_plugin_return_code_t stats_plugin_do_ingress(he_plugin_packet_t *packets,
+                                                he_plugin_return_code_t *results, size_t count,
+                                                void *data);
+he_plugin_return_code_t stats_plugin_do_egress(he_plugin_packet_t *packets,
+                                               he_plugin_return_code_t *results, size_t count,
+                                               void *data);
 
 #endif  // PLUGIN_STATS
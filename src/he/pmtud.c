@@ -0,0 +1,214 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "pmtud.h"
+#include "clock.h"
+#include "conn.h"
+
+// The MTU WolfSSL is normally held to, so that handshake messages aren't larger than the path
+static uint16_t he_pmtud_wolf_mtu(he_conn_t *conn) {
+  if(conn->effective_mtu || conn->peer_mtu) {
+    return (uint16_t)HE_PMTUD_WOLF_MTU(he_conn_get_effective_mtu(conn));
+  }
+  return (uint16_t)(conn->outside_mtu - HE_PACKET_OVERHEAD + HE_WOLF_MAX_HEADER_SIZE);
+}
+
+static void he_pmtud_send_mtu(he_conn_t *conn, bool is_reply) {
+  he_msg_mtu_t msg = {0};
+  msg.msg_header.msgid = HE_MSGID_MTU;
+  msg.mtu = htons(conn->effective_mtu);
+  msg.received_mtu = htons(conn->peer_mtu);
+  msg.is_reply = is_reply;
+
+  he_internal_send_message(conn, (uint8_t *)&msg, sizeof(he_msg_mtu_t));
+}
+
+// Applies a change to what either end found, the tunnel uses the smaller of the two
+static void he_pmtud_update(he_conn_t *conn, uint16_t effective_mtu, uint16_t peer_mtu) {
+  int before = he_conn_get_effective_mtu(conn);
+
+  conn->effective_mtu = effective_mtu;
+  conn->peer_mtu = peer_mtu;
+  wolfSSL_dtls_set_mtu(conn->wolf_ssl, he_pmtud_wolf_mtu(conn));
+
+  if(he_conn_get_effective_mtu(conn) != before) {
+    he_internal_generate_event(conn, HE_EVENT_PMTU_UPDATED);
+  }
+}
+
+static void he_pmtud_set_effective_mtu(he_conn_t *conn, uint16_t mtu) {
+  bool changed = mtu != conn->effective_mtu;
+
+  he_pmtud_update(conn, mtu, conn->peer_mtu);
+
+  // The peer has to know, or it keeps sending packets sized for its own measurement
+  if(changed) {
+    conn->pmtud_announce_count = 1;
+    he_pmtud_send_mtu(conn, false);
+  }
+}
+
+static he_return_code_t he_pmtud_send_probe(he_conn_t *conn, uint16_t size, uint64_t now) {
+  // A PING padded out to the same size as a data message carrying a packet of the probed size
+  uint8_t probe[HE_MAX_PMTU + sizeof(he_msg_data_t)] = {0};
+  he_internal_conn_build_ping(conn, (he_msg_ping_t *)probe);
+
+  conn->pmtud_probe_size = size;
+  conn->pmtud_probe_sequence = ((he_msg_ping_t *)probe)->payload;
+  conn->pmtud_timer_ms = now;
+
+  // Let this one record through WolfSSL's size check, but nothing else
+  wolfSSL_dtls_set_mtu(conn->wolf_ssl, (uint16_t)HE_PMTUD_WOLF_MTU(size));
+  he_return_code_t res =
+      he_internal_send_message(conn, probe, (uint16_t)(size + sizeof(he_msg_data_t)));
+  wolfSSL_dtls_set_mtu(conn->wolf_ssl, he_pmtud_wolf_mtu(conn));
+
+  return res;
+}
+
+static he_return_code_t he_pmtud_next_step(he_conn_t *conn, uint64_t now) {
+  // The base size has to work before anything else is tried. If it never does, either the path is
+  // down or the peer doesn't answer probes; either way there's nothing to learn.
+  if(conn->pmtud_low == 0) {
+    if(conn->pmtud_high <= HE_PMTUD_BASE_MTU) {
+      conn->pmtud_state = HE_PMTUD_SEARCH_COMPLETE;
+      conn->pmtud_timer_ms = now;
+      return HE_SUCCESS;
+    }
+    return he_pmtud_send_probe(conn, HE_PMTUD_BASE_MTU, now);
+  }
+
+  if(conn->pmtud_high - conn->pmtud_low <= HE_PMTUD_SEARCH_PRECISION) {
+    // Settle on what is known to work, which may be smaller than where we started
+    conn->pmtud_state = HE_PMTUD_SEARCH_COMPLETE;
+    conn->pmtud_timer_ms = now;
+    he_pmtud_set_effective_mtu(conn, conn->pmtud_low);
+    return HE_SUCCESS;
+  }
+
+  // Retry a lost probe at the same size, it may just have been unlucky
+  uint16_t size = conn->pmtud_probe_count
+                      ? conn->pmtud_probe_size
+                      : (uint16_t)(conn->pmtud_low + (conn->pmtud_high - conn->pmtud_low) / 2);
+  return he_pmtud_send_probe(conn, size, now);
+}
+
+static void he_pmtud_start_search(he_conn_t *conn, uint16_t low) {
+  int largest = conn->outside_mtu - (int)HE_PMTUD_OVERHEAD;
+  if(largest > HE_MAX_PMTU) {
+    largest = HE_MAX_PMTU;
+  }
+
+  conn->pmtud_state = HE_PMTUD_SEARCHING;
+  conn->pmtud_low = low;
+  // Exclusive, so one more than the largest size worth trying
+  conn->pmtud_high = (uint16_t)(largest > 0 ? largest + 1 : 0);
+  conn->pmtud_probe_size = 0;
+  conn->pmtud_probe_count = 0;
+}
+
+he_return_code_t he_conn_send_pmtu_probe_if_due(he_conn_t *conn) {
+  if(!conn) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  if(conn->connection_type != HE_CONNECTION_TYPE_DATAGRAM) {
+    return HE_ERR_NOT_SUPPORTED;
+  }
+
+  if(conn->state != HE_STATE_ONLINE) {
+    return HE_ERR_INVALID_CLIENT_STATE;
+  }
+
+  // Announcements can be lost. Older peers ignore them, so don't keep trying for ever.
+  if(conn->pmtud_acked_mtu != conn->effective_mtu &&
+     conn->pmtud_announce_count < HE_PMTUD_MAX_PROBES) {
+    conn->pmtud_announce_count++;
+    he_pmtud_send_mtu(conn, false);
+  }
+
+  uint64_t now = he_internal_clock_ms();
+
+  switch(conn->pmtud_state) {
+    case HE_PMTUD_DISABLED:
+      he_pmtud_start_search(conn, 0);
+      break;
+    case HE_PMTUD_SEARCH_COMPLETE:
+      if(now - conn->pmtud_timer_ms < HE_PMTUD_RAISE_INTERVAL_MS) {
+        return HE_SUCCESS;
+      }
+      // Paths change, look again for a larger MTU starting from the one in use
+      he_pmtud_start_search(conn, conn->effective_mtu);
+      break;
+    case HE_PMTUD_SEARCHING:
+      if(conn->pmtud_probe_size) {
+        uint32_t timeout = conn->rto_ms ? conn->rto_ms : HE_PMTUD_PROBE_TIMEOUT_MS;
+        if(now - conn->pmtud_timer_ms < timeout) {
+          return HE_SUCCESS;
+        }
+
+        // Lost, after enough losses in a row assume the probe was too large for the path
+        conn->pmtud_probe_count++;
+        if(conn->pmtud_probe_count >= HE_PMTUD_MAX_PROBES) {
+          conn->pmtud_high = conn->pmtud_probe_size;
+          conn->pmtud_probe_size = 0;
+          conn->pmtud_probe_count = 0;
+        }
+      }
+      break;
+  }
+
+  return he_pmtud_next_step(conn, now);
+}
+
+void he_internal_pmtud_pong_received(he_conn_t *conn, uint32_t sequence) {
+  if(conn->pmtud_state != HE_PMTUD_SEARCHING || !conn->pmtud_probe_size ||
+     sequence != conn->pmtud_probe_sequence) {
+    return;
+  }
+
+  conn->pmtud_low = conn->pmtud_probe_size;
+  conn->pmtud_probe_size = 0;
+  conn->pmtud_probe_count = 0;
+
+  // Make use of a larger MTU as soon as it's known to work
+  if(conn->pmtud_low > (conn->effective_mtu ? conn->effective_mtu : HE_MAX_MTU)) {
+    he_pmtud_set_effective_mtu(conn, conn->pmtud_low);
+  }
+
+  // No need to wait for the host, move straight on to the next probe
+  he_pmtud_next_step(conn, he_internal_clock_ms());
+}
+
+void he_internal_pmtud_mtu_received(he_conn_t *conn, uint16_t mtu, uint16_t received_mtu,
+                                    bool is_reply) {
+  if(received_mtu == conn->effective_mtu) {
+    conn->pmtud_acked_mtu = received_mtu;
+  }
+
+  // Path MTU discovery never settles outside these, so anything else is nonsense
+  if(mtu == 0 || (mtu >= HE_PMTUD_BASE_MTU && mtu <= HE_MAX_PMTU)) {
+    if(mtu != conn->peer_mtu) {
+      he_pmtud_update(conn, conn->effective_mtu, mtu);
+    }
+  }
+
+  if(!is_reply) {
+    he_pmtud_send_mtu(conn, true);
+  }
+}
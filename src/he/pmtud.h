@@ -0,0 +1,88 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file pmtud.h
+ * @brief Functions for path MTU discovery
+ *
+ * Rather than relying on ICMP, which is often filtered, the largest packet that gets through is
+ * found by sending PINGs padded to a given size and seeing which are answered (as in DPLPMTUD,
+ * RFC 8899). The search starts from a size that fits any path that can carry a 1280 byte
+ * datagram and narrows down on the largest working size with a binary search.
+ */
+
+#ifndef PMTUD_H
+#define PMTUD_H
+
+#include <he.h>
+
+// Fits in a 1280 byte datagram, the smallest MTU IPv6 allows, so works on practically any path
+#define HE_PMTUD_BASE_MTU 1196
+// Outside IPv4 / UDP headers, the Helium header and D/TLS overhead around a tunnelled packet
+#define HE_PMTUD_OVERHEAD (HE_PACKET_OVERHEAD - HE_HEADER_SAFE_GAP)
+// Stop searching when the largest working and smallest failing sizes are this close
+#define HE_PMTUD_SEARCH_PRECISION 4
+// A probe size is considered too large after this many unanswered probes
+#define HE_PMTUD_MAX_PROBES 3
+// How long to wait for a probe to be answered if there's no RTT estimate yet
+#define HE_PMTUD_PROBE_TIMEOUT_MS 1000
+// How often to check whether the path can now take larger packets
+#define HE_PMTUD_RAISE_INTERVAL_MS 600000
+
+// The MTU WolfSSL needs to allow for a tunnelled packet of the given size
+#define HE_PMTUD_WOLF_MTU(mtu) ((mtu) + sizeof(he_msg_data_t) + HE_WOLF_MAX_HEADER_SIZE)
+
+/**
+ * @brief Runs path MTU discovery, sending a probe if one is due
+ * @param conn A pointer to a valid connection
+ * @return HE_SUCCESS A probe was sent, or none was due
+ * @return HE_ERR_NULL_POINTER The conn pointer supplied is NULL
+ * @return HE_ERR_INVALID_CLIENT_STATE The connection isn't online
+ * @return HE_ERR_NOT_SUPPORTED The connection isn't using D/TLS; TCP takes care of its own MTU
+ *
+ * The first call starts the search. The host should then call this regularly, e.g. every second,
+ * to time out lost probes. Answered probes move the search on straight away. What was found is
+ * sent to the peer, which uses it to limit what it sends us. Whenever the MTU of the tunnel
+ * changes, because of a search at either end, HE_EVENT_PMTU_UPDATED is generated and the host
+ * should update the MTU of its TUN device to he_conn_get_effective_mtu().
+ *
+ * Once the search is done, it is repeated every 10 minutes in case the path has changed.
+ *
+ * @note Both ends must be running a version of Helium that answers PINGs with their sequence
+ *       number. If the peer doesn't, no probe will ever be answered and the MTU is left as it is.
+ */
+he_return_code_t he_conn_send_pmtu_probe_if_due(he_conn_t *conn);
+
+/**
+ * @brief Checks whether a PONG answers the outstanding probe and moves the search on if it does
+ * @param conn A pointer to a valid connection
+ * @param sequence The sequence number echoed in the PONG
+ */
+void he_internal_pmtud_pong_received(he_conn_t *conn, uint32_t sequence);
+
+/**
+ * @brief Takes note of the MTU the peer's path MTU discovery found, and answers it
+ * @param conn A pointer to a valid connection
+ * @param mtu The MTU the peer found, 0 if it hasn't found one
+ * @param received_mtu The MTU the peer last heard from us
+ * @param is_reply Whether the message answers one of ours, and so isn't answered itself
+ */
+void he_internal_pmtud_mtu_received(he_conn_t *conn, uint16_t mtu, uint16_t received_mtu,
+                                    bool is_reply);
+
+#endif  // PMTUD_H
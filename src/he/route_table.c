@@ -0,0 +1,192 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "route_table.h"
+#include "atomic.h"
+#include "inet.h"
+#include "ipv4.h"
+#include "memory.h"
+
+#include <string.h>
+
+#define HE_ROUTE_TABLE_INITIAL_NODES 4
+
+static uint32_t he_route_table_leaf(uint32_t prefix_length, he_route_verdict_t verdict) {
+  return ((prefix_length + 1) << 8) | (uint32_t)verdict;
+}
+
+// Length of the route that set a leaf plus one, 0 for an empty entry
+static uint32_t he_route_table_leaf_length(uint32_t entry) {
+  return (entry >> 8) & 0xFF;
+}
+
+static bool he_route_table_new_node(he_route_table_t *table, uint32_t fill, uint32_t *index) {
+  if(table->node_count == table->node_capacity) {
+    size_t capacity = table->node_capacity * 2;
+    void *nodes = he_internal_realloc(table->nodes, capacity * sizeof(*table->nodes));
+    if(!nodes) {
+      return false;
+    }
+    table->nodes = nodes;
+    table->node_capacity = capacity;
+  }
+
+  *index = (uint32_t)table->node_count++;
+  for(int i = 0; i < HE_ROUTE_TABLE_NODE_SIZE; i++) {
+    table->nodes[*index][i] = fill;
+  }
+  return true;
+}
+
+// Sets every entry of a node, and of the nodes below it, that isn't covered by a longer route
+static void he_route_table_fill(he_route_table_t *table, uint32_t index, uint32_t first,
+                                uint32_t count, uint32_t leaf) {
+  for(uint32_t i = first; i < first + count; i++) {
+    uint32_t entry = table->nodes[index][i];
+    if(entry & HE_ROUTE_TABLE_CHILD) {
+      he_route_table_fill(table, entry & ~HE_ROUTE_TABLE_CHILD, 0, HE_ROUTE_TABLE_NODE_SIZE, leaf);
+    } else if(he_route_table_leaf_length(entry) <= he_route_table_leaf_length(leaf)) {
+      table->nodes[index][i] = leaf;
+    }
+  }
+}
+
+he_route_table_t *he_route_table_create(he_route_verdict_t default_verdict) {
+  he_route_table_t *table = he_internal_calloc(1, sizeof(he_route_table_t));
+  if(!table) {
+    return NULL;
+  }
+
+  table->default_verdict = default_verdict;
+  table->node_capacity = HE_ROUTE_TABLE_INITIAL_NODES;
+  table->nodes = he_internal_calloc(table->node_capacity, sizeof(*table->nodes));
+  if(!table->nodes) {
+    he_internal_free(table);
+    return NULL;
+  }
+
+  // The root node, which always exists so lookups don't have to check
+  table->node_count = 1;
+
+  return table;
+}
+
+he_return_code_t he_route_table_destroy(he_route_table_t *table) {
+  if(table) {
+    he_internal_free(table->nodes);
+    he_internal_free(table);
+  }
+  return HE_SUCCESS;
+}
+
+he_return_code_t he_route_table_add(he_route_table_t *table, const char *cidr,
+                                    he_route_verdict_t verdict) {
+  if(!table || !cidr) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  uint32_t network = 0;
+  uint32_t prefix_length = 0;
+  if(!he_internal_ipv4_parse_prefix(cidr, &network, &prefix_length) ||
+     (verdict != HE_ROUTE_TUNNEL && verdict != HE_ROUTE_BYPASS)) {
+    return HE_ERR_INVALID_ROUTE;
+  }
+
+  uint32_t leaf = he_route_table_leaf(prefix_length, verdict);
+  uint32_t index = 0;
+
+  // Walk down to the level the route ends in, adding nodes as needed. A new node starts out with
+  // whatever covered it from above.
+  int level = 0;
+  while(prefix_length > (uint32_t)(level + 1) * HE_ROUTE_TABLE_STRIDE) {
+    uint32_t byte = (network >> (24 - level * HE_ROUTE_TABLE_STRIDE)) & 0xFF;
+    uint32_t entry = table->nodes[index][byte];
+    if(!(entry & HE_ROUTE_TABLE_CHILD)) {
+      uint32_t child = 0;
+      if(!he_route_table_new_node(table, entry, &child)) {
+        return HE_ERR_NO_MEMORY;
+      }
+      table->nodes[index][byte] = HE_ROUTE_TABLE_CHILD | child;
+      entry = table->nodes[index][byte];
+    }
+    index = entry & ~HE_ROUTE_TABLE_CHILD;
+    level++;
+  }
+
+  // The route covers a run of entries in this node
+  uint32_t span_bits = (uint32_t)(level + 1) * HE_ROUTE_TABLE_STRIDE - prefix_length;
+  uint32_t first = ((network >> (24 - level * HE_ROUTE_TABLE_STRIDE)) & 0xFF) &
+                   ~((1u << span_bits) - 1);
+  he_route_table_fill(table, index, first, 1u << span_bits, leaf);
+
+  return HE_SUCCESS;
+}
+
+he_route_verdict_t he_route_table_lookup(const he_route_table_t *table, uint32_t address) {
+  uint32_t host_address = ntohl(address);
+  uint32_t index = 0;
+
+  for(int shift = 24; shift >= 0; shift -= HE_ROUTE_TABLE_STRIDE) {
+    uint32_t entry = table->nodes[index][(host_address >> shift) & 0xFF];
+    if(!(entry & HE_ROUTE_TABLE_CHILD)) {
+      return entry ? (he_route_verdict_t)(entry & 0xFF) : table->default_verdict;
+    }
+    index = entry & ~HE_ROUTE_TABLE_CHILD;
+  }
+
+  // Routes are at most 32 bits long so the last level never has children
+  return table->default_verdict;
+}
+
+he_route_table_t *he_conn_set_route_table(he_conn_t *conn, he_route_table_t *table) {
+  if(!conn) {
+    return NULL;
+  }
+
+  he_route_table_t *old = (he_route_table_t *)(uintptr_t)he_atomic_exchange_u64(
+      &conn->route_table, (uint64_t)(uintptr_t)table);
+
+  // A reader that registered after the swap can only see the new table, so once the count has
+  // been seen at zero nobody can still be looking at the old one
+  while(old && he_atomic_add_u64(&conn->route_readers, 0) != 0) {
+  }
+
+  return old;
+}
+
+he_route_table_t *he_conn_get_route_table(he_conn_t *conn) {
+  if(!conn) {
+    return NULL;
+  }
+
+  return (he_route_table_t *)(uintptr_t)he_atomic_load_u64(&conn->route_table);
+}
+
+bool he_internal_route_table_bypass(he_conn_t *conn, uint32_t address) {
+  // Most connections never have a table, keep them off the shared counter
+  if(!he_atomic_load_u64(&conn->route_table)) {
+    return false;
+  }
+
+  he_atomic_add_u64(&conn->route_readers, 1);
+  he_route_table_t *table = he_conn_get_route_table(conn);
+  bool bypass = table && he_route_table_lookup(table, address) == HE_ROUTE_BYPASS;
+  he_atomic_add_u64(&conn->route_readers, (uint64_t)-1);
+
+  return bypass;
+}
@@ -0,0 +1,113 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file route_table.h
+ * @brief Functions for split tunnelling on clients
+ *
+ * A route table decides, by longest prefix match on the destination address, whether a packet
+ * from the inside goes through the tunnel or bypasses it. Tables are built once with
+ * he_route_table_add() and are read-only after that, so a new rule set is put in place by
+ * building a new table and swapping it in with he_conn_set_route_table().
+ */
+
+#ifndef ROUTE_TABLE_H
+#define ROUTE_TABLE_H
+
+#include <he.h>
+
+/// Set on entries that point to the node for the next 8 bits of the address
+#define HE_ROUTE_TABLE_CHILD 0x80000000u
+
+/**
+ * @brief Creates an empty route table
+ * @param default_verdict What to do with packets that don't match any route
+ * @return he_route_table_t* Returns a pointer to a route table, or NULL if it could not be
+ *         allocated
+ */
+he_route_table_t *he_route_table_create(he_route_verdict_t default_verdict);
+
+/**
+ * @brief Releases all memory allocated by a route table
+ * @param table A pointer to a route table, can be NULL
+ * @return HE_SUCCESS This function cannot fail
+ * @note The table must not be in use by a connection
+ */
+he_return_code_t he_route_table_destroy(he_route_table_t *table);
+
+/**
+ * @brief Adds a route
+ * @param table A pointer to a valid route table
+ * @param cidr The prefix the route covers, e.g. "192.168.0.0/16"
+ * @param verdict What to do with packets to the prefix
+ * @return HE_SUCCESS The route was added
+ * @return HE_ERR_NULL_POINTER Any of the pointers supplied is NULL
+ * @return HE_ERR_INVALID_ROUTE The prefix is not valid
+ * @return HE_ERR_NO_MEMORY The table could not grow to fit the route
+ *
+ * Routes can be added in any order; the longest one matching an address decides. Adding a route
+ * for a prefix that already has one replaces its verdict.
+ *
+ * @caution Routes must not be added to a table that is in use by a connection
+ */
+he_return_code_t he_route_table_add(he_route_table_t *table, const char *cidr,
+                                    he_route_verdict_t verdict);
+
+/**
+ * @brief Finds the verdict for a destination address
+ * @param table A pointer to a valid route table
+ * @param address The destination address, in network byte order
+ * @return he_route_verdict_t The verdict of the longest matching route, or the table's default
+ */
+he_route_verdict_t he_route_table_lookup(const he_route_table_t *table, uint32_t address);
+
+/**
+ * @brief Sets the route table inside packets are checked against before going through the tunnel
+ * @param conn A pointer to a valid connection
+ * @param table A pointer to a route table, or NULL to send everything through the tunnel
+ * @return he_route_table_t* The table that was in use before, NULL if there wasn't one
+ *
+ * With a table set, he_conn_inside_packet_received() returns HE_ERR_PACKET_BYPASSED for packets
+ * that match a bypass route, without doing anything else with them. The host then sends them
+ * directly.
+ *
+ * The swap is atomic, so this can be called while another thread is sending packets. A packet
+ * already being checked against the old table holds this call up until it is done, so the table
+ * returned can be destroyed straight away.
+ */
+he_route_table_t *he_conn_set_route_table(he_conn_t *conn, he_route_table_t *table);
+
+/**
+ * @brief Returns the route table set on a connection
+ * @param conn A pointer to a valid connection
+ * @return he_route_table_t* The table, NULL if there isn't one
+ * @caution The table is not held, it may be destroyed as soon as another thread replaces it
+ */
+he_route_table_t *he_conn_get_route_table(he_conn_t *conn);
+
+/**
+ * @brief Checks whether an inside packet should bypass the tunnel
+ * @param conn A pointer to a valid connection
+ * @param address The destination address of the packet, in network byte order
+ * @return bool True if the connection has a route table and it sends the address around the
+ *         tunnel
+ * @note The table is held for the duration of the lookup, see he_conn_set_route_table()
+ */
+bool he_internal_route_table_bypass(he_conn_t *conn, uint32_t address);
+
+#endif  // ROUTE_TABLE_H
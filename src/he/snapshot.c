@@ -0,0 +1,155 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "snapshot.h"
+#include "atomic.h"
+#include "conn_export.h"
+
+static he_snapshot_slot_t *he_snapshot_store_slots(he_snapshot_store_t *store) {
+  return (he_snapshot_slot_t *)((uint8_t *)store + sizeof(he_snapshot_store_t));
+}
+
+static uint32_t he_snapshot_store_home(he_snapshot_store_t *store, uint64_t session_id) {
+  // Session IDs are random already, but mixing costs nothing and protects against poor RNGs
+  return (uint32_t)(((session_id * 0x9E3779B97F4A7C15ULL) >> 32) % store->capacity);
+}
+
+size_t he_snapshot_store_size(uint32_t capacity) {
+  return sizeof(he_snapshot_store_t) + (size_t)capacity * sizeof(he_snapshot_slot_t);
+}
+
+he_snapshot_store_t *he_snapshot_store_init(void *region, size_t length, uint32_t capacity) {
+  if(!region || capacity == 0 || ((uintptr_t)region & 7) != 0) {
+    return NULL;
+  }
+
+  if(length < he_snapshot_store_size(capacity)) {
+    return NULL;
+  }
+
+  memset(region, 0, he_snapshot_store_size(capacity));
+
+  he_snapshot_store_t *store = (he_snapshot_store_t *)region;
+  store->magic[0] = 'H';
+  store->magic[1] = 'e';
+  store->magic[2] = 'S';
+  store->magic[3] = 'S';
+  store->version = HE_SNAPSHOT_STORE_VERSION;
+  store->capacity = capacity;
+  store->slot_size = sizeof(he_snapshot_slot_t);
+
+  return store;
+}
+
+he_snapshot_store_t *he_snapshot_store_attach(void *region, size_t length) {
+  if(!region || ((uintptr_t)region & 7) != 0 || length < sizeof(he_snapshot_store_t)) {
+    return NULL;
+  }
+
+  he_snapshot_store_t *store = (he_snapshot_store_t *)region;
+
+  if(memcmp(store->magic, "HeSS", sizeof(store->magic)) != 0 ||
+     store->version != HE_SNAPSHOT_STORE_VERSION ||
+     store->slot_size != sizeof(he_snapshot_slot_t) || store->capacity == 0) {
+    return NULL;
+  }
+
+  if(length < he_snapshot_store_size(store->capacity)) {
+    return NULL;
+  }
+
+  return store;
+}
+
+he_return_code_t he_snapshot_store_save(he_snapshot_store_t *store, he_conn_t *conn) {
+  if(!store || !conn) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  he_snapshot_slot_t *slots = he_snapshot_store_slots(store);
+  uint32_t index = he_snapshot_store_home(store, conn->session_id);
+  he_snapshot_slot_t *slot = NULL;
+
+  // Linear probing, reusing the slot if this session was saved before
+  for(uint32_t probe = 0; probe < store->capacity; probe++) {
+    he_snapshot_slot_t *candidate = &slots[(index + probe) % store->capacity];
+    uint64_t state = he_atomic_load_u64(&candidate->state);
+
+    if(state == HE_SNAPSHOT_SLOT_EMPTY ||
+       (state == HE_SNAPSHOT_SLOT_FULL && candidate->session_id == conn->session_id)) {
+      slot = candidate;
+      break;
+    }
+  }
+
+  if(!slot) {
+    return HE_ERR_NO_MEMORY;
+  }
+
+  size_t length = sizeof(slot->data);
+  he_return_code_t res = he_conn_export(conn, slot->data, &length);
+  if(res != HE_SUCCESS) {
+    return res;
+  }
+
+  slot->session_id = conn->session_id;
+  slot->length = (uint32_t)length;
+
+  // Publish the slot only once its contents are complete
+  he_atomic_store_u64(&slot->state, HE_SNAPSHOT_SLOT_FULL);
+
+  return HE_SUCCESS;
+}
+
+he_return_code_t he_snapshot_store_restore(he_snapshot_store_t *store, uint64_t session_id,
+                                           he_conn_t *conn, he_ssl_ctx_t *ctx,
+                                           he_plugin_chain_t *plugins) {
+  if(!store || !conn || !ctx) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  he_snapshot_slot_t *slots = he_snapshot_store_slots(store);
+  uint32_t index = he_snapshot_store_home(store, session_id);
+
+  for(uint32_t probe = 0; probe < store->capacity; probe++) {
+    he_snapshot_slot_t *slot = &slots[(index + probe) % store->capacity];
+    uint64_t state = he_atomic_load_u64(&slot->state);
+
+    // Taken slots stay in the chain so that later sessions can still be found
+    if(state == HE_SNAPSHOT_SLOT_EMPTY) {
+      break;
+    }
+
+    if(state != HE_SNAPSHOT_SLOT_FULL || slot->session_id != session_id) {
+      continue;
+    }
+
+    // Claim the slot, if another thread beat us to it the session is already being restored
+    if(!he_atomic_cas_u64(&slot->state, &state, HE_SNAPSHOT_SLOT_TAKEN)) {
+      break;
+    }
+
+    if(slot->length > sizeof(slot->data)) {
+      return HE_ERR_BAD_PACKET;
+    }
+
+    return he_conn_import(conn, ctx, plugins, slot->data, slot->length);
+  }
+
+  return HE_ERR_UNKNOWN_SESSION;
+}
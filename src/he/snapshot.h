@@ -0,0 +1,128 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file snapshot.h
+ * @brief Functions for handing connections over to a new server process
+ *
+ * A snapshot store is a hash table of exported connections, keyed by session ID, laid out in a
+ * single block of memory supplied by the host. It contains no pointers, so the block can be a
+ * memory-mapped file or shared memory segment: the old process fills it in before exiting, and the
+ * new process maps it and restores each connection the first time a packet for it arrives. Clients
+ * carry on as if nothing happened instead of all reconnecting at once.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <he.h>
+
+/// Current version of the snapshot store layout
+#define HE_SNAPSHOT_STORE_VERSION 1
+/// Space for one exported connection in the store
+#define HE_SNAPSHOT_SLOT_DATA_SIZE 1000
+
+/// Slot states
+#define HE_SNAPSHOT_SLOT_EMPTY 0
+#define HE_SNAPSHOT_SLOT_FULL 1
+#define HE_SNAPSHOT_SLOT_TAKEN 2
+
+/**
+ * @brief A single exported connection in a snapshot store
+ */
+typedef struct he_snapshot_slot {
+  volatile uint64_t state;
+  uint64_t session_id;
+  uint32_t length;
+  uint32_t reserved;
+  uint8_t data[HE_SNAPSHOT_SLOT_DATA_SIZE];
+} he_snapshot_slot_t;
+
+/**
+ * @brief Returns the amount of memory needed for a snapshot store
+ * @param capacity The number of connections the store should be able to hold
+ * @return size_t The size in bytes of the memory region to give to he_snapshot_store_init()
+ *
+ * The store is an open addressing hash table, so should be sized with some headroom -- a capacity
+ * of 25% more than the number of connections to be saved keeps lookups short.
+ */
+size_t he_snapshot_store_size(uint32_t capacity);
+
+/**
+ * @brief Creates an empty snapshot store in the memory region provided
+ * @param region A pointer to the memory to use, aligned to at least 8 bytes
+ * @param length The size of the region
+ * @param capacity The number of connections the store should be able to hold
+ * @return he_snapshot_store_t* A pointer to the store, or NULL if the region is NULL, misaligned,
+ *         too small for the capacity, or the capacity is zero
+ *
+ * The region is owned by the host, which must keep it mapped for as long as the store is used.
+ * Helium never frees it.
+ */
+he_snapshot_store_t *he_snapshot_store_init(void *region, size_t length, uint32_t capacity);
+
+/**
+ * @brief Opens a snapshot store created by he_snapshot_store_init(), usually by another process
+ * @param region A pointer to the mapped store
+ * @param length The size of the mapping
+ * @return he_snapshot_store_t* A pointer to the store, or NULL if the region doesn't contain a
+ *         store this version of Helium understands
+ */
+he_snapshot_store_t *he_snapshot_store_attach(void *region, size_t length);
+
+/**
+ * @brief Exports a connection into the store
+ * @param store A pointer to a valid snapshot store
+ * @param conn A pointer to an online connection
+ * @return HE_SUCCESS The connection was saved
+ * @return HE_ERR_NULL_POINTER The store or conn pointer supplied is NULL
+ * @return HE_ERR_NO_MEMORY The store is full
+ * @return HE_ERR_PACKET_TOO_LARGE The connection's export doesn't fit in a slot
+ * @return Any error returned by he_conn_export()
+ *
+ * Saving the same session twice replaces the earlier copy. As with he_conn_export(), the host
+ * must not use the connection for anything else once it has been saved.
+ *
+ * @caution Saving is not thread safe, use one thread to save all connections
+ */
+he_return_code_t he_snapshot_store_save(he_snapshot_store_t *store, he_conn_t *conn);
+
+/**
+ * @brief Restores a connection from the store
+ * @param store A pointer to a valid snapshot store
+ * @param session_id The session ID from the wire header of the packet that needs a connection
+ * @param conn A pointer to a newly created connection
+ * @param ctx A pointer to a started SSL context with the same export key as the old process
+ * @param plugins A pointer to the plugin chain for this connection, can be NULL
+ * @return HE_SUCCESS The connection was restored and is online. The host can now pass it the
+ *         packet it was looking up
+ * @return HE_ERR_NULL_POINTER The store, conn or ctx pointer supplied is NULL
+ * @return HE_ERR_UNKNOWN_SESSION The store has no connection for this session, or it has already
+ *         been restored
+ * @return Any error returned by he_conn_import()
+ *
+ * Each saved connection is handed out once. If the import fails the slot is still used up, and
+ * the client falls back to a new handshake as it would have without a snapshot.
+ *
+ * This is safe to call from several threads at once.
+ */
+he_return_code_t he_snapshot_store_restore(he_snapshot_store_t *store, uint64_t session_id,
+                                           he_conn_t *conn, he_ssl_ctx_t *ctx,
+                                           he_plugin_chain_t *plugins);
+
+#endif  // SNAPSHOT_H
@@ -240,6 +240,14 @@ he_return_code_t he_ssl_ctx_start_server(he_ssl_ctx_t *ctx) {
     return HE_ERR_INIT_FAILED;
   }
 
+  // Generate the first stateless cookie secret if cookies are enabled
+  if(ctx->use_stateless_cookies) {
+    if(wc_RNG_GenerateBlock(&ctx->wolf_rng, ctx->cookie_secret, sizeof(ctx->cookie_secret)) != 0) {
+      return HE_ERR_INIT_FAILED;
+    }
+    ctx->has_previous_cookie_secret = false;
+  }
+
   /* // 2020-03-15 Setting this currently causes chacha20 clients to misbehave, commenting out
    * // while the team investigates
    *
@@ -396,6 +404,30 @@ bool he_ssl_ctx_is_inside_write_cb_set(he_ssl_ctx_t *ctx) {
   return ctx->inside_write_cb;
 }
 
+void he_ssl_ctx_set_inside_write_gro_cb(he_ssl_ctx_t *ctx,
+                                        he_inside_write_gro_cb_t inside_write_gro_cb) {
+  ctx->inside_write_gro_cb = inside_write_gro_cb;
+}
+
+bool he_ssl_ctx_is_inside_write_gro_cb_set(he_ssl_ctx_t *ctx) {
+  if(!ctx) {
+    return false;
+  }
+  return ctx->inside_write_gro_cb;
+}
+
+void he_ssl_ctx_set_inside_write_flow_cb(he_ssl_ctx_t *ctx,
+                                         he_inside_write_flow_cb_t inside_write_flow_cb) {
+  ctx->inside_write_flow_cb = inside_write_flow_cb;
+}
+
+bool he_ssl_ctx_is_inside_write_flow_cb_set(he_ssl_ctx_t *ctx) {
+  if(!ctx) {
+    return false;
+  }
+  return ctx->inside_write_flow_cb;
+}
+
 void he_ssl_ctx_set_outside_write_cb(he_ssl_ctx_t *ctx, he_outside_write_cb_t outside_write_cb) {
   ctx->outside_write_cb = outside_write_cb;
 }
@@ -447,6 +479,30 @@ void he_ssl_ctx_set_populate_network_config_ipv4_cb(
   ctx->populate_network_config_ipv4_cb = pop_network_cb;
 }
 
+void he_ssl_ctx_set_handoff_cb(he_ssl_ctx_t *ctx, he_handoff_cb_t handoff_cb) {
+  ctx->handoff_cb = handoff_cb;
+}
+
+bool he_ssl_ctx_is_handoff_cb_set(he_ssl_ctx_t *ctx) {
+  return ctx->handoff_cb != NULL;
+}
+
+void he_ssl_ctx_set_timers(he_ssl_ctx_t *ctx, he_timers_t *timers) {
+  ctx->timers = timers;
+}
+
+bool he_ssl_ctx_is_timers_set(he_ssl_ctx_t *ctx) {
+  return ctx->timers != NULL;
+}
+
+void he_ssl_ctx_set_ip_pool(he_ssl_ctx_t *ctx, he_ip_pool_t *pool) {
+  ctx->ip_pool = pool;
+}
+
+bool he_ssl_ctx_is_ip_pool_set(he_ssl_ctx_t *ctx) {
+  return ctx->ip_pool != NULL;
+}
+
 he_return_code_t he_ssl_ctx_set_disable_roaming(he_ssl_ctx_t *ctx) {
   // Simply set the disable flag
   ctx->disable_roaming_connections = true;
@@ -470,3 +526,124 @@ he_return_code_t he_ssl_ctx_set_aggressive_mode(he_ssl_ctx_t *ctx) {
   ctx->use_aggressive_mode = true;
   return HE_SUCCESS;
 }
+
+he_return_code_t he_ssl_ctx_set_use_stateless_cookies(he_ssl_ctx_t *ctx, bool use) {
+  if(!ctx) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  ctx->use_stateless_cookies = use;
+  return HE_SUCCESS;
+}
+
+bool he_ssl_ctx_get_use_stateless_cookies(he_ssl_ctx_t *ctx) {
+  return ctx->use_stateless_cookies;
+}
+
+he_return_code_t he_ssl_ctx_set_mss_clamping(he_ssl_ctx_t *ctx, bool clamp) {
+  if(!ctx) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  ctx->clamp_mss = clamp;
+  return HE_SUCCESS;
+}
+
+bool he_ssl_ctx_is_mss_clamping_enabled(he_ssl_ctx_t *ctx) {
+  return ctx->clamp_mss;
+}
+
+he_return_code_t he_ssl_ctx_set_source_address_validation(he_ssl_ctx_t *ctx, bool validate) {
+  if(!ctx) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  ctx->validate_source_address = validate;
+  return HE_SUCCESS;
+}
+
+bool he_ssl_ctx_is_source_address_validation_enabled(he_ssl_ctx_t *ctx) {
+  return ctx->validate_source_address;
+}
+
+he_return_code_t he_ssl_ctx_set_outside_buffer_room(he_ssl_ctx_t *ctx, size_t headroom,
+                                                    size_t tailroom) {
+  if(!ctx) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  ctx->outside_headroom = headroom;
+  ctx->outside_tailroom = tailroom;
+  return HE_SUCCESS;
+}
+
+he_return_code_t he_ssl_ctx_set_inner_mtu(he_ssl_ctx_t *ctx, int mtu) {
+  if(!ctx) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  // Anything that fits in a single message doesn't need a jumbo MTU
+  if(mtu != 0 && (mtu <= HE_MAX_PMTU || mtu > HE_MAX_JUMBO_MTU)) {
+    return HE_ERR_INVALID_MTU_SIZE;
+  }
+
+  ctx->inner_mtu = mtu;
+  return HE_SUCCESS;
+}
+
+int he_ssl_ctx_get_inner_mtu(he_ssl_ctx_t *ctx) {
+  return ctx->inner_mtu;
+}
+
+he_return_code_t he_ssl_ctx_rotate_cookie_secret(he_ssl_ctx_t *ctx) {
+  if(!ctx) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  if(!ctx->use_stateless_cookies) {
+    return HE_ERR_FAILED;
+  }
+
+  // Cookies handed out under the current secret stay valid until the next rotation
+  memcpy(ctx->previous_cookie_secret, ctx->cookie_secret, sizeof(ctx->cookie_secret));
+  ctx->has_previous_cookie_secret = true;
+
+  if(wc_RNG_GenerateBlock(&ctx->wolf_rng, ctx->cookie_secret, sizeof(ctx->cookie_secret)) != 0) {
+    return HE_ERR_RNG_FAILURE;
+  }
+
+  return HE_SUCCESS;
+}
+
+he_return_code_t he_ssl_ctx_set_export_key(he_ssl_ctx_t *ctx, const uint8_t *key, size_t length) {
+  if(!ctx || !key) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  if(length != HE_EXPORT_KEY_LENGTH) {
+    return HE_ERR_FAILED;
+  }
+
+  memcpy(ctx->export_key, key, HE_EXPORT_KEY_LENGTH);
+  ctx->has_export_key = true;
+
+  return HE_SUCCESS;
+}
+
+bool he_ssl_ctx_is_export_key_set(he_ssl_ctx_t *ctx) {
+  return ctx->has_export_key;
+}
+
+he_return_code_t he_ssl_ctx_set_hibernate_idle_time(he_ssl_ctx_t *ctx, uint32_t idle_ms) {
+  if(!ctx) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  ctx->hibernate_idle_ms = idle_ms;
+
+  return HE_SUCCESS;
+}
+
+uint32_t he_ssl_ctx_get_hibernate_idle_time(he_ssl_ctx_t *ctx) {
+  return ctx->hibernate_idle_ms;
+}
@@ -301,6 +301,50 @@ void he_ssl_ctx_set_inside_write_cb(he_ssl_ctx_t *ctx, he_inside_write_cb_t insi
  */
 bool he_ssl_ctx_is_inside_write_cb_set(he_ssl_ctx_t *ctx);
 
+/**
+ * @brief Sets the function that will be called for inside writes to a TUN device that takes a
+ *        virtio-net header with every packet.
+ * @param ctx A pointer to a valid SSL context
+ * @param inside_write_gro_cb The function to be called instead of the inside write callback
+ *
+ * When set, consecutive in-order segments of a TCP flow that are decrypted together are merged
+ * into a single super-packet (GRO), and every packet is passed along with the virtio-net header
+ * that describes it and its flow. On Linux this suits a tun device opened with IFF_VNET_HDR.
+ * Segments are
+ * merged across the records of one call to he_conn_outside_data_received(), or across all the
+ * datagrams given to he_conn_outside_data_received_batch().
+ */
+void he_ssl_ctx_set_inside_write_gro_cb(he_ssl_ctx_t *ctx,
+                                        he_inside_write_gro_cb_t inside_write_gro_cb);
+
+/**
+ * @brief Check if the inside write GRO callback has been set.
+ * @param ctx A pointer to a valid SSL context
+ * @return bool Returns true or false depending on whether it has been set
+ */
+bool he_ssl_ctx_is_inside_write_gro_cb_set(he_ssl_ctx_t *ctx);
+
+/**
+ * @brief Sets the function that will be called for inside writes along with the packet's flow.
+ * @param ctx A pointer to a valid SSL context
+ * @param inside_write_flow_cb The function to be called instead of the inside write callback
+ *
+ * Helium works out the 5-tuple and flow hash of each packet once it has been validated, so hosts
+ * spreading packets over the queues of a multiqueue tun device or over several workers needn't
+ * parse them again. he_flow_classify() gives the same result for outgoing packets. The inside
+ * write GRO callback takes precedence if both are set, and is given the flow of every packet
+ * itself.
+ */
+void he_ssl_ctx_set_inside_write_flow_cb(he_ssl_ctx_t *ctx,
+                                         he_inside_write_flow_cb_t inside_write_flow_cb);
+
+/**
+ * @brief Check if the inside write flow callback has been set.
+ * @param ctx A pointer to a valid SSL context
+ * @return bool Returns true or false depending on whether it has been set
+ */
+bool he_ssl_ctx_is_inside_write_flow_cb_set(he_ssl_ctx_t *ctx);
+
 /**
  * @brief Sets the function that will be called when Helium needs to do an outside write.
  * @param ctx A pointer to a valid SSL context
@@ -393,6 +437,77 @@ bool he_ssl_ctx_is_auth_cb_set(he_ssl_ctx_t *ctx);
 void he_ssl_ctx_set_populate_network_config_ipv4_cb(
     he_ssl_ctx_t *ctx, he_populate_network_config_ipv4_cb_t pop_network_cb);
 
+/**
+ * @brief Sets the function that will be called when a server connection is ready to be moved to a
+ * data plane thread
+ * @param ctx A pointer to a valid SSL context
+ * @param handoff_cb The function to be called once a connection has gone online
+ *
+ * This supports servers that run handshakes on a dedicated pool of threads and forwarding data on
+ * another. A connection belongs to whichever thread is currently calling into it; the host moves
+ * it between threads by passing the he_conn_t pointer, so no D/TLS state or key material is copied.
+ *
+ * The callback is made at the end of he_conn_outside_data_received(), after the connection has
+ * reached HE_STATE_ONLINE and Helium has finished with it on the calling thread. The host must
+ * not call into the connection from the handshake thread after the callback returns.
+ *
+ * @caution he_conn_server_connect() and he_conn_rotate_session_id() draw from the context's random
+ * number generator and must not run on several threads at the same time. Hosts with a handshake
+ * pool should create connections from a single thread and dispatch them to the pool.
+ * he_conn_export() and he_conn_hibernate() seed a generator of their own on every call, so data
+ * plane threads may export and hibernate the connections they own. WolfSSL must be built without
+ * --enable-singlethreaded (SINGLE_THREADED), as it is by every platform build in this repository.
+ */
+void he_ssl_ctx_set_handoff_cb(he_ssl_ctx_t *ctx, he_handoff_cb_t handoff_cb);
+
+/**
+ * @brief Check if the handoff callback has been set.
+ * @param ctx A pointer to a valid SSL context
+ * @return bool Returns true or false depending on whether it has been set
+ */
+bool he_ssl_ctx_is_handoff_cb_set(he_ssl_ctx_t *ctx);
+
+/**
+ * @brief Sets a timer wheel for connections to schedule their nudges on
+ * @param ctx A pointer to a valid SSL context
+ * @param timers A pointer to a timer wheel created with he_timers_create(), or NULL to go back to
+ *        the nudge time callback
+ *
+ * Connections created after this call use the wheel instead of the nudge time callback. The host
+ * then drives all of them with he_timers_advance() and he_timers_next_deadline().
+ *
+ * @see he_conn_set_timers()
+ */
+void he_ssl_ctx_set_timers(he_ssl_ctx_t *ctx, he_timers_t *timers);
+
+/**
+ * @brief Check if a timer wheel has been set.
+ * @param ctx A pointer to a valid SSL context
+ * @return bool Returns true or false depending on whether it has been set
+ */
+bool he_ssl_ctx_is_timers_set(he_ssl_ctx_t *ctx);
+
+/**
+ * @brief Sets an address pool to give clients their tunnel addresses from (server only)
+ * @param ctx A pointer to a valid SSL context
+ * @param pool A pointer to an address pool created with he_ip_pool_create(), or NULL to leave it
+ *        to the populate network config callback
+ *
+ * Clients of connections created after this call get an address from the pool when they
+ * authenticate. The populate network config callback becomes optional: if it is set, it is called
+ * with the local, peer and DNS IPs already filled in and can change anything it likes.
+ *
+ * @see he_ip_pool_create()
+ */
+void he_ssl_ctx_set_ip_pool(he_ssl_ctx_t *ctx, he_ip_pool_t *pool);
+
+/**
+ * @brief Check if an address pool has been set.
+ * @param ctx A pointer to a valid SSL context
+ * @return bool Returns true or false depending on whether it has been set
+ */
+bool he_ssl_ctx_is_ip_pool_set(he_ssl_ctx_t *ctx);
+
 /**
  * @brief Disables session roaming and removes the session ID from the packet header
  * @return HE_SUCCESS
@@ -437,4 +552,178 @@ he_padding_type_t he_ssl_ctx_get_padding_type(he_ssl_ctx_t *ctx);
  */
 he_return_code_t he_ssl_ctx_set_aggressive_mode(he_ssl_ctx_t *ctx);
 
+/**
+ * @brief Enables or disables stateless cookies for new D/TLS connections
+ * @param ctx A pointer to a valid SSL context
+ * @param use Whether new connections must present a valid cookie before a connection is created
+ * @return HE_SUCCESS The setting was applied
+ * @return HE_ERR_NULL_POINTER The ctx pointer supplied is NULL
+ *
+ * When enabled, the host should pass every datagram that does not belong to a known session to
+ * he_ssl_ctx_verify_client_hello() before creating a connection for it. Only peers that can
+ * receive traffic at their claimed address get past the cookie exchange, so spoofed ClientHellos
+ * never cost a connection allocation or any asymmetric crypto.
+ *
+ * @note This must be set before calling he_ssl_ctx_start_server()
+ * @see he_ssl_ctx_verify_client_hello()
+ */
+he_return_code_t he_ssl_ctx_set_use_stateless_cookies(he_ssl_ctx_t *ctx, bool use);
+
+/**
+ * @brief Returns whether stateless cookies are enabled
+ * @param ctx A pointer to a valid SSL context
+ * @return bool Whether stateless cookies are enabled
+ */
+bool he_ssl_ctx_get_use_stateless_cookies(he_ssl_ctx_t *ctx);
+
+/**
+ * @brief Enables or disables MSS clamping for new connections
+ * @param ctx A pointer to a valid SSL context
+ * @param clamp Whether to clamp the MSS of TCP connections carried by the tunnel
+ * @return HE_SUCCESS The setting was applied
+ * @return HE_ERR_NULL_POINTER The ctx pointer supplied is NULL
+ *
+ * TCP stacks pick an MSS to suit the MTU of the interface they see, which is larger than the
+ * tunnel's, so full sized segments end up fragmented or dropped. With clamping enabled the MSS
+ * option of TCP SYNs going through the tunnel, in either direction, is lowered to fit
+ * he_conn_get_effective_mtu(). This saves users having to configure it on their devices.
+ *
+ * @note This must be set before connections are created
+ */
+he_return_code_t he_ssl_ctx_set_mss_clamping(he_ssl_ctx_t *ctx, bool clamp);
+
+/**
+ * @brief Returns whether MSS clamping is enabled
+ * @param ctx A pointer to a valid SSL context
+ * @return bool Whether MSS clamping is enabled
+ */
+bool he_ssl_ctx_is_mss_clamping_enabled(he_ssl_ctx_t *ctx);
+
+/**
+ * @brief Enables or disables source address validation for new connections
+ * @param ctx A pointer to a valid SSL context
+ * @param validate Whether to drop packets from clients that don't come from their own address
+ * @return HE_SUCCESS The setting was applied
+ * @return HE_ERR_NULL_POINTER The ctx pointer supplied is NULL
+ *
+ * Servers remember the local IP the populate network config callback gives each client. With
+ * validation enabled, packets a client sends through the tunnel from any other source address are
+ * dropped and counted as HE_INSIDE_DROP_SPOOFED_SOURCE, so one client can't pass its traffic off
+ * as another's. Clients ignore this setting.
+ *
+ * @note This must be set before connections are created
+ */
+he_return_code_t he_ssl_ctx_set_source_address_validation(he_ssl_ctx_t *ctx, bool validate);
+
+/**
+ * @brief Returns whether source address validation is enabled
+ * @param ctx A pointer to a valid SSL context
+ * @return bool Whether source address validation is enabled
+ */
+bool he_ssl_ctx_is_source_address_validation_enabled(he_ssl_ctx_t *ctx);
+
+/**
+ * @brief Tells Helium how much room there is around the buffers passed to
+ *        he_conn_outside_data_received()
+ * @param ctx A pointer to a valid SSL context
+ * @param headroom Bytes that can be written to in front of every buffer
+ * @param tailroom Bytes that can be written to after the end of every buffer
+ * @return HE_SUCCESS The setting was applied
+ * @return HE_ERR_NULL_POINTER The ctx pointer supplied is NULL
+ *
+ * Ingress plugins are given this room, so ones that wrap or pad packets can do it in place
+ * instead of copying into their own buffers. By default there is none.
+ *
+ * @note This must be set before connections are created
+ */
+he_return_code_t he_ssl_ctx_set_outside_buffer_room(he_ssl_ctx_t *ctx, size_t headroom,
+                                                    size_t tailroom);
+
+/**
+ * @brief Enables a jumbo inner MTU for new connections
+ * @param ctx A pointer to a valid SSL context
+ * @param mtu The largest inner packet to carry, up to HE_MAX_JUMBO_MTU, or 0 to disable
+ * @return HE_SUCCESS The setting was applied
+ * @return HE_ERR_NULL_POINTER The ctx pointer supplied is NULL
+ * @return HE_ERR_INVALID_MTU_SIZE The MTU isn't 0 and is either too large or small enough to
+ *         not need a jumbo MTU
+ *
+ * A large TUN MTU means far fewer packets, and so fewer system calls, record encryptions and
+ * plugin calls, for bulk transfers. Packets larger than what fits on the path are split across
+ * several records and put back together by the peer.
+ *
+ * Clients offer this MTU when they authenticate and servers agree to the smaller of theirs and
+ * the client's. The agreed MTU is what the client is given in its network config, and
+ * he_conn_get_inner_mtu() returns it on both sides. If either side doesn't support or enable it,
+ * the connection carries on with an ordinary MTU.
+ *
+ * @note This must be set before connections are created
+ */
+he_return_code_t he_ssl_ctx_set_inner_mtu(he_ssl_ctx_t *ctx, int mtu);
+
+/**
+ * @brief Returns the jumbo inner MTU new connections will offer
+ * @param ctx A pointer to a valid SSL context
+ * @return int The MTU, or 0 if jumbo MTUs are disabled
+ */
+int he_ssl_ctx_get_inner_mtu(he_ssl_ctx_t *ctx);
+
+/**
+ * @brief Generates a fresh stateless cookie secret
+ * @param ctx A pointer to a valid SSL context
+ * @return HE_SUCCESS The secret was rotated
+ * @return HE_ERR_NULL_POINTER The ctx pointer supplied is NULL
+ * @return HE_ERR_FAILED Stateless cookies are not enabled on this context
+ * @return HE_ERR_RNG_FAILURE A new secret could not be generated
+ *
+ * Cookies generated with the previous secret continue to be accepted until the next rotation, so
+ * clients in the middle of the cookie exchange are not affected. Hosts should call this
+ * periodically (e.g. every few minutes).
+ *
+ * @caution This is not thread safe with respect to he_ssl_ctx_verify_client_hello()
+ */
+he_return_code_t he_ssl_ctx_rotate_cookie_secret(he_ssl_ctx_t *ctx);
+
+/**
+ * @brief Sets the key used to seal and open connection exports
+ * @param ctx A pointer to a valid SSL context
+ * @param key A pointer to the key
+ * @param length The length of the key, must be HE_EXPORT_KEY_LENGTH
+ * @return HE_SUCCESS The key was set
+ * @return HE_ERR_NULL_POINTER The ctx or key pointer supplied is NULL
+ * @return HE_ERR_FAILED The key is not HE_EXPORT_KEY_LENGTH bytes long
+ *
+ * Every process that imports a connection must be configured with the same key as the process that
+ * exported it. Helium keeps a copy, so the caller can wipe its own.
+ *
+ * @note Connections pick the key up when they are created, so this must be set before any
+ *       connections that are to be exported are created
+ * @see he_conn_export()
+ */
+he_return_code_t he_ssl_ctx_set_export_key(he_ssl_ctx_t *ctx, const uint8_t *key, size_t length);
+
+/**
+ * @brief Returns whether an export key has been set
+ * @param ctx A pointer to a valid SSL context
+ * @return bool Whether an export key has been set
+ */
+bool he_ssl_ctx_is_export_key_set(he_ssl_ctx_t *ctx);
+
+/**
+ * @brief Sets how long connections must be idle before he_conn_hibernate_if_idle() hibernates them
+ * @param ctx A pointer to a valid SSL context
+ * @param idle_ms The idle time in milliseconds, or 0 to never hibernate idle connections (the
+ *        default)
+ * @return HE_SUCCESS The idle time was set
+ * @return HE_ERR_NULL_POINTER The ctx pointer supplied is NULL
+ */
+he_return_code_t he_ssl_ctx_set_hibernate_idle_time(he_ssl_ctx_t *ctx, uint32_t idle_ms);
+
+/**
+ * @brief Returns the idle time set with he_ssl_ctx_set_hibernate_idle_time()
+ * @param ctx A pointer to a valid SSL context
+ * @return uint32_t The idle time in milliseconds, 0 if idle connections are never hibernated
+ */
+uint32_t he_ssl_ctx_get_hibernate_idle_time(he_ssl_ctx_t *ctx);
+
 #endif  // SSL_CTX_H
@@ -0,0 +1,246 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "timers.h"
+#include "clock.h"
+#include "conn.h"
+
+#include <stddef.h>
+
+#include "memory.h"
+
+#define HE_TIMERS_SLOT_MASK ((uint64_t)HE_TIMERS_SLOTS - 1)
+// Furthest into the future a timer can be placed, longer ones are re-placed as the wheel turns
+#define HE_TIMERS_RANGE ((uint64_t)1 << (HE_TIMERS_SLOT_BITS * HE_TIMERS_LEVELS))
+
+static void he_timers_list_init(he_timer_node_t *head) {
+  head->next = head;
+  head->prev = head;
+}
+
+static bool he_timers_list_empty(he_timer_node_t *head) {
+  return head->next == head;
+}
+
+static void he_timers_list_add(he_timer_node_t *head, he_timer_node_t *node) {
+  node->prev = head->prev;
+  node->next = head;
+  head->prev->next = node;
+  head->prev = node;
+}
+
+static void he_timers_list_del(he_timer_node_t *node) {
+  node->prev->next = node->next;
+  node->next->prev = node->prev;
+  node->next = NULL;
+  node->prev = NULL;
+}
+
+// Moves everything in one list to another (empty) one
+static void he_timers_list_move(he_timer_node_t *from, he_timer_node_t *to) {
+  if(he_timers_list_empty(from)) {
+    he_timers_list_init(to);
+    return;
+  }
+
+  to->next = from->next;
+  to->prev = from->prev;
+  to->next->prev = to;
+  to->prev->next = to;
+  he_timers_list_init(from);
+}
+
+static void he_timers_place(he_timers_t *timers, he_timer_node_t *node) {
+  // Anything already due goes in the very next slot to be processed
+  uint64_t deadline = node->deadline < timers->now ? timers->now : node->deadline;
+  uint64_t delta = deadline - timers->now;
+
+  if(delta >= HE_TIMERS_RANGE) {
+    deadline = timers->now + HE_TIMERS_RANGE - 1;
+    delta = HE_TIMERS_RANGE - 1;
+  }
+
+  // Each level covers 64 times the span of the one below it
+  int level = 0;
+  while(level < HE_TIMERS_LEVELS - 1 &&
+        delta >= ((uint64_t)1 << (HE_TIMERS_SLOT_BITS * (level + 1)))) {
+    level++;
+  }
+
+  uint64_t slot = (deadline >> (HE_TIMERS_SLOT_BITS * level)) & HE_TIMERS_SLOT_MASK;
+  he_timers_list_add(&timers->slots[level][slot], node);
+}
+
+// Re-places every timer in a slot of a higher level now that it is close enough to be more precise
+static void he_timers_cascade(he_timers_t *timers, int level, uint64_t slot) {
+  he_timer_node_t work;
+  he_timers_list_move(&timers->slots[level][slot], &work);
+
+  while(!he_timers_list_empty(&work)) {
+    he_timer_node_t *node = work.next;
+    he_timers_list_del(node);
+    he_timers_place(timers, node);
+  }
+}
+
+he_timers_t *he_timers_create(uint64_t now_ms) {
+  he_timers_t *timers = he_internal_calloc(1, sizeof(he_timers_t));
+  if(!timers) {
+    return NULL;
+  }
+
+  for(int level = 0; level < HE_TIMERS_LEVELS; level++) {
+    for(int slot = 0; slot < HE_TIMERS_SLOTS; slot++) {
+      he_timers_list_init(&timers->slots[level][slot]);
+    }
+  }
+
+  timers->now = now_ms + 1;
+  timers->clock_offset = now_ms - he_internal_clock_ms();
+
+  return timers;
+}
+
+he_return_code_t he_timers_destroy(he_timers_t *timers) {
+  if(timers) {
+    // Leave any connections still on the wheel with an unlinked node rather than a dangling one
+    for(int level = 0; level < HE_TIMERS_LEVELS; level++) {
+      for(int slot = 0; slot < HE_TIMERS_SLOTS; slot++) {
+        he_timer_node_t *head = &timers->slots[level][slot];
+        while(!he_timers_list_empty(head)) {
+          he_timers_list_del(head->next);
+        }
+      }
+    }
+    he_internal_free(timers);
+  }
+  return HE_SUCCESS;
+}
+
+void he_internal_timers_schedule(he_timers_t *timers, he_timer_node_t *node, int delay_ms) {
+  if(node->next) {
+    he_internal_timers_cancel(timers, node);
+  }
+
+  // The host stops advancing the wheel while nothing is due, so the last tick processed can be long
+  // gone. Work out the host's time from our own clock instead, but never go back past that tick.
+  uint64_t now = he_internal_clock_ms() + timers->clock_offset;
+  if(now < timers->now - 1) {
+    now = timers->now - 1;
+  } else if(timers->pending == 0) {
+    // Just as he_timers_advance() would have, had the host called it
+    timers->now = now + 1;
+  }
+  node->deadline = now + (delay_ms > 0 ? (uint64_t)delay_ms : 0);
+  he_timers_place(timers, node);
+  timers->pending++;
+}
+
+void he_internal_timers_cancel(he_timers_t *timers, he_timer_node_t *node) {
+  if(!node->next) {
+    return;
+  }
+
+  he_timers_list_del(node);
+  timers->pending--;
+}
+
+he_return_code_t he_timers_advance(he_timers_t *timers, uint64_t now_ms) {
+  if(!timers) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  timers->clock_offset = now_ms - he_internal_clock_ms();
+
+  while(timers->now <= now_ms) {
+    // Nothing to do for the ticks in between, skip straight to the end
+    if(timers->pending == 0) {
+      timers->now = now_ms + 1;
+      break;
+    }
+
+    uint64_t slot = timers->now & HE_TIMERS_SLOT_MASK;
+
+    // Each time a level wraps, the next slot of the level above it is pulled down
+    if(slot == 0) {
+      for(int level = 1; level < HE_TIMERS_LEVELS; level++) {
+        uint64_t upper = (timers->now >> (HE_TIMERS_SLOT_BITS * level)) & HE_TIMERS_SLOT_MASK;
+        he_timers_cascade(timers, level, upper);
+        if(upper != 0) {
+          break;
+        }
+      }
+    }
+
+    timers->now++;
+
+    he_timer_node_t expired;
+    he_timers_list_move(&timers->slots[0][slot], &expired);
+
+    // Take one at a time: a nudge can reschedule its own timer or destroy other connections
+    while(!he_timers_list_empty(&expired)) {
+      he_timer_node_t *node = expired.next;
+      he_timers_list_del(node);
+      timers->pending--;
+
+      he_conn_t *conn = (he_conn_t *)((uint8_t *)node - offsetof(he_conn_t, timer_node));
+      he_conn_nudge(conn);
+    }
+  }
+
+  return HE_SUCCESS;
+}
+
+uint64_t he_timers_next_deadline(he_timers_t *timers) {
+  if(!timers || timers->pending == 0) {
+    return HE_TIMERS_NO_DEADLINE;
+  }
+
+  uint64_t next = HE_TIMERS_NO_DEADLINE;
+
+  // Only the slots are looked at, never the timers in them. A slot on the bottom level is processed
+  // at the tick its timers expire; a slot on a higher level has to be cascaded down when the wheel
+  // reaches its first tick, even if its timers expire later. Slots within a level are in time order
+  // starting from the current one, so the first non-empty slot is that level's earliest. The
+  // current slot of a higher level is the exception: once past its first tick it can only hold
+  // timers a whole turn of the wheel away, so look one slot further too.
+  for(int level = 0; level < HE_TIMERS_LEVELS; level++) {
+    int shift = HE_TIMERS_SLOT_BITS * level;
+    uint64_t base = timers->now >> shift;
+
+    for(uint64_t i = 0; i < HE_TIMERS_SLOTS; i++) {
+      if(he_timers_list_empty(&timers->slots[level][(base + i) & HE_TIMERS_SLOT_MASK])) {
+        continue;
+      }
+
+      uint64_t when = (base + i) << shift;
+      if(when < timers->now) {
+        when += (uint64_t)HE_TIMERS_SLOTS << shift;
+      }
+      if(when < next) {
+        next = when;
+      }
+
+      if(level == 0 || i > 0) {
+        break;
+      }
+    }
+  }
+
+  return next;
+}
@@ -0,0 +1,103 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file timers.h
+ * @brief Functions for managing nudge timers for many connections at once
+ *
+ * Normally each connection asks the host for its own timer through the nudge time callback. A
+ * server with many connections handshaking at once ends up with as many timers in its event loop.
+ * Instead, a timer wheel can be set on the SSL context: connections schedule their nudges on the
+ * wheel, and the host only needs a single timer that calls he_timers_advance().
+ *
+ * Scheduling and cancelling a timer are O(1). Timers have a resolution of one millisecond.
+ *
+ * Hosts only need to call he_timers_advance() when he_timers_next_deadline() says so, and can
+ * leave an empty wheel alone for as long as they like. Timers scheduled in the meantime are still
+ * measured from the time they were scheduled: the wheel keeps track of how the host's clock
+ * relates to Helium's own monotonic clock.
+ */
+
+#ifndef TIMERS_H
+#define TIMERS_H
+
+#include <he.h>
+
+/**
+ * @brief Creates a timer wheel
+ * @param now_ms The current time in milliseconds, from any monotonic clock the host likes
+ * @return he_timers_t* Returns a pointer to a timer wheel, or NULL if it could not be allocated
+ * @note The same clock must be used for every call to he_timers_advance(), and it must count
+ *       real milliseconds
+ */
+he_timers_t *he_timers_create(uint64_t now_ms);
+
+/**
+ * @brief Releases all memory allocated by a timer wheel
+ * @param timers A pointer to a timer wheel, can be NULL
+ * @return HE_SUCCESS This function cannot fail
+ * @note Connections using the wheel must be destroyed, or moved to another wheel, first
+ */
+he_return_code_t he_timers_destroy(he_timers_t *timers);
+
+/**
+ * @brief Nudges every connection whose timer has expired
+ * @param timers A pointer to a valid timer wheel
+ * @param now_ms The current time in milliseconds
+ * @return HE_SUCCESS The wheel was advanced
+ * @return HE_ERR_NULL_POINTER The timers pointer supplied is NULL
+ *
+ * Each expired connection has he_conn_nudge() called on it. A connection that times out changes to
+ * HE_STATE_DISCONNECTED, which the host sees through the state change callback as usual. The host
+ * may destroy connections from within its callbacks.
+ *
+ * @caution A timer wheel is not thread safe. Hosts that run connections on several threads should
+ *          give each thread its own wheel, see he_conn_set_timers()
+ */
+he_return_code_t he_timers_advance(he_timers_t *timers, uint64_t now_ms);
+
+/**
+ * @brief Returns when he_timers_advance() next needs to be called
+ * @param timers A pointer to a valid timer wheel
+ * @return uint64_t The time in milliseconds at which the wheel next has work to do, or
+ *         HE_TIMERS_NO_DEADLINE if there are no timers pending (or the pointer is NULL)
+ *
+ * This is intended for setting the timeout of the host's event loop. Usually it's when the next
+ * timer expires; timers far in the future are sorted lazily, so it can also be when some of them
+ * need moving closer, which costs the host an early wake-up now and then. It looks at no more
+ * than HE_TIMERS_LEVELS * HE_TIMERS_SLOTS slots however many timers there are, and never at the
+ * timers themselves -- call it once per loop iteration, not once per packet.
+ */
+uint64_t he_timers_next_deadline(he_timers_t *timers);
+
+/**
+ * @brief Schedules a timer
+ * @param timers A pointer to a valid timer wheel
+ * @param node A pointer to a timer that isn't scheduled yet
+ * @param delay_ms How long from now until the timer expires
+ */
+void he_internal_timers_schedule(he_timers_t *timers, he_timer_node_t *node, int delay_ms);
+
+/**
+ * @brief Cancels a timer if it is scheduled
+ * @param timers A pointer to the timer wheel the timer was scheduled on
+ * @param node A pointer to the timer
+ */
+void he_internal_timers_cancel(he_timers_t *timers, he_timer_node_t *node);
+
+#endif  // TIMERS_H
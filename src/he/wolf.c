@@ -19,6 +19,9 @@
 #include <he.h>
 
 #include "wolf.h"
+#include "clock.h"
+#include "core.h"
+#include "metrics.h"
 #include "plugin_chain.h"
 
 int he_wolf_dtls_read(WOLFSSL *ssl, char *buf, int sz, void *ctx) {
@@ -58,6 +61,16 @@ int he_wolf_dtls_read(WOLFSSL *ssl, char *buf, int sz, void *ctx) {
   return (int)conn->incoming_data_length;
 }
 
+static he_return_code_t he_wolf_write_outside(he_conn_t *conn, uint8_t *data, size_t length) {
+  he_return_code_t res = conn->outside_write_cb(conn, data, length, conn->data);
+  if(res == HE_SUCCESS) {
+    conn->counters.outside_tx_packets++;
+    conn->counters.outside_tx_bytes += length;
+    he_internal_metrics_add_traffic(conn->metrics, HE_METRIC_OUTSIDE_TX_PACKETS, 1, length);
+  }
+  return res;
+}
+
 int he_internal_write_packet_header(he_conn_t *conn, he_wire_hdr_t *hdr) {
   if(!hdr || !conn) {
     return HE_ERR_NULL_POINTER;
@@ -103,36 +116,46 @@ int he_wolf_dtls_write(WOLFSSL *ssl, char *buf, int sz, void *ctx) {
 
   // Check we have enough space
   // @TODO: Take MTU settings into account
-  if(sz + sizeof(he_wire_hdr_t) > sizeof(conn->write_buffer)) {
+  if(sz + sizeof(he_wire_hdr_t) > HE_MAX_WIRE_MTU) {
     // We have to drop the packet as we can never send it (in theory this should never happen
     // due to earlier constraints)
     return WOLFSSL_CBIO_ERR_GENERAL;
   }
 
+  // The packet goes after the headroom so plugins can add to its front in place
+  uint8_t *packet = &conn->write_buffer[HE_PLUGIN_HEADROOM];
+
   // Initialise the write buffer
-  he_internal_write_packet_header(conn, (he_wire_hdr_t *)conn->write_buffer);
+  he_internal_write_packet_header(conn, (he_wire_hdr_t *)packet);
 
   // Copy in the data behind the header
-  // TODO Actively investigating why the analyzer thinks that client->write_buffer is not the same
-  // as &client->write_buffer[0]
-  memcpy((&conn->write_buffer[0]) + sizeof(he_wire_hdr_t), buf, sz);
+  memcpy(packet + sizeof(he_wire_hdr_t), buf, sz);
 
   // Note that the parallel call to ingress is in client.c:he_internal_outside_data_received
-  size_t post_plugin_length = sz + sizeof(he_wire_hdr_t);
-  he_return_code_t res = he_plugin_egress(conn->plugins, &conn->write_buffer[0],
-                                          &post_plugin_length, sizeof(conn->write_buffer));
+  size_t length = sz + sizeof(he_wire_hdr_t);
+  he_plugin_packet_t post_plugin = {packet, length, HE_PLUGIN_HEADROOM,
+                                    sizeof(conn->write_buffer) - HE_PLUGIN_HEADROOM - length,
+                                    conn->plugin_state};
+  he_return_code_t res = he_plugin_egress_packet(conn->plugins, &post_plugin);
 
   if(res == HE_ERR_PLUGIN_DROP) {
     // Plugin said to drop it, we drop it
     // Parallel to returning HE_SUCCESS on ingress
+    he_internal_count_drop(conn, res);
     return sz;
   } else if(res != HE_SUCCESS) {
     return WOLFSSL_CBIO_ERR_GENERAL;
   }
 
+  // Note when each handshake flight goes out so its reply can be timed
+  if(!conn->flight_sent_ms &&
+     (conn->state != HE_STATE_ONLINE || conn->renegotiation_in_progress)) {
+    conn->flight_sent_ms = he_internal_clock_ms();
+  }
+
   // Call the write callback if set
   if(conn->outside_write_cb) {
-    res = conn->outside_write_cb(conn, conn->write_buffer, post_plugin_length, conn->data);
+    res = he_wolf_write_outside(conn, post_plugin.data, post_plugin.length);
     if(res != HE_SUCCESS) {
       return WOLFSSL_CBIO_ERR_GENERAL;
     }
@@ -140,12 +163,12 @@ int he_wolf_dtls_write(WOLFSSL *ssl, char *buf, int sz, void *ctx) {
     // If we're not yet connected, be aggressive and send two more packets. If aggressive mode
     // is set, always be aggressive and send two more.
     if(conn->state != HE_STATE_ONLINE || conn->use_aggressive_mode) {
-      conn->outside_write_cb(conn, conn->write_buffer, post_plugin_length, conn->data);
+      he_wolf_write_outside(conn, post_plugin.data, post_plugin.length);
       if(res != HE_SUCCESS) {
         return WOLFSSL_CBIO_ERR_GENERAL;
       }
 
-      conn->outside_write_cb(conn, conn->write_buffer, post_plugin_length, conn->data);
+      he_wolf_write_outside(conn, post_plugin.data, post_plugin.length);
       if(res != HE_SUCCESS) {
         return WOLFSSL_CBIO_ERR_GENERAL;
       }
@@ -210,23 +233,27 @@ int he_wolf_tls_write(WOLFSSL *ssl, char *buf, int sz, void *ctx) {
   size_t number_of_bytes_to_copy = 0;
 
   // Figure out how much to copy
-  if(sz < sizeof(conn->write_buffer)) {
+  if(sz < HE_MAX_WIRE_MTU) {
     number_of_bytes_to_copy = sz;
   } else {
-    number_of_bytes_to_copy = sizeof(conn->write_buffer);
+    number_of_bytes_to_copy = HE_MAX_WIRE_MTU;
   }
 
-  // Copy in the data
-  memcpy((&conn->write_buffer[0]), buf, number_of_bytes_to_copy);
+  // Copy in the data, leaving room in front for plugins
+  uint8_t *packet = &conn->write_buffer[HE_PLUGIN_HEADROOM];
+  memcpy(packet, buf, number_of_bytes_to_copy);
 
   // Note that the parallel call to ingress is in client.c:he_internal_outside_data_received
-  size_t post_plugin_length = number_of_bytes_to_copy;
-  he_return_code_t res = he_plugin_egress(conn->plugins, &conn->write_buffer[0],
-                                          &post_plugin_length, sizeof(conn->write_buffer));
+  he_plugin_packet_t post_plugin = {
+      packet, number_of_bytes_to_copy, HE_PLUGIN_HEADROOM,
+      sizeof(conn->write_buffer) - HE_PLUGIN_HEADROOM - number_of_bytes_to_copy,
+      conn->plugin_state};
+  he_return_code_t res = he_plugin_egress_packet(conn->plugins, &post_plugin);
 
   if(res == HE_ERR_PLUGIN_DROP) {
     // Plugin said to drop it, we drop it
     // Parallel to returning HE_SUCCESS on ingress
+    he_internal_count_drop(conn, res);
     return sz;
   } else if(res != HE_SUCCESS) {
     return WOLFSSL_CBIO_ERR_GENERAL;
@@ -234,7 +261,7 @@ int he_wolf_tls_write(WOLFSSL *ssl, char *buf, int sz, void *ctx) {
 
   // Call the write callback if set
   if(conn->outside_write_cb) {
-    res = conn->outside_write_cb(conn, conn->write_buffer, post_plugin_length, conn->data);
+    res = he_wolf_write_outside(conn, post_plugin.data, post_plugin.length);
     if(res != HE_SUCCESS) {
       return WOLFSSL_CBIO_ERR_GENERAL;
     }
@@ -0,0 +1,279 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <he.h>
+#include "unity.h"
+#include "test_defs.h"
+
+// Unit under test
+#include "admission.h"
+
+// Direct Includes for Utility Functions
+#include "cookie.h"
+#include "metrics.h"
+
+// Internal Mocks
+#include "mock_ssl_ctx.h"
+
+he_ssl_ctx_t ctx;
+
+uint8_t packet[HE_MAX_WIRE_MTU];
+size_t packet_length;
+
+static void build_client_hello(uint64_t session, uint8_t session_id_length) {
+  memset(packet, 0, sizeof(packet));
+  uint8_t *p = packet;
+
+  he_wire_hdr_t *hdr = (he_wire_hdr_t *)p;
+  hdr->he[0] = 'H';
+  hdr->he[1] = 'e';
+  hdr->major_version = 1;
+  hdr->minor_version = 1;
+  memcpy(&hdr->session, &session, sizeof(uint64_t));
+  p += sizeof(he_wire_hdr_t);
+
+  uint8_t *record = p;
+  p += HE_DTLS_RECORD_HEADER_SIZE;
+  uint8_t *hs = p;
+  p += HE_DTLS_HANDSHAKE_HEADER_SIZE;
+  uint8_t *body = p;
+
+  // Version and random
+  *p++ = 0xfe;
+  *p++ = 0xfd;
+  p += HE_DTLS_RANDOM_SIZE;
+
+  // Session ID
+  *p++ = session_id_length;
+  memset(p, 0xAA, session_id_length);
+  p += session_id_length;
+
+  // No cookie
+  *p++ = 0;
+
+  // One cipher suite, null compression
+  *p++ = 0;
+  *p++ = 2;
+  *p++ = 0xc0;
+  *p++ = 0x30;
+  *p++ = 1;
+  *p++ = 0;
+
+  size_t body_length = p - body;
+
+  record[0] = 22;
+  record[1] = 0xfe;
+  record[2] = 0xfd;
+  record[12] = (uint8_t)(body_length + HE_DTLS_HANDSHAKE_HEADER_SIZE);
+
+  hs[0] = 1;
+  hs[3] = (uint8_t)body_length;
+  hs[11] = (uint8_t)body_length;
+
+  packet_length = p - packet;
+}
+
+// The host knows one Helium session and has 32 byte D/TLS sessions of 0xAA cached
+static bool returning_client(he_ssl_ctx_t *ctx, uint64_t session, const uint8_t *tls_session_id,
+                             size_t tls_session_id_length) {
+  if(tls_session_id) {
+    return tls_session_id_length == 32 && tls_session_id[0] == 0xAA &&
+           tls_session_id[tls_session_id_length - 1] == 0xAA;
+  }
+  return session == 0x1234;
+}
+
+void setUp(void) {
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.connection_type = HE_CONNECTION_TYPE_DATAGRAM;
+  he_ssl_ctx_set_returning_client_cb(&ctx, returning_client);
+  build_client_hello(0, 0);
+}
+
+void tearDown(void) {
+}
+
+void test_set_handshake_rate_null(void) {
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_ssl_ctx_set_handshake_rate(NULL, 10, 10));
+}
+
+void test_set_handshake_rate_zero_burst(void) {
+  TEST_ASSERT_EQUAL(HE_ERR_ZERO_SIZE, he_ssl_ctx_set_handshake_rate(&ctx, 10, 0));
+}
+
+void test_set_handshake_rate(void) {
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_ssl_ctx_set_handshake_rate(&ctx, 100, 8));
+  TEST_ASSERT_EQUAL(10000, ctx.handshake_interval_us);
+  TEST_ASSERT_EQUAL(70000, ctx.handshake_priority_tolerance_us);
+  TEST_ASSERT_EQUAL(50000, ctx.handshake_full_tolerance_us);
+
+  // Zero turns it off again
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_ssl_ctx_set_handshake_rate(&ctx, 0, 0));
+  TEST_ASSERT_EQUAL(0, ctx.handshake_interval_us);
+}
+
+void test_classify_full(void) {
+  TEST_ASSERT_EQUAL(HE_HANDSHAKE_CLASS_FULL,
+                    he_internal_classify_handshake(&ctx, packet, packet_length));
+}
+
+void test_classify_resumption(void) {
+  build_client_hello(0, 32);
+  TEST_ASSERT_EQUAL(HE_HANDSHAKE_CLASS_RESUMPTION,
+                    he_internal_classify_handshake(&ctx, packet, packet_length));
+}
+
+void test_classify_roaming(void) {
+  build_client_hello(0x1234, 0);
+  TEST_ASSERT_EQUAL(HE_HANDSHAKE_CLASS_ROAMING,
+                    he_internal_classify_handshake(&ctx, packet, packet_length));
+}
+
+void test_classify_unknown_session_is_full(void) {
+  build_client_hello(0x5678, 0);
+  TEST_ASSERT_EQUAL(HE_HANDSHAKE_CLASS_FULL,
+                    he_internal_classify_handshake(&ctx, packet, packet_length));
+}
+
+void test_classify_unknown_session_id_is_full(void) {
+  build_client_hello(0, 16);
+  TEST_ASSERT_EQUAL(HE_HANDSHAKE_CLASS_FULL,
+                    he_internal_classify_handshake(&ctx, packet, packet_length));
+}
+
+void test_classify_unknown_session_can_still_resume(void) {
+  build_client_hello(0x5678, 32);
+  TEST_ASSERT_EQUAL(HE_HANDSHAKE_CLASS_RESUMPTION,
+                    he_internal_classify_handshake(&ctx, packet, packet_length));
+}
+
+void test_classify_without_callback_is_full(void) {
+  he_ssl_ctx_set_returning_client_cb(&ctx, NULL);
+
+  build_client_hello(0x1234, 0);
+  TEST_ASSERT_EQUAL(HE_HANDSHAKE_CLASS_FULL,
+                    he_internal_classify_handshake(&ctx, packet, packet_length));
+
+  build_client_hello(0, 32);
+  TEST_ASSERT_EQUAL(HE_HANDSHAKE_CLASS_FULL,
+                    he_internal_classify_handshake(&ctx, packet, packet_length));
+}
+
+void test_classify_rejected_session_is_full(void) {
+  build_client_hello(HE_PACKET_SESSION_REJECT, 0);
+  TEST_ASSERT_EQUAL(HE_HANDSHAKE_CLASS_FULL,
+                    he_internal_classify_handshake(&ctx, packet, packet_length));
+}
+
+void test_classify_garbage_is_full(void) {
+  TEST_ASSERT_EQUAL(HE_HANDSHAKE_CLASS_FULL, he_internal_classify_handshake(&ctx, packet, 4));
+  TEST_ASSERT_EQUAL(HE_HANDSHAKE_CLASS_FULL,
+                    he_internal_classify_handshake(&ctx, packet, sizeof(he_wire_hdr_t) + 3));
+}
+
+void test_admit_null(void) {
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER,
+                    he_ssl_ctx_admit_handshake(NULL, packet, packet_length, 0, NULL));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER,
+                    he_ssl_ctx_admit_handshake(&ctx, NULL, packet_length, 0, NULL));
+}
+
+void test_admit_disabled(void) {
+  for(int i = 0; i < 1000; i++) {
+    TEST_ASSERT_EQUAL(HE_SUCCESS,
+                      he_ssl_ctx_admit_handshake(&ctx, packet, packet_length, 1000, NULL));
+  }
+}
+
+void test_admit_full_handshakes_leave_reserve(void) {
+  uint32_t retry_after = 0;
+  he_ssl_ctx_set_handshake_rate(&ctx, 10, 4);
+
+  // Burst of 4 with 25% held back: three full handshakes get in
+  for(int i = 0; i < 3; i++) {
+    TEST_ASSERT_EQUAL(HE_SUCCESS,
+                      he_ssl_ctx_admit_handshake(&ctx, packet, packet_length, 1000, &retry_after));
+    TEST_ASSERT_EQUAL(0, retry_after);
+  }
+
+  TEST_ASSERT_EQUAL(HE_ERR_HANDSHAKE_THROTTLED,
+                    he_ssl_ctx_admit_handshake(&ctx, packet, packet_length, 1000, &retry_after));
+  TEST_ASSERT_EQUAL(100, retry_after);
+
+  // ...but a roaming client still does
+  build_client_hello(0x1234, 0);
+  TEST_ASSERT_EQUAL(HE_SUCCESS,
+                    he_ssl_ctx_admit_handshake(&ctx, packet, packet_length, 1000, &retry_after));
+
+  // Now everyone is throttled
+  TEST_ASSERT_EQUAL(HE_ERR_HANDSHAKE_THROTTLED,
+                    he_ssl_ctx_admit_handshake(&ctx, packet, packet_length, 1000, &retry_after));
+  TEST_ASSERT_EQUAL(100, retry_after);
+}
+
+void test_admit_spoofed_session_gets_no_reserve(void) {
+  uint32_t retry_after = 0;
+  he_ssl_ctx_set_handshake_rate(&ctx, 10, 4);
+
+  // Sessions nobody has heard of are full handshakes, and leave the reserve alone
+  build_client_hello(0x5678, 16);
+  for(int i = 0; i < 3; i++) {
+    TEST_ASSERT_EQUAL(HE_SUCCESS,
+                      he_ssl_ctx_admit_handshake(&ctx, packet, packet_length, 1000, &retry_after));
+  }
+  TEST_ASSERT_EQUAL(HE_ERR_HANDSHAKE_THROTTLED,
+                    he_ssl_ctx_admit_handshake(&ctx, packet, packet_length, 1000, &retry_after));
+
+  build_client_hello(0x1234, 0);
+  TEST_ASSERT_EQUAL(HE_SUCCESS,
+                    he_ssl_ctx_admit_handshake(&ctx, packet, packet_length, 1000, &retry_after));
+}
+
+void test_admit_refills_over_time(void) {
+  uint32_t retry_after = 0;
+  he_ssl_ctx_set_handshake_rate(&ctx, 10, 1);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS,
+                    he_ssl_ctx_admit_handshake(&ctx, packet, packet_length, 5000, &retry_after));
+  TEST_ASSERT_EQUAL(HE_ERR_HANDSHAKE_THROTTLED,
+                    he_ssl_ctx_admit_handshake(&ctx, packet, packet_length, 5050, &retry_after));
+  TEST_ASSERT_EQUAL(50, retry_after);
+
+  he_metrics_t metrics = {0};
+  he_ssl_ctx_get_metrics(&ctx, &metrics);
+  TEST_ASSERT_EQUAL(1, metrics.handshake_failures[-HE_ERR_HANDSHAKE_THROTTLED]);
+
+  // The retry hint is accurate
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_ssl_ctx_admit_handshake(&ctx, packet, packet_length,
+                                                           5050 + retry_after, &retry_after));
+}
+
+void test_admit_sustained_rate(void) {
+  int admitted = 0;
+  he_ssl_ctx_set_handshake_rate(&ctx, 100, 10);
+
+  // Offer a handshake every millisecond for ten seconds
+  for(uint64_t now = 10000; now < 20000; now++) {
+    if(he_ssl_ctx_admit_handshake(&ctx, packet, packet_length, now, NULL) == HE_SUCCESS) {
+      admitted++;
+    }
+  }
+
+  // 100 per second plus the initial burst (less the reserve)
+  TEST_ASSERT_UINT_WITHIN(2, 1000 + 8, admitted);
+}
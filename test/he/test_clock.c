@@ -0,0 +1,46 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <he.h>
+#include "unity.h"
+#include "test_defs.h"
+
+// Unit under test
+#include "clock.h"
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+}
+
+void test_clock_is_monotonic(void) {
+  uint64_t first = he_internal_clock_ms();
+  uint64_t second = he_internal_clock_ms();
+
+  TEST_ASSERT_NOT_EQUAL(0, first);
+  TEST_ASSERT_TRUE(second >= first);
+}
+
+void test_clock_us_is_monotonic(void) {
+  uint64_t first = he_internal_clock_us();
+  uint64_t second = he_internal_clock_us();
+
+  TEST_ASSERT_NOT_EQUAL(0, first);
+  TEST_ASSERT_TRUE(second >= first);
+}
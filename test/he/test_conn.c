@@ -26,11 +26,19 @@
 // Direct Includes for Utility Functions
 #include "config.h"
 #include "memory.h"
+#include "metrics.h"
 #include "ssl_ctx.h"
 
 // Internal Mocks
 #include "mock_fake_dispatch.h"
 #include "mock_wolf.h"
+#include "mock_conn_export.h"
+#include "mock_timers.h"
+#include "mock_clock.h"
+#include "mock_frag.h"
+#include "mock_gso.h"
+#include "mock_ip_pool.h"
+#include "mock_plugin_chain.h"
 
 // External Mocks
 #include "mock_ssl.h"
@@ -45,6 +53,11 @@ WOLFSSL wolf_ssl;
 
 void setUp(void) {
   conn.wolf_ssl = &wolf_ssl;
+
+  he_internal_frag_free_Ignore();
+  he_internal_gro_free_Ignore();
+  he_internal_ip_pool_release_Ignore();
+  he_internal_plugin_free_state_Ignore();
 }
 
 void tearDown(void) {
@@ -125,11 +138,54 @@ void test_conn_create_destroy(void) {
   test_conn->wolf_ssl = &wolf_ssl;
 
   wolfSSL_free_Expect(&wolf_ssl);
+  he_internal_ip_pool_retire_ExpectAndReturn(test_conn, false);
   he_return_code_t ret = he_conn_destroy(test_conn);
 
   TEST_ASSERT_EQUAL_INT(HE_SUCCESS, ret);
 }
 
+void test_conn_destroy_left_to_pool(void) {
+  he_conn_t *test_conn = he_conn_create();
+  TEST_ASSERT_NOT_NULL(test_conn);
+  test_conn->wolf_ssl = &wolf_ssl;
+  test_conn->state = HE_STATE_ONLINE;
+
+  wolfSSL_free_Expect(&wolf_ssl);
+  he_internal_ip_pool_retire_ExpectAndReturn(test_conn, true);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_destroy(test_conn));
+
+  // Lookup threads may still hand it packets, which it must turn away
+  TEST_ASSERT_NULL(test_conn->wolf_ssl);
+  TEST_ASSERT_EQUAL(HE_STATE_DISCONNECTED, test_conn->state);
+
+  free(test_conn);
+}
+
+void test_conn_counted_by_state_until_destroyed(void) {
+  he_conn_t *test_conn = he_conn_create();
+  TEST_ASSERT_NOT_NULL(test_conn);
+
+  he_internal_conn_configure(test_conn, &ssl_ctx);
+  TEST_ASSERT_EQUAL_PTR(&ssl_ctx.metrics, test_conn->metrics);
+  // Configuring a connection again, as waking from hibernation does, doesn't count it twice
+  he_internal_conn_configure(test_conn, &ssl_ctx);
+
+  he_metrics_t metrics = {0};
+  he_ssl_ctx_get_metrics(&ssl_ctx, &metrics);
+  TEST_ASSERT_EQUAL(1, metrics.connections[HE_STATE_NONE]);
+
+  he_internal_change_conn_state(test_conn, HE_STATE_DISCONNECTED);
+  he_ssl_ctx_get_metrics(&ssl_ctx, &metrics);
+  TEST_ASSERT_EQUAL(0, metrics.connections[HE_STATE_NONE]);
+  TEST_ASSERT_EQUAL(1, metrics.connections[HE_STATE_DISCONNECTED]);
+
+  wolfSSL_free_Expect(NULL);
+  he_internal_ip_pool_retire_ExpectAndReturn(test_conn, false);
+  he_conn_destroy(test_conn);
+  he_ssl_ctx_get_metrics(&ssl_ctx, &metrics);
+  TEST_ASSERT_EQUAL(0, metrics.connections[HE_STATE_DISCONNECTED]);
+}
+
 void test_set_username(void) {
   int res = he_conn_set_username(&conn, good_username);
   TEST_ASSERT_EQUAL_STRING(good_username, conn.username);
@@ -220,6 +276,139 @@ void test_is_mtu_set(void) {
   TEST_ASSERT_EQUAL(true, res3);
 }
 
+void test_get_effective_mtu(void) {
+  TEST_ASSERT_EQUAL(HE_MAX_MTU, he_conn_get_effective_mtu(&conn));
+
+  conn.effective_mtu = 1400;
+  TEST_ASSERT_EQUAL(1400, he_conn_get_effective_mtu(&conn));
+}
+
+void test_get_effective_mtu_uses_smaller_of_both_ends(void) {
+  conn.outside_mtu = HE_MAX_WIRE_MTU;
+
+  conn.peer_mtu = 1300;
+  TEST_ASSERT_EQUAL(1300, he_conn_get_effective_mtu(&conn));
+
+  conn.effective_mtu = 1250;
+  TEST_ASSERT_EQUAL(1250, he_conn_get_effective_mtu(&conn));
+
+  conn.effective_mtu = 1400;
+  TEST_ASSERT_EQUAL(1300, he_conn_get_effective_mtu(&conn));
+}
+
+void test_get_effective_mtu_limited_by_outside_mtu(void) {
+  // The peer's path can take more than ours
+  conn.outside_mtu = 1300;
+  conn.peer_mtu = 1400;
+  TEST_ASSERT_EQUAL(1300 - (HE_PACKET_OVERHEAD - HE_HEADER_SAFE_GAP),
+                    he_conn_get_effective_mtu(&conn));
+}
+
+void test_get_inner_mtu(void) {
+  TEST_ASSERT_EQUAL(HE_MAX_MTU, he_conn_get_inner_mtu(&conn));
+
+  conn.effective_mtu = 1400;
+  TEST_ASSERT_EQUAL(1400, he_conn_get_inner_mtu(&conn));
+
+  conn.inner_mtu = 9000;
+  TEST_ASSERT_EQUAL(9000, he_conn_get_inner_mtu(&conn));
+}
+
+void test_get_inside_drops(void) {
+  conn.inside_drops[HE_INSIDE_DROP_BAD_CHECKSUM] = 3;
+  TEST_ASSERT_EQUAL(3, he_conn_get_inside_drops(&conn, HE_INSIDE_DROP_BAD_CHECKSUM));
+  TEST_ASSERT_EQUAL(0, he_conn_get_inside_drops(&conn, HE_INSIDE_DROP_SPOOFED_SOURCE));
+
+  TEST_ASSERT_EQUAL(0, he_conn_get_inside_drops(&conn, HE_INSIDE_DROP_REASON_COUNT));
+  TEST_ASSERT_EQUAL(0, he_conn_get_inside_drops(NULL, HE_INSIDE_DROP_BAD_CHECKSUM));
+}
+
+void test_get_stats_null_pointers(void) {
+  he_conn_stats_t stats = {0};
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_get_stats(NULL, &stats));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_get_stats(&conn, NULL));
+}
+
+void test_get_stats(void) {
+  // WolfSSL's own D/TLS drop counts are covered below
+  conn.connection_type = HE_CONNECTION_TYPE_STREAM;
+  conn.counters.inside_rx_packets = 1;
+  conn.counters.inside_rx_bytes = 100;
+  conn.counters.inside_tx_packets = 2;
+  conn.counters.inside_tx_bytes = 200;
+  conn.counters.outside_rx_packets = 3;
+  conn.counters.outside_rx_bytes = 300;
+  conn.counters.outside_tx_packets = 4;
+  conn.counters.outside_tx_bytes = 400;
+  conn.counters.decrypt_failures = 0x100000005ull;
+  conn.counters.replays = 6;
+  conn.counters.renegotiations = 7;
+  conn.counters.session_rotations = 8;
+  conn.inside_drops[HE_INSIDE_DROP_SPOOFED_SOURCE] = 9;
+
+  he_conn_stats_t stats;
+  memset(&stats, 0xff, sizeof(stats));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_get_stats(&conn, &stats));
+
+  TEST_ASSERT_EQUAL(1, stats.inside_rx_packets);
+  TEST_ASSERT_EQUAL(100, stats.inside_rx_bytes);
+  TEST_ASSERT_EQUAL(2, stats.inside_tx_packets);
+  TEST_ASSERT_EQUAL(200, stats.inside_tx_bytes);
+  TEST_ASSERT_EQUAL(3, stats.outside_rx_packets);
+  TEST_ASSERT_EQUAL(300, stats.outside_rx_bytes);
+  TEST_ASSERT_EQUAL(4, stats.outside_tx_packets);
+  TEST_ASSERT_EQUAL(400, stats.outside_tx_bytes);
+  // Wider than 32 bits
+  TEST_ASSERT_EQUAL_UINT64(0x100000005ull, stats.decrypt_failures);
+  TEST_ASSERT_EQUAL(6, stats.replays);
+  TEST_ASSERT_EQUAL(7, stats.renegotiations);
+  TEST_ASSERT_EQUAL(8, stats.session_rotations);
+  TEST_ASSERT_EQUAL(9, stats.inside_drops[HE_INSIDE_DROP_SPOOFED_SOURCE]);
+  TEST_ASSERT_EQUAL(0, stats.inside_drops[HE_INSIDE_DROP_BAD_CHECKSUM]);
+  TEST_ASSERT_EQUAL(0, stats.other_drops);
+}
+
+void test_get_stats_expands_drop_reasons(void) {
+  conn.connection_type = HE_CONNECTION_TYPE_STREAM;
+  uint64_t one = 1ull << HE_CONN_DROP_REASON_BITS;
+  conn.counters.drops[0].value = 2 * one | (uint64_t)-HE_ERR_PACKET_TOO_LARGE;
+  conn.counters.drops[1].value = 3 * one | (uint64_t)-HE_ERR_PLUGIN_DROP;
+  // Codes past the end of the snapshot's table are folded into other_drops
+  conn.counters.drops[2].value = 4 * one | HE_CONN_STATS_MAX_DROP_REASONS;
+  conn.counters.other_drops = 5;
+
+  he_conn_stats_t stats;
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_get_stats(&conn, &stats));
+
+  TEST_ASSERT_EQUAL(2, stats.drops[-HE_ERR_PACKET_TOO_LARGE]);
+  TEST_ASSERT_EQUAL(3, stats.drops[-HE_ERR_PLUGIN_DROP]);
+  TEST_ASSERT_EQUAL(0, stats.drops[-HE_ERR_BAD_PACKET]);
+  TEST_ASSERT_EQUAL(9, stats.other_drops);
+}
+
+#ifdef WOLFSSL_DTLS_DROP_STATS
+static int fixture_wolfSSL_dtls_get_drop_stats(WOLFSSL *ssl, word32 *mac_drops,
+                                               word32 *replay_drops, int numCalls) {
+  TEST_ASSERT_EQUAL(&wolf_ssl, ssl);
+  *mac_drops = 10;
+  *replay_drops = 20;
+  return SSL_SUCCESS;
+}
+
+void test_get_stats_adds_wolfssl_dtls_drops(void) {
+  conn.connection_type = HE_CONNECTION_TYPE_DATAGRAM;
+  conn.counters.decrypt_failures = 1;
+  conn.counters.replays = 2;
+  wolfSSL_dtls_get_drop_stats_Stub(fixture_wolfSSL_dtls_get_drop_stats);
+
+  he_conn_stats_t stats;
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_get_stats(&conn, &stats));
+
+  TEST_ASSERT_EQUAL(11, stats.decrypt_failures);
+  TEST_ASSERT_EQUAL(22, stats.replays);
+}
+#endif
+
 void test_set_context(void) {
   char test = 'x';
 
@@ -267,6 +456,7 @@ void test_call_state_change_cb_for_new_states(void) {
   TEST_ASSERT_EQUAL(1, call_counter);
 
   // Do it again
+  wolfSSL_FreeHandshakeResources_Expect(&wolf_ssl);
   he_internal_change_conn_state(&conn, HE_STATE_ONLINE);
   // Check it incremented by 1
   TEST_ASSERT_EQUAL(2, call_counter);
@@ -325,6 +515,78 @@ void test_he_internal_update_timeout_with_cb(void) {
   TEST_ASSERT_EQUAL(1, call_counter);
 }
 
+void test_he_internal_update_timeout_with_timers(void) {
+  he_timers_t timers = {0};
+  conn.nudge_time_cb = nudge_time_cb;
+  conn.timers = &timers;
+
+  wolfSSL_dtls_get_current_timeout_ExpectAndReturn(conn.wolf_ssl, 10);
+  he_internal_timers_schedule_Expect(&timers, &conn.timer_node, 1000);
+  he_internal_update_timeout(&conn);
+
+  // The wheel takes the place of the callback
+  TEST_ASSERT_EQUAL(0, call_counter);
+  TEST_ASSERT_TRUE(conn.is_nudge_timer_running);
+
+  // Not scheduled again while pending
+  wolfSSL_dtls_get_current_timeout_ExpectAndReturn(conn.wolf_ssl, 10);
+  he_internal_update_timeout(&conn);
+}
+
+void test_he_conn_set_timers_null(void) {
+  he_timers_t timers = {0};
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_set_timers(NULL, &timers));
+}
+
+void test_he_conn_set_timers_no_pending_nudge(void) {
+  he_timers_t timers = {0};
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_timers(&conn, &timers));
+  TEST_ASSERT_EQUAL_PTR(&timers, conn.timers);
+  TEST_ASSERT_FALSE(conn.is_nudge_timer_running);
+}
+
+void test_he_conn_set_timers_moves_pending_nudge(void) {
+  he_timers_t old_timers = {0};
+  he_timers_t new_timers = {0};
+  conn.timers = &old_timers;
+  conn.wolf_timeout = 2000;
+  conn.is_nudge_timer_running = true;
+
+  he_internal_timers_cancel_Expect(&old_timers, &conn.timer_node);
+  he_internal_timers_schedule_Expect(&new_timers, &conn.timer_node, 2000);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_timers(&conn, &new_timers));
+  TEST_ASSERT_EQUAL_PTR(&new_timers, conn.timers);
+  TEST_ASSERT_TRUE(conn.is_nudge_timer_running);
+}
+
+void test_he_conn_set_timers_back_to_cb(void) {
+  he_timers_t timers = {0};
+  conn.nudge_time_cb = nudge_time_cb;
+  conn.timers = &timers;
+  conn.is_nudge_timer_running = true;
+
+  he_internal_timers_cancel_Expect(&timers, &conn.timer_node);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_timers(&conn, NULL));
+  TEST_ASSERT_NULL(conn.timers);
+  TEST_ASSERT_EQUAL(1, call_counter);
+  TEST_ASSERT_TRUE(conn.is_nudge_timer_running);
+}
+
+void test_he_internal_disconnect_and_shutdown_cancels_timer(void) {
+  he_timers_t timers = {0};
+  conn.timers = &timers;
+  conn.is_nudge_timer_running = true;
+
+  wolfSSL_shutdown_ExpectAndReturn(conn.wolf_ssl, SSL_SUCCESS);
+  he_internal_timers_cancel_Expect(&timers, &conn.timer_node);
+
+  he_internal_disconnect_and_shutdown(&conn);
+  TEST_ASSERT_FALSE(conn.is_nudge_timer_running);
+  TEST_ASSERT_EQUAL(HE_STATE_DISCONNECTED, conn.state);
+}
+
 void test_he_nudge_connection_timed_out(void) {
   wolfSSL_dtls_got_timeout_ExpectAndReturn(conn.wolf_ssl, SSL_FATAL_ERROR);
   wolfSSL_get_error_ExpectAndReturn(conn.wolf_ssl, SSL_FATAL_ERROR, SSL_FATAL_ERROR);
@@ -364,8 +626,20 @@ void test_he_nudge_with_cb(void) {
   TEST_ASSERT_EQUAL(1, call_counter);
 }
 
+void test_he_nudge_while_hibernating(void) {
+  uint8_t sealed[8] = {0};
+  conn.hibernated_state = sealed;
+  conn.is_nudge_timer_running = true;
+
+  // No calls into WolfSSL, there's no session to nudge
+  int res = he_conn_nudge(&conn);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+  TEST_ASSERT_FALSE(conn.is_nudge_timer_running);
+}
+
 void test_he_get_state(void) {
   // Change state
+  wolfSSL_FreeHandshakeResources_Expect(&wolf_ssl);
   he_internal_change_conn_state(&conn, HE_STATE_ONLINE);
   he_client_state_t state = he_conn_get_state(&conn);
   TEST_ASSERT_EQUAL(HE_STATE_ONLINE, state);
@@ -382,6 +656,31 @@ void test_he_disconnect(void) {
   TEST_ASSERT_EQUAL(HE_SUCCESS, res1);
 }
 
+void test_he_disconnect_wakes_hibernating_conn(void) {
+  uint8_t sealed[8] = {0};
+  conn.state = HE_STATE_ONLINE;
+  conn.hibernated_state = sealed;
+
+  he_internal_conn_wake_ExpectAndReturn(&conn, HE_SUCCESS);
+  wolfSSL_write_IgnoreAndReturn(SSL_SUCCESS);
+  wolfSSL_shutdown_ExpectAndReturn(conn.wolf_ssl, SSL_SUCCESS);
+
+  int res = he_conn_disconnect(&conn);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+  TEST_ASSERT_EQUAL(HE_STATE_DISCONNECTED, conn.state);
+}
+
+void test_send_keepalive_wake_fails(void) {
+  uint8_t sealed[8] = {0};
+  conn.state = HE_STATE_ONLINE;
+  conn.hibernated_state = sealed;
+
+  he_internal_conn_wake_ExpectAndReturn(&conn, HE_ERR_BAD_PACKET);
+
+  int res = he_conn_send_keepalive(&conn);
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET, res);
+}
+
 void test_send_keepalive_error_when_not_connected(void) {
   int res = he_conn_send_keepalive(&conn);
   TEST_ASSERT_EQUAL(HE_ERR_INVALID_CLIENT_STATE, res);
@@ -390,8 +689,202 @@ void test_send_keepalive_error_when_not_connected(void) {
 void test_send_keepalive_connected(void) {
   conn.state = HE_STATE_ONLINE;
   wolfSSL_write_IgnoreAndReturn(SSL_SUCCESS);
+  he_internal_clock_ms_ExpectAndReturn(1000);
   int res = he_conn_send_keepalive(&conn);
   TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+  TEST_ASSERT_EQUAL(1, conn.ping_sequence);
+}
+
+he_msg_ping_t written_ping;
+
+int write_capture_ping(WOLFSSL *ssl, const void *data, int sz, int numCalls) {
+  TEST_ASSERT_EQUAL(sizeof(he_msg_ping_t), sz);
+  memcpy(&written_ping, data, sizeof(he_msg_ping_t));
+  return sz;
+}
+
+void test_build_ping(void) {
+  he_msg_ping_t ping = {0};
+  conn.ping_sequence = 9;
+
+  he_internal_clock_ms_ExpectAndReturn(5000);
+  he_internal_conn_build_ping(&conn, &ping);
+
+  TEST_ASSERT_EQUAL(HE_MSGID_PING, ping.msg_header.msgid);
+  TEST_ASSERT_EQUAL(10, ping.payload);
+  TEST_ASSERT_EQUAL(5000, ping.timestamp);
+  TEST_ASSERT_EQUAL(10, conn.ping_sequence);
+}
+
+void test_send_keepalive_stamps_ping(void) {
+  conn.state = HE_STATE_ONLINE;
+  conn.ping_sequence = 41;
+  wolfSSL_write_Stub(write_capture_ping);
+  he_internal_clock_ms_ExpectAndReturn(0x100000123);
+
+  he_conn_send_keepalive(&conn);
+  TEST_ASSERT_EQUAL(HE_MSGID_PING, written_ping.msg_header.msgid);
+  TEST_ASSERT_EQUAL(42, written_ping.payload);
+  // Only the low 32 bits of the clock go on the wire
+  TEST_ASSERT_EQUAL(0x123, written_ping.timestamp);
+}
+
+void test_send_keepalive_sequence_never_zero(void) {
+  conn.state = HE_STATE_ONLINE;
+  conn.ping_sequence = UINT32_MAX;
+  wolfSSL_write_IgnoreAndReturn(SSL_SUCCESS);
+  he_internal_clock_ms_IgnoreAndReturn(1000);
+
+  he_conn_send_keepalive(&conn);
+  TEST_ASSERT_EQUAL(1, conn.ping_sequence);
+  he_conn_send_keepalive(&conn);
+  TEST_ASSERT_EQUAL(2, conn.ping_sequence);
+}
+
+void test_set_keepalive_interval(void) {
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_set_keepalive_interval(NULL, 1000));
+  TEST_ASSERT_EQUAL(0, he_conn_get_keepalive_interval(&conn));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_keepalive_interval(&conn, 15000));
+  TEST_ASSERT_EQUAL(15000, he_conn_get_keepalive_interval(&conn));
+}
+
+void test_send_keepalive_if_idle_not_online(void) {
+  conn.keepalive_interval_ms = 1000;
+  TEST_ASSERT_EQUAL(HE_ERR_INVALID_CLIENT_STATE, he_conn_send_keepalive_if_idle(&conn));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_send_keepalive_if_idle(NULL));
+}
+
+void test_send_keepalive_if_idle_disabled(void) {
+  conn.state = HE_STATE_ONLINE;
+  // No clock reads and nothing sent
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_send_keepalive_if_idle(&conn));
+}
+
+void test_send_keepalive_if_idle_suppressed_by_traffic(void) {
+  conn.state = HE_STATE_ONLINE;
+  conn.keepalive_interval_ms = 1000;
+
+  // First call only takes note of the time
+  he_internal_clock_ms_ExpectAndReturn(10000);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_send_keepalive_if_idle(&conn));
+
+  // Data keeps arriving, so no keepalives however long it's been
+  for(uint64_t now = 11000; now < 20000; now += 1000) {
+    conn.rx_records += 10;
+    he_internal_clock_ms_ExpectAndReturn(now);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_send_keepalive_if_idle(&conn));
+  }
+  TEST_ASSERT_EQUAL(0, conn.ping_sequence);
+}
+
+void test_send_keepalive_if_idle_sends_once_per_interval(void) {
+  conn.state = HE_STATE_ONLINE;
+  conn.keepalive_interval_ms = 1000;
+  wolfSSL_write_IgnoreAndReturn(SSL_SUCCESS);
+
+  he_internal_clock_ms_ExpectAndReturn(10000);
+  he_conn_send_keepalive_if_idle(&conn);
+
+  // Not idle for long enough yet
+  he_internal_clock_ms_ExpectAndReturn(10500);
+  he_conn_send_keepalive_if_idle(&conn);
+  TEST_ASSERT_EQUAL(0, conn.ping_sequence);
+
+  he_internal_clock_ms_ExpectAndReturn(11000);
+  he_internal_clock_ms_ExpectAndReturn(11000);
+  he_conn_send_keepalive_if_idle(&conn);
+  TEST_ASSERT_EQUAL(1, conn.ping_sequence);
+
+  // No reply yet, wait another interval before trying again
+  he_internal_clock_ms_ExpectAndReturn(11500);
+  he_conn_send_keepalive_if_idle(&conn);
+  TEST_ASSERT_EQUAL(1, conn.ping_sequence);
+
+  he_internal_clock_ms_ExpectAndReturn(12000);
+  he_internal_clock_ms_ExpectAndReturn(12000);
+  he_conn_send_keepalive_if_idle(&conn);
+  TEST_ASSERT_EQUAL(2, conn.ping_sequence);
+}
+
+void test_ping_sample_jitter(void) {
+  he_internal_conn_ping_sample(&conn, 100);
+  TEST_ASSERT_EQUAL(0, he_conn_get_jitter(&conn));
+  TEST_ASSERT_EQUAL(100, he_conn_get_rtt(&conn));
+
+  he_internal_conn_ping_sample(&conn, 132);
+  TEST_ASSERT_EQUAL(2, he_conn_get_jitter(&conn));
+
+  he_internal_conn_ping_sample(&conn, 100);
+  // 2 + (32 - 2) / 16
+  TEST_ASSERT_EQUAL(3, he_conn_get_jitter(&conn));
+}
+
+void test_rtt_first_sample(void) {
+  TEST_ASSERT_EQUAL(0, he_conn_get_rtt(&conn));
+
+  he_internal_conn_rtt_sample(&conn, 200);
+  TEST_ASSERT_EQUAL(200, he_conn_get_rtt(&conn));
+  TEST_ASSERT_EQUAL(100, conn.rttvar_ms);
+  // SRTT + 4 * RTTVAR
+  TEST_ASSERT_EQUAL(600, conn.rto_ms);
+}
+
+void test_rtt_smoothing(void) {
+  he_internal_conn_rtt_sample(&conn, 200);
+  he_internal_conn_rtt_sample(&conn, 120);
+
+  // 7/8 * 200 + 1/8 * 120, 3/4 * 100 + 1/4 * 80
+  TEST_ASSERT_EQUAL(190, he_conn_get_rtt(&conn));
+  TEST_ASSERT_EQUAL(95, conn.rttvar_ms);
+  TEST_ASSERT_EQUAL(570, conn.rto_ms);
+}
+
+void test_rtt_rto_bounds(void) {
+  // A fast and steady path still gets the minimum timeout
+  for(int i = 0; i < 50; i++) {
+    he_internal_conn_rtt_sample(&conn, 0);
+  }
+  TEST_ASSERT_EQUAL(1, he_conn_get_rtt(&conn));
+  TEST_ASSERT_EQUAL(HE_RTO_MIN_MS, conn.rto_ms);
+
+  memset(&conn, 0, sizeof(conn));
+  he_internal_conn_rtt_sample(&conn, 50000);
+  TEST_ASSERT_EQUAL(HE_RTO_MAX_MS, conn.rto_ms);
+}
+
+void test_he_internal_update_timeout_uses_rto(void) {
+  conn.nudge_time_cb = nudge_time_cb;
+  conn.srtt_ms = 20;
+  conn.rto_ms = 150;
+
+  // Wolf's own timeout isn't consulted once the RTT is known
+  he_internal_update_timeout(&conn);
+  TEST_ASSERT_EQUAL(150, conn.wolf_timeout);
+  TEST_ASSERT_EQUAL(1, call_counter);
+}
+
+void test_he_internal_update_timeout_backs_off(void) {
+  conn.srtt_ms = 20;
+  conn.rto_ms = 150;
+
+  conn.flight_retransmits = 2;
+  he_internal_update_timeout(&conn);
+  TEST_ASSERT_EQUAL(600, conn.wolf_timeout);
+
+  conn.flight_retransmits = 200;
+  he_internal_update_timeout(&conn);
+  TEST_ASSERT_EQUAL(150 << HE_RTO_MAX_BACKOFF, conn.wolf_timeout);
+
+  conn.rto_ms = HE_RTO_MAX_MS;
+  he_internal_update_timeout(&conn);
+  TEST_ASSERT_EQUAL(HE_RTO_MAX_MS, conn.wolf_timeout);
+}
+
+void test_he_nudge_counts_retransmits(void) {
+  wolfSSL_dtls_got_timeout_ExpectAndReturn(conn.wolf_ssl, SSL_SUCCESS);
+  wolfSSL_dtls_get_current_timeout_ExpectAndReturn(conn.wolf_ssl, 10);
+  he_conn_nudge(&conn);
+  TEST_ASSERT_EQUAL(1, conn.flight_retransmits);
 }
 
 void test_disconnect_reject_if_not_online(void) {
@@ -459,6 +952,13 @@ void test_calculate_data_padding_full_large(void) {
   TEST_ASSERT_EQUAL(HE_MAX_MTU, res);
 }
 
+void test_calculate_data_padding_full_uses_effective_mtu(void) {
+  conn.padding_type = HE_PADDING_FULL;
+  conn.effective_mtu = 1400;
+  size_t res = he_internal_calculate_data_packet_length(&conn, 10);
+  TEST_ASSERT_EQUAL(1400, res);
+}
+
 void test_calculate_data_padding_none_small(void) {
   conn.padding_type = HE_PADDING_NONE;
   size_t res = he_internal_calculate_data_packet_length(&conn, 10);
@@ -739,6 +1239,11 @@ void test_he_conn_is_error_fatal_code_for_non_fatal_ssl(void) {
   TEST_ASSERT_FALSE(res);
 }
 
+void test_he_conn_is_error_fatal_code_for_bypassed_packet(void) {
+  bool res = he_conn_is_error_fatal(&conn, HE_ERR_PACKET_BYPASSED);
+  TEST_ASSERT_FALSE(res);
+}
+
 void test_he_conn_is_error_fatal_code_for_null_pointer(void) {
   bool res = he_conn_is_error_fatal(&conn, HE_ERR_NULL_POINTER);
   TEST_ASSERT_TRUE(res);
@@ -901,6 +1406,12 @@ void test_he_conn_server_connect(void) {
 
   he_return_code_t res = he_conn_server_connect(&conn, &ssl_ctx, NULL);
   TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+
+  he_metrics_t metrics = {0};
+  he_ssl_ctx_get_metrics(&ssl_ctx, &metrics);
+  TEST_ASSERT_EQUAL(1, metrics.handshakes_started);
+  TEST_ASSERT_EQUAL(1, metrics.handshakes_completed);
+  TEST_ASSERT_EQUAL(1, metrics.connections[conn.state]);
 }
 
 void test_he_conn_server_connect_dn_set(void) {
@@ -950,6 +1461,183 @@ void test_he_conn_server_connect_dn_set_fail(void) {
   TEST_ASSERT_EQUAL(HE_ERR_INIT_FAILED, res);
 }
 
+void test_he_conn_server_connect_stateless_cookies(void) {
+  uint8_t peer[] = {0x02, 0x00, 0x1f, 0x90, 0x7f, 0x00, 0x00, 0x01};
+
+  ssl_ctx.use_stateless_cookies = true;
+  ssl_ctx.connection_type = HE_CONNECTION_TYPE_DATAGRAM;
+
+  he_return_code_t res1 = he_conn_set_outside_mtu(&conn, 1500);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res1);
+
+  he_return_code_t res2 = he_conn_set_peer_address(&conn, peer, sizeof(peer));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res2);
+
+  wolfSSL_new_ExpectAndReturn(ssl_ctx.wolf_ctx, conn.wolf_ssl);
+  wolfSSL_dtls_set_using_nonblock_Expect(conn.wolf_ssl, 1);
+  wolfSSL_dtls_set_mtu_ExpectAndReturn(conn.wolf_ssl, 1425, SSL_SUCCESS);
+  wolfSSL_SetIOWriteCtx_Expect(conn.wolf_ssl, &conn);
+  wolfSSL_SetIOReadCtx_Expect(conn.wolf_ssl, &conn);
+
+  wolfSSL_negotiate_ExpectAndReturn(conn.wolf_ssl, SSL_SUCCESS);
+  wolfSSL_write_IgnoreAndReturn(SSL_SUCCESS);
+  wolfSSL_dtls_get_current_timeout_ExpectAndReturn(conn.wolf_ssl, 10);
+  wc_RNG_GenerateBlock_IgnoreAndReturn(0);
+
+  wolfSSL_DTLS_SetCookieSecret_ExpectAndReturn(conn.wolf_ssl, ssl_ctx.cookie_secret,
+                                               HE_COOKIE_SECRET_LENGTH, SSL_SUCCESS);
+  wolfSSL_dtls_set_peer_ExpectAndReturn(conn.wolf_ssl, conn.peer_address, sizeof(peer),
+                                        SSL_SUCCESS);
+
+  he_return_code_t res = he_conn_server_connect(&conn, &ssl_ctx, NULL);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+}
+
+static void server_connect_with_cookie_secret(const uint8_t *secret) {
+  uint8_t peer[] = {0x02, 0x00, 0x1f, 0x90, 0x7f, 0x00, 0x00, 0x01};
+
+  ssl_ctx.use_stateless_cookies = true;
+  ssl_ctx.connection_type = HE_CONNECTION_TYPE_DATAGRAM;
+  memset(ssl_ctx.cookie_secret, 0x24, sizeof(ssl_ctx.cookie_secret));
+  memset(ssl_ctx.previous_cookie_secret, 0x42, sizeof(ssl_ctx.previous_cookie_secret));
+
+  he_conn_set_outside_mtu(&conn, 1500);
+  he_conn_set_peer_address(&conn, peer, sizeof(peer));
+
+  wolfSSL_new_ExpectAndReturn(ssl_ctx.wolf_ctx, conn.wolf_ssl);
+  wolfSSL_dtls_set_using_nonblock_Expect(conn.wolf_ssl, 1);
+  wolfSSL_dtls_set_mtu_ExpectAndReturn(conn.wolf_ssl, 1425, SSL_SUCCESS);
+  wolfSSL_SetIOWriteCtx_Expect(conn.wolf_ssl, &conn);
+  wolfSSL_SetIOReadCtx_Expect(conn.wolf_ssl, &conn);
+
+  wolfSSL_negotiate_ExpectAndReturn(conn.wolf_ssl, SSL_SUCCESS);
+  wolfSSL_write_IgnoreAndReturn(SSL_SUCCESS);
+  wolfSSL_dtls_get_current_timeout_ExpectAndReturn(conn.wolf_ssl, 10);
+  wc_RNG_GenerateBlock_IgnoreAndReturn(0);
+
+  wolfSSL_DTLS_SetCookieSecret_ExpectAndReturn(conn.wolf_ssl, secret, HE_COOKIE_SECRET_LENGTH,
+                                               SSL_SUCCESS);
+  wolfSSL_dtls_set_peer_ExpectAndReturn(conn.wolf_ssl, conn.peer_address, sizeof(peer),
+                                        SSL_SUCCESS);
+
+  he_return_code_t res = he_conn_server_connect(&conn, &ssl_ctx, NULL);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+}
+
+void test_he_conn_server_connect_stateless_cookies_previous_secret(void) {
+  // The cookie was issued just before the secret was rotated
+  ssl_ctx.has_previous_cookie_secret = true;
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_use_previous_cookie_secret(&conn, true));
+
+  server_connect_with_cookie_secret(ssl_ctx.previous_cookie_secret);
+}
+
+void test_he_conn_server_connect_stateless_cookies_previous_secret_gone(void) {
+  // Rotated twice since, so the client will have to fetch a new cookie whatever we do
+  ssl_ctx.has_previous_cookie_secret = false;
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_use_previous_cookie_secret(&conn, true));
+
+  server_connect_with_cookie_secret(ssl_ctx.cookie_secret);
+}
+
+void test_he_conn_set_use_previous_cookie_secret_null(void) {
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_set_use_previous_cookie_secret(NULL, true));
+}
+
+void test_he_conn_server_connect_stateless_cookies_set_secret_fail(void) {
+  uint8_t peer[] = {0x02, 0x00, 0x1f, 0x90, 0x7f, 0x00, 0x00, 0x01};
+
+  ssl_ctx.use_stateless_cookies = true;
+  ssl_ctx.connection_type = HE_CONNECTION_TYPE_DATAGRAM;
+
+  he_conn_set_outside_mtu(&conn, 1500);
+  he_conn_set_peer_address(&conn, peer, sizeof(peer));
+
+  wolfSSL_new_ExpectAndReturn(ssl_ctx.wolf_ctx, conn.wolf_ssl);
+  wolfSSL_dtls_set_using_nonblock_Expect(conn.wolf_ssl, 1);
+  wolfSSL_dtls_set_mtu_ExpectAndReturn(conn.wolf_ssl, 1425, SSL_SUCCESS);
+  wolfSSL_SetIOWriteCtx_Expect(conn.wolf_ssl, &conn);
+  wolfSSL_SetIOReadCtx_Expect(conn.wolf_ssl, &conn);
+
+  wolfSSL_negotiate_ExpectAndReturn(conn.wolf_ssl, SSL_SUCCESS);
+  wolfSSL_write_IgnoreAndReturn(SSL_SUCCESS);
+  wolfSSL_dtls_get_current_timeout_ExpectAndReturn(conn.wolf_ssl, 10);
+  wc_RNG_GenerateBlock_IgnoreAndReturn(0);
+
+  wolfSSL_DTLS_SetCookieSecret_ExpectAndReturn(conn.wolf_ssl, ssl_ctx.cookie_secret,
+                                               HE_COOKIE_SECRET_LENGTH, SSL_FATAL_ERROR);
+
+  he_return_code_t res = he_conn_server_connect(&conn, &ssl_ctx, NULL);
+  TEST_ASSERT_EQUAL(HE_ERR_INIT_FAILED, res);
+}
+
+void test_he_conn_set_peer_address(void) {
+  uint8_t peer[] = {0x02, 0x00, 0x1f, 0x90, 0x7f, 0x00, 0x00, 0x01};
+
+  he_return_code_t res = he_conn_set_peer_address(&conn, peer, sizeof(peer));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+  TEST_ASSERT_EQUAL(sizeof(peer), conn.peer_address_length);
+  TEST_ASSERT_EQUAL_MEMORY(peer, conn.peer_address, sizeof(peer));
+}
+
+void test_he_conn_set_peer_address_errors(void) {
+  uint8_t peer[HE_MAX_PEER_ADDRESS_LENGTH + 1] = {0};
+
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_set_peer_address(NULL, peer, 4));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_set_peer_address(&conn, NULL, 4));
+  TEST_ASSERT_EQUAL(HE_ERR_ZERO_SIZE, he_conn_set_peer_address(&conn, peer, 0));
+  TEST_ASSERT_EQUAL(HE_ERR_PACKET_TOO_LARGE, he_conn_set_peer_address(&conn, peer, sizeof(peer)));
+  TEST_ASSERT_EQUAL(0, conn.peer_address_length);
+}
+
+void test_he_internal_change_conn_state_online_server_handoff(void) {
+  conn.is_server = true;
+  conn.handoff_cb = handoff_cb;
+
+  wolfSSL_FreeHandshakeResources_Expect(&wolf_ssl);
+  he_internal_change_conn_state(&conn, HE_STATE_ONLINE);
+  TEST_ASSERT_TRUE(conn.handoff_pending);
+}
+
+void test_he_internal_change_conn_state_online_no_handoff_cb(void) {
+  conn.is_server = true;
+
+  wolfSSL_FreeHandshakeResources_Expect(&wolf_ssl);
+  he_internal_change_conn_state(&conn, HE_STATE_ONLINE);
+  TEST_ASSERT_FALSE(conn.handoff_pending);
+}
+
+void test_he_internal_change_conn_state_online_client_no_handoff(void) {
+  conn.is_server = false;
+  conn.handoff_cb = handoff_cb;
+
+  wolfSSL_FreeHandshakeResources_Expect(&wolf_ssl);
+  he_internal_change_conn_state(&conn, HE_STATE_ONLINE);
+  TEST_ASSERT_FALSE(conn.handoff_pending);
+}
+
+void test_he_internal_change_conn_state_online_frees_handshake_resources(void) {
+  conn.state = HE_STATE_CONFIGURING;
+
+  wolfSSL_FreeHandshakeResources_Expect(&wolf_ssl);
+  he_internal_change_conn_state(&conn, HE_STATE_ONLINE);
+
+  // Only once, staying online doesn't free anything again
+  he_internal_change_conn_state(&conn, HE_STATE_ONLINE);
+}
+
+void test_he_internal_change_conn_state_online_without_ssl(void) {
+  conn.wolf_ssl = NULL;
+  he_internal_change_conn_state(&conn, HE_STATE_ONLINE);
+  TEST_ASSERT_EQUAL(HE_STATE_ONLINE, conn.state);
+}
+
+void test_conn_steady_state_footprint(void) {
+  // With the handshake resources released, an online connection is this struct plus WolfSSL's
+  // record layer state. Keep an eye on anything that makes it grow.
+  TEST_ASSERT_LESS_OR_EQUAL(4096, sizeof(he_conn_t));
+}
+
 void test_he_internal_send_auth_bad_state(void) {
   conn.state = HE_STATE_ONLINE;
   he_return_code_t res = he_internal_send_auth(&conn);
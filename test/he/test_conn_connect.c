@@ -30,11 +30,19 @@
 #include "config.h"
 #include "core.h"
 #include "memory.h"
+#include "metrics.h"
 
 // Internal Mocks
 #include "mock_wolf.h"
 #include "mock_ssl_ctx.h"
 #include "mock_fake_dispatch.h"
+#include "mock_conn_export.h"
+#include "mock_timers.h"
+#include "mock_clock.h"
+#include "mock_frag.h"
+#include "mock_gso.h"
+#include "mock_ip_pool.h"
+#include "mock_plugin_chain.h"
 
 // External Mocks
 #include "mock_ssl.h"
@@ -61,6 +69,11 @@ void setUp(void) {
   he_conn_set_outside_mtu(conn, 1500);
 
   call_counter = 0;
+
+  he_internal_frag_free_Ignore();
+  he_internal_gro_free_Ignore();
+  he_internal_ip_pool_release_Ignore();
+  he_internal_plugin_free_state_Ignore();
 }
 
 void tearDown(void) {
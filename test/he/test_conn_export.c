@@ -0,0 +1,705 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <he.h>
+#include "unity.h"
+#include "test_defs.h"
+
+// Unit under test
+#include "conn_export.h"
+
+// Direct Includes for Utility Functions
+#include "config.h"
+#include "conn.h"
+#include "memory.h"
+#include "metrics.h"
+#include "pmtud.h"
+#include "ssl_ctx.h"
+#include <wolfssl/error-ssl.h>
+#include <wolfssl/wolfcrypt/aes.h>
+
+// Internal Mocks
+#include "mock_fake_dispatch.h"
+#include "mock_wolf.h"
+#include "mock_timers.h"
+#include "mock_clock.h"
+#include "mock_frag.h"
+#include "mock_gso.h"
+#include "mock_ip_pool.h"
+#include "mock_plugin_chain.h"
+
+// External Mocks
+#include "mock_ssl.h"
+#include "mock_wolfio.h"
+#include "mock_fake_rng.h"
+
+he_ssl_ctx_t ssl_ctx;
+he_conn_t conn;
+he_conn_t imported;
+
+WOLFSSL wolf_ssl;
+WOLFSSL imported_wolf_ssl;
+
+uint8_t export_key[HE_EXPORT_KEY_LENGTH];
+uint8_t export_buffer[512];
+
+// Stands in for the keys and sequence numbers WolfSSL would export
+uint8_t fake_wolf_state[] = {0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a};
+
+int fixture_wolfSSL_dtls_export(WOLFSSL *ssl, unsigned char *buf, unsigned int *sz, int numCalls) {
+  TEST_ASSERT_EQUAL(&wolf_ssl, ssl);
+
+  // Size query
+  if(!buf) {
+    *sz = sizeof(fake_wolf_state);
+    return 0;
+  }
+
+  if(*sz < sizeof(fake_wolf_state)) {
+    return BUFFER_E;
+  }
+
+  memcpy(buf, fake_wolf_state, sizeof(fake_wolf_state));
+  return sizeof(fake_wolf_state);
+}
+
+int fixture_wolfSSL_dtls_import(WOLFSSL *ssl, const unsigned char *buf, unsigned int sz,
+                                int numCalls) {
+  TEST_ASSERT_EQUAL(&imported_wolf_ssl, ssl);
+  TEST_ASSERT_EQUAL(sizeof(fake_wolf_state), sz);
+  TEST_ASSERT_EQUAL_MEMORY(fake_wolf_state, buf, sizeof(fake_wolf_state));
+  return (int)sz;
+}
+
+void setUp(void) {
+  memset(export_key, 0x42, sizeof(export_key));
+
+  ssl_ctx.connection_type = HE_CONNECTION_TYPE_DATAGRAM;
+  ssl_ctx.minimum_supported_version.major_version = 1;
+  ssl_ctx.maximum_supported_version.major_version = 1;
+  ssl_ctx.maximum_supported_version.minor_version = 1;
+  he_ssl_ctx_set_export_key(&ssl_ctx, export_key, sizeof(export_key));
+
+  conn.wolf_ssl = &wolf_ssl;
+  conn.connection_type = HE_CONNECTION_TYPE_DATAGRAM;
+  conn.state = HE_STATE_ONLINE;
+  conn.is_server = true;
+  conn.session_id = 0x1122334455667788;
+  conn.protocol_version.major_version = 1;
+  conn.protocol_version.minor_version = 1;
+  conn.outside_mtu = HE_MAX_WIRE_MTU;
+  conn.padding_type = HE_PADDING_450;
+  conn.export_key = ssl_ctx.export_key;
+
+  he_internal_frag_free_Ignore();
+  he_internal_gro_free_Ignore();
+  he_internal_ip_pool_release_Ignore();
+  he_internal_plugin_free_state_Ignore();
+}
+
+void tearDown(void) {
+  memset(&ssl_ctx, 0, sizeof(he_ssl_ctx_t));
+  memset(&conn, 0, sizeof(he_conn_t));
+  memset(&imported, 0, sizeof(he_conn_t));
+  memset(export_buffer, 0, sizeof(export_buffer));
+}
+
+static size_t do_export(void) {
+  size_t length = sizeof(export_buffer);
+
+  wolfSSL_dtls_export_Stub(fixture_wolfSSL_dtls_export);
+  wc_InitRng_IgnoreAndReturn(0);
+  wc_RNG_GenerateBlock_IgnoreAndReturn(0);
+  wc_FreeRng_IgnoreAndReturn(0);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_export(&conn, export_buffer, &length));
+
+  return length;
+}
+
+void test_export_null_pointers(void) {
+  size_t length = sizeof(export_buffer);
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_export(NULL, export_buffer, &length));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_export(&conn, export_buffer, NULL));
+}
+
+void test_export_not_online(void) {
+  size_t length = sizeof(export_buffer);
+  conn.state = HE_STATE_CONNECTING;
+  TEST_ASSERT_EQUAL(HE_ERR_INVALID_CLIENT_STATE, he_conn_export(&conn, export_buffer, &length));
+}
+
+void test_export_renegotiating(void) {
+  size_t length = sizeof(export_buffer);
+  conn.renegotiation_in_progress = true;
+  TEST_ASSERT_EQUAL(HE_ERR_INVALID_CLIENT_STATE, he_conn_export(&conn, export_buffer, &length));
+}
+
+void test_export_stream_not_supported(void) {
+  size_t length = sizeof(export_buffer);
+  conn.connection_type = HE_CONNECTION_TYPE_STREAM;
+  TEST_ASSERT_EQUAL(HE_ERR_INVALID_CONNECTION_TYPE,
+                    he_conn_export(&conn, export_buffer, &length));
+}
+
+void test_export_no_key(void) {
+  size_t length = sizeof(export_buffer);
+  conn.export_key = NULL;
+  TEST_ASSERT_EQUAL(HE_ERR_CONF_EXPORT_KEY_NOT_SET,
+                    he_conn_export(&conn, export_buffer, &length));
+}
+
+void test_export_size_query(void) {
+  size_t length = 0;
+  wolfSSL_dtls_export_ExpectAnyArgsAndReturn(0);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_export(&conn, NULL, &length));
+  TEST_ASSERT_EQUAL(sizeof(he_conn_export_hdr_t) + sizeof(he_conn_export_state_t) +
+                        HE_CONN_EXPORT_TAG_SIZE,
+                    length);
+}
+
+void test_export_buffer_too_small(void) {
+  size_t length = sizeof(he_conn_export_hdr_t) + sizeof(he_conn_export_state_t) +
+                  HE_CONN_EXPORT_TAG_SIZE + 2;
+  wolfSSL_dtls_export_Stub(fixture_wolfSSL_dtls_export);
+
+  TEST_ASSERT_EQUAL(HE_ERR_PACKET_TOO_LARGE, he_conn_export(&conn, export_buffer, &length));
+}
+
+void test_export_rng_failure(void) {
+  size_t length = sizeof(export_buffer);
+  wolfSSL_dtls_export_Stub(fixture_wolfSSL_dtls_export);
+  wc_InitRng_IgnoreAndReturn(0);
+  wc_RNG_GenerateBlock_IgnoreAndReturn(-1);
+  wc_FreeRng_IgnoreAndReturn(0);
+
+  TEST_ASSERT_EQUAL(HE_ERR_RNG_FAILURE, he_conn_export(&conn, export_buffer, &length));
+}
+
+void test_export_rng_init_failure(void) {
+  size_t length = sizeof(export_buffer);
+  wolfSSL_dtls_export_Stub(fixture_wolfSSL_dtls_export);
+  wc_InitRng_IgnoreAndReturn(-1);
+
+  TEST_ASSERT_EQUAL(HE_ERR_RNG_FAILURE, he_conn_export(&conn, export_buffer, &length));
+}
+
+RNG *iv_rng = NULL;
+
+int fixture_wc_InitRng(RNG *rng, int numCalls) {
+  iv_rng = rng;
+  return 0;
+}
+
+int fixture_wc_RNG_GenerateBlock(RNG *rng, byte *bytes, uint32_t sz, int numCalls) {
+  TEST_ASSERT_EQUAL_PTR(iv_rng, rng);
+  memset(bytes, 0x5a, sz);
+  return 0;
+}
+
+int fixture_wc_FreeRng(RNG *rng, int numCalls) {
+  TEST_ASSERT_EQUAL_PTR(iv_rng, rng);
+  return 0;
+}
+
+void test_export_iv_does_not_use_shared_rng(void) {
+  size_t length = sizeof(export_buffer);
+  wolfSSL_dtls_export_Stub(fixture_wolfSSL_dtls_export);
+  wc_InitRng_Stub(fixture_wc_InitRng);
+  wc_RNG_GenerateBlock_Stub(fixture_wc_RNG_GenerateBlock);
+  wc_FreeRng_Stub(fixture_wc_FreeRng);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_export(&conn, export_buffer, &length));
+
+  // Seeded for this call alone, rather than the state the connection shares with its context
+  TEST_ASSERT_NOT_EQUAL(&conn.wolf_rng, iv_rng);
+  TEST_ASSERT_NOT_EQUAL(&ssl_ctx.wolf_rng, iv_rng);
+  he_conn_export_hdr_t *hdr = (he_conn_export_hdr_t *)export_buffer;
+  TEST_ASSERT_EACH_EQUAL_UINT8(0x5a, hdr->iv, sizeof(hdr->iv));
+}
+
+void test_export_is_sealed(void) {
+  size_t length = do_export();
+
+  TEST_ASSERT_EQUAL(sizeof(he_conn_export_hdr_t) + sizeof(he_conn_export_state_t) +
+                        sizeof(fake_wolf_state) + HE_CONN_EXPORT_TAG_SIZE,
+                    length);
+  TEST_ASSERT_EQUAL('H', export_buffer[0]);
+  TEST_ASSERT_EQUAL('x', export_buffer[1]);
+  TEST_ASSERT_EQUAL(HE_CONN_EXPORT_VERSION, export_buffer[2]);
+
+  // Neither the session nor the WolfSSL state can be seen in the export
+  size_t state_offset = sizeof(he_conn_export_hdr_t) + sizeof(he_conn_export_state_t);
+  TEST_ASSERT_NOT_EQUAL(0, memcmp(fake_wolf_state, export_buffer + state_offset,
+                                  sizeof(fake_wolf_state)));
+  TEST_ASSERT_NOT_EQUAL(0, memcmp(&conn.session_id, export_buffer + sizeof(he_conn_export_hdr_t),
+                                  sizeof(uint64_t)));
+}
+
+void test_import_null_pointers(void) {
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER,
+                    he_conn_import(NULL, &ssl_ctx, NULL, export_buffer, sizeof(export_buffer)));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER,
+                    he_conn_import(&imported, NULL, NULL, export_buffer, sizeof(export_buffer)));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER,
+                    he_conn_import(&imported, &ssl_ctx, NULL, NULL, sizeof(export_buffer)));
+}
+
+void test_import_already_connected(void) {
+  imported.wolf_ssl = &imported_wolf_ssl;
+  TEST_ASSERT_EQUAL(HE_ERR_INVALID_CLIENT_STATE,
+                    he_conn_import(&imported, &ssl_ctx, NULL, export_buffer, sizeof(export_buffer)));
+}
+
+void test_import_no_key(void) {
+  ssl_ctx.has_export_key = false;
+  TEST_ASSERT_EQUAL(HE_ERR_CONF_EXPORT_KEY_NOT_SET,
+                    he_conn_import(&imported, &ssl_ctx, NULL, export_buffer, sizeof(export_buffer)));
+}
+
+void test_import_too_short(void) {
+  size_t length = do_export();
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET,
+                    he_conn_import(&imported, &ssl_ctx, NULL, export_buffer, 10));
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET,
+                    he_conn_import(&imported, &ssl_ctx, NULL, export_buffer, length - 1));
+}
+
+void test_import_bad_magic(void) {
+  size_t length = do_export();
+  export_buffer[0] = 'X';
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET,
+                    he_conn_import(&imported, &ssl_ctx, NULL, export_buffer, length));
+}
+
+void test_import_tampered(void) {
+  size_t length = do_export();
+  export_buffer[length / 2] ^= 0x01;
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET,
+                    he_conn_import(&imported, &ssl_ctx, NULL, export_buffer, length));
+  TEST_ASSERT_NULL(imported.wolf_ssl);
+}
+
+void test_import_tampered_header(void) {
+  size_t length = do_export();
+  // The IV is authenticated along with the rest of the header
+  export_buffer[sizeof(he_conn_export_hdr_t) - 1] ^= 0x01;
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET,
+                    he_conn_import(&imported, &ssl_ctx, NULL, export_buffer, length));
+}
+
+void test_import_wrong_key(void) {
+  size_t length = do_export();
+  uint8_t other_key[HE_EXPORT_KEY_LENGTH] = {0};
+  he_ssl_ctx_set_export_key(&ssl_ctx, other_key, sizeof(other_key));
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET,
+                    he_conn_import(&imported, &ssl_ctx, NULL, export_buffer, length));
+}
+
+void test_import_unsupported_version(void) {
+  size_t length = do_export();
+  ssl_ctx.minimum_supported_version.major_version = 2;
+  ssl_ctx.maximum_supported_version.major_version = 2;
+  TEST_ASSERT_EQUAL(HE_ERR_INCORRECT_PROTOCOL_VERSION,
+                    he_conn_import(&imported, &ssl_ctx, NULL, export_buffer, length));
+}
+
+void test_import_wolf_failure(void) {
+  size_t length = do_export();
+
+  wolfSSL_new_ExpectAndReturn(ssl_ctx.wolf_ctx, &imported_wolf_ssl);
+  wolfSSL_dtls_set_using_nonblock_Expect(&imported_wolf_ssl, 1);
+  wolfSSL_dtls_set_mtu_ExpectAndReturn(&imported_wolf_ssl, calculate_wolf_mtu(HE_MAX_WIRE_MTU),
+                                       SSL_SUCCESS);
+  wolfSSL_SetIOWriteCtx_Expect(&imported_wolf_ssl, &imported);
+  wolfSSL_SetIOReadCtx_Expect(&imported_wolf_ssl, &imported);
+  wolfSSL_dtls_import_ExpectAnyArgsAndReturn(VERSION_ERROR);
+
+  TEST_ASSERT_EQUAL(HE_ERR_SSL_ERROR,
+                    he_conn_import(&imported, &ssl_ctx, NULL, export_buffer, length));
+  TEST_ASSERT_NOT_EQUAL(HE_STATE_ONLINE, imported.state);
+}
+
+void test_export_import_round_trip(void) {
+  size_t length = do_export();
+  ssl_ctx.padding_type = HE_PADDING_NONE;
+
+  wolfSSL_new_ExpectAndReturn(ssl_ctx.wolf_ctx, &imported_wolf_ssl);
+  wolfSSL_dtls_set_using_nonblock_Expect(&imported_wolf_ssl, 1);
+  wolfSSL_dtls_set_mtu_ExpectAndReturn(&imported_wolf_ssl, calculate_wolf_mtu(HE_MAX_WIRE_MTU),
+                                       SSL_SUCCESS);
+  wolfSSL_SetIOWriteCtx_Expect(&imported_wolf_ssl, &imported);
+  wolfSSL_SetIOReadCtx_Expect(&imported_wolf_ssl, &imported);
+  wolfSSL_dtls_import_Stub(fixture_wolfSSL_dtls_import);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_import(&imported, &ssl_ctx, NULL, export_buffer, length));
+
+  TEST_ASSERT_EQUAL(HE_STATE_ONLINE, imported.state);
+  TEST_ASSERT_EQUAL(&imported_wolf_ssl, imported.wolf_ssl);
+  TEST_ASSERT_EQUAL(conn.session_id, imported.session_id);
+  TEST_ASSERT_EQUAL(0, imported.pending_session_id);
+  TEST_ASSERT_TRUE(imported.is_server);
+  TEST_ASSERT_TRUE(imported.first_message_received);
+  TEST_ASSERT_EQUAL(HE_MAX_WIRE_MTU, imported.outside_mtu);
+  TEST_ASSERT_EQUAL(1, imported.protocol_version.major_version);
+  TEST_ASSERT_EQUAL(1, imported.protocol_version.minor_version);
+  // Negotiated values come from the export, not the new context
+  TEST_ASSERT_EQUAL(HE_PADDING_450, imported.padding_type);
+  TEST_ASSERT_EQUAL(ssl_ctx.export_key, imported.export_key);
+}
+
+void test_export_import_keeps_inner_mtu(void) {
+  conn.inner_mtu = 9000;
+  conn.client_ip = htonl(0x0A7D0002);
+  size_t length = do_export();
+
+  wolfSSL_new_ExpectAndReturn(ssl_ctx.wolf_ctx, &imported_wolf_ssl);
+  wolfSSL_dtls_set_using_nonblock_Expect(&imported_wolf_ssl, 1);
+  wolfSSL_dtls_set_mtu_ExpectAndReturn(&imported_wolf_ssl, calculate_wolf_mtu(HE_MAX_WIRE_MTU),
+                                       SSL_SUCCESS);
+  wolfSSL_SetIOWriteCtx_Expect(&imported_wolf_ssl, &imported);
+  wolfSSL_SetIOReadCtx_Expect(&imported_wolf_ssl, &imported);
+  wolfSSL_dtls_import_Stub(fixture_wolfSSL_dtls_import);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_import(&imported, &ssl_ctx, NULL, export_buffer, length));
+
+  // Agreed with the peer, so it survives even though the new context doesn't offer it
+  TEST_ASSERT_EQUAL(9000, imported.inner_mtu);
+  // So is the address the client was given
+  TEST_ASSERT_EQUAL(htonl(0x0A7D0002), imported.client_ip);
+}
+
+void test_export_import_keeps_pmtud_results(void) {
+  conn.effective_mtu = 1400;
+  conn.peer_mtu = 1300;
+  size_t length = do_export();
+
+  wolfSSL_new_ExpectAndReturn(ssl_ctx.wolf_ctx, &imported_wolf_ssl);
+  wolfSSL_dtls_set_using_nonblock_Expect(&imported_wolf_ssl, 1);
+  // Held to the smaller of the two straight away
+  wolfSSL_dtls_set_mtu_ExpectAndReturn(&imported_wolf_ssl, HE_PMTUD_WOLF_MTU(1300), SSL_SUCCESS);
+  wolfSSL_SetIOWriteCtx_Expect(&imported_wolf_ssl, &imported);
+  wolfSSL_SetIOReadCtx_Expect(&imported_wolf_ssl, &imported);
+  wolfSSL_dtls_import_Stub(fixture_wolfSSL_dtls_import);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_import(&imported, &ssl_ctx, NULL, export_buffer, length));
+
+  TEST_ASSERT_EQUAL(1400, imported.effective_mtu);
+  TEST_ASSERT_EQUAL(1300, imported.peer_mtu);
+  TEST_ASSERT_EQUAL(1300, he_conn_get_effective_mtu(&imported));
+}
+
+void test_export_import_claims_pool_address(void) {
+  conn.pool_address = 0x0A7D0005;
+  size_t length = do_export();
+
+  he_internal_ip_pool_claim_ExpectAndReturn(&imported, 0x0A7D0005, HE_SUCCESS);
+  wolfSSL_new_ExpectAndReturn(ssl_ctx.wolf_ctx, &imported_wolf_ssl);
+  wolfSSL_dtls_set_using_nonblock_Expect(&imported_wolf_ssl, 1);
+  wolfSSL_dtls_set_mtu_ExpectAndReturn(&imported_wolf_ssl, calculate_wolf_mtu(HE_MAX_WIRE_MTU),
+                                       SSL_SUCCESS);
+  wolfSSL_SetIOWriteCtx_Expect(&imported_wolf_ssl, &imported);
+  wolfSSL_SetIOReadCtx_Expect(&imported_wolf_ssl, &imported);
+  wolfSSL_dtls_import_Stub(fixture_wolfSSL_dtls_import);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_import(&imported, &ssl_ctx, NULL, export_buffer, length));
+}
+
+void test_import_pool_address_taken(void) {
+  conn.pool_address = 0x0A7D0005;
+  size_t length = do_export();
+
+  he_internal_ip_pool_claim_ExpectAndReturn(&imported, 0x0A7D0005, HE_ERR_IP_POOL_ADDRESS_TAKEN);
+
+  TEST_ASSERT_EQUAL(HE_ERR_IP_POOL_ADDRESS_TAKEN,
+                    he_conn_import(&imported, &ssl_ctx, NULL, export_buffer, length));
+  TEST_ASSERT_NULL(imported.wolf_ssl);
+  TEST_ASSERT_NOT_EQUAL(HE_STATE_ONLINE, imported.state);
+}
+
+#pragma pack(1)
+// Helium's state as the first version of the format laid it out
+typedef struct export_state_v1 {
+  uint64_t session_id;
+  uint64_t pending_session_id;
+  uint8_t major_version;
+  uint8_t minor_version;
+  uint8_t is_server;
+  uint8_t padding_type;
+  uint8_t disable_roaming_connections;
+  uint8_t use_aggressive_mode;
+  uint16_t outside_mtu;
+  uint32_t wolf_length;
+} export_state_v1_t;
+#pragma pack()
+
+static size_t build_v1_export(void) {
+  he_conn_export_hdr_t *hdr = (he_conn_export_hdr_t *)export_buffer;
+  export_state_v1_t *state = (export_state_v1_t *)(export_buffer + sizeof(he_conn_export_hdr_t));
+  size_t plaintext_length = sizeof(export_state_v1_t) + sizeof(fake_wolf_state);
+  uint8_t *tag = (uint8_t *)state + plaintext_length;
+
+  state->session_id = 0x1122334455667788;
+  state->major_version = 1;
+  state->minor_version = 1;
+  state->is_server = 1;
+  state->padding_type = HE_PADDING_450;
+  state->outside_mtu = HE_MAX_WIRE_MTU;
+  state->wolf_length = sizeof(fake_wolf_state);
+  memcpy(state + 1, fake_wolf_state, sizeof(fake_wolf_state));
+
+  hdr->magic[0] = 'H';
+  hdr->magic[1] = 'x';
+  hdr->version = 1;
+  hdr->length = htonl((uint32_t)plaintext_length);
+  memset(hdr->iv, 0x24, sizeof(hdr->iv));
+
+  Aes aes;
+  TEST_ASSERT_EQUAL(0, wc_AesInit(&aes, NULL, INVALID_DEVID));
+  TEST_ASSERT_EQUAL(0, wc_AesGcmSetKey(&aes, export_key, sizeof(export_key)));
+  TEST_ASSERT_EQUAL(0, wc_AesGcmEncrypt(&aes, (uint8_t *)state, (uint8_t *)state,
+                                        plaintext_length, hdr->iv, sizeof(hdr->iv), tag,
+                                        HE_CONN_EXPORT_TAG_SIZE, (uint8_t *)hdr, sizeof(*hdr)));
+  wc_AesFree(&aes);
+
+  return sizeof(he_conn_export_hdr_t) + plaintext_length + HE_CONN_EXPORT_TAG_SIZE;
+}
+
+void test_import_version_1(void) {
+  size_t length = build_v1_export();
+
+  wolfSSL_new_ExpectAndReturn(ssl_ctx.wolf_ctx, &imported_wolf_ssl);
+  wolfSSL_dtls_set_using_nonblock_Expect(&imported_wolf_ssl, 1);
+  wolfSSL_dtls_set_mtu_ExpectAndReturn(&imported_wolf_ssl, calculate_wolf_mtu(HE_MAX_WIRE_MTU),
+                                       SSL_SUCCESS);
+  wolfSSL_SetIOWriteCtx_Expect(&imported_wolf_ssl, &imported);
+  wolfSSL_SetIOReadCtx_Expect(&imported_wolf_ssl, &imported);
+  wolfSSL_dtls_import_Stub(fixture_wolfSSL_dtls_import);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_import(&imported, &ssl_ctx, NULL, export_buffer, length));
+
+  TEST_ASSERT_EQUAL(HE_STATE_ONLINE, imported.state);
+  TEST_ASSERT_EQUAL(0x1122334455667788, imported.session_id);
+  TEST_ASSERT_TRUE(imported.is_server);
+  TEST_ASSERT_EQUAL(HE_PADDING_450, imported.padding_type);
+  TEST_ASSERT_EQUAL(HE_MAX_WIRE_MTU, imported.outside_mtu);
+  // Added in later versions, so they take their defaults
+  TEST_ASSERT_EQUAL(0, imported.inner_mtu);
+  TEST_ASSERT_EQUAL(0, imported.client_ip);
+  TEST_ASSERT_EQUAL(0, imported.pool_address);
+}
+
+void test_import_version_1_truncated(void) {
+  build_v1_export();
+  he_conn_export_hdr_t *hdr = (he_conn_export_hdr_t *)export_buffer;
+
+  // Too short to hold even the version 1 state
+  hdr->length = htonl(sizeof(export_state_v1_t) - 1);
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET,
+                    he_conn_import(&imported, &ssl_ctx, NULL, export_buffer,
+                                   sizeof(he_conn_export_hdr_t) + sizeof(export_state_v1_t) - 1 +
+                                       HE_CONN_EXPORT_TAG_SIZE));
+}
+
+void test_import_newer_version(void) {
+  size_t length = do_export();
+  export_buffer[2] = HE_CONN_EXPORT_VERSION + 1;
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET,
+                    he_conn_import(&imported, &ssl_ctx, NULL, export_buffer, length));
+}
+
+void test_hibernate_null_pointers(void) {
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_hibernate(NULL, &ssl_ctx));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_hibernate(&conn, NULL));
+}
+
+void test_hibernate_not_online(void) {
+  conn.state = HE_STATE_AUTHENTICATING;
+  TEST_ASSERT_EQUAL(HE_ERR_INVALID_CLIENT_STATE, he_conn_hibernate(&conn, &ssl_ctx));
+  TEST_ASSERT_FALSE(he_conn_is_hibernating(&conn));
+}
+
+static void expect_hibernate(void) {
+  wolfSSL_dtls_export_Stub(fixture_wolfSSL_dtls_export);
+  wc_InitRng_IgnoreAndReturn(0);
+  wc_RNG_GenerateBlock_IgnoreAndReturn(0);
+  wc_FreeRng_IgnoreAndReturn(0);
+#ifdef WOLFSSL_DTLS_DROP_STATS
+  wolfSSL_dtls_get_drop_stats_IgnoreAndReturn(SSL_FATAL_ERROR);
+#endif
+  wolfSSL_free_Expect(&wolf_ssl);
+}
+
+static void hibernate(void) {
+  expect_hibernate();
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_hibernate(&conn, &ssl_ctx));
+}
+
+void test_hibernate(void) {
+  hibernate();
+
+  TEST_ASSERT_TRUE(he_conn_is_hibernating(&conn));
+  TEST_ASSERT_NULL(conn.wolf_ssl);
+  TEST_ASSERT_EQUAL(HE_STATE_ONLINE, conn.state);
+  TEST_ASSERT_EQUAL(&ssl_ctx, conn.hibernated_ctx);
+
+  // Hibernating twice is harmless
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_hibernate(&conn, &ssl_ctx));
+
+  he_internal_free(conn.hibernated_state);
+}
+
+void test_hibernate_if_idle_null_pointers(void) {
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_hibernate_if_idle(NULL, &ssl_ctx));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_hibernate_if_idle(&conn, NULL));
+}
+
+void test_hibernate_if_idle_not_online(void) {
+  he_ssl_ctx_set_hibernate_idle_time(&ssl_ctx, 60000);
+  conn.state = HE_STATE_AUTHENTICATING;
+  TEST_ASSERT_EQUAL(HE_ERR_INVALID_CLIENT_STATE, he_conn_hibernate_if_idle(&conn, &ssl_ctx));
+}
+
+void test_hibernate_if_idle_disabled(void) {
+  // No idle time, so the clock isn't even looked at
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_hibernate_if_idle(&conn, &ssl_ctx));
+  TEST_ASSERT_FALSE(he_conn_is_hibernating(&conn));
+}
+
+void test_hibernate_if_idle(void) {
+  he_ssl_ctx_set_hibernate_idle_time(&ssl_ctx, 60000);
+
+  // The first call starts the idle clock
+  he_internal_clock_ms_ExpectAndReturn(1000);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_hibernate_if_idle(&conn, &ssl_ctx));
+
+  // Traffic either way restarts it
+  conn.rx_records++;
+  he_internal_clock_ms_ExpectAndReturn(50000);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_hibernate_if_idle(&conn, &ssl_ctx));
+  conn.counters.inside_rx_packets++;
+  he_internal_clock_ms_ExpectAndReturn(100000);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_hibernate_if_idle(&conn, &ssl_ctx));
+
+  // Not idle for long enough yet
+  he_internal_clock_ms_ExpectAndReturn(159999);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_hibernate_if_idle(&conn, &ssl_ctx));
+  TEST_ASSERT_FALSE(he_conn_is_hibernating(&conn));
+
+  he_internal_clock_ms_ExpectAndReturn(160000);
+  expect_hibernate();
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_hibernate_if_idle(&conn, &ssl_ctx));
+  TEST_ASSERT_TRUE(he_conn_is_hibernating(&conn));
+
+  // Already hibernating
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_hibernate_if_idle(&conn, &ssl_ctx));
+
+  he_internal_free(conn.hibernated_state);
+}
+
+void test_wake(void) {
+  // Still held, so it isn't claimed again
+  conn.pool_address = 0x0A7D0005;
+  hibernate();
+
+  wolfSSL_new_ExpectAndReturn(ssl_ctx.wolf_ctx, &imported_wolf_ssl);
+  wolfSSL_dtls_set_using_nonblock_Expect(&imported_wolf_ssl, 1);
+  wolfSSL_dtls_set_mtu_ExpectAndReturn(&imported_wolf_ssl, calculate_wolf_mtu(HE_MAX_WIRE_MTU),
+                                       SSL_SUCCESS);
+  wolfSSL_SetIOWriteCtx_Expect(&imported_wolf_ssl, &conn);
+  wolfSSL_SetIOReadCtx_Expect(&imported_wolf_ssl, &conn);
+  wolfSSL_dtls_import_Stub(fixture_wolfSSL_dtls_import);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_conn_wake(&conn));
+
+  TEST_ASSERT_FALSE(he_conn_is_hibernating(&conn));
+  TEST_ASSERT_EQUAL(&imported_wolf_ssl, conn.wolf_ssl);
+  TEST_ASSERT_EQUAL(HE_STATE_ONLINE, conn.state);
+  TEST_ASSERT_EQUAL(0x1122334455667788, conn.session_id);
+  TEST_ASSERT_EQUAL(0x0A7D0005, conn.pool_address);
+}
+
+static void expect_wake(void) {
+  wolfSSL_new_ExpectAndReturn(ssl_ctx.wolf_ctx, &imported_wolf_ssl);
+  wolfSSL_dtls_set_using_nonblock_Expect(&imported_wolf_ssl, 1);
+  wolfSSL_dtls_set_mtu_ExpectAndReturn(&imported_wolf_ssl, calculate_wolf_mtu(HE_MAX_WIRE_MTU),
+                                       SSL_SUCCESS);
+  wolfSSL_SetIOWriteCtx_Expect(&imported_wolf_ssl, &conn);
+  wolfSSL_SetIOReadCtx_Expect(&imported_wolf_ssl, &conn);
+  wolfSSL_dtls_import_Stub(fixture_wolfSSL_dtls_import);
+}
+
+void test_wake_keeps_timer_wheel(void) {
+  he_timers_t context_timers = {0};
+  he_timers_t thread_timers = {0};
+  ssl_ctx.timers = &context_timers;
+  // The connection was handed to a thread with its own wheel
+  conn.timers = &thread_timers;
+  hibernate();
+
+  expect_wake();
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_conn_wake(&conn));
+
+  TEST_ASSERT_EQUAL_PTR(&thread_timers, conn.timers);
+}
+
+void test_wake_keeps_nudge_time_cb(void) {
+  he_timers_t context_timers = {0};
+  ssl_ctx.timers = &context_timers;
+  // The host moved the connection off the wheel with he_conn_set_timers(conn, NULL)
+  conn.timers = NULL;
+  hibernate();
+
+  expect_wake();
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_conn_wake(&conn));
+
+  TEST_ASSERT_NULL(conn.timers);
+}
+
+void test_import_timer_wheel(void) {
+  he_timers_t context_timers = {0};
+  he_timers_t thread_timers = {0};
+  ssl_ctx.timers = &context_timers;
+  size_t length = do_export();
+
+  wolfSSL_new_ExpectAndReturn(ssl_ctx.wolf_ctx, &imported_wolf_ssl);
+  wolfSSL_dtls_set_using_nonblock_Expect(&imported_wolf_ssl, 1);
+  wolfSSL_dtls_set_mtu_ExpectAndReturn(&imported_wolf_ssl, calculate_wolf_mtu(HE_MAX_WIRE_MTU),
+                                       SSL_SUCCESS);
+  wolfSSL_SetIOWriteCtx_Expect(&imported_wolf_ssl, &imported);
+  wolfSSL_SetIOReadCtx_Expect(&imported_wolf_ssl, &imported);
+  wolfSSL_dtls_import_Stub(fixture_wolfSSL_dtls_import);
+
+  // A wheel set before the import is kept rather than the context's
+  imported.timers = &thread_timers;
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_import(&imported, &ssl_ctx, NULL, export_buffer, length));
+  TEST_ASSERT_EQUAL_PTR(&thread_timers, imported.timers);
+}
+
+void test_wake_failure_disconnects(void) {
+  hibernate();
+
+  wolfSSL_new_ExpectAndReturn(ssl_ctx.wolf_ctx, NULL);
+  wolfSSL_free_Expect(NULL);
+
+  TEST_ASSERT_EQUAL(HE_ERR_INIT_FAILED, he_internal_conn_wake(&conn));
+
+  TEST_ASSERT_FALSE(he_conn_is_hibernating(&conn));
+  TEST_ASSERT_EQUAL(HE_STATE_DISCONNECTED, conn.state);
+}
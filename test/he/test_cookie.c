@@ -0,0 +1,351 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <he.h>
+#include "unity.h"
+#include "test_defs.h"
+
+// Unit under test
+#include "cookie.h"
+
+// Internal Mocks
+#include "mock_ssl_ctx.h"
+
+he_ssl_ctx_t ctx;
+
+uint8_t peer[] = {0x02, 0x00, 0x1f, 0x90, 0x7f, 0x00, 0x00, 0x01};
+
+uint8_t packet[HE_MAX_WIRE_MTU];
+size_t packet_length;
+
+uint8_t response[HE_MAX_WIRE_MTU];
+size_t response_length;
+
+static void build_client_hello(const uint8_t *cookie, uint8_t cookie_length) {
+  uint8_t *p = packet;
+
+  he_wire_hdr_t *hdr = (he_wire_hdr_t *)p;
+  memset(hdr, 0, sizeof(he_wire_hdr_t));
+  hdr->he[0] = 'H';
+  hdr->he[1] = 'e';
+  hdr->major_version = 1;
+  hdr->minor_version = 1;
+  p += sizeof(he_wire_hdr_t);
+
+  uint8_t *record = p;
+  p += HE_DTLS_RECORD_HEADER_SIZE;
+  uint8_t *hs = p;
+  p += HE_DTLS_HANDSHAKE_HEADER_SIZE;
+  uint8_t *body = p;
+
+  // Version and random
+  *p++ = 0xfe;
+  *p++ = 0xfd;
+  for(int i = 0; i < HE_DTLS_RANDOM_SIZE; i++) {
+    *p++ = (uint8_t)i;
+  }
+
+  // Empty session ID
+  *p++ = 0;
+
+  // Cookie
+  *p++ = cookie_length;
+  if(cookie_length) {
+    memcpy(p, cookie, cookie_length);
+  }
+  p += cookie_length;
+
+  // Two cipher suites
+  *p++ = 0;
+  *p++ = 4;
+  *p++ = 0xc0;
+  *p++ = 0x30;
+  *p++ = 0xcc;
+  *p++ = 0xa8;
+
+  // Null compression
+  *p++ = 1;
+  *p++ = 0;
+
+  size_t body_length = p - body;
+
+  record[0] = 22;
+  record[1] = 0xfe;
+  record[2] = 0xfd;
+  memset(record + 3, 0, 8);
+  record[10] = 7;
+  record[11] = (uint8_t)((body_length + HE_DTLS_HANDSHAKE_HEADER_SIZE) >> 8);
+  record[12] = (uint8_t)(body_length + HE_DTLS_HANDSHAKE_HEADER_SIZE);
+
+  memset(hs, 0, HE_DTLS_HANDSHAKE_HEADER_SIZE);
+  hs[0] = 1;
+  hs[2] = (uint8_t)(body_length >> 8);
+  hs[3] = (uint8_t)body_length;
+  hs[10] = (uint8_t)(body_length >> 8);
+  hs[11] = (uint8_t)body_length;
+
+  packet_length = p - packet;
+}
+
+void setUp(void) {
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.connection_type = HE_CONNECTION_TYPE_DATAGRAM;
+  ctx.use_stateless_cookies = true;
+  memset(ctx.cookie_secret, 0x42, sizeof(ctx.cookie_secret));
+
+  memset(packet, 0, sizeof(packet));
+  memset(response, 0, sizeof(response));
+  response_length = sizeof(response);
+
+  build_client_hello(NULL, 0);
+}
+
+void tearDown(void) {
+}
+
+static uint8_t *request_cookie(void) {
+  he_ssl_ctx_is_supported_version_ExpectAndReturn(&ctx, 1, 1, true);
+  he_return_code_t res = he_ssl_ctx_verify_client_hello(
+      &ctx, peer, sizeof(peer), packet, packet_length, response, &response_length, NULL);
+  TEST_ASSERT_EQUAL(HE_WANT_COOKIE, res);
+  return response + sizeof(he_wire_hdr_t) + HE_DTLS_RECORD_HEADER_SIZE +
+         HE_DTLS_HANDSHAKE_HEADER_SIZE + 3;
+}
+
+void test_parse_client_hello(void) {
+  he_client_hello_t hello = {0};
+  he_return_code_t res = he_internal_parse_client_hello(
+      packet + sizeof(he_wire_hdr_t), packet_length - sizeof(he_wire_hdr_t), &hello);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+  TEST_ASSERT_EQUAL(1, hello.session_id_length);
+  TEST_ASSERT_EQUAL(0, hello.cookie_length);
+  TEST_ASSERT_EQUAL(6, hello.cipher_suites_length);
+  TEST_ASSERT_EQUAL(2, hello.compression_methods_length);
+  TEST_ASSERT_EQUAL(7, hello.record_sequence[5]);
+}
+
+void test_parse_client_hello_truncated(void) {
+  he_client_hello_t hello = {0};
+
+  // Every truncation of a valid ClientHello must be rejected
+  for(size_t len = 0; len < packet_length - sizeof(he_wire_hdr_t); len++) {
+    he_return_code_t res =
+        he_internal_parse_client_hello(packet + sizeof(he_wire_hdr_t), len, &hello);
+    TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET, res);
+  }
+}
+
+void test_parse_client_hello_wrong_handshake_type(void) {
+  he_client_hello_t hello = {0};
+  packet[sizeof(he_wire_hdr_t) + HE_DTLS_RECORD_HEADER_SIZE] = 2;
+
+  he_return_code_t res = he_internal_parse_client_hello(
+      packet + sizeof(he_wire_hdr_t), packet_length - sizeof(he_wire_hdr_t), &hello);
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET, res);
+}
+
+void test_parse_client_hello_non_zero_epoch(void) {
+  he_client_hello_t hello = {0};
+  packet[sizeof(he_wire_hdr_t) + 4] = 1;
+
+  he_return_code_t res = he_internal_parse_client_hello(
+      packet + sizeof(he_wire_hdr_t), packet_length - sizeof(he_wire_hdr_t), &hello);
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET, res);
+}
+
+void test_parse_client_hello_fragmented(void) {
+  he_client_hello_t hello = {0};
+  // Shorten the fragment length so it no longer covers the whole message
+  packet[sizeof(he_wire_hdr_t) + HE_DTLS_RECORD_HEADER_SIZE + 11] -= 1;
+
+  he_return_code_t res = he_internal_parse_client_hello(
+      packet + sizeof(he_wire_hdr_t), packet_length - sizeof(he_wire_hdr_t), &hello);
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET, res);
+}
+
+void test_verify_client_hello_null_pointers(void) {
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER,
+                    he_ssl_ctx_verify_client_hello(NULL, peer, sizeof(peer), packet, packet_length,
+                                                   response, &response_length, NULL));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER,
+                    he_ssl_ctx_verify_client_hello(&ctx, NULL, sizeof(peer), packet, packet_length,
+                                                   response, &response_length, NULL));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER,
+                    he_ssl_ctx_verify_client_hello(&ctx, peer, sizeof(peer), NULL, packet_length,
+                                                   response, &response_length, NULL));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER,
+                    he_ssl_ctx_verify_client_hello(&ctx, peer, sizeof(peer), packet, packet_length,
+                                                   NULL, &response_length, NULL));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER,
+                    he_ssl_ctx_verify_client_hello(&ctx, peer, sizeof(peer), packet, packet_length,
+                                                   response, NULL, NULL));
+}
+
+void test_verify_client_hello_streaming(void) {
+  ctx.connection_type = HE_CONNECTION_TYPE_STREAM;
+  he_return_code_t res = he_ssl_ctx_verify_client_hello(
+      &ctx, peer, sizeof(peer), packet, packet_length, response, &response_length, NULL);
+  TEST_ASSERT_EQUAL(HE_ERR_INVALID_CONNECTION_TYPE, res);
+}
+
+void test_verify_client_hello_not_enabled(void) {
+  ctx.use_stateless_cookies = false;
+  he_return_code_t res = he_ssl_ctx_verify_client_hello(
+      &ctx, peer, sizeof(peer), packet, packet_length, response, &response_length, NULL);
+  TEST_ASSERT_EQUAL(HE_ERR_INVALID_CLIENT_STATE, res);
+}
+
+void test_verify_client_hello_not_helium(void) {
+  packet[0] = 'X';
+  he_return_code_t res = he_ssl_ctx_verify_client_hello(
+      &ctx, peer, sizeof(peer), packet, packet_length, response, &response_length, NULL);
+  TEST_ASSERT_EQUAL(HE_ERR_NOT_HE_PACKET, res);
+}
+
+void test_verify_client_hello_unsupported_version(void) {
+  he_ssl_ctx_is_supported_version_ExpectAndReturn(&ctx, 1, 1, false);
+  he_return_code_t res = he_ssl_ctx_verify_client_hello(
+      &ctx, peer, sizeof(peer), packet, packet_length, response, &response_length, NULL);
+  TEST_ASSERT_EQUAL(HE_ERR_INCORRECT_PROTOCOL_VERSION, res);
+}
+
+void test_verify_client_hello_no_cookie(void) {
+  uint8_t *cookie = request_cookie();
+
+  TEST_ASSERT_EQUAL(sizeof(he_wire_hdr_t) + HE_DTLS_RECORD_HEADER_SIZE +
+                        HE_DTLS_HANDSHAKE_HEADER_SIZE + 3 + HE_COOKIE_LENGTH,
+                    response_length);
+
+  // Wire header is echoed back without a session
+  he_wire_hdr_t *hdr = (he_wire_hdr_t *)response;
+  TEST_ASSERT_EQUAL('H', hdr->he[0]);
+  TEST_ASSERT_EQUAL('e', hdr->he[1]);
+  TEST_ASSERT_EQUAL(1, hdr->major_version);
+  TEST_ASSERT_EQUAL(1, hdr->minor_version);
+  TEST_ASSERT_EQUAL(0, hdr->session);
+
+  // Record header echoes the ClientHello sequence number
+  uint8_t *record = response + sizeof(he_wire_hdr_t);
+  TEST_ASSERT_EQUAL(22, record[0]);
+  TEST_ASSERT_EQUAL(7, record[10]);
+
+  // HelloVerifyRequest
+  TEST_ASSERT_EQUAL(3, record[HE_DTLS_RECORD_HEADER_SIZE]);
+  TEST_ASSERT_EQUAL(HE_COOKIE_LENGTH, *(cookie - 1));
+}
+
+void test_verify_client_hello_valid_cookie(void) {
+  uint8_t cookie[HE_COOKIE_LENGTH] = {0};
+  memcpy(cookie, request_cookie(), sizeof(cookie));
+
+  build_client_hello(cookie, sizeof(cookie));
+  response_length = sizeof(response);
+
+  bool previous_secret = true;
+  he_ssl_ctx_is_supported_version_ExpectAndReturn(&ctx, 1, 1, true);
+  he_return_code_t res =
+      he_ssl_ctx_verify_client_hello(&ctx, peer, sizeof(peer), packet, packet_length, response,
+                                     &response_length, &previous_secret);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+  TEST_ASSERT_FALSE(previous_secret);
+}
+
+void test_verify_client_hello_cookie_from_other_peer(void) {
+  uint8_t cookie[HE_COOKIE_LENGTH] = {0};
+  memcpy(cookie, request_cookie(), sizeof(cookie));
+
+  build_client_hello(cookie, sizeof(cookie));
+  response_length = sizeof(response);
+
+  uint8_t other_peer[] = {0x02, 0x00, 0x1f, 0x90, 0x7f, 0x00, 0x00, 0x02};
+  he_ssl_ctx_is_supported_version_ExpectAndReturn(&ctx, 1, 1, true);
+  he_return_code_t res =
+      he_ssl_ctx_verify_client_hello(&ctx, other_peer, sizeof(other_peer), packet, packet_length,
+                                     response, &response_length, NULL);
+  TEST_ASSERT_EQUAL(HE_WANT_COOKIE, res);
+}
+
+void test_verify_client_hello_tampered_cookie(void) {
+  uint8_t cookie[HE_COOKIE_LENGTH] = {0};
+  memcpy(cookie, request_cookie(), sizeof(cookie));
+  cookie[0] ^= 1;
+
+  build_client_hello(cookie, sizeof(cookie));
+  response_length = sizeof(response);
+
+  he_ssl_ctx_is_supported_version_ExpectAndReturn(&ctx, 1, 1, true);
+  he_return_code_t res = he_ssl_ctx_verify_client_hello(
+      &ctx, peer, sizeof(peer), packet, packet_length, response, &response_length, NULL);
+  TEST_ASSERT_EQUAL(HE_WANT_COOKIE, res);
+}
+
+void test_verify_client_hello_previous_secret(void) {
+  uint8_t cookie[HE_COOKIE_LENGTH] = {0};
+  memcpy(cookie, request_cookie(), sizeof(cookie));
+
+  // Rotate the secret by hand
+  memcpy(ctx.previous_cookie_secret, ctx.cookie_secret, sizeof(ctx.cookie_secret));
+  ctx.has_previous_cookie_secret = true;
+  memset(ctx.cookie_secret, 0x24, sizeof(ctx.cookie_secret));
+
+  build_client_hello(cookie, sizeof(cookie));
+  response_length = sizeof(response);
+
+  // WolfSSL has to be told which secret issued the cookie
+  bool previous_secret = false;
+  he_ssl_ctx_is_supported_version_ExpectAndReturn(&ctx, 1, 1, true);
+  he_return_code_t res =
+      he_ssl_ctx_verify_client_hello(&ctx, peer, sizeof(peer), packet, packet_length, response,
+                                     &response_length, &previous_secret);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+  TEST_ASSERT_TRUE(previous_secret);
+
+  // ...but not after a second rotation
+  memset(ctx.previous_cookie_secret, 0x24, sizeof(ctx.previous_cookie_secret));
+  memset(ctx.cookie_secret, 0x99, sizeof(ctx.cookie_secret));
+  response_length = sizeof(response);
+
+  he_ssl_ctx_is_supported_version_ExpectAndReturn(&ctx, 1, 1, true);
+  res = he_ssl_ctx_verify_client_hello(&ctx, peer, sizeof(peer), packet, packet_length, response,
+                                       &response_length, NULL);
+  TEST_ASSERT_EQUAL(HE_WANT_COOKIE, res);
+}
+
+void test_verify_client_hello_response_too_small(void) {
+  response_length = 10;
+  he_ssl_ctx_is_supported_version_ExpectAndReturn(&ctx, 1, 1, true);
+  he_return_code_t res = he_ssl_ctx_verify_client_hello(
+      &ctx, peer, sizeof(peer), packet, packet_length, response, &response_length, NULL);
+  TEST_ASSERT_EQUAL(HE_ERR_PACKET_TOO_LARGE, res);
+}
+
+void test_verify_client_hello_peer_too_large(void) {
+  uint8_t big_peer[HE_MAX_PEER_ADDRESS_LENGTH + 1] = {0};
+  he_return_code_t res = he_ssl_ctx_verify_client_hello(
+      &ctx, big_peer, sizeof(big_peer), packet, packet_length, response, &response_length, NULL);
+  TEST_ASSERT_EQUAL(HE_ERR_PACKET_TOO_LARGE, res);
+}
+
+void test_verify_client_hello_cookie_is_deterministic(void) {
+  uint8_t first[HE_COOKIE_LENGTH] = {0};
+  memcpy(first, request_cookie(), sizeof(first));
+
+  response_length = sizeof(response);
+  TEST_ASSERT_EQUAL_MEMORY(first, request_cookie(), sizeof(first));
+}
@@ -23,7 +23,11 @@
 // Unit under test
 #include "core.h"
 
+// Direct Includes for Utility Functions
+#include "metrics.h"
+
 he_conn_t *conn;
+he_ssl_ctx_t ctx;
 
 void setUp(void) {
   conn = calloc(1, sizeof(he_conn_t));
@@ -31,6 +35,7 @@ void setUp(void) {
 
 void tearDown(void) {
   free(conn);
+  memset(&ctx, 0, sizeof(ctx));
 }
 
 void test_he_internal_stream_setup_state_overwrite(void) {
@@ -39,3 +44,56 @@ void test_he_internal_stream_setup_state_overwrite(void) {
 
   TEST_ASSERT_EQUAL(HE_ERR_SSL_ERROR, res);
 }
+
+void test_he_internal_count_drop(void) {
+  he_internal_count_drop(conn, HE_ERR_PACKET_TOO_LARGE);
+  he_internal_count_drop(conn, HE_ERR_BAD_PACKET);
+  he_internal_count_drop(conn, HE_ERR_PACKET_TOO_LARGE);
+
+  TEST_ASSERT_EQUAL(HE_ERR_PACKET_TOO_LARGE, HE_CONN_DROP_REASON(conn->counters.drops[0].value));
+  TEST_ASSERT_EQUAL(2, HE_CONN_DROP_COUNT(conn->counters.drops[0].value));
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET, HE_CONN_DROP_REASON(conn->counters.drops[1].value));
+  TEST_ASSERT_EQUAL(1, HE_CONN_DROP_COUNT(conn->counters.drops[1].value));
+  TEST_ASSERT_EQUAL(0, conn->counters.drops[2].value);
+  TEST_ASSERT_EQUAL(0, conn->counters.other_drops);
+}
+
+void test_he_internal_count_drop_runs_out_of_slots(void) {
+  for(int i = 0; i < HE_CONN_DROP_SLOTS; i++) {
+    he_internal_count_drop(conn, -1 - i);
+  }
+  he_internal_count_drop(conn, -1 - HE_CONN_DROP_SLOTS);
+  he_internal_count_drop(conn, -1);
+
+  TEST_ASSERT_EQUAL(1, conn->counters.other_drops);
+  TEST_ASSERT_EQUAL(2, HE_CONN_DROP_COUNT(conn->counters.drops[0].value));
+  TEST_ASSERT_EQUAL(1, HE_CONN_DROP_COUNT(conn->counters.drops[HE_CONN_DROP_SLOTS - 1].value));
+}
+
+void test_he_internal_count_drop_unpackable_reasons(void) {
+  // Too large to keep a slot for, and not errors at all
+  he_internal_count_drop(conn, -(1 << HE_CONN_DROP_REASON_BITS));
+  he_internal_count_drop(conn, HE_SUCCESS);
+
+  TEST_ASSERT_EQUAL(2, conn->counters.other_drops);
+  TEST_ASSERT_EQUAL(0, conn->counters.drops[0].value);
+}
+
+void test_he_internal_count_drop_counts_past_32_bits(void) {
+  conn->counters.drops[0].value =
+      (0xFFFFFFFFull << HE_CONN_DROP_REASON_BITS) | (uint64_t)-HE_ERR_BAD_PACKET;
+  he_internal_count_drop(conn, HE_ERR_BAD_PACKET);
+
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET, HE_CONN_DROP_REASON(conn->counters.drops[0].value));
+  TEST_ASSERT_EQUAL_UINT64(0x100000000ull, HE_CONN_DROP_COUNT(conn->counters.drops[0].value));
+}
+
+void test_he_internal_count_drop_counts_plugin_drops_for_the_context(void) {
+  conn->metrics = &ctx.metrics;
+  he_internal_count_drop(conn, HE_ERR_PLUGIN_DROP);
+  he_internal_count_drop(conn, HE_ERR_BAD_PACKET);
+
+  he_metrics_t metrics = {0};
+  he_ssl_ctx_get_metrics(&ctx, &metrics);
+  TEST_ASSERT_EQUAL(1, metrics.plugin_drops);
+}
@@ -26,11 +26,20 @@
 // Direct Includes for Utility Functions
 #include "config.h"
 #include "core.h"
+#include "ipv4.h"
+#include "metrics.h"
+#include "route_table.h"
 #include <wolfssl/error-ssl.h>
 
 // Internal Mocks
 #include "mock_msg_handlers.h"
 #include "mock_conn.h"
+#include "mock_conn_export.h"
+#include "mock_clock.h"
+#include "mock_mss.h"
+#include "mock_frag.h"
+#include "mock_gso.h"
+#include "mock_ip_pool.h"
 #include "mock_fake_dispatch.h"
 #include "mock_plugin_chain.h"
 
@@ -47,6 +56,8 @@ size_t test_buffer_length = 1200;
 size_t test_packet_size = 1100;
 
 he_conn_t *conn = NULL;
+he_ssl_ctx_t ctx;
+he_metrics_t metrics;
 
 void setUp(void) {
   srand(time(NULL));
@@ -72,12 +83,16 @@ void setUp(void) {
   for(int a = 4; a < packet_max_length; a++) {
     packet[a] = rand() % 256;
   }
+
+  he_internal_gro_flush_Ignore();
 }
 
 void tearDown(void) {
   free(buffer);
   free(packet);
   free(conn);
+  memset(&ctx, 0, sizeof(ctx));
+  memset(&metrics, 0, sizeof(metrics));
 }
 
 he_return_code_t fixture_inside_packet_send_message(he_conn_t *conn, uint8_t *message,
@@ -117,6 +132,42 @@ void test_inside_pkt_received_too_large(void) {
   conn->outside_mtu = HE_MAX_MTU;
   res1 = he_conn_inside_packet_received(conn, fake_ipv4_packet, HE_MAX_MTU - 1);
   TEST_ASSERT_EQUAL(HE_ERR_PACKET_TOO_LARGE, res1);
+
+  TEST_ASSERT_EQUAL(HE_ERR_PACKET_TOO_LARGE, HE_CONN_DROP_REASON(conn->counters.drops[0].value));
+  TEST_ASSERT_EQUAL(2, HE_CONN_DROP_COUNT(conn->counters.drops[0].value));
+  TEST_ASSERT_EQUAL(0, conn->counters.inside_rx_packets);
+}
+
+void test_inside_pkt_received_too_large_for_effective_mtu(void) {
+  conn->state = HE_STATE_ONLINE;
+  conn->outside_mtu = HE_MAX_WIRE_MTU;
+  conn->effective_mtu = 1200;
+
+  he_conn_get_effective_mtu_ExpectAndReturn(conn, 1200);
+  int res1 = he_conn_inside_packet_received(conn, fake_ipv4_packet, 1201);
+  TEST_ASSERT_EQUAL(HE_ERR_PACKET_TOO_LARGE, res1);
+}
+
+void test_inside_pkt_received_too_large_for_peer_mtu(void) {
+  conn->state = HE_STATE_ONLINE;
+  conn->outside_mtu = HE_MAX_WIRE_MTU;
+  conn->peer_mtu = 1100;
+
+  he_conn_get_effective_mtu_ExpectAndReturn(conn, 1100);
+  int res1 = he_conn_inside_packet_received(conn, fake_ipv4_packet, 1101);
+  TEST_ASSERT_EQUAL(HE_ERR_PACKET_TOO_LARGE, res1);
+}
+
+void test_inside_pkt_received_too_large_for_outside_mtu_after_pmtud(void) {
+  conn->state = HE_STATE_ONLINE;
+  conn->outside_mtu = 1300;
+  conn->peer_mtu = 1400;
+
+  // Even if the effective MTU were to allow it, the outside MTU still has to
+  he_conn_get_effective_mtu_ExpectAndReturn(conn, 1400);
+  int res1 = he_conn_inside_packet_received(conn, fake_ipv4_packet,
+                                            1300 - (HE_PACKET_OVERHEAD - HE_HEADER_SAFE_GAP) + 1);
+  TEST_ASSERT_EQUAL(HE_ERR_PACKET_TOO_LARGE, res1);
 }
 
 void test_inside_pkt_bad_packet(void) {
@@ -134,6 +185,93 @@ void test_inside_pkt_good_packet(void) {
   he_internal_send_message_AddCallback(fixture_inside_packet_send_message);
   int res1 = he_conn_inside_packet_received(conn, fake_ipv4_packet, sizeof(fake_ipv4_packet));
   TEST_ASSERT_EQUAL(HE_SUCCESS, res1);
+  TEST_ASSERT_EQUAL(1, conn->counters.inside_rx_packets);
+  TEST_ASSERT_EQUAL(sizeof(fake_ipv4_packet), conn->counters.inside_rx_bytes);
+}
+
+void test_inside_pkt_counts_for_the_context(void) {
+  conn->state = HE_STATE_ONLINE;
+  conn->metrics = &ctx.metrics;
+  he_internal_calculate_data_packet_length_ExpectAndReturn(conn, sizeof(fake_ipv4_packet), 1242);
+  he_internal_send_message_ExpectAndReturn(conn, NULL, 1242 + sizeof(he_msg_data_t), HE_SUCCESS);
+  he_internal_send_message_IgnoreArg_message();
+  int res1 = he_conn_inside_packet_received(conn, fake_ipv4_packet, sizeof(fake_ipv4_packet));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res1);
+
+  he_ssl_ctx_get_metrics(&ctx, &metrics);
+  TEST_ASSERT_EQUAL(1, metrics.inside_rx_packets);
+  TEST_ASSERT_EQUAL(sizeof(fake_ipv4_packet), metrics.inside_rx_bytes);
+  TEST_ASSERT_EQUAL(1242 - sizeof(fake_ipv4_packet), metrics.padding_bytes);
+}
+
+void test_inside_pkt_good_packet_clamps_mss(void) {
+  conn->state = HE_STATE_ONLINE;
+  conn->clamp_mss = true;
+
+  he_conn_get_inner_mtu_ExpectAndReturn(conn, HE_MAX_MTU);
+  he_internal_clamp_mss_ExpectAndReturn(NULL, sizeof(fake_ipv4_packet), HE_MAX_MTU - 40, false);
+  he_internal_clamp_mss_IgnoreArg_packet();
+  he_internal_calculate_data_packet_length_ExpectAndReturn(conn, sizeof(fake_ipv4_packet), 1242);
+  he_internal_send_message_ExpectAndReturn(conn, NULL, 1242 + sizeof(he_msg_data_t), HE_SUCCESS);
+  he_internal_send_message_IgnoreArg_message();
+  he_internal_send_message_AddCallback(fixture_inside_packet_send_message);
+  int res1 = he_conn_inside_packet_received(conn, fake_ipv4_packet, sizeof(fake_ipv4_packet));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res1);
+}
+
+void test_inside_pkt_jumbo_packet_is_fragmented(void) {
+  uint8_t jumbo[3000] = {0x45};
+  conn->state = HE_STATE_ONLINE;
+  conn->inner_mtu = 9000;
+
+  he_conn_get_effective_mtu_ExpectAndReturn(conn, HE_MAX_MTU);
+  he_internal_frag_send_ExpectAndReturn(conn, jumbo, sizeof(jumbo), HE_SUCCESS);
+  int res1 = he_conn_inside_packet_received(conn, jumbo, sizeof(jumbo));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res1);
+}
+
+void test_inside_pkt_too_large_for_inner_mtu(void) {
+  uint8_t jumbo[3001] = {0x45};
+  conn->state = HE_STATE_ONLINE;
+  conn->inner_mtu = 3000;
+
+  int res1 = he_conn_inside_packet_received(conn, jumbo, sizeof(jumbo));
+  TEST_ASSERT_EQUAL(HE_ERR_PACKET_TOO_LARGE, res1);
+}
+
+void test_inside_pkt_bypasses_tunnel(void) {
+  uint8_t large[2000] = {0x45};
+  he_route_table_t *table = he_route_table_create(HE_ROUTE_TUNNEL);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_route_table_add(table, "0.0.0.0/8", HE_ROUTE_BYPASS));
+  he_conn_set_route_table(conn, table);
+  conn->state = HE_STATE_ONLINE;
+
+  // Nothing is sent, and the tunnel MTU doesn't matter
+  int res1 = he_conn_inside_packet_received(conn, fake_ipv4_packet, sizeof(fake_ipv4_packet));
+  TEST_ASSERT_EQUAL(HE_ERR_PACKET_BYPASSED, res1);
+  res1 = he_conn_inside_packet_received(conn, large, sizeof(large));
+  TEST_ASSERT_EQUAL(HE_ERR_PACKET_BYPASSED, res1);
+
+  // The host sends them, so they aren't drops
+  TEST_ASSERT_EQUAL(0, conn->counters.drops[0].value);
+  TEST_ASSERT_EQUAL(0, conn->counters.inside_rx_packets);
+
+  he_route_table_destroy(table);
+}
+
+void test_inside_pkt_routed_through_tunnel(void) {
+  he_route_table_t *table = he_route_table_create(HE_ROUTE_BYPASS);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_route_table_add(table, "0.0.0.0/8", HE_ROUTE_TUNNEL));
+  he_conn_set_route_table(conn, table);
+  conn->state = HE_STATE_ONLINE;
+
+  he_internal_calculate_data_packet_length_ExpectAndReturn(conn, sizeof(fake_ipv4_packet), 1242);
+  he_internal_send_message_ExpectAndReturn(conn, NULL, 1242 + sizeof(he_msg_data_t), HE_SUCCESS);
+  he_internal_send_message_IgnoreArg_message();
+  int res1 = he_conn_inside_packet_received(conn, fake_ipv4_packet, sizeof(fake_ipv4_packet));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res1);
+
+  he_route_table_destroy(table);
 }
 
 void test_inside_pkt_good_packet_with_legacy_behaviour(void) {
@@ -221,6 +359,39 @@ void test_outside_pktrcv_good_packet_in_connecting_want_write(void) {
   TEST_ASSERT_EQUAL(HE_SUCCESS, res2);
 }
 
+void test_verify_connection_times_handshake_flight(void) {
+  conn->state = HE_STATE_CONNECTING;
+  conn->first_message_received = true;
+  conn->flight_sent_ms = 1000;
+
+  he_internal_clock_ms_ExpectAndReturn(1042);
+  he_internal_conn_rtt_sample_Expect(conn, 42);
+  wolfSSL_negotiate_ExpectAndReturn(conn->wolf_ssl, SSL_FATAL_ERROR);
+  wolfSSL_get_error_ExpectAndReturn(conn->wolf_ssl, SSL_FATAL_ERROR, SSL_ERROR_WANT_READ);
+  he_internal_update_timeout_Expect(conn);
+
+  int res = he_internal_flow_outside_data_verify_connection(conn);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+  TEST_ASSERT_EQUAL(0, conn->flight_sent_ms);
+}
+
+void test_verify_connection_does_not_time_retransmitted_flight(void) {
+  conn->state = HE_STATE_CONNECTING;
+  conn->first_message_received = true;
+  conn->flight_sent_ms = 1000;
+  conn->flight_retransmits = 2;
+
+  // No clock or sample, the reply could be to any of the copies
+  wolfSSL_negotiate_ExpectAndReturn(conn->wolf_ssl, SSL_FATAL_ERROR);
+  wolfSSL_get_error_ExpectAndReturn(conn->wolf_ssl, SSL_FATAL_ERROR, SSL_ERROR_WANT_READ);
+  he_internal_update_timeout_Expect(conn);
+
+  int res = he_internal_flow_outside_data_verify_connection(conn);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+  TEST_ASSERT_EQUAL(0, conn->flight_sent_ms);
+  TEST_ASSERT_EQUAL(0, conn->flight_retransmits);
+}
+
 void test_outside_pktrcv_good_packet_in_connecting_actual_error(void) {
   dispatch_ExpectAndReturn("he_internal_flow_outside_data_verify_connection", HE_SUCCESS);
   he_internal_generate_event_Expect(conn, HE_EVENT_FIRST_MESSAGE_RECEIVED);
@@ -268,17 +439,44 @@ void test_packet_session_reject(void) {
 }
 
 void test_plugin_drop_returns_he_success(void) {
-  he_plugin_ingress_ExpectAnyArgsAndReturn(HE_ERR_PLUGIN_DROP);
+  he_plugin_ingress_packet_ExpectAnyArgsAndReturn(HE_ERR_PLUGIN_DROP);
   int res = he_conn_outside_data_received(conn, packet, packet_max_length);
 
   TEST_ASSERT_EQUAL_INT(HE_SUCCESS, res);
+
+  // Still counted
+  TEST_ASSERT_EQUAL(1, conn->counters.outside_rx_packets);
+  TEST_ASSERT_EQUAL(packet_max_length, conn->counters.outside_rx_bytes);
+  TEST_ASSERT_EQUAL(HE_ERR_PLUGIN_DROP, HE_CONN_DROP_REASON(conn->counters.drops[0].value));
+  TEST_ASSERT_EQUAL(1, HE_CONN_DROP_COUNT(conn->counters.drops[0].value));
+}
+
+static he_return_code_t plugin_packet_check_room(he_plugin_chain_t *chain,
+                                                 he_plugin_packet_t *plugin_packet, int numCalls) {
+  TEST_ASSERT_EQUAL_PTR(packet, plugin_packet->data);
+  TEST_ASSERT_EQUAL(packet_max_length, plugin_packet->length);
+  TEST_ASSERT_EQUAL(16, plugin_packet->headroom);
+  TEST_ASSERT_EQUAL(32, plugin_packet->tailroom);
+  return HE_SUCCESS;
+}
+
+void test_plugin_given_outside_buffer_room(void) {
+  conn->outside_headroom = 16;
+  conn->outside_tailroom = 32;
+  he_plugin_ingress_packet_Stub(plugin_packet_check_room);
+  dispatch_ExpectAndReturn("he_internal_flow_outside_packet_received", HE_SUCCESS);
+
+  int res = he_conn_outside_data_received(conn, packet, packet_max_length);
+  TEST_ASSERT_EQUAL_INT(HE_SUCCESS, res);
 }
 
 void test_plugin_error_returns_error(void) {
-  he_plugin_ingress_ExpectAnyArgsAndReturn(HE_ERR_NULL_POINTER);
+  he_plugin_ingress_packet_ExpectAnyArgsAndReturn(HE_ERR_NULL_POINTER);
   int res = he_conn_outside_data_received(conn, packet, packet_max_length);
 
   TEST_ASSERT_EQUAL_INT(HE_ERR_NULL_POINTER, res);
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, HE_CONN_DROP_REASON(conn->counters.drops[0].value));
+  TEST_ASSERT_EQUAL(1, HE_CONN_DROP_COUNT(conn->counters.drops[0].value));
 }
 
 void test_session_id_change(void) {
@@ -290,6 +488,19 @@ void test_session_id_change(void) {
 
   he_internal_update_session_incoming(conn, pkt);
   TEST_ASSERT_EQUAL(0xDEADBAD, conn->session_id);
+  TEST_ASSERT_EQUAL(1, conn->counters.session_rotations);
+}
+
+void test_session_id_first_session_isnt_a_rotation(void) {
+  conn->state = HE_STATE_ONLINE;
+
+  he_wire_hdr_t *pkt = (he_wire_hdr_t *)empty_data;
+  pkt->session = 0xDEADBAD;
+
+  he_internal_update_session_incoming(conn, pkt);
+  he_internal_update_session_incoming(conn, pkt);
+  TEST_ASSERT_EQUAL(0xDEADBAD, conn->session_id);
+  TEST_ASSERT_EQUAL(0, conn->counters.session_rotations);
 }
 
 void test_session_id_unset_doesnt_trigger_change(void) {
@@ -343,6 +554,7 @@ void test_session_id_server_session_rotation(void) {
   TEST_ASSERT_EQUAL(0xbeef, conn->session_id);
   TEST_ASSERT_EQUAL(0, conn->pending_session_id);
   TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+  TEST_ASSERT_EQUAL(1, conn->counters.session_rotations);
 }
 
 void test_handle_process_packet_wants_read(void) {
@@ -418,6 +630,28 @@ void test_handle_process_packet_other_error(void) {
 
   TEST_ASSERT_EQUAL(0, conn->read_packet.packet_size);
   TEST_ASSERT_FALSE(conn->read_packet.has_packet);
+  TEST_ASSERT_EQUAL(0, conn->counters.decrypt_failures);
+  TEST_ASSERT_EQUAL(0, conn->counters.replays);
+}
+
+void test_fetch_message_counts_decrypt_failures_and_replays(void) {
+  wolfSSL_read_ExpectAndReturn(conn->wolf_ssl, conn->read_packet.packet,
+                               sizeof(conn->read_packet.packet), SSL_FATAL_ERROR);
+  wolfSSL_get_error_ExpectAndReturn(conn->wolf_ssl, SSL_FATAL_ERROR, VERIFY_MAC_ERROR);
+  TEST_ASSERT_EQUAL(HE_ERR_SSL_ERROR_NONFATAL, he_internal_flow_fetch_message(conn));
+
+  wolfSSL_read_ExpectAndReturn(conn->wolf_ssl, conn->read_packet.packet,
+                               sizeof(conn->read_packet.packet), SSL_FATAL_ERROR);
+  wolfSSL_get_error_ExpectAndReturn(conn->wolf_ssl, SSL_FATAL_ERROR, DECRYPT_ERROR);
+  TEST_ASSERT_EQUAL(HE_ERR_SSL_ERROR_NONFATAL, he_internal_flow_fetch_message(conn));
+
+  wolfSSL_read_ExpectAndReturn(conn->wolf_ssl, conn->read_packet.packet,
+                               sizeof(conn->read_packet.packet), SSL_FATAL_ERROR);
+  wolfSSL_get_error_ExpectAndReturn(conn->wolf_ssl, SSL_FATAL_ERROR, DUPLICATE_MSG_E);
+  TEST_ASSERT_EQUAL(HE_ERR_SSL_ERROR_NONFATAL, he_internal_flow_fetch_message(conn));
+
+  TEST_ASSERT_EQUAL(2, conn->counters.decrypt_failures);
+  TEST_ASSERT_EQUAL(1, conn->counters.replays);
 }
 
 void test_handle_process_packet_connection_closed(void) {
@@ -470,6 +704,25 @@ void test_cert_verify_failed_gets_returned(void) {
   TEST_ASSERT_EQUAL(HE_ERR_CANNOT_VERIFY_SERVER_CERT, res2);
 }
 
+void test_failed_handshake_is_counted_for_the_context(void) {
+  conn->state = HE_STATE_CONNECTING;
+  conn->first_message_received = true;
+  conn->metrics = &ctx.metrics;
+
+  wolfSSL_negotiate_ExpectAndReturn(conn->wolf_ssl, SSL_FATAL_ERROR);
+  wolfSSL_get_error_ExpectAndReturn(conn->wolf_ssl, SSL_FATAL_ERROR, ASN_SIG_CONFIRM_E);
+  TEST_ASSERT_EQUAL(HE_ERR_CANNOT_VERIFY_SERVER_CERT,
+                    he_internal_flow_outside_data_verify_connection(conn));
+
+  wolfSSL_negotiate_ExpectAndReturn(conn->wolf_ssl, SSL_FATAL_ERROR);
+  wolfSSL_get_error_ExpectAndReturn(conn->wolf_ssl, SSL_FATAL_ERROR, SSL_FATAL_ERROR);
+  TEST_ASSERT_EQUAL(HE_ERR_SSL_ERROR, he_internal_flow_outside_data_verify_connection(conn));
+
+  he_ssl_ctx_get_metrics(&ctx, &metrics);
+  TEST_ASSERT_EQUAL(1, metrics.handshake_failures[-HE_ERR_CANNOT_VERIFY_SERVER_CERT]);
+  TEST_ASSERT_EQUAL(1, metrics.handshake_failures[-HE_ERR_SSL_ERROR]);
+}
+
 void test_handle_process_packet_app_data_ready(void) {
   dispatch_ExpectAndReturn("he_internal_flow_outside_data_verify_connection", HE_SUCCESS);
   he_internal_generate_event_Expect(conn, HE_EVENT_FIRST_MESSAGE_RECEIVED);
@@ -504,16 +757,194 @@ void test_handle_process_packet_app_data_ready(void) {
 }
 
 void test_outside_datarcv_good_packet_datagram(void) {
-  he_plugin_ingress_ExpectAnyArgsAndReturn(HE_SUCCESS);
+  he_plugin_ingress_packet_ExpectAnyArgsAndReturn(HE_SUCCESS);
+  dispatch_ExpectAndReturn("he_internal_flow_outside_packet_received", HE_SUCCESS);
+
+  int res1 = he_conn_outside_data_received(conn, packet, packet_max_length);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res1);
+}
+
+void test_outside_datarcv_hands_off_online_connection(void) {
+  call_counter = 0;
+  conn->handoff_cb = handoff_cb;
+  conn->handoff_pending = true;
+
+  he_plugin_ingress_packet_ExpectAnyArgsAndReturn(HE_SUCCESS);
+  dispatch_ExpectAndReturn("he_internal_flow_outside_packet_received", HE_SUCCESS);
+  he_conn_is_error_fatal_ExpectAndReturn(conn, HE_SUCCESS, false);
+
+  int res1 = he_conn_outside_data_received(conn, packet, packet_max_length);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res1);
+  TEST_ASSERT_EQUAL(1, call_counter);
+  TEST_ASSERT_FALSE(conn->handoff_pending);
+}
+
+void test_outside_datarcv_no_handoff_on_fatal_error(void) {
+  call_counter = 0;
+  conn->handoff_cb = handoff_cb;
+  conn->handoff_pending = true;
+
+  he_plugin_ingress_packet_ExpectAnyArgsAndReturn(HE_SUCCESS);
+  dispatch_ExpectAndReturn("he_internal_flow_outside_packet_received", HE_ERR_SSL_ERROR);
+  he_conn_is_error_fatal_ExpectAndReturn(conn, HE_ERR_SSL_ERROR, true);
+
+  int res1 = he_conn_outside_data_received(conn, packet, packet_max_length);
+  TEST_ASSERT_EQUAL(HE_ERR_SSL_ERROR, res1);
+  TEST_ASSERT_EQUAL(0, call_counter);
+}
+
+void test_outside_datarcv_flushes_gro(void) {
+  he_internal_gro_flush_StopIgnore();
+
+  he_plugin_ingress_packet_ExpectAnyArgsAndReturn(HE_SUCCESS);
+  dispatch_ExpectAndReturn("he_internal_flow_outside_packet_received", HE_SUCCESS);
+  he_internal_gro_flush_Expect(conn);
+
+  int res1 = he_conn_outside_data_received(conn, packet, packet_max_length);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res1);
+}
+
+void test_outside_datarcv_batch_null_pointers(void) {
+  uint8_t *buffers[1] = {packet};
+  size_t lengths[1] = {packet_max_length};
+
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER,
+                    he_conn_outside_data_received_batch(NULL, buffers, lengths, 1));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER,
+                    he_conn_outside_data_received_batch(conn, NULL, lengths, 1));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER,
+                    he_conn_outside_data_received_batch(conn, buffers, NULL, 1));
+}
+
+static he_return_code_t plugin_batch_pass(he_plugin_chain_t *chain, he_plugin_packet_t *packets,
+                                          he_return_code_t *results, size_t count, int numCalls) {
+  for(size_t i = 0; i < count; i++) {
+    TEST_ASSERT_EQUAL(conn->outside_headroom, packets[i].headroom);
+    TEST_ASSERT_EQUAL(conn->outside_tailroom, packets[i].tailroom);
+    results[i] = HE_SUCCESS;
+  }
+  return HE_SUCCESS;
+}
+
+static he_return_code_t plugin_batch_drop_second(he_plugin_chain_t *chain,
+                                                 he_plugin_packet_t *packets,
+                                                 he_return_code_t *results, size_t count,
+                                                 int numCalls) {
+  TEST_ASSERT_EQUAL(3, count);
+  results[0] = HE_SUCCESS;
+  results[1] = HE_ERR_PLUGIN_DROP;
+  results[2] = HE_SUCCESS;
+  return HE_SUCCESS;
+}
+
+void test_outside_datarcv_batch(void) {
+  uint8_t *buffers[3] = {packet, packet, packet};
+  size_t lengths[3] = {packet_max_length, packet_max_length, packet_max_length};
+  call_counter = 0;
+  conn->handoff_cb = handoff_cb;
+  conn->handoff_pending = true;
+  conn->outside_headroom = 8;
+  conn->metrics = &ctx.metrics;
+  he_internal_gro_flush_StopIgnore();
+
+  he_plugin_ingress_batch_Stub(plugin_batch_pass);
+  dispatch_ExpectAndReturn("he_internal_flow_outside_packet_received", HE_SUCCESS);
+  // A bad datagram in the middle doesn't stop the rest
+  dispatch_ExpectAndReturn("he_internal_flow_outside_packet_received", HE_ERR_BAD_PACKET);
+  he_conn_is_error_fatal_ExpectAndReturn(conn, HE_ERR_BAD_PACKET, false);
+  dispatch_ExpectAndReturn("he_internal_flow_outside_packet_received", HE_SUCCESS);
+  // Merged segments and the handoff wait for the end of the batch
+  he_internal_gro_flush_Expect(conn);
+
+  int res1 = he_conn_outside_data_received_batch(conn, buffers, lengths, 3);
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET, res1);
+  TEST_ASSERT_EQUAL(3, conn->counters.outside_rx_packets);
+  TEST_ASSERT_EQUAL(3 * packet_max_length, conn->counters.outside_rx_bytes);
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET, HE_CONN_DROP_REASON(conn->counters.drops[0].value));
+  TEST_ASSERT_EQUAL(1, HE_CONN_DROP_COUNT(conn->counters.drops[0].value));
+
+  he_ssl_ctx_get_metrics(&ctx, &metrics);
+  TEST_ASSERT_EQUAL(3, metrics.outside_rx_packets);
+  TEST_ASSERT_EQUAL(3 * packet_max_length, metrics.outside_rx_bytes);
+  TEST_ASSERT_EQUAL(1, call_counter);
+  TEST_ASSERT_FALSE(conn->handoff_pending);
+  TEST_ASSERT_FALSE(conn->receiving_batch);
+}
+
+void test_outside_datarcv_batch_stops_on_fatal_error(void) {
+  uint8_t *buffers[2] = {packet, packet};
+  size_t lengths[2] = {packet_max_length, packet_max_length};
+  call_counter = 0;
+  conn->handoff_cb = handoff_cb;
+  conn->handoff_pending = true;
+
+  he_plugin_ingress_batch_Stub(plugin_batch_pass);
+  dispatch_ExpectAndReturn("he_internal_flow_outside_packet_received", HE_ERR_SSL_ERROR);
+  he_conn_is_error_fatal_ExpectAndReturn(conn, HE_ERR_SSL_ERROR, true);
+
+  int res1 = he_conn_outside_data_received_batch(conn, buffers, lengths, 2);
+  TEST_ASSERT_EQUAL(HE_ERR_SSL_ERROR, res1);
+  TEST_ASSERT_EQUAL(0, call_counter);
+  TEST_ASSERT_FALSE(conn->receiving_batch);
+}
+
+void test_outside_datarcv_batch_plugin_drop(void) {
+  uint8_t *buffers[3] = {packet, packet, packet};
+  size_t lengths[3] = {packet_max_length, packet_max_length, packet_max_length};
+
+  // The dropped datagram is never processed, and that isn't an error
+  he_plugin_ingress_batch_Stub(plugin_batch_drop_second);
+  dispatch_ExpectAndReturn("he_internal_flow_outside_packet_received", HE_SUCCESS);
+  dispatch_ExpectAndReturn("he_internal_flow_outside_packet_received", HE_SUCCESS);
+
+  int res1 = he_conn_outside_data_received_batch(conn, buffers, lengths, 3);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res1);
+  TEST_ASSERT_EQUAL(HE_ERR_PLUGIN_DROP, HE_CONN_DROP_REASON(conn->counters.drops[0].value));
+  TEST_ASSERT_EQUAL(1, HE_CONN_DROP_COUNT(conn->counters.drops[0].value));
+}
+
+void test_outside_datarcv_batch_skips_null_buffers(void) {
+  uint8_t *buffers[2] = {NULL, packet};
+  size_t lengths[2] = {packet_max_length, packet_max_length};
+
+  he_plugin_ingress_batch_Stub(plugin_batch_pass);
+  he_conn_is_error_fatal_ExpectAndReturn(conn, HE_ERR_NULL_POINTER, false);
+  dispatch_ExpectAndReturn("he_internal_flow_outside_packet_received", HE_SUCCESS);
+
+  int res1 = he_conn_outside_data_received_batch(conn, buffers, lengths, 2);
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, res1);
+
+  // Nothing was received in place of the missing buffer, so nothing was dropped either
+  TEST_ASSERT_EQUAL(1, conn->counters.outside_rx_packets);
+  TEST_ASSERT_EQUAL(0, conn->counters.drops[0].value);
+}
+
+void test_outside_datarcv_wakes_hibernating_conn(void) {
+  uint8_t sealed[8] = {0};
+  conn->hibernated_state = sealed;
+
+  he_plugin_ingress_packet_ExpectAnyArgsAndReturn(HE_SUCCESS);
+  he_internal_conn_wake_ExpectAndReturn(conn, HE_SUCCESS);
   dispatch_ExpectAndReturn("he_internal_flow_outside_packet_received", HE_SUCCESS);
 
   int res1 = he_conn_outside_data_received(conn, packet, packet_max_length);
   TEST_ASSERT_EQUAL(HE_SUCCESS, res1);
 }
 
+void test_outside_datarcv_wake_fails(void) {
+  uint8_t sealed[8] = {0};
+  conn->hibernated_state = sealed;
+
+  he_plugin_ingress_packet_ExpectAnyArgsAndReturn(HE_SUCCESS);
+  he_internal_conn_wake_ExpectAndReturn(conn, HE_ERR_BAD_PACKET);
+
+  int res1 = he_conn_outside_data_received(conn, packet, packet_max_length);
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET, res1);
+}
+
 void test_outside_datarcv_good_buffer_streaming(void) {
   conn->connection_type = HE_CONNECTION_TYPE_STREAM;
-  he_plugin_ingress_ExpectAnyArgsAndReturn(HE_SUCCESS);
+  he_plugin_ingress_packet_ExpectAnyArgsAndReturn(HE_SUCCESS);
   dispatch_ExpectAndReturn("he_internal_flow_outside_stream_received", HE_SUCCESS);
 
   int res1 = he_conn_outside_data_received(conn, packet, packet_max_length);
@@ -592,6 +1023,7 @@ void test_he_internal_flow_process_message_switch(void) {
   HE_MSG_SWITCH_TEST_EXPECT(HE_MSGID_PING, he_handle_msg_ping);
   HE_MSG_SWITCH_TEST_EXPECT(HE_MSGID_PONG, he_handle_msg_pong);
   HE_MSG_SWITCH_TEST_EXPECT(HE_MSGID_DATA, he_handle_msg_data);
+  HE_MSG_SWITCH_TEST_EXPECT(HE_MSGID_MTU, he_handle_msg_mtu);
 
   HE_MSG_SWITCH_TEST(HE_MSGID_AUTH_RESPONSE_WITH_CONFIG);
   HE_MSG_SWITCH_TEST(HE_MSGID_EXTENSION);
@@ -678,7 +1110,9 @@ void test_outside_data_handle_messages_generates_renegotiation_event(void) {
   // Renegotiation completed, conn expects renegotiation, expect event and conn reset
   wolfSSL_SSL_renegotiate_pending_ExpectAndReturn(conn->wolf_ssl, 0);
   he_internal_generate_event_Expect(conn, HE_EVENT_SECURE_RENEGOTIATION_COMPLETED);
+  wolfSSL_FreeHandshakeResources_Expect(conn->wolf_ssl);
   he_internal_update_timeout_Expect(conn);
   he_internal_flow_outside_data_handle_messages(conn);
   TEST_ASSERT_FALSE(conn->renegotiation_in_progress);
+  TEST_ASSERT_EQUAL(1, conn->counters.renegotiations);
 }
@@ -0,0 +1,147 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <he.h>
+#include "unity.h"
+#include "test_defs.h"
+
+// Unit under test
+#include "flow_hash.h"
+
+// Direct Includes for Utility Functions
+#include "network.h"
+
+static uint8_t packet[64];
+
+static size_t build_packet(uint8_t protocol, uint32_t src, uint16_t src_port, uint32_t dst,
+                           uint16_t dst_port) {
+  memset(packet, 0, sizeof(packet));
+  ipv4_header_t *ip = (ipv4_header_t *)packet;
+  ip->ver_ihl = 0x45;
+  ip->total_length = htons(sizeof(packet));
+  ip->protocol = protocol;
+  ip->src_addr = htonl(src);
+  ip->dst_addr = htonl(dst);
+
+  uint8_t *ports = packet + sizeof(ipv4_header_t);
+  ports[0] = (uint8_t)(src_port >> 8);
+  ports[1] = (uint8_t)src_port;
+  ports[2] = (uint8_t)(dst_port >> 8);
+  ports[3] = (uint8_t)dst_port;
+  return sizeof(packet);
+}
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+}
+
+void test_toeplitz_hash_verification_vectors(void) {
+  // From Microsoft's RSS verification suite, for 66.9.149.187:2794 -> 161.142.100.80:1766
+  uint8_t input[12] = {66, 9, 149, 187, 161, 142, 100, 80, 0x0a, 0xea, 0x06, 0xe6};
+  TEST_ASSERT_EQUAL_HEX32(0x323e8fc2, he_internal_toeplitz_hash(input, 8));
+  TEST_ASSERT_EQUAL_HEX32(0x51ccc178, he_internal_toeplitz_hash(input, 12));
+
+  // 199.92.111.2:14230 -> 65.69.140.83:4739
+  uint8_t input2[12] = {199, 92, 111, 2, 65, 69, 140, 83, 0x37, 0x96, 0x12, 0x83};
+  TEST_ASSERT_EQUAL_HEX32(0xd718262a, he_internal_toeplitz_hash(input2, 8));
+  TEST_ASSERT_EQUAL_HEX32(0xc626b0ea, he_internal_toeplitz_hash(input2, 12));
+}
+
+void test_classify_tcp(void) {
+  he_flow_info_t flow;
+  size_t length = build_packet(6, 0x420995bb, 2794, 0xa18e6450, 1766);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_flow_classify(packet, length, &flow));
+  TEST_ASSERT_EQUAL(6, flow.protocol);
+  TEST_ASSERT_EQUAL_HEX32(0x420995bb, flow.src_addr);
+  TEST_ASSERT_EQUAL_HEX32(0xa18e6450, flow.dst_addr);
+  TEST_ASSERT_EQUAL(2794, flow.src_port);
+  TEST_ASSERT_EQUAL(1766, flow.dst_port);
+  TEST_ASSERT_EQUAL_HEX32(0x51ccc178, flow.hash);
+}
+
+void test_classify_udp(void) {
+  he_flow_info_t flow;
+  size_t length = build_packet(17, 0xc75c6f02, 14230, 0x41458c53, 4739);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_flow_classify(packet, length, &flow));
+  TEST_ASSERT_EQUAL(17, flow.protocol);
+  TEST_ASSERT_EQUAL(14230, flow.src_port);
+  TEST_ASSERT_EQUAL(4739, flow.dst_port);
+  TEST_ASSERT_EQUAL_HEX32(0xc626b0ea, flow.hash);
+}
+
+void test_classify_without_ports(void) {
+  he_flow_info_t flow;
+  // ICMP
+  size_t length = build_packet(1, 0x420995bb, 2794, 0xa18e6450, 1766);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_flow_classify(packet, length, &flow));
+  TEST_ASSERT_EQUAL(0, flow.src_port);
+  TEST_ASSERT_EQUAL(0, flow.dst_port);
+  TEST_ASSERT_EQUAL_HEX32(0x323e8fc2, flow.hash);
+}
+
+void test_classify_fragments_hash_alike(void) {
+  he_flow_info_t first;
+  he_flow_info_t later;
+  size_t length = build_packet(6, 0x420995bb, 2794, 0xa18e6450, 1766);
+  ipv4_header_t *ip = (ipv4_header_t *)packet;
+
+  // More fragments to come
+  ip->flags_fo = htons(0x2000);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_flow_classify(packet, length, &first));
+
+  // A later fragment, where the ports would be is just data
+  ip->flags_fo = htons(185);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_flow_classify(packet, length, &later));
+
+  TEST_ASSERT_EQUAL(0, first.src_port);
+  TEST_ASSERT_EQUAL_HEX32(0x323e8fc2, first.hash);
+  TEST_ASSERT_EQUAL_HEX32(first.hash, later.hash);
+}
+
+void test_classify_truncated_ports(void) {
+  he_flow_info_t flow;
+  build_packet(6, 0x420995bb, 2794, 0xa18e6450, 1766);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_flow_classify(packet, sizeof(ipv4_header_t) + 3, &flow));
+  TEST_ASSERT_EQUAL(0, flow.src_port);
+  TEST_ASSERT_EQUAL_HEX32(0x323e8fc2, flow.hash);
+}
+
+void test_classify_bad_packets(void) {
+  he_flow_info_t flow;
+  size_t length = build_packet(6, 0x420995bb, 2794, 0xa18e6450, 1766);
+
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_flow_classify(NULL, length, &flow));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_flow_classify(packet, length, NULL));
+  TEST_ASSERT_EQUAL(HE_ERR_PACKET_TOO_SMALL,
+                    he_flow_classify(packet, sizeof(ipv4_header_t) - 1, &flow));
+
+  packet[0] = 0x60;
+  TEST_ASSERT_EQUAL(HE_ERR_UNSUPPORTED_PACKET_TYPE, he_flow_classify(packet, length, &flow));
+
+  // Header length shorter than the minimum, then longer than the packet
+  packet[0] = 0x44;
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET, he_flow_classify(packet, length, &flow));
+  packet[0] = 0x4F;
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET, he_flow_classify(packet, 40, &flow));
+}
@@ -0,0 +1,398 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <he.h>
+#include "unity.h"
+#include "test_defs.h"
+
+// Unit under test
+#include "frag.h"
+
+// Direct Includes for Utility Functions
+#include "memory.h"
+#include "metrics.h"
+
+// Internal Mocks
+#include "mock_conn.h"
+#include "mock_clock.h"
+
+static he_conn_t *conn = NULL;
+static uint8_t jumbo[9000];
+
+// Fragments captured from he_internal_send_message
+static uint8_t sent[16][HE_MAX_PMTU + sizeof(he_msg_data_t)];
+static uint16_t sent_length[16];
+static int sent_count = 0;
+
+static he_return_code_t stub_send_message(he_conn_t *conn, uint8_t *message, uint16_t length,
+                                          int numCalls) {
+  memcpy(sent[sent_count], message, length);
+  sent_length[sent_count] = length;
+  sent_count++;
+  return HE_SUCCESS;
+}
+
+static size_t stub_no_padding(he_conn_t *conn, size_t length, int numCalls) {
+  return length;
+}
+
+// The HE_PADDING_450 steps
+static size_t stub_padding_450(he_conn_t *conn, size_t length, int numCalls) {
+  return length <= 450 ? 450 : length <= 900 ? 900 : HE_MAX_MTU;
+}
+
+static he_return_code_t reassemble_sent(int i, uint8_t **packet, uint16_t *packet_length) {
+  he_msg_data_fragment_t *fragment = (he_msg_data_fragment_t *)sent[i];
+  return he_internal_frag_reassemble(conn, fragment, sent[i] + sizeof(he_msg_data_fragment_t),
+                                     ntohs(fragment->length), packet, packet_length);
+}
+
+static he_msg_data_fragment_t make_fragment(uint16_t id, uint16_t total_length, uint8_t index,
+                                            uint8_t count) {
+  he_msg_data_fragment_t fragment = {0};
+  fragment.msg_header.msgid = HE_MSGID_DATA_FRAGMENT;
+  fragment.id = htons(id);
+  fragment.total_length = htons(total_length);
+  fragment.index = index;
+  fragment.count = count;
+  return fragment;
+}
+
+void setUp(void) {
+  conn = calloc(1, sizeof(he_conn_t));
+  conn->inner_mtu = sizeof(jumbo);
+
+  for(size_t i = 0; i < sizeof(jumbo); i++) {
+    jumbo[i] = (uint8_t)(i * 7);
+  }
+  sent_count = 0;
+
+  he_internal_clock_ms_IgnoreAndReturn(1000);
+  he_internal_calculate_data_packet_length_Stub(stub_no_padding);
+}
+
+void tearDown(void) {
+  he_internal_frag_free(conn);
+  free(conn);
+}
+
+void test_frag_send(void) {
+  he_conn_get_effective_mtu_ExpectAndReturn(conn, HE_MAX_MTU);
+  he_internal_send_message_Stub(stub_send_message);
+  conn->fragment_id = 41;
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_frag_send(conn, jumbo, 3000));
+
+  // Each fragment is the size of a full DATA message
+  uint16_t chunk = HE_MAX_MTU + sizeof(he_msg_data_t) - sizeof(he_msg_data_fragment_t);
+  TEST_ASSERT_EQUAL(3, sent_count);
+  TEST_ASSERT_EQUAL(HE_MAX_MTU + sizeof(he_msg_data_t), sent_length[0]);
+  TEST_ASSERT_EQUAL(HE_MAX_MTU + sizeof(he_msg_data_t), sent_length[1]);
+  TEST_ASSERT_EQUAL(sizeof(he_msg_data_fragment_t) + 3000 - 2 * chunk, sent_length[2]);
+
+  for(int i = 0; i < 3; i++) {
+    he_msg_data_fragment_t *fragment = (he_msg_data_fragment_t *)sent[i];
+    TEST_ASSERT_EQUAL(HE_MSGID_DATA_FRAGMENT, fragment->msg_header.msgid);
+    TEST_ASSERT_EQUAL(41, ntohs(fragment->id));
+    TEST_ASSERT_EQUAL(3000, ntohs(fragment->total_length));
+    TEST_ASSERT_EQUAL(i, fragment->index);
+    TEST_ASSERT_EQUAL(3, fragment->count);
+    TEST_ASSERT_EQUAL_MEMORY(jumbo + i * chunk, sent[i] + sizeof(he_msg_data_fragment_t),
+                             ntohs(fragment->length));
+  }
+
+  TEST_ASSERT_EQUAL(42, conn->fragment_id);
+}
+
+void test_frag_send_pads_last_fragment(void) {
+  he_conn_get_effective_mtu_ExpectAndReturn(conn, HE_MAX_MTU);
+  he_internal_calculate_data_packet_length_Stub(stub_padding_450);
+  he_internal_send_message_Stub(stub_send_message);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_frag_send(conn, jumbo, 3000));
+
+  // Full fragments are already as large as padding makes anything, the last one is padded up to
+  // the same size a DATA message with as many bytes would be
+  TEST_ASSERT_EQUAL(3, sent_count);
+  TEST_ASSERT_EQUAL(HE_MAX_MTU + sizeof(he_msg_data_t), sent_length[0]);
+  TEST_ASSERT_EQUAL(HE_MAX_MTU + sizeof(he_msg_data_t), sent_length[1]);
+  TEST_ASSERT_EQUAL(450 + sizeof(he_msg_data_t), sent_length[2]);
+
+  // The padding is zeroes rather than what was left over from the previous fragment
+  he_msg_data_fragment_t *fragment = (he_msg_data_fragment_t *)sent[2];
+  size_t end = sizeof(he_msg_data_fragment_t) + ntohs(fragment->length);
+  TEST_ASSERT_EACH_EQUAL_UINT8(0, sent[2] + end, sent_length[2] - end);
+
+  // The peer only takes the fragment's own bytes
+  uint8_t *packet = NULL;
+  uint16_t packet_length = 0;
+  for(int i = 0; i < sent_count; i++) {
+    TEST_ASSERT_EQUAL(HE_SUCCESS, reassemble_sent(i, &packet, &packet_length));
+  }
+  TEST_ASSERT_EQUAL(3000, packet_length);
+  TEST_ASSERT_EQUAL_MEMORY(jumbo, packet, 3000);
+  he_internal_free(packet);
+}
+
+void test_frag_send_too_many_fragments(void) {
+  // A tiny MTU would need more fragments than a packet can have
+  he_conn_get_effective_mtu_ExpectAndReturn(conn, 500);
+
+  TEST_ASSERT_EQUAL(HE_ERR_PACKET_TOO_LARGE, he_internal_frag_send(conn, jumbo, 65000));
+}
+
+void test_frag_send_error(void) {
+  he_conn_get_effective_mtu_ExpectAndReturn(conn, HE_MAX_MTU);
+  he_internal_send_message_ExpectAnyArgsAndReturn(HE_ERR_SSL_ERROR);
+
+  TEST_ASSERT_EQUAL(HE_ERR_SSL_ERROR, he_internal_frag_send(conn, jumbo, 3000));
+}
+
+void test_frag_round_trip(void) {
+  he_conn_get_effective_mtu_ExpectAndReturn(conn, HE_MAX_MTU);
+  he_internal_send_message_Stub(stub_send_message);
+  he_internal_frag_send(conn, jumbo, sizeof(jumbo));
+  TEST_ASSERT_EQUAL(7, sent_count);
+
+  uint8_t *packet = NULL;
+  uint16_t packet_length = 0;
+  for(int i = 0; i < sent_count; i++) {
+    TEST_ASSERT_EQUAL(HE_SUCCESS, reassemble_sent(i, &packet, &packet_length));
+    if(i < sent_count - 1) {
+      TEST_ASSERT_NULL(packet);
+    }
+  }
+
+  TEST_ASSERT_NOT_NULL(packet);
+  TEST_ASSERT_EQUAL(sizeof(jumbo), packet_length);
+  TEST_ASSERT_EQUAL_MEMORY(jumbo, packet, sizeof(jumbo));
+  he_internal_free(packet);
+
+  // The slot was given back
+  TEST_ASSERT_NULL(conn->reassembly[0].buffer);
+}
+
+void test_frag_reassemble_out_of_order(void) {
+  he_conn_get_effective_mtu_ExpectAndReturn(conn, HE_MAX_MTU);
+  he_internal_send_message_Stub(stub_send_message);
+  he_internal_frag_send(conn, jumbo, 3000);
+
+  uint8_t *packet = NULL;
+  uint16_t packet_length = 0;
+  // The short last fragment first, so its offset is worked out from the end
+  TEST_ASSERT_EQUAL(HE_SUCCESS, reassemble_sent(2, &packet, &packet_length));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, reassemble_sent(0, &packet, &packet_length));
+  TEST_ASSERT_NULL(packet);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, reassemble_sent(1, &packet, &packet_length));
+
+  TEST_ASSERT_NOT_NULL(packet);
+  TEST_ASSERT_EQUAL(3000, packet_length);
+  TEST_ASSERT_EQUAL_MEMORY(jumbo, packet, 3000);
+  he_internal_free(packet);
+}
+
+void test_frag_reassemble_duplicate(void) {
+  he_conn_get_effective_mtu_ExpectAndReturn(conn, HE_MAX_MTU);
+  he_internal_send_message_Stub(stub_send_message);
+  he_internal_frag_send(conn, jumbo, 3000);
+
+  uint8_t *packet = NULL;
+  uint16_t packet_length = 0;
+  reassemble_sent(0, &packet, &packet_length);
+  reassemble_sent(1, &packet, &packet_length);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, reassemble_sent(1, &packet, &packet_length));
+  TEST_ASSERT_NULL(packet);
+
+  reassemble_sent(2, &packet, &packet_length);
+  TEST_ASSERT_NOT_NULL(packet);
+  he_internal_free(packet);
+}
+
+void test_frag_reassemble_bad_fragments(void) {
+  uint8_t data[100] = {0};
+  uint8_t *packet = NULL;
+  uint16_t packet_length = 0;
+
+  // Larger than agreed
+  he_msg_data_fragment_t fragment = make_fragment(1, sizeof(jumbo) + 1, 0, 2);
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET,
+                    he_internal_frag_reassemble(conn, &fragment, data, 100, &packet, &packet_length));
+
+  // Needs at least two fragments, and no more than fit in the mask
+  fragment = make_fragment(1, 1000, 0, 1);
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET,
+                    he_internal_frag_reassemble(conn, &fragment, data, 100, &packet, &packet_length));
+  fragment = make_fragment(1, 1000, 0, HE_FRAG_MAX_FRAGMENTS + 1);
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET,
+                    he_internal_frag_reassemble(conn, &fragment, data, 100, &packet, &packet_length));
+
+  // Index out of range
+  fragment = make_fragment(1, 1000, 2, 2);
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET,
+                    he_internal_frag_reassemble(conn, &fragment, data, 100, &packet, &packet_length));
+
+  // Empty
+  fragment = make_fragment(1, 1000, 0, 2);
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET,
+                    he_internal_frag_reassemble(conn, &fragment, data, 0, &packet, &packet_length));
+
+  // Runs past the end of the packet
+  fragment = make_fragment(1, 150, 1, 3);
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET,
+                    he_internal_frag_reassemble(conn, &fragment, data, 100, &packet, &packet_length));
+  fragment = make_fragment(1, 50, 1, 2);
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET,
+                    he_internal_frag_reassemble(conn, &fragment, data, 100, &packet, &packet_length));
+
+  // Jumbo MTU wasn't agreed
+  conn->inner_mtu = 0;
+  fragment = make_fragment(1, 1000, 0, 2);
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET,
+                    he_internal_frag_reassemble(conn, &fragment, data, 100, &packet, &packet_length));
+
+  TEST_ASSERT_NULL(packet);
+  TEST_ASSERT_NULL(conn->reassembly);
+}
+
+void test_frag_reassemble_last_fragment_doesnt_fit(void) {
+  uint8_t data[100] = {0};
+  uint8_t *packet = NULL;
+  uint16_t packet_length = 0;
+
+  // The other two fragments would have to be 75 bytes and a half
+  he_msg_data_fragment_t fragment = make_fragment(1, 251, 2, 3);
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET,
+                    he_internal_frag_reassemble(conn, &fragment, data, 100, &packet, &packet_length));
+
+  // Longer than the fragments before it
+  fragment = make_fragment(1, 220, 2, 3);
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET,
+                    he_internal_frag_reassemble(conn, &fragment, data, 100, &packet, &packet_length));
+
+  TEST_ASSERT_NULL(conn->reassembly);
+}
+
+void test_frag_reassemble_gapped(void) {
+  uint8_t data[100];
+  memset(data, 0xAA, sizeof(data));
+  uint8_t *packet = NULL;
+  uint16_t packet_length = 0;
+
+  // A short middle fragment would leave 20 bytes between it and the last one
+  he_msg_data_fragment_t fragment = make_fragment(1, 300, 0, 3);
+  TEST_ASSERT_EQUAL(HE_SUCCESS,
+                    he_internal_frag_reassemble(conn, &fragment, data, 100, &packet, &packet_length));
+  fragment = make_fragment(1, 300, 1, 3);
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET,
+                    he_internal_frag_reassemble(conn, &fragment, data, 80, &packet, &packet_length));
+  fragment = make_fragment(1, 300, 2, 3);
+  TEST_ASSERT_EQUAL(HE_SUCCESS,
+                    he_internal_frag_reassemble(conn, &fragment, data, 100, &packet, &packet_length));
+
+  // The short middle fragment was dropped, so the packet is never handed over with a hole in it
+  TEST_ASSERT_NULL(packet);
+  TEST_ASSERT_EQUAL(200, conn->reassembly[0].received_length);
+}
+
+void test_frag_reassemble_overlapping(void) {
+  uint8_t data[150];
+  memset(data, 0xAA, sizeof(data));
+  uint8_t *packet = NULL;
+  uint16_t packet_length = 0;
+
+  // Fixes 100 byte fragments, the last one being 50 bytes
+  he_msg_data_fragment_t fragment = make_fragment(1, 250, 2, 3);
+  TEST_ASSERT_EQUAL(HE_SUCCESS,
+                    he_internal_frag_reassemble(conn, &fragment, data, 50, &packet, &packet_length));
+
+  // A 120 byte fragment would overlap its neighbours
+  fragment = make_fragment(1, 250, 0, 3);
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET,
+                    he_internal_frag_reassemble(conn, &fragment, data, 120, &packet, &packet_length));
+  fragment = make_fragment(1, 250, 1, 3);
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET,
+                    he_internal_frag_reassemble(conn, &fragment, data, 120, &packet, &packet_length));
+  TEST_ASSERT_NULL(packet);
+  TEST_ASSERT_EQUAL(50, conn->reassembly[0].received_length);
+
+  // The right sizes still complete it
+  fragment = make_fragment(1, 250, 0, 3);
+  he_internal_frag_reassemble(conn, &fragment, data, 100, &packet, &packet_length);
+  fragment = make_fragment(1, 250, 1, 3);
+  TEST_ASSERT_EQUAL(HE_SUCCESS,
+                    he_internal_frag_reassemble(conn, &fragment, data, 100, &packet, &packet_length));
+  TEST_ASSERT_NOT_NULL(packet);
+  TEST_ASSERT_EQUAL(250, packet_length);
+  he_internal_free(packet);
+}
+
+void test_frag_reassemble_timeout(void) {
+  uint8_t data[100] = {0};
+  uint8_t *packet = NULL;
+  uint16_t packet_length = 0;
+
+  he_msg_data_fragment_t fragment = make_fragment(1, 200, 0, 2);
+  he_internal_frag_reassemble(conn, &fragment, data, 100, &packet, &packet_length);
+  TEST_ASSERT_NOT_NULL(conn->reassembly[0].buffer);
+
+  // The rest arrives too late, so it starts a new packet rather than completing the old one
+  he_internal_clock_ms_IgnoreAndReturn(1000 + HE_FRAG_TIMEOUT_MS);
+  fragment = make_fragment(1, 200, 1, 2);
+  TEST_ASSERT_EQUAL(HE_SUCCESS,
+                    he_internal_frag_reassemble(conn, &fragment, data, 100, &packet, &packet_length));
+  TEST_ASSERT_NULL(packet);
+  TEST_ASSERT_EQUAL(2, conn->reassembly[0].received);
+}
+
+void test_frag_reassemble_evicts_oldest(void) {
+  uint8_t data[100] = {0};
+  uint8_t *packet = NULL;
+  uint16_t packet_length = 0;
+
+  for(int i = 0; i < HE_FRAG_MAX_REASSEMBLIES; i++) {
+    he_internal_clock_ms_IgnoreAndReturn(1000 + i);
+    he_msg_data_fragment_t fragment = make_fragment((uint16_t)i, 200, 0, 2);
+    he_internal_frag_reassemble(conn, &fragment, data, 100, &packet, &packet_length);
+  }
+
+  // One more packet than there is room for pushes out the first
+  he_internal_clock_ms_IgnoreAndReturn(1000 + HE_FRAG_MAX_REASSEMBLIES);
+  he_msg_data_fragment_t fragment = make_fragment(100, 200, 0, 2);
+  TEST_ASSERT_EQUAL(HE_SUCCESS,
+                    he_internal_frag_reassemble(conn, &fragment, data, 100, &packet, &packet_length));
+
+  TEST_ASSERT_EQUAL(100, conn->reassembly[0].id);
+  for(int i = 1; i < HE_FRAG_MAX_REASSEMBLIES; i++) {
+    TEST_ASSERT_EQUAL(i, conn->reassembly[i].id);
+  }
+}
+
+void test_frag_free(void) {
+  uint8_t data[100] = {0};
+  uint8_t *packet = NULL;
+  uint16_t packet_length = 0;
+
+  he_msg_data_fragment_t fragment = make_fragment(1, 200, 0, 2);
+  he_internal_frag_reassemble(conn, &fragment, data, 100, &packet, &packet_length);
+
+  he_internal_frag_free(conn);
+  TEST_ASSERT_NULL(conn->reassembly);
+
+  // Safe to call again
+  he_internal_frag_free(conn);
+}
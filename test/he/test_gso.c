@@ -0,0 +1,459 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <he.h>
+#include "unity.h"
+#include "test_defs.h"
+
+// Unit under test
+#include "gso.h"
+
+// Direct Includes for Utility Functions
+#include "memory.h"
+#include "network.h"
+#include "flow_hash.h"
+
+// Internal Mocks
+#include "mock_flow.h"
+
+#define IP_HEADER_LENGTH 20
+// With 12 bytes of options, e.g. timestamps
+#define TCP_HEADER_LENGTH 32
+#define HEADER_LENGTH (IP_HEADER_LENGTH + TCP_HEADER_LENGTH)
+
+#define FLAG_FIN 0x01
+#define FLAG_PSH 0x08
+#define FLAG_ACK 0x10
+#define FLAG_CWR 0x80
+
+static he_conn_t *conn = NULL;
+static uint8_t packet[HE_MAX_JUMBO_MTU];
+
+// Packets captured from he_conn_inside_packet_received or the inside write GRO callback
+static uint8_t written[8][HE_MAX_JUMBO_MTU];
+static size_t written_length[8];
+static he_virtio_net_hdr_t written_hdr[8];
+static he_flow_info_t written_flow[8];
+static int written_count = 0;
+
+static uint32_t sum16(uint32_t sum, const uint8_t *data, size_t length) {
+  for(size_t i = 0; i + 1 < length; i += 2) {
+    sum += (uint32_t)((data[i] << 8) | data[i + 1]);
+  }
+  if(length & 1) {
+    sum += (uint32_t)(data[length - 1] << 8);
+  }
+  return sum;
+}
+
+static uint16_t fold(uint32_t sum) {
+  while(sum >> 16) {
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  }
+  return (uint16_t)sum;
+}
+
+static uint32_t pseudo_header_sum(const uint8_t *p, size_t tcp_length) {
+  return sum16(6 + (uint32_t)tcp_length, p + 12, 8);
+}
+
+static bool checksums_valid(const uint8_t *p, size_t length) {
+  return fold(sum16(0, p, IP_HEADER_LENGTH)) == 0xFFFF &&
+         fold(sum16(pseudo_header_sum(p, length - IP_HEADER_LENGTH), p + IP_HEADER_LENGTH,
+                    length - IP_HEADER_LENGTH)) == 0xFFFF;
+}
+
+static void write16(uint8_t *p, uint16_t value) {
+  p[0] = (uint8_t)(value >> 8);
+  p[1] = (uint8_t)value;
+}
+
+// Payload bytes depend on their sequence number, so reordering shows up
+static size_t build_segment(uint8_t *p, uint32_t seq, uint8_t flags, size_t payload_length) {
+  memset(p, 0, HEADER_LENGTH);
+  ipv4_header_t *ip = (ipv4_header_t *)p;
+  ip->ver_ihl = 0x45;
+  ip->total_length = htons((uint16_t)(HEADER_LENGTH + payload_length));
+  ip->id = htons(100);
+  ip->flags_fo = htons(0x4000);
+  ip->ttl = 64;
+  ip->protocol = 6;
+  ip->src_addr = htonl(0x0A000001);
+  ip->dst_addr = htonl(0x0A000002);
+  write16((uint8_t *)&ip->checksum, (uint16_t)~fold(sum16(0, p, IP_HEADER_LENGTH)));
+
+  tcp_header_t *tcp = (tcp_header_t *)(p + IP_HEADER_LENGTH);
+  tcp->src_port = htons(443);
+  tcp->dst_port = htons(50000);
+  tcp->seq = htonl(seq);
+  tcp->ack = htonl(7);
+  tcp->data_offset = (TCP_HEADER_LENGTH / 4) << 4;
+  tcp->flags = flags;
+  tcp->window = htons(1024);
+  // NOP, NOP, timestamps
+  uint8_t options[12] = {1, 1, 8, 10, 0, 0, 0, 1, 0, 0, 0, 2};
+  memcpy(p + IP_HEADER_LENGTH + sizeof(tcp_header_t), options, sizeof(options));
+
+  for(size_t i = 0; i < payload_length; i++) {
+    p[HEADER_LENGTH + i] = (uint8_t)((seq + i) % 251);
+  }
+
+  size_t length = HEADER_LENGTH + payload_length;
+  write16((uint8_t *)&tcp->checksum,
+          (uint16_t)~fold(sum16(pseudo_header_sum(p, length - IP_HEADER_LENGTH),
+                                p + IP_HEADER_LENGTH, length - IP_HEADER_LENGTH)));
+  return length;
+}
+
+static he_return_code_t stub_inside_packet_received(he_conn_t *conn, uint8_t *packet,
+                                                    size_t length, int numCalls) {
+  memcpy(written[written_count], packet, length);
+  written_length[written_count] = length;
+  written_count++;
+  return HE_SUCCESS;
+}
+
+static he_return_code_t inside_write_gro_cb(he_conn_t *conn, const he_virtio_net_hdr_t *vnet_hdr,
+                                           const he_flow_info_t *flow, uint8_t *packet,
+                                           size_t length, void *context) {
+  memcpy(written[written_count], packet, length);
+  written_length[written_count] = length;
+  written_hdr[written_count] = *vnet_hdr;
+  written_flow[written_count] = *flow;
+  written_count++;
+  return HE_SUCCESS;
+}
+
+static uint32_t seq_of(int i) {
+  return ntohl(((tcp_header_t *)(written[i] + IP_HEADER_LENGTH))->seq);
+}
+
+static uint8_t flags_of(int i) {
+  return ((tcp_header_t *)(written[i] + IP_HEADER_LENGTH))->flags;
+}
+
+void setUp(void) {
+  conn = calloc(1, sizeof(he_conn_t));
+  conn->state = HE_STATE_ONLINE;
+  conn->inside_write_gro_cb = inside_write_gro_cb;
+  written_count = 0;
+}
+
+void tearDown(void) {
+  he_internal_gro_free(conn);
+  free(conn);
+}
+
+void test_gso_null_pointers(void) {
+  he_virtio_net_hdr_t vnet_hdr = {0};
+
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER,
+                    he_conn_inside_gso_packet_received(NULL, &vnet_hdr, packet, 100));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER,
+                    he_conn_inside_gso_packet_received(conn, NULL, packet, 100));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER,
+                    he_conn_inside_gso_packet_received(conn, &vnet_hdr, NULL, 100));
+}
+
+void test_gso_ordinary_packet(void) {
+  he_virtio_net_hdr_t vnet_hdr = {0};
+  size_t length = build_segment(packet, 1000, FLAG_ACK, 500);
+
+  he_conn_inside_packet_received_ExpectAndReturn(conn, packet, length, HE_SUCCESS);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_inside_gso_packet_received(conn, &vnet_hdr, packet, length));
+}
+
+void test_gso_completes_checksum(void) {
+  size_t length = build_segment(packet, 1000, FLAG_ACK, 501);
+
+  // Leave only the pseudo header's sum in place, as the kernel does
+  write16(packet + IP_HEADER_LENGTH + 16,
+          fold(pseudo_header_sum(packet, length - IP_HEADER_LENGTH)));
+
+  he_virtio_net_hdr_t vnet_hdr = {0};
+  vnet_hdr.flags = HE_VIRTIO_NET_HDR_F_NEEDS_CSUM;
+  vnet_hdr.csum_start = IP_HEADER_LENGTH;
+  vnet_hdr.csum_offset = 16;
+
+  he_conn_inside_packet_received_Stub(stub_inside_packet_received);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_inside_gso_packet_received(conn, &vnet_hdr, packet, length));
+  TEST_ASSERT_EQUAL(1, written_count);
+  TEST_ASSERT_TRUE(checksums_valid(written[0], written_length[0]));
+
+  // Checksum beyond the end of the packet
+  vnet_hdr.csum_start = (uint16_t)length - 1;
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET,
+                    he_conn_inside_gso_packet_received(conn, &vnet_hdr, packet, length));
+}
+
+void test_gso_unsupported_type(void) {
+  he_virtio_net_hdr_t vnet_hdr = {0};
+  // UDP fragmentation offload
+  vnet_hdr.gso_type = 3;
+
+  TEST_ASSERT_EQUAL(HE_ERR_UNSUPPORTED_PACKET_TYPE,
+                    he_conn_inside_gso_packet_received(conn, &vnet_hdr, packet, 100));
+}
+
+void test_gso_not_online(void) {
+  he_virtio_net_hdr_t vnet_hdr = {.gso_type = HE_VIRTIO_NET_HDR_GSO_TCPV4, .gso_size = 1000};
+  size_t length = build_segment(packet, 1000, FLAG_ACK, 3000);
+  conn->state = HE_STATE_LINK_UP;
+
+  TEST_ASSERT_EQUAL(HE_ERR_INVALID_CLIENT_STATE,
+                    he_conn_inside_gso_packet_received(conn, &vnet_hdr, packet, length));
+}
+
+void test_gso_bad_packet(void) {
+  he_virtio_net_hdr_t vnet_hdr = {.gso_type = HE_VIRTIO_NET_HDR_GSO_TCPV4, .gso_size = 1000};
+  size_t length = build_segment(packet, 1000, FLAG_ACK, 3000);
+
+  // Not TCP
+  packet[9] = 17;
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET,
+                    he_conn_inside_gso_packet_received(conn, &vnet_hdr, packet, length));
+  packet[9] = 6;
+
+  // Longer than what was read
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET,
+                    he_conn_inside_gso_packet_received(conn, &vnet_hdr, packet, length - 1));
+
+  // No segment size
+  vnet_hdr.gso_size = 0;
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET,
+                    he_conn_inside_gso_packet_received(conn, &vnet_hdr, packet, length));
+}
+
+void test_gso_segments(void) {
+  he_virtio_net_hdr_t vnet_hdr = {.flags = HE_VIRTIO_NET_HDR_F_NEEDS_CSUM,
+                                  .gso_type = HE_VIRTIO_NET_HDR_GSO_TCPV4,
+                                  .hdr_len = HEADER_LENGTH,
+                                  .gso_size = 1000,
+                                  .csum_start = IP_HEADER_LENGTH,
+                                  .csum_offset = 16};
+  size_t length = build_segment(packet, 5000, FLAG_ACK | FLAG_PSH | FLAG_FIN | FLAG_CWR, 2500);
+  uint8_t original[HE_MAX_JUMBO_MTU];
+  memcpy(original, packet, length);
+
+  he_conn_inside_packet_received_Stub(stub_inside_packet_received);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_inside_gso_packet_received(conn, &vnet_hdr, packet, length));
+
+  TEST_ASSERT_EQUAL(3, written_count);
+  TEST_ASSERT_EQUAL(HEADER_LENGTH + 1000, written_length[0]);
+  TEST_ASSERT_EQUAL(HEADER_LENGTH + 1000, written_length[1]);
+  TEST_ASSERT_EQUAL(HEADER_LENGTH + 500, written_length[2]);
+
+  for(int i = 0; i < 3; i++) {
+    ipv4_header_t *ip = (ipv4_header_t *)written[i];
+    TEST_ASSERT_EQUAL(written_length[i], ntohs(ip->total_length));
+    TEST_ASSERT_EQUAL(100 + i, ntohs(ip->id));
+    TEST_ASSERT_EQUAL(5000 + i * 1000, seq_of(i));
+    TEST_ASSERT_TRUE(checksums_valid(written[i], written_length[i]));
+    // Options are carried by every segment
+    TEST_ASSERT_EQUAL_MEMORY(original + IP_HEADER_LENGTH + sizeof(tcp_header_t),
+                             written[i] + IP_HEADER_LENGTH + sizeof(tcp_header_t),
+                             TCP_HEADER_LENGTH - sizeof(tcp_header_t));
+    TEST_ASSERT_EQUAL_MEMORY(original + HEADER_LENGTH + i * 1000, written[i] + HEADER_LENGTH,
+                             written_length[i] - HEADER_LENGTH);
+  }
+
+  TEST_ASSERT_EQUAL(FLAG_ACK | FLAG_CWR, flags_of(0));
+  TEST_ASSERT_EQUAL(FLAG_ACK, flags_of(1));
+  TEST_ASSERT_EQUAL(FLAG_ACK | FLAG_PSH | FLAG_FIN, flags_of(2));
+}
+
+void test_gso_segment_error(void) {
+  he_virtio_net_hdr_t vnet_hdr = {.gso_type = HE_VIRTIO_NET_HDR_GSO_TCPV4, .gso_size = 1000};
+  size_t length = build_segment(packet, 5000, FLAG_ACK, 2500);
+
+  he_conn_inside_packet_received_ExpectAnyArgsAndReturn(HE_ERR_PACKET_TOO_LARGE);
+
+  TEST_ASSERT_EQUAL(HE_ERR_PACKET_TOO_LARGE,
+                    he_conn_inside_gso_packet_received(conn, &vnet_hdr, packet, length));
+}
+
+void test_gso_first_segment_bypassed_leaves_packet(void) {
+  he_virtio_net_hdr_t vnet_hdr = {.gso_type = HE_VIRTIO_NET_HDR_GSO_TCPV4, .gso_size = 1000};
+  size_t length = build_segment(packet, 5000, FLAG_ACK | FLAG_PSH, 2500);
+  uint8_t original[HEADER_LENGTH + 2500];
+  memcpy(original, packet, length);
+
+  he_conn_inside_packet_received_ExpectAnyArgsAndReturn(HE_ERR_PACKET_BYPASSED);
+
+  TEST_ASSERT_EQUAL(HE_ERR_PACKET_BYPASSED,
+                    he_conn_inside_gso_packet_received(conn, &vnet_hdr, packet, length));
+  // Still the super-packet the host gave us, for it to send outside the tunnel
+  TEST_ASSERT_EQUAL_MEMORY(original, packet, length);
+}
+
+void test_gro_single_segment(void) {
+  size_t length = build_segment(packet, 1000, FLAG_ACK, 1000);
+
+  he_internal_gro_deliver(conn, packet, length);
+  // Held in case the next segment follows on
+  TEST_ASSERT_EQUAL(0, written_count);
+
+  he_internal_gro_flush(conn);
+  TEST_ASSERT_EQUAL(1, written_count);
+  TEST_ASSERT_EQUAL(HE_VIRTIO_NET_HDR_GSO_NONE, written_hdr[0].gso_type);
+  TEST_ASSERT_EQUAL(0, written_hdr[0].flags);
+  TEST_ASSERT_EQUAL(length, written_length[0]);
+  TEST_ASSERT_EQUAL_MEMORY(packet, written[0], length);
+
+  // Nothing left to flush
+  he_internal_gro_flush(conn);
+  TEST_ASSERT_EQUAL(1, written_count);
+}
+
+void test_gro_merges_segments(void) {
+  uint8_t expected[HE_MAX_JUMBO_MTU];
+  size_t expected_length = build_segment(expected, 1000, FLAG_ACK | FLAG_PSH, 2500);
+
+  for(int i = 0; i < 3; i++) {
+    size_t payload = i < 2 ? 1000 : 500;
+    uint8_t flags = i < 2 ? FLAG_ACK : FLAG_ACK | FLAG_PSH;
+    size_t length = build_segment(packet, 1000 + i * 1000, flags, payload);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_gro_deliver(conn, packet, length));
+  }
+
+  // The short last segment ends the super-packet without waiting for a flush
+  TEST_ASSERT_EQUAL(1, written_count);
+  TEST_ASSERT_EQUAL(expected_length, written_length[0]);
+  TEST_ASSERT_EQUAL(HE_VIRTIO_NET_HDR_F_NEEDS_CSUM, written_hdr[0].flags);
+  TEST_ASSERT_EQUAL(HE_VIRTIO_NET_HDR_GSO_TCPV4, written_hdr[0].gso_type);
+  TEST_ASSERT_EQUAL(HEADER_LENGTH, written_hdr[0].hdr_len);
+  TEST_ASSERT_EQUAL(1000, written_hdr[0].gso_size);
+  TEST_ASSERT_EQUAL(IP_HEADER_LENGTH, written_hdr[0].csum_start);
+  TEST_ASSERT_EQUAL(16, written_hdr[0].csum_offset);
+
+  // Same packet as if it had never been split, but with a partial TCP checksum
+  TEST_ASSERT_EQUAL_MEMORY(expected, written[0], IP_HEADER_LENGTH + 16);
+  TEST_ASSERT_EQUAL_MEMORY(expected + IP_HEADER_LENGTH + 18, written[0] + IP_HEADER_LENGTH + 18,
+                           expected_length - IP_HEADER_LENGTH - 18);
+  TEST_ASSERT_EQUAL(fold(pseudo_header_sum(expected, expected_length - IP_HEADER_LENGTH)),
+                    (written[0][IP_HEADER_LENGTH + 16] << 8) | written[0][IP_HEADER_LENGTH + 17]);
+
+  // The super-packet is classified like any one of its segments
+  he_flow_info_t flow = {0};
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_flow_classify(packet, HEADER_LENGTH + 500, &flow));
+  TEST_ASSERT_EQUAL(6, written_flow[0].protocol);
+  TEST_ASSERT_EQUAL(0x0A000001, written_flow[0].src_addr);
+  TEST_ASSERT_EQUAL(0x0A000002, written_flow[0].dst_addr);
+  TEST_ASSERT_EQUAL(443, written_flow[0].src_port);
+  TEST_ASSERT_EQUAL(50000, written_flow[0].dst_port);
+  TEST_ASSERT_EQUAL(flow.hash, written_flow[0].hash);
+}
+
+void test_gro_buffer_sized_for_segments(void) {
+  size_t length = build_segment(packet, 1000, FLAG_ACK, 100);
+  he_internal_gro_deliver(conn, packet, length);
+  TEST_ASSERT_EQUAL(HEADER_LENGTH + 100 * HE_GRO_MAX_SEGMENTS, conn->gro->capacity);
+
+  // No more than HE_GRO_MAX_SEGMENTS are merged
+  for(int i = 1; i <= HE_GRO_MAX_SEGMENTS; i++) {
+    length = build_segment(packet, 1000 + i * 100, FLAG_ACK, 100);
+    he_internal_gro_deliver(conn, packet, length);
+  }
+  TEST_ASSERT_EQUAL(1, written_count);
+  TEST_ASSERT_EQUAL(HEADER_LENGTH + 100 * HE_GRO_MAX_SEGMENTS, written_length[0]);
+  // The one after them starts the next super-packet
+  TEST_ASSERT_EQUAL(1000 + (HE_GRO_MAX_SEGMENTS + 1) * 100, conn->gro->next_seq);
+
+  // Grows for larger segments
+  he_internal_gro_flush(conn);
+  length = build_segment(packet, 50000, FLAG_ACK, 1000);
+  he_internal_gro_deliver(conn, packet, length);
+  TEST_ASSERT_EQUAL(HEADER_LENGTH + 1000 * HE_GRO_MAX_SEGMENTS, conn->gro->capacity);
+  he_internal_gro_flush(conn);
+  TEST_ASSERT_EQUAL(3, written_count);
+  TEST_ASSERT_EQUAL(HEADER_LENGTH + 1000, written_length[2]);
+}
+
+void test_gro_out_of_order(void) {
+  size_t length = build_segment(packet, 1000, FLAG_ACK, 1000);
+  he_internal_gro_deliver(conn, packet, length);
+
+  // A gap in the sequence numbers
+  length = build_segment(packet, 3000, FLAG_ACK, 1000);
+  he_internal_gro_deliver(conn, packet, length);
+
+  TEST_ASSERT_EQUAL(1, written_count);
+  TEST_ASSERT_EQUAL(1000, seq_of(0));
+
+  he_internal_gro_flush(conn);
+  TEST_ASSERT_EQUAL(2, written_count);
+  TEST_ASSERT_EQUAL(3000, seq_of(1));
+  TEST_ASSERT_EQUAL(HE_VIRTIO_NET_HDR_GSO_NONE, written_hdr[1].gso_type);
+}
+
+void test_gro_different_flow(void) {
+  size_t length = build_segment(packet, 1000, FLAG_ACK, 1000);
+  he_internal_gro_deliver(conn, packet, length);
+
+  // Same sequence numbers but another port
+  length = build_segment(packet, 2000, FLAG_ACK, 1000);
+  ((tcp_header_t *)(packet + IP_HEADER_LENGTH))->dst_port = htons(50001);
+  he_internal_gro_deliver(conn, packet, length);
+  he_internal_gro_flush(conn);
+
+  TEST_ASSERT_EQUAL(2, written_count);
+  TEST_ASSERT_EQUAL(HEADER_LENGTH + 1000, written_length[0]);
+  TEST_ASSERT_EQUAL(HEADER_LENGTH + 1000, written_length[1]);
+}
+
+void test_gro_other_packets_keep_order(void) {
+  size_t length = build_segment(packet, 1000, FLAG_ACK, 1000);
+  he_internal_gro_deliver(conn, packet, length);
+
+  // Not worth merging, but has to come after what's held
+  he_internal_gro_deliver(conn, fake_ipv4_packet, sizeof(fake_ipv4_packet));
+
+  TEST_ASSERT_EQUAL(2, written_count);
+  TEST_ASSERT_EQUAL(HEADER_LENGTH + 1000, written_length[0]);
+  TEST_ASSERT_EQUAL(sizeof(fake_ipv4_packet), written_length[1]);
+  TEST_ASSERT_EQUAL(HE_VIRTIO_NET_HDR_GSO_NONE, written_hdr[1].gso_type);
+
+  // Packets that aren't merged still come with their flow
+  he_flow_info_t flow = {0};
+  he_flow_classify(fake_ipv4_packet, sizeof(fake_ipv4_packet), &flow);
+  TEST_ASSERT_EQUAL_MEMORY(&flow, &written_flow[1], sizeof(flow));
+}
+
+void test_gro_syn_is_not_held(void) {
+  size_t length = build_segment(packet, 1000, 0x02, 0);
+
+  he_internal_gro_deliver(conn, packet, length);
+
+  TEST_ASSERT_EQUAL(1, written_count);
+  TEST_ASSERT_NULL(conn->gro);
+}
+
+void test_gro_free(void) {
+  size_t length = build_segment(packet, 1000, FLAG_ACK, 1000);
+  he_internal_gro_deliver(conn, packet, length);
+  TEST_ASSERT_NOT_NULL(conn->gro);
+
+  he_internal_gro_free(conn);
+  TEST_ASSERT_NULL(conn->gro);
+
+  // Safe to call again
+  he_internal_gro_free(conn);
+}
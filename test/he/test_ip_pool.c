@@ -0,0 +1,376 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <he.h>
+#include "unity.h"
+#include "test_defs.h"
+
+// Unit under test
+#include "ip_pool.h"
+
+// Direct Includes for Utility Functions
+#include "grace.h"
+#include "ipv4.h"
+#include "memory.h"
+
+static he_ip_pool_t *pool = NULL;
+static he_conn_t conn = {0};
+static he_network_config_ipv4_t config = {0};
+
+void setUp(void) {
+  pool = NULL;
+  memset(&conn, 0, sizeof(conn));
+  memset(&config, 0, sizeof(config));
+}
+
+void tearDown(void) {
+  he_ip_pool_destroy(pool);
+}
+
+void test_create_rejects_bad_ranges(void) {
+  TEST_ASSERT_NULL(he_ip_pool_create(NULL));
+  TEST_ASSERT_NULL(he_ip_pool_create(""));
+  TEST_ASSERT_NULL(he_ip_pool_create("10.125.0.0"));
+  TEST_ASSERT_NULL(he_ip_pool_create("10.125.0.0/16x"));
+  TEST_ASSERT_NULL(he_ip_pool_create("10.256.0.0/16"));
+  TEST_ASSERT_NULL(he_ip_pool_create("10.0.0.0/8"));
+  TEST_ASSERT_NULL(he_ip_pool_create("10.125.0.0/31"));
+}
+
+void test_create(void) {
+  pool = he_ip_pool_create("10.125.0.0/16");
+  TEST_ASSERT_NOT_NULL(pool);
+  // Less the network, gateway and broadcast addresses
+  TEST_ASSERT_EQUAL(65533, he_ip_pool_available(pool));
+}
+
+void test_create_masks_host_bits(void) {
+  pool = he_ip_pool_create("10.125.3.7/24");
+  TEST_ASSERT_NOT_NULL(pool);
+  conn.ip_pool = pool;
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_ip_pool_assign(&conn, &config));
+  TEST_ASSERT_EQUAL_STRING("10.125.3.2", config.local_ip);
+  TEST_ASSERT_EQUAL_STRING("10.125.3.1", config.peer_ip);
+}
+
+void test_available_null(void) {
+  TEST_ASSERT_EQUAL(0, he_ip_pool_available(NULL));
+}
+
+void test_destroy_null(void) {
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_ip_pool_destroy(NULL));
+}
+
+void test_assign_null_pointers(void) {
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_internal_ip_pool_assign(NULL, &config));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_internal_ip_pool_assign(&conn, NULL));
+  // The connection has no pool
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_internal_ip_pool_assign(&conn, &config));
+}
+
+void test_assign(void) {
+  pool = he_ip_pool_create("10.125.0.0/16");
+  conn.ip_pool = pool;
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_ip_pool_assign(&conn, &config));
+  TEST_ASSERT_EQUAL_STRING("10.125.0.2", config.local_ip);
+  TEST_ASSERT_EQUAL_STRING("10.125.0.1", config.peer_ip);
+  TEST_ASSERT_EQUAL_STRING("10.125.0.1", config.dns_ip);
+  TEST_ASSERT_EQUAL(0x0A7D0002, conn.pool_address);
+  TEST_ASSERT_EQUAL(65532, he_ip_pool_available(pool));
+
+  // The next client gets the next address
+  he_conn_t other = {0};
+  other.ip_pool = pool;
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_ip_pool_assign(&other, &config));
+  TEST_ASSERT_EQUAL_STRING("10.125.0.3", config.local_ip);
+}
+
+void test_assign_keeps_address(void) {
+  pool = he_ip_pool_create("10.125.0.0/16");
+  conn.ip_pool = pool;
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_ip_pool_assign(&conn, &config));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_ip_pool_assign(&conn, &config));
+  TEST_ASSERT_EQUAL_STRING("10.125.0.2", config.local_ip);
+  TEST_ASSERT_EQUAL(65532, he_ip_pool_available(pool));
+}
+
+void test_assign_exhausted(void) {
+  pool = he_ip_pool_create("10.125.0.0/30");
+  TEST_ASSERT_EQUAL(1, he_ip_pool_available(pool));
+  conn.ip_pool = pool;
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_ip_pool_assign(&conn, &config));
+  TEST_ASSERT_EQUAL_STRING("10.125.0.2", config.local_ip);
+
+  he_conn_t other = {0};
+  other.ip_pool = pool;
+  TEST_ASSERT_EQUAL(HE_ERR_IP_POOL_EXHAUSTED, he_internal_ip_pool_assign(&other, &config));
+  TEST_ASSERT_EQUAL(0, other.pool_address);
+  TEST_ASSERT_EQUAL(0, he_ip_pool_available(pool));
+}
+
+void test_release(void) {
+  pool = he_ip_pool_create("10.125.0.0/30");
+  conn.ip_pool = pool;
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_ip_pool_assign(&conn, &config));
+
+  he_internal_ip_pool_release(&conn);
+  TEST_ASSERT_EQUAL(0, conn.pool_address);
+  TEST_ASSERT_EQUAL(1, he_ip_pool_available(pool));
+
+  // Releasing twice doesn't give the address back twice
+  he_internal_ip_pool_release(&conn);
+  TEST_ASSERT_EQUAL(1, he_ip_pool_available(pool));
+
+  // The address can be handed out again
+  he_conn_t other = {0};
+  other.ip_pool = pool;
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_ip_pool_assign(&other, &config));
+  TEST_ASSERT_EQUAL_STRING("10.125.0.2", config.local_ip);
+}
+
+void test_release_reuses_most_recent(void) {
+  pool = he_ip_pool_create("10.125.0.0/24");
+  he_conn_t conns[3] = {0};
+  for(int i = 0; i < 3; i++) {
+    conns[i].ip_pool = pool;
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_ip_pool_assign(&conns[i], &config));
+  }
+
+  he_internal_ip_pool_release(&conns[1]);
+  he_internal_ip_pool_release(&conns[0]);
+
+  conn.ip_pool = pool;
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_ip_pool_assign(&conn, &config));
+  TEST_ASSERT_EQUAL_STRING("10.125.0.2", config.local_ip);
+  memset(&conn, 0, sizeof(conn));
+  conn.ip_pool = pool;
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_ip_pool_assign(&conn, &config));
+  TEST_ASSERT_EQUAL_STRING("10.125.0.3", config.local_ip);
+}
+
+void test_release_without_address(void) {
+  pool = he_ip_pool_create("10.125.0.0/30");
+  conn.ip_pool = pool;
+
+  he_internal_ip_pool_release(&conn);
+  he_internal_ip_pool_release(NULL);
+  TEST_ASSERT_EQUAL(1, he_ip_pool_available(pool));
+}
+
+void test_claim_null_pointer(void) {
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_internal_ip_pool_claim(NULL, 0x0A7D0005));
+}
+
+void test_claim(void) {
+  pool = he_ip_pool_create("10.125.0.0/24");
+  conn.ip_pool = pool;
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_ip_pool_claim(&conn, 0x0A7D0005));
+  TEST_ASSERT_EQUAL(0x0A7D0005, conn.pool_address);
+  TEST_ASSERT_EQUAL(252, he_ip_pool_available(pool));
+  TEST_ASSERT_EQUAL_PTR(&conn, he_ip_pool_lookup(pool, htonl(0x0A7D0005)));
+
+  // Still on the stack, but never handed out to anyone else
+  const char *expected[] = {"10.125.0.2", "10.125.0.3", "10.125.0.4", "10.125.0.6"};
+  he_conn_t others[4] = {0};
+  for(int i = 0; i < 4; i++) {
+    others[i].ip_pool = pool;
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_ip_pool_assign(&others[i], &config));
+    TEST_ASSERT_EQUAL_STRING(expected[i], config.local_ip);
+  }
+  TEST_ASSERT_EQUAL(248, he_ip_pool_available(pool));
+  TEST_ASSERT_EQUAL_PTR(&conn, he_ip_pool_lookup(pool, htonl(0x0A7D0005)));
+}
+
+void test_claim_taken(void) {
+  pool = he_ip_pool_create("10.125.0.0/24");
+  conn.ip_pool = pool;
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_ip_pool_assign(&conn, &config));
+
+  he_conn_t other = {0};
+  other.ip_pool = pool;
+  TEST_ASSERT_EQUAL(HE_ERR_IP_POOL_ADDRESS_TAKEN, he_internal_ip_pool_claim(&other, 0x0A7D0002));
+  TEST_ASSERT_EQUAL(0, other.pool_address);
+  TEST_ASSERT_EQUAL(252, he_ip_pool_available(pool));
+  TEST_ASSERT_EQUAL_PTR(&conn, he_ip_pool_lookup(pool, htonl(0x0A7D0002)));
+}
+
+void test_claim_own_address(void) {
+  pool = he_ip_pool_create("10.125.0.0/24");
+  conn.ip_pool = pool;
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_ip_pool_claim(&conn, 0x0A7D0005));
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_ip_pool_claim(&conn, 0x0A7D0005));
+  TEST_ASSERT_EQUAL(252, he_ip_pool_available(pool));
+}
+
+void test_claim_outside_pool(void) {
+  pool = he_ip_pool_create("10.125.0.0/24");
+  conn.ip_pool = pool;
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_ip_pool_claim(&conn, 0x0A7E0005));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_ip_pool_claim(&conn, 0x0A7D0001));
+  TEST_ASSERT_EQUAL(0, conn.pool_address);
+  TEST_ASSERT_EQUAL(253, he_ip_pool_available(pool));
+
+  // Nor is there anything to claim without a pool
+  he_conn_t other = {0};
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_ip_pool_claim(&other, 0x0A7D0005));
+  TEST_ASSERT_EQUAL(0, other.pool_address);
+}
+
+void test_release_claimed(void) {
+  pool = he_ip_pool_create("10.125.0.0/24");
+  conn.ip_pool = pool;
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_ip_pool_claim(&conn, 0x0A7D0002));
+
+  he_internal_ip_pool_release(&conn);
+  TEST_ASSERT_EQUAL(0, conn.pool_address);
+  TEST_ASSERT_EQUAL(253, he_ip_pool_available(pool));
+  TEST_ASSERT_NULL(he_ip_pool_lookup(pool, htonl(0x0A7D0002)));
+
+  // It never left the stack, so it's handed out once and only once
+  he_conn_t others[2] = {0};
+  others[0].ip_pool = pool;
+  others[1].ip_pool = pool;
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_ip_pool_assign(&others[0], &config));
+  TEST_ASSERT_EQUAL_STRING("10.125.0.2", config.local_ip);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_ip_pool_assign(&others[1], &config));
+  TEST_ASSERT_EQUAL_STRING("10.125.0.3", config.local_ip);
+}
+
+void test_lookup(void) {
+  pool = he_ip_pool_create("10.125.0.0/16");
+  conn.ip_pool = pool;
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_ip_pool_assign(&conn, &config));
+
+  TEST_ASSERT_EQUAL_PTR(&conn, he_ip_pool_lookup(pool, htonl(0x0A7D0002)));
+  // Free, outside the range, the gateway and the broadcast address
+  TEST_ASSERT_NULL(he_ip_pool_lookup(pool, htonl(0x0A7D0003)));
+  TEST_ASSERT_NULL(he_ip_pool_lookup(pool, htonl(0x0A7E0002)));
+  TEST_ASSERT_NULL(he_ip_pool_lookup(pool, htonl(0x0A7D0001)));
+  TEST_ASSERT_NULL(he_ip_pool_lookup(pool, htonl(0x0A7DFFFF)));
+  TEST_ASSERT_NULL(he_ip_pool_lookup(NULL, htonl(0x0A7D0002)));
+
+  // Gone as soon as the address is given back
+  he_internal_ip_pool_release(&conn);
+  TEST_ASSERT_NULL(he_ip_pool_lookup(pool, htonl(0x0A7D0002)));
+}
+
+void test_lookup_batch(void) {
+  pool = he_ip_pool_create("10.125.0.0/16");
+  conn.ip_pool = pool;
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_ip_pool_assign(&conn, &config));
+
+  uint8_t to_client[20] = {0x45};
+  uint8_t to_nobody[20] = {0x45};
+  uint8_t ipv6[40] = {0x60};
+  uint32_t address = htonl(0x0A7D0002);
+  memcpy(to_client + 16, &address, sizeof(address));
+  memcpy(ipv6 + 16, &address, sizeof(address));
+  address = htonl(0x0A7D0009);
+  memcpy(to_nobody + 16, &address, sizeof(address));
+
+  uint8_t *packets[5] = {to_client, to_nobody, ipv6, to_client, NULL};
+  size_t lengths[5] = {20, 20, 40, 19, 20};
+  he_conn_t *conns[5];
+
+  TEST_ASSERT_EQUAL(1, he_ip_pool_lookup_batch(pool, packets, lengths, 5, conns));
+  TEST_ASSERT_EQUAL_PTR(&conn, conns[0]);
+  TEST_ASSERT_NULL(conns[1]);
+  TEST_ASSERT_NULL(conns[2]);
+  // Too short to have a destination
+  TEST_ASSERT_NULL(conns[3]);
+  TEST_ASSERT_NULL(conns[4]);
+
+  TEST_ASSERT_EQUAL(0, he_ip_pool_lookup_batch(NULL, packets, lengths, 5, conns));
+  TEST_ASSERT_EQUAL(0, he_ip_pool_lookup_batch(pool, packets, lengths, 5, NULL));
+}
+
+void test_register_thread_null_pointers(void) {
+  size_t id = 0;
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_ip_pool_register_thread(NULL, &id));
+  pool = he_ip_pool_create("10.125.0.0/24");
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_ip_pool_register_thread(pool, NULL));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_ip_pool_quiescent(NULL, 0));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_ip_pool_thread_offline(NULL, 0));
+  TEST_ASSERT_EQUAL(0, he_ip_pool_reclaim(NULL));
+}
+
+void test_retire_without_threads(void) {
+  pool = he_ip_pool_create("10.125.0.0/24");
+  conn.ip_pool = pool;
+
+  // Nobody said they look connections up, so the caller frees it as before
+  TEST_ASSERT_FALSE(he_internal_ip_pool_retire(&conn));
+  TEST_ASSERT_FALSE(he_internal_ip_pool_retire(NULL));
+  TEST_ASSERT_EQUAL(0, he_ip_pool_reclaim(pool));
+}
+
+void test_retire_waits_for_lookup_threads(void) {
+  pool = he_ip_pool_create("10.125.0.0/24");
+  size_t lookup = 0;
+  size_t other = 0;
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_ip_pool_register_thread(pool, &lookup));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_ip_pool_register_thread(pool, &other));
+
+  he_conn_t *destroyed = he_internal_calloc(1, sizeof(he_conn_t));
+  destroyed->ip_pool = pool;
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_ip_pool_assign(destroyed, &config));
+  uint32_t address = htonl(destroyed->pool_address);
+  TEST_ASSERT_EQUAL_PTR(destroyed, he_ip_pool_lookup(pool, address));
+
+  // What he_conn_destroy() does
+  he_internal_ip_pool_release(destroyed);
+  TEST_ASSERT_TRUE(he_internal_ip_pool_retire(destroyed));
+  TEST_ASSERT_NULL(he_ip_pool_lookup(pool, address));
+  TEST_ASSERT_EQUAL(1, he_ip_pool_reclaim(pool));
+
+  // Both threads may still hold it from before the destroy
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_ip_pool_quiescent(pool, lookup));
+  TEST_ASSERT_EQUAL(1, he_ip_pool_reclaim(pool));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_ip_pool_thread_offline(pool, other));
+  TEST_ASSERT_EQUAL(0, he_ip_pool_reclaim(pool));
+}
+
+void test_destroy_frees_retired(void) {
+  pool = he_ip_pool_create("10.125.0.0/24");
+  size_t lookup = 0;
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_ip_pool_register_thread(pool, &lookup));
+
+  he_conn_t *destroyed = he_internal_calloc(1, sizeof(he_conn_t));
+  destroyed->ip_pool = pool;
+  TEST_ASSERT_TRUE(he_internal_ip_pool_retire(destroyed));
+  TEST_ASSERT_EQUAL(1, he_ip_pool_reclaim(pool));
+
+  // tearDown destroys the pool, and the sanitizer would catch the connection leaking
+}
+
+void test_register_too_many_threads(void) {
+  pool = he_ip_pool_create("10.125.0.0/24");
+  size_t id = 0;
+  for(size_t i = 0; i < HE_GRACE_MAX_THREADS; i++) {
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_ip_pool_register_thread(pool, &id));
+    TEST_ASSERT_EQUAL(i, id);
+  }
+  TEST_ASSERT_EQUAL(HE_ERR_TOO_MANY_THREADS, he_ip_pool_register_thread(pool, &id));
+}
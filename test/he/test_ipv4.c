@@ -0,0 +1,173 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <he.h>
+#include "unity.h"
+#include "test_defs.h"
+
+// Unit under test
+#include "ipv4.h"
+
+// Direct Includes for Utility Functions
+#include "network.h"
+
+static uint8_t packet[100];
+static ipv4_header_t *ip = (ipv4_header_t *)packet;
+
+static void set_checksum(void) {
+  ip->checksum = 0;
+  ip->checksum = he_internal_ipv4_checksum(packet, (ip->ver_ihl & 0x0F) * 4);
+}
+
+void setUp(void) {
+  memset(packet, 0, sizeof(packet));
+  ip->ver_ihl = 0x45;
+  ip->total_length = htons(sizeof(packet));
+  ip->ttl = 64;
+  ip->protocol = 17;
+  ip->src_addr = htonl(0x0A7D0002);
+  ip->dst_addr = htonl(0x01010101);
+  set_checksum();
+}
+
+void tearDown(void) {
+}
+
+void test_checksum_known_header(void) {
+  // A commonly used worked example, whose checksum is 0xb861
+  uint8_t header[20] = {0x45, 0x00, 0x00, 0x73, 0x00, 0x00, 0x40, 0x00, 0x40, 0x11,
+                        0x00, 0x00, 0xc0, 0xa8, 0x00, 0x01, 0xc0, 0xa8, 0x00, 0xc7};
+  uint16_t checksum = he_internal_ipv4_checksum(header, sizeof(header));
+  TEST_ASSERT_EQUAL_HEX16(0xb861, ntohs(checksum));
+
+  // With the checksum in place the header sums to zero
+  memcpy(header + 10, &checksum, sizeof(checksum));
+  TEST_ASSERT_EQUAL(0, he_internal_ipv4_checksum(header, sizeof(header)));
+}
+
+void test_validate_good_packet(void) {
+  size_t length = sizeof(packet);
+  TEST_ASSERT_EQUAL(HE_INSIDE_DROP_NONE, he_internal_ipv4_validate(packet, &length, 0));
+  TEST_ASSERT_EQUAL(sizeof(packet), length);
+}
+
+void test_validate_with_options(void) {
+  ip->ver_ihl = 0x46;
+  set_checksum();
+
+  size_t length = sizeof(packet);
+  TEST_ASSERT_EQUAL(HE_INSIDE_DROP_NONE, he_internal_ipv4_validate(packet, &length, 0));
+}
+
+void test_validate_not_ipv4(void) {
+  size_t length = sizeof(packet);
+  TEST_ASSERT_EQUAL(HE_INSIDE_DROP_NOT_IPV4, he_internal_ipv4_validate(NULL, &length, 0));
+
+  length = 0;
+  TEST_ASSERT_EQUAL(HE_INSIDE_DROP_NOT_IPV4, he_internal_ipv4_validate(packet, &length, 0));
+
+  packet[0] = 0x60;
+  length = sizeof(packet);
+  TEST_ASSERT_EQUAL(HE_INSIDE_DROP_NOT_IPV4, he_internal_ipv4_validate(packet, &length, 0));
+}
+
+void test_validate_bad_header_length(void) {
+  ip->ver_ihl = 0x44;
+  size_t length = sizeof(packet);
+  TEST_ASSERT_EQUAL(HE_INSIDE_DROP_BAD_HEADER_LENGTH,
+                    he_internal_ipv4_validate(packet, &length, 0));
+
+  // Longer than what was received
+  ip->ver_ihl = 0x45;
+  length = sizeof(ipv4_header_t) - 1;
+  TEST_ASSERT_EQUAL(HE_INSIDE_DROP_BAD_HEADER_LENGTH,
+                    he_internal_ipv4_validate(packet, &length, 0));
+}
+
+void test_validate_bad_total_length(void) {
+  size_t length = sizeof(packet) - 1;
+  TEST_ASSERT_EQUAL(HE_INSIDE_DROP_BAD_TOTAL_LENGTH,
+                    he_internal_ipv4_validate(packet, &length, 0));
+
+  ip->total_length = htons(sizeof(ipv4_header_t) - 1);
+  set_checksum();
+  length = sizeof(packet);
+  TEST_ASSERT_EQUAL(HE_INSIDE_DROP_BAD_TOTAL_LENGTH,
+                    he_internal_ipv4_validate(packet, &length, 0));
+}
+
+void test_validate_trims_padding(void) {
+  ip->total_length = htons(60);
+  set_checksum();
+
+  size_t length = sizeof(packet);
+  TEST_ASSERT_EQUAL(HE_INSIDE_DROP_NONE, he_internal_ipv4_validate(packet, &length, 0));
+  TEST_ASSERT_EQUAL(60, length);
+}
+
+void test_validate_bad_checksum(void) {
+  ip->ttl--;
+
+  size_t length = sizeof(packet);
+  TEST_ASSERT_EQUAL(HE_INSIDE_DROP_BAD_CHECKSUM, he_internal_ipv4_validate(packet, &length, 0));
+  // Left alone when the packet is dropped
+  TEST_ASSERT_EQUAL(sizeof(packet), length);
+}
+
+void test_validate_source_address(void) {
+  size_t length = sizeof(packet);
+  TEST_ASSERT_EQUAL(HE_INSIDE_DROP_NONE,
+                    he_internal_ipv4_validate(packet, &length, htonl(0x0A7D0002)));
+
+  TEST_ASSERT_EQUAL(HE_INSIDE_DROP_SPOOFED_SOURCE,
+                    he_internal_ipv4_validate(packet, &length, htonl(0x0A7D0003)));
+}
+
+void test_parse_address(void) {
+  uint32_t address = 0;
+  TEST_ASSERT_TRUE(he_internal_ipv4_parse_address("10.125.0.2", &address));
+  TEST_ASSERT_EQUAL_HEX32(0x0A7D0002, address);
+
+  TEST_ASSERT_FALSE(he_internal_ipv4_parse_address("10.125.0", &address));
+  TEST_ASSERT_FALSE(he_internal_ipv4_parse_address("10.125.0.256", &address));
+  TEST_ASSERT_FALSE(he_internal_ipv4_parse_address("10.125.0.2/32", &address));
+  TEST_ASSERT_FALSE(he_internal_ipv4_parse_address("", &address));
+  TEST_ASSERT_FALSE(he_internal_ipv4_parse_address(NULL, &address));
+  TEST_ASSERT_FALSE(he_internal_ipv4_parse_address("10.125.0.2", NULL));
+}
+
+void test_parse_prefix(void) {
+  uint32_t network = 0;
+  uint32_t prefix_length = 0;
+  TEST_ASSERT_TRUE(he_internal_ipv4_parse_prefix("10.125.3.7/16", &network, &prefix_length));
+  TEST_ASSERT_EQUAL_HEX32(0x0A7D0000, network);
+  TEST_ASSERT_EQUAL(16, prefix_length);
+
+  TEST_ASSERT_TRUE(he_internal_ipv4_parse_prefix("1.2.3.4/0", &network, &prefix_length));
+  TEST_ASSERT_EQUAL_HEX32(0, network);
+  TEST_ASSERT_EQUAL(0, prefix_length);
+
+  TEST_ASSERT_TRUE(he_internal_ipv4_parse_prefix("1.2.3.4/32", &network, &prefix_length));
+  TEST_ASSERT_EQUAL_HEX32(0x01020304, network);
+
+  TEST_ASSERT_FALSE(he_internal_ipv4_parse_prefix("10.125.0.0", &network, &prefix_length));
+  TEST_ASSERT_FALSE(he_internal_ipv4_parse_prefix("10.125.0.0/33", &network, &prefix_length));
+  TEST_ASSERT_FALSE(he_internal_ipv4_parse_prefix("10.125.0.0/16 ", &network, &prefix_length));
+  TEST_ASSERT_FALSE(he_internal_ipv4_parse_prefix("300.125.0.0/16", &network, &prefix_length));
+  TEST_ASSERT_FALSE(he_internal_ipv4_parse_prefix(NULL, &network, &prefix_length));
+}
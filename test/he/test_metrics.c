@@ -0,0 +1,194 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <he.h>
+#include "unity.h"
+#include "test_defs.h"
+
+// Unit under test
+#include "metrics.h"
+
+static he_ssl_ctx_t ctx;
+static he_metrics_t metrics;
+static char text[4096];
+
+void setUp(void) {
+  memset(&ctx, 0, sizeof(ctx));
+  memset(&metrics, 0, sizeof(metrics));
+  memset(text, 0, sizeof(text));
+}
+
+void tearDown(void) {
+}
+
+void test_get_metrics_null_pointers(void) {
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_ssl_ctx_get_metrics(NULL, &metrics));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_ssl_ctx_get_metrics(&ctx, NULL));
+}
+
+void test_counters_add_up(void) {
+  he_internal_metrics_add(&ctx.metrics, HE_METRIC_HANDSHAKES_STARTED, 3);
+  he_internal_metrics_add(&ctx.metrics, HE_METRIC_HANDSHAKES_COMPLETED, 2);
+  he_internal_metrics_add(&ctx.metrics, HE_METRIC_AUTH_SUCCESSES, 1);
+  he_internal_metrics_add(&ctx.metrics, HE_METRIC_PADDING_BYTES, 40);
+  he_internal_metrics_add(&ctx.metrics, HE_METRIC_PLUGIN_DROPS, 5);
+  he_internal_metrics_add_traffic(&ctx.metrics, HE_METRIC_INSIDE_RX_PACKETS, 2, 300);
+  he_internal_metrics_add_traffic(&ctx.metrics, HE_METRIC_OUTSIDE_TX_PACKETS, 1, 1400);
+  he_internal_metrics_handshake_failed(&ctx.metrics, HE_ERR_SSL_ERROR);
+  he_internal_metrics_handshake_failed(&ctx.metrics, HE_ERR_SSL_ERROR);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_ssl_ctx_get_metrics(&ctx, &metrics));
+  TEST_ASSERT_EQUAL(3, metrics.handshakes_started);
+  TEST_ASSERT_EQUAL(2, metrics.handshakes_completed);
+  TEST_ASSERT_EQUAL(1, metrics.auth_successes);
+  TEST_ASSERT_EQUAL(0, metrics.auth_failures);
+  TEST_ASSERT_EQUAL(40, metrics.padding_bytes);
+  TEST_ASSERT_EQUAL(5, metrics.plugin_drops);
+  TEST_ASSERT_EQUAL(2, metrics.inside_rx_packets);
+  TEST_ASSERT_EQUAL(300, metrics.inside_rx_bytes);
+  TEST_ASSERT_EQUAL(0, metrics.inside_tx_packets);
+  TEST_ASSERT_EQUAL(1, metrics.outside_tx_packets);
+  TEST_ASSERT_EQUAL(1400, metrics.outside_tx_bytes);
+  TEST_ASSERT_EQUAL(2, metrics.handshake_failures[-HE_ERR_SSL_ERROR]);
+}
+
+void test_counting_without_a_context_does_nothing(void) {
+  he_internal_metrics_add(NULL, HE_METRIC_HANDSHAKES_STARTED, 1);
+  he_internal_metrics_add_traffic(NULL, HE_METRIC_INSIDE_RX_PACKETS, 1, 100);
+  he_internal_metrics_handshake_failed(NULL, HE_ERR_SSL_ERROR);
+  he_internal_metrics_conn_added(NULL, HE_STATE_ONLINE);
+  he_internal_metrics_conn_removed(NULL, HE_STATE_ONLINE);
+  he_internal_metrics_state_change(NULL, HE_STATE_NONE, HE_STATE_ONLINE);
+}
+
+void test_out_of_range_values_are_ignored(void) {
+  he_internal_metrics_add(&ctx.metrics, HE_METRIC_COUNT, 1);
+  he_internal_metrics_add_traffic(&ctx.metrics, HE_METRIC_PLUGIN_DROPS, 1, 100);
+  he_internal_metrics_handshake_failed(&ctx.metrics, HE_SUCCESS);
+  he_internal_metrics_handshake_failed(&ctx.metrics, -HE_METRICS_MAX_ERROR_CODES);
+  he_internal_metrics_conn_added(&ctx.metrics, HE_METRICS_STATE_COUNT);
+
+  he_metrics_t empty = {0};
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_ssl_ctx_get_metrics(&ctx, &metrics));
+  TEST_ASSERT_EQUAL_MEMORY(&empty, &metrics, sizeof(he_metrics_t));
+}
+
+void test_shards_are_summed(void) {
+  ctx.metrics.shards[0].counters[HE_METRIC_AUTH_FAILURES] = 1;
+  ctx.metrics.shards[3].counters[HE_METRIC_AUTH_FAILURES] = 2;
+  ctx.metrics.shards[HE_METRICS_SHARDS - 1].handshake_failures[-HE_CONNECTION_TIMED_OUT] = 4;
+  ctx.metrics.shards[1].handshake_failures[-HE_CONNECTION_TIMED_OUT] = 1;
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_ssl_ctx_get_metrics(&ctx, &metrics));
+  TEST_ASSERT_EQUAL(3, metrics.auth_failures);
+  TEST_ASSERT_EQUAL(5, metrics.handshake_failures[-HE_CONNECTION_TIMED_OUT]);
+}
+
+void test_connections_follow_their_state(void) {
+  he_internal_metrics_conn_added(&ctx.metrics, HE_STATE_NONE);
+  he_internal_metrics_conn_added(&ctx.metrics, HE_STATE_NONE);
+  he_internal_metrics_state_change(&ctx.metrics, HE_STATE_NONE, HE_STATE_CONNECTING);
+  he_internal_metrics_state_change(&ctx.metrics, HE_STATE_CONNECTING, HE_STATE_ONLINE);
+  he_internal_metrics_state_change(&ctx.metrics, HE_STATE_ONLINE, HE_STATE_ONLINE);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_ssl_ctx_get_metrics(&ctx, &metrics));
+  TEST_ASSERT_EQUAL(1, metrics.connections[HE_STATE_NONE]);
+  TEST_ASSERT_EQUAL(0, metrics.connections[HE_STATE_CONNECTING]);
+  TEST_ASSERT_EQUAL(1, metrics.connections[HE_STATE_ONLINE]);
+
+  he_internal_metrics_conn_removed(&ctx.metrics, HE_STATE_ONLINE);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_ssl_ctx_get_metrics(&ctx, &metrics));
+  TEST_ASSERT_EQUAL(0, metrics.connections[HE_STATE_ONLINE]);
+}
+
+void test_connections_moved_on_by_another_thread(void) {
+  // Counted in on one shard and out on another
+  ctx.metrics.shards[0].connections[HE_STATE_ONLINE] = 2;
+  ctx.metrics.shards[5].connections[HE_STATE_ONLINE] = UINT64_MAX;
+  // Seen leaving before it was seen arriving
+  ctx.metrics.shards[2].connections[HE_STATE_LINK_UP] = UINT64_MAX;
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_ssl_ctx_get_metrics(&ctx, &metrics));
+  TEST_ASSERT_EQUAL(1, metrics.connections[HE_STATE_ONLINE]);
+  TEST_ASSERT_EQUAL(0, metrics.connections[HE_STATE_LINK_UP]);
+}
+
+void test_render_null_pointers(void) {
+  size_t length = sizeof(text);
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_metrics_render(NULL, text, &length));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_metrics_render(&metrics, text, NULL));
+}
+
+void test_render(void) {
+  metrics.connections[HE_STATE_ONLINE] = 7;
+  metrics.handshakes_started = 10;
+  metrics.handshakes_completed = 8;
+  metrics.handshake_failures[-HE_ERR_HANDSHAKE_THROTTLED] = 2;
+  metrics.auth_failures = 1;
+  metrics.outside_rx_bytes = 123456789012ULL;
+  metrics.padding_bytes = 16;
+
+  size_t length = sizeof(text);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_metrics_render(&metrics, text, &length));
+  TEST_ASSERT_EQUAL(strlen(text), length);
+
+  TEST_ASSERT_NOT_NULL(strstr(text, "# TYPE helium_connections gauge\n"));
+  TEST_ASSERT_NOT_NULL(strstr(text, "helium_connections{state=\"online\"} 7\n"));
+  TEST_ASSERT_NOT_NULL(strstr(text, "helium_connections{state=\"connecting\"} 0\n"));
+  TEST_ASSERT_NOT_NULL(strstr(text, "# TYPE helium_handshakes_started counter\n"));
+  TEST_ASSERT_NOT_NULL(strstr(text, "helium_handshakes_started_total 10\n"));
+  TEST_ASSERT_NOT_NULL(strstr(text, "helium_handshakes_completed_total 8\n"));
+  TEST_ASSERT_NOT_NULL(strstr(text, "helium_handshake_failures_total{code=\"-54\"} 2\n"));
+  TEST_ASSERT_NOT_NULL(strstr(text, "helium_auths_total{result=\"failure\"} 1\n"));
+  TEST_ASSERT_NOT_NULL(strstr(text, "# UNIT helium_bytes bytes\n"));
+  TEST_ASSERT_NOT_NULL(
+      strstr(text, "helium_bytes_total{side=\"outside\",direction=\"rx\"} 123456789012\n"));
+  TEST_ASSERT_NOT_NULL(strstr(text, "helium_padding_bytes_total 16\n"));
+
+  // Only failures that happened are listed
+  TEST_ASSERT_NULL(strstr(text, "code=\"-1\""));
+
+  // OpenMetrics text always ends with this
+  TEST_ASSERT_EQUAL_STRING("# EOF\n", text + length - strlen("# EOF\n"));
+}
+
+void test_render_size(void) {
+  metrics.handshakes_started = 1000;
+
+  size_t needed = 0;
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_metrics_render(&metrics, NULL, &needed));
+  TEST_ASSERT_GREATER_THAN(0, needed);
+
+  // No room for the terminator
+  size_t length = needed;
+  TEST_ASSERT_EQUAL(HE_ERR_PACKET_TOO_LARGE, he_metrics_render(&metrics, text, &length));
+  TEST_ASSERT_EQUAL(needed, length);
+
+  length = needed + 1;
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_metrics_render(&metrics, text, &length));
+  TEST_ASSERT_EQUAL(needed, length);
+  TEST_ASSERT_EQUAL(needed, strlen(text));
+}
+
+void test_render_too_small(void) {
+  size_t length = 10;
+  TEST_ASSERT_EQUAL(HE_ERR_PACKET_TOO_LARGE, he_metrics_render(&metrics, text, &length));
+  TEST_ASSERT_GREATER_THAN(10, length);
+  // What was written is still a string
+  TEST_ASSERT_EQUAL(9, strlen(text));
+}
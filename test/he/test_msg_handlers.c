@@ -25,7 +25,11 @@
 
 // Direct Includes for Utility Functions
 #include "network.h"
+#include "core.h"
 #include "memory.h"
+#include "metrics.h"
+#include "flow_hash.h"
+#include "ipv4.h"
 // We need the real conn.h to handle event callbacks, and mock_fake_dispatch for the transitive
 // linkage
 #include "conn.h"
@@ -34,12 +38,22 @@
 // Internal Mocks
 #include "mock_ssl_ctx.h"
 #include "mock_config.h"
+#include "mock_conn_export.h"
+#include "mock_timers.h"
+#include "mock_clock.h"
+#include "mock_pmtud.h"
+#include "mock_mss.h"
+#include "mock_frag.h"
+#include "mock_gso.h"
+#include "mock_ip_pool.h"
+#include "mock_plugin_chain.h"
 
 // External Mocks
 #include "mock_ssl.h"
 #include "mock_wolfio.h"
 
 he_conn_t *conn = NULL;
+he_ssl_ctx_t ctx;
 he_return_code_t ret;
 he_msg_config_ipv4_t empty_msg_config = {0};
 he_network_config_ipv4_t empty_network_config = {0};
@@ -76,11 +90,43 @@ bool auth_cb_succeed(he_conn_t *conn, char const *username, char const *password
   return true;
 }
 
+static size_t written_length = 0;
+
 he_return_code_t inside_write_cb(he_conn_t *conn, uint8_t *packet, size_t length, void *context) {
   call_counter++;
+  written_length = length;
   return true;
 }
 
+he_return_code_t fixture_network_config_cb_with_ip(he_conn_t *conn,
+                                                   he_network_config_ipv4_t *config,
+                                                   void *context) {
+  call_counter++;
+  strcpy(config->local_ip, "10.125.0.2");
+  return HE_SUCCESS;
+}
+
+// Makes the start of the packet a valid IPv4 header for a packet of this length
+static void fill_ipv4_header(uint8_t *packet, uint16_t length) {
+  ipv4_header_t *ip = (ipv4_header_t *)packet;
+  ip->ver_ihl = 0x45;
+  ip->total_length = htons(length);
+  ip->checksum = 0;
+  ip->checksum = he_internal_ipv4_checksum(packet, sizeof(ipv4_header_t));
+}
+
+static he_return_code_t stub_frag_reassemble(he_conn_t *conn,
+                                             const he_msg_data_fragment_t *fragment,
+                                             const uint8_t *data, uint16_t data_length,
+                                             uint8_t **packet, uint16_t *packet_length,
+                                             int numCalls) {
+  // Pretend this fragment completed a packet
+  *packet = he_internal_calloc(1, 3000);
+  fill_ipv4_header(*packet, 3000);
+  *packet_length = 3000;
+  return HE_SUCCESS;
+}
+
 void setUp(void) {
   conn = calloc(1, sizeof(he_conn_t));
 
@@ -90,10 +136,18 @@ void setUp(void) {
   memset(&empty_network_config, 0, sizeof(he_network_config_ipv4_t));
   memset(&empty_data, 0, sizeof(empty_data));
   call_counter = 0;
+  written_length = 0;
+
+  he_internal_pmtud_pong_received_Ignore();
+  he_internal_frag_free_Ignore();
+  he_internal_gro_free_Ignore();
+  he_internal_ip_pool_release_Ignore();
+  he_internal_plugin_free_state_Ignore();
 }
 
 void tearDown(void) {
   free(conn);
+  memset(&ctx, 0, sizeof(ctx));
 }
 
 void test_msg_handler_noop(void) {
@@ -135,6 +189,46 @@ void test_msg_handler_ping_successful(void) {
   TEST_ASSERT_EQUAL(HE_SUCCESS, ret);
 }
 
+he_msg_pong_t written_pong;
+
+int write_capture_pong(WOLFSSL *ssl, const void *data, int sz, int numCalls) {
+  TEST_ASSERT_EQUAL(sizeof(he_msg_pong_t), sz);
+  memcpy(&written_pong, data, sizeof(he_msg_pong_t));
+  return sz;
+}
+
+void test_msg_handler_ping_echoes_payload(void) {
+  he_msg_ping_t ping = {0};
+  ping.msg_header.msgid = HE_MSGID_PING;
+  ping.payload = 0x12345678;
+  ping.timestamp = 0xCAFE;
+  conn->state = HE_STATE_ONLINE;
+
+  wolfSSL_write_Stub(write_capture_pong);
+
+  ret = he_handle_msg_ping(conn, (uint8_t *)&ping, sizeof(ping));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, ret);
+  TEST_ASSERT_EQUAL(HE_MSGID_PONG, written_pong.msg_header.msgid);
+  TEST_ASSERT_EQUAL(0x12345678, written_pong.payload);
+  TEST_ASSERT_EQUAL(0xCAFE, written_pong.timestamp);
+}
+
+void test_msg_handler_ping_from_older_peer(void) {
+  he_msg_ping_t ping = {0};
+  ping.msg_header.msgid = HE_MSGID_PING;
+  ping.payload = 0x12345678;
+  ping.timestamp = 0xCAFE;
+  conn->state = HE_STATE_ONLINE;
+
+  wolfSSL_write_Stub(write_capture_pong);
+
+  // Without a timestamp, which mustn't be read past the end of the message
+  ret = he_handle_msg_ping(conn, (uint8_t *)&ping, sizeof(he_msg_hdr_t) + sizeof(uint32_t));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, ret);
+  TEST_ASSERT_EQUAL(0x12345678, written_pong.payload);
+  TEST_ASSERT_EQUAL(0, written_pong.timestamp);
+}
+
 void test_msg_handler_ping_conn_null(void) {
   ret = he_handle_msg_ping(NULL, empty_data, 0);
 
@@ -162,6 +256,84 @@ void test_msg_handler_pong(void) {
   TEST_ASSERT_EQUAL(HE_SUCCESS, ret);
 }
 
+void test_msg_handler_pong_answers_pmtu_probe(void) {
+  he_msg_pong_t pong = {0};
+  pong.msg_header.msgid = HE_MSGID_PONG;
+  pong.payload = 7;
+
+  he_internal_pmtud_pong_received_StopIgnore();
+  he_internal_pmtud_pong_received_Expect(conn, 7);
+
+  ret = he_handle_msg_pong(conn, (uint8_t *)&pong, sizeof(he_msg_hdr_t) + sizeof(uint32_t));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, ret);
+}
+
+void test_msg_handler_pong_measures_rtt(void) {
+  he_msg_pong_t pong = {0};
+  pong.msg_header.msgid = HE_MSGID_PONG;
+  pong.payload = 7;
+  pong.timestamp = 1000;
+  conn->ping_sequence = 8;
+  conn->event_cb = event_cb_pong;
+
+  he_internal_clock_ms_ExpectAndReturn(1080);
+
+  ret = he_handle_msg_pong(conn, (uint8_t *)&pong, sizeof(pong));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, ret);
+  TEST_ASSERT_EQUAL(80, he_conn_get_rtt(conn));
+  TEST_ASSERT_EQUAL(1, call_counter);
+}
+
+void test_msg_handler_pong_measures_rtt_across_clock_wrap(void) {
+  he_msg_pong_t pong = {0};
+  pong.msg_header.msgid = HE_MSGID_PONG;
+  pong.payload = 1;
+  pong.timestamp = 0xFFFFFFF0;
+  conn->ping_sequence = 1;
+
+  he_internal_clock_ms_ExpectAndReturn(0x100000010);
+
+  ret = he_handle_msg_pong(conn, (uint8_t *)&pong, sizeof(pong));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, ret);
+  TEST_ASSERT_EQUAL(32, he_conn_get_rtt(conn));
+}
+
+void test_msg_handler_pong_not_ours(void) {
+  he_msg_pong_t pong = {0};
+  pong.msg_header.msgid = HE_MSGID_PONG;
+  pong.timestamp = 1000;
+  conn->ping_sequence = 100;
+
+  // Too old
+  pong.payload = 100 - HE_PING_WINDOW;
+  ret = he_handle_msg_pong(conn, (uint8_t *)&pong, sizeof(pong));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, ret);
+
+  // Never sent
+  pong.payload = 101;
+  ret = he_handle_msg_pong(conn, (uint8_t *)&pong, sizeof(pong));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, ret);
+
+  TEST_ASSERT_EQUAL(0, he_conn_get_rtt(conn));
+}
+
+void test_msg_handler_pong_from_older_peer(void) {
+  he_msg_pong_t pong = {0};
+  pong.msg_header.msgid = HE_MSGID_PONG;
+  conn->ping_sequence = 1;
+
+  // Peers that don't echo send back zeros, or a shorter message
+  ret = he_handle_msg_pong(conn, (uint8_t *)&pong, sizeof(pong));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, ret);
+
+  pong.payload = 1;
+  pong.timestamp = 1000;
+  ret = he_handle_msg_pong(conn, (uint8_t *)&pong, sizeof(he_msg_hdr_t) + sizeof(uint32_t));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, ret);
+
+  TEST_ASSERT_EQUAL(0, he_conn_get_rtt(conn));
+}
+
 void test_msg_handler_pong_conn_null(void) {
   ret = he_handle_msg_pong(NULL, empty_data, 0);
 
@@ -260,6 +432,65 @@ void test_msg_config_with_sane_mtu(void) {
   TEST_ASSERT_EQUAL(1242, empty_network_config.mtu);
 }
 
+void test_msg_config_with_discovered_mtu(void) {
+  conn->state = HE_STATE_AUTHENTICATING;
+  conn->network_config_ipv4_cb = fixture_network_config_cb;
+
+  // Larger than the default, which servers offer once path MTU discovery has found it works
+  strncpy(empty_msg_config.mtu, "1400", HE_MAX_IPV4_STRING_LENGTH);
+
+  ret = he_handle_msg_config_ipv4(conn, (uint8_t *)&empty_msg_config, sizeof(he_msg_config_ipv4_t));
+
+  TEST_ASSERT_EQUAL(1, call_counter);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, ret);
+
+  TEST_ASSERT_EQUAL(1400, empty_network_config.mtu);
+}
+
+void test_msg_config_with_jumbo_mtu(void) {
+  conn->state = HE_STATE_AUTHENTICATING;
+  conn->network_config_ipv4_cb = fixture_network_config_cb;
+  conn->inner_mtu = 9000;
+
+  // The server agreed to less than we offered
+  strncpy(empty_msg_config.mtu, "4000", HE_MAX_IPV4_STRING_LENGTH);
+
+  ret = he_handle_msg_config_ipv4(conn, (uint8_t *)&empty_msg_config, sizeof(he_msg_config_ipv4_t));
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, ret);
+  TEST_ASSERT_EQUAL(4000, empty_network_config.mtu);
+  TEST_ASSERT_EQUAL(4000, conn->inner_mtu);
+}
+
+void test_msg_config_with_jumbo_mtu_declined(void) {
+  conn->state = HE_STATE_AUTHENTICATING;
+  conn->network_config_ipv4_cb = fixture_network_config_cb;
+  conn->inner_mtu = 9000;
+
+  // A server without jumbo support offers a normal MTU
+  strncpy(empty_msg_config.mtu, "1350", HE_MAX_IPV4_STRING_LENGTH);
+
+  ret = he_handle_msg_config_ipv4(conn, (uint8_t *)&empty_msg_config, sizeof(he_msg_config_ipv4_t));
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, ret);
+  TEST_ASSERT_EQUAL(1350, empty_network_config.mtu);
+  TEST_ASSERT_EQUAL(0, conn->inner_mtu);
+}
+
+void test_msg_config_with_jumbo_mtu_not_offered(void) {
+  conn->state = HE_STATE_AUTHENTICATING;
+  conn->network_config_ipv4_cb = fixture_network_config_cb;
+
+  // Never larger than we asked for
+  strncpy(empty_msg_config.mtu, "9000", HE_MAX_IPV4_STRING_LENGTH);
+
+  ret = he_handle_msg_config_ipv4(conn, (uint8_t *)&empty_msg_config, sizeof(he_msg_config_ipv4_t));
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, ret);
+  TEST_ASSERT_EQUAL(HE_MAX_MTU, empty_network_config.mtu);
+  TEST_ASSERT_EQUAL(0, conn->inner_mtu);
+}
+
 void test_msg_config_with_too_large_mtu(void) {
   conn->state = HE_STATE_AUTHENTICATING;
   conn->network_config_ipv4_cb = fixture_network_config_cb;
@@ -395,10 +626,12 @@ void test_msg_data_something(void) {
   conn->state = HE_STATE_ONLINE;
   he_msg_data_t *pkt = (he_msg_data_t *)empty_data;
   pkt->length = htons(100);
-  empty_data[sizeof(he_msg_data_t)] = 0x45;
+  fill_ipv4_header(empty_data + sizeof(he_msg_data_t), 100);
 
   ret = he_handle_msg_data(conn, empty_data, sizeof(empty_data));
   TEST_ASSERT_EQUAL(HE_SUCCESS, ret);
+  // Nobody to hand it to, so nothing was delivered
+  TEST_ASSERT_EQUAL(0, conn->counters.inside_tx_packets);
 }
 
 void test_msg_data_old_protocol_something(void) {
@@ -408,7 +641,7 @@ void test_msg_data_old_protocol_something(void) {
 
   he_msg_data_t *pkt = (he_msg_data_t *)empty_data;
   pkt->length = 100;
-  empty_data[sizeof(he_msg_data_t)] = 0x45;
+  fill_ipv4_header(empty_data + sizeof(he_msg_data_t), 100);
 
   ret = he_handle_msg_data(conn, empty_data, sizeof(empty_data));
   TEST_ASSERT_EQUAL(HE_SUCCESS, ret);
@@ -421,7 +654,7 @@ void test_msg_data_something_other_version(void) {
 
   he_msg_data_t *pkt = (he_msg_data_t *)empty_data;
   pkt->length = htons(100);
-  empty_data[sizeof(he_msg_data_t)] = 0x45;
+  fill_ipv4_header(empty_data + sizeof(he_msg_data_t), 100);
 
   ret = he_handle_msg_data(conn, empty_data, sizeof(empty_data));
   TEST_ASSERT_EQUAL(HE_SUCCESS, ret);
@@ -435,13 +668,299 @@ void test_msg_data_old_protocol_something_with_cb(void) {
 
   he_msg_data_t *pkt = (he_msg_data_t *)empty_data;
   pkt->length = 100;
-  empty_data[sizeof(he_msg_data_t)] = 0x45;
+  fill_ipv4_header(empty_data + sizeof(he_msg_data_t), 100);
+
+  ret = he_handle_msg_data(conn, empty_data, sizeof(empty_data));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, ret);
+  TEST_ASSERT_EQUAL(1, call_counter);
+  TEST_ASSERT_EQUAL(1, conn->counters.inside_tx_packets);
+  TEST_ASSERT_EQUAL(100, conn->counters.inside_tx_bytes);
+}
+
+void test_msg_data_clamps_mss(void) {
+  conn->state = HE_STATE_ONLINE;
+  conn->protocol_version.major_version = 1;
+  conn->protocol_version.minor_version = 1;
+  conn->inside_write_cb = inside_write_cb;
+  conn->clamp_mss = true;
+  conn->effective_mtu = 1400;
+
+  he_msg_data_t *pkt = (he_msg_data_t *)empty_data;
+  pkt->length = htons(100);
+  fill_ipv4_header(empty_data + sizeof(he_msg_data_t), 100);
+
+  he_internal_clamp_mss_ExpectAndReturn(empty_data + sizeof(he_msg_data_t), 100, 1360, true);
 
   ret = he_handle_msg_data(conn, empty_data, sizeof(empty_data));
   TEST_ASSERT_EQUAL(HE_SUCCESS, ret);
   TEST_ASSERT_EQUAL(1, call_counter);
 }
 
+he_return_code_t inside_write_gro_cb(he_conn_t *conn, const he_virtio_net_hdr_t *vnet_hdr,
+                                    const he_flow_info_t *flow, uint8_t *packet, size_t length,
+                                    void *context) {
+  call_counter++;
+  return HE_SUCCESS;
+}
+
+void test_msg_data_goes_through_gro(void) {
+  conn->state = HE_STATE_ONLINE;
+  conn->protocol_version.major_version = 1;
+  conn->protocol_version.minor_version = 1;
+  conn->inside_write_cb = inside_write_cb;
+  conn->inside_write_gro_cb = inside_write_gro_cb;
+
+  he_msg_data_t *pkt = (he_msg_data_t *)empty_data;
+  pkt->length = htons(100);
+  fill_ipv4_header(empty_data + sizeof(he_msg_data_t), 100);
+
+  he_internal_gro_deliver_ExpectAndReturn(conn, empty_data + sizeof(he_msg_data_t), 100,
+                                          HE_SUCCESS);
+
+  ret = he_handle_msg_data(conn, empty_data, sizeof(empty_data));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, ret);
+  // The ordinary inside write callback isn't used
+  TEST_ASSERT_EQUAL(0, call_counter);
+}
+
+static he_flow_info_t written_flow;
+
+he_return_code_t inside_write_flow_cb(he_conn_t *conn, const he_flow_info_t *flow,
+                                      uint8_t *packet, size_t length, void *context) {
+  call_counter++;
+  written_flow = *flow;
+  return HE_SUCCESS;
+}
+
+void test_msg_data_with_flow(void) {
+  conn->state = HE_STATE_ONLINE;
+  conn->protocol_version.major_version = 1;
+  conn->protocol_version.minor_version = 1;
+  conn->inside_write_cb = inside_write_cb;
+  conn->inside_write_flow_cb = inside_write_flow_cb;
+
+  he_msg_data_t *pkt = (he_msg_data_t *)empty_data;
+  pkt->length = htons(100);
+  ipv4_header_t *ip = (ipv4_header_t *)(empty_data + sizeof(he_msg_data_t));
+  ip->ver_ihl = 0x45;
+  ip->protocol = 17;
+  ip->src_addr = htonl(0x0A000001);
+  ip->dst_addr = htonl(0x0A000002);
+  uint8_t *ports = empty_data + sizeof(he_msg_data_t) + sizeof(ipv4_header_t);
+  ports[1] = 53;
+  ports[3] = 54;
+  fill_ipv4_header(empty_data + sizeof(he_msg_data_t), 100);
+
+  ret = he_handle_msg_data(conn, empty_data, sizeof(empty_data));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, ret);
+  // Only the flow callback is called
+  TEST_ASSERT_EQUAL(1, call_counter);
+  TEST_ASSERT_EQUAL(17, written_flow.protocol);
+  TEST_ASSERT_EQUAL(0x0A000001, written_flow.src_addr);
+  TEST_ASSERT_EQUAL(53, written_flow.src_port);
+  TEST_ASSERT_EQUAL(54, written_flow.dst_port);
+
+  he_flow_info_t expected;
+  he_flow_classify(empty_data + sizeof(he_msg_data_t), 100, &expected);
+  TEST_ASSERT_EQUAL(expected.hash, written_flow.hash);
+}
+
+void test_msg_data_counts_bad_packets(void) {
+  conn->state = HE_STATE_ONLINE;
+  conn->protocol_version.major_version = 1;
+  conn->protocol_version.minor_version = 1;
+  conn->inside_write_cb = inside_write_cb;
+
+  he_msg_data_t *pkt = (he_msg_data_t *)empty_data;
+  pkt->length = htons(100);
+  uint8_t *packet = empty_data + sizeof(he_msg_data_t);
+  ipv4_header_t *ip = (ipv4_header_t *)packet;
+
+  // Not IPv4 at all
+  packet[0] = 0x60;
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET, he_handle_msg_data(conn, empty_data, sizeof(empty_data)));
+
+  // Header checksum doesn't match
+  fill_ipv4_header(packet, 100);
+  ip->ttl = 64;
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET, he_handle_msg_data(conn, empty_data, sizeof(empty_data)));
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET, he_handle_msg_data(conn, empty_data, sizeof(empty_data)));
+
+  // Claims to be longer than what came through the tunnel
+  fill_ipv4_header(packet, 101);
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET, he_handle_msg_data(conn, empty_data, sizeof(empty_data)));
+
+  TEST_ASSERT_EQUAL(0, call_counter);
+  TEST_ASSERT_EQUAL(1, he_conn_get_inside_drops(conn, HE_INSIDE_DROP_NOT_IPV4));
+  TEST_ASSERT_EQUAL(2, he_conn_get_inside_drops(conn, HE_INSIDE_DROP_BAD_CHECKSUM));
+  TEST_ASSERT_EQUAL(1, he_conn_get_inside_drops(conn, HE_INSIDE_DROP_BAD_TOTAL_LENGTH));
+  TEST_ASSERT_EQUAL(0, he_conn_get_inside_drops(conn, HE_INSIDE_DROP_BAD_HEADER_LENGTH));
+}
+
+void test_msg_data_strips_padding(void) {
+  conn->state = HE_STATE_ONLINE;
+  conn->protocol_version.major_version = 1;
+  conn->protocol_version.minor_version = 1;
+  conn->inside_write_cb = inside_write_cb;
+
+  he_msg_data_t *pkt = (he_msg_data_t *)empty_data;
+  pkt->length = htons(100);
+  fill_ipv4_header(empty_data + sizeof(he_msg_data_t), 60);
+
+  ret = he_handle_msg_data(conn, empty_data, sizeof(empty_data));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, ret);
+  TEST_ASSERT_EQUAL(1, call_counter);
+  TEST_ASSERT_EQUAL(60, written_length);
+}
+
+void test_msg_data_drops_spoofed_source(void) {
+  conn->state = HE_STATE_ONLINE;
+  conn->protocol_version.major_version = 1;
+  conn->protocol_version.minor_version = 1;
+  conn->inside_write_cb = inside_write_cb;
+  conn->validate_source_address = true;
+  conn->client_ip = htonl(0x0A7D0002);
+
+  he_msg_data_t *pkt = (he_msg_data_t *)empty_data;
+  pkt->length = htons(100);
+  ipv4_header_t *ip = (ipv4_header_t *)(empty_data + sizeof(he_msg_data_t));
+  ip->src_addr = htonl(0x0A7D0003);
+  fill_ipv4_header(empty_data + sizeof(he_msg_data_t), 100);
+
+  ret = he_handle_msg_data(conn, empty_data, sizeof(empty_data));
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET, ret);
+  TEST_ASSERT_EQUAL(1, he_conn_get_inside_drops(conn, HE_INSIDE_DROP_SPOOFED_SOURCE));
+
+  // The client's own address goes through
+  ip->src_addr = htonl(0x0A7D0002);
+  fill_ipv4_header(empty_data + sizeof(he_msg_data_t), 100);
+
+  ret = he_handle_msg_data(conn, empty_data, sizeof(empty_data));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, ret);
+  TEST_ASSERT_EQUAL(1, call_counter);
+}
+
+void test_msg_data_source_not_checked_when_disabled(void) {
+  conn->state = HE_STATE_ONLINE;
+  conn->protocol_version.major_version = 1;
+  conn->protocol_version.minor_version = 1;
+  conn->inside_write_cb = inside_write_cb;
+  conn->client_ip = htonl(0x0A7D0002);
+
+  he_msg_data_t *pkt = (he_msg_data_t *)empty_data;
+  pkt->length = htons(100);
+  ipv4_header_t *ip = (ipv4_header_t *)(empty_data + sizeof(he_msg_data_t));
+  ip->src_addr = htonl(0x0A7D0003);
+  fill_ipv4_header(empty_data + sizeof(he_msg_data_t), 100);
+
+  ret = he_handle_msg_data(conn, empty_data, sizeof(empty_data));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, ret);
+  TEST_ASSERT_EQUAL(1, call_counter);
+}
+
+void test_msg_data_fragment_null_pointers(void) {
+  ret = he_handle_msg_data_fragment(NULL, empty_data, sizeof(empty_data));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, ret);
+
+  ret = he_handle_msg_data_fragment(conn, NULL, sizeof(empty_data));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, ret);
+}
+
+void test_msg_data_fragment_not_online(void) {
+  conn->state = HE_STATE_LINK_UP;
+
+  ret = he_handle_msg_data_fragment(conn, empty_data, sizeof(empty_data));
+  TEST_ASSERT_EQUAL(HE_ERR_INVALID_CLIENT_STATE, ret);
+}
+
+void test_msg_data_fragment_too_small(void) {
+  conn->state = HE_STATE_ONLINE;
+
+  ret = he_handle_msg_data_fragment(conn, empty_data, sizeof(he_msg_data_fragment_t) - 1);
+  TEST_ASSERT_EQUAL(HE_ERR_PACKET_TOO_SMALL, ret);
+
+  // Claims more data than was received
+  he_msg_data_fragment_t *fragment = (he_msg_data_fragment_t *)empty_data;
+  fragment->length = htons(101);
+  ret = he_handle_msg_data_fragment(conn, empty_data, sizeof(he_msg_data_fragment_t) + 100);
+  TEST_ASSERT_EQUAL(HE_ERR_PACKET_TOO_SMALL, ret);
+}
+
+void test_msg_data_fragment_incomplete(void) {
+  conn->state = HE_STATE_ONLINE;
+  conn->inside_write_cb = inside_write_cb;
+
+  he_msg_data_fragment_t *fragment = (he_msg_data_fragment_t *)empty_data;
+  fragment->length = htons(100);
+
+  he_internal_frag_reassemble_ExpectAndReturn(conn, fragment, empty_data + sizeof(*fragment), 100,
+                                              NULL, NULL, HE_SUCCESS);
+  he_internal_frag_reassemble_IgnoreArg_packet();
+  he_internal_frag_reassemble_IgnoreArg_packet_length();
+
+  ret = he_handle_msg_data_fragment(conn, empty_data, sizeof(*fragment) + 100);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, ret);
+  TEST_ASSERT_EQUAL(0, call_counter);
+}
+
+void test_msg_data_fragment_bad_fragment(void) {
+  conn->state = HE_STATE_ONLINE;
+  conn->inside_write_cb = inside_write_cb;
+
+  he_internal_frag_reassemble_ExpectAnyArgsAndReturn(HE_ERR_BAD_PACKET);
+
+  ret = he_handle_msg_data_fragment(conn, empty_data, sizeof(empty_data));
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET, ret);
+  TEST_ASSERT_EQUAL(0, call_counter);
+}
+
+void test_msg_data_fragment_completes_packet(void) {
+  conn->state = HE_STATE_ONLINE;
+  conn->inside_write_cb = inside_write_cb;
+
+  he_internal_frag_reassemble_Stub(stub_frag_reassemble);
+
+  ret = he_handle_msg_data_fragment(conn, empty_data, sizeof(empty_data));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, ret);
+  TEST_ASSERT_EQUAL(1, call_counter);
+}
+
+void test_msg_mtu_null_pointers(void) {
+  ret = he_handle_msg_mtu(NULL, empty_data, sizeof(empty_data));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, ret);
+
+  ret = he_handle_msg_mtu(conn, NULL, sizeof(empty_data));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, ret);
+}
+
+void test_msg_mtu_not_online(void) {
+  conn->state = HE_STATE_LINK_UP;
+
+  ret = he_handle_msg_mtu(conn, empty_data, sizeof(empty_data));
+  TEST_ASSERT_EQUAL(HE_ERR_INVALID_CLIENT_STATE, ret);
+}
+
+void test_msg_mtu_too_small(void) {
+  conn->state = HE_STATE_ONLINE;
+
+  ret = he_handle_msg_mtu(conn, empty_data, sizeof(he_msg_mtu_t) - 1);
+  TEST_ASSERT_EQUAL(HE_ERR_PACKET_TOO_SMALL, ret);
+}
+
+void test_msg_mtu(void) {
+  conn->state = HE_STATE_ONLINE;
+
+  he_msg_mtu_t *msg = (he_msg_mtu_t *)empty_data;
+  msg->mtu = htons(1300);
+  msg->received_mtu = htons(1400);
+  msg->is_reply = 1;
+
+  he_internal_pmtud_mtu_received_Expect(conn, 1300, 1400, true);
+
+  ret = he_handle_msg_mtu(conn, empty_data, sizeof(he_msg_mtu_t));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, ret);
+}
+
 void test_msg_auth_response(void) {
   ret = he_handle_msg_auth_response(conn, empty_data, 0);
   TEST_ASSERT_EQUAL(HE_ERR_ACCESS_DENIED, ret);
@@ -575,10 +1094,17 @@ void test_msg_auth_auth_access_denied(void) {
   conn->auth_cb = auth_cb_fail;
   conn->populate_network_config_ipv4_cb = fixture_network_config_cb;
 
+  conn->metrics = &ctx.metrics;
+
   // We should get access denied and the call counter should be 1
   he_return_code_t res = he_handle_msg_auth(conn, empty_data, sizeof(empty_data));
   TEST_ASSERT_EQUAL(HE_ERR_ACCESS_DENIED, res);
   TEST_ASSERT_EQUAL(1, call_counter);
+
+  he_metrics_t metrics = {0};
+  he_ssl_ctx_get_metrics(&ctx, &metrics);
+  TEST_ASSERT_EQUAL(1, metrics.auth_failures);
+  TEST_ASSERT_EQUAL(0, metrics.auth_successes);
 }
 
 void test_msg_auth_fail_network_config_cb(void) {
@@ -607,6 +1133,8 @@ void test_msg_auth_auth_access_granted(void) {
   conn->auth_cb = auth_cb_succeed;
   conn->populate_network_config_ipv4_cb = fixture_network_config_cb;
 
+  conn->metrics = &ctx.metrics;
+
   // We're not testing Wolf here
   wolfSSL_write_IgnoreAndReturn(SSL_SUCCESS);
 
@@ -614,12 +1142,195 @@ void test_msg_auth_auth_access_granted(void) {
   he_return_code_t res = he_handle_msg_auth(conn, empty_data, sizeof(empty_data));
   TEST_ASSERT_EQUAL(HE_SUCCESS, res);
   TEST_ASSERT_EQUAL(2, call_counter);
+
+  he_metrics_t metrics = {0};
+  he_ssl_ctx_get_metrics(&ctx, &metrics);
+  TEST_ASSERT_EQUAL(0, metrics.auth_failures);
+  TEST_ASSERT_EQUAL(1, metrics.auth_successes);
+}
+
+void test_msg_auth_negotiates_inner_mtu(void) {
+  conn->is_server = true;
+  conn->state = HE_STATE_LINK_UP;
+  conn->auth_cb = auth_cb_succeed;
+  conn->populate_network_config_ipv4_cb = fixture_network_config_cb;
+  conn->inner_mtu = 9000;
+  wolfSSL_write_IgnoreAndReturn(SSL_SUCCESS);
+
+  // The smaller of the two offers wins
+  he_msg_auth_t *msg = (he_msg_auth_t *)empty_data;
+  msg->inner_mtu = htons(4000);
+
+  he_return_code_t res = he_handle_msg_auth(conn, empty_data, sizeof(he_msg_auth_t));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+  TEST_ASSERT_EQUAL(4000, conn->inner_mtu);
+}
+
+void test_msg_auth_inner_mtu_from_old_client(void) {
+  conn->is_server = true;
+  conn->state = HE_STATE_LINK_UP;
+  conn->auth_cb = auth_cb_succeed;
+  conn->populate_network_config_ipv4_cb = fixture_network_config_cb;
+  conn->inner_mtu = 9000;
+  wolfSSL_write_IgnoreAndReturn(SSL_SUCCESS);
+
+  // Older clients send a shorter message without the inner MTU
+  he_return_code_t res =
+      he_handle_msg_auth(conn, empty_data, offsetof(he_msg_auth_t, inner_mtu));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+  TEST_ASSERT_EQUAL(0, conn->inner_mtu);
+}
+
+void test_msg_auth_remembers_client_ip(void) {
+  conn->is_server = true;
+  conn->state = HE_STATE_LINK_UP;
+  conn->auth_cb = auth_cb_succeed;
+  conn->populate_network_config_ipv4_cb = fixture_network_config_cb_with_ip;
+  wolfSSL_write_IgnoreAndReturn(SSL_SUCCESS);
+
+  he_return_code_t res = he_handle_msg_auth(conn, empty_data, sizeof(empty_data));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+  TEST_ASSERT_EQUAL(htonl(0x0A7D0002), conn->client_ip);
+}
+
+static he_return_code_t stub_ip_pool_assign(he_conn_t *conn, he_network_config_ipv4_t *config,
+                                            int numCalls) {
+  conn->pool_address = 0x0A7D0002;
+  strcpy(config->local_ip, "10.125.0.2");
+  strcpy(config->peer_ip, "10.125.0.1");
+  return HE_SUCCESS;
+}
+
+static he_return_code_t network_config_cb_clears_ip(he_conn_t *conn,
+                                                           he_network_config_ipv4_t *config,
+                                                           void *context) {
+  call_counter++;
+  config->local_ip[0] = '\0';
+  return HE_SUCCESS;
+}
+
+static he_return_code_t network_config_cb_other_ip(he_conn_t *conn,
+                                                   he_network_config_ipv4_t *config,
+                                                   void *context) {
+  call_counter++;
+  strcpy(config->local_ip, "10.125.0.9");
+  return HE_SUCCESS;
+}
+
+void test_msg_auth_with_ip_pool(void) {
+  he_ip_pool_t pool = {0};
+  conn->is_server = true;
+  conn->state = HE_STATE_LINK_UP;
+  conn->auth_cb = auth_cb_succeed;
+  conn->ip_pool = &pool;
+  wolfSSL_write_IgnoreAndReturn(SSL_SUCCESS);
+
+  // The populate network config callback isn't needed
+  he_internal_ip_pool_assign_Stub(stub_ip_pool_assign);
+
+  he_return_code_t res = he_handle_msg_auth(conn, empty_data, sizeof(empty_data));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+  TEST_ASSERT_EQUAL(htonl(0x0A7D0002), conn->client_ip);
+}
+
+void test_msg_auth_with_ip_pool_and_cb(void) {
+  he_ip_pool_t pool = {0};
+  conn->is_server = true;
+  conn->state = HE_STATE_LINK_UP;
+  conn->auth_cb = auth_cb_succeed;
+  conn->populate_network_config_ipv4_cb = fixture_network_config_cb;
+  conn->ip_pool = &pool;
+  wolfSSL_write_IgnoreAndReturn(SSL_SUCCESS);
+
+  he_internal_ip_pool_assign_Stub(stub_ip_pool_assign);
+
+  // The callback sees what the pool filled in
+  he_return_code_t res = he_handle_msg_auth(conn, empty_data, sizeof(empty_data));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+  TEST_ASSERT_EQUAL(2, call_counter);
+  TEST_ASSERT_EQUAL_STRING("10.125.0.2", empty_network_config.local_ip);
+}
+
+void test_msg_auth_with_ip_pool_cb_changes_ip(void) {
+  he_ip_pool_t pool = {0};
+  conn->is_server = true;
+  conn->state = HE_STATE_LINK_UP;
+  conn->auth_cb = auth_cb_succeed;
+  conn->populate_network_config_ipv4_cb = network_config_cb_other_ip;
+  conn->ip_pool = &pool;
+  wolfSSL_write_IgnoreAndReturn(SSL_SUCCESS);
+
+  he_internal_ip_pool_assign_Stub(stub_ip_pool_assign);
+
+  // The pool's address is given back and the one the host chose is taken in its place
+  he_internal_ip_pool_release_StopIgnore();
+  he_internal_ip_pool_release_Expect(conn);
+  he_internal_ip_pool_claim_ExpectAndReturn(conn, 0x0A7D0009, HE_SUCCESS);
+
+  he_return_code_t res = he_handle_msg_auth(conn, empty_data, sizeof(empty_data));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+  TEST_ASSERT_EQUAL(htonl(0x0A7D0009), conn->client_ip);
+}
+
+void test_msg_auth_with_ip_pool_cb_clears_ip(void) {
+  he_ip_pool_t pool = {0};
+  conn->is_server = true;
+  conn->state = HE_STATE_LINK_UP;
+  conn->auth_cb = auth_cb_succeed;
+  conn->populate_network_config_ipv4_cb = network_config_cb_clears_ip;
+  conn->ip_pool = &pool;
+  wolfSSL_write_IgnoreAndReturn(SSL_SUCCESS);
+
+  he_internal_ip_pool_assign_Stub(stub_ip_pool_assign);
+
+  // Without an address there's nothing to claim
+  he_internal_ip_pool_release_StopIgnore();
+  he_internal_ip_pool_release_Expect(conn);
+
+  he_return_code_t res = he_handle_msg_auth(conn, empty_data, sizeof(empty_data));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+  TEST_ASSERT_EQUAL(0, conn->client_ip);
+}
+
+void test_msg_auth_with_ip_pool_cb_ip_taken(void) {
+  he_ip_pool_t pool = {0};
+  conn->is_server = true;
+  conn->state = HE_STATE_LINK_UP;
+  conn->auth_cb = auth_cb_succeed;
+  conn->populate_network_config_ipv4_cb = network_config_cb_other_ip;
+  conn->ip_pool = &pool;
+
+  he_internal_ip_pool_assign_Stub(stub_ip_pool_assign);
+  he_internal_ip_pool_claim_ExpectAndReturn(conn, 0x0A7D0009, HE_ERR_IP_POOL_ADDRESS_TAKEN);
+
+  // The client isn't told about an address another connection has
+  he_return_code_t res = he_handle_msg_auth(conn, empty_data, sizeof(empty_data));
+  TEST_ASSERT_EQUAL(HE_ERR_IP_POOL_ADDRESS_TAKEN, res);
+  TEST_ASSERT_EQUAL(HE_STATE_LINK_UP, conn->state);
+}
+
+void test_msg_auth_ip_pool_exhausted(void) {
+  he_ip_pool_t pool = {0};
+  conn->is_server = true;
+  conn->state = HE_STATE_LINK_UP;
+  conn->auth_cb = auth_cb_succeed;
+  conn->ip_pool = &pool;
+
+  he_internal_ip_pool_assign_ExpectAndReturn(conn, NULL, HE_ERR_IP_POOL_EXHAUSTED);
+  he_internal_ip_pool_assign_IgnoreArg_config();
+
+  he_return_code_t res = he_handle_msg_auth(conn, empty_data, sizeof(empty_data));
+  TEST_ASSERT_EQUAL(HE_ERR_IP_POOL_EXHAUSTED, res);
 }
 
 void test_he_internal_is_ipv4_packet_valid(void) {
   // Test with a NULL packet
   bool res = he_internal_is_ipv4_packet_valid(NULL, 0);
   TEST_ASSERT_EQUAL(false, res);
+
+  fill_ipv4_header(empty_data, 100);
+  TEST_ASSERT_TRUE(he_internal_is_ipv4_packet_valid(empty_data, 100));
+  TEST_ASSERT_FALSE(he_internal_is_ipv4_packet_valid(empty_data, 99));
 }
 
 void test_he_handle_msg_auth_response_with_config(void) {
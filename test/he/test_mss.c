@@ -0,0 +1,256 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <he.h>
+#include "unity.h"
+#include "test_defs.h"
+
+// Unit under test
+#include "mss.h"
+
+// Direct Includes for Utility Functions
+#include "network.h"
+
+static uint8_t packet[128];
+static size_t packet_length;
+
+// Full TCP checksum including the IPv4 pseudo header, to check the incremental update against
+static uint16_t tcp_checksum(uint8_t *pkt, size_t length) {
+  size_t ihl = (size_t)(pkt[0] & 0x0F) * 4;
+  size_t tcp_length = length - ihl;
+  uint32_t sum = 0;
+
+  // Source and destination addresses, protocol and TCP length
+  for(size_t i = 12; i < 20; i += 2) {
+    sum += (uint32_t)((pkt[i] << 8) | pkt[i + 1]);
+  }
+  sum += 6;
+  sum += (uint32_t)tcp_length;
+
+  for(size_t i = 0; i < tcp_length; i += 2) {
+    uint16_t word = (uint16_t)(pkt[ihl + i] << 8);
+    if(i + 1 < tcp_length) {
+      word |= pkt[ihl + i + 1];
+    }
+    sum += word;
+  }
+
+  while(sum >> 16) {
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  }
+  return (uint16_t)~sum;
+}
+
+static void set_tcp_checksum(void) {
+  tcp_header_t *tcp = (tcp_header_t *)(packet + sizeof(ipv4_header_t));
+  tcp->checksum = 0;
+  tcp->checksum = htons(tcp_checksum(packet, packet_length));
+}
+
+static bool tcp_checksum_valid(void) {
+  // Summing a packet that includes its checksum gives zero when it's right
+  tcp_header_t *tcp = (tcp_header_t *)(packet + sizeof(ipv4_header_t));
+  uint16_t stored = ntohs(tcp->checksum);
+  tcp->checksum = 0;
+  uint16_t expected = tcp_checksum(packet, packet_length);
+  tcp->checksum = htons(stored);
+  return stored == expected;
+}
+
+// Builds an IPv4 TCP packet with the given flags and options
+static void build_tcp(uint8_t flags, const uint8_t *options, size_t options_length) {
+  memset(packet, 0, sizeof(packet));
+
+  ipv4_header_t *ip = (ipv4_header_t *)packet;
+  ip->ver_ihl = 0x45;
+  ip->ttl = 64;
+  ip->protocol = 6;
+  ip->src_addr = htonl(0x0A000001);
+  ip->dst_addr = htonl(0xC0A80101);
+
+  tcp_header_t *tcp = (tcp_header_t *)(packet + sizeof(ipv4_header_t));
+  tcp->src_port = htons(51234);
+  tcp->dst_port = htons(443);
+  tcp->seq = htonl(0x12345678);
+  tcp->data_offset = (uint8_t)(((sizeof(tcp_header_t) + options_length) / 4) << 4);
+  tcp->flags = flags;
+  tcp->window = htons(64240);
+
+  memcpy(packet + sizeof(ipv4_header_t) + sizeof(tcp_header_t), options, options_length);
+  packet_length = sizeof(ipv4_header_t) + sizeof(tcp_header_t) + options_length;
+  ip->total_length = htons((uint16_t)packet_length);
+
+  set_tcp_checksum();
+}
+
+static uint16_t mss_at(size_t option_offset) {
+  uint8_t *value = packet + sizeof(ipv4_header_t) + sizeof(tcp_header_t) + option_offset + 2;
+  return (uint16_t)((value[0] << 8) | value[1]);
+}
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+}
+
+void test_clamp_mss_syn(void) {
+  // MSS 1460, SACK permitted, NOP, window scale 7
+  uint8_t options[] = {2, 4, 0x05, 0xB4, 4, 2, 1, 1, 1, 3, 3, 7};
+  build_tcp(0x02, options, sizeof(options));
+
+  TEST_ASSERT_TRUE(he_internal_clamp_mss(packet, packet_length, 1310));
+  TEST_ASSERT_EQUAL(1310, mss_at(0));
+  TEST_ASSERT_TRUE(tcp_checksum_valid());
+}
+
+void test_clamp_mss_syn_ack(void) {
+  uint8_t options[] = {2, 4, 0x05, 0xB4};
+  build_tcp(0x12, options, sizeof(options));
+
+  TEST_ASSERT_TRUE(he_internal_clamp_mss(packet, packet_length, 1310));
+  TEST_ASSERT_EQUAL(1310, mss_at(0));
+  TEST_ASSERT_TRUE(tcp_checksum_valid());
+}
+
+void test_clamp_mss_at_odd_offset(void) {
+  // A single NOP first leaves the MSS value straddling two checksum words
+  uint8_t options[] = {1, 2, 4, 0x05, 0xB4, 1, 1, 0};
+  build_tcp(0x02, options, sizeof(options));
+
+  TEST_ASSERT_TRUE(he_internal_clamp_mss(packet, packet_length, 1310));
+  TEST_ASSERT_EQUAL(1310, mss_at(1));
+  TEST_ASSERT_TRUE(tcp_checksum_valid());
+}
+
+void test_clamp_mss_after_other_options(void) {
+  // Timestamps before the MSS
+  uint8_t options[] = {8, 10, 1, 2, 3, 4, 5, 6, 7, 8, 2, 4, 0x23, 0x28, 0, 0};
+  build_tcp(0x02, options, sizeof(options));
+
+  TEST_ASSERT_TRUE(he_internal_clamp_mss(packet, packet_length, 1310));
+  TEST_ASSERT_EQUAL(1310, mss_at(10));
+  TEST_ASSERT_TRUE(tcp_checksum_valid());
+}
+
+void test_clamp_mss_checksum_wraps(void) {
+  // Picked so the incremental update has to carry
+  uint8_t options[] = {2, 4, 0xFF, 0xFF};
+  build_tcp(0x02, options, sizeof(options));
+
+  TEST_ASSERT_TRUE(he_internal_clamp_mss(packet, packet_length, 1));
+  TEST_ASSERT_EQUAL(1, mss_at(0));
+  TEST_ASSERT_TRUE(tcp_checksum_valid());
+}
+
+void test_clamp_mss_already_small_enough(void) {
+  uint8_t options[] = {2, 4, 0x05, 0x00};
+  build_tcp(0x02, options, sizeof(options));
+
+  TEST_ASSERT_FALSE(he_internal_clamp_mss(packet, packet_length, 1310));
+  TEST_ASSERT_EQUAL(1280, mss_at(0));
+}
+
+void test_clamp_mss_not_syn(void) {
+  uint8_t options[] = {2, 4, 0x05, 0xB4};
+  build_tcp(0x10, options, sizeof(options));
+
+  TEST_ASSERT_FALSE(he_internal_clamp_mss(packet, packet_length, 1310));
+  TEST_ASSERT_EQUAL(1460, mss_at(0));
+}
+
+void test_clamp_mss_no_option(void) {
+  uint8_t options[] = {1, 1, 4, 2};
+  build_tcp(0x02, options, sizeof(options));
+
+  TEST_ASSERT_FALSE(he_internal_clamp_mss(packet, packet_length, 1310));
+}
+
+void test_clamp_mss_end_of_options(void) {
+  // Anything after the end of option list is padding, not an MSS
+  uint8_t options[] = {0, 0, 0, 0, 2, 4, 0x05, 0xB4};
+  build_tcp(0x02, options, sizeof(options));
+
+  TEST_ASSERT_FALSE(he_internal_clamp_mss(packet, packet_length, 1310));
+}
+
+void test_clamp_mss_malformed_options(void) {
+  // Zero length option
+  uint8_t zero_length[] = {3, 0, 2, 4, 0x05, 0xB4, 0, 0};
+  build_tcp(0x02, zero_length, sizeof(zero_length));
+  TEST_ASSERT_FALSE(he_internal_clamp_mss(packet, packet_length, 1310));
+
+  // Option running past the end of the header
+  uint8_t overrun[] = {1, 1, 2, 6, 0x05, 0xB4, 0, 0};
+  build_tcp(0x02, overrun, sizeof(overrun));
+  TEST_ASSERT_FALSE(he_internal_clamp_mss(packet, packet_length, 1310));
+
+  // MSS with the wrong length
+  uint8_t bad_mss[] = {2, 3, 0x05, 0xB4};
+  build_tcp(0x02, bad_mss, sizeof(bad_mss));
+  TEST_ASSERT_FALSE(he_internal_clamp_mss(packet, packet_length, 1310));
+}
+
+void test_clamp_mss_truncated(void) {
+  uint8_t options[] = {2, 4, 0x05, 0xB4};
+  build_tcp(0x02, options, sizeof(options));
+
+  // The data offset claims options that aren't there
+  TEST_ASSERT_FALSE(he_internal_clamp_mss(packet, packet_length - 1, 1310));
+  TEST_ASSERT_FALSE(he_internal_clamp_mss(packet, sizeof(ipv4_header_t) + 10, 1310));
+  TEST_ASSERT_EQUAL(1460, mss_at(0));
+}
+
+void test_clamp_mss_not_tcp(void) {
+  uint8_t options[] = {2, 4, 0x05, 0xB4};
+  build_tcp(0x02, options, sizeof(options));
+  ((ipv4_header_t *)packet)->protocol = 17;
+
+  TEST_ASSERT_FALSE(he_internal_clamp_mss(packet, packet_length, 1310));
+}
+
+void test_clamp_mss_not_ipv4(void) {
+  uint8_t options[] = {2, 4, 0x05, 0xB4};
+  build_tcp(0x02, options, sizeof(options));
+  packet[0] = 0x65;
+
+  TEST_ASSERT_FALSE(he_internal_clamp_mss(packet, packet_length, 1310));
+}
+
+void test_clamp_mss_later_fragment(void) {
+  uint8_t options[] = {2, 4, 0x05, 0xB4};
+  build_tcp(0x02, options, sizeof(options));
+  ((ipv4_header_t *)packet)->flags_fo = htons(0x0010);
+
+  TEST_ASSERT_FALSE(he_internal_clamp_mss(packet, packet_length, 1310));
+}
+
+void test_clamp_mss_with_ip_options(void) {
+  uint8_t options[] = {2, 4, 0x05, 0xB4};
+  build_tcp(0x02, options, sizeof(options));
+
+  // Shift the TCP header along to make room for 4 bytes of IPv4 options
+  memmove(packet + 24, packet + 20, packet_length - 20);
+  memset(packet + 20, 1, 4);
+  packet[0] = 0x46;
+  packet_length += 4;
+
+  TEST_ASSERT_TRUE(he_internal_clamp_mss(packet, packet_length, 1310));
+  uint8_t *value = packet + 24 + sizeof(tcp_header_t) + 2;
+  TEST_ASSERT_EQUAL(1310, (value[0] << 8) | value[1]);
+}
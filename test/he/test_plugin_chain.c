@@ -24,6 +24,7 @@
 #include "plugin_chain.h"
 
 // Direct Includes for Utility Functions
+#include "grace.h"
 #include "memory.h"
 
 he_plugin_chain_t *chain = NULL;
@@ -223,3 +224,481 @@ void test_egress_only_plugin(void) {
   TEST_ASSERT_EQUAL(HE_SUCCESS, res);
   TEST_ASSERT_EQUAL(1, egress_count);
 }
+
+int batch_calls = 0;
+size_t batch_packets = 0;
+
+he_plugin_return_code_t counting_batch(he_plugin_packet_t *packets,
+                                       he_plugin_return_code_t *results, size_t count,
+                                       void *data) {
+  batch_calls++;
+  batch_packets += count;
+  for(size_t i = 0; i < count; i++) {
+    // Shrink each packet so we can see the new length make it back
+    packets[i].length--;
+    packets[i].tailroom++;
+    results[i] = HE_PLUGIN_SUCCESS;
+  }
+  return HE_PLUGIN_SUCCESS;
+}
+
+he_plugin_return_code_t failing_batch(he_plugin_packet_t *packets,
+                                      he_plugin_return_code_t *results, size_t count,
+                                      void *data) {
+  return HE_PLUGIN_FAIL;
+}
+
+// Wraps the packet in a two byte header and a two byte trailer
+he_plugin_return_code_t wrap_batch(he_plugin_packet_t *packets, he_plugin_return_code_t *results,
+                                   size_t count, void *data) {
+  for(size_t i = 0; i < count; i++) {
+    he_plugin_packet_t *packet = &packets[i];
+    if(packet->headroom < 2 || packet->tailroom < 2) {
+      results[i] = HE_PLUGIN_FAIL;
+      continue;
+    }
+    packet->data -= 2;
+    packet->headroom -= 2;
+    packet->length += 4;
+    packet->tailroom -= 2;
+    packet->data[0] = 0xCA;
+    packet->data[1] = 0xFE;
+    packet->data[packet->length - 2] = 0xBE;
+    packet->data[packet->length - 1] = 0xEF;
+    results[i] = HE_PLUGIN_SUCCESS;
+  }
+  return HE_PLUGIN_SUCCESS;
+}
+
+// Strips the two byte header again
+he_plugin_return_code_t unwrap_batch(he_plugin_packet_t *packets,
+                                     he_plugin_return_code_t *results, size_t count, void *data) {
+  for(size_t i = 0; i < count; i++) {
+    packets[i].data += 2;
+    packets[i].headroom += 2;
+    packets[i].length -= 2;
+    results[i] = HE_PLUGIN_SUCCESS;
+  }
+  return HE_PLUGIN_SUCCESS;
+}
+
+plugin_struct_t batch_plugin = {do_ingress_batch : counting_batch, do_egress_batch : counting_batch};
+plugin_struct_t failing_batch_plugin = {do_ingress_batch : failing_batch};
+plugin_struct_t wrap_plugin = {do_egress_batch : wrap_batch};
+plugin_struct_t unwrap_plugin = {do_ingress_batch : unwrap_batch};
+
+int order[8] = {0};
+int order_count = 0;
+
+he_plugin_return_code_t record_order(uint8_t *packet, size_t *length, size_t capacity,
+                                     void *data) {
+  order[order_count++] = *(int *)data;
+  return HE_PLUGIN_SUCCESS;
+}
+
+void test_egress_runs_in_reverse_registration_order(void) {
+  int ids[6] = {0, 1, 2, 3, 4, 5};
+  plugin_struct_t plugins[6] = {0};
+
+  // More plugins than the chain starts out with room for
+  for(int i = 0; i < 6; i++) {
+    plugins[i].do_ingress = record_order;
+    plugins[i].do_egress = record_order;
+    plugins[i].data = &ids[i];
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &plugins[i]));
+  }
+
+  order_count = 0;
+  TEST_ASSERT_EQUAL(HE_SUCCESS,
+                    he_plugin_ingress(chain, packet, &test_packet_size, packet_max_length));
+  for(int i = 0; i < 6; i++) {
+    TEST_ASSERT_EQUAL(i, order[i]);
+  }
+
+  order_count = 0;
+  TEST_ASSERT_EQUAL(HE_SUCCESS,
+                    he_plugin_egress(chain, packet, &test_packet_size, packet_max_length));
+  for(int i = 0; i < 6; i++) {
+    TEST_ASSERT_EQUAL(5 - i, order[i]);
+  }
+}
+
+void test_batch_null_pointers(void) {
+  he_plugin_packet_t packets[1] = {{packet, test_packet_size, 0, 0}};
+  he_return_code_t results[1] = {0};
+
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_plugin_ingress_batch(chain, NULL, results, 1));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_plugin_egress_batch(chain, packets, NULL, 1));
+}
+
+void test_batch_empty_chain(void) {
+  he_plugin_packet_t packets[2] = {{packet, test_packet_size, 0, 0},
+                                   {packet, test_packet_size, 0, 0}};
+  he_return_code_t results[2] = {HE_ERR_FAILED, HE_ERR_FAILED};
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_ingress_batch(NULL, packets, results, 2));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, results[0]);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, results[1]);
+}
+
+void test_batch_uses_single_packet_callbacks(void) {
+  he_plugin_packet_t packets[3] = {
+      {packet, test_packet_size, 0, packet_max_length - test_packet_size},
+      {empty_data, sizeof(empty_data), 0, 0},
+      {packet, test_packet_size, 0, packet_max_length - test_packet_size}};
+  he_return_code_t results[3] = {0};
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &zero_dropping_plugin));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &call_counting_plugin));
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_ingress_batch(chain, packets, results, 3));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, results[0]);
+  TEST_ASSERT_EQUAL(HE_ERR_PLUGIN_DROP, results[1]);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, results[2]);
+
+  // The dropped packet doesn't go on to the next plugin
+  TEST_ASSERT_EQUAL(2, ingress_count);
+}
+
+void test_batch_callback_gets_whole_batch(void) {
+  he_plugin_packet_t packets[3] = {{packet, test_packet_size, 0, 0},
+                                   {empty_data, sizeof(empty_data), 0, 0},
+                                   {packet, test_packet_size, 0, 0}};
+  he_return_code_t results[3] = {0};
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &zero_dropping_plugin));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &batch_plugin));
+  batch_calls = 0;
+  batch_packets = 0;
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_ingress_batch(chain, packets, results, 3));
+  TEST_ASSERT_EQUAL(1, batch_calls);
+  TEST_ASSERT_EQUAL(2, batch_packets);
+  TEST_ASSERT_EQUAL(HE_ERR_PLUGIN_DROP, results[1]);
+  TEST_ASSERT_EQUAL(test_packet_size - 1, packets[0].length);
+  TEST_ASSERT_EQUAL(sizeof(empty_data), packets[1].length);
+  TEST_ASSERT_EQUAL(test_packet_size - 1, packets[2].length);
+}
+
+void test_batch_split_into_chunks(void) {
+  size_t count = HE_PLUGIN_MAX_BATCH * 2 + 3;
+  he_plugin_packet_t packets[HE_PLUGIN_MAX_BATCH * 2 + 3];
+  he_return_code_t results[HE_PLUGIN_MAX_BATCH * 2 + 3];
+  for(size_t i = 0; i < count; i++) {
+    packets[i].data = packet;
+    packets[i].length = test_packet_size;
+    packets[i].headroom = 0;
+    packets[i].tailroom = 0;
+  }
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &batch_plugin));
+  batch_calls = 0;
+  batch_packets = 0;
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_egress_batch(chain, packets, results, count));
+  TEST_ASSERT_EQUAL(3, batch_calls);
+  TEST_ASSERT_EQUAL(count, batch_packets);
+}
+
+void test_batch_failure_fails_every_packet(void) {
+  he_plugin_packet_t packets[2] = {{packet, test_packet_size, 0, 0},
+                                   {packet, test_packet_size, 0, 0}};
+  he_return_code_t results[2] = {0};
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &failing_batch_plugin));
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_ingress_batch(chain, packets, results, 2));
+  TEST_ASSERT_EQUAL(HE_ERR_FAILED, results[0]);
+  TEST_ASSERT_EQUAL(HE_ERR_FAILED, results[1]);
+}
+
+void test_batch_only_plugin_on_single_packet(void) {
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &batch_plugin));
+  batch_calls = 0;
+  batch_packets = 0;
+  size_t length = test_packet_size;
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_ingress(chain, packet, &length, packet_max_length));
+  TEST_ASSERT_EQUAL(1, batch_calls);
+  TEST_ASSERT_EQUAL(1, batch_packets);
+  TEST_ASSERT_EQUAL(test_packet_size - 1, length);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &failing_batch_plugin));
+  TEST_ASSERT_EQUAL(HE_ERR_FAILED, he_plugin_ingress(chain, packet, &length, packet_max_length));
+}
+
+void test_packet_grows_into_headroom_and_tailroom(void) {
+  uint8_t original[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+  memcpy(packet + 16, original, sizeof(original));
+  he_plugin_packet_t desc = {packet + 16, sizeof(original), 16, 24};
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &wrap_plugin));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_egress_packet(chain, &desc));
+
+  // Wrapped in place, with no copy of the original bytes
+  TEST_ASSERT_EQUAL_PTR(packet + 14, desc.data);
+  TEST_ASSERT_EQUAL(sizeof(original) + 4, desc.length);
+  TEST_ASSERT_EQUAL(14, desc.headroom);
+  TEST_ASSERT_EQUAL(22, desc.tailroom);
+  TEST_ASSERT_EQUAL_HEX8(0xCA, desc.data[0]);
+  TEST_ASSERT_EQUAL_MEMORY(original, desc.data + 2, sizeof(original));
+  TEST_ASSERT_EQUAL_HEX8(0xEF, desc.data[desc.length - 1]);
+
+  // Without room the plugin can't wrap it
+  he_plugin_packet_t cramped = {packet, sizeof(original), 0, 0};
+  TEST_ASSERT_EQUAL(HE_ERR_FAILED, he_plugin_egress_packet(chain, &cramped));
+}
+
+void test_single_packet_callback_keeps_tailroom_in_step(void) {
+  he_plugin_packet_t desc = {packet + 4, test_packet_size, 4, 10};
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &call_counting_plugin));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_ingress_packet(chain, &desc));
+  TEST_ASSERT_EQUAL(1, ingress_count);
+  TEST_ASSERT_EQUAL_PTR(packet + 4, desc.data);
+  TEST_ASSERT_EQUAL(test_packet_size, desc.length);
+  TEST_ASSERT_EQUAL(4, desc.headroom);
+  TEST_ASSERT_EQUAL(10, desc.tailroom);
+}
+
+void test_buffer_api_keeps_packet_in_place(void) {
+  // A plugin that strips bytes from the front of a plain buffer leaves the rest where it was
+  uint8_t expected[8] = {0};
+  memcpy(expected, packet + 2, sizeof(expected));
+  size_t length = sizeof(expected) + 2;
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &unwrap_plugin));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_ingress(chain, packet, &length, packet_max_length));
+  TEST_ASSERT_EQUAL(sizeof(expected), length);
+  TEST_ASSERT_EQUAL_MEMORY(expected, packet, sizeof(expected));
+}
+
+void test_unregister_fails_on_null(void) {
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_plugin_unregister_plugin(NULL, &call_counting_plugin));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_plugin_unregister_plugin(chain, NULL));
+}
+
+void test_unregister_not_registered(void) {
+  TEST_ASSERT_EQUAL(HE_ERR_PLUGIN_NOT_REGISTERED,
+                    he_plugin_unregister_plugin(chain, &call_counting_plugin));
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &wipeout_plugin));
+  TEST_ASSERT_EQUAL(HE_ERR_PLUGIN_NOT_REGISTERED,
+                    he_plugin_unregister_plugin(chain, &call_counting_plugin));
+}
+
+void test_unregister_removes_only_that_plugin(void) {
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &call_counting_plugin));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &failing_plugin));
+  TEST_ASSERT_EQUAL(HE_ERR_FAILED,
+                    he_plugin_ingress(chain, packet, &test_packet_size, packet_max_length));
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_unregister_plugin(chain, &failing_plugin));
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS,
+                    he_plugin_ingress(chain, packet, &test_packet_size, packet_max_length));
+  TEST_ASSERT_EQUAL(HE_SUCCESS,
+                    he_plugin_egress(chain, packet, &test_packet_size, packet_max_length));
+  TEST_ASSERT_EQUAL(2, ingress_count);
+  TEST_ASSERT_EQUAL(1, egress_count);
+}
+
+void test_unregister_last_plugin_then_register_again(void) {
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &call_counting_plugin));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_unregister_plugin(chain, &call_counting_plugin));
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS,
+                    he_plugin_ingress(chain, packet, &test_packet_size, packet_max_length));
+  TEST_ASSERT_EQUAL(0, ingress_count);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &call_counting_plugin));
+  TEST_ASSERT_EQUAL(HE_SUCCESS,
+                    he_plugin_ingress(chain, packet, &test_packet_size, packet_max_length));
+  TEST_ASSERT_EQUAL(1, ingress_count);
+}
+
+void test_unregister_removes_every_registration(void) {
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &call_counting_plugin));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &call_counting_plugin));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_unregister_plugin(chain, &call_counting_plugin));
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS,
+                    he_plugin_ingress(chain, packet, &test_packet_size, packet_max_length));
+  TEST_ASSERT_EQUAL(0, ingress_count);
+}
+
+int state_frees = 0;
+
+void free_counter_state(void *state, void *data) {
+  state_frees++;
+  free(state);
+}
+
+// Counts packets per connection in the state slot the chain says the plugin has
+he_plugin_return_code_t count_per_conn(he_plugin_packet_t *packets,
+                                       he_plugin_return_code_t *results, size_t count,
+                                       void *data) {
+  for(size_t i = 0; i < count; i++) {
+    int slot = packets[i].state_slot;
+    if(!packets[i].state[slot]) {
+      packets[i].state[slot] = calloc(1, sizeof(int));
+    }
+    (*(int *)packets[i].state[slot])++;
+  }
+  return HE_PLUGIN_SUCCESS;
+}
+
+// The state slot a plugin has on a chain, or -1 if it has none
+static int state_slot_of(he_plugin_chain_t *on, const plugin_struct_t *plugin) {
+  for(int i = 0; i < HE_PLUGIN_MAX_STATE_SLOTS; i++) {
+    if(on->state_owners[i] == plugin) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void test_state_slot_for_plugins_that_keep_state(void) {
+  // Plugins without state don't get a slot
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &call_counting_plugin));
+  TEST_ASSERT_EQUAL(-1, state_slot_of(chain, &call_counting_plugin));
+
+  plugin_struct_t stateful = {.do_ingress_batch = count_per_conn,
+                              .free_state = free_counter_state};
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &stateful));
+  TEST_ASSERT_EQUAL(0, state_slot_of(chain, &stateful));
+
+  void *state[HE_PLUGIN_MAX_STATE_SLOTS] = {0};
+  he_plugin_packet_t desc = {packet, test_packet_size, 0, 0, state};
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_ingress_packet(chain, &desc));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_ingress_packet(chain, &desc));
+  TEST_ASSERT_NOT_NULL(state[0]);
+  TEST_ASSERT_EQUAL(2, *(int *)state[0]);
+
+  state_frees = 0;
+  he_internal_plugin_free_state(chain, state);
+  TEST_ASSERT_EQUAL(1, state_frees);
+  TEST_ASSERT_NULL(state[0]);
+}
+
+void test_state_slot_is_per_chain(void) {
+  plugin_struct_t other_stateful = {.free_state = free_counter_state};
+  plugin_struct_t stateful = {.do_ingress_batch = count_per_conn,
+                              .free_state = free_counter_state};
+  he_plugin_chain_t *other = he_plugin_create_chain();
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &other_stateful));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &stateful));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(other, &stateful));
+
+  // Registering on the second chain doesn't change where the first one keeps its state
+  void *state[HE_PLUGIN_MAX_STATE_SLOTS] = {0};
+  void *other_state[HE_PLUGIN_MAX_STATE_SLOTS] = {0};
+  he_plugin_packet_t packets[2] = {{packet, test_packet_size, 0, 0, state},
+                                   {packet, test_packet_size, 0, 0, other_state}};
+  he_return_code_t results[2];
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_ingress_batch(chain, &packets[0], &results[0], 1));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_ingress_batch(other, &packets[1], &results[1], 1));
+
+  TEST_ASSERT_NULL(state[0]);
+  TEST_ASSERT_NOT_NULL(state[1]);
+  TEST_ASSERT_NOT_NULL(other_state[0]);
+  TEST_ASSERT_NULL(other_state[1]);
+
+  he_internal_plugin_free_state(chain, state);
+  he_internal_plugin_free_state(other, other_state);
+  he_plugin_destroy_chain(other);
+}
+
+void test_state_slot_kept_across_unregister(void) {
+  plugin_struct_t first = {.do_ingress = call_counting_plugin_ingress,
+                           .free_state = free_counter_state};
+  plugin_struct_t second = {.do_ingress = call_counting_plugin_ingress,
+                            .free_state = free_counter_state};
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &first));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_unregister_plugin(chain, &first));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &second));
+  TEST_ASSERT_EQUAL(1, state_slot_of(chain, &second));
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &first));
+  TEST_ASSERT_EQUAL(0, state_slot_of(chain, &first));
+}
+
+void test_state_slots_run_out(void) {
+  plugin_struct_t plugins[HE_PLUGIN_MAX_STATE_SLOTS + 1] = {0};
+  for(int i = 0; i < HE_PLUGIN_MAX_STATE_SLOTS; i++) {
+    plugins[i].free_state = free_counter_state;
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &plugins[i]));
+    TEST_ASSERT_EQUAL(i, state_slot_of(chain, &plugins[i]));
+  }
+
+  plugins[HE_PLUGIN_MAX_STATE_SLOTS].free_state = free_counter_state;
+  TEST_ASSERT_EQUAL(HE_ERR_INIT_FAILED,
+                    he_plugin_register_plugin(chain, &plugins[HE_PLUGIN_MAX_STATE_SLOTS]));
+}
+
+void test_free_state_without_chain(void) {
+  // Connections without plugins have nothing to free
+  void *state[HE_PLUGIN_MAX_STATE_SLOTS] = {0};
+  he_internal_plugin_free_state(NULL, state);
+}
+
+void test_thread_registration_fails_on_null(void) {
+  size_t id = 0;
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_plugin_chain_register_thread(NULL, &id));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_plugin_chain_register_thread(chain, NULL));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_plugin_chain_quiescent(NULL, 0));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_plugin_chain_thread_offline(NULL, 0));
+  TEST_ASSERT_EQUAL(0, he_plugin_chain_reclaim(NULL));
+}
+
+void test_too_many_threads(void) {
+  size_t id = 0;
+  for(size_t i = 0; i < HE_PLUGIN_MAX_THREADS; i++) {
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_chain_register_thread(chain, &id));
+    TEST_ASSERT_EQUAL(i, id);
+  }
+  TEST_ASSERT_EQUAL(HE_ERR_TOO_MANY_THREADS, he_plugin_chain_register_thread(chain, &id));
+}
+
+void test_old_hooks_kept_without_threads(void) {
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &call_counting_plugin));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &wipeout_plugin));
+
+  // Any thread might still be walking the first set of hooks
+  TEST_ASSERT_EQUAL(1, he_plugin_chain_reclaim(chain));
+
+  size_t worker = 0;
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_chain_register_thread(chain, &worker));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_chain_quiescent(chain, worker));
+  TEST_ASSERT_EQUAL(0, he_plugin_chain_reclaim(chain));
+}
+
+void test_old_hooks_held_until_every_thread_is_quiescent(void) {
+  size_t worker = 0;
+  size_t idle = 0;
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_chain_register_thread(chain, &worker));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_chain_register_thread(chain, &idle));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_chain_thread_offline(chain, idle));
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &call_counting_plugin));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(chain, &wipeout_plugin));
+
+  // The worker may still be walking the first set of hooks
+  TEST_ASSERT_EQUAL(1, he_plugin_chain_reclaim(chain));
+  TEST_ASSERT_EQUAL(HE_SUCCESS,
+                    he_plugin_ingress(chain, packet, &test_packet_size, packet_max_length));
+  TEST_ASSERT_EQUAL(1, ingress_count);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_chain_quiescent(chain, worker));
+  TEST_ASSERT_EQUAL(0, he_plugin_chain_reclaim(chain));
+
+  // Coming back online holds up the next swap again
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_chain_quiescent(chain, idle));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_unregister_plugin(chain, &wipeout_plugin));
+  TEST_ASSERT_EQUAL(1, he_plugin_chain_reclaim(chain));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_chain_quiescent(chain, worker));
+  TEST_ASSERT_EQUAL(1, he_plugin_chain_reclaim(chain));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_chain_quiescent(chain, idle));
+  TEST_ASSERT_EQUAL(0, he_plugin_chain_reclaim(chain));
+}
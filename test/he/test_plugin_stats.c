@@ -23,88 +23,220 @@
 // Unit under test
 #include "plugin_stats.h"
 
-packet_stats_t stats;
+// Direct Includes for Utility Functions
+#include "memory.h"
+
+// Internal Mocks
+#include "mock_clock.h"
+
 plugin_struct_t plugin = {0};
+packet_stats_t *stats = NULL;
+stats_snapshot_t snapshot = {0};
 
 const int NUM_SAMPLES = 10;
 size_t samples[] = {61061334, 96783204, 12747090, 82395131, 3333483,
                     69755066, 10626275, 76587523, 49382973, 95788115};
 
-stats_t expect = {
-    .sumsq = 42516409741139184,
-    .sum = 558460194,
-    .min = 3333483,
-    .max = 96783204,
-    .n = 10,
-};
+he_plugin_packet_t packets[10] = {0};
+he_plugin_return_code_t results[10] = {0};
 
 void setUp(void) {
   int res = stats_plugin_create(&plugin);
-  TEST_ASSERT_EQUAL(HE_PLUGIN_SUCCESS, res);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res);
   TEST_ASSERT_NOT_NULL(plugin.data);
+  stats = plugin.data;
+
+  memset(&snapshot, 0, sizeof(snapshot));
+  for(int i = 0; i < NUM_SAMPLES; i++) {
+    packets[i] = (he_plugin_packet_t){NULL, samples[i], 0, 0, NULL, -1};
+  }
 }
 
 void tearDown(void) {
   stats_plugin_destroy(&plugin);
   memset(&plugin, 0, sizeof(plugin_struct_t));
-  memset(&stats, 0, sizeof(packet_stats_t));
 }
 
 void test_construction(void) {
-  TEST_ASSERT_EQUAL(0, stats.incoming.n);
-  TEST_ASSERT_EQUAL(0, stats.outgoing.n);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, stats_plugin_snapshot(&plugin, &snapshot));
+  TEST_ASSERT_EQUAL(0, snapshot.ingress.sizes.count);
+  TEST_ASSERT_EQUAL(0, snapshot.egress.sizes.count);
+
+  TEST_ASSERT_EQUAL_PTR(stats_plugin_do_ingress, plugin.do_ingress_batch);
+  TEST_ASSERT_EQUAL_PTR(stats_plugin_do_egress, plugin.do_egress_batch);
+  TEST_ASSERT_NOT_NULL(plugin.free_state);
 }
 
-static void internal_test_stats(stats_t *st) {
-  TEST_ASSERT_EQUAL(expect.sumsq, st->sumsq);
-  TEST_ASSERT_EQUAL(expect.sum, st->sum);
-  TEST_ASSERT_EQUAL(expect.min, st->min);
-  TEST_ASSERT_EQUAL(expect.max, st->max);
-  TEST_ASSERT_EQUAL(expect.n, st->n);
+void test_bucket_small_values_are_exact(void) {
+  for(uint64_t value = 0; value < STATS_SUB_BUCKETS * 2; value++) {
+    TEST_ASSERT_EQUAL(value, stats_histogram_bucket(value));
+    TEST_ASSERT_EQUAL(value, stats_histogram_bucket_max(value));
+  }
 }
 
-void test_operations(void) {
-  for(int i = 0; i < NUM_SAMPLES; i++) {
-    stats_plugin_do_ingress(NULL, &samples[i], samples[i], &stats);
-    stats_plugin_do_egress(NULL, &samples[i], samples[i], &stats);
+void test_buckets_are_contiguous(void) {
+  // Every bucket starts right after the one before it ends
+  for(size_t bucket = 1; bucket < STATS_HISTOGRAM_BUCKETS; bucket++) {
+    uint64_t first = stats_histogram_bucket_max(bucket - 1) + 1;
+    TEST_ASSERT_EQUAL(bucket, stats_histogram_bucket(first));
+    TEST_ASSERT_EQUAL(bucket, stats_histogram_bucket(stats_histogram_bucket_max(bucket)));
   }
+  TEST_ASSERT_EQUAL(STATS_MAX_VALUE, stats_histogram_bucket_max(STATS_HISTOGRAM_BUCKETS - 1));
+}
 
-  internal_test_stats(&stats.incoming);
-  internal_test_stats(&stats.outgoing);
+void test_bucket_error_is_bounded(void) {
+  for(size_t i = 0; i < NUM_SAMPLES; i++) {
+    uint64_t max = stats_histogram_bucket_max(stats_histogram_bucket(samples[i]));
+    TEST_ASSERT_TRUE(max >= samples[i]);
+    TEST_ASSERT_TRUE(max - samples[i] <= samples[i] / STATS_SUB_BUCKETS);
+  }
+}
+
+void test_bucket_clamps_large_values(void) {
+  TEST_ASSERT_EQUAL(STATS_HISTOGRAM_BUCKETS - 1, stats_histogram_bucket(UINT64_MAX));
+  TEST_ASSERT_EQUAL(STATS_HISTOGRAM_BUCKETS - 1,
+                    stats_histogram_bucket((uint64_t)STATS_MAX_VALUE + 1));
+}
+
+void test_operations(void) {
+  TEST_ASSERT_EQUAL(HE_PLUGIN_SUCCESS,
+                    stats_plugin_do_ingress(packets, results, NUM_SAMPLES, stats));
+  TEST_ASSERT_EQUAL(HE_PLUGIN_SUCCESS,
+                    stats_plugin_do_egress(packets, results, NUM_SAMPLES, stats));
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, stats_plugin_snapshot(&plugin, &snapshot));
+  TEST_ASSERT_EQUAL(NUM_SAMPLES, snapshot.ingress.sizes.count);
+  TEST_ASSERT_EQUAL(558460194, snapshot.ingress.sizes.sum);
+  TEST_ASSERT_EQUAL(NUM_SAMPLES, snapshot.egress.sizes.count);
+  TEST_ASSERT_EQUAL(558460194, snapshot.egress.sizes.sum);
+
+  // Nowhere to keep the time of the last packet, so no gaps
+  TEST_ASSERT_EQUAL(0, snapshot.ingress.gaps.count);
+  TEST_ASSERT_EQUAL(0, snapshot.egress.gaps.count);
 }
 
 void test_operations_through_plugin_api(void) {
   for(int i = 0; i < NUM_SAMPLES; i++) {
-    plugin.do_ingress(NULL, &samples[i], samples[i], plugin.data);
+    plugin.do_ingress_batch(&packets[i], &results[i], 1, plugin.data);
+  }
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, stats_plugin_snapshot(&plugin, &snapshot));
+  TEST_ASSERT_EQUAL(NUM_SAMPLES, snapshot.ingress.sizes.count);
+  TEST_ASSERT_EQUAL(558460194, snapshot.ingress.sizes.sum);
+  TEST_ASSERT_EQUAL(0, snapshot.egress.sizes.count);
+}
+
+void test_percentiles(void) {
+  TEST_ASSERT_EQUAL(0, stats_histogram_percentile(&snapshot.ingress.sizes, 50));
+
+  stats_plugin_do_ingress(packets, results, NUM_SAMPLES, stats);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, stats_plugin_snapshot(&plugin, &snapshot));
+
+  const stats_histogram_t *sizes = &snapshot.ingress.sizes;
+  TEST_ASSERT_EQUAL(stats_histogram_bucket_max(stats_histogram_bucket(3333483)),
+                    stats_histogram_percentile(sizes, 0));
+  TEST_ASSERT_EQUAL(stats_histogram_bucket_max(stats_histogram_bucket(61061334)),
+                    stats_histogram_percentile(sizes, 50));
+  TEST_ASSERT_EQUAL(stats_histogram_bucket_max(stats_histogram_bucket(96783204)),
+                    stats_histogram_percentile(sizes, 100));
+  TEST_ASSERT_EQUAL(stats_histogram_bucket_max(stats_histogram_bucket(96783204)),
+                    stats_histogram_percentile(sizes, 250));
+}
+
+void test_gaps_per_connection(void) {
+  void *state[HE_PLUGIN_MAX_STATE_SLOTS] = {0};
+  packets[0].state = state;
+  packets[0].state_slot = 2;
+
+  he_internal_clock_us_ExpectAndReturn(1000);
+  stats_plugin_do_ingress(packets, results, 1, stats);
+  TEST_ASSERT_NOT_NULL(state[2]);
+
+  he_internal_clock_us_ExpectAndReturn(1250);
+  stats_plugin_do_ingress(packets, results, 1, stats);
+  he_internal_clock_us_ExpectAndReturn(1300);
+  stats_plugin_do_egress(packets, results, 1, stats);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, stats_plugin_snapshot(&plugin, &snapshot));
+  TEST_ASSERT_EQUAL(1, snapshot.ingress.gaps.count);
+  TEST_ASSERT_EQUAL(250, snapshot.ingress.gaps.sum);
+  TEST_ASSERT_EQUAL(1, snapshot.ingress.gaps.buckets[stats_histogram_bucket(250)]);
+
+  // Egress keeps its own time
+  TEST_ASSERT_EQUAL(0, snapshot.egress.gaps.count);
+
+  plugin.free_state(state[2], plugin.data);
+}
+
+void test_gaps_read_clock_once_per_batch(void) {
+  void *first[HE_PLUGIN_MAX_STATE_SLOTS] = {0};
+  void *second[HE_PLUGIN_MAX_STATE_SLOTS] = {0};
+  packets[0].state = first;
+  packets[1].state = second;
+  packets[2].state = first;
+  for(int i = 0; i < 3; i++) {
+    packets[i].state_slot = 0;
   }
 
-  packet_stats_t *packet_stats = (packet_stats_t *)plugin.data;
+  he_internal_clock_us_ExpectAndReturn(5000);
+  stats_plugin_do_ingress(packets, results, 3, stats);
+
+  // The second packet on a connection in the same batch arrived with the first
+  TEST_ASSERT_EQUAL(HE_SUCCESS, stats_plugin_snapshot(&plugin, &snapshot));
+  TEST_ASSERT_EQUAL(1, snapshot.ingress.gaps.count);
+  TEST_ASSERT_EQUAL(1, snapshot.ingress.gaps.buckets[0]);
+
+  plugin.free_state(first[0], plugin.data);
+  plugin.free_state(second[0], plugin.data);
+}
 
-  internal_test_stats(&packet_stats->incoming);
+void test_snapshot_adds_up_shards(void) {
+  stats->shards[0].ingress.sizes.count = 3;
+  stats->shards[0].ingress.sizes.buckets[7] = 3;
+  stats->shards[STATS_SHARDS - 1].ingress.sizes.count = 2;
+  stats->shards[STATS_SHARDS - 1].ingress.sizes.buckets[7] = 2;
+  stats->shards[1].egress.gaps.sum = 40;
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, stats_plugin_snapshot(&plugin, &snapshot));
+  TEST_ASSERT_EQUAL(5, snapshot.ingress.sizes.count);
+  TEST_ASSERT_EQUAL(5, snapshot.ingress.sizes.buckets[7]);
+  TEST_ASSERT_EQUAL(40, snapshot.egress.gaps.sum);
+}
+
+void test_merge(void) {
+  stats_plugin_do_ingress(packets, results, NUM_SAMPLES, stats);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, stats_plugin_snapshot(&plugin, &snapshot));
+
+  stats_snapshot_t total = {0};
+  stats_snapshot_merge(&total, &snapshot);
+  stats_snapshot_merge(&total, &snapshot);
+
+  TEST_ASSERT_EQUAL(2 * NUM_SAMPLES, total.ingress.sizes.count);
+  TEST_ASSERT_EQUAL(2 * 558460194ull, total.ingress.sizes.sum);
+  TEST_ASSERT_EQUAL(2, total.ingress.sizes.buckets[stats_histogram_bucket(samples[0])]);
+
+  // Just make sure it doesn't blow up
+  stats_snapshot_merge(NULL, &snapshot);
+  stats_snapshot_merge(&total, NULL);
 }
 
 void test_null(void) {
-  int res = stats_plugin_do_ingress(NULL, &samples[0], samples[0], NULL);
+  int res = stats_plugin_do_ingress(packets, results, 1, NULL);
   TEST_ASSERT_EQUAL(res, HE_PLUGIN_FAIL);
 
-  res = stats_plugin_do_egress(NULL, &samples[0], samples[0], NULL);
+  res = stats_plugin_do_egress(packets, results, 1, NULL);
   TEST_ASSERT_EQUAL(res, HE_PLUGIN_FAIL);
 
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, stats_plugin_create(NULL));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, stats_plugin_snapshot(NULL, &snapshot));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, stats_plugin_snapshot(&plugin, NULL));
+  TEST_ASSERT_EQUAL(0, stats_histogram_percentile(NULL, 50));
+
   // Just make sure it doesn't blow up
   stats_plugin_destroy(NULL);
 
   plugin_struct_t empty_plugin = {0};
 
   stats_plugin_destroy(&empty_plugin);
-}
-
-void test_print_doesnt_explode(void) {
-  // No sane way to verify the fprint output but will at least make sure we get it here
-  stats.incoming.n = PACKET_SAMPLE_N - 1;
-  int res = stats_plugin_do_ingress(NULL, &samples[0], samples[0], &stats);
-  TEST_ASSERT_EQUAL(HE_PLUGIN_SUCCESS, res);
-
-  stats.outgoing.n = PACKET_SAMPLE_N - 1;
-  res = stats_plugin_do_egress(NULL, &samples[0], samples[0], &stats);
-  TEST_ASSERT_EQUAL(HE_PLUGIN_SUCCESS, res);
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, stats_plugin_snapshot(&empty_plugin, &snapshot));
 }
@@ -0,0 +1,434 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <he.h>
+#include "unity.h"
+#include "test_defs.h"
+
+// Unit under test
+#include "pmtud.h"
+
+// Internal Mocks
+#include "mock_conn.h"
+#include "mock_clock.h"
+
+// External Mocks
+#include "mock_ssl.h"
+
+static he_conn_t *conn = NULL;
+static uint32_t sequence = 0;
+static int sent_size = 0;
+// Largest tunnelled packet the simulated path lets through
+static int path_mtu = 0;
+// The last MTU message sent and how many have been
+static he_msg_mtu_t announced = {0};
+static int announcements = 0;
+
+static int stub_get_effective_mtu(he_conn_t *conn, int numCalls) {
+  int mtu = conn->effective_mtu;
+  if(conn->peer_mtu && (!mtu || conn->peer_mtu < mtu)) {
+    mtu = conn->peer_mtu;
+  }
+  return mtu ? mtu : HE_MAX_MTU;
+}
+
+static bool record_announcement(uint8_t *message, uint16_t length) {
+  if(((he_msg_hdr_t *)message)->msgid != HE_MSGID_MTU) {
+    return false;
+  }
+  TEST_ASSERT_EQUAL(sizeof(he_msg_mtu_t), length);
+  memcpy(&announced, message, sizeof(he_msg_mtu_t));
+  announcements++;
+  return true;
+}
+
+static void stub_build_ping(he_conn_t *conn, he_msg_ping_t *ping, int numCalls) {
+  ping->msg_header.msgid = HE_MSGID_PING;
+  ping->payload = ++sequence;
+}
+
+static he_return_code_t stub_send_message(he_conn_t *conn, uint8_t *message, uint16_t length,
+                                          int numCalls) {
+  if(record_announcement(message, length)) {
+    return HE_SUCCESS;
+  }
+  sent_size = length - sizeof(he_msg_data_t);
+  return HE_SUCCESS;
+}
+
+// Probes that fit the path are answered straight away
+static he_return_code_t stub_send_message_on_path(he_conn_t *conn, uint8_t *message,
+                                                  uint16_t length, int numCalls) {
+  if(record_announcement(message, length)) {
+    return HE_SUCCESS;
+  }
+  sent_size = length - sizeof(he_msg_data_t);
+  if(sent_size <= path_mtu) {
+    he_internal_pmtud_pong_received(conn, ((he_msg_ping_t *)message)->payload);
+  }
+  return HE_SUCCESS;
+}
+
+void setUp(void) {
+  conn = calloc(1, sizeof(he_conn_t));
+  conn->state = HE_STATE_ONLINE;
+  conn->connection_type = HE_CONNECTION_TYPE_DATAGRAM;
+  conn->outside_mtu = HE_MAX_WIRE_MTU;
+  conn->wolf_ssl = (WOLFSSL *)0x1;
+
+  sequence = 0;
+  sent_size = 0;
+  path_mtu = 0;
+  memset(&announced, 0, sizeof(announced));
+  announcements = 0;
+
+  he_conn_get_effective_mtu_Stub(stub_get_effective_mtu);
+  he_internal_conn_build_ping_Stub(stub_build_ping);
+}
+
+void tearDown(void) {
+  free(conn);
+}
+
+static void expect_probe(uint16_t size) {
+  wolfSSL_dtls_set_mtu_ExpectAndReturn(conn->wolf_ssl, HE_PMTUD_WOLF_MTU(size), SSL_SUCCESS);
+  he_internal_send_message_ExpectAndReturn(conn, NULL, size + sizeof(he_msg_data_t), HE_SUCCESS);
+  he_internal_send_message_IgnoreArg_message();
+  // Then back to the usual limit
+  uint16_t restored = conn->effective_mtu ? HE_PMTUD_WOLF_MTU(conn->effective_mtu)
+                                          : conn->outside_mtu - HE_PACKET_OVERHEAD +
+                                                HE_WOLF_MAX_HEADER_SIZE;
+  wolfSSL_dtls_set_mtu_ExpectAndReturn(conn->wolf_ssl, restored, SSL_SUCCESS);
+}
+
+void test_send_pmtu_probe_if_due_null(void) {
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_send_pmtu_probe_if_due(NULL));
+}
+
+void test_send_pmtu_probe_if_due_stream(void) {
+  conn->connection_type = HE_CONNECTION_TYPE_STREAM;
+  TEST_ASSERT_EQUAL(HE_ERR_NOT_SUPPORTED, he_conn_send_pmtu_probe_if_due(conn));
+}
+
+void test_send_pmtu_probe_if_due_not_online(void) {
+  conn->state = HE_STATE_CONNECTING;
+  TEST_ASSERT_EQUAL(HE_ERR_INVALID_CLIENT_STATE, he_conn_send_pmtu_probe_if_due(conn));
+}
+
+void test_first_probe_is_base_size(void) {
+  he_internal_clock_ms_ExpectAndReturn(1000);
+  wolfSSL_dtls_set_mtu_ExpectAndReturn(conn->wolf_ssl, HE_PMTUD_WOLF_MTU(HE_PMTUD_BASE_MTU),
+                                       SSL_SUCCESS);
+  he_internal_send_message_ExpectAndReturn(
+      conn, NULL, HE_PMTUD_BASE_MTU + sizeof(he_msg_data_t), HE_SUCCESS);
+  he_internal_send_message_IgnoreArg_message();
+  // WolfSSL goes straight back to its usual limit
+  wolfSSL_dtls_set_mtu_ExpectAndReturn(
+      conn->wolf_ssl, HE_MAX_WIRE_MTU - HE_PACKET_OVERHEAD + HE_WOLF_MAX_HEADER_SIZE, SSL_SUCCESS);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_send_pmtu_probe_if_due(conn));
+  TEST_ASSERT_EQUAL(HE_PMTUD_SEARCHING, conn->pmtud_state);
+  TEST_ASSERT_EQUAL(HE_PMTUD_BASE_MTU, conn->pmtud_probe_size);
+  TEST_ASSERT_EQUAL(1, conn->pmtud_probe_sequence);
+  TEST_ASSERT_EQUAL(0, conn->pmtud_low);
+  TEST_ASSERT_EQUAL(HE_MAX_PMTU + 1, conn->pmtud_high);
+}
+
+void test_probe_not_due_yet(void) {
+  he_internal_clock_ms_ExpectAndReturn(1000);
+  expect_probe(HE_PMTUD_BASE_MTU);
+  he_conn_send_pmtu_probe_if_due(conn);
+
+  he_internal_clock_ms_ExpectAndReturn(1000 + HE_PMTUD_PROBE_TIMEOUT_MS - 1);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_send_pmtu_probe_if_due(conn));
+  TEST_ASSERT_EQUAL(0, conn->pmtud_probe_count);
+}
+
+void test_lost_probe_timeout_uses_rto(void) {
+  conn->rto_ms = 200;
+
+  he_internal_clock_ms_ExpectAndReturn(1000);
+  expect_probe(HE_PMTUD_BASE_MTU);
+  he_conn_send_pmtu_probe_if_due(conn);
+
+  he_internal_clock_ms_ExpectAndReturn(1199);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_send_pmtu_probe_if_due(conn));
+
+  // Retried at the same size
+  he_internal_clock_ms_ExpectAndReturn(1200);
+  expect_probe(HE_PMTUD_BASE_MTU);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_send_pmtu_probe_if_due(conn));
+  TEST_ASSERT_EQUAL(1, conn->pmtud_probe_count);
+  TEST_ASSERT_EQUAL(2, conn->pmtud_probe_sequence);
+}
+
+void test_base_probe_never_answered(void) {
+  he_internal_clock_ms_ExpectAndReturn(1000);
+  expect_probe(HE_PMTUD_BASE_MTU);
+  he_conn_send_pmtu_probe_if_due(conn);
+
+  for(int i = 1; i < HE_PMTUD_MAX_PROBES; i++) {
+    he_internal_clock_ms_ExpectAndReturn(1000 + i * HE_PMTUD_PROBE_TIMEOUT_MS);
+    expect_probe(HE_PMTUD_BASE_MTU);
+    he_conn_send_pmtu_probe_if_due(conn);
+  }
+
+  // Gives up without touching the MTU or telling the host anything
+  he_internal_clock_ms_ExpectAndReturn(1000 + HE_PMTUD_MAX_PROBES * HE_PMTUD_PROBE_TIMEOUT_MS);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_send_pmtu_probe_if_due(conn));
+  TEST_ASSERT_EQUAL(HE_PMTUD_SEARCH_COMPLETE, conn->pmtud_state);
+  TEST_ASSERT_EQUAL(0, conn->effective_mtu);
+}
+
+void test_pong_received_wrong_sequence(void) {
+  he_internal_clock_ms_ExpectAndReturn(1000);
+  expect_probe(HE_PMTUD_BASE_MTU);
+  he_conn_send_pmtu_probe_if_due(conn);
+
+  he_internal_pmtud_pong_received(conn, 5);
+  TEST_ASSERT_EQUAL(HE_PMTUD_BASE_MTU, conn->pmtud_probe_size);
+  TEST_ASSERT_EQUAL(0, conn->pmtud_low);
+}
+
+void test_pong_received_not_searching(void) {
+  conn->pmtud_probe_size = 1300;
+  conn->pmtud_probe_sequence = 1;
+
+  he_internal_pmtud_pong_received(conn, 1);
+  TEST_ASSERT_EQUAL(0, conn->pmtud_low);
+}
+
+void test_pong_received_moves_on(void) {
+  he_internal_clock_ms_ExpectAndReturn(1000);
+  expect_probe(HE_PMTUD_BASE_MTU);
+  he_conn_send_pmtu_probe_if_due(conn);
+
+  // Half way between the base size and the largest the outside MTU allows
+  uint16_t next = HE_PMTUD_BASE_MTU + (HE_MAX_PMTU + 1 - HE_PMTUD_BASE_MTU) / 2;
+  he_internal_clock_ms_ExpectAndReturn(1100);
+  expect_probe(next);
+
+  he_internal_pmtud_pong_received(conn, 1);
+  TEST_ASSERT_EQUAL(HE_PMTUD_BASE_MTU, conn->pmtud_low);
+  TEST_ASSERT_EQUAL(next, conn->pmtud_probe_size);
+  // Smaller than the default so nothing changes yet
+  TEST_ASSERT_EQUAL(0, conn->effective_mtu);
+}
+
+void test_pong_received_raises_mtu(void) {
+  conn->pmtud_state = HE_PMTUD_SEARCHING;
+  conn->pmtud_low = 1300;
+  conn->pmtud_high = HE_MAX_PMTU + 1;
+  conn->pmtud_probe_size = 1358;
+  conn->pmtud_probe_sequence = 7;
+  sequence = 7;
+
+  wolfSSL_dtls_set_mtu_ExpectAndReturn(conn->wolf_ssl, HE_PMTUD_WOLF_MTU(1358), SSL_SUCCESS);
+  he_internal_generate_event_Expect(conn, HE_EVENT_PMTU_UPDATED);
+  // The peer is told
+  he_internal_send_message_ExpectAndReturn(conn, NULL, sizeof(he_msg_mtu_t), HE_SUCCESS);
+  he_internal_send_message_IgnoreArg_message();
+  he_internal_clock_ms_ExpectAndReturn(1100);
+  uint16_t next = 1358 + (HE_MAX_PMTU + 1 - 1358) / 2;
+  wolfSSL_dtls_set_mtu_ExpectAndReturn(conn->wolf_ssl, HE_PMTUD_WOLF_MTU(next), SSL_SUCCESS);
+  he_internal_send_message_ExpectAndReturn(conn, NULL, next + sizeof(he_msg_data_t), HE_SUCCESS);
+  he_internal_send_message_IgnoreArg_message();
+  wolfSSL_dtls_set_mtu_ExpectAndReturn(conn->wolf_ssl, HE_PMTUD_WOLF_MTU(1358), SSL_SUCCESS);
+
+  he_internal_pmtud_pong_received(conn, 7);
+  TEST_ASSERT_EQUAL(1358, conn->effective_mtu);
+  TEST_ASSERT_EQUAL(1, conn->pmtud_announce_count);
+}
+
+void test_search_converges(void) {
+  path_mtu = 1400;
+
+  wolfSSL_dtls_set_mtu_IgnoreAndReturn(SSL_SUCCESS);
+  he_internal_send_message_Stub(stub_send_message_on_path);
+  he_internal_generate_event_Ignore();
+
+  uint64_t now = 1000;
+  for(int i = 0; i < 100 && conn->pmtud_state != HE_PMTUD_SEARCH_COMPLETE; i++) {
+    he_internal_clock_ms_IgnoreAndReturn(now);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_send_pmtu_probe_if_due(conn));
+    now += HE_PMTUD_PROBE_TIMEOUT_MS;
+  }
+
+  TEST_ASSERT_EQUAL(HE_PMTUD_SEARCH_COMPLETE, conn->pmtud_state);
+  TEST_ASSERT_LESS_OR_EQUAL(path_mtu, conn->effective_mtu);
+  TEST_ASSERT_GREATER_THAN(path_mtu - HE_PMTUD_SEARCH_PRECISION, conn->effective_mtu);
+
+  // The peer was told what was found in the end
+  TEST_ASSERT_EQUAL(conn->effective_mtu, ntohs(announced.mtu));
+  TEST_ASSERT_EQUAL(0, announced.is_reply);
+}
+
+void test_search_lowers_mtu(void) {
+  // Narrower than the default MTU assumes
+  path_mtu = 1250;
+
+  wolfSSL_dtls_set_mtu_IgnoreAndReturn(SSL_SUCCESS);
+  he_internal_send_message_Stub(stub_send_message_on_path);
+  he_internal_generate_event_Expect(conn, HE_EVENT_PMTU_UPDATED);
+
+  uint64_t now = 1000;
+  for(int i = 0; i < 100 && conn->pmtud_state != HE_PMTUD_SEARCH_COMPLETE; i++) {
+    he_internal_clock_ms_IgnoreAndReturn(now);
+    he_conn_send_pmtu_probe_if_due(conn);
+    now += HE_PMTUD_PROBE_TIMEOUT_MS;
+  }
+
+  TEST_ASSERT_EQUAL(HE_PMTUD_SEARCH_COMPLETE, conn->pmtud_state);
+  TEST_ASSERT_LESS_OR_EQUAL(path_mtu, conn->effective_mtu);
+  TEST_ASSERT_GREATER_THAN(path_mtu - HE_PMTUD_SEARCH_PRECISION, conn->effective_mtu);
+}
+
+void test_search_skipped_on_small_outside_mtu(void) {
+  conn->outside_mtu = 1200;
+
+  he_internal_clock_ms_ExpectAndReturn(1000);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_send_pmtu_probe_if_due(conn));
+  TEST_ASSERT_EQUAL(HE_PMTUD_SEARCH_COMPLETE, conn->pmtud_state);
+  TEST_ASSERT_EQUAL(0, conn->effective_mtu);
+}
+
+void test_search_repeated_after_raise_interval(void) {
+  conn->pmtud_state = HE_PMTUD_SEARCH_COMPLETE;
+  conn->pmtud_timer_ms = 1000;
+  conn->effective_mtu = 1300;
+  conn->pmtud_acked_mtu = 1300;
+
+  he_internal_clock_ms_ExpectAndReturn(1000 + HE_PMTUD_RAISE_INTERVAL_MS - 1);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_send_pmtu_probe_if_due(conn));
+  TEST_ASSERT_EQUAL(HE_PMTUD_SEARCH_COMPLETE, conn->pmtud_state);
+
+  // Carries on from the MTU in use rather than the base size
+  he_internal_clock_ms_ExpectAndReturn(1000 + HE_PMTUD_RAISE_INTERVAL_MS);
+  expect_probe(1300 + (HE_MAX_PMTU + 1 - 1300) / 2);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_send_pmtu_probe_if_due(conn));
+  TEST_ASSERT_EQUAL(HE_PMTUD_SEARCHING, conn->pmtud_state);
+  TEST_ASSERT_EQUAL(1300, conn->pmtud_low);
+}
+
+void test_announcement_repeated_until_acked(void) {
+  conn->pmtud_state = HE_PMTUD_SEARCH_COMPLETE;
+  conn->pmtud_timer_ms = 1000;
+  conn->effective_mtu = 1300;
+  conn->pmtud_announce_count = 1;
+  he_internal_send_message_Stub(stub_send_message);
+
+  he_internal_clock_ms_IgnoreAndReturn(1000);
+  he_conn_send_pmtu_probe_if_due(conn);
+  TEST_ASSERT_EQUAL(1, announcements);
+  TEST_ASSERT_EQUAL(1300, ntohs(announced.mtu));
+
+  // Acknowledged, so no more
+  he_internal_pmtud_mtu_received(conn, 0, 1300, true);
+  he_conn_send_pmtu_probe_if_due(conn);
+  TEST_ASSERT_EQUAL(1, announcements);
+  TEST_ASSERT_EQUAL(1300, conn->pmtud_acked_mtu);
+}
+
+void test_announcement_gives_up(void) {
+  conn->pmtud_state = HE_PMTUD_SEARCH_COMPLETE;
+  conn->pmtud_timer_ms = 1000;
+  conn->effective_mtu = 1300;
+  conn->pmtud_announce_count = 1;
+  he_internal_send_message_Stub(stub_send_message);
+
+  // A peer that doesn't know the message never answers it
+  he_internal_clock_ms_IgnoreAndReturn(1000);
+  for(int i = 0; i < 10; i++) {
+    he_conn_send_pmtu_probe_if_due(conn);
+  }
+  TEST_ASSERT_EQUAL(HE_PMTUD_MAX_PROBES - 1, announcements);
+}
+
+void test_mtu_received_lowers_mtu(void) {
+  conn->effective_mtu = 1400;
+  conn->pmtud_acked_mtu = 1400;
+  he_internal_send_message_Stub(stub_send_message);
+
+  wolfSSL_dtls_set_mtu_ExpectAndReturn(conn->wolf_ssl, HE_PMTUD_WOLF_MTU(1300), SSL_SUCCESS);
+  he_internal_generate_event_Expect(conn, HE_EVENT_PMTU_UPDATED);
+
+  he_internal_pmtud_mtu_received(conn, 1300, 1400, false);
+  TEST_ASSERT_EQUAL(1300, conn->peer_mtu);
+  TEST_ASSERT_EQUAL(1400, conn->effective_mtu);
+  TEST_ASSERT_EQUAL(1300, stub_get_effective_mtu(conn, 0));
+
+  // Answered with what we found and what we heard
+  TEST_ASSERT_EQUAL(1, announcements);
+  TEST_ASSERT_EQUAL(HE_MSGID_MTU, announced.msg_header.msgid);
+  TEST_ASSERT_EQUAL(1400, ntohs(announced.mtu));
+  TEST_ASSERT_EQUAL(1300, ntohs(announced.received_mtu));
+  TEST_ASSERT_EQUAL(1, announced.is_reply);
+}
+
+void test_mtu_received_larger_than_ours(void) {
+  conn->effective_mtu = 1300;
+  he_internal_send_message_Stub(stub_send_message);
+
+  // Our own measurement still limits the tunnel, so the host isn't told
+  wolfSSL_dtls_set_mtu_ExpectAndReturn(conn->wolf_ssl, HE_PMTUD_WOLF_MTU(1300), SSL_SUCCESS);
+
+  he_internal_pmtud_mtu_received(conn, 1400, 0, false);
+  TEST_ASSERT_EQUAL(1400, conn->peer_mtu);
+  TEST_ASSERT_EQUAL(1, announcements);
+}
+
+void test_mtu_received_before_we_found_one(void) {
+  he_internal_send_message_Stub(stub_send_message);
+
+  wolfSSL_dtls_set_mtu_ExpectAndReturn(conn->wolf_ssl, HE_PMTUD_WOLF_MTU(1250), SSL_SUCCESS);
+  he_internal_generate_event_Expect(conn, HE_EVENT_PMTU_UPDATED);
+
+  he_internal_pmtud_mtu_received(conn, 1250, 0, false);
+  TEST_ASSERT_EQUAL(1250, conn->peer_mtu);
+  TEST_ASSERT_EQUAL(0, conn->effective_mtu);
+  TEST_ASSERT_EQUAL(0, ntohs(announced.mtu));
+}
+
+void test_mtu_received_out_of_range(void) {
+  conn->effective_mtu = 1300;
+  he_internal_send_message_Stub(stub_send_message);
+
+  // Nothing changes but it is still answered
+  he_internal_pmtud_mtu_received(conn, HE_PMTUD_BASE_MTU - 1, 0, false);
+  he_internal_pmtud_mtu_received(conn, HE_MAX_PMTU + 1, 0, false);
+  TEST_ASSERT_EQUAL(0, conn->peer_mtu);
+  TEST_ASSERT_EQUAL(2, announcements);
+}
+
+void test_mtu_reply_not_answered(void) {
+  conn->effective_mtu = 1300;
+  conn->peer_mtu = 1300;
+
+  he_internal_pmtud_mtu_received(conn, 1300, 1300, true);
+  TEST_ASSERT_EQUAL(1300, conn->pmtud_acked_mtu);
+}
+
+void test_mtu_received_stale_ack(void) {
+  conn->effective_mtu = 1300;
+  conn->peer_mtu = 1300;
+
+  // The peer heard an older announcement
+  he_internal_pmtud_mtu_received(conn, 1300, 1400, true);
+  TEST_ASSERT_EQUAL(0, conn->pmtud_acked_mtu);
+}
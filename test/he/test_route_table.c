@@ -0,0 +1,173 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <he.h>
+#include "unity.h"
+#include "test_defs.h"
+
+// Unit under test
+#include "route_table.h"
+
+// Direct Includes for Utility Functions
+#include "ipv4.h"
+#include "memory.h"
+
+static he_route_table_t *table = NULL;
+static he_conn_t conn = {0};
+
+static he_route_verdict_t lookup(uint32_t address) {
+  return he_route_table_lookup(table, htonl(address));
+}
+
+void setUp(void) {
+  table = he_route_table_create(HE_ROUTE_TUNNEL);
+  memset(&conn, 0, sizeof(conn));
+}
+
+void tearDown(void) {
+  he_route_table_destroy(table);
+}
+
+void test_empty_table_uses_default(void) {
+  TEST_ASSERT_EQUAL(HE_ROUTE_TUNNEL, lookup(0x0A000001));
+  TEST_ASSERT_EQUAL(HE_ROUTE_TUNNEL, lookup(0xFFFFFFFF));
+
+  he_route_table_t *bypass = he_route_table_create(HE_ROUTE_BYPASS);
+  TEST_ASSERT_EQUAL(HE_ROUTE_BYPASS, he_route_table_lookup(bypass, htonl(0x0A000001)));
+  he_route_table_destroy(bypass);
+}
+
+void test_add_invalid(void) {
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_route_table_add(NULL, "10.0.0.0/8", HE_ROUTE_BYPASS));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_route_table_add(table, NULL, HE_ROUTE_BYPASS));
+  TEST_ASSERT_EQUAL(HE_ERR_INVALID_ROUTE, he_route_table_add(table, "10.0.0.0", HE_ROUTE_BYPASS));
+  TEST_ASSERT_EQUAL(HE_ERR_INVALID_ROUTE,
+                    he_route_table_add(table, "10.0.0.0/33", HE_ROUTE_BYPASS));
+  TEST_ASSERT_EQUAL(HE_ERR_INVALID_ROUTE, he_route_table_add(table, "10.0.0.0/8", 0));
+}
+
+void test_lan_bypass(void) {
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_route_table_add(table, "192.168.0.0/16", HE_ROUTE_BYPASS));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_route_table_add(table, "10.0.0.0/8", HE_ROUTE_BYPASS));
+
+  TEST_ASSERT_EQUAL(HE_ROUTE_BYPASS, lookup(0xC0A80101));
+  TEST_ASSERT_EQUAL(HE_ROUTE_BYPASS, lookup(0x0AFFFFFF));
+  TEST_ASSERT_EQUAL(HE_ROUTE_TUNNEL, lookup(0xC0A90101));
+  TEST_ASSERT_EQUAL(HE_ROUTE_TUNNEL, lookup(0x0B000000));
+}
+
+void test_longest_prefix_wins(void) {
+  // Added shortest first and longest first, the result is the same
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_route_table_add(table, "10.0.0.0/8", HE_ROUTE_BYPASS));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_route_table_add(table, "10.1.0.0/16", HE_ROUTE_TUNNEL));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_route_table_add(table, "10.1.2.3/32", HE_ROUTE_BYPASS));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_route_table_add(table, "172.16.5.0/24", HE_ROUTE_BYPASS));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_route_table_add(table, "172.16.0.0/12", HE_ROUTE_TUNNEL));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_route_table_add(table, "172.0.0.0/8", HE_ROUTE_BYPASS));
+
+  TEST_ASSERT_EQUAL(HE_ROUTE_BYPASS, lookup(0x0A020304));
+  TEST_ASSERT_EQUAL(HE_ROUTE_TUNNEL, lookup(0x0A010204));
+  TEST_ASSERT_EQUAL(HE_ROUTE_BYPASS, lookup(0x0A010203));
+
+  TEST_ASSERT_EQUAL(HE_ROUTE_BYPASS, lookup(0xAC100501));
+  TEST_ASSERT_EQUAL(HE_ROUTE_TUNNEL, lookup(0xAC100601));
+  TEST_ASSERT_EQUAL(HE_ROUTE_TUNNEL, lookup(0xAC1F0001));
+  TEST_ASSERT_EQUAL(HE_ROUTE_BYPASS, lookup(0xAC200001));
+}
+
+void test_unaligned_prefixes(void) {
+  // 100.64.0.0/10 spans 64 entries of the first level
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_route_table_add(table, "100.64.0.0/10", HE_ROUTE_BYPASS));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_route_table_add(table, "100.100.100.96/27", HE_ROUTE_TUNNEL));
+
+  TEST_ASSERT_EQUAL(HE_ROUTE_TUNNEL, lookup(0x643FFFFF));
+  TEST_ASSERT_EQUAL(HE_ROUTE_BYPASS, lookup(0x64400000));
+  TEST_ASSERT_EQUAL(HE_ROUTE_BYPASS, lookup(0x647FFFFF));
+  TEST_ASSERT_EQUAL(HE_ROUTE_TUNNEL, lookup(0x64800000));
+
+  TEST_ASSERT_EQUAL(HE_ROUTE_BYPASS, lookup(0x6464645F));
+  TEST_ASSERT_EQUAL(HE_ROUTE_TUNNEL, lookup(0x64646460));
+  TEST_ASSERT_EQUAL(HE_ROUTE_TUNNEL, lookup(0x6464647F));
+  TEST_ASSERT_EQUAL(HE_ROUTE_BYPASS, lookup(0x64646480));
+}
+
+void test_default_route(void) {
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_route_table_add(table, "10.0.0.0/8", HE_ROUTE_TUNNEL));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_route_table_add(table, "0.0.0.0/0", HE_ROUTE_BYPASS));
+
+  TEST_ASSERT_EQUAL(HE_ROUTE_TUNNEL, lookup(0x0A000001));
+  TEST_ASSERT_EQUAL(HE_ROUTE_BYPASS, lookup(0x08080808));
+}
+
+void test_same_prefix_replaces_verdict(void) {
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_route_table_add(table, "10.1.0.0/16", HE_ROUTE_BYPASS));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_route_table_add(table, "10.1.0.0/16", HE_ROUTE_TUNNEL));
+  TEST_ASSERT_EQUAL(HE_ROUTE_TUNNEL, lookup(0x0A010001));
+}
+
+void test_many_routes(void) {
+  // Every other /24 of 10.0.0.0/16 bypasses the tunnel
+  char cidr[HE_MAX_IPV4_STRING_LENGTH];
+  for(int i = 0; i < 256; i += 2) {
+    snprintf(cidr, sizeof(cidr), "10.0.%d.0/24", i);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_route_table_add(table, cidr, HE_ROUTE_BYPASS));
+  }
+
+  for(uint32_t i = 0; i < 256; i++) {
+    TEST_ASSERT_EQUAL(i % 2 ? HE_ROUTE_TUNNEL : HE_ROUTE_BYPASS, lookup(0x0A000001 | (i << 8)));
+  }
+}
+
+void test_conn_route_table_swap(void) {
+  TEST_ASSERT_NULL(he_conn_get_route_table(&conn));
+
+  TEST_ASSERT_NULL(he_conn_set_route_table(&conn, table));
+  TEST_ASSERT_EQUAL_PTR(table, he_conn_get_route_table(&conn));
+
+  // The old table is handed back to be destroyed
+  TEST_ASSERT_EQUAL_PTR(table, he_conn_set_route_table(&conn, NULL));
+  TEST_ASSERT_NULL(he_conn_get_route_table(&conn));
+
+  TEST_ASSERT_NULL(he_conn_set_route_table(NULL, table));
+  TEST_ASSERT_NULL(he_conn_get_route_table(NULL));
+}
+
+void test_conn_route_table_bypass(void) {
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_route_table_add(table, "192.168.0.0/16", HE_ROUTE_BYPASS));
+
+  // Nothing bypasses without a table
+  TEST_ASSERT_FALSE(he_internal_route_table_bypass(&conn, htonl(0xC0A80001)));
+
+  he_conn_set_route_table(&conn, table);
+  TEST_ASSERT_TRUE(he_internal_route_table_bypass(&conn, htonl(0xC0A80001)));
+  TEST_ASSERT_FALSE(he_internal_route_table_bypass(&conn, htonl(0x0A000001)));
+
+  // The table is let go of after every lookup
+  TEST_ASSERT_EQUAL(0, conn.route_readers);
+}
+
+void test_conn_route_table_swap_waits_for_readers(void) {
+  // Readers only ever hold up a swap that takes a table away, installing the first one doesn't
+  // wait for them
+  conn.route_readers = 1;
+  TEST_ASSERT_NULL(he_conn_set_route_table(&conn, table));
+
+  // Once the count is back at zero the old table is handed back
+  conn.route_readers = 0;
+  TEST_ASSERT_EQUAL_PTR(table, he_conn_set_route_table(&conn, NULL));
+}
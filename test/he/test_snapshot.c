@@ -0,0 +1,190 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <he.h>
+#include "unity.h"
+#include "test_defs.h"
+
+// Unit under test
+#include "snapshot.h"
+
+// Internal Mocks
+#include "mock_conn_export.h"
+
+#define TEST_CAPACITY 4
+
+// uint64_t keeps the region aligned the way mmap would
+uint64_t region[(sizeof(he_snapshot_store_t) + TEST_CAPACITY * sizeof(he_snapshot_slot_t)) /
+                    sizeof(uint64_t) +
+                1];
+
+he_snapshot_store_t *store;
+he_ssl_ctx_t ssl_ctx;
+he_conn_t conn;
+he_conn_t restored;
+
+he_return_code_t fixture_he_conn_export(he_conn_t *conn, uint8_t *buffer, size_t *length,
+                                        int numCalls) {
+  // Stand in for the sealed export: just the session ID
+  TEST_ASSERT_TRUE(*length >= sizeof(uint64_t));
+  memcpy(buffer, &conn->session_id, sizeof(uint64_t));
+  *length = sizeof(uint64_t);
+  return HE_SUCCESS;
+}
+
+he_return_code_t fixture_he_conn_import(he_conn_t *conn, he_ssl_ctx_t *ctx,
+                                        he_plugin_chain_t *plugins, const uint8_t *buffer,
+                                        size_t length, int numCalls) {
+  TEST_ASSERT_EQUAL(sizeof(uint64_t), length);
+  memcpy(&conn->session_id, buffer, sizeof(uint64_t));
+  conn->state = HE_STATE_ONLINE;
+  return HE_SUCCESS;
+}
+
+void setUp(void) {
+  memset(region, 0, sizeof(region));
+  store = he_snapshot_store_init(region, sizeof(region), TEST_CAPACITY);
+  conn.session_id = 0x1234;
+}
+
+void tearDown(void) {
+  memset(&conn, 0, sizeof(he_conn_t));
+  memset(&restored, 0, sizeof(he_conn_t));
+}
+
+void test_store_size(void) {
+  TEST_ASSERT_EQUAL(sizeof(he_snapshot_store_t) + 10 * sizeof(he_snapshot_slot_t),
+                    he_snapshot_store_size(10));
+}
+
+void test_init_invalid(void) {
+  TEST_ASSERT_NULL(he_snapshot_store_init(NULL, sizeof(region), TEST_CAPACITY));
+  TEST_ASSERT_NULL(he_snapshot_store_init(region, sizeof(region), 0));
+  TEST_ASSERT_NULL(he_snapshot_store_init(region, sizeof(region), TEST_CAPACITY + 1));
+  TEST_ASSERT_NULL(he_snapshot_store_init((uint8_t *)region + 1, sizeof(region) - 1, 1));
+}
+
+void test_init(void) {
+  TEST_ASSERT_EQUAL_PTR(region, store);
+  TEST_ASSERT_EQUAL(TEST_CAPACITY, store->capacity);
+  TEST_ASSERT_EQUAL(HE_SNAPSHOT_STORE_VERSION, store->version);
+}
+
+void test_attach(void) {
+  TEST_ASSERT_EQUAL_PTR(store, he_snapshot_store_attach(region, sizeof(region)));
+}
+
+void test_attach_invalid(void) {
+  TEST_ASSERT_NULL(he_snapshot_store_attach(NULL, sizeof(region)));
+  // Truncated mapping
+  TEST_ASSERT_NULL(he_snapshot_store_attach(region, sizeof(region) / 2));
+
+  store->version = HE_SNAPSHOT_STORE_VERSION + 1;
+  TEST_ASSERT_NULL(he_snapshot_store_attach(region, sizeof(region)));
+
+  memset(region, 0, sizeof(region));
+  TEST_ASSERT_NULL(he_snapshot_store_attach(region, sizeof(region)));
+}
+
+void test_save_null(void) {
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_snapshot_store_save(NULL, &conn));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_snapshot_store_save(store, NULL));
+}
+
+void test_save_export_fails(void) {
+  he_conn_export_ExpectAnyArgsAndReturn(HE_ERR_INVALID_CLIENT_STATE);
+  TEST_ASSERT_EQUAL(HE_ERR_INVALID_CLIENT_STATE, he_snapshot_store_save(store, &conn));
+
+  // Nothing was published
+  TEST_ASSERT_EQUAL(HE_ERR_UNKNOWN_SESSION,
+                    he_snapshot_store_restore(store, conn.session_id, &restored, &ssl_ctx, NULL));
+}
+
+void test_save_and_restore(void) {
+  he_conn_export_Stub(fixture_he_conn_export);
+  he_conn_import_Stub(fixture_he_conn_import);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_snapshot_store_save(store, &conn));
+
+  // A new process maps the same memory
+  he_snapshot_store_t *attached = he_snapshot_store_attach(region, sizeof(region));
+  TEST_ASSERT_NOT_NULL(attached);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS,
+                    he_snapshot_store_restore(attached, 0x1234, &restored, &ssl_ctx, NULL));
+  TEST_ASSERT_EQUAL(0x1234, restored.session_id);
+  TEST_ASSERT_EQUAL(HE_STATE_ONLINE, restored.state);
+}
+
+void test_restore_only_once(void) {
+  he_conn_export_Stub(fixture_he_conn_export);
+  he_conn_import_Stub(fixture_he_conn_import);
+
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_snapshot_store_save(store, &conn));
+  TEST_ASSERT_EQUAL(HE_SUCCESS,
+                    he_snapshot_store_restore(store, 0x1234, &restored, &ssl_ctx, NULL));
+  TEST_ASSERT_EQUAL(HE_ERR_UNKNOWN_SESSION,
+                    he_snapshot_store_restore(store, 0x1234, &restored, &ssl_ctx, NULL));
+}
+
+void test_restore_unknown(void) {
+  TEST_ASSERT_EQUAL(HE_ERR_UNKNOWN_SESSION,
+                    he_snapshot_store_restore(store, 0x1234, &restored, &ssl_ctx, NULL));
+}
+
+void test_restore_import_fails(void) {
+  he_conn_export_Stub(fixture_he_conn_export);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_snapshot_store_save(store, &conn));
+
+  he_conn_import_ExpectAnyArgsAndReturn(HE_ERR_BAD_PACKET);
+  TEST_ASSERT_EQUAL(HE_ERR_BAD_PACKET,
+                    he_snapshot_store_restore(store, 0x1234, &restored, &ssl_ctx, NULL));
+}
+
+void test_store_fills_up(void) {
+  he_conn_export_Stub(fixture_he_conn_export);
+
+  for(uint64_t session = 1; session <= TEST_CAPACITY; session++) {
+    conn.session_id = session;
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_snapshot_store_save(store, &conn));
+  }
+
+  // Saving an existing session again replaces it
+  conn.session_id = 2;
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_snapshot_store_save(store, &conn));
+
+  conn.session_id = TEST_CAPACITY + 1;
+  TEST_ASSERT_EQUAL(HE_ERR_NO_MEMORY, he_snapshot_store_save(store, &conn));
+}
+
+void test_restore_past_taken_slots(void) {
+  he_conn_export_Stub(fixture_he_conn_export);
+  he_conn_import_Stub(fixture_he_conn_import);
+
+  for(uint64_t session = 1; session <= TEST_CAPACITY; session++) {
+    conn.session_id = session;
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_snapshot_store_save(store, &conn));
+  }
+
+  // Every session can be found regardless of which slots collided and were taken first
+  for(uint64_t session = 1; session <= TEST_CAPACITY; session++) {
+    TEST_ASSERT_EQUAL(HE_SUCCESS,
+                      he_snapshot_store_restore(store, session, &restored, &ssl_ctx, NULL));
+    TEST_ASSERT_EQUAL(session, restored.session_id);
+  }
+}
@@ -756,3 +756,213 @@ void test_is_server_cert_set(void) {
   ctx->server_cert = NULL;
   TEST_ASSERT_FALSE(he_ssl_ctx_is_server_cert_key_set(ctx));
 }
+
+void test_he_server_connect_generates_cookie_secret(void) {
+  uint8_t empty[HE_COOKIE_SECRET_LENGTH] = {0};
+  he_ssl_ctx_set_use_stateless_cookies(ctx3, true);
+
+  WOLFSSL_METHOD *my_method = (WOLFSSL_METHOD *)0xdeadbeef;
+  WOLFSSL_CTX *my_ctx = (WOLFSSL_CTX *)0xdeadbeef;
+  wolfDTLSv1_2_server_method_ExpectAndReturn(my_method);
+  wolfSSL_CTX_new_ExpectAndReturn(my_method, my_ctx);
+
+  wolfSSL_CTX_use_certificate_file_ExpectAndReturn(my_ctx, ctx3->server_cert, SSL_FILETYPE_PEM,
+                                                   SSL_SUCCESS);
+
+  wolfSSL_CTX_use_PrivateKey_file_ExpectAndReturn(my_ctx, ctx3->server_key, SSL_FILETYPE_PEM,
+                                                  SSL_SUCCESS);
+
+  wolfSSL_CTX_SetIORecv_Expect(my_ctx, he_wolf_dtls_read);
+  wolfSSL_CTX_SetIOSend_Expect(my_ctx, he_wolf_dtls_write);
+
+  wolfSSL_CTX_UseSecureRenegotiation_ExpectAndReturn(my_ctx, SSL_SUCCESS);
+
+  int res = he_ssl_ctx_start_server(ctx3);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+  TEST_ASSERT_TRUE(memcmp(empty, ctx3->cookie_secret, sizeof(empty)) != 0);
+  TEST_ASSERT_FALSE(ctx3->has_previous_cookie_secret);
+}
+
+void test_set_use_stateless_cookies(void) {
+  TEST_ASSERT_FALSE(he_ssl_ctx_get_use_stateless_cookies(ctx));
+
+  int res = he_ssl_ctx_set_use_stateless_cookies(ctx, true);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+  TEST_ASSERT_TRUE(he_ssl_ctx_get_use_stateless_cookies(ctx));
+
+  res = he_ssl_ctx_set_use_stateless_cookies(NULL, true);
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, res);
+}
+
+void test_set_mss_clamping(void) {
+  TEST_ASSERT_FALSE(he_ssl_ctx_is_mss_clamping_enabled(ctx));
+
+  int res = he_ssl_ctx_set_mss_clamping(ctx, true);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+  TEST_ASSERT_TRUE(he_ssl_ctx_is_mss_clamping_enabled(ctx));
+
+  res = he_ssl_ctx_set_mss_clamping(ctx, false);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+  TEST_ASSERT_FALSE(he_ssl_ctx_is_mss_clamping_enabled(ctx));
+
+  res = he_ssl_ctx_set_mss_clamping(NULL, true);
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, res);
+}
+
+void test_set_source_address_validation(void) {
+  TEST_ASSERT_FALSE(he_ssl_ctx_is_source_address_validation_enabled(ctx));
+
+  int res = he_ssl_ctx_set_source_address_validation(ctx, true);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+  TEST_ASSERT_TRUE(he_ssl_ctx_is_source_address_validation_enabled(ctx));
+
+  res = he_ssl_ctx_set_source_address_validation(ctx, false);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+  TEST_ASSERT_FALSE(he_ssl_ctx_is_source_address_validation_enabled(ctx));
+
+  res = he_ssl_ctx_set_source_address_validation(NULL, true);
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, res);
+}
+
+void test_set_outside_buffer_room(void) {
+  TEST_ASSERT_EQUAL(0, ctx->outside_headroom);
+  TEST_ASSERT_EQUAL(0, ctx->outside_tailroom);
+
+  int res = he_ssl_ctx_set_outside_buffer_room(ctx, 64, 32);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+  TEST_ASSERT_EQUAL(64, ctx->outside_headroom);
+  TEST_ASSERT_EQUAL(32, ctx->outside_tailroom);
+
+  res = he_ssl_ctx_set_outside_buffer_room(NULL, 64, 32);
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, res);
+}
+
+static he_return_code_t inside_write_gro_cb(he_conn_t *conn, const he_virtio_net_hdr_t *vnet_hdr,
+                                           const he_flow_info_t *flow, uint8_t *packet,
+                                           size_t length, void *context) {
+  return HE_SUCCESS;
+}
+
+void test_set_inside_write_gro_cb(void) {
+  TEST_ASSERT_FALSE(he_ssl_ctx_is_inside_write_gro_cb_set(ctx));
+  TEST_ASSERT_FALSE(he_ssl_ctx_is_inside_write_gro_cb_set(NULL));
+
+  he_ssl_ctx_set_inside_write_gro_cb(ctx, inside_write_gro_cb);
+  TEST_ASSERT_TRUE(he_ssl_ctx_is_inside_write_gro_cb_set(ctx));
+  TEST_ASSERT_EQUAL(inside_write_gro_cb, ctx->inside_write_gro_cb);
+}
+
+static he_return_code_t inside_write_flow_cb(he_conn_t *conn, const he_flow_info_t *flow,
+                                            uint8_t *packet, size_t length, void *context) {
+  return HE_SUCCESS;
+}
+
+void test_set_inside_write_flow_cb(void) {
+  TEST_ASSERT_FALSE(he_ssl_ctx_is_inside_write_flow_cb_set(ctx));
+  TEST_ASSERT_FALSE(he_ssl_ctx_is_inside_write_flow_cb_set(NULL));
+
+  he_ssl_ctx_set_inside_write_flow_cb(ctx, inside_write_flow_cb);
+  TEST_ASSERT_TRUE(he_ssl_ctx_is_inside_write_flow_cb_set(ctx));
+  TEST_ASSERT_EQUAL(inside_write_flow_cb, ctx->inside_write_flow_cb);
+}
+
+void test_set_inner_mtu(void) {
+  TEST_ASSERT_EQUAL(0, he_ssl_ctx_get_inner_mtu(ctx));
+
+  int res = he_ssl_ctx_set_inner_mtu(ctx, 9000);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+  TEST_ASSERT_EQUAL(9000, he_ssl_ctx_get_inner_mtu(ctx));
+
+  res = he_ssl_ctx_set_inner_mtu(ctx, HE_MAX_PMTU);
+  TEST_ASSERT_EQUAL(HE_ERR_INVALID_MTU_SIZE, res);
+
+  res = he_ssl_ctx_set_inner_mtu(ctx, HE_MAX_JUMBO_MTU + 1);
+  TEST_ASSERT_EQUAL(HE_ERR_INVALID_MTU_SIZE, res);
+  TEST_ASSERT_EQUAL(9000, he_ssl_ctx_get_inner_mtu(ctx));
+
+  res = he_ssl_ctx_set_inner_mtu(ctx, 0);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+  TEST_ASSERT_EQUAL(0, he_ssl_ctx_get_inner_mtu(ctx));
+
+  res = he_ssl_ctx_set_inner_mtu(NULL, 9000);
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, res);
+}
+
+void test_rotate_cookie_secret_not_enabled(void) {
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_ssl_ctx_rotate_cookie_secret(NULL));
+  TEST_ASSERT_EQUAL(HE_ERR_FAILED, he_ssl_ctx_rotate_cookie_secret(ctx));
+}
+
+void test_rotate_cookie_secret(void) {
+  uint8_t original[HE_COOKIE_SECRET_LENGTH] = {0};
+
+  TEST_ASSERT_EQUAL(0, wc_InitRng(&ctx->wolf_rng));
+  he_ssl_ctx_set_use_stateless_cookies(ctx, true);
+  memset(ctx->cookie_secret, 0xAB, sizeof(ctx->cookie_secret));
+  memcpy(original, ctx->cookie_secret, sizeof(original));
+
+  int res = he_ssl_ctx_rotate_cookie_secret(ctx);
+  TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+  TEST_ASSERT_TRUE(ctx->has_previous_cookie_secret);
+  TEST_ASSERT_EQUAL_MEMORY(original, ctx->previous_cookie_secret, sizeof(original));
+  TEST_ASSERT_TRUE(memcmp(original, ctx->cookie_secret, sizeof(original)) != 0);
+
+  wc_FreeRng(&ctx->wolf_rng);
+}
+
+void test_set_handoff_cb(void) {
+  TEST_ASSERT_FALSE(he_ssl_ctx_is_handoff_cb_set(ctx));
+  he_ssl_ctx_set_handoff_cb(ctx, handoff_cb);
+  TEST_ASSERT_TRUE(he_ssl_ctx_is_handoff_cb_set(ctx));
+  TEST_ASSERT_EQUAL(handoff_cb, ctx->handoff_cb);
+}
+
+void test_set_export_key_null(void) {
+  uint8_t key[HE_EXPORT_KEY_LENGTH] = {0};
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_ssl_ctx_set_export_key(NULL, key, sizeof(key)));
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_ssl_ctx_set_export_key(ctx, NULL, sizeof(key)));
+}
+
+void test_set_export_key_wrong_length(void) {
+  uint8_t key[HE_EXPORT_KEY_LENGTH] = {0};
+  TEST_ASSERT_EQUAL(HE_ERR_FAILED, he_ssl_ctx_set_export_key(ctx, key, sizeof(key) - 1));
+  TEST_ASSERT_FALSE(he_ssl_ctx_is_export_key_set(ctx));
+}
+
+void test_set_export_key(void) {
+  uint8_t key[HE_EXPORT_KEY_LENGTH];
+  memset(key, 0x5A, sizeof(key));
+
+  TEST_ASSERT_FALSE(he_ssl_ctx_is_export_key_set(ctx));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_ssl_ctx_set_export_key(ctx, key, sizeof(key)));
+  TEST_ASSERT_TRUE(he_ssl_ctx_is_export_key_set(ctx));
+  TEST_ASSERT_EQUAL_MEMORY(key, ctx->export_key, sizeof(key));
+}
+
+void test_set_hibernate_idle_time(void) {
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_ssl_ctx_set_hibernate_idle_time(NULL, 60000));
+  TEST_ASSERT_EQUAL(0, he_ssl_ctx_get_hibernate_idle_time(ctx));
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_ssl_ctx_set_hibernate_idle_time(ctx, 60000));
+  TEST_ASSERT_EQUAL(60000, he_ssl_ctx_get_hibernate_idle_time(ctx));
+}
+
+void test_set_timers(void) {
+  he_timers_t timers = {0};
+
+  TEST_ASSERT_FALSE(he_ssl_ctx_is_timers_set(ctx));
+  he_ssl_ctx_set_timers(ctx, &timers);
+  TEST_ASSERT_TRUE(he_ssl_ctx_is_timers_set(ctx));
+  TEST_ASSERT_EQUAL_PTR(&timers, ctx->timers);
+}
+
+void test_set_ip_pool(void) {
+  he_ip_pool_t pool = {0};
+
+  TEST_ASSERT_FALSE(he_ssl_ctx_is_ip_pool_set(ctx));
+  he_ssl_ctx_set_ip_pool(ctx, &pool);
+  TEST_ASSERT_TRUE(he_ssl_ctx_is_ip_pool_set(ctx));
+  TEST_ASSERT_EQUAL_PTR(&pool, ctx->ip_pool);
+
+  he_ssl_ctx_set_ip_pool(ctx, NULL);
+  TEST_ASSERT_FALSE(he_ssl_ctx_is_ip_pool_set(ctx));
+}
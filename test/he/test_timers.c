@@ -0,0 +1,311 @@
+/*
+ *  Copyright (C) 2021 Express VPN International Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <he.h>
+#include "unity.h"
+#include "test_defs.h"
+
+// Unit under test
+#include "timers.h"
+
+// Direct Includes for Utility Functions
+#include "memory.h"
+
+// Internal Mocks
+#include "mock_conn.h"
+#include "mock_clock.h"
+
+#define TEST_CONNS 8
+
+he_timers_t *timers;
+he_conn_t conns[TEST_CONNS];
+
+he_conn_t *nudged[TEST_CONNS * 4];
+uint64_t nudged_at[TEST_CONNS * 4];
+int nudge_count;
+uint64_t current_time;
+
+he_return_code_t fixture_he_conn_nudge(he_conn_t *conn, int numCalls) {
+  nudged[nudge_count] = conn;
+  nudged_at[nudge_count] = current_time;
+  nudge_count++;
+  return HE_SUCCESS;
+}
+
+// Helium's clock runs a long way behind the host's, which the wheel mustn't care about
+uint64_t fixture_he_internal_clock_ms(int numCalls) {
+  return current_time - 900;
+}
+
+static void advance_to(uint64_t now) {
+  current_time = now;
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_timers_advance(timers, now));
+}
+
+// Advances the wheel only when it asks to be, as an event loop would, until something is nudged
+static int run_to_next_nudge(void) {
+  int wakeups = 0;
+  int nudges = nudge_count;
+  while(nudge_count == nudges) {
+    uint64_t deadline = he_timers_next_deadline(timers);
+    TEST_ASSERT_NOT_EQUAL(HE_TIMERS_NO_DEADLINE, deadline);
+    TEST_ASSERT_TRUE(deadline >= current_time);
+    advance_to(deadline);
+    wakeups++;
+  }
+  return wakeups;
+}
+
+void setUp(void) {
+  memset(conns, 0, sizeof(conns));
+  nudge_count = 0;
+  current_time = 1000;
+  he_internal_clock_ms_Stub(fixture_he_internal_clock_ms);
+  timers = he_timers_create(1000);
+  he_conn_nudge_Stub(fixture_he_conn_nudge);
+}
+
+void tearDown(void) {
+  he_timers_destroy(timers);
+}
+
+void test_create(void) {
+  TEST_ASSERT_NOT_NULL(timers);
+  TEST_ASSERT_EQUAL(0, timers->pending);
+  TEST_ASSERT_EQUAL(HE_TIMERS_NO_DEADLINE, he_timers_next_deadline(timers));
+}
+
+void test_destroy_null(void) {
+  TEST_ASSERT_EQUAL(HE_SUCCESS, he_timers_destroy(NULL));
+}
+
+void test_advance_null(void) {
+  TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_timers_advance(NULL, 10));
+}
+
+void test_next_deadline_null(void) {
+  TEST_ASSERT_EQUAL(HE_TIMERS_NO_DEADLINE, he_timers_next_deadline(NULL));
+}
+
+void test_fires_on_time(void) {
+  he_internal_timers_schedule(timers, &conns[0].timer_node, 10);
+  TEST_ASSERT_EQUAL(1010, he_timers_next_deadline(timers));
+
+  advance_to(1009);
+  TEST_ASSERT_EQUAL(0, nudge_count);
+
+  advance_to(1010);
+  TEST_ASSERT_EQUAL(1, nudge_count);
+  TEST_ASSERT_EQUAL_PTR(&conns[0], nudged[0]);
+  TEST_ASSERT_EQUAL(0, timers->pending);
+  TEST_ASSERT_NULL(conns[0].timer_node.next);
+}
+
+void test_fires_once(void) {
+  he_internal_timers_schedule(timers, &conns[0].timer_node, 5);
+  advance_to(1100);
+  advance_to(1200);
+  TEST_ASSERT_EQUAL(1, nudge_count);
+}
+
+void test_zero_delay_fires_on_next_advance(void) {
+  he_internal_timers_schedule(timers, &conns[0].timer_node, 0);
+  advance_to(1000);
+  TEST_ASSERT_EQUAL(0, nudge_count);
+  advance_to(1001);
+  TEST_ASSERT_EQUAL(1, nudge_count);
+}
+
+void test_cancel(void) {
+  he_internal_timers_schedule(timers, &conns[0].timer_node, 10);
+  he_internal_timers_schedule(timers, &conns[1].timer_node, 10);
+  he_internal_timers_cancel(timers, &conns[0].timer_node);
+
+  // Cancelling twice is harmless
+  he_internal_timers_cancel(timers, &conns[0].timer_node);
+  TEST_ASSERT_EQUAL(1, timers->pending);
+
+  advance_to(2000);
+  TEST_ASSERT_EQUAL(1, nudge_count);
+  TEST_ASSERT_EQUAL_PTR(&conns[1], nudged[0]);
+}
+
+void test_reschedule_replaces(void) {
+  he_internal_timers_schedule(timers, &conns[0].timer_node, 10);
+  he_internal_timers_schedule(timers, &conns[0].timer_node, 500);
+  TEST_ASSERT_EQUAL(1, timers->pending);
+
+  advance_to(1499);
+  TEST_ASSERT_EQUAL(0, nudge_count);
+  advance_to(1500);
+  TEST_ASSERT_EQUAL(1, nudge_count);
+}
+
+void test_fires_in_order_across_levels(void) {
+  // One timer for each level of the wheel, scheduled out of order
+  int delays[] = {300000, 70, 5000, 3, 20000000};
+  for(int i = 0; i < 5; i++) {
+    he_internal_timers_schedule(timers, &conns[i].timer_node, delays[i]);
+  }
+
+  TEST_ASSERT_EQUAL(1003, he_timers_next_deadline(timers));
+
+  // Step through time a little at a time, as an event loop would
+  for(uint64_t now = 1000; now <= 1000 + 20000000; now += 1 + now / 1000) {
+    advance_to(now);
+  }
+  advance_to(1000 + 20000000);
+
+  TEST_ASSERT_EQUAL(5, nudge_count);
+  TEST_ASSERT_EQUAL_PTR(&conns[3], nudged[0]);
+  TEST_ASSERT_EQUAL_PTR(&conns[1], nudged[1]);
+  TEST_ASSERT_EQUAL_PTR(&conns[2], nudged[2]);
+  TEST_ASSERT_EQUAL_PTR(&conns[0], nudged[3]);
+  TEST_ASSERT_EQUAL_PTR(&conns[4], nudged[4]);
+}
+
+void test_exact_expiry_after_cascade(void) {
+  he_internal_timers_schedule(timers, &conns[0].timer_node, 12345);
+
+  advance_to(1000 + 12344);
+  TEST_ASSERT_EQUAL(0, nudge_count);
+  advance_to(1000 + 12345);
+  TEST_ASSERT_EQUAL(1, nudge_count);
+}
+
+void test_late_advance_fires_everything_due(void) {
+  for(int i = 0; i < TEST_CONNS; i++) {
+    he_internal_timers_schedule(timers, &conns[i].timer_node, 100 * (i + 1));
+  }
+
+  advance_to(1000 + 100 * TEST_CONNS);
+  TEST_ASSERT_EQUAL(TEST_CONNS, nudge_count);
+  TEST_ASSERT_EQUAL(HE_TIMERS_NO_DEADLINE, he_timers_next_deadline(timers));
+}
+
+void test_next_deadline_after_cascade(void) {
+  he_internal_timers_schedule(timers, &conns[0].timer_node, 5000);
+  he_internal_timers_schedule(timers, &conns[1].timer_node, 300000);
+
+  // Far off timers are moved closer on the way, costing at most a wake-up per level
+  TEST_ASSERT_LESS_OR_EQUAL(HE_TIMERS_LEVELS, run_to_next_nudge());
+  TEST_ASSERT_EQUAL(6000, current_time);
+  TEST_ASSERT_EQUAL_PTR(&conns[0], nudged[0]);
+
+  TEST_ASSERT_LESS_OR_EQUAL(HE_TIMERS_LEVELS, run_to_next_nudge());
+  TEST_ASSERT_EQUAL(301000, current_time);
+  TEST_ASSERT_EQUAL(HE_TIMERS_NO_DEADLINE, he_timers_next_deadline(timers));
+}
+
+void test_next_deadline_with_timer_a_turn_away(void) {
+  // Lands in the current slot of the second level, one whole turn of that level from now
+  he_internal_timers_schedule(timers, &conns[0].timer_node, 4090);
+  he_internal_timers_schedule(timers, &conns[1].timer_node, 100);
+
+  run_to_next_nudge();
+  TEST_ASSERT_EQUAL(1100, current_time);
+  TEST_ASSERT_EQUAL_PTR(&conns[1], nudged[0]);
+
+  run_to_next_nudge();
+  TEST_ASSERT_EQUAL(5090, current_time);
+  TEST_ASSERT_EQUAL_PTR(&conns[0], nudged[1]);
+}
+
+void test_next_deadline_ignores_how_many_timers_share_a_slot(void) {
+  // Every one of these lands in the same slot of the second level
+  for(int i = 0; i < TEST_CONNS; i++) {
+    he_internal_timers_schedule(timers, &conns[i].timer_node, 1000 + i);
+  }
+
+  // The slot is due to be moved down when the wheel reaches its first tick
+  TEST_ASSERT_EQUAL(1984, he_timers_next_deadline(timers));
+  advance_to(1984);
+  TEST_ASSERT_EQUAL(2000, he_timers_next_deadline(timers));
+  TEST_ASSERT_EQUAL(0, nudge_count);
+}
+
+void test_schedule_after_idle_wheel(void) {
+  advance_to(1000);
+  TEST_ASSERT_EQUAL(HE_TIMERS_NO_DEADLINE, he_timers_next_deadline(timers));
+
+  // Nothing was due, so the host didn't advance the wheel for a minute
+  current_time = 61000;
+  he_internal_timers_schedule(timers, &conns[0].timer_node, 100);
+
+  run_to_next_nudge();
+  TEST_ASSERT_EQUAL(61100, current_time);
+}
+
+void test_schedule_measures_from_now_between_advances(void) {
+  he_internal_timers_schedule(timers, &conns[0].timer_node, 1000);
+  advance_to(1200);
+
+  current_time = 1700;
+  he_internal_timers_schedule(timers, &conns[1].timer_node, 100);
+
+  run_to_next_nudge();
+  TEST_ASSERT_EQUAL(1800, current_time);
+  TEST_ASSERT_EQUAL_PTR(&conns[1], nudged[0]);
+}
+
+he_return_code_t fixture_reschedule_nudge(he_conn_t *conn, int numCalls) {
+  nudge_count++;
+  // Like a D/TLS retransmission backing off
+  if(nudge_count < 3) {
+    he_internal_timers_schedule(timers, &conn->timer_node, 100);
+  }
+  return HE_SUCCESS;
+}
+
+void test_nudge_can_reschedule(void) {
+  he_conn_nudge_Stub(fixture_reschedule_nudge);
+  he_internal_timers_schedule(timers, &conns[0].timer_node, 100);
+
+  advance_to(1100);
+  TEST_ASSERT_EQUAL(1, nudge_count);
+  advance_to(1200);
+  TEST_ASSERT_EQUAL(2, nudge_count);
+  advance_to(1300);
+  TEST_ASSERT_EQUAL(3, nudge_count);
+  TEST_ASSERT_EQUAL(0, timers->pending);
+}
+
+he_return_code_t fixture_cancelling_nudge(he_conn_t *conn, int numCalls) {
+  nudge_count++;
+  // As if the host destroyed another connection from a state callback
+  he_internal_timers_cancel(timers, &conns[1].timer_node);
+  return HE_SUCCESS;
+}
+
+void test_nudge_can_cancel_other_timers(void) {
+  he_conn_nudge_Stub(fixture_cancelling_nudge);
+  he_internal_timers_schedule(timers, &conns[0].timer_node, 10);
+  he_internal_timers_schedule(timers, &conns[1].timer_node, 10);
+
+  advance_to(1010);
+  TEST_ASSERT_EQUAL(1, nudge_count);
+  TEST_ASSERT_EQUAL(0, timers->pending);
+}
+
+void test_destroy_unlinks_pending_timers(void) {
+  he_internal_timers_schedule(timers, &conns[0].timer_node, 10);
+  he_timers_destroy(timers);
+  TEST_ASSERT_NULL(conns[0].timer_node.next);
+
+  timers = he_timers_create(0);
+}
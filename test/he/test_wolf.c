@@ -25,9 +25,11 @@
 
 // Direct Includes for Utility Functions
 #include "core.h"
+#include "metrics.h"
 
 // Internal Mocks
 #include "mock_plugin_chain.h"
+#include "mock_clock.h"
 
 uint8_t *packet = NULL;
 uint8_t *buffer = NULL;
@@ -96,9 +98,9 @@ void assert_standard_version(uint8_t write_buffer[]) {
 }
 
 void assert_standard_reserved_section(uint8_t write_buffer[]) {
-  TEST_ASSERT_EQUAL(0x00, conn->write_buffer[5]);
-  TEST_ASSERT_EQUAL(0x00, conn->write_buffer[6]);
-  TEST_ASSERT_EQUAL(0x00, conn->write_buffer[7]);
+  TEST_ASSERT_EQUAL(0x00, write_buffer[5]);
+  TEST_ASSERT_EQUAL(0x00, write_buffer[6]);
+  TEST_ASSERT_EQUAL(0x00, write_buffer[7]);
 }
 
 void setUp(void) {
@@ -122,7 +124,8 @@ void setUp(void) {
 
   write_callback_count = 0;
 
-  he_plugin_egress_IgnoreAndReturn(HE_SUCCESS);
+  he_plugin_egress_packet_IgnoreAndReturn(HE_SUCCESS);
+  he_internal_clock_ms_IgnoreAndReturn(1000);
 }
 
 void tearDown(void) {
@@ -163,6 +166,9 @@ void test_read_buffer_too_small(void) {
 }
 
 void test_write_create_packet(void) {
+  // The packet is written after the room left for plugins
+  uint8_t *written = &conn->write_buffer[HE_PLUGIN_HEADROOM];
+
   int res1 = he_wolf_dtls_write(ssl, (char *)packet, test_packet_size, conn);
 
   // Checks that the data written is what WolfSSL expects - Helium headers are extra and not covered
@@ -170,20 +176,23 @@ void test_write_create_packet(void) {
   TEST_ASSERT_EQUAL(test_packet_size, res1);
 
   // Test we have a valid helium header
-  assert_standard_header(conn->write_buffer);
-  assert_standard_version(conn->write_buffer);
-  assert_standard_reserved_section(conn->write_buffer);
+  assert_standard_header(written);
+  assert_standard_version(written);
+  assert_standard_reserved_section(written);
 
-  TEST_ASSERT_EQUAL(0x00, conn->write_buffer[4]);
-  TEST_ASSERT_EQUAL_MEMORY(&conn->session_id, &conn->write_buffer[8], sizeof(conn->session_id));
+  TEST_ASSERT_EQUAL(0x00, written[4]);
+  TEST_ASSERT_EQUAL_MEMORY(&conn->session_id, &written[8], sizeof(conn->session_id));
 
   // Test packet is unchanged
-  TEST_ASSERT_EQUAL_MEMORY(packet, conn->write_buffer + sizeof(he_wire_hdr_t), test_packet_size);
+  TEST_ASSERT_EQUAL_MEMORY(packet, written + sizeof(he_wire_hdr_t), test_packet_size);
 
   // Test that the callback is set correctly
   TEST_ASSERT_EQUAL(outside_write_test, conn->outside_write_cb);
 }
 void test_write_packet_too_big(void) {
+  // The packet is written after the room left for plugins
+  uint8_t *written = &conn->write_buffer[HE_PLUGIN_HEADROOM];
+
   size_t test_packet_size = 4000;
   int res1 = he_wolf_dtls_write(ssl, (char *)packet, test_packet_size, conn);
 
@@ -191,7 +200,42 @@ void test_write_packet_too_big(void) {
   TEST_ASSERT_EQUAL(WOLFSSL_CBIO_ERR_GENERAL, res1);
 
   // Ensure the write buffer wasn't touched
-  TEST_ASSERT_EQUAL(0, conn->write_buffer[0]);
+  TEST_ASSERT_EQUAL(0, written[0]);
+}
+
+static he_return_code_t prepend_egress(he_plugin_chain_t *chain, he_plugin_packet_t *packet,
+                                       int numCalls) {
+  TEST_ASSERT_EQUAL(HE_PLUGIN_HEADROOM, packet->headroom);
+  TEST_ASSERT_TRUE(packet->tailroom >= HE_PLUGIN_TAILROOM);
+
+  // Wrap the packet in four bytes of our own, without moving it
+  packet->data -= 4;
+  packet->headroom -= 4;
+  packet->length += 4;
+  memset(packet->data, 0xAB, 4);
+  return HE_SUCCESS;
+}
+
+static he_return_code_t outside_write_test_prepended(he_conn_t *conn1, uint8_t *packet1,
+                                                     size_t length1, void *context1) {
+  TEST_ASSERT_EQUAL_PTR(&conn->write_buffer[HE_PLUGIN_HEADROOM - 4], packet1);
+  TEST_ASSERT_EQUAL(test_packet_size + sizeof(he_wire_hdr_t) + 4, length1);
+  TEST_ASSERT_EQUAL_HEX8(0xAB, packet1[0]);
+  TEST_ASSERT_EQUAL_CHAR('H', packet1[4]);
+  TEST_ASSERT_EQUAL_MEMORY(packet, packet1 + 4 + sizeof(he_wire_hdr_t), test_packet_size);
+  write_callback_count++;
+  return HE_SUCCESS;
+}
+
+void test_write_plugin_prepends_in_place(void) {
+  he_plugin_egress_packet_StopIgnore();
+  he_plugin_egress_packet_Stub(prepend_egress);
+  conn->state = HE_STATE_ONLINE;
+  conn->outside_write_cb = outside_write_test_prepended;
+
+  int res1 = he_wolf_dtls_write(ssl, (char *)packet, test_packet_size, conn);
+  TEST_ASSERT_EQUAL(test_packet_size, res1);
+  TEST_ASSERT_EQUAL(1, write_callback_count);
 }
 
 void test_write_context_gets_passed(void) {
@@ -276,6 +320,9 @@ void test_internal_pkt_header_writer_pending_session(void) {
 }
 
 void test_write_dont_explode_if_not_write_cb_set(void) {
+  // The packet is written after the room left for plugins
+  uint8_t *written = &conn->write_buffer[HE_PLUGIN_HEADROOM];
+
   // Unset the callback
   conn->outside_write_cb = NULL;
 
@@ -286,21 +333,24 @@ void test_write_dont_explode_if_not_write_cb_set(void) {
   TEST_ASSERT_EQUAL(test_packet_size, res1);
 
   // Test we have a valid helium header
-  assert_standard_header(conn->write_buffer);
-  assert_standard_version(conn->write_buffer);
-  assert_standard_reserved_section(conn->write_buffer);
+  assert_standard_header(written);
+  assert_standard_version(written);
+  assert_standard_reserved_section(written);
 
-  TEST_ASSERT_EQUAL(0x00, conn->write_buffer[4]);
-  TEST_ASSERT_EQUAL_MEMORY(&conn->session_id, &conn->write_buffer[8], sizeof(conn->session_id));
+  TEST_ASSERT_EQUAL(0x00, written[4]);
+  TEST_ASSERT_EQUAL_MEMORY(&conn->session_id, &written[8], sizeof(conn->session_id));
 
   // Test packet is unchanged
-  TEST_ASSERT_EQUAL_MEMORY(packet, conn->write_buffer + sizeof(he_wire_hdr_t), test_packet_size);
+  TEST_ASSERT_EQUAL_MEMORY(packet, written + sizeof(he_wire_hdr_t), test_packet_size);
 
   // Test that the callback is set correctly
   TEST_ASSERT_NULL(conn->outside_write_cb);
 }
 
 void test_write_accepts_conn_version(void) {
+  // The packet is written after the room left for plugins
+  uint8_t *written = &conn->write_buffer[HE_PLUGIN_HEADROOM];
+
   conn->protocol_version.major_version = 0xFF;
   conn->protocol_version.minor_version = 0x99;
 
@@ -311,17 +361,17 @@ void test_write_accepts_conn_version(void) {
   TEST_ASSERT_EQUAL(test_packet_size, res1);
 
   // Test we have a valid helium header
-  assert_standard_header(conn->write_buffer);
-  assert_standard_reserved_section(conn->write_buffer);
+  assert_standard_header(written);
+  assert_standard_reserved_section(written);
 
-  TEST_ASSERT_EQUAL(0xFF, conn->write_buffer[2]);
-  TEST_ASSERT_EQUAL(0x99, conn->write_buffer[3]);
+  TEST_ASSERT_EQUAL(0xFF, written[2]);
+  TEST_ASSERT_EQUAL(0x99, written[3]);
 
-  TEST_ASSERT_EQUAL(0x00, conn->write_buffer[4]);
-  TEST_ASSERT_EQUAL_MEMORY(&conn->session_id, &conn->write_buffer[8], sizeof(conn->session_id));
+  TEST_ASSERT_EQUAL(0x00, written[4]);
+  TEST_ASSERT_EQUAL_MEMORY(&conn->session_id, &written[8], sizeof(conn->session_id));
 
   // Test packet is unchanged
-  TEST_ASSERT_EQUAL_MEMORY(packet, conn->write_buffer + sizeof(he_wire_hdr_t), test_packet_size);
+  TEST_ASSERT_EQUAL_MEMORY(packet, written + sizeof(he_wire_hdr_t), test_packet_size);
 }
 
 void test_aggressive_mode_is_off_write_callback_called_once_when_online(void) {
@@ -336,6 +386,8 @@ void test_aggressive_mode_is_off_write_callback_called_once_when_online(void) {
 
   // Test that the callback was triggered once
   TEST_ASSERT_EQUAL(1, write_callback_count);
+  TEST_ASSERT_EQUAL(1, conn->counters.outside_tx_packets);
+  TEST_ASSERT_EQUAL(test_packet_size + sizeof(he_wire_hdr_t), conn->counters.outside_tx_bytes);
 }
 
 void test_aggressive_mode_is_on_write_callback_called_three_times_when_online(void) {
@@ -350,6 +402,7 @@ void test_aggressive_mode_is_on_write_callback_called_three_times_when_online(vo
 
   // Test that the callback was triggered three times
   TEST_ASSERT_EQUAL(3, write_callback_count);
+  TEST_ASSERT_EQUAL(3, conn->counters.outside_tx_packets);
 }
 
 void test_aggressive_mode_on_before_online(void) {
@@ -363,9 +416,41 @@ void test_aggressive_mode_on_before_online(void) {
   TEST_ASSERT_EQUAL(3, write_callback_count);
 }
 
+void test_write_times_first_packet_of_flight(void) {
+  conn->state = HE_STATE_CONNECTING;
+  he_internal_clock_ms_StopIgnore();
+  he_internal_clock_ms_ExpectAndReturn(1234);
+
+  he_wolf_dtls_write(ssl, (char *)packet, test_packet_size, conn);
+  // Later packets of the same flight don't move the start time
+  he_wolf_dtls_write(ssl, (char *)packet, test_packet_size, conn);
+
+  TEST_ASSERT_EQUAL(1234, conn->flight_sent_ms);
+}
+
+void test_write_times_renegotiation_flight(void) {
+  conn->state = HE_STATE_ONLINE;
+  conn->renegotiation_in_progress = true;
+  he_internal_clock_ms_StopIgnore();
+  he_internal_clock_ms_ExpectAndReturn(1234);
+
+  he_wolf_dtls_write(ssl, (char *)packet, test_packet_size, conn);
+
+  TEST_ASSERT_EQUAL(1234, conn->flight_sent_ms);
+}
+
+void test_write_does_not_time_online_data(void) {
+  conn->state = HE_STATE_ONLINE;
+  he_internal_clock_ms_StopIgnore();
+
+  he_wolf_dtls_write(ssl, (char *)packet, test_packet_size, conn);
+
+  TEST_ASSERT_EQUAL(0, conn->flight_sent_ms);
+}
+
 void test_plugin_drop_results_in_no_write(void) {
-  he_plugin_egress_StopIgnore();
-  he_plugin_egress_ExpectAnyArgsAndReturn(HE_ERR_PLUGIN_DROP);
+  he_plugin_egress_packet_StopIgnore();
+  he_plugin_egress_packet_ExpectAnyArgsAndReturn(HE_ERR_PLUGIN_DROP);
 
   // Call a write
   he_return_code_t res2 = he_wolf_dtls_write(ssl, (char *)packet, test_packet_size, conn);
@@ -375,11 +460,14 @@ void test_plugin_drop_results_in_no_write(void) {
 
   // Test that the callback was triggered once
   TEST_ASSERT_EQUAL(0, write_callback_count);
+  TEST_ASSERT_EQUAL(0, conn->counters.outside_tx_packets);
+  TEST_ASSERT_EQUAL(HE_ERR_PLUGIN_DROP, HE_CONN_DROP_REASON(conn->counters.drops[0].value));
+  TEST_ASSERT_EQUAL(1, HE_CONN_DROP_COUNT(conn->counters.drops[0].value));
 }
 
 void test_plugin_error_results_in_no_write(void) {
-  he_plugin_egress_StopIgnore();
-  he_plugin_egress_ExpectAnyArgsAndReturn(HE_ERR_FAILED);
+  he_plugin_egress_packet_StopIgnore();
+  he_plugin_egress_packet_ExpectAnyArgsAndReturn(HE_ERR_FAILED);
 
   // Call a write
   he_return_code_t res2 = he_wolf_dtls_write(ssl, (char *)packet, test_packet_size, conn);
@@ -432,7 +520,9 @@ void test_tls_write_simple(void) {
 
   // Make sure it sent all the data
   TEST_ASSERT_EQUAL(test_packet_size, res1);
-  TEST_ASSERT_EQUAL_MEMORY(packet, &conn->write_buffer[0], test_packet_size);
+  TEST_ASSERT_EQUAL(1, conn->counters.outside_tx_packets);
+  TEST_ASSERT_EQUAL(test_packet_size, conn->counters.outside_tx_bytes);
+  TEST_ASSERT_EQUAL_MEMORY(packet, &conn->write_buffer[HE_PLUGIN_HEADROOM], test_packet_size);
 }
 
 void test_tls_write_attemps_lots_of_data_but_only_write_our_buffer_size(void) {
@@ -444,12 +534,12 @@ void test_tls_write_attemps_lots_of_data_but_only_write_our_buffer_size(void) {
 
   // Make sure it sent only HE_MAX_WIRE_MTU worth of data and told wolf just that many
   TEST_ASSERT_EQUAL(HE_MAX_WIRE_MTU, res1);
-  TEST_ASSERT_EQUAL_MEMORY(packet, &conn->write_buffer[0], HE_MAX_WIRE_MTU);
+  TEST_ASSERT_EQUAL_MEMORY(packet, &conn->write_buffer[HE_PLUGIN_HEADROOM], HE_MAX_WIRE_MTU);
 }
 
 void test_plugin_drop_results_in_no_write_tls(void) {
-  he_plugin_egress_StopIgnore();
-  he_plugin_egress_ExpectAnyArgsAndReturn(HE_ERR_PLUGIN_DROP);
+  he_plugin_egress_packet_StopIgnore();
+  he_plugin_egress_packet_ExpectAnyArgsAndReturn(HE_ERR_PLUGIN_DROP);
 
   // Call a write
   he_return_code_t res2 = he_wolf_tls_write(ssl, (char *)packet, test_packet_size, conn);
@@ -462,8 +552,8 @@ void test_plugin_drop_results_in_no_write_tls(void) {
 }
 
 void test_plugin_error_results_in_no_write_tls(void) {
-  he_plugin_egress_StopIgnore();
-  he_plugin_egress_ExpectAnyArgsAndReturn(HE_ERR_FAILED);
+  he_plugin_egress_packet_StopIgnore();
+  he_plugin_egress_packet_ExpectAnyArgsAndReturn(HE_ERR_FAILED);
 
   // Call a write
   he_return_code_t res2 = he_wolf_tls_write(ssl, (char *)packet, test_packet_size, conn);
@@ -33,4 +33,10 @@ int wc_InitRng(RNG *rng);
  */
 int wc_RNG_GenerateBlock(RNG *rng, byte *bytes, uint32_t sz);
 
+/**
+ *  This function should NEVER be defined and only used in test files by
+ *  #include "mock_fake_rng.h"
+ */
+int wc_FreeRng(RNG *rng);
+
 #endif
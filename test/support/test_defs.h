@@ -92,4 +92,9 @@ he_return_code_t pop_network_config_cb(he_conn_t *conn, he_network_config_ipv4_t
   return HE_SUCCESS;
 }
 
+he_return_code_t handoff_cb(he_conn_t *conn, void *context) {
+  call_counter++;
+  return HE_SUCCESS;
+}
+
 #endif  // HE_TEST_DEFS
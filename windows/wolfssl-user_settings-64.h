@@ -53,8 +53,11 @@
 #undef  WOLFSSL_DTLS
 #define WOLFSSL_DTLS
 
-#undef  SINGLE_THREADED
-#define SINGLE_THREADED
+#undef  WOLFSSL_SESSION_EXPORT
+#define WOLFSSL_SESSION_EXPORT
+
+#undef  WOLFSSL_DTLS_DROP_STATS
+#define WOLFSSL_DTLS_DROP_STATS
 
 #undef  HAVE_THREAD_LS
 #define HAVE_THREAD_LS